@@ -0,0 +1,80 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_BENCHMARKS_BENCHMARK_UTIL_H_
+#define REVERB_CC_BENCHMARKS_BENCHMARK_UTIL_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+
+namespace deepmind {
+namespace reverb {
+namespace benchmarks {
+
+// Records the latency of the operations of one benchmark thread and reports
+// their percentiles as counters of the benchmark. The counters are averaged
+// over the threads of the benchmark.
+//
+// Usage:
+//
+//   LatencyRecorder latencies;
+//   for (auto _ : state) {
+//     auto start = latencies.Start();
+//     ...
+//     latencies.Stop(start);
+//   }
+//   latencies.Report(state);
+//
+class LatencyRecorder {
+ public:
+  absl::Time Start() const { return absl::Now(); }
+
+  void Stop(absl::Time start) {
+    latencies_us_.push_back(absl::ToDoubleMicroseconds(absl::Now() - start));
+  }
+
+  // Adds the counters `p50_us`, `p90_us` and `p99_us` to `state`. No counters
+  // are added if no latencies have been recorded.
+  void Report(benchmark::State& state) {
+    if (latencies_us_.empty()) return;
+    std::sort(latencies_us_.begin(), latencies_us_.end());
+    state.counters["p50_us"] = Counter(Percentile(0.50));
+    state.counters["p90_us"] = Counter(Percentile(0.90));
+    state.counters["p99_us"] = Counter(Percentile(0.99));
+  }
+
+ private:
+  static benchmark::Counter Counter(double value) {
+    return benchmark::Counter(value, benchmark::Counter::kAvgThreads);
+  }
+
+  // Assumes that `latencies_us_` is sorted.
+  double Percentile(double p) const {
+    auto index = static_cast<int64_t>(p * (latencies_us_.size() - 1));
+    return latencies_us_[index];
+  }
+
+  std::vector<double> latencies_us_;
+};
+
+}  // namespace benchmarks
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_BENCHMARKS_BENCHMARK_UTIL_H_
@@ -0,0 +1,138 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Cost of the `IntrusiveHeap` operations as a function of the arity and the
+// number of elements held by the heap. Run with:
+//
+//   bazel run -c opt //reverb/cc/benchmarks:intrusive_heap_benchmark
+//
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "absl/random/random.h"
+#include "reverb/cc/support/intrusive_heap.h"
+
+namespace deepmind {
+namespace reverb {
+namespace benchmarks {
+namespace {
+
+// Same size and ordering as the entries of a priority based remover.
+struct Node {
+  double priority;
+  uint64_t update_number;
+  IntrusiveHeapLink heap;
+};
+
+struct NodeLess {
+  bool operator()(const Node* a, const Node* b) const {
+    return a->priority < b->priority ||
+           (a->priority == b->priority && a->update_number < b->update_number);
+  }
+};
+
+template <size_t Arity>
+using NodeHeap =
+    IntrusiveHeap<Node, NodeLess, DefaultIntrusiveHeapLinkAccess<Node>,
+                  std::allocator<Node*>, Arity>;
+
+// Heap of `num_nodes` nodes with random priorities.
+template <size_t Arity>
+struct FilledHeap {
+  explicit FilledHeap(int64_t num_nodes) : nodes(num_nodes) {
+    heap.reserve(num_nodes);
+    for (int64_t i = 0; i < num_nodes; i++) {
+      nodes[i].priority = absl::Uniform(gen, 0.0, 1.0);
+      nodes[i].update_number = i;
+      heap.Push(&nodes[i]);
+    }
+  }
+
+  absl::BitGen gen;
+  std::vector<Node> nodes;
+  NodeHeap<Arity> heap;
+};
+
+// Pops the top node and pushes it back with a new priority, which is what
+// evicting the lowest priority item and inserting a new one does.
+template <size_t Arity>
+void BM_PopAndPush(benchmark::State& state) {
+  FilledHeap<Arity> filled(state.range(0));
+  uint64_t update_number = state.range(0);
+  for (auto _ : state) {
+    Node* node = filled.heap.Pop();
+    node->priority = absl::Uniform(filled.gen, 0.0, 1.0);
+    node->update_number = update_number++;
+    filled.heap.Push(node);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// Removes a random node and pushes it back with a new priority.
+template <size_t Arity>
+void BM_RemoveAndPush(benchmark::State& state) {
+  FilledHeap<Arity> filled(state.range(0));
+  uint64_t update_number = state.range(0);
+  for (auto _ : state) {
+    Node* node = &filled.nodes[absl::Uniform<int64_t>(filled.gen, 0,
+                                                      filled.nodes.size())];
+    filled.heap.Remove(node);
+    node->priority = absl::Uniform(filled.gen, 0.0, 1.0);
+    node->update_number = update_number++;
+    filled.heap.Push(node);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// Changes the priority of a random node.
+template <size_t Arity>
+void BM_Adjust(benchmark::State& state) {
+  FilledHeap<Arity> filled(state.range(0));
+  uint64_t update_number = state.range(0);
+  for (auto _ : state) {
+    Node* node = &filled.nodes[absl::Uniform<int64_t>(filled.gen, 0,
+                                                      filled.nodes.size())];
+    node->priority = absl::Uniform(filled.gen, 0.0, 1.0);
+    node->update_number = update_number++;
+    filled.heap.Adjust(node);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// Registers `benchmark` for arities 2, 4 and 8 with 1K to 10M nodes.
+#define REVERB_HEAP_BENCHMARK(benchmark) \
+  BENCHMARK_TEMPLATE(benchmark, 2)         \
+      ->RangeMultiplier(10)                \
+      ->Range(1000, 10000000);             \
+  BENCHMARK_TEMPLATE(benchmark, 4)         \
+      ->RangeMultiplier(10)                \
+      ->Range(1000, 10000000);             \
+  BENCHMARK_TEMPLATE(benchmark, 8)         \
+      ->RangeMultiplier(10)                \
+      ->Range(1000, 10000000)
+
+REVERB_HEAP_BENCHMARK(BM_PopAndPush);
+REVERB_HEAP_BENCHMARK(BM_RemoveAndPush);
+REVERB_HEAP_BENCHMARK(BM_Adjust);
+
+#undef REVERB_HEAP_BENCHMARK
+
+}  // namespace
+}  // namespace benchmarks
+}  // namespace reverb
+}  // namespace deepmind
@@ -0,0 +1,155 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Cost of the `ItemSelector` operations as a function of the number of items
+// held by the selector. Run with:
+//
+//   bazel run -c opt //reverb/cc/benchmarks:selector_benchmark
+//
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "absl/memory/memory.h"
+#include "absl/random/random.h"
+#include "reverb/cc/platform/logging.h"
+#include "reverb/cc/selectors/fifo.h"
+#include "reverb/cc/selectors/heap.h"
+#include "reverb/cc/selectors/interface.h"
+#include "reverb/cc/selectors/lifo.h"
+#include "reverb/cc/selectors/prioritized.h"
+#include "reverb/cc/selectors/rank_based.h"
+#include "reverb/cc/selectors/uniform.h"
+
+namespace deepmind {
+namespace reverb {
+namespace benchmarks {
+namespace {
+
+using SelectorFactory = std::function<std::unique_ptr<ItemSelector>()>;
+
+constexpr int kSampleBatchSize = 64;
+
+std::unique_ptr<ItemSelector> MakeFilledSelector(const SelectorFactory& factory,
+                                                 int64_t num_items) {
+  auto selector = factory();
+  absl::BitGen gen;
+  for (int64_t key = 0; key < num_items; key++) {
+    REVERB_CHECK(selector->Insert(key, absl::Uniform(gen, 0.0, 1.0)).ok());
+  }
+  return selector;
+}
+
+// Deletes the oldest item and inserts a new one under its key, which keeps the
+// selector at its initial size. Keys are reused the way `Table` reuses the
+// slots of deleted items since some selectors only support keys below 2^32.
+void BM_InsertAndDelete(benchmark::State& state,
+                        const SelectorFactory& factory) {
+  const int64_t num_items = state.range(0);
+  auto selector = MakeFilledSelector(factory, num_items);
+  absl::BitGen gen;
+  int64_t i = 0;
+  for (auto _ : state) {
+    const int64_t key = i++ % num_items;
+    REVERB_CHECK(selector->Delete(key).ok());
+    REVERB_CHECK(selector->Insert(key, absl::Uniform(gen, 0.0, 1.0)).ok());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+void BM_Update(benchmark::State& state, const SelectorFactory& factory) {
+  const int64_t num_items = state.range(0);
+  auto selector = MakeFilledSelector(factory, num_items);
+  absl::BitGen gen;
+  for (auto _ : state) {
+    REVERB_CHECK(selector
+                     ->Update(absl::Uniform<int64_t>(gen, 0, num_items),
+                              absl::Uniform(gen, 0.0, 1.0))
+                     .ok());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+void BM_Sample(benchmark::State& state, const SelectorFactory& factory) {
+  auto selector = MakeFilledSelector(factory, state.range(0));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(selector->Sample());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+void BM_SampleBatch(benchmark::State& state, const SelectorFactory& factory) {
+  auto selector = MakeFilledSelector(factory, state.range(0));
+  std::vector<ItemSelector::KeyWithProbability> samples;
+  for (auto _ : state) {
+    samples.clear();
+    selector->SampleBatch(kSampleBatchSize, &samples);
+    benchmark::DoNotOptimize(samples.data());
+  }
+  state.SetItemsProcessed(state.iterations() * kSampleBatchSize);
+}
+
+std::unique_ptr<ItemSelector> MakeUniform() {
+  return absl::make_unique<UniformSelector>();
+}
+std::unique_ptr<ItemSelector> MakeFifo() {
+  return absl::make_unique<FifoSelector>();
+}
+std::unique_ptr<ItemSelector> MakeLifo() {
+  return absl::make_unique<LifoSelector>();
+}
+std::unique_ptr<ItemSelector> MakePrioritized() {
+  return absl::make_unique<PrioritizedSelector>(0.8);
+}
+std::unique_ptr<ItemSelector> MakeMinHeap() {
+  return absl::make_unique<HeapSelector>(/*min_heap=*/true);
+}
+std::unique_ptr<ItemSelector> MakeRankBased() {
+  return absl::make_unique<RankBasedSelector>(0.8);
+}
+
+// Registers `benchmark` for every selector with 1K to 10M items.
+#define REVERB_SELECTOR_BENCHMARK(benchmark)                          \
+  BENCHMARK_CAPTURE(benchmark, uniform, MakeUniform)                  \
+      ->RangeMultiplier(10)                                           \
+      ->Range(1000, 10000000);                                        \
+  BENCHMARK_CAPTURE(benchmark, fifo, MakeFifo)                        \
+      ->RangeMultiplier(10)                                           \
+      ->Range(1000, 10000000);                                        \
+  BENCHMARK_CAPTURE(benchmark, lifo, MakeLifo)                        \
+      ->RangeMultiplier(10)                                           \
+      ->Range(1000, 10000000);                                        \
+  BENCHMARK_CAPTURE(benchmark, prioritized, MakePrioritized)          \
+      ->RangeMultiplier(10)                                           \
+      ->Range(1000, 10000000);                                        \
+  BENCHMARK_CAPTURE(benchmark, min_heap, MakeMinHeap)                 \
+      ->RangeMultiplier(10)                                           \
+      ->Range(1000, 10000000);                                        \
+  BENCHMARK_CAPTURE(benchmark, rank_based, MakeRankBased)             \
+      ->RangeMultiplier(10)                                           \
+      ->Range(1000, 10000000)
+
+REVERB_SELECTOR_BENCHMARK(BM_InsertAndDelete);
+REVERB_SELECTOR_BENCHMARK(BM_Update);
+REVERB_SELECTOR_BENCHMARK(BM_Sample);
+REVERB_SELECTOR_BENCHMARK(BM_SampleBatch);
+
+#undef REVERB_SELECTOR_BENCHMARK
+
+}  // namespace
+}  // namespace benchmarks
+}  // namespace reverb
+}  // namespace deepmind
@@ -0,0 +1,259 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Round trips of `InsertStream` and `SampleStream` through a server running in
+// the same process. The clients connect to the server over a gRPC channel
+// (rather than through `Server::InProcessClient`) so serialization and the
+// network stack are included in the measurements. Run with:
+//
+//   bazel run -c opt //reverb/cc/benchmarks:server_benchmark
+//
+#include <algorithm>
+#include <cfloat>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "grpcpp/support/channel_arguments.h"
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "absl/types/optional.h"
+#include "reverb/cc/benchmarks/benchmark_util.h"
+#include "reverb/cc/platform/grpc_utils.h"
+#include "reverb/cc/platform/logging.h"
+#include "reverb/cc/platform/net.h"
+#include "reverb/cc/platform/server.h"
+#include "reverb/cc/platform/status_macros.h"
+#include "reverb/cc/platform/thread.h"
+#include "reverb/cc/rate_limiter.h"
+#include "reverb/cc/reverb_service.grpc.pb.h"
+#include "reverb/cc/sampler.h"
+#include "reverb/cc/selectors/fifo.h"
+#include "reverb/cc/selectors/uniform.h"
+#include "reverb/cc/table.h"
+#include "reverb/cc/trajectory_writer.h"
+#include "tensorflow/core/framework/tensor.h"
+
+namespace deepmind {
+namespace reverb {
+namespace benchmarks {
+namespace {
+
+constexpr char kTable[] = "dist";
+constexpr int64_t kMaxSize = 10000;
+constexpr int kNumPrefilledItems = 1000;
+
+// A server with a single uniform table and a gRPC stub connected to it.
+struct ServerAndStub {
+  std::unique_ptr<Server> server;
+  std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface> stub;
+};
+
+ServerAndStub StartServerAndStub(const ServerOptions& options = {}) {
+  ServerAndStub result;
+  int port = internal::PickUnusedPortOrDie();
+  REVERB_CHECK(
+      StartServer({std::make_shared<Table>(
+                      kTable, std::make_shared<UniformSelector>(),
+                      std::make_shared<FifoSelector>(), kMaxSize,
+                      /*max_times_sampled=*/0,
+                      std::make_shared<RateLimiter>(1.0, 1, -DBL_MAX, DBL_MAX))},
+                  port, /*checkpointer=*/nullptr, options, &result.server)
+          .ok());
+
+  grpc::ChannelArguments arguments;
+  arguments.SetMaxReceiveMessageSize(-1);
+  arguments.SetMaxSendMessageSize(-1);
+  result.stub = /* grpc_gen:: */ReverbService::NewStub(CreateCustomGrpcChannel(
+      absl::StrCat("localhost:", port), MakeChannelCredentials(), arguments));
+  return result;
+}
+
+tensorflow::Tensor MakeStep(int64_t num_elements) {
+  tensorflow::Tensor tensor(tensorflow::DT_FLOAT, {num_elements});
+  auto flat = tensor.flat<float>();
+  for (int64_t i = 0; i < num_elements; i++) {
+    flat(i) = i % 100;
+  }
+  return tensor;
+}
+
+// Appends `step` and creates an item of it.
+absl::Status WriteItem(TrajectoryWriter* writer,
+                       const tensorflow::Tensor& step) {
+  std::vector<absl::optional<std::weak_ptr<CellRef>>> refs;
+  REVERB_RETURN_IF_ERROR(writer->Append({step}, &refs));
+  return writer->CreateItem(kTable, 1.0,
+                            {TrajectoryColumn({refs[0].value()},
+                                              /*squeeze=*/false)});
+}
+
+TrajectoryWriter::Options MakeWriterOptions() {
+  TrajectoryWriter::Options options;
+  options.max_chunk_length = 1;
+  options.num_keep_alive_refs = 1;
+  return options;
+}
+
+// Arguments: {elements per step, items in flight}.
+//
+// Each iteration writes an item of one step and then waits until no more than
+// `items in flight` items remain unconfirmed. With 0 items in flight the
+// latency is that of a complete round trip.
+void BM_InsertStream(benchmark::State& state) {
+  const int64_t num_elements = state.range(0);
+  const int max_in_flight = state.range(1);
+  auto server = StartServerAndStub();
+  TrajectoryWriter writer(server.stub, MakeWriterOptions());
+  tensorflow::Tensor step = MakeStep(num_elements);
+
+  LatencyRecorder latencies;
+  for (auto _ : state) {
+    auto start = latencies.Start();
+    auto status = WriteItem(&writer, step);
+    if (status.ok()) status = writer.Flush(max_in_flight);
+    latencies.Stop(start);
+    if (!status.ok()) {
+      state.SkipWithError(status.ToString().c_str());
+      break;
+    }
+  }
+  REVERB_CHECK(writer.Flush().ok());
+
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * step.TotalBytes());
+  latencies.Report(state);
+}
+BENCHMARK(BM_InsertStream)
+    ->ArgNames({"elements", "in_flight"})
+    ->ArgsProduct({{1 << 4, 1 << 12, 1 << 18}, {0, 64}})
+    ->UseRealTime();
+
+// Arguments: {elements per step, number of sampler workers}.
+void BM_SampleStream(benchmark::State& state) {
+  const int64_t num_elements = state.range(0);
+  auto server = StartServerAndStub();
+  tensorflow::Tensor step = MakeStep(num_elements);
+  {
+    TrajectoryWriter writer(server.stub, MakeWriterOptions());
+    for (int i = 0; i < kNumPrefilledItems; i++) {
+      REVERB_CHECK(WriteItem(&writer, step).ok());
+    }
+    REVERB_CHECK(writer.Flush().ok());
+  }
+
+  Sampler::Options options;
+  options.num_workers = state.range(1);
+  Sampler sampler(server.stub, kTable, options);
+
+  LatencyRecorder latencies;
+  std::vector<tensorflow::Tensor> data;
+  for (auto _ : state) {
+    auto start = latencies.Start();
+    auto status = sampler.GetNextTrajectory(&data);
+    latencies.Stop(start);
+    if (!status.ok()) {
+      state.SkipWithError(status.ToString().c_str());
+      break;
+    }
+  }
+  sampler.Close();
+
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * step.TotalBytes());
+  latencies.Report(state);
+}
+BENCHMARK(BM_SampleStream)
+    ->ArgNames({"elements", "workers"})
+    ->ArgsProduct({{1 << 4, 1 << 12, 1 << 18}, {1, 4}})
+    ->UseRealTime();
+
+// Number of threads of the process as reported by `/proc/self/status`.
+int64_t NumThreads() {
+  std::ifstream status("/proc/self/status");
+  std::string field;
+  while (status >> field) {
+    if (field == "Threads:") {
+      int64_t threads = 0;
+      status >> threads;
+      return threads;
+    }
+  }
+  return 0;
+}
+
+constexpr int kItemsPerStream = 100;
+
+// Arguments: {use_callback_service, concurrent streams}.
+//
+// Compares the callback service with the synchronous service (see
+// `ServerOptions::use_callback_service`). Each iteration writes
+// `kItemsPerStream` items on each of the streams concurrently, with up to 64
+// items in flight per stream. Besides the throughput, the number of threads of
+// the process while all the streams are open is reported as `threads`. The
+// client threads are the same in both configurations so the difference is
+// that of the server.
+void BM_ConcurrentInsertStreams(benchmark::State& state) {
+  ServerOptions options;
+  options.use_callback_service = state.range(0) != 0;
+  const int num_streams = state.range(1);
+  auto server = StartServerAndStub(options);
+  tensorflow::Tensor step = MakeStep(1 << 4);
+
+  std::vector<std::unique_ptr<TrajectoryWriter>> writers;
+  for (int i = 0; i < num_streams; i++) {
+    writers.push_back(
+        std::make_unique<TrajectoryWriter>(server.stub, MakeWriterOptions()));
+  }
+
+  int64_t max_threads = 0;
+  for (auto _ : state) {
+    std::vector<absl::Status> statuses(num_streams);
+    std::vector<std::unique_ptr<internal::Thread>> threads;
+    for (int i = 0; i < num_streams; i++) {
+      threads.push_back(internal::StartThread("Writer", [&, i] {
+        for (int j = 0; j < kItemsPerStream && statuses[i].ok(); j++) {
+          statuses[i] = WriteItem(writers[i].get(), step);
+          if (statuses[i].ok()) statuses[i] = writers[i]->Flush(64);
+        }
+        if (statuses[i].ok()) statuses[i] = writers[i]->Flush();
+      }));
+    }
+    threads.clear();
+
+    // The streams remain open between iterations.
+    max_threads = std::max(max_threads, NumThreads());
+    auto failed = std::find_if(statuses.begin(), statuses.end(),
+                               [](const auto& s) { return !s.ok(); });
+    if (failed != statuses.end()) {
+      state.SkipWithError(failed->ToString().c_str());
+      break;
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations() * num_streams * kItemsPerStream);
+  state.counters["threads"] = max_threads;
+}
+BENCHMARK(BM_ConcurrentInsertStreams)
+    ->ArgNames({"callback", "streams"})
+    ->ArgsProduct({{0, 1}, {1, 16, 64, 256}})
+    ->UseRealTime();
+
+}  // namespace
+}  // namespace benchmarks
+}  // namespace reverb
+}  // namespace deepmind
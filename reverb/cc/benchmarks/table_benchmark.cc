@@ -0,0 +1,380 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Throughput and latency of the `Table` operations when called concurrently
+// from several threads. Run with:
+//
+//   bazel run -c opt //reverb/cc/benchmarks:table_benchmark
+//
+#include <unistd.h>
+
+#include <cfloat>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "absl/random/random.h"
+#include "absl/status/status.h"
+#include "absl/time/time.h"
+#include "reverb/cc/benchmarks/benchmark_util.h"
+#include "reverb/cc/chunk_store.h"
+#include "reverb/cc/platform/logging.h"
+#include "reverb/cc/rate_limiter.h"
+#include "reverb/cc/schema.pb.h"
+#include "reverb/cc/selectors/fifo.h"
+#include "reverb/cc/selectors/interface.h"
+#include "reverb/cc/selectors/prioritized.h"
+#include "reverb/cc/selectors/uniform.h"
+#include "reverb/cc/platform/hash_map.h"
+#include "reverb/cc/table.h"
+#include "reverb/cc/table_extensions/base.h"
+#include "reverb/cc/testing/proto_test_util.h"
+
+namespace deepmind {
+namespace reverb {
+namespace benchmarks {
+namespace {
+
+constexpr int64_t kMaxSize = 1000000;
+constexpr int64_t kNumPrefilledItems = 100000;
+
+// Shared by the threads of the running benchmark. Created by thread 0 before
+// the timed loop and destroyed by it afterwards. The start and stop barriers
+// of the timed loop keep the other threads from seeing it in between.
+std::shared_ptr<Table> shared_table;
+
+std::shared_ptr<Table> MakeTable(std::shared_ptr<ItemSelector> sampler) {
+  return std::make_shared<Table>(
+      "dist", std::move(sampler), std::make_shared<FifoSelector>(), kMaxSize,
+      /*max_times_sampled=*/0,
+      std::make_shared<RateLimiter>(1.0, 1, -DBL_MAX, DBL_MAX));
+}
+
+// Key of the `i`:th item inserted by the calling thread. The keys of the
+// threads never collide.
+uint64_t MakeKey(const benchmark::State& state, int64_t i) {
+  return (static_cast<uint64_t>(state.thread_index()) << 40) | i;
+}
+
+// Item of a single chunk. The chunk is shared by all items so only the
+// cost of the table operations is measured.
+TableItem MakeItem(uint64_t key, double priority,
+                   const std::shared_ptr<ChunkStore::Chunk>& chunk) {
+  TableItem item;
+  item.item = testing::MakePrioritizedItem(key, priority, {chunk->data()});
+  item.chunks.push_back(chunk);
+  return item;
+}
+
+std::shared_ptr<ChunkStore::Chunk> MakeChunk() {
+  return std::make_shared<ChunkStore::Chunk>(testing::MakeChunkData(
+      1, testing::MakeSequenceRange(/*episode_id=*/1, 0, 99)));
+}
+
+void Prefill(Table* table, const std::shared_ptr<ChunkStore::Chunk>& chunk) {
+  absl::BitGen gen;
+  for (int64_t i = 0; i < kNumPrefilledItems; i++) {
+    // Keys of thread 0 start at 0, so these start right above them.
+    REVERB_CHECK(table
+                     ->InsertOrAssign(MakeItem((1ULL << 60) | i,
+                                               absl::Uniform(gen, 0.0, 1.0),
+                                               chunk))
+                     .ok());
+  }
+}
+
+void BM_InsertOrAssign(benchmark::State& state) {
+  auto chunk = MakeChunk();
+  if (state.thread_index() == 0) {
+    shared_table = MakeTable(std::make_shared<UniformSelector>());
+  }
+
+  absl::BitGen gen;
+  LatencyRecorder latencies;
+  int64_t i = 0;
+  for (auto _ : state) {
+    TableItem item = MakeItem(MakeKey(state, i++),
+                              absl::Uniform(gen, 0.0, 1.0), chunk);
+    auto start = latencies.Start();
+    auto status = shared_table->InsertOrAssign(std::move(item));
+    latencies.Stop(start);
+    if (!status.ok()) {
+      state.SkipWithError(status.ToString().c_str());
+      break;
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * chunk->data().ByteSizeLong());
+  latencies.Report(state);
+  if (state.thread_index() == 0) {
+    shared_table = nullptr;
+  }
+}
+BENCHMARK(BM_InsertOrAssign)->ThreadRange(1, 16)->UseRealTime();
+
+// Arguments: {batch size}.
+void BM_SampleFlexibleBatch(benchmark::State& state) {
+  const int batch_size = state.range(0);
+  auto chunk = MakeChunk();
+  if (state.thread_index() == 0) {
+    shared_table = MakeTable(std::make_shared<UniformSelector>());
+    Prefill(shared_table.get(), chunk);
+  }
+
+  LatencyRecorder latencies;
+  std::vector<Table::SampledItem> items;
+  int64_t num_items = 0;
+  for (auto _ : state) {
+    items.clear();
+    auto start = latencies.Start();
+    auto status = shared_table->SampleFlexibleBatch(&items, batch_size);
+    latencies.Stop(start);
+    if (!status.ok()) {
+      state.SkipWithError(status.ToString().c_str());
+      break;
+    }
+    num_items += items.size();
+  }
+
+  state.SetItemsProcessed(num_items);
+  state.SetBytesProcessed(num_items * chunk->data().ByteSizeLong());
+  latencies.Report(state);
+  if (state.thread_index() == 0) {
+    shared_table = nullptr;
+  }
+}
+BENCHMARK(BM_SampleFlexibleBatch)
+    ->ArgNames({"batch_size"})
+    ->RangeMultiplier(8)
+    ->Range(1, 512)
+    ->ThreadRange(1, 16)
+    ->UseRealTime();
+
+// Arguments: {number of updates per call}.
+void BM_MutateItems(benchmark::State& state) {
+  const int num_updates = state.range(0);
+  auto chunk = MakeChunk();
+  if (state.thread_index() == 0) {
+    shared_table = MakeTable(std::make_shared<PrioritizedSelector>(0.8));
+    Prefill(shared_table.get(), chunk);
+  }
+
+  absl::BitGen gen;
+  LatencyRecorder latencies;
+  std::vector<KeyWithPriority> updates(num_updates);
+  for (auto _ : state) {
+    for (auto& update : updates) {
+      update.set_key((1ULL << 60) |
+                     absl::Uniform<int64_t>(gen, 0, kNumPrefilledItems));
+      update.set_priority(absl::Uniform(gen, 0.0, 1.0));
+    }
+    auto start = latencies.Start();
+    auto status = shared_table->MutateItems(updates, {});
+    latencies.Stop(start);
+    if (!status.ok()) {
+      state.SkipWithError(status.ToString().c_str());
+      break;
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations() * num_updates);
+  latencies.Report(state);
+  if (state.thread_index() == 0) {
+    shared_table = nullptr;
+  }
+}
+BENCHMARK(BM_MutateItems)
+    ->ArgNames({"updates"})
+    ->RangeMultiplier(8)
+    ->Range(1, 512)
+    ->ThreadRange(1, 16)
+    ->UseRealTime();
+
+// Wraps a selector of type `T` but reports `SelectorKind::kGeneric`, so the
+// table calls it through the `ItemSelector` interface. Calls are forwarded
+// directly to the (final) wrapped selector, so the difference from using `T`
+// itself is the cost of the virtual dispatch the table avoids for `T`.
+template <typename T>
+class VirtualSelector : public ItemSelector {
+ public:
+  template <typename... Args>
+  explicit VirtualSelector(Args... args) : selector_(args...) {}
+
+  absl::Status Delete(Key key) override { return selector_.Delete(key); }
+  absl::Status Insert(Key key, double priority) override {
+    return selector_.Insert(key, priority);
+  }
+  absl::Status Update(Key key, double priority) override {
+    return selector_.Update(key, priority);
+  }
+  KeyWithProbability Sample() override { return selector_.Sample(); }
+  KeyWithProbability SampleShared(absl::BitGen* bit_gen) const override {
+    return selector_.SampleShared(bit_gen);
+  }
+  bool SupportsSampleShared() const override {
+    return selector_.SupportsSampleShared();
+  }
+  void Clear() override { selector_.Clear(); }
+  double TotalWeight() const override { return selector_.TotalWeight(); }
+  KeyDistributionOptions options() const override {
+    return selector_.options();
+  }
+  std::string DebugString() const override { return selector_.DebugString(); }
+
+ private:
+  T selector_;
+};
+
+// Arguments: {sampler (0 = uniform, 1 = prioritized), devirtualized}.
+//
+// Inserts into a full table (so every insert also samples and deletes an item
+// from the FIFO remover) and samples one item per iteration. Compares the
+// common (sampler, remover) pairs called without virtual dispatch (see
+// `internal::VisitSelector`) to the same selectors behind the interface.
+void BM_InsertAndSampleDispatch(benchmark::State& state) {
+  const bool prioritized = state.range(0) == 1;
+  const bool devirtualized = state.range(1) == 1;
+  std::shared_ptr<ItemSelector> sampler;
+  std::shared_ptr<ItemSelector> remover;
+  if (devirtualized) {
+    sampler = prioritized
+                  ? std::shared_ptr<ItemSelector>(
+                        std::make_shared<PrioritizedSelector>(0.8))
+                  : std::make_shared<UniformSelector>();
+    remover = std::make_shared<FifoSelector>();
+  } else {
+    sampler = prioritized
+                  ? std::shared_ptr<ItemSelector>(
+                        std::make_shared<VirtualSelector<PrioritizedSelector>>(
+                            0.8))
+                  : std::make_shared<VirtualSelector<UniformSelector>>();
+    remover = std::make_shared<VirtualSelector<FifoSelector>>();
+  }
+  auto table = std::make_shared<Table>(
+      "dist", std::move(sampler), std::move(remover), kNumPrefilledItems,
+      /*max_times_sampled=*/0,
+      std::make_shared<RateLimiter>(1.0, 1, -DBL_MAX, DBL_MAX));
+  auto chunk = MakeChunk();
+  Prefill(table.get(), chunk);
+
+  absl::BitGen gen;
+  Table::SampledItem sample;
+  int64_t i = 0;
+  for (auto _ : state) {
+    auto status = table->InsertOrAssign(
+        MakeItem(MakeKey(state, i++), absl::Uniform(gen, 0.0, 1.0), chunk));
+    if (status.ok()) status = table->Sample(&sample);
+    if (!status.ok()) {
+      state.SkipWithError(status.ToString().c_str());
+      break;
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_InsertAndSampleDispatch)
+    ->ArgNames({"prioritized", "devirtualized"})
+    ->ArgsProduct({{0, 1}, {0, 1}});
+
+// Resident set size of the process.
+int64_t ResidentBytes() {
+  int64_t size_pages = 0;
+  int64_t resident_pages = 0;
+  std::ifstream statm("/proc/self/statm");
+  statm >> size_pages >> resident_pages;
+  return resident_pages * sysconf(_SC_PAGESIZE);
+}
+
+// Arguments: {stored (0 = `TableItem`, 1 = `Table`)}.
+//
+// Memory used per item when storing `kNumMemoryItems` items (all referencing
+// the same chunk so only the per item overhead is measured) in a `Table`,
+// compared to a map of materialized `TableItem`s (the representation used by
+// tables before items were stored compactly). Reported as `bytes_per_item`.
+constexpr int64_t kNumMemoryItems = 500000;
+
+void BM_MemoryPerItem(benchmark::State& state) {
+  const bool compact = state.range(0) == 1;
+  auto chunk = MakeChunk();
+  for (auto _ : state) {
+    const int64_t before = ResidentBytes();
+    std::shared_ptr<Table> table;
+    internal::flat_hash_map<uint64_t, TableItem> items;
+    if (compact) {
+      table = MakeTable(std::make_shared<UniformSelector>());
+      for (int64_t i = 0; i < kNumMemoryItems; i++) {
+        REVERB_CHECK(table->InsertOrAssign(MakeItem(i, 1, chunk)).ok());
+      }
+    } else {
+      for (int64_t i = 0; i < kNumMemoryItems; i++) {
+        TableItem item = MakeItem(i, 1, chunk);
+        item.item.set_table("dist");
+        items.emplace(i, std::move(item));
+      }
+    }
+    state.counters["bytes_per_item"] =
+        static_cast<double>(ResidentBytes() - before) / kNumMemoryItems;
+  }
+}
+BENCHMARK(BM_MemoryPerItem)
+    ->ArgNames({"compact"})
+    ->Arg(0)
+    ->Arg(1)
+    ->Iterations(1)
+    ->Unit(benchmark::kMillisecond);
+
+// Extension which does nothing, so only the cost of calling the hooks (i.e.
+// preparing the items passed to them) is measured.
+class NoopExtension : public TableExtensionBase {
+ public:
+  std::string DebugString() const override { return "NoopExtension"; }
+};
+
+// Arguments: {extension}.
+//
+// Inserts into and samples from a full table with and without an extension
+// registered.
+void BM_InsertAndSampleWithExtension(benchmark::State& state) {
+  const bool with_extension = state.range(0) == 1;
+  auto chunk = MakeChunk();
+  std::vector<std::shared_ptr<TableExtension>> extensions;
+  if (with_extension) extensions.push_back(std::make_shared<NoopExtension>());
+  Table table("dist", std::make_shared<UniformSelector>(),
+              std::make_shared<FifoSelector>(), kNumPrefilledItems,
+              /*max_times_sampled=*/0,
+              std::make_shared<RateLimiter>(1.0, 1, -DBL_MAX, DBL_MAX),
+              std::move(extensions));
+  Prefill(&table, chunk);
+
+  int64_t i = 0;
+  std::vector<Table::SampledItem> samples;
+  for (auto _ : state) {
+    REVERB_CHECK(table.InsertOrAssign(MakeItem(i++, 1, chunk)).ok());
+    samples.clear();
+    REVERB_CHECK(table.SampleFlexibleBatch(&samples, 1).ok());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_InsertAndSampleWithExtension)
+    ->ArgNames({"extension"})
+    ->Arg(0)
+    ->Arg(1);
+
+}  // namespace
+}  // namespace benchmarks
+}  // namespace reverb
+}  // namespace deepmind
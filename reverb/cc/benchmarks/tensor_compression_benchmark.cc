@@ -0,0 +1,112 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Throughput of `CompressTensorAsProto` and `DecompressTensorFromProto` per
+// dtype and codec. Run with:
+//
+//   bazel run -c opt //reverb/cc/benchmarks:tensor_compression_benchmark
+//
+#include <cstdint>
+
+#include "benchmark/benchmark.h"
+#include "reverb/cc/schema.pb.h"
+#include "reverb/cc/tensor_compression.h"
+#include "tensorflow/core/framework/tensor.h"
+#include "tensorflow/core/framework/tensor.pb.h"
+#include "tensorflow/core/framework/types.h"
+
+namespace deepmind {
+namespace reverb {
+namespace benchmarks {
+namespace {
+
+// Tensor of `num_elements` values which repeat with a short period, which
+// roughly matches the redundancy of typical observations (e.g. images).
+template <typename T>
+tensorflow::Tensor MakeTensor(int64_t num_elements) {
+  tensorflow::Tensor tensor(tensorflow::DataTypeToEnum<T>::value,
+                            {num_elements});
+  auto flat = tensor.flat<T>();
+  for (int64_t i = 0; i < num_elements; i++) {
+    flat(i) = static_cast<T>(i % 100);
+  }
+  return tensor;
+}
+
+// Returns false and marks the benchmark as skipped if `codec` is not linked
+// into the binary.
+bool CheckCodec(benchmark::State& state, ChunkData::Codec codec) {
+  if (GetTensorCodec(codec) == nullptr) {
+    state.SkipWithError("Codec is not registered.");
+    return false;
+  }
+  return true;
+}
+
+// Arguments: {number of elements, codec}.
+template <typename T>
+void BM_CompressTensorAsProto(benchmark::State& state) {
+  const auto codec = static_cast<ChunkData::Codec>(state.range(1));
+  if (!CheckCodec(state, codec)) return;
+
+  tensorflow::Tensor tensor = MakeTensor<T>(state.range(0));
+  tensorflow::TensorProto proto;
+  for (auto _ : state) {
+    CompressTensorAsProto(tensor, &proto, codec);
+    benchmark::DoNotOptimize(proto);
+  }
+  state.SetBytesProcessed(state.iterations() * tensor.TotalBytes());
+  state.counters["ratio"] =
+      static_cast<double>(tensor.TotalBytes()) / proto.ByteSizeLong();
+}
+
+// Arguments: {number of elements, codec}.
+template <typename T>
+void BM_DecompressTensorFromProto(benchmark::State& state) {
+  const auto codec = static_cast<ChunkData::Codec>(state.range(1));
+  if (!CheckCodec(state, codec)) return;
+
+  tensorflow::Tensor tensor = MakeTensor<T>(state.range(0));
+  tensorflow::TensorProto proto;
+  CompressTensorAsProto(tensor, &proto, codec);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(DecompressTensorFromProto(proto, codec));
+  }
+  state.SetBytesProcessed(state.iterations() * tensor.TotalBytes());
+}
+
+#define REVERB_COMPRESSION_BENCHMARK(benchmark, type)                   \
+  BENCHMARK_TEMPLATE(benchmark, type)                                   \
+      ->ArgNames({"elements", "codec"})                                 \
+      ->ArgsProduct({{1 << 10, 1 << 16, 1 << 20},                       \
+                     {ChunkData::NONE, ChunkData::SNAPPY, ChunkData::ZSTD, \
+                      ChunkData::LZ4}})
+
+REVERB_COMPRESSION_BENCHMARK(BM_CompressTensorAsProto, uint8_t);
+REVERB_COMPRESSION_BENCHMARK(BM_CompressTensorAsProto, int32_t);
+REVERB_COMPRESSION_BENCHMARK(BM_CompressTensorAsProto, int64_t);
+REVERB_COMPRESSION_BENCHMARK(BM_CompressTensorAsProto, float);
+REVERB_COMPRESSION_BENCHMARK(BM_CompressTensorAsProto, double);
+REVERB_COMPRESSION_BENCHMARK(BM_DecompressTensorFromProto, uint8_t);
+REVERB_COMPRESSION_BENCHMARK(BM_DecompressTensorFromProto, int32_t);
+REVERB_COMPRESSION_BENCHMARK(BM_DecompressTensorFromProto, int64_t);
+REVERB_COMPRESSION_BENCHMARK(BM_DecompressTensorFromProto, float);
+REVERB_COMPRESSION_BENCHMARK(BM_DecompressTensorFromProto, double);
+
+#undef REVERB_COMPRESSION_BENCHMARK
+
+}  // namespace
+}  // namespace benchmarks
+}  // namespace reverb
+}  // namespace deepmind
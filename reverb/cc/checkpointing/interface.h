@@ -48,6 +48,11 @@ class Checkpointer {
   virtual absl::Status LoadLatest(
       ChunkStore* chunk_store, std::vector<std::shared_ptr<Table>>* tables) = 0;
 
+  // Stops restoring data which `Load` may continue to insert in the background
+  // and blocks until this has stopped. Must be called before the `ChunkStore`
+  // passed to `Load` is destroyed.
+  virtual void StopLoading() {}
+
   // Returns a summary string description.
   virtual std::string DebugString() const = 0;
 };
@@ -14,20 +14,24 @@
 
 #include "reverb/cc/chunk_store.h"
 
+#include <algorithm>
 #include <memory>
+#include <string>
 #include <utility>
 #include <vector>
 
 #include <cstdint>
+#include "absl/hash/hash.h"
 #include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
 #include "absl/synchronization/mutex.h"
-#include "absl/time/time.h"
 #include "absl/types/span.h"
 #include "reverb/cc/platform/hash_map.h"
 #include "reverb/cc/platform/logging.h"
-#include "reverb/cc/platform/thread.h"
+#include "reverb/cc/platform/status_macros.h"
 #include "reverb/cc/schema.pb.h"
-#include "reverb/cc/support/queue.h"
+#include "reverb/cc/support/chunk_spill_log.h"
+#include "reverb/cc/support/latency_histogram.h"
 #include "reverb/cc/tensor_compression.h"
 #include "tensorflow/core/framework/tensor.h"
 #include "tensorflow/core/lib/core/errors.h"
@@ -36,55 +40,516 @@
 namespace deepmind {
 namespace reverb {
 
-ChunkStore::Chunk::Chunk(ChunkData data) : data_(std::move(data)) {}
+namespace {
 
-uint64_t ChunkStore::Chunk::key() const { return data_.chunk_key(); }
+// Size of the first and largest blocks allocated by the arena of a chunk. The
+// messages of most chunks fit in the first block.
+constexpr size_t kArenaStartBlockSize = 4 << 10;
+constexpr size_t kArenaMaxBlockSize = 64 << 10;
 
-const ChunkData& ChunkStore::Chunk::data() const { return data_; }
+// Indexed by `ChunkStore::LockOperation`.
+constexpr const char* kLockOperationNames[] = {
+    "insert", "get", "release", "enqueue", "evict",
+};
 
-size_t ChunkStore::Chunk::DataByteSizeLong() const {
-  absl::call_once(data_byte_size_once_,
-                  [this]() { data_byte_size_ = data_.ByteSizeLong(); });
-  return data_byte_size_;
+// Wire encoding of the content of `data`, i.e. of everything but the key. The
+// encoding is deterministic as `ChunkData` has no map fields, so chunks with
+// the same content have the same encoding.
+std::string ContentOf(ChunkData data) {
+  data.clear_chunk_key();
+  return data.SerializeAsString();
 }
 
-uint64_t ChunkStore::Chunk::episode_id() const {
-  return data_.sequence_range().episode_id();
+}  // namespace
+
+ChunkStore::Chunk::Chunk(ChunkData data)
+    : data_(std::make_shared<const ChunkData>(std::move(data))) {
+  InitMetadata();
+}
+
+ChunkStore::Chunk::Chunk(std::shared_ptr<google::protobuf::Arena> arena,
+                         ChunkData* data) {
+  REVERB_CHECK_EQ(data->GetArena(), arena.get());
+  // The aliasing constructor makes the pointer to the message own the arena.
+  data_ = std::shared_ptr<const ChunkData>(std::move(arena), data);
+  InitMetadata();
+}
+
+ChunkStore::Chunk::Chunk(std::shared_ptr<const internal::MappedChunkFile> file,
+                         const internal::MappedChunkFile::Entry& entry)
+    : key_(entry.key),
+      episode_id_(entry.episode_id),
+      num_rows_(entry.num_rows),
+      num_columns_(entry.num_columns),
+      data_byte_size_(entry.length),
+      lazy_(true),
+      mapped_file_(std::move(file)) {
+  mapped_payload_ = mapped_file_->Payload(entry);
+}
+
+ChunkStore::Chunk::~Chunk() {
+  if (!lazy_) return;
+  absl::MutexLock lock(&mu_);
+  if (tracks_residency()) {
+    store_state_->resident_bytes.fetch_sub(ResidentBytesLocked(),
+                                           std::memory_order_relaxed);
+  }
+  if (spilled_at_.has_value()) {
+    store_state_->spill_log->Release(*spilled_at_);
+  }
 }
 
-int32_t ChunkStore::Chunk::num_rows() const {
-  return data_.sequence_range().end() - data_.sequence_range().start() + 1;
+void ChunkStore::Chunk::InitMetadata() {
+  key_ = data_->chunk_key();
+  episode_id_ = data_->sequence_range().episode_id();
+  num_rows_ =
+      data_->sequence_range().end() - data_->sequence_range().start() + 1;
+  num_columns_ = data_->data().tensors_size();
+  data_byte_size_ = data_->ByteSizeLong();
+}
+
+uint64_t ChunkStore::Chunk::key() const { return key_; }
+
+bool ChunkStore::Chunk::tracks_residency() const {
+  return store_state_ != nullptr && store_state_->spill_log != nullptr;
+}
+
+const ChunkData& ChunkStore::Chunk::data() const {
+  REVERB_CHECK(!lazy_)
+      << "Chunk::data cannot be used for mapped chunks or when spilling is "
+         "enabled. Use Chunk::PinData instead.";
+  return *data_;
+}
+
+absl::Status ChunkStore::Chunk::PinData(
+    std::shared_ptr<const ChunkData>* data) const {
+  if (!lazy_) {
+    *data = data_;
+    return absl::OkStatus();
+  }
+
+  // Avoid writing to the (shared) cache line when the flag is already set.
+  if (!accessed_.load(std::memory_order_relaxed)) {
+    accessed_.store(true, std::memory_order_relaxed);
+  }
+
+  bool loaded = false;
+  {
+    absl::MutexLock lock(&mu_);
+    if (data_ == nullptr) {
+      auto arena = NewArena();
+      auto* message = google::protobuf::Arena::CreateMessage<ChunkData>(
+          arena.get());
+      bool parsed;
+      if (mapped_file_ != nullptr) {
+        // Parsed in place, the payload is not copied out of the mapping first.
+        parsed = message->ParseFromArray(mapped_payload_.data(),
+                                         mapped_payload_.size());
+      } else {
+        std::string serialized;
+        REVERB_RETURN_IF_ERROR(ReadSerializedLocked(&serialized));
+        parsed = message->ParseFromString(serialized);
+      }
+      if (!parsed) {
+        return absl::DataLossError(
+            absl::StrCat("Failed to parse chunk ", key_, "."));
+      }
+      loaded = serialized_data_ == nullptr;
+      data_ = std::shared_ptr<const ChunkData>(std::move(arena), message);
+      if (tracks_residency()) {
+        store_state_->resident_bytes.fetch_add(data_byte_size_,
+                                               std::memory_order_relaxed);
+      }
+    }
+    *data = data_;
+  }
+
+  // The chunk lock must be released first as the shard lock is acquired.
+  if (loaded && tracks_residency()) {
+    store_state_->Enqueue(this);
+    store_state_->MaybeEvict();
+  }
+  return absl::OkStatus();
 }
 
-int ChunkStore::Chunk::num_columns() const {
-  return data_.data().tensors_size();
+size_t ChunkStore::Chunk::DataByteSizeLong() const { return data_byte_size_; }
+
+absl::string_view ChunkStore::Chunk::SerializedData() const {
+  REVERB_CHECK(!lazy_)
+      << "Chunk::SerializedData cannot be used for mapped chunks or when "
+         "spilling is enabled. Use Chunk::PinSerializedData instead.";
+  std::shared_ptr<const std::string> serialized;
+  REVERB_CHECK_OK(PinSerializedData(&serialized));
+  return *serialized;
 }
 
-ChunkStore::ChunkStore(int cleanup_batch_size)
-    : delete_keys_(std::make_shared<internal::Queue<Key>>(10000000)),
-      cleaner_(internal::StartThread(
-          "ChunkStore-Cleaner", [this, cleanup_batch_size] {
-            while (CleanupInternal(cleanup_batch_size)) {
-            }
-          })) {}
+absl::Status ChunkStore::Chunk::PinSerializedData(
+    std::shared_ptr<const std::string>* data) const {
+  if (!lazy_) {
+    absl::call_once(serialized_data_once_, [this]() {
+      auto serialized = std::make_shared<std::string>();
+      data_->SerializeToString(serialized.get());
+      serialized_data_ = std::move(serialized);
+    });
+    *data = serialized_data_;
+    return absl::OkStatus();
+  }
+
+  if (!accessed_.load(std::memory_order_relaxed)) {
+    accessed_.store(true, std::memory_order_relaxed);
+  }
+
+  bool loaded = false;
+  {
+    absl::MutexLock lock(&mu_);
+    if (serialized_data_ == nullptr) {
+      auto serialized = std::make_shared<std::string>();
+      REVERB_RETURN_IF_ERROR(ReadSerializedLocked(serialized.get()));
+      loaded = data_ == nullptr;
+      serialized_data_ = std::move(serialized);
+      if (tracks_residency()) {
+        store_state_->resident_bytes.fetch_add(data_byte_size_,
+                                               std::memory_order_relaxed);
+      }
+    }
+    *data = serialized_data_;
+  }
+
+  if (loaded && tracks_residency()) {
+    store_state_->Enqueue(this);
+    store_state_->MaybeEvict();
+  }
+  return absl::OkStatus();
+}
 
-ChunkStore::~ChunkStore() {
-  // Closing the queue makes all calls to `CleanupInternal` to return false
-  // which will break the loop in `cleaner_` making it joinable.
-  delete_keys_->Close();
-  cleaner_ = nullptr;  // Joins thread.
+absl::Status ChunkStore::Chunk::ReadSerializedLocked(std::string* out) const {
+  if (serialized_data_ != nullptr) {
+    *out = *serialized_data_;
+    return absl::OkStatus();
+  }
+  if (data_ != nullptr) {
+    data_->SerializeToString(out);
+    return absl::OkStatus();
+  }
+  if (mapped_file_ != nullptr) {
+    out->assign(mapped_payload_.data(), mapped_payload_.size());
+    return absl::OkStatus();
+  }
+  return store_state_->spill_log->Read(*spilled_at_, out);
+}
+
+int64_t ChunkStore::Chunk::ResidentBytesLocked() const {
+  return (data_ != nullptr ? data_byte_size_ : 0) +
+         (serialized_data_ != nullptr ? data_byte_size_ : 0);
+}
+
+absl::Status ChunkStore::Chunk::Spill() {
+  // Declared before the lock so that the data is freed after it is released.
+  std::shared_ptr<const ChunkData> data;
+  std::shared_ptr<const std::string> serialized;
+
+  absl::MutexLock lock(&mu_);
+
+  // Mapped chunks can be parsed again from the mapping so nothing is written.
+  if (!spilled_at_.has_value() && mapped_file_ == nullptr) {
+    if (data_ == nullptr && serialized_data_ == nullptr) {
+      return absl::OkStatus();
+    }
+    std::string buffer;
+    if (serialized_data_ == nullptr) {
+      data_->SerializeToString(&buffer);
+    }
+    internal::ChunkSpillLog::Location location;
+    REVERB_RETURN_IF_ERROR(store_state_->spill_log->Append(
+        serialized_data_ != nullptr ? *serialized_data_ : buffer, &location));
+    spilled_at_ = location;
+  }
+
+  store_state_->resident_bytes.fetch_sub(ResidentBytesLocked(),
+                                         std::memory_order_relaxed);
+  data = std::move(data_);
+  serialized = std::move(serialized_data_);
+  return absl::OkStatus();
+}
+
+uint64_t ChunkStore::Chunk::episode_id() const { return episode_id_; }
+
+int32_t ChunkStore::Chunk::num_rows() const { return num_rows_; }
+
+int ChunkStore::Chunk::num_columns() const { return num_columns_; }
+
+void ChunkStore::Chunk::AddTableReference() const {
+  const int num_tables = num_tables_.fetch_add(1, std::memory_order_relaxed);
+  if (store_state_ != nullptr) {
+    store_state_->UpdateSharing(num_tables, data_byte_size_, -1);
+    store_state_->UpdateSharing(num_tables + 1, data_byte_size_, 1);
+  }
+}
+
+void ChunkStore::Chunk::RemoveTableReference() const {
+  const int num_tables = num_tables_.fetch_sub(1, std::memory_order_relaxed);
+  REVERB_CHECK_GT(num_tables, 0);
+  if (store_state_ != nullptr) {
+    store_state_->UpdateSharing(num_tables, data_byte_size_, -1);
+    store_state_->UpdateSharing(num_tables - 1, data_byte_size_, 1);
+  }
+}
+
+int ChunkStore::Chunk::num_tables() const {
+  return num_tables_.load(std::memory_order_relaxed);
+}
+
+bool ChunkStore::Chunk::is_resident() const {
+  if (!lazy_) return true;
+  absl::MutexLock lock(&mu_);
+  return data_ != nullptr || serialized_data_ != nullptr;
+}
+
+ChunkStore::ChunkStore(int num_shards)
+    : state_(std::make_shared<State>(num_shards)) {
+  REVERB_CHECK_GT(num_shards, 0);
+}
+
+ChunkStore::Shard& ChunkStore::State::ShardFor(Key key) {
+  return shards[absl::Hash<Key>()(key) % shards.size()];
+}
+
+void ChunkStore::State::UpdateSharing(int num_tables, int64_t bytes,
+                                      int sign) {
+  num_chunks_by_num_tables[std::min(num_tables, kNumSharingBuckets - 1)]
+      .fetch_add(sign, std::memory_order_relaxed);
+  if (num_tables == 0) {
+    orphaned_bytes.fetch_add(sign * bytes, std::memory_order_relaxed);
+  } else if (num_tables == 1) {
+    exclusive_bytes.fetch_add(sign * bytes, std::memory_order_relaxed);
+  }
+}
+
+void ChunkStore::State::Release(Key key, Chunk* chunk) {
+  num_chunks.fetch_sub(1, std::memory_order_relaxed);
+  num_bytes.fetch_sub(chunk->DataByteSizeLong(), std::memory_order_relaxed);
+  UpdateSharing(chunk->num_tables(), chunk->DataByteSizeLong(), -1);
+  {
+    Shard& shard = ShardFor(key);
+    internal::TimedMutexLock lock(&shard.mu, &lock_contention[kReleaseLock]);
+
+    // The chunk may have been replaced by a new chunk with the same key after
+    // the last reference was dropped but before the lock was acquired.
+    auto it = shard.data.find(key);
+    if (it != shard.data.end() && it->second.expired()) {
+      shard.data.erase(it);
+    }
+
+    // Drop the queue entries of destroyed chunks once they make up the
+    // majority of the queue so it cannot grow beyond the number of chunks.
+    if (shard.resident.size() > 2 * shard.data.size() + 16) {
+      shard.resident.erase(
+          std::remove_if(shard.resident.begin(), shard.resident.end(),
+                         [](const std::weak_ptr<Chunk>& wp) {
+                           return wp.expired();
+                         }),
+          shard.resident.end());
+    }
+  }
+  if (chunk->content_fingerprint_.has_value()) {
+    const uint64_t fingerprint = *chunk->content_fingerprint_;
+    Shard& shard = ShardFor(fingerprint);
+    internal::TimedMutexLock lock(&shard.mu, &lock_contention[kReleaseLock]);
+    auto it = shard.by_content.find(fingerprint);
+    if (it != shard.by_content.end()) {
+      auto& candidates = it->second;
+      candidates.erase(
+          std::remove_if(candidates.begin(), candidates.end(),
+                         [](const std::weak_ptr<Chunk>& wp) {
+                           return wp.expired();
+                         }),
+          candidates.end());
+      if (candidates.empty()) {
+        shard.by_content.erase(it);
+      }
+    }
+  }
+  delete chunk;
+}
+
+void ChunkStore::State::Enqueue(const Chunk* chunk) {
+  if (chunk->queued_.exchange(true)) return;
+  Shard& shard = ShardFor(chunk->key());
+  internal::TimedMutexLock lock(&shard.mu, &lock_contention[kEnqueueLock]);
+
+  // The caller holds a reference to the chunk so the entry is still its own.
+  auto it = shard.data.find(chunk->key());
+  REVERB_CHECK(it != shard.data.end());
+  shard.resident.push_back(it->second);
+}
+
+void ChunkStore::State::MaybeEvict() {
+  if (resident_bytes.load(std::memory_order_relaxed) <= max_resident_bytes) {
+    return;
+  }
+  if (!evict_mu.TryLock()) return;
+
+  // Destroying the last reference to a chunk acquires the lock of its shard so
+  // the references taken while scanning are only dropped after the scan.
+  std::vector<std::shared_ptr<Chunk>> victims;
+  std::vector<std::shared_ptr<Chunk>> passed_over;
+
+  int64_t excess =
+      resident_bytes.load(std::memory_order_relaxed) - max_resident_bytes;
+  for (int i = 0; i < shards.size() && excess > 0; i++) {
+    Shard& shard = shards[next_evict_shard];
+    next_evict_shard = (next_evict_shard + 1) % shards.size();
+
+    internal::TimedMutexLock lock(&shard.mu, &lock_contention[kEvictLock]);
+    for (size_t n = shard.resident.size(); n > 0 && excess > 0; n--) {
+      std::shared_ptr<Chunk> chunk = shard.resident.front().lock();
+      shard.resident.pop_front();
+      if (chunk == nullptr) continue;
+
+      if (chunk->accessed_.exchange(false, std::memory_order_relaxed)) {
+        shard.resident.push_back(chunk);
+        passed_over.push_back(std::move(chunk));
+        continue;
+      }
+
+      chunk->queued_.store(false);
+      excess -= chunk->DataByteSizeLong();
+      victims.push_back(std::move(chunk));
+    }
+  }
+  evict_mu.Unlock();
+
+  for (auto& chunk : victims) {
+    if (auto status = chunk->Spill(); !status.ok()) {
+      REVERB_LOG(REVERB_WARNING)
+          << "Failed to spill chunk " << chunk->key() << ": " << status;
+    }
+  }
 }
 
 std::shared_ptr<ChunkStore::Chunk> ChunkStore::Insert(ChunkData item) {
-  absl::WriterMutexLock lock(&mu_);
-  std::weak_ptr<Chunk>& wp = data_[item.chunk_key()];
-  std::shared_ptr<Chunk> sp = wp.lock();
-  if (sp == nullptr) {
-    wp = (sp = std::shared_ptr<Chunk>(new Chunk(std::move(item)),
-                                      [q = delete_keys_](Chunk* chunk) {
-                                        q->Push(chunk->key());
-                                        delete chunk;
-                                      }));
+  const Key key = item.chunk_key();
+  return InsertOrGet(key, [&item] { return new Chunk(std::move(item)); });
+}
+
+std::shared_ptr<ChunkStore::Chunk> ChunkStore::Insert(
+    std::shared_ptr<google::protobuf::Arena> arena, ChunkData* item) {
+  return InsertOrGet(item->chunk_key(), [&arena, item] {
+    return new Chunk(std::move(arena), item);
+  });
+}
+
+std::shared_ptr<ChunkStore::Chunk> ChunkStore::InsertMapped(
+    std::shared_ptr<const internal::MappedChunkFile> file,
+    const internal::MappedChunkFile::Entry& entry) {
+  return InsertOrGet(entry.key, [&file, &entry] {
+    return new Chunk(std::move(file), entry);
+  });
+}
+
+std::shared_ptr<ChunkStore::Chunk> ChunkStore::InsertDeduplicated(
+    std::shared_ptr<google::protobuf::Arena> arena, ChunkData* item) {
+  // A live chunk with the same key takes precedence, as for `Insert`.
+  {
+    Shard& shard = state_->ShardFor(item->chunk_key());
+    internal::TimedReaderMutexLock lock(&shard.mu,
+                                        &state_->lock_contention[kInsertLock]);
+    auto it = shard.data.find(item->chunk_key());
+    if (it != shard.data.end()) {
+      if (auto chunk = it->second.lock()) return chunk;
+    }
+  }
+
+  const Key key = item->chunk_key();
+  item->clear_chunk_key();
+  const std::string content = item->SerializeAsString();
+  item->set_chunk_key(key);
+  const uint64_t fingerprint = absl::Hash<std::string>()(content);
+
+  // The candidates are compared once the lock has been released as pinning
+  // their data may load it from the spill log.
+  std::vector<std::shared_ptr<Chunk>> candidates;
+  Shard& content_shard = state_->ShardFor(fingerprint);
+  {
+    internal::TimedReaderMutexLock lock(&content_shard.mu,
+                                        &state_->lock_contention[kInsertLock]);
+    auto it = content_shard.by_content.find(fingerprint);
+    if (it != content_shard.by_content.end()) {
+      for (const auto& wp : it->second) {
+        if (auto chunk = wp.lock()) candidates.push_back(std::move(chunk));
+      }
+    }
+  }
+  for (auto& candidate : candidates) {
+    std::shared_ptr<const ChunkData> data;
+    if (candidate->PinData(&data).ok() && ContentOf(*data) == content) {
+      state_->num_deduplicated.fetch_add(1, std::memory_order_relaxed);
+      return std::move(candidate);
+    }
+  }
+  candidates.clear();
+
+  std::shared_ptr<Chunk> chunk =
+      InsertOrGet(key, [&arena, item, fingerprint] {
+        auto* chunk = new Chunk(std::move(arena), item);
+        chunk->content_fingerprint_ = fingerprint;
+        return chunk;
+      });
+  if (chunk->content_fingerprint_ == fingerprint) {
+    internal::TimedMutexLock lock(&content_shard.mu,
+                                  &state_->lock_contention[kInsertLock]);
+    content_shard.by_content[fingerprint].push_back(chunk);
+  }
+  return chunk;
+}
+
+std::shared_ptr<google::protobuf::Arena> ChunkStore::NewArena() {
+  google::protobuf::ArenaOptions options;
+  options.start_block_size = kArenaStartBlockSize;
+  options.max_block_size = kArenaMaxBlockSize;
+  return std::make_shared<google::protobuf::Arena>(options);
+}
+
+std::shared_ptr<ChunkStore::Chunk> ChunkStore::InsertOrGet(
+    Key key, const std::function<Chunk*()>& create) {
+  std::shared_ptr<Chunk> sp;
+  bool spill = false;
+  {
+    Shard& shard = state_->ShardFor(key);
+    internal::TimedMutexLock lock(&shard.mu,
+                                  &state_->lock_contention[kInsertLock]);
+    std::weak_ptr<Chunk>& wp = shard.data[key];
+    sp = wp.lock();
+    if (sp == nullptr) {
+      Chunk* chunk = create();
+      state_->num_chunks.fetch_add(1, std::memory_order_relaxed);
+      state_->num_bytes.fetch_add(chunk->DataByteSizeLong(),
+                                  std::memory_order_relaxed);
+      chunk->store_state_ = state_;
+      state_->UpdateSharing(0, chunk->DataByteSizeLong(), 1);
+
+      // The state is taken from the chunk so the deleter does not hold a
+      // reference to it. The resident queue can keep the control blocks of
+      // destroyed chunks alive, which would otherwise form a cycle.
+      wp = (sp = std::shared_ptr<Chunk>(chunk, [](Chunk* c) {
+              std::shared_ptr<State> state = c->store_state_;
+              state->Release(c->key(), c);
+            }));
+
+      // Mapped chunks are not resident until their data is first pinned.
+      if (state_->spill_log != nullptr && chunk->mapped_file_ == nullptr) {
+        chunk->lazy_ = true;
+        chunk->queued_.store(true);
+        state_->resident_bytes.fetch_add(chunk->DataByteSizeLong(),
+                                         std::memory_order_relaxed);
+        shard.resident.push_back(wp);
+        spill = true;
+      }
+    }
+  }
+
+  if (spill) {
+    state_->MaybeEvict();
   }
   return sp;
 }
@@ -92,37 +557,93 @@ std::shared_ptr<ChunkStore::Chunk> ChunkStore::Insert(ChunkData item) {
 tensorflow::Status ChunkStore::Get(
     absl::Span<const ChunkStore::Key> keys,
     std::vector<std::shared_ptr<Chunk>>* chunks) {
-  absl::ReaderMutexLock lock(&mu_);
+  // Dropping the previous content may destroy chunks, which acquires the lock
+  // of their shard, so it must happen before any lock is held.
   chunks->clear();
   chunks->reserve(keys.size());
-  for (int i = 0; i < keys.size(); i++) {
-    chunks->push_back(GetItem(keys[i]));
-    if (!chunks->at(i)) {
+  for (const Key key : keys) {
+    Shard& shard = state_->ShardFor(key);
+    internal::TimedReaderMutexLock lock(&shard.mu,
+                                        &state_->lock_contention[kGetLock]);
+    auto it = shard.data.find(key);
+    chunks->push_back(it == shard.data.end() ? nullptr : it->second.lock());
+    if (chunks->back() == nullptr) {
       return tensorflow::errors::NotFound(
-          absl::StrCat("Chunk ", keys[i], " cannot be found."));
+          absl::StrCat("Chunk ", key, " cannot be found."));
     }
   }
   return tensorflow::Status::OK();
 }
 
-std::shared_ptr<ChunkStore::Chunk> ChunkStore::GetItem(Key key) {
-  auto it = data_.find(key);
-  return it == data_.end() ? nullptr : it->second.lock();
+int64_t ChunkStore::num_chunks() const {
+  return state_->num_chunks.load(std::memory_order_relaxed);
 }
 
-bool ChunkStore::CleanupInternal(int num_chunks) {
-  std::vector<Key> popped_keys;
-  popped_keys.reserve(num_chunks);
-  if (!delete_keys_->PopBatch(num_chunks, &popped_keys).ok()) {
-    return false;
+int64_t ChunkStore::num_bytes() const {
+  return state_->num_bytes.load(std::memory_order_relaxed);
+}
+
+int64_t ChunkStore::num_deduplicated_chunks() const {
+  return state_->num_deduplicated.load(std::memory_order_relaxed);
+}
+
+int64_t ChunkStore::num_resident_bytes() const {
+  return state_->resident_bytes.load(std::memory_order_relaxed);
+}
+
+int64_t ChunkStore::num_spilled_bytes() const {
+  return state_->spill_log == nullptr ? 0 : state_->spill_log->live_bytes();
+}
+
+ChunkSharingInfo ChunkStore::sharing_info() const {
+  ChunkSharingInfo info;
+  for (const auto& count : state_->num_chunks_by_num_tables) {
+    info.add_num_chunks_by_num_tables(count.load(std::memory_order_relaxed));
   }
+  info.set_exclusive_chunk_bytes(
+      state_->exclusive_bytes.load(std::memory_order_relaxed));
+  info.set_orphaned_chunk_bytes(
+      state_->orphaned_bytes.load(std::memory_order_relaxed));
+  return info;
+}
+
+std::vector<LockContention> ChunkStore::lock_contention() const {
+  std::vector<LockContention> contention(kNumLockOperations);
+  for (int op = 0; op < kNumLockOperations; op++) {
+    contention[op].set_operation(kLockOperationNames[op]);
+    state_->lock_contention[op].ToProto(&contention[op]);
+  }
+  return contention;
+}
 
-  absl::WriterMutexLock data_lock(&mu_);
-  for (const Key& key : popped_keys) {
-    data_.erase(key);
+absl::Status ChunkStore::EnableSpilling(const std::string& directory,
+                                        int64_t max_resident_bytes,
+                                        int64_t max_segment_bytes) {
+  if (state_->spill_log != nullptr) {
+    return absl::FailedPreconditionError("Spilling is already enabled.");
   }
+  if (num_entries() > 0) {
+    return absl::FailedPreconditionError(
+        "Spilling must be enabled before any chunk is inserted.");
+  }
+  if (max_resident_bytes < 0) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("max_resident_bytes must be >= 0 but got ",
+                     max_resident_bytes, "."));
+  }
+  REVERB_RETURN_IF_ERROR(internal::ChunkSpillLog::Create(
+      directory, max_segment_bytes, &state_->spill_log));
+  state_->max_resident_bytes = max_resident_bytes;
+  return absl::OkStatus();
+}
 
-  return true;
+int64_t ChunkStore::num_entries() const {
+  int64_t total = 0;
+  for (const Shard& shard : state_->shards) {
+    absl::ReaderMutexLock lock(&shard.mu);
+    total += shard.data.size();
+  }
+  return total;
 }
 
 }  // namespace reverb
@@ -15,19 +15,29 @@
 #ifndef REVERB_CC_CHUNK_STORE_H_
 #define REVERB_CC_CHUNK_STORE_H_
 
+#include <array>
+#include <atomic>
+#include <deque>
+#include <functional>
 #include <memory>
+#include <string>
 #include <utility>
 #include <vector>
 
 #include "absl/base/call_once.h"
 #include <cstdint>
 #include "absl/base/thread_annotations.h"
+#include "absl/status/status.h"
+#include "absl/strings/string_view.h"
 #include "absl/synchronization/mutex.h"
+#include "absl/types/optional.h"
 #include "absl/types/span.h"
+#include "google/protobuf/arena.h"
 #include "reverb/cc/platform/hash_map.h"
-#include "reverb/cc/platform/thread.h"
 #include "reverb/cc/schema.pb.h"
-#include "reverb/cc/support/queue.h"
+#include "reverb/cc/support/chunk_spill_log.h"
+#include "reverb/cc/support/latency_histogram.h"
+#include "reverb/cc/support/mapped_chunk_file.h"
 #include "tensorflow/core/framework/tensor.h"
 #include "tensorflow/core/framework/tensor_shape.h"
 #include "tensorflow/core/lib/core/status.h"
@@ -47,8 +57,38 @@ namespace reverb {
 // reason, Insert() returns a shared pointer, as otherwise the Chunk would be
 // destroyed right away.
 //
+// The map is partitioned into shards which are locked independently so that
+// concurrent inserts and lookups (e.g. from many insert streams) rarely
+// contend. The entry of a chunk is erased by the deleter of the chunk when the
+// last reference is dropped.
+//
+// The store keeps track of the number and (serialized) size of the live chunks,
+// i.e. the chunks which are still referenced by a table, a pending request or
+// a stream. This is the memory held by the chunks regardless of how many items
+// or tables reference them.
+//
+// Optionally (see `EnableSpilling`) the store keeps only the recently used
+// chunks in memory and writes the data of the remaining (cold) chunks to a log
+// on local disk. Spilled chunks remain in the store and are loaded again the
+// first time their data is pinned. Which chunks stay resident is decided by a
+// CLOCK (second chance) approximation of LRU, so pinning a resident chunk only
+// sets a flag and the latency of sampling hot items is unaffected.
+//
+// Chunks inserted with `InsertDeduplicated` are also indexed by a fingerprint
+// of their content (everything but the key), so a chunk whose content is
+// identical to that of a live chunk shares the existing chunk instead of
+// holding a second copy of the data.
+//
+// Chunks can also be backed by a memory mapped checkpoint file (see
+// `InsertMapped`). Their data is parsed from the mapping the first time it is
+// pinned and, if spilling is enabled, evicting them only drops the parsed data
+// as it can be parsed again from the mapping.
+//
 // All public methods are thread safe.
 class ChunkStore {
+ private:
+  struct State;
+
  public:
   using Key = uint64_t;
 
@@ -56,15 +96,48 @@ class ChunkStore {
    public:
     explicit Chunk(ChunkData data);
 
+    // Wraps `data` which must have been allocated on `arena`. The chunk shares
+    // the ownership of `arena` so the memory of `data` is released as a whole
+    // when the chunk (and any other owner of `arena`) is destroyed.
+    Chunk(std::shared_ptr<google::protobuf::Arena> arena, ChunkData* data);
+
+    // Wraps the chunk stored as `entry` in `file`. The chunk shares the
+    // ownership of `file` and its data is parsed from the mapped payload the
+    // first time it is pinned.
+    Chunk(std::shared_ptr<const internal::MappedChunkFile> file,
+          const internal::MappedChunkFile::Entry& entry);
+
+    ~Chunk();
+
     // Unique identifier of the chunk.
     uint64_t key() const;
 
-    // Returns the proto data of the chunk.
+    // Returns the proto data of the chunk. Must not be used for mapped chunks
+    // or chunks of a store with spilling enabled as the data may not be
+    // resident. Use `PinData` instead.
     const ChunkData& data() const;
 
-    // (Potentially cached) size of `data`.
+    // Sets `data` to the proto data of the chunk, loading it from the spill log
+    // or the mapped file if required. The data remains valid for as long as
+    // `data` is held, even if the chunk is spilled in the meantime.
+    absl::Status PinData(std::shared_ptr<const ChunkData>* data) const;
+
+    // Size of `data`. Computed when the chunk is constructed.
     size_t DataByteSizeLong() const;
 
+    // Wire encoding of `data`. The encoding is computed the first time it is
+    // requested and cached for the lifetime of the chunk, so a chunk that is
+    // sent to many clients is only serialized once. Note that this roughly
+    // doubles the memory held by the chunk once it has been requested. Must
+    // not be used for mapped chunks or chunks of a store with spilling
+    // enabled. Use `PinSerializedData` instead.
+    absl::string_view SerializedData() const;
+
+    // Same as `PinData` but for the wire encoding of the data. Spilled and
+    // mapped chunks are copied from the log or mapping without being parsed.
+    absl::Status PinSerializedData(
+        std::shared_ptr<const std::string>* data) const;
+
     // Alias for `data().sequence_range().episode_id()`.
     uint64_t episode_id() const;
 
@@ -75,59 +148,272 @@ class ChunkStore {
     // Number of tensors in each step.
     int num_columns() const;
 
+    // True if the data (or its wire encoding) is held in memory. Always true
+    // for chunks which are neither mapped nor in a store with spilling.
+    bool is_resident() const;
+
+    // Called by a table when the first of its items referencing the chunk is
+    // inserted and when the last of them is removed respectively. Used for the
+    // statistics returned by `ChunkStore::sharing_info`.
+    void AddTableReference() const;
+    void RemoveTableReference() const;
+
+    // Number of tables which reference the chunk.
+    int num_tables() const;
+
    private:
-    ChunkData data_;
-    mutable size_t data_byte_size_;
-    mutable absl::once_flag data_byte_size_once_;
-  };
+    friend class ChunkStore;
+    friend struct State;
+
+    // Sets the metadata members from `data_`.
+    void InitMetadata();
+
+    // Appends the wire encoding of the chunk to the spill log, unless it is
+    // already there or the chunk is mapped, and drops the in memory copies of
+    // the data.
+    absl::Status Spill();
+
+    // True if the resident bytes of the chunk are tracked by the store, i.e.
+    // if the chunk belongs to a store with spilling enabled.
+    bool tracks_residency() const;
+
+    // Bytes of memory held by `data_` and `serialized_data_`.
+    int64_t ResidentBytesLocked() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+    // Reads the wire encoding of the chunk from `serialized_data_` or `data_`
+    // if loaded and otherwise from the mapped file or the spill log.
+    absl::Status ReadSerializedLocked(std::string* out) const
+        ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+    // Metadata, which is kept in memory even when the chunk is spilled.
+    uint64_t key_;
+    uint64_t episode_id_;
+    int32_t num_rows_;
+    int num_columns_;
+    size_t data_byte_size_;
+
+    // State of the store which created the chunk. Set by `ChunkStore` and
+    // nullptr for chunks constructed directly.
+    std::shared_ptr<State> store_state_;
+
+    // True if the data may not be resident, i.e. if the chunk is mapped or
+    // belongs to a store with spilling enabled.
+    bool lazy_ = false;
+
+    // Set for chunks backed by a mapped file. `mapped_payload_` points into
+    // the mapping of `mapped_file_`.
+    std::shared_ptr<const internal::MappedChunkFile> mapped_file_;
+    absl::string_view mapped_payload_;
+
+    mutable std::atomic<int> num_tables_{0};
+
+    // Fingerprint of the content of the chunk if it was inserted with
+    // `InsertDeduplicated`. Set before the chunk is published.
+    absl::optional<uint64_t> content_fingerprint_;
+
+    // When `lazy_` is false, `data_` is set in the constructor and
+    // `serialized_data_` once (see `serialized_data_once_`) and neither is
+    // modified after that, so they can be read without holding `mu_`.
+    // Otherwise they are guarded by `mu_` and nullptr while not loaded.
+    mutable absl::Mutex mu_;
+    mutable std::shared_ptr<const ChunkData> data_;
+    mutable std::shared_ptr<const std::string> serialized_data_;
+    mutable absl::once_flag serialized_data_once_;
+
+    // Position of the data in the spill log once written.
+    absl::optional<internal::ChunkSpillLog::Location> spilled_at_
+        ABSL_GUARDED_BY(mu_);
+
+    // Set when the data is pinned and cleared when the chunk is passed over by
+    // the eviction, which gives recently used chunks a second chance.
+    mutable std::atomic<bool> accessed_{false};
 
-  // Starts `cleaner_`. `cleanup_batch_size` is the number of keys the cleaner
-  // should wait for before acquiring the lock and erasing them from `data_`.
-  explicit ChunkStore(int cleanup_batch_size = 1000);
+    // True while the chunk is in the resident queue of its shard.
+    mutable std::atomic<bool> queued_{false};
+  };
 
-  // Stops `cleaner_` closes `delete_keys_`.
-  ~ChunkStore();
+  // `num_shards` is the number of independently locked partitions of the key
+  // space. Higher values reduce the contention between concurrent calls.
+  explicit ChunkStore(int num_shards = kDefaultNumShards);
 
   // Attempts to insert a Chunk into the map using the key inside `item`. If no
   // entry existed for the key, a new Chunk is created, inserted and returned.
   // Otherwise, the existing chunk is returned.
-  std::shared_ptr<Chunk> Insert(ChunkData item) ABSL_LOCKS_EXCLUDED(mu_);
+  std::shared_ptr<Chunk> Insert(ChunkData item);
+
+  // Same as above but for an `item` allocated on `arena` (see `NewArena`). If a
+  // new chunk is created it takes (shared) ownership of `arena`, avoiding a
+  // copy of `item` and releasing all the memory it allocated at once.
+  std::shared_ptr<Chunk> Insert(std::shared_ptr<google::protobuf::Arena> arena,
+                                ChunkData* item);
+
+  // Same as above but for the chunk stored as `entry` in `file`. The payload
+  // is not read until the data of the chunk is pinned.
+  std::shared_ptr<Chunk> InsertMapped(
+      std::shared_ptr<const internal::MappedChunkFile> file,
+      const internal::MappedChunkFile::Entry& entry);
+
+  // Same as `Insert` but if a live chunk (inserted with `InsertDeduplicated`)
+  // has the same content as `item` apart from the key, then that chunk is
+  // returned and `item` is dropped. The key of the returned chunk can then
+  // differ from the key of `item` so the caller must refer to the chunk by
+  // `Chunk::key` from then on. Candidates are selected by fingerprint and
+  // compared in full, so distinct chunks are never merged. Concurrent inserts
+  // of identical chunks may both be kept.
+  std::shared_ptr<Chunk> InsertDeduplicated(
+      std::shared_ptr<google::protobuf::Arena> arena, ChunkData* item);
+
+  // Creates an arena whose blocks are sized for the messages of a chunk. The
+  // submessages, repeated fields and string objects of a chunk parsed onto it
+  // are allocated from a few large blocks instead of individually on the heap.
+  // Note that protobuf still allocates the character buffers of `bytes` fields
+  // (e.g. the tensor content) on the heap.
+  static std::shared_ptr<google::protobuf::Arena> NewArena();
 
   // Gets the Chunk for each given key. Returns an error if one of the items
-  // does not exist or if `Close` has been called. On success, the returned
-  // items are in the same order as given in `keys`.
+  // does not exist. On success, the returned items are in the same order as
+  // given in `keys`.
   tensorflow::Status Get(absl::Span<const Key> keys,
-                         std::vector<std::shared_ptr<Chunk>>* chunks)
-      ABSL_LOCKS_EXCLUDED(mu_);
+                         std::vector<std::shared_ptr<Chunk>>* chunks);
+
+  // Number of live chunks created by `Insert`. Does not acquire any lock.
+  int64_t num_chunks() const;
+
+  // Sum of `Chunk::DataByteSizeLong` of the live chunks created by `Insert`.
+  // Does not acquire any lock.
+  int64_t num_bytes() const;
+
+  // Number of entries in the map, including those whose chunk is being
+  // destroyed. Acquires the lock of every shard.
+  int64_t num_entries() const;
 
-  // Blocks until `num_chunks` expired entries have been cleaned up from
-  // `data_`. This method is called automatically by a background thread to
-  // limit memory size, but does not have any effect on the semantics of Get()
-  // or Insert() calls.
+  // Number of calls to `InsertDeduplicated` which returned an existing chunk
+  // with a different key. Does not acquire any lock.
+  int64_t num_deduplicated_chunks() const;
+
+  // Enables spilling of cold chunks to segment files of at most
+  // `max_segment_bytes` in `directory`. Chunks are spilled, least recently
+  // used first, whenever the memory held by the data of the live chunks
+  // exceeds `max_resident_bytes`. The files are deleted when no longer needed.
   //
-  // Returns false if `delete_keys_` closed before `num_chunks` could be popped.
-  bool CleanupInternal(int num_chunks) ABSL_LOCKS_EXCLUDED(mu_);
+  // Must be called before the first chunk is inserted.
+  absl::Status EnableSpilling(const std::string& directory,
+                              int64_t max_resident_bytes,
+                              int64_t max_segment_bytes =
+                                  kDefaultMaxSpillSegmentBytes);
+
+  // Bytes of memory held by the data of the live chunks. Only tracked when
+  // spilling is enabled. Does not acquire any lock.
+  int64_t num_resident_bytes() const;
+
+  // Bytes of chunk data held by the spill log. Zero if spilling is disabled.
+  int64_t num_spilled_bytes() const;
+
+  // How the live chunks are shared between tables (see
+  // `Chunk::AddTableReference`). Does not acquire any lock so the values of
+  // different fields may be slightly out of sync while tables are modified.
+  ChunkSharingInfo sharing_info() const;
+
+  // Contention of the shard locks attributed to the operation which acquired
+  // them (see `ServerInfoResponse.chunk_store_lock_contention`). Only a sample
+  // of the acquisitions is timed. Does not acquire any lock.
+  std::vector<LockContention> lock_contention() const;
+
+  static constexpr int kDefaultNumShards = 64;
+  static constexpr int64_t kDefaultMaxSpillSegmentBytes = 256 << 20;
+
+  // Number of elements of `ChunkSharingInfo.num_chunks_by_num_tables`.
+  static constexpr int kNumSharingBuckets = 8;
 
  private:
-  // Gets an item. Returns nullptr if the item does not exist.
-  std::shared_ptr<Chunk> GetItem(Key key) ABSL_SHARED_LOCKS_REQUIRED(mu_);
+  // Operations which the contention of `Shard::mu` is attributed to.
+  enum LockOperation {
+    kInsertLock,
+    kGetLock,
+    kReleaseLock,
+    kEnqueueLock,
+    kEvictLock,
+    kNumLockOperations,
+  };
 
-  // Holds the actual mapping of key to Chunk. We only hold a weak pointer to
-  // the Chunk, which means that destruction and reference counting of the
-  // chunks happens independently of this map.
-  internal::flat_hash_map<Key, std::weak_ptr<Chunk>> data_ ABSL_GUARDED_BY(mu_);
+  // Partition of the map. We only hold a weak pointer to the Chunk, which
+  // means that destruction and reference counting of the chunks happens
+  // independently of this map.
+  struct Shard {
+    mutable absl::Mutex mu;
+    internal::flat_hash_map<Key, std::weak_ptr<Chunk>> data
+        ABSL_GUARDED_BY(mu);
 
-  // Mutex protecting access to `data_`.
-  mutable absl::Mutex mu_;
+    // Chunks whose data is in memory, in the order they were inserted or
+    // loaded. Only used when spilling is enabled. This is the clock of the
+    // eviction so entries of destroyed chunks are removed lazily.
+    std::deque<std::weak_ptr<Chunk>> resident ABSL_GUARDED_BY(mu);
+
+    // Chunks inserted with `InsertDeduplicated` by the fingerprint of their
+    // content. Sharded by fingerprint rather than by key.
+    internal::flat_hash_map<uint64_t, std::vector<std::weak_ptr<Chunk>>>
+        by_content ABSL_GUARDED_BY(mu);
+  };
+
+  // The shards and statistics are heap allocated, and referenced by the
+  // deleter of every chunk, since chunks may outlive the store. The deleter
+  // erases the entry of the chunk from its shard so no cleanup is required.
+  // Chunks of a store with spilling enabled keep the state alive as they need
+  // the spill log.
+  struct State {
+    explicit State(int num_shards) : shards(num_shards) {}
+
+    Shard& ShardFor(Key key);
+
+    // Erases the entry for `key` (and the content entry of `chunk`, if any)
+    // unless it has been replaced by a chunk that is still alive and destroys
+    // `chunk`.
+    void Release(Key key, Chunk* chunk);
+
+    // Adds `chunk`, whose data was just loaded, to the resident queue of its
+    // shard unless it is already there.
+    void Enqueue(const Chunk* chunk);
+
+    // Spills chunks until the resident bytes are within the budget. Does
+    // nothing if another thread is already evicting.
+    void MaybeEvict();
+
+    // Adds (`sign` = 1) or removes (`sign` = -1) a chunk of `bytes` to the
+    // sharing statistics of chunks referenced by `num_tables` tables.
+    void UpdateSharing(int num_tables, int64_t bytes, int sign);
+
+    std::vector<Shard> shards;
+    std::atomic<int64_t> num_chunks{0};
+    std::atomic<int64_t> num_bytes{0};
+
+    // See `ChunkSharingInfo`.
+    std::array<std::atomic<int64_t>, kNumSharingBuckets>
+        num_chunks_by_num_tables{};
+    std::atomic<int64_t> exclusive_bytes{0};
+    std::atomic<int64_t> orphaned_bytes{0};
+
+    // See `num_deduplicated_chunks`.
+    std::atomic<int64_t> num_deduplicated{0};
+
+    // Only set when spilling is enabled.
+    std::unique_ptr<internal::ChunkSpillLog> spill_log;
+    int64_t max_resident_bytes = 0;
+    std::atomic<int64_t> resident_bytes{0};
+
+    absl::Mutex evict_mu;
+    int next_evict_shard ABSL_GUARDED_BY(evict_mu) = 0;
+
+    // Summed over all shards.
+    std::array<internal::LockContentionHistograms, kNumLockOperations>
+        lock_contention;
+  };
 
-  // Queue of keys of deleted items that will be cleaned up by `cleaner_`. Note
-  // the queue have to be allocated on the heap in order to avoid dereferencing
-  // errors caused by a stack allocated ChunkStore getting destroyed before all
-  // Chunk have been destroyed.
-  std::shared_ptr<internal::Queue<Key>> delete_keys_;
+  // Returns the chunk for `key` if it is alive, otherwise inserts and returns
+  // the chunk returned by `create`.
+  std::shared_ptr<Chunk> InsertOrGet(Key key,
+                                     const std::function<Chunk*()>& create);
 
-  // Consumes `delete_keys_` to remove dead pointers in `data_`.
-  std::unique_ptr<internal::Thread> cleaner_;
+  std::shared_ptr<State> state_;
 };
 
 }  // namespace reverb
@@ -15,13 +15,18 @@
 #include "reverb/cc/chunk_store.h"
 
 #include <atomic>
+#include <cstdlib>
 #include <memory>
+#include <string>
 #include <vector>
 
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
+#include "absl/status/status.h"
+#include "reverb/cc/platform/status_matchers.h"
 #include "reverb/cc/platform/thread.h"
 #include "reverb/cc/schema.pb.h"
+#include "reverb/cc/support/mapped_chunk_file.h"
 #include "reverb/cc/testing/proto_test_util.h"
 #include "tensorflow/core/lib/core/status.h"
 #include "tensorflow/core/lib/core/status_test_util.h"
@@ -79,8 +84,8 @@ TEST(ChunkStoreTest, InsertingTwiceSucceedsWhenChunkIsDestroyed) {
   EXPECT_NE(second, nullptr);
 }
 
-TEST(ChunkStoreTest, CleanupDoesNotDeleteRequiredChunks) {
-  ChunkStore store(/*cleanup_batch_size=*/1);
+TEST(ChunkStoreTest, DestroyingChunkErasesOnlyItsEntry) {
+  ChunkStore store(/*num_shards=*/1);
 
   // Keep this one around.
   std::shared_ptr<ChunkStore::Chunk> first =
@@ -92,15 +97,130 @@ TEST(ChunkStoreTest, CleanupDoesNotDeleteRequiredChunks) {
         store.Insert(testing::MakeChunkData(2));
   }
 
-  // The first one should still be available.
+  // The first one should still be available while the second one is erased
+  // as soon as its last reference is dropped.
   ChunkVector chunks;
   TF_EXPECT_OK(store.Get({1}, &chunks));
+  EXPECT_EQ(store.Get({2}, &chunks).code(), tensorflow::error::NOT_FOUND);
+  EXPECT_EQ(store.num_entries(), 1);
+
+  // Dropping the chunks returned by `Get` erases the last entry.
+  first = nullptr;
+  chunks.clear();
+  EXPECT_EQ(store.num_entries(), 0);
+}
 
-  // The second one should be gone eventually.
-  tensorflow::Status status;
-  while (status.code() != tensorflow::error::NOT_FOUND) {
-    status = store.Get({2}, &chunks);
+TEST(ChunkStoreTest, ChunksCanOutliveStore) {
+  std::shared_ptr<ChunkStore::Chunk> chunk;
+  {
+    ChunkStore store;
+    chunk = store.Insert(testing::MakeChunkData(1));
   }
+  EXPECT_EQ(chunk->key(), 1);
+  chunk = nullptr;
+}
+
+TEST(ChunkStoreTest, ArenaAllocatedChunkOwnsArena) {
+  ChunkStore store;
+  auto arena = ChunkStore::NewArena();
+  auto* data = google::protobuf::Arena::CreateMessage<ChunkData>(arena.get());
+  *data = testing::MakeChunkData(1);
+
+  std::shared_ptr<ChunkStore::Chunk> chunk = store.Insert(arena, data);
+  EXPECT_EQ(&chunk->data(), data);
+  EXPECT_EQ(chunk->key(), 1);
+  EXPECT_EQ(arena.use_count(), 2);
+
+  // The arena is not retained when the key already exists.
+  auto other_arena = ChunkStore::NewArena();
+  auto* other_data =
+      google::protobuf::Arena::CreateMessage<ChunkData>(other_arena.get());
+  *other_data = testing::MakeChunkData(1);
+  EXPECT_EQ(store.Insert(other_arena, other_data), chunk);
+  EXPECT_EQ(other_arena.use_count(), 1);
+
+  chunk = nullptr;
+  EXPECT_EQ(arena.use_count(), 1);
+}
+
+ChunkData* NewArenaChunk(const std::shared_ptr<google::protobuf::Arena>& arena,
+                         ChunkData data) {
+  auto* chunk = google::protobuf::Arena::CreateMessage<ChunkData>(arena.get());
+  *chunk = std::move(data);
+  return chunk;
+}
+
+TEST(ChunkStoreTest, InsertDeduplicatedSharesChunksWithSameContent) {
+  ChunkStore store;
+  const auto range = testing::MakeSequenceRange(1, 0, 0);
+  auto arena = ChunkStore::NewArena();
+  auto chunk = store.InsertDeduplicated(
+      arena, NewArenaChunk(arena, testing::MakeChunkData(1, range)));
+  EXPECT_EQ(chunk->key(), 1);
+
+  // Same content under a different key.
+  auto other_arena = ChunkStore::NewArena();
+  EXPECT_EQ(store.InsertDeduplicated(
+                other_arena,
+                NewArenaChunk(other_arena, testing::MakeChunkData(2, range))),
+            chunk);
+  EXPECT_EQ(other_arena.use_count(), 1);
+  EXPECT_EQ(store.num_chunks(), 1);
+  EXPECT_EQ(store.num_deduplicated_chunks(), 1);
+
+  // Different content.
+  auto different_arena = ChunkStore::NewArena();
+  auto different = store.InsertDeduplicated(
+      different_arena,
+      NewArenaChunk(different_arena,
+                    testing::MakeChunkData(3, testing::MakeSequenceRange(
+                                                  2, 0, 0))));
+  EXPECT_NE(different, chunk);
+  EXPECT_EQ(different->key(), 3);
+  EXPECT_EQ(store.num_chunks(), 2);
+
+  // Once the chunk has been destroyed its content is no longer shared.
+  chunk = nullptr;
+  auto new_arena = ChunkStore::NewArena();
+  chunk = store.InsertDeduplicated(
+      new_arena, NewArenaChunk(new_arena, testing::MakeChunkData(4, range)));
+  EXPECT_EQ(chunk->key(), 4);
+  EXPECT_EQ(store.num_deduplicated_chunks(), 1);
+}
+
+TEST(ChunkStoreTest, InsertDoesNotShareChunksWithSameContent) {
+  ChunkStore store;
+  const auto range = testing::MakeSequenceRange(1, 0, 0);
+  auto chunk = store.Insert(testing::MakeChunkData(1, range));
+  auto arena = ChunkStore::NewArena();
+  auto other = store.InsertDeduplicated(
+      arena, NewArenaChunk(arena, testing::MakeChunkData(2, range)));
+  EXPECT_NE(other, chunk);
+  EXPECT_EQ(other->key(), 2);
+}
+
+TEST(ChunkStoreTest, TracksLiveChunks) {
+  ChunkStore store;
+  std::shared_ptr<ChunkStore::Chunk> first =
+      store.Insert(testing::MakeChunkData(1));
+  std::shared_ptr<ChunkStore::Chunk> second =
+      store.Insert(testing::MakeChunkData(2));
+  EXPECT_EQ(store.num_chunks(), 2);
+  EXPECT_EQ(store.num_bytes(),
+            first->DataByteSizeLong() + second->DataByteSizeLong());
+
+  // Inserting an existing chunk does not count it twice.
+  EXPECT_EQ(store.Insert(testing::MakeChunkData(1)), first);
+  EXPECT_EQ(store.num_chunks(), 2);
+
+  const int64_t second_bytes = second->DataByteSizeLong();
+  first = nullptr;
+  EXPECT_EQ(store.num_chunks(), 1);
+  EXPECT_EQ(store.num_bytes(), second_bytes);
+
+  second = nullptr;
+  EXPECT_EQ(store.num_chunks(), 0);
+  EXPECT_EQ(store.num_bytes(), 0);
 }
 
 TEST(ChunkStoreTest, ConcurrentCalls) {
@@ -123,6 +243,258 @@ TEST(ChunkStoreTest, ConcurrentCalls) {
   EXPECT_EQ(count, 1000);
 }
 
+TEST(ChunkStoreTest, TracksSharingOfChunks) {
+  ChunkStore store;
+  auto first = store.Insert(testing::MakeChunkData(1));
+  auto second = store.Insert(testing::MakeChunkData(2));
+  const int64_t first_bytes = first->DataByteSizeLong();
+  const int64_t second_bytes = second->DataByteSizeLong();
+
+  // Chunks are not referenced by any table when inserted.
+  ChunkSharingInfo info = store.sharing_info();
+  ASSERT_EQ(info.num_chunks_by_num_tables_size(),
+            ChunkStore::kNumSharingBuckets);
+  EXPECT_EQ(info.num_chunks_by_num_tables(0), 2);
+  EXPECT_EQ(info.orphaned_chunk_bytes(), first_bytes + second_bytes);
+  EXPECT_EQ(info.exclusive_chunk_bytes(), 0);
+
+  first->AddTableReference();
+  second->AddTableReference();
+  second->AddTableReference();
+  info = store.sharing_info();
+  EXPECT_EQ(info.num_chunks_by_num_tables(0), 0);
+  EXPECT_EQ(info.num_chunks_by_num_tables(1), 1);
+  EXPECT_EQ(info.num_chunks_by_num_tables(2), 1);
+  EXPECT_EQ(info.orphaned_chunk_bytes(), 0);
+  EXPECT_EQ(info.exclusive_chunk_bytes(), first_bytes);
+
+  // Chunks referenced by many tables share the last bucket.
+  for (int i = 2; i < ChunkStore::kNumSharingBuckets + 2; i++) {
+    second->AddTableReference();
+  }
+  info = store.sharing_info();
+  EXPECT_EQ(info.num_chunks_by_num_tables(ChunkStore::kNumSharingBuckets - 1),
+            1);
+
+  first->RemoveTableReference();
+  first = nullptr;
+  info = store.sharing_info();
+  EXPECT_EQ(info.num_chunks_by_num_tables(0), 0);
+  EXPECT_EQ(info.num_chunks_by_num_tables(1), 0);
+  EXPECT_EQ(info.exclusive_chunk_bytes(), 0);
+  EXPECT_EQ(info.orphaned_chunk_bytes(), 0);
+}
+
+TEST(ChunkStoreTest, ReportsLockContentionByOperation) {
+  ChunkStore store;
+
+  // Only a sample of the acquisitions is timed.
+  for (ChunkStore::Key i = 0; i < 1000; i++) {
+    auto chunk = store.Insert(testing::MakeChunkData(i));
+    ChunkVector chunks;
+    TF_ASSERT_OK(store.Get({i}, &chunks));
+  }
+
+  std::vector<LockContention> contention = store.lock_contention();
+  ASSERT_EQ(contention.size(), 5);
+  EXPECT_EQ(contention[0].operation(), "insert");
+  EXPECT_GT(contention[0].hold().count(), 0);
+  EXPECT_EQ(contention[1].operation(), "get");
+  EXPECT_GT(contention[1].hold().count(), 0);
+  EXPECT_EQ(contention[2].operation(), "release");
+  EXPECT_GT(contention[2].hold().count(), 0);
+
+  // Spilling is disabled so chunks are never enqueued or evicted.
+  EXPECT_EQ(contention[3].hold().count(), 0);
+  EXPECT_EQ(contention[4].hold().count(), 0);
+}
+
+std::string SpillDirectory() {
+  const char* dir = std::getenv("TEST_TMPDIR");
+  return dir != nullptr ? dir : "/tmp";
+}
+
+TEST(ChunkStoreTest, EnableSpillingFailsAfterInsert) {
+  ChunkStore store;
+  auto chunk = store.Insert(testing::MakeChunkData(1));
+  EXPECT_EQ(store.EnableSpilling(SpillDirectory(), 0).code(),
+            absl::StatusCode::kFailedPrecondition);
+}
+
+TEST(ChunkStoreTest, SpilledChunkIsLoadedWhenPinned) {
+  ChunkStore store;
+  REVERB_ASSERT_OK(store.EnableSpilling(SpillDirectory(), 0));
+
+  ChunkData data = testing::MakeChunkData(1);
+  auto chunk = store.Insert(data);
+
+  // Nothing may be resident so the chunk is spilled right away.
+  EXPECT_FALSE(chunk->is_resident());
+  EXPECT_EQ(store.num_resident_bytes(), 0);
+  EXPECT_EQ(store.num_spilled_bytes(), chunk->DataByteSizeLong());
+
+  // The metadata remains available.
+  EXPECT_EQ(chunk->key(), 1);
+  EXPECT_EQ(chunk->num_rows(), data.sequence_range().end() -
+                                   data.sequence_range().start() + 1);
+
+  std::shared_ptr<const ChunkData> pinned;
+  REVERB_ASSERT_OK(chunk->PinData(&pinned));
+  EXPECT_THAT(*pinned, testing::EqualsProto(data));
+
+  std::shared_ptr<const std::string> serialized;
+  REVERB_ASSERT_OK(chunk->PinSerializedData(&serialized));
+  EXPECT_EQ(*serialized, data.SerializeAsString());
+}
+
+TEST(ChunkStoreTest, PinnedDataSurvivesSpill) {
+  ChunkStore store(/*num_shards=*/1);
+  REVERB_ASSERT_OK(store.EnableSpilling(SpillDirectory(), 0));
+
+  auto first_data = testing::MakeChunkData(1);
+  auto first = store.Insert(first_data);
+  std::shared_ptr<const ChunkData> pinned;
+  REVERB_ASSERT_OK(first->PinData(&pinned));
+
+  // The load gives the chunk a second chance but the next insert spills it.
+  EXPECT_TRUE(first->is_resident());
+  auto second = store.Insert(testing::MakeChunkData(2));
+  EXPECT_FALSE(first->is_resident());
+  EXPECT_THAT(*pinned, testing::EqualsProto(first_data));
+}
+
+TEST(ChunkStoreTest, KeepsRecentlyUsedChunksResident) {
+  ChunkStore store(/*num_shards=*/1);
+  // Room for two and a half chunks. The exact size varies with the key.
+  const int64_t chunk_bytes = testing::MakeChunkData(1).ByteSizeLong();
+  const int64_t max_resident_bytes = 2 * chunk_bytes + chunk_bytes / 2;
+  REVERB_ASSERT_OK(store.EnableSpilling(SpillDirectory(), max_resident_bytes));
+
+  ChunkVector chunks;
+  for (int i = 1; i <= 2; i++) {
+    chunks.push_back(store.Insert(testing::MakeChunkData(i)));
+  }
+
+  // Using the first chunk makes the second chunk the next to be spilled.
+  std::shared_ptr<const ChunkData> pinned;
+  REVERB_ASSERT_OK(chunks[0]->PinData(&pinned));
+  chunks.push_back(store.Insert(testing::MakeChunkData(3)));
+
+  EXPECT_TRUE(chunks[0]->is_resident());
+  EXPECT_FALSE(chunks[1]->is_resident());
+  EXPECT_TRUE(chunks[2]->is_resident());
+  EXPECT_LE(store.num_resident_bytes(), max_resident_bytes);
+
+  // Loading the second chunk spills the third, which has not been used.
+  REVERB_ASSERT_OK(chunks[1]->PinData(&pinned));
+  EXPECT_TRUE(chunks[0]->is_resident());
+  EXPECT_TRUE(chunks[1]->is_resident());
+  EXPECT_FALSE(chunks[2]->is_resident());
+  EXPECT_LE(store.num_resident_bytes(), max_resident_bytes);
+}
+
+TEST(ChunkStoreTest, DestroyingSpilledChunksReleasesSpilledBytes) {
+  ChunkStore store;
+  REVERB_ASSERT_OK(store.EnableSpilling(SpillDirectory(), 0));
+
+  ChunkVector chunks;
+  for (int i = 0; i < 10; i++) {
+    chunks.push_back(store.Insert(testing::MakeChunkData(i)));
+  }
+  EXPECT_GT(store.num_spilled_bytes(), 0);
+
+  chunks.clear();
+  EXPECT_EQ(store.num_spilled_bytes(), 0);
+  EXPECT_EQ(store.num_resident_bytes(), 0);
+  EXPECT_EQ(store.num_entries(), 0);
+}
+
+TEST(ChunkStoreTest, ConcurrentPinsOfSpillingStore) {
+  ChunkStore store;
+  const int64_t chunk_bytes = testing::MakeChunkData(1).ByteSizeLong();
+  REVERB_ASSERT_OK(store.EnableSpilling(SpillDirectory(), 10 * chunk_bytes));
+
+  ChunkVector chunks;
+  for (int i = 0; i < 100; i++) {
+    chunks.push_back(store.Insert(testing::MakeChunkData(i)));
+  }
+
+  std::vector<std::unique_ptr<internal::Thread>> bundle;
+  for (int t = 0; t < 10; t++) {
+    bundle.push_back(internal::StartThread("", [t, &chunks] {
+      for (int i = 0; i < 1000; i++) {
+        const auto& chunk = chunks[(i * 7 + t) % chunks.size()];
+        std::shared_ptr<const ChunkData> pinned;
+        REVERB_ASSERT_OK(chunk->PinData(&pinned));
+        EXPECT_EQ(pinned->chunk_key(), chunk->key());
+      }
+    }));
+  }
+  bundle.clear();  // Joins all threads.
+}
+
+// Writes `data` to a new mapped chunk file and returns the opened file.
+std::shared_ptr<const internal::MappedChunkFile> WriteMappedChunkFile(
+    const std::string& name, const ChunkData& data) {
+  const std::string path = SpillDirectory() + "/" + name;
+  std::unique_ptr<internal::MappedChunkFile::Writer> writer;
+  REVERB_CHECK_OK(internal::MappedChunkFile::Writer::Create(path, &writer));
+  REVERB_CHECK_OK(writer->Append(
+      {data.chunk_key(), data.sequence_range().episode_id(),
+       data.sequence_range().end() - data.sequence_range().start() + 1,
+       data.data().tensors_size()},
+      data.SerializeAsString()));
+  REVERB_CHECK_OK(writer->Close());
+  std::shared_ptr<const internal::MappedChunkFile> file;
+  REVERB_CHECK_OK(internal::MappedChunkFile::Open(path, &file));
+  return file;
+}
+
+TEST(ChunkStoreTest, MappedChunkIsParsedWhenPinned) {
+  ChunkStore store;
+  ChunkData data = testing::MakeChunkData(1);
+  auto file = WriteMappedChunkFile("mapped_chunk_is_parsed", data);
+  auto chunk = store.InsertMapped(file, file->entries()[0]);
+
+  EXPECT_FALSE(chunk->is_resident());
+  EXPECT_EQ(chunk->key(), 1);
+  EXPECT_EQ(chunk->episode_id(), data.sequence_range().episode_id());
+  EXPECT_EQ(chunk->num_columns(), data.data().tensors_size());
+  EXPECT_EQ(chunk->DataByteSizeLong(), data.ByteSizeLong());
+  EXPECT_EQ(store.num_bytes(), data.ByteSizeLong());
+
+  std::shared_ptr<const ChunkData> pinned;
+  REVERB_ASSERT_OK(chunk->PinData(&pinned));
+  EXPECT_THAT(*pinned, testing::EqualsProto(data));
+  EXPECT_TRUE(chunk->is_resident());
+
+  std::shared_ptr<const std::string> serialized;
+  REVERB_ASSERT_OK(chunk->PinSerializedData(&serialized));
+  EXPECT_EQ(*serialized, data.SerializeAsString());
+}
+
+TEST(ChunkStoreTest, SpillingMappedChunkDoesNotWriteToLog) {
+  ChunkStore store(/*num_shards=*/1);
+  REVERB_ASSERT_OK(store.EnableSpilling(SpillDirectory(), 0));
+
+  ChunkData data = testing::MakeChunkData(1);
+  auto file = WriteMappedChunkFile("spilling_mapped_chunk", data);
+  auto chunk = store.InsertMapped(file, file->entries()[0]);
+  EXPECT_EQ(store.num_resident_bytes(), 0);
+
+  std::shared_ptr<const ChunkData> pinned;
+  REVERB_ASSERT_OK(chunk->PinData(&pinned));
+  pinned = nullptr;
+
+  // The next insert evicts the mapped chunk, which only drops its data.
+  auto other = store.Insert(testing::MakeChunkData(2));
+  EXPECT_FALSE(chunk->is_resident());
+  EXPECT_EQ(store.num_spilled_bytes(), other->DataByteSizeLong());
+
+  REVERB_ASSERT_OK(chunk->PinData(&pinned));
+  EXPECT_THAT(*pinned, testing::EqualsProto(data));
+}
+
 TEST(ChunkTest, Length) {
   ChunkData data;
   data.mutable_sequence_range()->set_start(5);
@@ -156,6 +528,22 @@ TEST(ChunkTest, EpisodeId) {
   }
 }
 
+TEST(ChunkTest, SerializedData) {
+  ChunkData data;
+  data.set_chunk_key(3);
+  data.mutable_sequence_range()->set_episode_id(7);
+  data.mutable_data()->add_tensors();
+  ChunkStore::Chunk chunk(data);
+
+  ChunkData parsed;
+  ASSERT_TRUE(parsed.ParseFromArray(chunk.SerializedData().data(),
+                                    chunk.SerializedData().size()));
+  EXPECT_THAT(parsed, testing::EqualsProto(data));
+
+  // The encoding is cached.
+  EXPECT_EQ(chunk.SerializedData().data(), chunk.SerializedData().data());
+}
+
 }  // namespace
 }  // namespace reverb
 }  // namespace deepmind
@@ -23,11 +23,11 @@
 #include "absl/strings/string_view.h"
 #include "absl/time/time.h"
 #include "absl/types/optional.h"
-#include "reverb/cc/platform/grpc_utils.h"
 #include "reverb/cc/platform/logging.h"
 #include "reverb/cc/platform/status_macros.h"
 #include "reverb/cc/reverb_service.pb.h"
 #include "reverb/cc/schema.pb.h"
+#include "reverb/cc/support/channel_pool.h"
 #include "reverb/cc/support/grpc_util.h"
 #include "reverb/cc/support/uint128.h"
 #include "reverb/cc/trajectory_writer.h"
@@ -54,8 +54,8 @@ Client::Client(std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface> stu
 
 Client::Client(absl::string_view server_address)
     : stub_(/* grpc_gen:: */ReverbService::NewStub(
-          CreateCustomGrpcChannel(server_address, MakeChannelCredentials(),
-                                  CreateChannelArguments()))) {}
+          ChannelPool::Global()->GetChannel(server_address,
+                                            CreateChannelArguments()))) {}
 
 absl::Status Client::MaybeUpdateServerInfoCache(
     absl::Duration timeout,
@@ -120,9 +120,12 @@ absl::Status Client::NewWriter(int chunk_length, int max_timesteps,
   // some limits.
   REVERB_RETURN_IF_ERROR(MaybeUpdateServerInfoCache(absl::InfiniteDuration(),
                                                     &cached_flat_signatures));
+  // Pipelined writers chunk every tensor separately and thus cannot delta
+  // encode the timesteps.
   *writer = absl::make_unique<Writer>(
       stub_, chunk_length, max_timesteps, delta_encoded,
-      std::move(cached_flat_signatures), std::move(max_in_flight_items));
+      std::move(cached_flat_signatures), std::move(max_in_flight_items),
+      /*pipelined=*/!delta_encoded);
   return absl::OkStatus();
 }
 
@@ -158,7 +161,8 @@ absl::Status Client::NewSampler(
   REVERB_RETURN_IF_ERROR(options.Validate());
 
   std::shared_ptr<Table> table_ptr;
-  if (GetLocalTablePtr(table, &table_ptr).ok()) {
+  // Mixtures span several tables so they are always sampled over gRPC.
+  if (options.mixture.empty() && GetLocalTablePtr(table, &table_ptr).ok()) {
     REVERB_LOG_EVERY_POW_2(REVERB_INFO)
         << "Sampler and server are owned by the same process (" << getpid()
         << ") so Table " << table << " is accessed directly without gRPC.";
@@ -351,6 +355,21 @@ absl::Status Client::LockedUpdateServerInfoCache(
   return absl::OkStatus();
 }
 
+absl::Status Client::DeleteEpisodes(absl::string_view table,
+                                    const std::vector<uint64_t>& episode_ids,
+                                    absl::Duration timeout) {
+  grpc::ClientContext context;
+  context.set_wait_for_ready(true);
+  context.set_deadline(absl::ToChronoTime(absl::Now() + timeout));
+  MutatePrioritiesRequest request;
+  request.set_table(table.data(), table.size());
+  for (uint64_t episode_id : episode_ids) {
+    request.add_delete_episodes(episode_id);
+  }
+  MutatePrioritiesResponse response;
+  return FromGrpcStatus(stub_->MutatePriorities(&context, request, &response));
+}
+
 absl::Status Client::Reset(const std::string& table) {
   grpc::ClientContext context;
   context.set_wait_for_ready(true);
@@ -371,6 +390,59 @@ absl::Status Client::Checkpoint(std::string* path) {
   return absl::OkStatus();
 }
 
+absl::Status Client::ExportTable(absl::string_view table,
+                                 const ExportCallback& callback,
+                                 int max_items_per_response) {
+  grpc::ClientContext context;
+  context.set_fail_fast(true);
+  ExportTableRequest request;
+  request.set_table(std::string(table));
+  request.set_max_items_per_response(max_items_per_response);
+  auto reader = stub_->ExportTable(&context, request);
+
+  internal::flat_hash_map<uint64_t, std::shared_ptr<const ChunkData>> chunks;
+  std::vector<std::shared_ptr<const ChunkData>> item_chunks;
+  ExportTableResponse response;
+  absl::Status status;
+  while (status.ok() && reader->Read(&response)) {
+    if (response.has_chunk()) {
+      const uint64_t key = response.chunk().chunk_key();
+      chunks[key] = std::make_shared<const ChunkData>(
+          std::move(*response.mutable_chunk()));
+    }
+    for (const auto& item : response.items()) {
+      item_chunks.clear();
+      for (const auto& column : item.flat_trajectory().columns()) {
+        for (const auto& slice : column.chunk_slices()) {
+          auto it = chunks.find(slice.chunk_key());
+          if (it == chunks.end()) {
+            status = absl::InternalError(
+                absl::StrCat("Chunk ", slice.chunk_key(), " of item ",
+                             item.key(), " was not received."));
+            break;
+          }
+          if (std::find(item_chunks.begin(), item_chunks.end(), it->second) ==
+              item_chunks.end()) {
+            item_chunks.push_back(it->second);
+          }
+        }
+        if (!status.ok()) break;
+      }
+      if (!status.ok()) break;
+      status = callback(item, item_chunks);
+      if (!status.ok()) break;
+    }
+    for (uint64_t key : response.released_chunk_keys()) {
+      chunks.erase(key);
+    }
+  }
+
+  // The stream must be cancelled before `Finish` if it is stopped early.
+  if (!status.ok()) context.TryCancel();
+  auto finish_status = FromGrpcStatus(reader->Finish());
+  return status.ok() ? finish_status : status;
+}
+
 absl::Status Client::GetLocalTablePtr(absl::string_view table_name,
                                       std::shared_ptr<Table>* out) {
   grpc::ClientContext context;
@@ -409,7 +481,41 @@ absl::Status Client::NewTrajectoryWriter(
     const TrajectoryWriter::Options& options,
     std::unique_ptr<TrajectoryWriter>* writer) {
   REVERB_RETURN_IF_ERROR(options.Validate());
-  *writer = absl::make_unique<TrajectoryWriter>(stub_, options);
+
+  internal::flat_hash_map<std::string, std::shared_ptr<Table>> tables;
+  if (GetLocalTables(&tables).ok()) {
+    REVERB_LOG_EVERY_POW_2(REVERB_INFO)
+        << "TrajectoryWriter and server are owned by the same process ("
+        << getpid() << ") so the tables are written to without gRPC.";
+    *writer = absl::make_unique<TrajectoryWriter>(std::move(tables), options);
+  } else {
+    *writer = absl::make_unique<TrajectoryWriter>(stub_, options);
+  }
+  return absl::OkStatus();
+}
+
+absl::Status Client::NewPriorityUpdater(
+    const PriorityUpdater::Options& options,
+    std::unique_ptr<PriorityUpdater>* updater) {
+  REVERB_RETURN_IF_ERROR(options.Validate());
+  *updater = absl::make_unique<PriorityUpdater>(stub_, options);
+  return absl::OkStatus();
+}
+
+absl::Status Client::GetLocalTables(
+    internal::flat_hash_map<std::string, std::shared_ptr<Table>>* tables) {
+  // The tables are only looked up to decide whether the local writer can be
+  // used so there is no point in waiting for a server that is not yet up.
+  struct ServerInfo info;
+  REVERB_RETURN_IF_ERROR(GetServerInfo(absl::Seconds(1), &info));
+  if (info.table_info.empty()) {
+    return absl::FailedPreconditionError("Server does not have any tables.");
+  }
+  for (const auto& table_info : info.table_info) {
+    std::shared_ptr<Table> table;
+    REVERB_RETURN_IF_ERROR(GetLocalTablePtr(table_info.name(), &table));
+    (*tables)[table_info.name()] = std::move(table);
+  }
   return absl::OkStatus();
 }
 
@@ -17,6 +17,7 @@
 
 #include <stddef.h>
 
+#include <functional>
 #include <memory>
 #include <string>
 #include <vector>
@@ -27,11 +28,14 @@
 #include "absl/strings/string_view.h"
 #include "absl/synchronization/mutex.h"
 #include "absl/time/time.h"
+#include "reverb/cc/platform/hash_map.h"
+#include "reverb/cc/priority_updater.h"
 #include "reverb/cc/reverb_service.grpc.pb.h"
 #include "reverb/cc/reverb_service.pb.h"
 #include "reverb/cc/sampler.h"
 #include "reverb/cc/schema.pb.h"
 #include "reverb/cc/support/signature.h"
+#include "reverb/cc/table.h"
 #include "reverb/cc/trajectory_writer.h"
 #include "reverb/cc/writer.h"
 
@@ -54,7 +58,8 @@ class Client {
   explicit Client(std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface> stub);
   explicit Client(absl::string_view server_address);
 
-  // Upon successful return, `writer` will contain an instance of Writer.
+  // Upon successful return, `writer` will contain an instance of Writer. The
+  // writer is pipelined (see `Writer`) unless `delta_encoded` is set.
   absl::Status NewWriter(int chunk_length, int max_timesteps,
                          bool delta_encoded, std::unique_ptr<Writer>* writer);
   absl::Status NewWriter(int chunk_length, int max_timesteps,
@@ -110,10 +115,39 @@ class Client {
       const std::vector<uint64_t>& deletes,
       absl::Duration timeout = absl::InfiniteDuration());
 
+  // Validates `options` and if valid, creates a new `PriorityUpdater` which
+  // sends the priority updates passed to it in the background, merging the
+  // updates of the same table (see `PriorityUpdater`). Prefer this over
+  // `MutatePriorities` when updating priorities at a high rate, e.g. after
+  // every learner step.
+  absl::Status NewPriorityUpdater(const PriorityUpdater::Options& options,
+                                  std::unique_ptr<PriorityUpdater>* updater);
+
+  // Deletes all items of the episodes `episode_ids` from table `table`, which
+  // must index its episodes (see `Table::DeleteEpisode`).
+  absl::Status DeleteEpisodes(
+      absl::string_view table, const std::vector<uint64_t>& episode_ids,
+      absl::Duration timeout = absl::InfiniteDuration());
+
   absl::Status Reset(const std::string& table);
 
   absl::Status Checkpoint(std::string* path);
 
+  // Called by `ExportTable` for every item with the chunks it references.
+  using ExportCallback = std::function<absl::Status(
+      const PrioritizedItem& item,
+      const std::vector<std::shared_ptr<const ChunkData>>& chunks)>;
+
+  // Streams a consistent snapshot of the items of `table` (see
+  // `ReverbService.ExportTable`) and calls `callback` for every item in
+  // insertion order. Only the chunks which are still referenced by items that
+  // have not been exported are held by the client. Stops and returns the error
+  // if `callback` returns an error. `max_items_per_response` <= 0 selects the
+  // default of the server.
+  absl::Status ExportTable(absl::string_view table,
+                           const ExportCallback& callback,
+                           int max_items_per_response = 0);
+
   // Requests ServerInfo. Forces an update of internal signature caches.
   absl::Status ServerInfo(absl::Duration timeout, struct ServerInfo* info);
   // Waits indefinitely for server to respond.
@@ -138,6 +172,11 @@ class Client {
   absl::Status GetLocalTablePtr(absl::string_view table_name,
                                 std::shared_ptr<Table>* out);
 
+  // Populates `tables` with direct access to every table of the server. Fails
+  // unless the server is running in the same process.
+  absl::Status GetLocalTables(
+      internal::flat_hash_map<std::string, std::shared_ptr<Table>>* tables);
+
   // Upon successful return, `sampler` will contain an instance of
   // Sampler.  This version is called by the public `NewSampler` methods.
   //
@@ -0,0 +1,219 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/local_insert_stream.h"
+
+#include <limits>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "reverb/cc/platform/hash_set.h"
+#include "reverb/cc/support/grpc_util.h"
+#include "reverb/cc/support/trajectory_util.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+
+LocalInsertStream::LocalInsertStream(
+    flat_hash_map<std::string, std::shared_ptr<Table>> tables)
+    : tables_(std::move(tables)), state_(std::make_shared<State>()) {}
+
+LocalInsertStream::~LocalInsertStream() { TryCancel(); }
+
+bool LocalInsertStream::NextMessageSize(uint32_t* sz) {
+  *sz = std::numeric_limits<uint32_t>::max();
+  return true;
+}
+
+bool LocalInsertStream::Read(InsertStreamResponse* response) {
+  absl::MutexLock lock(&state_->mu);
+  auto ready = [this]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(state_->mu) {
+    return !state_->confirmations.empty() || state_->cancelled ||
+           !state_->status.ok() ||
+           (state_->writes_done && state_->num_pending_inserts == 0);
+  };
+  state_->mu.Await(absl::Condition(&ready));
+  if (state_->cancelled || state_->confirmations.empty()) return false;
+
+  // All confirmations which are ready are returned in a single response.
+  response->set_key(state_->confirmations.front());
+  response->mutable_keys()->Add(state_->confirmations.begin() + 1,
+                                state_->confirmations.end());
+  state_->confirmations.clear();
+  return true;
+}
+
+bool LocalInsertStream::Write(const InsertStreamRequest& request,
+                              grpc::WriteOptions options) {
+  {
+    absl::MutexLock lock(&state_->mu);
+    if (state_->cancelled || state_->writes_done || !state_->status.ok()) {
+      return false;
+    }
+  }
+
+  // The requests of a batch are handled as if they had been written one by
+  // one.
+  grpc::Status status;
+  if (request.has_batch()) {
+    for (const auto& batched : request.batch().requests()) {
+      status = HandleRequest(batched);
+      if (!status.ok()) break;
+    }
+  } else {
+    status = HandleRequest(request);
+  }
+
+  absl::MutexLock lock(&state_->mu);
+  if (!status.ok() && state_->status.ok()) {
+    state_->status = std::move(status);
+  }
+  return state_->status.ok() && !state_->cancelled;
+}
+
+grpc::Status LocalInsertStream::HandleRequest(
+    const InsertStreamRequest& request) {
+  if (request.has_chunk()) {
+    // The chunk is copied rather than serialized. This is the only copy made
+    // of the data on its way into the table.
+    chunks_[request.chunk().chunk_key()] =
+        std::make_shared<ChunkStore::Chunk>(request.chunk());
+    chunk_index_.Add(request.chunk().chunk_key(), request.chunk_column(),
+                     request.chunk().sequence_range());
+    return grpc::Status::OK;
+  }
+  if (request.has_item() && request.item().has_assembled_trajectory()) {
+    if (request.item().item().has_flat_trajectory()) {
+      return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                          "Items must not set both `flat_trajectory` and "
+                          "`assembled_trajectory`.");
+    }
+    InsertStreamRequest::PriorityInsertion expanded = request.item();
+    expanded.clear_assembled_trajectory();
+    if (auto status = chunk_index_.Expand(
+            request.item().assembled_trajectory(),
+            expanded.mutable_item()->mutable_flat_trajectory());
+        !status.ok()) {
+      return ToGrpcStatus(status);
+    }
+    return InsertItem(expanded);
+  }
+  if (request.has_item()) {
+    return InsertItem(request.item());
+  }
+  return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                      "LocalInsertStream only accepts chunks and items.");
+}
+
+grpc::Status LocalInsertStream::InsertItem(
+    const InsertStreamRequest::PriorityInsertion& request) {
+  Table::Item item;
+  for (ChunkStore::Key key : GetChunkKeys(request.item().flat_trajectory())) {
+    auto it = chunks_.find(key);
+    if (it == chunks_.end()) {
+      return grpc::Status(
+          grpc::StatusCode::INTERNAL,
+          absl::StrCat("Could not find sequence chunk ", key, "."));
+    }
+    item.chunks.push_back(it->second);
+  }
+
+  auto table_it = tables_.find(request.item().table());
+  if (table_it == tables_.end()) {
+    return grpc::Status(grpc::StatusCode::NOT_FOUND,
+                        absl::StrCat("Priority table ", request.item().table(),
+                                     " was not found"));
+  }
+
+  if (request.keep_unreleased_chunks()) {
+    for (ChunkStore::Key key : request.released_chunk_keys()) {
+      chunks_.erase(key);
+      chunk_index_.Remove(key);
+    }
+  } else {
+    // Only keep specified chunks.
+    flat_hash_set<ChunkStore::Key> keep_keys{request.keep_chunk_keys().begin(),
+                                             request.keep_chunk_keys().end()};
+    for (auto it = chunks_.begin(); it != chunks_.end();) {
+      if (keep_keys.contains(it->first)) {
+        ++it;
+      } else {
+        chunk_index_.Remove(it->first);
+        chunks_.erase(it++);
+      }
+    }
+  }
+
+  uint64_t sequence_number;
+  {
+    absl::MutexLock lock(&state_->mu);
+    auto has_capacity = [this]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(state_->mu) {
+      return state_->num_pending_inserts < kMaxPendingInserts ||
+             state_->cancelled;
+    };
+    state_->mu.Await(absl::Condition(&has_capacity));
+    if (state_->cancelled) return grpc::Status::CANCELLED;
+    state_->num_pending_inserts++;
+    sequence_number = state_->ordering.Add(request.item().key(),
+                                           request.send_confirmation());
+  }
+
+  item.item = request.item();
+  table_it->second->InsertOrAssignAsync(
+      std::move(item), [state = state_, sequence_number](absl::Status status) {
+        absl::MutexLock lock(&state->mu);
+        state->num_pending_inserts--;
+        std::vector<uint64_t> keys;
+        state->ordering.Done(sequence_number, &keys);
+        if (!status.ok()) {
+          if (state->status.ok()) state->status = ToGrpcStatus(status);
+        } else {
+          state->confirmations.insert(state->confirmations.end(), keys.begin(),
+                                      keys.end());
+        }
+      });
+  return grpc::Status::OK;
+}
+
+bool LocalInsertStream::WritesDone() {
+  absl::MutexLock lock(&state_->mu);
+  state_->writes_done = true;
+  return !state_->cancelled;
+}
+
+grpc::Status LocalInsertStream::Finish() {
+  absl::MutexLock lock(&state_->mu);
+  state_->writes_done = true;
+  auto done = [this]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(state_->mu) {
+    return state_->num_pending_inserts == 0 || state_->cancelled;
+  };
+  state_->mu.Await(absl::Condition(&done));
+  if (state_->cancelled && state_->status.ok()) {
+    return grpc::Status::CANCELLED;
+  }
+  return state_->status;
+}
+
+void LocalInsertStream::TryCancel() {
+  absl::MutexLock lock(&state_->mu);
+  state_->cancelled = true;
+}
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
@@ -0,0 +1,125 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_LOCAL_INSERT_STREAM_H_
+#define REVERB_CC_LOCAL_INSERT_STREAM_H_
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+
+#include "grpcpp/impl/codegen/status.h"
+#include "grpcpp/impl/codegen/sync_stream.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+#include "reverb/cc/chunk_store.h"
+#include "reverb/cc/platform/hash_map.h"
+#include "reverb/cc/reverb_service.pb.h"
+#include "reverb/cc/support/chunk_column_index.h"
+#include "reverb/cc/support/insert_confirmations.h"
+#include "reverb/cc/table.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+
+// Insert stream which writes directly to tables owned by the same process.
+//
+// The requests are handled exactly as `ReverbServiceImpl::InsertStream` would
+// handle them but without being serialized: chunks are wrapped as
+// `ChunkStore::Chunk`s (kept alive by the items that reference them) and items
+// are inserted with `Table::InsertOrAssignAsync`. At most `kMaxPendingInserts`
+// inserts are in flight at any time, `Write` blocks once the limit is reached.
+// Confirmations are returned by `Read` in the order the items were written,
+// each once the item and all items written before it have been inserted, and
+// all confirmations which are ready are batched into a single response.
+//
+// `Write` must not be called concurrently with itself but all other methods
+// are thread safe.
+class LocalInsertStream
+    : public grpc::ClientReaderWriterInterface<InsertStreamRequest,
+                                               InsertStreamResponse> {
+ public:
+  static constexpr int kMaxPendingInserts = 8;
+
+  explicit LocalInsertStream(
+      flat_hash_map<std::string, std::shared_ptr<Table>> tables);
+
+  ~LocalInsertStream() override;
+
+  void WaitForInitialMetadata() override {}
+
+  bool NextMessageSize(uint32_t* sz) override;
+
+  // Blocks until a confirmation is available. Returns false once the stream
+  // has failed or been cancelled, or once `Finish` has been called and all
+  // confirmations have been read.
+  bool Read(InsertStreamResponse* response) override;
+
+  // Returns false if the request could not be handled (in which case `Finish`
+  // returns the reason) or if the stream has been cancelled.
+  bool Write(const InsertStreamRequest& request,
+             grpc::WriteOptions options) override;
+
+  bool WritesDone() override;
+
+  // Waits for the pending inserts to complete, unless the stream has been
+  // cancelled, and returns the status of the stream.
+  grpc::Status Finish() override;
+
+  // Unblocks all pending and future calls. Inserts which have already been
+  // handed to a table are not withdrawn but their confirmations are dropped.
+  void TryCancel();
+
+ private:
+  // State shared with the table callbacks, which may outlive the stream if it
+  // is cancelled.
+  struct State {
+    absl::Mutex mu;
+    int num_pending_inserts ABSL_GUARDED_BY(mu) = 0;
+    bool cancelled ABSL_GUARDED_BY(mu) = false;
+    bool writes_done ABSL_GUARDED_BY(mu) = false;
+    grpc::Status status ABSL_GUARDED_BY(mu);
+    // Orders the confirmations of items inserted into different tables.
+    InsertConfirmations ordering ABSL_GUARDED_BY(mu);
+    // Confirmations released by `ordering` which have not yet been read.
+    std::deque<uint64_t> confirmations ABSL_GUARDED_BY(mu);
+  };
+
+  // Stores the chunk or inserts the item of `request`, which must not be a
+  // batch.
+  grpc::Status HandleRequest(const InsertStreamRequest& request);
+
+  // Resolves the chunks of `request` and inserts the item.
+  grpc::Status InsertItem(const InsertStreamRequest::PriorityInsertion& request);
+
+  const flat_hash_map<std::string, std::shared_ptr<Table>> tables_;
+
+  // Chunks that can be referenced by the items of the stream. Only accessed
+  // from `Write`, which the caller must not call concurrently.
+  flat_hash_map<ChunkStore::Key, std::shared_ptr<ChunkStore::Chunk>> chunks_;
+
+  // Index of `chunks_` by writer column, used to expand assembled
+  // trajectories. Only accessed from `Write`.
+  ChunkColumnIndex chunk_index_;
+
+  std::shared_ptr<State> state_;
+};
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_LOCAL_INSERT_STREAM_H_
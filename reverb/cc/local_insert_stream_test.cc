@@ -0,0 +1,141 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/local_insert_stream.h"
+
+#include <cfloat>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/memory/memory.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/time.h"
+#include "reverb/cc/platform/thread.h"
+#include "reverb/cc/rate_limiter.h"
+#include "reverb/cc/reverb_service.pb.h"
+#include "reverb/cc/selectors/fifo.h"
+#include "reverb/cc/selectors/uniform.h"
+#include "reverb/cc/table.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+namespace {
+
+InsertStreamRequest MakeChunkRequest(uint64_t key) {
+  InsertStreamRequest request;
+  request.mutable_chunk()->set_chunk_key(key);
+  return request;
+}
+
+InsertStreamRequest MakeItemRequest(uint64_t key, uint64_t chunk_key,
+                                    const std::vector<uint64_t>& keep_keys,
+                                    const std::string& table = "dist") {
+  InsertStreamRequest request;
+  auto* item = request.mutable_item()->mutable_item();
+  item->set_key(key);
+  item->set_table(table);
+  item->set_priority(1);
+  auto* slice =
+      item->mutable_flat_trajectory()->add_columns()->add_chunk_slices();
+  slice->set_chunk_key(chunk_key);
+  slice->set_length(1);
+  for (uint64_t keep_key : keep_keys) {
+    request.mutable_item()->add_keep_chunk_keys(keep_key);
+  }
+  request.mutable_item()->set_send_confirmation(true);
+  return request;
+}
+
+class LocalInsertStreamTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    table_ = std::make_shared<Table>(
+        "dist", std::make_shared<UniformSelector>(),
+        std::make_shared<FifoSelector>(), 1000, 0,
+        std::make_shared<RateLimiter>(1.0, 1, -DBL_MAX, DBL_MAX));
+    stream_ = absl::make_unique<LocalInsertStream>(
+        flat_hash_map<std::string, std::shared_ptr<Table>>{{"dist", table_}});
+  }
+
+  std::shared_ptr<Table> table_;
+  std::unique_ptr<LocalInsertStream> stream_;
+};
+
+TEST_F(LocalInsertStreamTest, InsertsItemsAndConfirmsThem) {
+  ASSERT_TRUE(stream_->Write(MakeChunkRequest(1), grpc::WriteOptions()));
+  ASSERT_TRUE(stream_->Write(MakeItemRequest(10, 1, {1}), grpc::WriteOptions()));
+  ASSERT_TRUE(stream_->Write(MakeItemRequest(11, 1, {}), grpc::WriteOptions()));
+
+  // The confirmations are returned in order but may be batched.
+  std::vector<uint64_t> confirmed;
+  InsertStreamResponse response;
+  while (confirmed.size() < 2) {
+    ASSERT_TRUE(stream_->Read(&response));
+    confirmed.push_back(response.key());
+    confirmed.insert(confirmed.end(), response.keys().begin(),
+                     response.keys().end());
+  }
+  EXPECT_THAT(confirmed, ::testing::ElementsAre(10, 11));
+
+  EXPECT_TRUE(stream_->Finish().ok());
+  EXPECT_FALSE(stream_->Read(&response));
+  EXPECT_EQ(table_->size(), 2);
+}
+
+TEST_F(LocalInsertStreamTest, ItemWithMissingChunkFails) {
+  ASSERT_TRUE(stream_->Write(MakeChunkRequest(1), grpc::WriteOptions()));
+  EXPECT_FALSE(stream_->Write(MakeItemRequest(10, 2, {}), grpc::WriteOptions()));
+  EXPECT_EQ(stream_->Finish().error_code(), grpc::StatusCode::INTERNAL);
+  EXPECT_EQ(table_->size(), 0);
+}
+
+TEST_F(LocalInsertStreamTest, ChunksNotKeptCannotBeReferenced) {
+  ASSERT_TRUE(stream_->Write(MakeChunkRequest(1), grpc::WriteOptions()));
+  ASSERT_TRUE(stream_->Write(MakeItemRequest(10, 1, {}), grpc::WriteOptions()));
+  EXPECT_FALSE(stream_->Write(MakeItemRequest(11, 1, {}), grpc::WriteOptions()));
+  EXPECT_EQ(stream_->Finish().error_code(), grpc::StatusCode::INTERNAL);
+  EXPECT_EQ(table_->size(), 1);
+}
+
+TEST_F(LocalInsertStreamTest, ItemForMissingTableFails) {
+  ASSERT_TRUE(stream_->Write(MakeChunkRequest(1), grpc::WriteOptions()));
+  EXPECT_FALSE(stream_->Write(MakeItemRequest(10, 1, {}, "missing"),
+                              grpc::WriteOptions()));
+  EXPECT_EQ(stream_->Finish().error_code(), grpc::StatusCode::NOT_FOUND);
+}
+
+TEST_F(LocalInsertStreamTest, TryCancelUnblocksRead) {
+  absl::Notification done;
+  auto reader = StartThread("Reader", [&] {
+    InsertStreamResponse response;
+    EXPECT_FALSE(stream_->Read(&response));
+    done.Notify();
+  });
+
+  EXPECT_FALSE(done.WaitForNotificationWithTimeout(absl::Milliseconds(50)));
+  stream_->TryCancel();
+  done.WaitForNotification();
+
+  EXPECT_FALSE(stream_->Write(MakeChunkRequest(1), grpc::WriteOptions()));
+  EXPECT_EQ(stream_->Finish().error_code(), grpc::StatusCode::CANCELLED);
+}
+
+}  // namespace
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
@@ -19,7 +19,10 @@
 #include <vector>
 
 #include <cstdint>
+#include "absl/base/thread_annotations.h"
 #include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+#include "reverb/cc/priority_updater.h"
 #include "reverb/cc/support/tf_util.h"
 #include "tensorflow/core/framework/op.h"
 #include "tensorflow/core/framework/op_kernel.h"
@@ -66,6 +69,7 @@ opening and closing the stream with each call.
 )doc");
 
 REGISTER_OP("ReverbClientUpdatePriorities")
+    .Attr("asynchronous: bool = false")
     .Input("handle: resource")
     .Input("table: string")
     .Input("keys: uint64")
@@ -74,6 +78,11 @@ REGISTER_OP("ReverbClientUpdatePriorities")
 Blocking call to update the priorities of a collection of items. Keys that could
 not be found in table `table` on server are ignored and does not impact the rest
 of the request.
+
+If `asynchronous` is set then the updates are instead buffered by the client
+resource and sent in the background, merged with the other updates of the same
+table. The op then returns without waiting for the server and the error of a
+failed update is returned by a later call.
 )doc");
 
 REGISTER_OP("ReverbClientInsert")
@@ -102,10 +111,25 @@ class ClientResource : public tensorflow::ResourceBase {
 
   Client* client() { return &client_; }
 
+  // Returns the updater shared by the asynchronous `UpdatePrioritiesOp`s of
+  // the resource, creating it on first use.
+  tensorflow::Status GetPriorityUpdater(PriorityUpdater** updater) {
+    absl::MutexLock lock(&mu_);
+    if (priority_updater_ == nullptr) {
+      TF_RETURN_IF_ERROR(ToTensorflowStatus(client_.NewPriorityUpdater(
+          PriorityUpdater::Options(), &priority_updater_)));
+    }
+    *updater = priority_updater_.get();
+    return tensorflow::Status::OK();
+  }
+
  private:
   Client client_;
   std::string server_address_;
 
+  absl::Mutex mu_;
+  std::unique_ptr<PriorityUpdater> priority_updater_ ABSL_GUARDED_BY(mu_);
+
   TF_DISALLOW_COPY_AND_ASSIGN(ClientResource);
 };
 
@@ -175,7 +199,9 @@ class SampleOp : public tensorflow::OpKernel {
 class UpdatePrioritiesOp : public tensorflow::OpKernel {
  public:
   explicit UpdatePrioritiesOp(tensorflow::OpKernelConstruction* context)
-      : OpKernel(context) {}
+      : OpKernel(context) {
+    OP_REQUIRES_OK(context, context->GetAttr("asynchronous", &asynchronous_));
+  }
 
   void Compute(tensorflow::OpKernelContext* context) override {
     ClientResource* resource;
@@ -207,6 +233,14 @@ class UpdatePrioritiesOp : public tensorflow::OpKernel {
       updates.push_back(std::move(update));
     }
 
+    if (asynchronous_) {
+      PriorityUpdater* updater;
+      OP_REQUIRES_OK(context, resource->GetPriorityUpdater(&updater));
+      OP_REQUIRES_OK(context,
+                     ToTensorflowStatus(updater->Update(table_str, updates)));
+      return;
+    }
+
     // The call will only fail if the Reverb-server is brought down during an
     // active call (e.g preempted). When this happens the request is retried and
     // since MutatePriorities sets `wait_for_ready` the request will no be sent
@@ -219,6 +253,9 @@ class UpdatePrioritiesOp : public tensorflow::OpKernel {
     OP_REQUIRES_OK(context, ToTensorflowStatus(status));
   }
 
+ private:
+  bool asynchronous_;
+
   TF_DISALLOW_COPY_AND_ASSIGN(UpdatePrioritiesOp);
 };
 
@@ -14,9 +14,18 @@
 
 #include "tensorflow/core/framework/dataset.h"
 
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+
 #include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
 #include "reverb/cc/client.h"
 #include "reverb/cc/errors.h"
+#include "reverb/cc/platform/hash_map.h"
 #include "reverb/cc/platform/logging.h"
 #include "reverb/cc/sampler.h"
 #include "reverb/cc/support/tf_util.h"
@@ -24,6 +33,7 @@
 #include "tensorflow/core/framework/op.h"
 #include "tensorflow/core/framework/op_kernel.h"
 #include "tensorflow/core/framework/tensor_shape.h"
+#include "tensorflow/core/framework/tensor_util.h"
 #include "tensorflow/core/framework/types.h"
 
 namespace deepmind {
@@ -45,6 +55,7 @@ REGISTER_OP("ReverbDataset")
     .Attr("max_samples_per_stream: int = -1")
     .Attr("rate_limiter_timeout_ms: int = -1")
     .Attr("flexible_batch_size: int = -1")
+    .Attr("share_sampler: bool = false")
     .Attr("dtypes: list(type) >= 1")
     .Attr("shapes: list(shape) >= 1")
     .Output("dataset: variant")
@@ -109,8 +120,61 @@ auto selected value should almost always be preferred.
 Larger `flexible_batch_size` values result a bias towards sampling over
 inserts. In highly overloaded systems this results in higher sample QPS
 and lower insert QPS compared to lower `flexible_batch_size` values.
+
+`share_sampler` (defaults to false) makes the iterators of all datasets in the
+process which sample from the same table of the same server, with the same
+options, dtypes and shapes, share a single `Sampler` instead of creating one
+each. The number of streams and workers then stays constant as the number of
+iterators (e.g. of an `interleave`) grows, while the iterators take turns to
+pop complete samples. Requires `emit_timesteps` to be false. Cancelling any of
+the iterators closes the shared sampler.
 )doc");
 
+// Maximum number of timesteps fetched from the sampler at once when timesteps
+// are emitted. The timesteps are emitted one by one from the fetched slices
+// which saves the per call overhead of `Sampler::GetNextTimestep`.
+constexpr int kMaxTimestepsPerFetch = 256;
+
+// `Sampler` shared by the iterators which set `share_sampler`. `Sampler` does
+// not support concurrent calls so the iterators take turns through `mu`.
+struct SharedSampler {
+  absl::Mutex mu;
+  std::unique_ptr<Sampler> sampler;
+
+  // Set once an iterator has closed the sampler (i.e. was cancelled). Closed
+  // samplers are not handed out to new iterators.
+  std::atomic<bool> closed{false};
+};
+
+// Returns the open `SharedSampler` registered under `key`, or registers and
+// returns a sampler created by `create_fn` if there is none. The registry only
+// holds weak references so a sampler is destroyed along with the last iterator
+// using it.
+tensorflow::Status GetOrCreateSharedSampler(
+    const std::string& key,
+    const std::function<tensorflow::Status(std::unique_ptr<Sampler>*)>&
+        create_fn,
+    std::shared_ptr<SharedSampler>* shared_sampler) {
+  static auto* mu = new absl::Mutex();
+  static auto* samplers =
+      new internal::flat_hash_map<std::string, std::weak_ptr<SharedSampler>>();
+
+  absl::MutexLock lock(mu);
+  if (auto it = samplers->find(key); it != samplers->end()) {
+    auto existing = it->second.lock();
+    if (existing != nullptr && !existing->closed) {
+      *shared_sampler = std::move(existing);
+      return tensorflow::Status::OK();
+    }
+  }
+
+  auto created = std::make_shared<SharedSampler>();
+  TF_RETURN_IF_ERROR(create_fn(&created->sampler));
+  (*samplers)[key] = created;
+  *shared_sampler = std::move(created);
+  return tensorflow::Status::OK();
+}
+
 class ReverbDatasetOp : public tensorflow::data::DatasetOpKernel {
  public:
   explicit ReverbDatasetOp(tensorflow::OpKernelConstruction* ctx)
@@ -126,6 +190,7 @@ class ReverbDatasetOp : public tensorflow::data::DatasetOpKernel {
                                      &sampler_options_.flexible_batch_size));
     OP_REQUIRES_OK(ctx, ctx->GetAttr("sequence_length", &sequence_length_));
     OP_REQUIRES_OK(ctx, ctx->GetAttr("emit_timesteps", &emit_timesteps_));
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("share_sampler", &share_sampler_));
     tensorflow::int64 rate_limiter_timeout_ms;
     OP_REQUIRES_OK(
         ctx, ctx->GetAttr("rate_limiter_timeout_ms", &rate_limiter_timeout_ms));
@@ -155,6 +220,11 @@ class ReverbDatasetOp : public tensorflow::data::DatasetOpKernel {
       }
     }
 
+    // The timesteps of a sample must all be returned by the same iterator.
+    OP_REQUIRES(ctx, !share_sampler_ || !emit_timesteps_,
+                InvalidArgument("share_sampler requires emit_timesteps to be "
+                                "false."));
+
     OP_REQUIRES_OK(ctx, ToTensorflowStatus(sampler_options_.Validate()));
   }
 
@@ -170,7 +240,8 @@ class ReverbDatasetOp : public tensorflow::data::DatasetOpKernel {
                        ctx, "table", &table));
 
     *output = new Dataset(ctx, server_address, dtypes_, shapes_, table,
-                          sampler_options_, sequence_length_, emit_timesteps_);
+                          sampler_options_, sequence_length_, emit_timesteps_,
+                          share_sampler_);
   }
 
  private:
@@ -180,7 +251,7 @@ class ReverbDatasetOp : public tensorflow::data::DatasetOpKernel {
             tensorflow::DataTypeVector dtypes,
             std::vector<tensorflow::PartialTensorShape> shapes,
             std::string table, const Sampler::Options& sampler_options,
-            int sequence_length, bool emit_timesteps)
+            int sequence_length, bool emit_timesteps, bool share_sampler)
         : tensorflow::data::DatasetBase(tensorflow::data::DatasetContext(ctx)),
           server_address_(std::move(server_address)),
           dtypes_(std::move(dtypes)),
@@ -189,7 +260,24 @@ class ReverbDatasetOp : public tensorflow::data::DatasetOpKernel {
           sampler_options_(sampler_options),
           sequence_length_(sequence_length),
           emit_timesteps_(emit_timesteps),
-          client_(absl::make_unique<Client>(server_address_)) {}
+          share_sampler_(share_sampler),
+          client_(absl::make_unique<Client>(server_address_)) {
+      // Iterators can only share a sampler if everything which affects the
+      // samples it returns is the same.
+      if (share_sampler_) {
+        shared_sampler_key_ = absl::StrCat(
+            server_address_, "|", table_, "|",
+            sampler_options_.max_in_flight_samples_per_worker, "|",
+            sampler_options_.num_workers, "|",
+            sampler_options_.max_samples_per_stream, "|",
+            absl::FormatDuration(sampler_options_.rate_limiter_timeout), "|",
+            sampler_options_.flexible_batch_size, "|", sequence_length_, "|",
+            tensorflow::DataTypeVectorString(dtypes_));
+        for (const auto& shape : shapes_) {
+          absl::StrAppend(&shared_sampler_key_, "|", shape.DebugString());
+        }
+      }
+    }
 
     std::unique_ptr<tensorflow::data::IteratorBase> MakeIteratorInternal(
         const std::string& prefix) const override {
@@ -197,7 +285,7 @@ class ReverbDatasetOp : public tensorflow::data::DatasetOpKernel {
           tensorflow::data::DatasetIterator<Dataset>::Params{
               this, absl::StrCat(prefix, "::ReverbDataset")},
           client_.get(), table_, sampler_options_, sequence_length_,
-          emit_timesteps_, dtypes_, shapes_);
+          emit_timesteps_, dtypes_, shapes_, shared_sampler_key_);
     }
 
     const tensorflow::DataTypeVector& output_dtypes() const override {
@@ -228,6 +316,7 @@ class ReverbDatasetOp : public tensorflow::data::DatasetOpKernel {
       tensorflow::AttrValue emit_timesteps_attr;
       tensorflow::AttrValue rate_limiter_timeout_ms_attr;
       tensorflow::AttrValue flexible_batch_size_attr;
+      tensorflow::AttrValue share_sampler_attr;
       tensorflow::AttrValue dtypes_attr;
       tensorflow::AttrValue shapes_attr;
 
@@ -250,6 +339,7 @@ class ReverbDatasetOp : public tensorflow::data::DatasetOpKernel {
       b->BuildAttrValue(emit_timesteps_, &emit_timesteps_attr);
       b->BuildAttrValue(sampler_options_.flexible_batch_size,
                         &flexible_batch_size_attr);
+      b->BuildAttrValue(share_sampler_, &share_sampler_attr);
       b->BuildAttrValue(dtypes_, &dtypes_attr);
       b->BuildAttrValue(shapes_, &shapes_attr);
 
@@ -266,6 +356,7 @@ class ReverbDatasetOp : public tensorflow::data::DatasetOpKernel {
               {"emit_timesteps", emit_timesteps_attr},
               {"rate_limiter_timeout_ms", rate_limiter_timeout_ms_attr},
               {"flexible_batch_size", flexible_batch_size_attr},
+              {"share_sampler", share_sampler_attr},
               {"dtypes", dtypes_attr},
               {"shapes", shapes_attr},
           },
@@ -281,7 +372,8 @@ class ReverbDatasetOp : public tensorflow::data::DatasetOpKernel {
           const Params& params, Client* client, const std::string& table,
           const Sampler::Options& sampler_options, int sequence_length,
           bool emit_timesteps, const tensorflow::DataTypeVector& dtypes,
-          const std::vector<tensorflow::PartialTensorShape>& shapes)
+          const std::vector<tensorflow::PartialTensorShape>& shapes,
+          const std::string& shared_sampler_key)
           : DatasetIterator<Dataset>(params),
             client_(client),
             table_(table),
@@ -290,63 +382,45 @@ class ReverbDatasetOp : public tensorflow::data::DatasetOpKernel {
             emit_timesteps_(emit_timesteps),
             dtypes_(dtypes),
             shapes_(shapes),
+            shared_sampler_key_(shared_sampler_key),
             step_within_sample_(0) {}
 
       tensorflow::Status Initialize(
           tensorflow::data::IteratorContext* ctx) override {
-        // If sequences are emitted then the all shapes will start with the
-        // sequence length. The validation expects the shapes of a single
-        // timestep so if sequences are emitted then we need to trim the leading
-        // dim on all shapes before validating it.
-        auto validation_shapes = shapes_;
-        if (!emit_timesteps_) {
-          for (auto& shape : validation_shapes) {
-            shape.RemoveDim(0);
-          }
+        if (shared_sampler_key_.empty()) {
+          TF_RETURN_IF_ERROR(CreateSampler(&owned_sampler_));
+          sampler_ = owned_sampler_.get();
+          return tensorflow::Status::OK();
         }
 
-        constexpr auto kValidationTimeout = absl::Seconds(30);
-        auto status = client_->NewSampler(table_, sampler_options_,
-                                          /*validation_dtypes=*/dtypes_,
-                                          validation_shapes, kValidationTimeout,
-                                          &sampler_);
-        if (absl::IsDeadlineExceeded(status)) {
-          REVERB_LOG(REVERB_WARNING)
-              << "Unable to validate shapes and dtypes of new sampler for '"
-              << table_ << "' as server could not be reached in time ("
-              << kValidationTimeout
-              << "). We were thus unable to fetch signature from server. The "
-                 "sampler will be constructed without validating the dtypes "
-                 "and shapes.";
-          // Ask for a NewSampler with negative validation_timeout Duration,
-          // which causes it to skip the validation and return an OK status.
-          return ToTensorflowStatus(client_->NewSampler(
-              table_, sampler_options_,
-              /*validation_timeout=*/-absl::InfiniteDuration(), &sampler_));
-        }
-        return ToTensorflowStatus(status);
+        TF_RETURN_IF_ERROR(GetOrCreateSharedSampler(
+            shared_sampler_key_,
+            [this](std::unique_ptr<Sampler>* sampler) {
+              return CreateSampler(sampler);
+            },
+            &shared_sampler_));
+        sampler_ = shared_sampler_->sampler.get();
+        return tensorflow::Status::OK();
       }
 
       tensorflow::Status GetNextInternal(
           tensorflow::data::IteratorContext* ctx,
           std::vector<tensorflow::Tensor>* out_tensors,
           bool* end_of_sequence) override {
-        REVERB_CHECK(sampler_.get() != nullptr) << "Initialize was not called?";
+        REVERB_CHECK(sampler_ != nullptr) << "Initialize was not called?";
 
         auto token = ctx->cancellation_manager()->get_cancellation_token();
         bool registered = ctx->cancellation_manager()->RegisterCallback(
-            token, [&] { sampler_->Close(); });
+            token, [&] { CloseSampler(); });
         if (!registered) {
-          sampler_->Close();
+          CloseSampler();
         }
 
         tensorflow::Status status;
         if (emit_timesteps_) {
           bool last_timestep = false;
-          status = ToTensorflowStatus(
-              sampler_->GetNextTimestep(out_tensors, &last_timestep));
-
-          step_within_sample_++;
+          status = GetNextTimestep(out_tensors, &last_timestep);
+          if (status.ok()) step_within_sample_++;
 
           if (last_timestep && sequence_length_ > 0 &&
               step_within_sample_ != sequence_length_) {
@@ -363,6 +437,9 @@ class ReverbDatasetOp : public tensorflow::data::DatasetOpKernel {
           if (last_timestep) {
             step_within_sample_ = 0;
           }
+        } else if (shared_sampler_ != nullptr) {
+          absl::MutexLock lock(&shared_sampler_->mu);
+          status = ToTensorflowStatus(sampler_->GetNextSample(out_tensors));
         } else {
           status = ToTensorflowStatus(sampler_->GetNextSample(out_tensors));
         }
@@ -399,6 +476,76 @@ class ReverbDatasetOp : public tensorflow::data::DatasetOpKernel {
       }
 
      private:
+      // Emits the next timestep from `timesteps_`, which is refilled through
+      // `Sampler::GetNextTimesteps` once all its timesteps have been emitted.
+      tensorflow::Status GetNextTimestep(std::vector<tensorflow::Tensor>* data,
+                                         bool* last_timestep) {
+        if (next_timestep_ == num_timesteps_) {
+          TF_RETURN_IF_ERROR(ToTensorflowStatus(sampler_->GetNextTimesteps(
+              kMaxTimestepsPerFetch, &timesteps_, &timesteps_end_sample_)));
+          num_timesteps_ = timesteps_.front().dim_size(0);
+          next_timestep_ = 0;
+        }
+
+        data->clear();
+        data->reserve(timesteps_.size());
+        for (const auto& t : timesteps_) {
+          auto slice = t.SubSlice(next_timestep_);
+          if (slice.IsAligned()) {
+            data->push_back(std::move(slice));
+          } else {
+            data->push_back(tensorflow::tensor::DeepCopy(slice));
+          }
+        }
+        *last_timestep =
+            ++next_timestep_ == num_timesteps_ && timesteps_end_sample_;
+        return tensorflow::Status::OK();
+      }
+
+      // Creates a sampler which validates the dtypes and shapes of the samples
+      // unless the signature could not be fetched in time.
+      tensorflow::Status CreateSampler(std::unique_ptr<Sampler>* sampler) {
+        // If sequences are emitted then the all shapes will start with the
+        // sequence length. The validation expects the shapes of a single
+        // timestep so if sequences are emitted then we need to trim the leading
+        // dim on all shapes before validating it.
+        auto validation_shapes = shapes_;
+        if (!emit_timesteps_) {
+          for (auto& shape : validation_shapes) {
+            shape.RemoveDim(0);
+          }
+        }
+
+        constexpr auto kValidationTimeout = absl::Seconds(30);
+        auto status = client_->NewSampler(table_, sampler_options_,
+                                          /*validation_dtypes=*/dtypes_,
+                                          validation_shapes, kValidationTimeout,
+                                          sampler);
+        if (absl::IsDeadlineExceeded(status)) {
+          REVERB_LOG(REVERB_WARNING)
+              << "Unable to validate shapes and dtypes of new sampler for '"
+              << table_ << "' as server could not be reached in time ("
+              << kValidationTimeout
+              << "). We were thus unable to fetch signature from server. The "
+                 "sampler will be constructed without validating the dtypes "
+                 "and shapes.";
+          // Ask for a NewSampler with negative validation_timeout Duration,
+          // which causes it to skip the validation and return an OK status.
+          return ToTensorflowStatus(client_->NewSampler(
+              table_, sampler_options_,
+              /*validation_timeout=*/-absl::InfiniteDuration(), sampler));
+        }
+        return ToTensorflowStatus(status);
+      }
+
+      // Closes the sampler, and marks it as closed if it is shared.
+      void CloseSampler() {
+        sampler_->Close();
+        if (shared_sampler_ != nullptr) {
+          shared_sampler_->closed = true;
+        }
+      }
+
       Client* client_;
       const std::string& table_;
       const Sampler::Options sampler_options_;
@@ -406,8 +553,23 @@ class ReverbDatasetOp : public tensorflow::data::DatasetOpKernel {
       const bool emit_timesteps_;
       const tensorflow::DataTypeVector& dtypes_;
       const std::vector<tensorflow::PartialTensorShape>& shapes_;
-      std::unique_ptr<Sampler> sampler_;
+      const std::string& shared_sampler_key_;
+
+      // The sampler is either owned by the iterator or shared with other
+      // iterators (if `shared_sampler_key_` is non-empty).
+      std::unique_ptr<Sampler> owned_sampler_;
+      std::shared_ptr<SharedSampler> shared_sampler_;
+      Sampler* sampler_ = nullptr;
+
       int step_within_sample_;
+
+      // Timesteps fetched by `GetNextTimestep` but not yet emitted. Only the
+      // timesteps from `next_timestep_` onwards remain to be emitted.
+      // `timesteps_end_sample_` is set if the last of them ends its sample.
+      std::vector<tensorflow::Tensor> timesteps_;
+      int64_t num_timesteps_ = 0;
+      int64_t next_timestep_ = 0;
+      bool timesteps_end_sample_ = false;
     };  // Iterator.
 
     const std::string server_address_;
@@ -417,12 +579,15 @@ class ReverbDatasetOp : public tensorflow::data::DatasetOpKernel {
     const Sampler::Options sampler_options_;
     const int sequence_length_;
     const bool emit_timesteps_;
+    const bool share_sampler_;
+    std::string shared_sampler_key_;
     std::unique_ptr<Client> client_;
   };  // Dataset.
 
   Sampler::Options sampler_options_;
   int sequence_length_;
   bool emit_timesteps_;
+  bool share_sampler_;
   tensorflow::DataTypeVector dtypes_;
   std::vector<tensorflow::PartialTensorShape> shapes_;
 
@@ -42,6 +42,7 @@ REGISTER_OP("ReverbTrajectoryDataset")
     .Attr("max_samples_per_stream: int = -1")
     .Attr("rate_limiter_timeout_ms: int = -1")
     .Attr("flexible_batch_size: int = -1")
+    .Attr("batch_size: int = 0")
     .Attr("dtypes: list(type) >= 1")
     .Attr("shapes: list(shape) >= 1")
     .Output("dataset: variant")
@@ -94,6 +95,14 @@ auto selected value should almost always be preferred.
 Larger `flexible_batch_size` values result a bias towards sampling over
 inserts. In highly overloaded systems this results in higher sample QPS
 and lower insert QPS compared to lower `flexible_batch_size` values.
+
+`batch_size` (defaults to 0, i.e. no batching) is the number of trajectories
+in each element when > 0. Every element is then built by a single call to
+`Sampler::GetNextBatch` which decodes the samples straight into tensors of shape
+`[batch_size, ...shapes]` instead of leaving `tf.data` to concatenate one
+element per trajectory. `shapes` still describe a single trajectory. Samples of
+an incomplete batch are dropped when `rate_limiter_timeout_ms` ends the
+sequence.
 )doc");
 
 class ReverbTrajectoryDatasetOp : public tensorflow::data::DatasetOpKernel {
@@ -109,6 +118,10 @@ class ReverbTrajectoryDatasetOp : public tensorflow::data::DatasetOpKernel {
                                      &sampler_options_.max_samples_per_stream));
     OP_REQUIRES_OK(ctx, ctx->GetAttr("flexible_batch_size",
                                      &sampler_options_.flexible_batch_size));
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("batch_size", &batch_size_));
+    OP_REQUIRES(ctx, batch_size_ >= 0,
+                tensorflow::errors::InvalidArgument(
+                    "batch_size must be >= 0 but got ", batch_size_));
     tensorflow::int64 rate_limiter_timeout_ms;
     OP_REQUIRES_OK(
         ctx, ctx->GetAttr("rate_limiter_timeout_ms", &rate_limiter_timeout_ms));
@@ -133,7 +146,7 @@ class ReverbTrajectoryDatasetOp : public tensorflow::data::DatasetOpKernel {
                        ctx, "table", &table));
 
     *output = new Dataset(ctx, server_address, dtypes_, shapes_, table,
-                          sampler_options_);
+                          sampler_options_, batch_size_);
   }
 
  private:
@@ -142,21 +155,33 @@ class ReverbTrajectoryDatasetOp : public tensorflow::data::DatasetOpKernel {
     Dataset(tensorflow::OpKernelContext* ctx, std::string server_address,
             tensorflow::DataTypeVector dtypes,
             std::vector<tensorflow::PartialTensorShape> shapes,
-            std::string table, const Sampler::Options& sampler_options)
+            std::string table, const Sampler::Options& sampler_options,
+            int batch_size)
         : tensorflow::data::DatasetBase(tensorflow::data::DatasetContext(ctx)),
           server_address_(std::move(server_address)),
           dtypes_(std::move(dtypes)),
           shapes_(std::move(shapes)),
           table_(std::move(table)),
           sampler_options_(sampler_options),
-          client_(absl::make_unique<Client>(server_address_)) {}
+          batch_size_(batch_size),
+          client_(absl::make_unique<Client>(server_address_)) {
+      // Elements of batched datasets have a leading batch dimension.
+      output_shapes_ = shapes_;
+      if (batch_size_ > 0) {
+        for (auto& shape : output_shapes_) {
+          shape = tensorflow::PartialTensorShape({batch_size_})
+                      .Concatenate(shape);
+        }
+      }
+    }
 
     std::unique_ptr<tensorflow::data::IteratorBase> MakeIteratorInternal(
         const std::string& prefix) const override {
       return absl::make_unique<Iterator>(
           tensorflow::data::DatasetIterator<Dataset>::Params{
               this, absl::StrCat(prefix, "::ReverbDataset")},
-          client_.get(), table_, sampler_options_, dtypes_, shapes_);
+          client_.get(), table_, sampler_options_, dtypes_, shapes_,
+          batch_size_);
     }
 
     const tensorflow::DataTypeVector& output_dtypes() const override {
@@ -165,7 +190,7 @@ class ReverbTrajectoryDatasetOp : public tensorflow::data::DatasetOpKernel {
 
     const std::vector<tensorflow::PartialTensorShape>& output_shapes()
         const override {
-      return shapes_;
+      return output_shapes_;
     }
 
     std::string DebugString() const override {
@@ -185,6 +210,7 @@ class ReverbTrajectoryDatasetOp : public tensorflow::data::DatasetOpKernel {
       tensorflow::AttrValue max_samples_per_stream_attr;
       tensorflow::AttrValue rate_limiter_timeout_ms_attr;
       tensorflow::AttrValue flexible_batch_size_attr;
+      tensorflow::AttrValue batch_size_attr;
       tensorflow::AttrValue dtypes_attr;
       tensorflow::AttrValue shapes_attr;
 
@@ -205,6 +231,7 @@ class ReverbTrajectoryDatasetOp : public tensorflow::data::DatasetOpKernel {
           &rate_limiter_timeout_ms_attr);
       b->BuildAttrValue(sampler_options_.flexible_batch_size,
                         &flexible_batch_size_attr);
+      b->BuildAttrValue(batch_size_, &batch_size_attr);
       b->BuildAttrValue(dtypes_, &dtypes_attr);
       b->BuildAttrValue(shapes_, &shapes_attr);
 
@@ -219,6 +246,7 @@ class ReverbTrajectoryDatasetOp : public tensorflow::data::DatasetOpKernel {
               {"max_samples_per_stream", max_samples_per_stream_attr},
               {"rate_limiter_timeout_ms", rate_limiter_timeout_ms_attr},
               {"flexible_batch_size", flexible_batch_size_attr},
+              {"batch_size", batch_size_attr},
               {"dtypes", dtypes_attr},
               {"shapes", shapes_attr},
           },
@@ -234,13 +262,15 @@ class ReverbTrajectoryDatasetOp : public tensorflow::data::DatasetOpKernel {
           const Params& params, Client* client, const std::string& table,
           const Sampler::Options& sampler_options,
           const tensorflow::DataTypeVector& dtypes,
-          const std::vector<tensorflow::PartialTensorShape>& shapes)
+          const std::vector<tensorflow::PartialTensorShape>& shapes,
+          int batch_size)
           : DatasetIterator<Dataset>(params),
             client_(client),
             table_(table),
             sampler_options_(sampler_options),
             dtypes_(dtypes),
             shapes_(shapes),
+            batch_size_(batch_size),
             step_within_sample_(0) {}
 
       tensorflow::Status Initialize(
@@ -280,8 +310,9 @@ class ReverbTrajectoryDatasetOp : public tensorflow::data::DatasetOpKernel {
           sampler_->Close();
         }
 
-        auto status =
-            ToTensorflowStatus(sampler_->GetNextTrajectory(out_tensors));
+        auto status = ToTensorflowStatus(
+            batch_size_ > 0 ? sampler_->GetNextBatch(batch_size_, out_tensors)
+                            : sampler_->GetNextTrajectory(out_tensors));
         if (registered &&
             !ctx->cancellation_manager()->DeregisterCallback(token)) {
           return Cancelled("Iterator context was cancelled");
@@ -319,6 +350,7 @@ class ReverbTrajectoryDatasetOp : public tensorflow::data::DatasetOpKernel {
       const Sampler::Options sampler_options_;
       const tensorflow::DataTypeVector& dtypes_;
       const std::vector<tensorflow::PartialTensorShape>& shapes_;
+      const int batch_size_;
       std::unique_ptr<Sampler> sampler_;
       int step_within_sample_;
     };  // Iterator.
@@ -328,10 +360,13 @@ class ReverbTrajectoryDatasetOp : public tensorflow::data::DatasetOpKernel {
     const std::vector<tensorflow::PartialTensorShape> shapes_;
     const std::string table_;
     const Sampler::Options sampler_options_;
+    const int batch_size_;
+    std::vector<tensorflow::PartialTensorShape> output_shapes_;
     std::unique_ptr<Client> client_;
   };  // Dataset.
 
   Sampler::Options sampler_options_;
+  int batch_size_;
   tensorflow::DataTypeVector dtypes_;
   std::vector<tensorflow::PartialTensorShape> shapes_;
 
@@ -277,6 +277,51 @@ def reverb_cc_test(name, srcs, deps = [], **kwargs):
         **kwargs
     )
 
+def reverb_cc_binary(name, srcs, deps = [], **kwargs):
+    """Reverb-specific version of cc_binary.
+
+    Args:
+      name: Target name.
+      srcs: Target sources.
+      deps: Target deps.
+      **kwargs: Additional args to cc_binary.
+    """
+    native.cc_binary(
+        name = name,
+        srcs = srcs,
+        copts = tf_copts(),
+        deps = depset(deps + reverb_tf_deps()),
+        **kwargs
+    )
+
+def reverb_cc_benchmark(name, srcs, deps = [], **kwargs):
+    """Reverb-specific Google Benchmark binary.
+
+    Benchmarks are tagged `manual` so they are only built when requested, e.g.
+    `bazel run -c opt //reverb/cc/benchmarks:table_benchmark`.
+
+    Args:
+      name: Target name.
+      srcs: Target sources.
+      deps: Target deps.
+      **kwargs: Additional args to cc_binary.
+    """
+    new_deps = [
+        "@com_github_google_benchmark//:benchmark_main",
+        "@tensorflow_includes//:includes",
+        "@tensorflow_solib//:framework_lib",
+    ]
+    tags = kwargs.pop("tags", [])
+    native.cc_binary(
+        name = name,
+        srcs = srcs,
+        copts = tf_copts(),
+        testonly = 1,
+        tags = tags + ["benchmark", "manual"],
+        deps = depset(deps + new_deps),
+        **kwargs
+    )
+
 def reverb_gen_op_wrapper_py(name, out, kernel_lib, linkopts = [], **kwargs):
     """Generates the py_library `name` with a data dep on the ops in kernel_lib.
 
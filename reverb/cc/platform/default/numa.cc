@@ -0,0 +1,111 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/platform/numa.h"
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/string_view.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+namespace {
+
+constexpr char kNodesDir[] = "/sys/devices/system/node";
+
+// Parses a list of CPUs in the format of the kernel, e.g "0-3,8,10-11".
+absl::Status ParseCpuList(absl::string_view list, std::vector<int>* cpus) {
+  for (absl::string_view range :
+       absl::StrSplit(list, ',', absl::SkipWhitespace())) {
+    std::vector<absl::string_view> bounds = absl::StrSplit(range, '-');
+    int first, last;
+    if (bounds.size() > 2 ||
+        !absl::SimpleAtoi(bounds.front(), &first) ||
+        !absl::SimpleAtoi(bounds.back(), &last) || first > last) {
+      return absl::InternalError(
+          absl::StrCat("Unable to parse CPU list '", list, "'."));
+    }
+    for (int cpu = first; cpu <= last; cpu++) {
+      cpus->push_back(cpu);
+    }
+  }
+  return absl::OkStatus();
+}
+
+}  // namespace
+
+int NumNumaNodes() {
+  int num_nodes = 0;
+  while (std::ifstream(absl::StrCat(kNodesDir, "/node", num_nodes, "/cpulist"))
+             .good()) {
+    num_nodes++;
+  }
+  return num_nodes > 0 ? num_nodes : 1;
+}
+
+absl::Status PinCurrentThreadToNumaNode(int node) {
+  if (node < 0 || node >= NumNumaNodes()) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "node must be in [0, ", NumNumaNodes(), ") but got ", node, "."));
+  }
+#ifdef __linux__
+  const std::string path = absl::StrCat(kNodesDir, "/node", node, "/cpulist");
+  std::ifstream file(path);
+  std::string list;
+  if (!std::getline(file, list)) {
+    return absl::UnavailableError(
+        absl::StrCat("Unable to read the CPUs of NUMA node ", node, " from ",
+                     path, "."));
+  }
+  std::vector<int> cpus;
+  if (auto status = ParseCpuList(list, &cpus); !status.ok()) {
+    return status;
+  }
+  if (cpus.empty()) {
+    return absl::FailedPreconditionError(
+        absl::StrCat("NUMA node ", node, " has no CPUs."));
+  }
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) {
+    if (cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+  }
+  if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+    return absl::InternalError(
+        absl::StrCat("sched_setaffinity failed: ", std::strerror(errno)));
+  }
+  return absl::OkStatus();
+#else
+  return absl::UnimplementedError(
+      "Pinning threads to NUMA nodes is only supported on Linux.");
+#endif
+}
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
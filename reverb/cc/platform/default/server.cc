@@ -19,34 +19,98 @@
 
 #include "grpcpp/server_builder.h"
 #include "absl/strings/str_cat.h"
+#include "absl/strings/str_join.h"
+#include "absl/time/time.h"
 #include "reverb/cc/checkpointing/interface.h"
 #include "reverb/cc/client.h"
 #include "reverb/cc/platform/grpc_utils.h"
 #include "reverb/cc/platform/logging.h"
+#include "reverb/cc/platform/numa.h"
 #include "reverb/cc/platform/status_macros.h"
-#include "reverb/cc/reverb_service_impl.h"
+#include "reverb/cc/reverb_callback_service_impl.h"
 
 namespace deepmind {
 namespace reverb {
 namespace {
 
+// Spreads the tables without a NUMA node round-robin over the NUMA nodes of the
+// host.
+void AssignNumaNodes(const std::vector<std::shared_ptr<Table>>& tables) {
+  const int num_nodes = internal::NumNumaNodes();
+  int next_node = 0;
+  for (const auto& table : tables) {
+    if (table->numa_node() >= 0) continue;
+    table->UnsafeSetNumaNode(next_node);
+    REVERB_LOG(REVERB_INFO) << "Table " << table->name()
+                            << " assigned to NUMA node " << next_node << ".";
+    next_node = (next_node + 1) % num_nodes;
+  }
+}
+
 class ServerImpl : public Server {
  public:
-  ServerImpl(int port) : port_(port) {}
+  ServerImpl(int port, ServerOptions options)
+      : port_(port), options_(std::move(options)) {}
 
   absl::Status Initialize(std::vector<std::shared_ptr<Table>> tables,
                           std::shared_ptr<Checkpointer> checkpointer) {
     absl::WriterMutexLock lock(&mu_);
     REVERB_CHECK(!running_) << "Initialize() called twice?";
-    REVERB_RETURN_IF_ERROR(ReverbServiceImpl::Create(
-        std::move(tables), std::move(checkpointer), &reverb_service_));
-    server_ = grpc::ServerBuilder()
-                  .AddListeningPort(absl::StrCat("[::]:", port_),
-                                    MakeServerCredentials())
-                  .RegisterService(reverb_service_.get())
-                  .SetMaxSendMessageSize(kMaxMessageSize)
-                  .SetMaxReceiveMessageSize(kMaxMessageSize)
-                  .BuildAndStart();
+    if (options_.numa_aware) {
+      AssignNumaNodes(tables);
+    }
+    REVERB_RETURN_IF_ERROR(ReverbCallbackServiceImpl::Create(
+        std::move(tables), std::move(checkpointer),
+        options_.max_insert_read_ahead_bytes > 0
+            ? options_.max_insert_read_ahead_bytes
+            : ReverbCallbackServiceImpl::kDefaultMaxInsertReadAheadBytes,
+        &reverb_service_));
+    if (options_.deduplicate_chunks) {
+      reverb_service_->EnableChunkDeduplication();
+    }
+    if (options_.read_only) {
+      for (const auto& [name, table] : reverb_service_->tables()) {
+        REVERB_RETURN_IF_ERROR(table->Freeze());
+      }
+    }
+    if (options_.checkpoint_interval > absl::ZeroDuration()) {
+      REVERB_RETURN_IF_ERROR(reverb_service_->StartPeriodicCheckpoints(
+          options_.checkpoint_interval));
+    }
+    if (!options_.workload_trace_path.empty()) {
+      REVERB_RETURN_IF_ERROR(
+          reverb_service_->StartRecording(options_.workload_trace_path));
+    }
+
+    grpc::ServerBuilder builder;
+    builder.AddListeningPort(absl::StrCat("[::]:", port_),
+                             MakeServerCredentials());
+    for (int port : options_.additional_ports) {
+      builder.AddListeningPort(absl::StrCat("[::]:", port),
+                               MakeServerCredentials());
+    }
+    if (options_.use_callback_service) {
+      builder.RegisterService(reverb_service_.get());
+    } else {
+      builder.RegisterService(reverb_service_->sync_service());
+    }
+    builder.SetMaxSendMessageSize(options_.max_send_message_size)
+        .SetMaxReceiveMessageSize(options_.max_receive_message_size)
+        .AddChannelArgument(GRPC_ARG_ALLOW_REUSEPORT, options_.reuse_port);
+    if (options_.http2_stream_window_bytes > 0) {
+      builder.AddChannelArgument(GRPC_ARG_HTTP2_BDP_PROBE, 0);
+      builder.AddChannelArgument(GRPC_ARG_HTTP2_STREAM_LOOKAHEAD_BYTES,
+                                 options_.http2_stream_window_bytes);
+    }
+    if (options_.http2_write_buffer_bytes > 0) {
+      builder.AddChannelArgument(GRPC_ARG_HTTP2_WRITE_BUFFER_SIZE,
+                                 options_.http2_write_buffer_bytes);
+    }
+    if (options_.max_concurrent_streams > 0) {
+      builder.AddChannelArgument(GRPC_ARG_MAX_CONCURRENT_STREAMS,
+                                 options_.max_concurrent_streams);
+    }
+    server_ = builder.BuildAndStart();
     if (!server_) {
       return absl::InvalidArgumentError("Failed to BuildAndStart gRPC server");
     }
@@ -86,14 +150,20 @@ class ServerImpl : public Server {
   }
 
   std::string DebugString() const override {
-    return absl::StrCat("Server(port=", port_,
-                        ", reverb_service=", reverb_service_->DebugString(),
-                        ")");
+    std::string str = absl::StrCat("Server(port=", port_);
+    if (!options_.additional_ports.empty()) {
+      absl::StrAppend(&str, ", additional_ports=[",
+                      absl::StrJoin(options_.additional_ports, ", "), "]");
+    }
+    absl::StrAppend(&str, ", reverb_service=", reverb_service_->DebugString(),
+                    ")");
+    return str;
   }
 
  private:
   int port_;
-  std::unique_ptr<ReverbServiceImpl> reverb_service_;
+  const ServerOptions options_;
+  std::unique_ptr<ReverbCallbackServiceImpl> reverb_service_;
   std::unique_ptr<grpc::Server> server_ = nullptr;
 
   absl::Mutex mu_;
@@ -102,10 +172,83 @@ class ServerImpl : public Server {
 
 }  // namespace
 
+absl::Status ServerOptions::Validate() const {
+  for (int port : additional_ports) {
+    if (port <= 0) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "additional_ports must be > 0 but got ", port, "."));
+    }
+  }
+  if (max_send_message_size <= 0 && max_send_message_size != kMaxMessageSize) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("max_send_message_size must be > 0 or kMaxMessageSize but "
+                     "got ", max_send_message_size, "."));
+  }
+  if (max_receive_message_size <= 0 &&
+      max_receive_message_size != kMaxMessageSize) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "max_receive_message_size must be > 0 or kMaxMessageSize but got ",
+        max_receive_message_size, "."));
+  }
+  if (http2_stream_window_bytes < 0) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("http2_stream_window_bytes must be >= 0 but got ",
+                     http2_stream_window_bytes, "."));
+  }
+  if (http2_write_buffer_bytes < 0) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("http2_write_buffer_bytes must be >= 0 but got ",
+                     http2_write_buffer_bytes, "."));
+  }
+  if (max_concurrent_streams < 0) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("max_concurrent_streams must be >= 0 but got ",
+                     max_concurrent_streams, "."));
+  }
+  if (max_insert_read_ahead_bytes < 0) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("max_insert_read_ahead_bytes must be >= 0 but got ",
+                     max_insert_read_ahead_bytes, "."));
+  }
+  if (checkpoint_interval < absl::ZeroDuration()) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("checkpoint_interval must be >= 0 but got ",
+                     absl::FormatDuration(checkpoint_interval), "."));
+  }
+  if (!use_callback_service && deduplicate_chunks) {
+    return absl::InvalidArgumentError(
+        "deduplicate_chunks requires use_callback_service.");
+  }
+  if (!use_callback_service && max_insert_read_ahead_bytes > 0) {
+    return absl::InvalidArgumentError(
+        "max_insert_read_ahead_bytes requires use_callback_service.");
+  }
+  return absl::OkStatus();
+}
+
+absl::Status StartServer(std::vector<std::shared_ptr<Table>> tables, int port,
+                         std::shared_ptr<Checkpointer> checkpointer,
+                         std::unique_ptr<Server> *server) {
+  return StartServer(std::move(tables), port, std::move(checkpointer),
+                     ServerOptions(), server);
+}
+
+absl::Status StartServer(std::vector<std::shared_ptr<Table>> tables, int port,
+                         std::shared_ptr<Checkpointer> checkpointer,
+                         int64_t max_insert_read_ahead_bytes,
+                         std::unique_ptr<Server> *server) {
+  ServerOptions options;
+  options.max_insert_read_ahead_bytes = max_insert_read_ahead_bytes;
+  return StartServer(std::move(tables), port, std::move(checkpointer), options,
+                     server);
+}
+
 absl::Status StartServer(std::vector<std::shared_ptr<Table>> tables, int port,
                          std::shared_ptr<Checkpointer> checkpointer,
+                         const ServerOptions &options,
                          std::unique_ptr<Server> *server) {
-  auto s = absl::make_unique<ServerImpl>(port);
+  REVERB_RETURN_IF_ERROR(options.Validate());
+  auto s = absl::make_unique<ServerImpl>(port, options);
   REVERB_RETURN_IF_ERROR(
       s->Initialize(std::move(tables), std::move(checkpointer)));
   *server = std::move(s);
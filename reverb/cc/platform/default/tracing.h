@@ -0,0 +1,71 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_PLATFORM_DEFAULT_TRACING_H_
+#define REVERB_CC_PLATFORM_DEFAULT_TRACING_H_
+
+#include <string>
+#include <utility>
+
+#include "absl/strings/string_view.h"
+#include "tensorflow/core/profiler/lib/traceme.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+
+// Records a span, from construction until destruction or `Stop`, on the
+// timeline of the TensorFlow profiler. The spans of the client are thereby
+// shown next to the ops of the input pipeline when a trace is captured (e.g.
+// with `tf.profiler.experimental.start`) and viewed in TensorBoard or Perfetto.
+//
+// Names with metadata are passed as a callable which is only invoked while a
+// trace is being captured. Otherwise a span costs a single atomic load. The
+// profiler expects metadata to be appended as "name#key=value,key=value#".
+class ScopedTrace {
+ public:
+  explicit ScopedTrace(const char* name) : trace_(absl::string_view(name)) {}
+
+  template <typename NameGeneratorT>
+  explicit ScopedTrace(NameGeneratorT name_generator)
+      : trace_(std::move(name_generator)) {}
+
+  // Ends the span before the object is destroyed.
+  void Stop() { trace_.Stop(); }
+
+  ScopedTrace(const ScopedTrace&) = delete;
+  ScopedTrace& operator=(const ScopedTrace&) = delete;
+
+ private:
+  tensorflow::profiler::TraceMe trace_;
+};
+
+// Records an event without duration (e.g. the arrival of a response).
+template <typename NameGeneratorT>
+void TraceInstant(NameGeneratorT name_generator) {
+  tensorflow::profiler::TraceMe::InstantActivity(std::move(name_generator));
+}
+
+inline void TraceInstant(const char* name) {
+  TraceInstant([name] { return std::string(name); });
+}
+
+// Returns true while a trace is being captured.
+inline bool TraceActive() { return tensorflow::profiler::TraceMe::Active(); }
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_PLATFORM_DEFAULT_TRACING_H_
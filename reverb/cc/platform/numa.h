@@ -0,0 +1,36 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_PLATFORM_NUMA_H_
+#define REVERB_CC_PLATFORM_NUMA_H_
+
+#include "absl/status/status.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+
+// Number of NUMA nodes of the host. 1 if the topology is unknown.
+int NumNumaNodes();
+
+// Restricts the calling thread to the CPUs of NUMA node `node`. With the
+// default (first touch) memory policy, the memory which the thread touches
+// first is then allocated on the same node.
+absl::Status PinCurrentThreadToNumaNode(int node);
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_PLATFORM_NUMA_H_
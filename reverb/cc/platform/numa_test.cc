@@ -0,0 +1,52 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/platform/numa.h"
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/status/status.h"
+#include "reverb/cc/platform/status_matchers.h"
+#include "reverb/cc/platform/thread.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+namespace {
+
+TEST(NumaTest, NumNumaNodesIsPositive) { EXPECT_GE(NumNumaNodes(), 1); }
+
+TEST(NumaTest, PinCurrentThreadToNumaNode) {
+  absl::Status status;
+  auto thread = StartThread(
+      "PinnedThread", [&status] { status = PinCurrentThreadToNumaNode(0); });
+  thread = nullptr;
+#ifdef __linux__
+  REVERB_EXPECT_OK(status);
+#else
+  EXPECT_EQ(status.code(), absl::StatusCode::kUnimplemented);
+#endif
+}
+
+TEST(NumaTest, PinCurrentThreadToNumaNodeOutOfRange) {
+  EXPECT_EQ(PinCurrentThreadToNumaNode(-1).code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(PinCurrentThreadToNumaNode(NumNumaNodes()).code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+}  // namespace
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
@@ -15,10 +15,13 @@
 #ifndef REVERB_CC_PLATFORM_SERVER_H_
 #define REVERB_CC_PLATFORM_SERVER_H_
 
+#include <cstdint>
 #include <memory>
+#include <string>
 #include <vector>
 
 #include "absl/status/status.h"
+#include "absl/time/time.h"
 #include "reverb/cc/checkpointing/interface.h"
 #include "reverb/cc/client.h"
 #include "reverb/cc/table.h"
@@ -29,6 +32,83 @@ namespace reverb {
 // Unlimited.
 constexpr int kMaxMessageSize = -1;
 
+// Settings of the gRPC server. The defaults are used by the overloads of
+// `StartServer` which do not take options. Fields set to 0 leave the setting to
+// gRPC.
+struct ServerOptions {
+  // Ports which the server listens on in addition to `port`, e.g. to spread the
+  // connections of the clients over several listeners.
+  std::vector<int> additional_ports;
+
+  // If true then the listeners are created with `SO_REUSEPORT` so several
+  // server processes on the same host can listen on the same port, with the
+  // kernel sharding the incoming connections between them.
+  bool reuse_port = true;
+
+  // Maximum size of the messages sent and received respectively.
+  // `kMaxMessageSize` means unlimited.
+  int max_send_message_size = kMaxMessageSize;
+  int max_receive_message_size = kMaxMessageSize;
+
+  // Size of the HTTP/2 flow control window of each stream. Disables the
+  // automatic sizing of the window (BDP probing), which can be too slow to
+  // open the window of streams on fast (e.g 100Gbit) links.
+  int http2_stream_window_bytes = 0;
+
+  // Size of the buffer which the writes of each connection are coalesced into.
+  int http2_write_buffer_bytes = 0;
+
+  // Maximum number of concurrent streams (i.e calls) of each connection.
+  int max_concurrent_streams = 0;
+
+  // Bounds the size of the requests an insert stream reads ahead of the items
+  // that have been inserted into the tables. If 0 then
+  // `ReverbCallbackServiceImpl::kDefaultMaxInsertReadAheadBytes` is used.
+  int64_t max_insert_read_ahead_bytes = 0;
+
+  // If true then the tables are spread round-robin over the NUMA nodes of the
+  // host and the background threads of each table are pinned to its node. See
+  // `Table::UnsafeSetNumaNode`. Tables which already have a node keep it.
+  bool numa_aware = false;
+
+  // If true then chunks with identical content (e.g. the same episode written
+  // by several writers) are only held once. See
+  // `ReverbCallbackServiceImpl::EnableChunkDeduplication`.
+  bool deduplicate_chunks = false;
+
+  // If positive then a checkpoint is saved with the checkpointer of the server
+  // (which must be set) every `checkpoint_interval`, in addition to those
+  // requested by clients. See `ReverbServiceImpl::StartPeriodicCheckpoints`.
+  absl::Duration checkpoint_interval = absl::ZeroDuration();
+
+  // If set then the requests received by the server are recorded to a
+  // workload trace at this path, which can be replayed with
+  // `tools::WorkloadReplayer`. See `ReverbServiceImpl::StartRecording`.
+  std::string workload_trace_path;
+
+  // If true then every table is frozen (see `Table::Freeze`) once the latest
+  // checkpoint of the checkpointer has been loaded, so the server serves the
+  // checkpoint read-only, e.g. for offline training, and samples without
+  // contention. Fails to start if any table cannot be frozen, in particular if
+  // it is still empty, so the checkpointer must not load checkpoints in the
+  // background (`streaming_load`). Loading with `mapped_chunk_files` keeps the
+  // chunks in the checkpoint files until they are sampled.
+  bool read_only = false;
+
+  // If true (default) then the requests are served by
+  // `ReverbCallbackServiceImpl`, which runs every stream on the fixed size
+  // callback executor of gRPC. If false then they are served by
+  // `ReverbServiceImpl`, which dedicates a thread to every open stream (two to
+  // insert streams) and therefore uses more threads as more clients connect.
+  // `ReverbServiceImpl` does not support `deduplicate_chunks` or
+  // `max_insert_read_ahead_bytes`, nor the `ExportTable` method, sample groups
+  // and mixtures (which fail with `Unimplemented`).
+  bool use_callback_service = true;
+
+  // Returns `InvalidArgument` if any field value is invalid.
+  absl::Status Validate() const;
+};
+
 class Server {
  public:
   virtual ~Server() = default;
@@ -53,6 +133,18 @@ absl::Status StartServer(std::vector<std::shared_ptr<Table>> tables, int port,
                          std::shared_ptr<Checkpointer> checkpointer,
                          std::unique_ptr<Server> *server);
 
+// `max_insert_read_ahead_bytes` bounds the size of the requests an insert
+// stream reads ahead of the items that have been inserted into the tables.
+absl::Status StartServer(std::vector<std::shared_ptr<Table>> tables, int port,
+                         std::shared_ptr<Checkpointer> checkpointer,
+                         int64_t max_insert_read_ahead_bytes,
+                         std::unique_ptr<Server> *server);
+
+absl::Status StartServer(std::vector<std::shared_ptr<Table>> tables, int port,
+                         std::shared_ptr<Checkpointer> checkpointer,
+                         const ServerOptions &options,
+                         std::unique_ptr<Server> *server);
+
 }  // namespace reverb
 }  // namespace deepmind
 
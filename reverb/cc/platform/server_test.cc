@@ -14,15 +14,24 @@
 
 #include "reverb/cc/platform/server.h"
 
+#include <cfloat>
 #include <memory>
+#include <vector>
 
 #include "grpcpp/impl/codegen/client_context.h"
 #include "grpcpp/impl/codegen/status.h"
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "reverb/cc/client.h"
 #include "reverb/cc/platform/net.h"
 #include "reverb/cc/platform/status_matchers.h"
+#include "reverb/cc/rate_limiter.h"
+#include "reverb/cc/selectors/fifo.h"
+#include "reverb/cc/selectors/uniform.h"
+#include "reverb/cc/table.h"
+#include "reverb/cc/testing/proto_test_util.h"
 
 namespace deepmind {
 namespace reverb {
@@ -46,6 +55,113 @@ TEST(ServerTest, ErrorOnUnavailablePort) {
               ::testing::HasSubstr("Failed to BuildAndStart gRPC server"));
 }
 
+TEST(ServerTest, StartServerWithOptions) {
+  ServerOptions options;
+  options.additional_ports = {internal::PickUnusedPortOrDie()};
+  options.http2_stream_window_bytes = 16 << 20;
+  options.http2_write_buffer_bytes = 1 << 20;
+  options.max_concurrent_streams = 1000;
+  std::unique_ptr<Server> server;
+  REVERB_EXPECT_OK(StartServer(/*tables=*/{},
+                               /*port=*/internal::PickUnusedPortOrDie(),
+                               /*checkpointer=*/nullptr, options, &server));
+}
+
+TEST(ServerTest, StartServerWithSyncService) {
+  auto table = std::make_shared<Table>(
+      "table", std::make_shared<UniformSelector>(),
+      std::make_shared<FifoSelector>(), /*max_size=*/10,
+      /*max_times_sampled=*/0,
+      std::make_shared<RateLimiter>(1.0, 1, -DBL_MAX, DBL_MAX));
+  ServerOptions options;
+  options.use_callback_service = false;
+  std::unique_ptr<Server> server;
+  REVERB_ASSERT_OK(StartServer({table},
+                               /*port=*/internal::PickUnusedPortOrDie(),
+                               /*checkpointer=*/nullptr, options, &server));
+
+  auto client = server->InProcessClient();
+  struct Client::ServerInfo info;
+  REVERB_EXPECT_OK(client->ServerInfo(&info));
+  ASSERT_EQ(info.table_info.size(), 1);
+  EXPECT_EQ(info.table_info[0].name(), "table");
+}
+
+TEST(ServerTest, NumaAwareAssignsNodesToTables) {
+  std::vector<std::shared_ptr<Table>> tables;
+  for (int i = 0; i < 2; i++) {
+    tables.push_back(std::make_shared<Table>(
+        absl::StrCat("table", i), std::make_shared<UniformSelector>(),
+        std::make_shared<FifoSelector>(), /*max_size=*/10,
+        /*max_times_sampled=*/0,
+        std::make_shared<RateLimiter>(1.0, 1, -DBL_MAX, DBL_MAX)));
+  }
+  ServerOptions options;
+  options.numa_aware = true;
+  std::unique_ptr<Server> server;
+  REVERB_EXPECT_OK(StartServer(tables,
+                               /*port=*/internal::PickUnusedPortOrDie(),
+                               /*checkpointer=*/nullptr, options, &server));
+  for (const auto& table : tables) {
+    EXPECT_GE(table->numa_node(), 0);
+  }
+}
+
+TEST(ServerTest, ReadOnlyFreezesTables) {
+  auto table = std::make_shared<Table>(
+      "table", std::make_shared<UniformSelector>(),
+      std::make_shared<FifoSelector>(), /*max_size=*/10,
+      /*max_times_sampled=*/0,
+      std::make_shared<RateLimiter>(1.0, 1, -DBL_MAX, DBL_MAX));
+  ServerOptions options;
+  options.read_only = true;
+  std::unique_ptr<Server> server;
+
+  // Empty tables cannot be frozen.
+  EXPECT_EQ(StartServer({table}, /*port=*/internal::PickUnusedPortOrDie(),
+                        /*checkpointer=*/nullptr, options, &server)
+                .code(),
+            absl::StatusCode::kFailedPrecondition);
+
+  ChunkData data =
+      testing::MakeChunkData(1, testing::MakeSequenceRange(1, 0, 1));
+  Table::Item item;
+  item.chunks.push_back(std::make_shared<ChunkStore::Chunk>(data));
+  item.item = testing::MakePrioritizedItem(1, 1, {data});
+  REVERB_ASSERT_OK(table->InsertOrAssign(std::move(item)));
+  REVERB_EXPECT_OK(StartServer({table},
+                               /*port=*/internal::PickUnusedPortOrDie(),
+                               /*checkpointer=*/nullptr, options, &server));
+  EXPECT_TRUE(table->frozen());
+}
+
+TEST(ServerTest, ValidatesOptions) {
+  ServerOptions options;
+  REVERB_EXPECT_OK(options.Validate());
+  options.max_receive_message_size = 0;
+  EXPECT_EQ(options.Validate().code(), absl::StatusCode::kInvalidArgument);
+  options = ServerOptions();
+  options.http2_stream_window_bytes = -1;
+  EXPECT_EQ(options.Validate().code(), absl::StatusCode::kInvalidArgument);
+  options = ServerOptions();
+  options.use_callback_service = false;
+  options.deduplicate_chunks = true;
+  EXPECT_EQ(options.Validate().code(), absl::StatusCode::kInvalidArgument);
+  options = ServerOptions();
+  options.use_callback_service = false;
+  options.max_insert_read_ahead_bytes = 1 << 20;
+  EXPECT_EQ(options.Validate().code(), absl::StatusCode::kInvalidArgument);
+  options = ServerOptions();
+  options.additional_ports = {-1};
+  EXPECT_EQ(options.Validate().code(), absl::StatusCode::kInvalidArgument);
+
+  std::unique_ptr<Server> server;
+  EXPECT_EQ(StartServer(/*tables=*/{}, /*port=*/internal::PickUnusedPortOrDie(),
+                        /*checkpointer=*/nullptr, options, &server)
+                .code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
 }  // namespace
 }  // namespace reverb
 }  // namespace deepmind
@@ -15,6 +15,7 @@
 #include "reverb/cc/platform/tfrecord_checkpointer.h"
 
 #include <algorithm>
+#include <functional>
 #include <iterator>
 #include <memory>
 #include <string>
@@ -25,15 +26,20 @@
 #include "absl/memory/memory.h"
 #include "absl/status/status.h"
 #include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+#include "absl/strings/match.h"
 #include "absl/strings/str_join.h"
 #include "absl/strings/string_view.h"
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
+#include "google/protobuf/arena.h"
+#include "google/protobuf/duration.pb.h"
 #include "reverb/cc/checkpointing/checkpoint.pb.h"
 #include "reverb/cc/chunk_store.h"
 #include "reverb/cc/platform/hash_map.h"
 #include "reverb/cc/platform/hash_set.h"
 #include "reverb/cc/platform/status_macros.h"
+#include "reverb/cc/platform/thread.h"
 #include "reverb/cc/rate_limiter.h"
 #include "reverb/cc/schema.pb.h"
 #include "reverb/cc/selectors/fifo.h"
@@ -41,8 +47,13 @@
 #include "reverb/cc/selectors/interface.h"
 #include "reverb/cc/selectors/lifo.h"
 #include "reverb/cc/selectors/prioritized.h"
+#include "reverb/cc/selectors/rank_based.h"
+#include "reverb/cc/selectors/reservoir.h"
 #include "reverb/cc/selectors/uniform.h"
+#include "reverb/cc/support/bandwidth_limiter.h"
+#include "reverb/cc/support/mapped_chunk_file.h"
 #include "reverb/cc/support/tf_util.h"
+#include "reverb/cc/support/thread_pool.h"
 #include "reverb/cc/support/trajectory_util.h"
 #include "reverb/cc/table.h"
 #include "reverb/cc/table_extensions/interface.h"
@@ -57,9 +68,28 @@ namespace reverb {
 namespace {
 
 constexpr char kTablesFileName[] = "tables.tfrecord";
-constexpr char kChunksFileName[] = "chunks.tfrecord";
+constexpr char kChunkFilesFileName[] = "chunk_files.pb";
+constexpr char kChunkFilesDirName[] = "chunks";
 constexpr char kDoneFileName[] = "DONE";
 
+// Extension of chunk files written with `MappedChunkFile` rather than as
+// records.
+constexpr char kMappedChunkFileExtension[] = "chunks";
+
+// Chunks of checkpoints written before chunk files were introduced.
+constexpr char kLegacyChunksFileName[] = "chunks.tfrecord";
+
+// Compression types of record files and the suffix appended to the name of
+// files written with them. The compression of a file is inferred from its
+// name so that checkpoints written with different options can share chunk
+// files.
+constexpr std::pair<absl::string_view, absl::string_view>
+    kRecordCompressionSuffixes[] = {{"ZLIB", ".zlib"}, {"GZIP", ".gz"}};
+
+// Chunk files where the chunks referenced by a new checkpoint make up less
+// than this fraction of the file have their referenced chunks rewritten.
+constexpr double kMinReferencedChunkFileFraction = 0.5;
+
 using RecordWriterUniquePtr =
     std::unique_ptr<tensorflow::io::RecordWriter,
                     std::function<void(tensorflow::io::RecordWriter*)>>;
@@ -67,17 +97,37 @@ using RecordReaderUniquePtr =
     std::unique_ptr<tensorflow::io::RecordReader,
                     std::function<void(tensorflow::io::RecordReader*)>>;
 
+// Returns the suffix of record files written with `compression_type`.
+absl::string_view RecordFileSuffix(absl::string_view compression_type) {
+  for (const auto& [type, suffix] : kRecordCompressionSuffixes) {
+    if (type == compression_type) return suffix;
+  }
+  return "";
+}
+
+// Returns the compression type of the record file at `path`.
+std::string RecordCompressionType(absl::string_view path) {
+  for (const auto& [type, suffix] : kRecordCompressionSuffixes) {
+    if (absl::EndsWith(path, suffix)) return std::string(type);
+  }
+  return "";
+}
+
 absl::Status OpenWriter(const std::string& path,
                         RecordWriterUniquePtr* writer) {
   std::unique_ptr<tensorflow::WritableFile> file;
   REVERB_RETURN_IF_ERROR(FromTensorflowStatus(
       tensorflow::Env::Default()->NewWritableFile(path, &file)));
   auto* file_ptr = file.release();
-  *writer = RecordWriterUniquePtr(new tensorflow::io::RecordWriter(file_ptr),
-                                  [file_ptr](tensorflow::io::RecordWriter* w) {
-                                    delete w;
-                                    delete file_ptr;
-                                  });
+  *writer = RecordWriterUniquePtr(
+      new tensorflow::io::RecordWriter(
+          file_ptr,
+          tensorflow::io::RecordWriterOptions::CreateRecordWriterOptions(
+              RecordCompressionType(path))),
+      [file_ptr](tensorflow::io::RecordWriter* w) {
+        delete w;
+        delete file_ptr;
+      });
   return absl::OkStatus();
 }
 
@@ -87,11 +137,15 @@ absl::Status OpenReader(const std::string& path,
   REVERB_RETURN_IF_ERROR(FromTensorflowStatus(
       tensorflow::Env::Default()->NewRandomAccessFile(path, &file)));
   auto* file_ptr = file.release();
-  *reader = RecordReaderUniquePtr(new tensorflow::io::RecordReader(file_ptr),
-                                  [file_ptr](tensorflow::io::RecordReader* r) {
-                                    delete r;
-                                    delete file_ptr;
-                                  });
+  *reader = RecordReaderUniquePtr(
+      new tensorflow::io::RecordReader(
+          file_ptr,
+          tensorflow::io::RecordReaderOptions::CreateRecordReaderOptions(
+              RecordCompressionType(path))),
+      [file_ptr](tensorflow::io::RecordReader* r) {
+        delete r;
+        delete file_ptr;
+      });
   return absl::OkStatus();
 }
 
@@ -123,6 +177,12 @@ std::unique_ptr<ItemSelector> MakeDistribution(
           options.prioritized().priority_exponent());
     case KeyDistributionOptions::kHeap:
       return absl::make_unique<HeapSelector>(options.heap().min_heap());
+    case KeyDistributionOptions::kRankBased:
+      return absl::make_unique<RankBasedSelector>(
+          options.rank_based().priority_exponent());
+    case KeyDistributionOptions::kReservoir:
+      return absl::make_unique<ReservoirSelector>(
+          options.reservoir().num_inserted());
     case KeyDistributionOptions::DISTRIBUTION_NOT_SET:
       REVERB_LOG(REVERB_FATAL) << "Selector not set";
     default:
@@ -139,15 +199,417 @@ inline size_t find_table_index(
   return -1;
 }
 
+// Lists the checkpoint directories in `root_dir`, oldest first.
+absl::Status ListCheckpoints(const std::string& root_dir,
+                             std::vector<std::string>* paths) {
+  std::vector<std::string> filenames;
+  REVERB_RETURN_IF_ERROR(
+      FromTensorflowStatus(tensorflow::Env::Default()->GetMatchingPaths(
+          tensorflow::io::JoinPath(root_dir, "*"), &filenames)));
+  const std::string chunk_files_dir =
+      tensorflow::io::JoinPath(root_dir, kChunkFilesDirName);
+  filenames.erase(std::remove(filenames.begin(), filenames.end(),
+                              chunk_files_dir),
+                  filenames.end());
+  std::sort(filenames.begin(), filenames.end());
+  *paths = std::move(filenames);
+  return absl::OkStatus();
+}
+
+// Keys of the chunks referenced by `item`, in the order of the trajectory.
+std::vector<ChunkStore::Key> ItemChunkKeys(const PrioritizedItem& item) {
+  if (item.has_deprecated_sequence_range()) {
+    return {item.deprecated_chunk_keys().begin(),
+            item.deprecated_chunk_keys().end()};
+  }
+  return internal::GetChunkKeys(item.flat_trajectory());
+}
+
+// Finds the tables file of the checkpoint in `dir_path`, whose name depends
+// on the compression it was written with.
+absl::Status FindTablesFile(const std::string& dir_path, std::string* path) {
+  auto* env = tensorflow::Env::Default();
+  *path = tensorflow::io::JoinPath(dir_path, kTablesFileName);
+  if (env->FileExists(*path).ok()) return absl::OkStatus();
+  for (const auto& [type, suffix] : kRecordCompressionSuffixes) {
+    *path = absl::StrCat(tensorflow::io::JoinPath(dir_path, kTablesFileName),
+                         suffix);
+    if (env->FileExists(*path).ok()) return absl::OkStatus();
+  }
+  return absl::NotFoundError(
+      absl::StrCat("No tables file found in checkpoint ", dir_path));
+}
+
+// Reads the table checkpoints stored in the tables file of the checkpoint in
+// `dir_path`.
+absl::Status ReadTables(const std::string& dir_path,
+                        std::vector<PriorityTableCheckpoint>* checkpoints) {
+  std::string path;
+  REVERB_RETURN_IF_ERROR(FindTablesFile(dir_path, &path));
+  RecordReaderUniquePtr reader;
+  REVERB_RETURN_IF_ERROR(OpenReader(path, &reader));
+
+  absl::Status status;
+  tensorflow::uint64 offset = 0;
+  tensorflow::tstring record;
+  while ((status = FromTensorflowStatus(reader->ReadRecord(&offset, &record)))
+             .ok()) {
+    checkpoints->emplace_back();
+    if (!checkpoints->back().ParseFromArray(record.data(), record.size())) {
+      return absl::DataLossError(
+          absl::StrCat("Could not parse TFRecord as Checkpoint: '",
+                       absl::string_view(record), "'"));
+    }
+
+    // The name of the table is omitted from the items when they are written.
+    auto& checkpoint = checkpoints->back();
+    for (auto& item : *checkpoint.mutable_items()) {
+      if (item.table().empty()) item.set_table(checkpoint.table_name());
+    }
+  }
+  return absl::IsOutOfRange(status) ? absl::OkStatus() : status;
+}
+
+// Adds the keys of the chunks referenced by the items of `checkpoints` to
+// `keys`.
+void CollectChunkKeys(const std::vector<PriorityTableCheckpoint>& checkpoints,
+                      internal::flat_hash_set<ChunkStore::Key>* keys) {
+  for (const auto& checkpoint : checkpoints) {
+    for (const auto& item : checkpoint.items()) {
+      for (const auto key : ItemChunkKeys(item)) {
+        keys->insert(key);
+      }
+    }
+  }
+}
+
+using ChunkByKey =
+    internal::flat_hash_map<ChunkStore::Key, std::shared_ptr<ChunkStore::Chunk>>;
+
+// Same as `LoadChunks` but for a file written with `MappedChunkFile`. Only the
+// index of the file is read, the chunks reference the mapped payloads.
+absl::Status LoadMappedChunks(
+    const std::string& path,
+    const internal::flat_hash_set<ChunkStore::Key>* keys,
+    ChunkStore* chunk_store,
+    const std::function<absl::Status(std::shared_ptr<ChunkStore::Chunk>)>&
+        on_insert,
+    const std::function<void(ChunkStore::Key, int64_t)>& on_chunk) {
+  std::shared_ptr<const internal::MappedChunkFile> file;
+  REVERB_RETURN_IF_ERROR(internal::MappedChunkFile::Open(path, &file));
+  for (const auto& entry : file->entries()) {
+    on_chunk(entry.key, entry.length);
+    if (keys != nullptr && !keys->contains(entry.key)) continue;
+    REVERB_RETURN_IF_ERROR(on_insert(chunk_store->InsertMapped(file, entry)));
+  }
+  return absl::OkStatus();
+}
+
+// Inserts the chunks stored in the chunk file at `path` into `chunk_store`
+// and passes them to `on_insert`, stopping at the first error it returns. If
+// `keys` is non-null then other chunks are skipped. `on_chunk` is called with
+// the key and the size of every chunk in the file.
+absl::Status LoadChunks(
+    const std::string& path,
+    const internal::flat_hash_set<ChunkStore::Key>* keys,
+    ChunkStore* chunk_store,
+    const std::function<absl::Status(std::shared_ptr<ChunkStore::Chunk>)>&
+        on_insert,
+    const std::function<void(ChunkStore::Key, int64_t)>& on_chunk) {
+  if (tensorflow::io::Extension(path) == kMappedChunkFileExtension) {
+    return LoadMappedChunks(path, keys, chunk_store, on_insert, on_chunk);
+  }
+
+  RecordReaderUniquePtr chunk_reader;
+  REVERB_RETURN_IF_ERROR(OpenReader(path, &chunk_reader));
+
+  absl::Status chunk_status;
+  tensorflow::uint64 chunk_offset = 0;
+  tensorflow::tstring chunk_record;
+  do {
+    chunk_status = FromTensorflowStatus(
+        chunk_reader->ReadRecord(&chunk_offset, &chunk_record));
+    if (!chunk_status.ok()) break;
+
+    // Every chunk is parsed onto its own arena which is then owned by the
+    // chunk.
+    auto arena = ChunkStore::NewArena();
+    auto* chunk_data =
+        google::protobuf::Arena::CreateMessage<ChunkData>(arena.get());
+    if (!chunk_data->ParseFromArray(chunk_record.data(),
+                                    chunk_record.size())) {
+      return absl::DataLossError(
+          absl::StrCat("Could not parse TFRecord as ChunkData: '",
+                       absl::string_view(chunk_record), "'"));
+    }
+    on_chunk(chunk_data->chunk_key(), chunk_record.size());
+    if (keys != nullptr && !keys->contains(chunk_data->chunk_key())) {
+      continue;
+    }
+    if (chunk_data->deprecated_data_size()) {
+      if (!chunk_data->data().tensors().empty()) {
+        return absl::InternalError(
+            absl::StrCat("Checkpoint ChunkData at offset: ", chunk_offset,
+            " has both data and deprecated_data."));
+      }
+      chunk_data->mutable_data()->mutable_tensors()->Swap(
+          chunk_data->mutable_deprecated_data());
+    }
+    REVERB_RETURN_IF_ERROR(
+        on_insert(chunk_store->Insert(std::move(arena), chunk_data)));
+  } while (chunk_status.ok());
+  return absl::IsOutOfRange(chunk_status) ? absl::OkStatus() : chunk_status;
+}
+
+// Creates a table without any items from `checkpoint`. The table of the same
+// name in `tables` hands over its extensions and its index is returned in
+// `index`.
+absl::Status MakeEmptyTable(PriorityTableCheckpoint* checkpoint,
+                            std::vector<std::shared_ptr<Table>>* tables,
+                            int* index, std::shared_ptr<Table>* table) {
+  *index = find_table_index(tables, checkpoint->table_name());
+  if (*index == -1) {
+    std::vector<std::string> table_names;
+    for (const auto& table : *tables) {
+      table_names.push_back(absl::StrCat("'", table->name(), "'"));
+    }
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Trying to load table ", checkpoint->table_name(),
+        " but table was not found in provided list of tables. Available "
+        "tables: [",
+        absl::StrJoin(table_names, ", "), "]"));
+  }
+
+  auto sampler = MakeDistribution(checkpoint->sampler());
+  auto remover = MakeDistribution(checkpoint->remover());
+  auto rate_limiter = std::make_shared<RateLimiter>(checkpoint->rate_limiter());
+  auto extensions = tables->at(*index)->UnsafeClearExtensions();
+  auto signature =
+      checkpoint->has_signature()
+          ? absl::make_optional(std::move(*checkpoint->mutable_signature()))
+          : absl::nullopt;
+  auto max_age = checkpoint->has_max_age()
+                     ? absl::Seconds(checkpoint->max_age().seconds()) +
+                           absl::Nanoseconds(checkpoint->max_age().nanos())
+                     : absl::InfiniteDuration();
+
+  *table = std::make_shared<Table>(
+      /*name=*/checkpoint->table_name(),
+      /*sampler=*/std::move(sampler),
+      /*remover=*/std::move(remover),
+      /*max_size=*/checkpoint->max_size(),
+      /*max_times_sampled=*/checkpoint->max_times_sampled(),
+      /*rate_limiter=*/std::move(rate_limiter),
+      /*extensions=*/std::move(extensions),
+      /*signature=*/std::move(signature),
+      /*max_chunk_bytes=*/checkpoint->max_chunk_bytes(),
+      /*max_age=*/max_age,
+      /*index_episodes=*/checkpoint->index_episodes());
+  (*table)->set_num_deleted_episodes_from_checkpoint(
+      checkpoint->num_deleted_episodes());
+  return absl::OkStatus();
+}
+
+// Converts `checkpoint_item` into an item which references the chunks in
+// `chunk_by_key`. Every chunk referenced by the item must be present.
+absl::Status ToTableItem(const PrioritizedItem& checkpoint_item,
+                         ChunkStore* chunk_store,
+                         const ChunkByKey& chunk_by_key, Table::Item* item) {
+  item->item = checkpoint_item;
+
+  if (item->item.has_deprecated_sequence_range() &&
+      item->item.has_flat_trajectory()) {
+    return absl::InternalError(
+        absl::StrCat("Item ", item->item.key(),
+                     " has both deprecated and new trajectory format: ",
+                     item->item.DebugString(), "."));
+  }
+
+  if (item->item.has_deprecated_sequence_range()) {
+    std::vector<std::shared_ptr<ChunkStore::Chunk>> trajectory_chunks;
+    REVERB_CHECK_OK(FromTensorflowStatus(chunk_store->Get(
+        item->item.deprecated_chunk_keys(), &trajectory_chunks)));
+
+    *item->item.mutable_flat_trajectory() = internal::FlatTimestepTrajectory(
+        trajectory_chunks, item->item.deprecated_sequence_range().offset(),
+        item->item.deprecated_sequence_range().length());
+
+    item->item.clear_deprecated_sequence_range();
+    item->item.clear_deprecated_chunk_keys();
+  }
+
+  for (const auto& key : internal::GetChunkKeys(item->item.flat_trajectory())) {
+    auto it = chunk_by_key.find(key);
+    REVERB_CHECK(it != chunk_by_key.end());
+    item->chunks.push_back(it->second);
+  }
+  return absl::OkStatus();
+}
+
+// Blocks until `num_bytes` may be written if `limiter` is non-null.
+void ThrottleWrite(internal::BandwidthLimiter* limiter, int64_t num_bytes) {
+  if (limiter != nullptr) limiter->Acquire(num_bytes);
+}
+
+// Writer of a single chunk file.
+class ChunkFileWriter {
+ public:
+  virtual ~ChunkFileWriter() = default;
+
+  // Appends `chunk`, whose data has been serialized into `serialized`.
+  virtual absl::Status Append(const ChunkStore::Chunk& chunk,
+                              const std::string& serialized) = 0;
+
+  virtual absl::Status Close() = 0;
+};
+
+// Writes the chunks as records, each holding the serialized `ChunkData`.
+class RecordChunkFileWriter : public ChunkFileWriter {
+ public:
+  static absl::Status Open(const std::string& path,
+                           std::unique_ptr<ChunkFileWriter>* writer) {
+    RecordWriterUniquePtr record_writer;
+    REVERB_RETURN_IF_ERROR(OpenWriter(path, &record_writer));
+    *writer = absl::WrapUnique<ChunkFileWriter>(
+        new RecordChunkFileWriter(std::move(record_writer)));
+    return absl::OkStatus();
+  }
+
+  absl::Status Append(const ChunkStore::Chunk& chunk,
+                      const std::string& serialized) override {
+    return FromTensorflowStatus(writer_->WriteRecord(serialized));
+  }
+
+  absl::Status Close() override {
+    return FromTensorflowStatus(writer_->Close());
+  }
+
+ private:
+  explicit RecordChunkFileWriter(RecordWriterUniquePtr writer)
+      : writer_(std::move(writer)) {}
+
+  RecordWriterUniquePtr writer_;
+};
+
+// Writes the chunks to a `MappedChunkFile`, with the serialized `ChunkData` as
+// payload.
+class MappedChunkFileWriter : public ChunkFileWriter {
+ public:
+  static absl::Status Open(const std::string& path,
+                           std::unique_ptr<ChunkFileWriter>* writer) {
+    std::unique_ptr<internal::MappedChunkFile::Writer> mapped_writer;
+    REVERB_RETURN_IF_ERROR(
+        internal::MappedChunkFile::Writer::Create(path, &mapped_writer));
+    *writer = absl::WrapUnique<ChunkFileWriter>(
+        new MappedChunkFileWriter(std::move(mapped_writer)));
+    return absl::OkStatus();
+  }
+
+  absl::Status Append(const ChunkStore::Chunk& chunk,
+                      const std::string& serialized) override {
+    internal::MappedChunkFile::Entry entry;
+    entry.key = chunk.key();
+    entry.episode_id = chunk.episode_id();
+    entry.num_rows = chunk.num_rows();
+    entry.num_columns = chunk.num_columns();
+    return writer_->Append(entry, serialized);
+  }
+
+  absl::Status Close() override { return writer_->Close(); }
+
+ private:
+  explicit MappedChunkFileWriter(
+      std::unique_ptr<internal::MappedChunkFile::Writer> writer)
+      : writer_(std::move(writer)) {}
+
+  std::unique_ptr<internal::MappedChunkFile::Writer> writer_;
+};
+
+// Chunk file written by `WriteChunks` and the key and size of every chunk it
+// holds.
+struct WrittenChunkFile {
+  std::string path;  // Relative to the root directory.
+  std::vector<std::pair<ChunkStore::Key, int64_t>> chunks;
+};
+
+// Writes every `num_shards`th chunk of `chunks`, starting at `shard`, to new
+// chunk files opened with `open`. The chunks are written to a single file
+// unless `max_file_bytes` is positive, in which case a new file is started
+// whenever the next chunk would take the current file beyond
+// `max_file_bytes`. The path of the `i`th file, relative to `root_dir`, is
+// `file_path(i)`. The written files are added to `files`. The writes are
+// throttled by `limiter` unless it is nullptr.
+absl::Status WriteChunks(
+    const std::string& root_dir,
+    const std::function<std::string(int)>& file_path,
+    const std::function<absl::Status(const std::string&,
+                                     std::unique_ptr<ChunkFileWriter>*)>& open,
+    const std::vector<std::shared_ptr<ChunkStore::Chunk>>& chunks, int shard,
+    int num_shards, int64_t max_file_bytes, internal::BandwidthLimiter* limiter,
+    std::vector<WrittenChunkFile>* files) {
+  std::unique_ptr<ChunkFileWriter> writer;
+  int64_t file_bytes = 0;
+  for (int i = shard; i < chunks.size(); i += num_shards) {
+    // The data is pinned rather than its cached encoding requested so that
+    // checkpointing does not double the memory held by every chunk.
+    std::shared_ptr<const ChunkData> data;
+    REVERB_RETURN_IF_ERROR(chunks[i]->PinData(&data));
+    const std::string serialized = data->SerializeAsString();
+
+    if (writer != nullptr && max_file_bytes > 0 &&
+        file_bytes + serialized.size() > max_file_bytes) {
+      REVERB_RETURN_IF_ERROR(writer->Close());
+      writer = nullptr;
+    }
+    if (writer == nullptr) {
+      files->emplace_back();
+      files->back().path = file_path(files->size() - 1);
+      REVERB_RETURN_IF_ERROR(
+          open(tensorflow::io::JoinPath(root_dir, files->back().path),
+               &writer));
+      file_bytes = 0;
+    }
+
+    ThrottleWrite(limiter, serialized.size());
+    REVERB_RETURN_IF_ERROR(writer->Append(*chunks[i], serialized));
+    file_bytes += serialized.size();
+    files->back().chunks.emplace_back(chunks[i]->key(), serialized.size());
+  }
+  return writer == nullptr ? absl::OkStatus() : writer->Close();
+}
+
 }  // namespace
 
 TFRecordCheckpointer::TFRecordCheckpointer(std::string root_dir,
-                                           std::string group)
-    : root_dir_(std::move(root_dir)), group_(std::move(group)) {
+                                           std::string group, int num_shards,
+                                           bool streaming_load,
+                                           bool mapped_chunk_files,
+                                           std::string compression_type,
+                                           int64_t max_bytes_per_second,
+                                           int64_t max_chunk_file_bytes)
+    : root_dir_(std::move(root_dir)),
+      group_(std::move(group)),
+      num_shards_(num_shards),
+      streaming_load_(streaming_load),
+      mapped_chunk_files_(mapped_chunk_files),
+      compression_type_(std::move(compression_type)),
+      write_limiter_(max_bytes_per_second > 0
+                         ? absl::make_unique<internal::BandwidthLimiter>(
+                               max_bytes_per_second)
+                         : nullptr),
+      max_chunk_file_bytes_(max_chunk_file_bytes) {
+  REVERB_CHECK_GT(num_shards_, 0);
+  REVERB_CHECK_GE(max_bytes_per_second, 0);
+  REVERB_CHECK_GE(max_chunk_file_bytes_, 0);
+  REVERB_CHECK(compression_type_.empty() ||
+               !RecordFileSuffix(compression_type_).empty())
+      << "Unsupported compression type: " << compression_type_;
   REVERB_LOG(REVERB_INFO) << "Initializing TFRecordCheckpointer in "
                           << root_dir_;
 }
 
+TFRecordCheckpointer::~TFRecordCheckpointer() { StopLoading(); }
+
 absl::Status TFRecordCheckpointer::Save(std::vector<Table*> tables,
                                         int keep_latest, std::string* path) {
   if (keep_latest <= 0) {
@@ -159,6 +621,13 @@ absl::Status TFRecordCheckpointer::Save(std::vector<Table*> tables,
         "Setting non-empty group is not supported");
   }
 
+  // The tables must not be checkpointed while items are still being restored
+  // into them.
+  {
+    absl::MutexLock lock(&mu_);
+    FinishBackgroundLoad(/*cancel=*/false);
+  }
+
   std::string dir_path =
       tensorflow::io::JoinPath(root_dir_, absl::FormatTime(absl::Now()));
   REVERB_RETURN_IF_ERROR(FromTensorflowStatus(
@@ -166,52 +635,183 @@ absl::Status TFRecordCheckpointer::Save(std::vector<Table*> tables,
 
   RecordWriterUniquePtr table_writer;
   REVERB_RETURN_IF_ERROR(OpenWriter(
-      tensorflow::io::JoinPath(dir_path, kTablesFileName), &table_writer));
+      absl::StrCat(tensorflow::io::JoinPath(dir_path, kTablesFileName),
+                   RecordFileSuffix(compression_type_)),
+      &table_writer));
 
-  absl::flat_hash_set<std::shared_ptr<ChunkStore::Chunk>> chunks;
+  // The chunks are ordered by the first (oldest) item of each table which
+  // references them so that a streaming load can insert the items while the
+  // chunk files are still being read.
+  std::vector<std::shared_ptr<ChunkStore::Chunk>> chunks;
+  internal::flat_hash_set<ChunkStore::Key> chunk_keys;
   for (Table* table : tables) {
     auto checkpoint = table->Checkpoint();
-    chunks.merge(checkpoint.chunks);
-    REVERB_RETURN_IF_ERROR(FromTensorflowStatus(
-        table_writer->WriteRecord(checkpoint.checkpoint.SerializeAsString())));
+    for (auto& item : *checkpoint.checkpoint.mutable_items()) {
+      item.clear_table();  // Restored from `table_name` when loaded.
+    }
+    const std::string record = checkpoint.checkpoint.SerializeAsString();
+    ThrottleWrite(write_limiter_.get(), record.size());
+    REVERB_RETURN_IF_ERROR(
+        FromTensorflowStatus(table_writer->WriteRecord(record)));
+
+    ChunkByKey table_chunks;
+    for (auto& chunk : checkpoint.chunks) {
+      table_chunks[chunk->key()] = chunk;
+    }
+    for (const auto& item : checkpoint.checkpoint.items()) {
+      for (const auto key : internal::GetChunkKeys(item.flat_trajectory())) {
+        if (chunk_keys.insert(key).second) {
+          chunks.push_back(table_chunks[key]);
+        }
+      }
+    }
   }
 
   REVERB_RETURN_IF_ERROR(FromTensorflowStatus(table_writer->Close()));
   table_writer = nullptr;
 
-  RecordWriterUniquePtr chunk_writer;
-  REVERB_RETURN_IF_ERROR(OpenWriter(
-      tensorflow::io::JoinPath(dir_path, kChunksFileName), &chunk_writer));
+  absl::MutexLock lock(&mu_);
 
+  // Chunk files which are mostly made up of chunks that are no longer
+  // referenced are not reused, which allows them to be deleted once the older
+  // checkpoints listing them have been deleted.
+  internal::flat_hash_map<const ChunkFile*, int64_t> referenced_bytes;
   for (const auto& chunk : chunks) {
-    REVERB_RETURN_IF_ERROR(FromTensorflowStatus(
-        chunk_writer->WriteRecord(chunk->data().SerializeAsString())));
+    auto it = stored_chunks_.find(chunk->key());
+    if (it != stored_chunks_.end()) {
+      referenced_bytes[it->second.file.get()] += it->second.num_bytes;
+    }
   }
-  REVERB_RETURN_IF_ERROR(FromTensorflowStatus(chunk_writer->Close()));
-  chunk_writer = nullptr;
+
+  internal::flat_hash_map<ChunkStore::Key, StoredChunk> stored_chunks;
+  internal::flat_hash_set<std::string> chunk_files;
+  std::vector<std::shared_ptr<ChunkStore::Chunk>> new_chunks;
+  for (const auto& chunk : chunks) {
+    auto it = stored_chunks_.find(chunk->key());
+    if (it != stored_chunks_.end() &&
+        referenced_bytes[it->second.file.get()] >=
+            kMinReferencedChunkFileFraction * it->second.file->num_bytes) {
+      chunk_files.insert(it->second.file->path);
+      stored_chunks.emplace(chunk->key(), it->second);
+    } else {
+      new_chunks.push_back(chunk);
+    }
+  }
+
+  if (!new_chunks.empty()) {
+    REVERB_RETURN_IF_ERROR(
+        FromTensorflowStatus(tensorflow::Env::Default()->RecursivelyCreateDir(
+            tensorflow::io::JoinPath(root_dir_, kChunkFilesDirName))));
+
+    // The new chunks are split between shards which are written to separate
+    // files in parallel.
+    const int num_shards = std::min<int>(num_shards_, new_chunks.size());
+    std::vector<std::vector<WrittenChunkFile>> shard_files(num_shards);
+    std::vector<absl::Status> shard_statuses(num_shards);
+    {
+      internal::ThreadPool pool("TFRecordCheckpointer_Save", num_shards);
+      for (int shard = 0; shard < num_shards; shard++) {
+        pool.Schedule([&, shard] {
+          // When the shards are split into parts, the part comes first in the
+          // name so that the (sorted) list of chunk files remains ordered by
+          // the age of the chunks.
+          auto file_path = [&, shard](int part) {
+            std::string name(tensorflow::io::Basename(dir_path));
+            if (max_chunk_file_bytes_ > 0) {
+              absl::StrAppend(&name, "_", absl::StrFormat("%06d", part));
+            }
+            absl::StrAppend(&name, "_", shard);
+            if (mapped_chunk_files_) {
+              absl::StrAppend(&name, ".", kMappedChunkFileExtension);
+            } else {
+              absl::StrAppend(&name, ".tfrecord",
+                              RecordFileSuffix(compression_type_));
+            }
+            return tensorflow::io::JoinPath(kChunkFilesDirName, name);
+          };
+          shard_statuses[shard] = WriteChunks(
+              root_dir_, file_path,
+              mapped_chunk_files_ ? MappedChunkFileWriter::Open
+                                  : RecordChunkFileWriter::Open,
+              new_chunks, shard, num_shards, max_chunk_file_bytes_,
+              write_limiter_.get(), &shard_files[shard]);
+        });
+      }
+    }
+
+    for (int shard = 0; shard < num_shards; shard++) {
+      REVERB_RETURN_IF_ERROR(shard_statuses[shard]);
+      for (const auto& written : shard_files[shard]) {
+        auto file = std::make_shared<ChunkFile>();
+        file->path = written.path;
+        chunk_files.insert(file->path);
+        for (const auto& [key, num_bytes] : written.chunks) {
+          file->num_bytes += num_bytes;
+          stored_chunks.emplace(key, StoredChunk{file, num_bytes});
+        }
+      }
+    }
+  }
+
+  ChunkFilesCheckpoint chunk_files_checkpoint;
+  for (const auto& file : chunk_files) {
+    chunk_files_checkpoint.add_files(file);
+  }
+  std::sort(chunk_files_checkpoint.mutable_files()->begin(),
+            chunk_files_checkpoint.mutable_files()->end());
+  REVERB_RETURN_IF_ERROR(FromTensorflowStatus(tensorflow::WriteBinaryProto(
+      tensorflow::Env::Default(),
+      tensorflow::io::JoinPath(dir_path, kChunkFilesFileName),
+      chunk_files_checkpoint)));
 
   // Both chunks and table checkpoint has now been written so we can proceed to
   // add the DONE-file.
   REVERB_RETURN_IF_ERROR(WriteDone(dir_path));
+  stored_chunks_ = std::move(stored_chunks);
 
-  // Delete the older checkpoints.
-  std::vector<std::string> filenames;
-  REVERB_RETURN_IF_ERROR(
-      FromTensorflowStatus(tensorflow::Env::Default()->GetMatchingPaths(
-          tensorflow::io::JoinPath(root_dir_, "*"), &filenames)));
-  std::sort(filenames.begin(), filenames.end());
-  int history_counter = 0;
-  for (auto it = filenames.rbegin(); it != filenames.rend(); it++) {
-    if (++history_counter > keep_latest) {
-      tensorflow::int64 undeleted_files;
-      tensorflow::int64 undeleted_dirs;
-      REVERB_RETURN_IF_ERROR(
-          FromTensorflowStatus(tensorflow::Env::Default()->DeleteRecursively(
-              *it, &undeleted_files, &undeleted_dirs)));
+  REVERB_RETURN_IF_ERROR(DeleteOldCheckpoints(keep_latest));
+
+  *path = std::move(dir_path);
+  return absl::OkStatus();
+}
+
+absl::Status TFRecordCheckpointer::DeleteOldCheckpoints(int keep_latest) {
+  auto* env = tensorflow::Env::Default();
+
+  std::vector<std::string> checkpoints;
+  REVERB_RETURN_IF_ERROR(ListCheckpoints(root_dir_, &checkpoints));
+  while (checkpoints.size() > keep_latest) {
+    tensorflow::int64 undeleted_files;
+    tensorflow::int64 undeleted_dirs;
+    REVERB_RETURN_IF_ERROR(FromTensorflowStatus(env->DeleteRecursively(
+        checkpoints.front(), &undeleted_files, &undeleted_dirs)));
+    checkpoints.erase(checkpoints.begin());
+  }
+
+  // Only chunk files listed by the remaining checkpoints are kept. Note that
+  // this includes checkpoints which are incomplete.
+  internal::flat_hash_set<std::string> referenced_files;
+  for (const auto& checkpoint : checkpoints) {
+    const std::string path =
+        tensorflow::io::JoinPath(checkpoint, kChunkFilesFileName);
+    if (!env->FileExists(path).ok()) continue;
+    ChunkFilesCheckpoint chunk_files;
+    REVERB_RETURN_IF_ERROR(FromTensorflowStatus(
+        tensorflow::ReadBinaryProto(env, path, &chunk_files)));
+    for (const auto& file : chunk_files.files()) {
+      referenced_files.insert(tensorflow::io::JoinPath(root_dir_, file));
     }
   }
 
-  *path = std::move(dir_path);
+  std::vector<std::string> chunk_files;
+  REVERB_RETURN_IF_ERROR(FromTensorflowStatus(env->GetMatchingPaths(
+      tensorflow::io::JoinPath(root_dir_, kChunkFilesDirName, "*"),
+      &chunk_files)));
+  for (const auto& file : chunk_files) {
+    if (!referenced_files.contains(file)) {
+      REVERB_RETURN_IF_ERROR(FromTensorflowStatus(env->DeleteFile(file)));
+    }
+  }
   return absl::OkStatus();
 }
 
@@ -225,154 +825,341 @@ absl::Status TFRecordCheckpointer::Load(
     return absl::InvalidArgumentError(
         absl::StrCat("Load called with invalid checkpoint path: ", dir_path));
   }
+  absl::MutexLock lock(&mu_);
+  FinishBackgroundLoad(/*cancel=*/true);
+
+  const std::string chunk_files_path =
+      tensorflow::io::JoinPath(dir_path, kChunkFilesFileName);
+  const bool has_chunk_files =
+      tensorflow::Env::Default()->FileExists(chunk_files_path).ok();
+  if (streaming_load_ && has_chunk_files) {
+    return StartBackgroundLoad(dir_path, chunk_store, tables);
+  }
+
+  std::vector<PriorityTableCheckpoint> checkpoints;
+  REVERB_RETURN_IF_ERROR(ReadTables(dir_path, &checkpoints));
+
   // Insert data first to ensure that all data referenced by the tables
   // exists. Keep the map of chunks around so that none of the chunks are
   // cleaned up before all the tables have been loaded.
-  internal::flat_hash_map<ChunkStore::Key, std::shared_ptr<ChunkStore::Chunk>>
-      chunk_by_key;
-  {
-    RecordReaderUniquePtr chunk_reader;
-    REVERB_RETURN_IF_ERROR(OpenReader(
-        tensorflow::io::JoinPath(dir_path, kChunksFileName), &chunk_reader));
-
-    ChunkData chunk_data;
-    absl::Status chunk_status;
-    tensorflow::uint64 chunk_offset = 0;
-    tensorflow::tstring chunk_record;
-    do {
-      chunk_status = FromTensorflowStatus(
-          chunk_reader->ReadRecord(&chunk_offset, &chunk_record));
-      if (!chunk_status.ok()) break;
-      if (!chunk_data.ParseFromArray(chunk_record.data(),
-                                     chunk_record.size())) {
-        return absl::DataLossError(
-            absl::StrCat("Could not parse TFRecord as ChunkData: '",
-                         absl::string_view(chunk_record), "'"));
+  ChunkByKey chunk_by_key;
+  internal::flat_hash_map<ChunkStore::Key, StoredChunk> stored_chunks;
+  if (has_chunk_files) {
+    ChunkFilesCheckpoint chunk_files;
+    REVERB_RETURN_IF_ERROR(FromTensorflowStatus(tensorflow::ReadBinaryProto(
+        tensorflow::Env::Default(), chunk_files_path, &chunk_files)));
+
+    // The chunk files can hold chunks which are not referenced by the tables
+    // of this checkpoint. These are skipped.
+    internal::flat_hash_set<ChunkStore::Key> keys;
+    CollectChunkKeys(checkpoints, &keys);
+
+    // The files are read in parallel and each of them inserts its chunks
+    // into `chunk_store` as they are parsed.
+    const int num_files = chunk_files.files_size();
+    std::vector<std::shared_ptr<ChunkFile>> files(num_files);
+    std::vector<ChunkByKey> file_chunk_by_key(num_files);
+    std::vector<std::vector<std::pair<ChunkStore::Key, int64_t>>> file_chunks(
+        num_files);
+    std::vector<absl::Status> file_statuses(num_files);
+    if (num_files > 0) {
+      internal::ThreadPool pool("TFRecordCheckpointer_Load",
+                                std::min(num_shards_, num_files));
+      for (int i = 0; i < num_files; i++) {
+        files[i] = std::make_shared<ChunkFile>();
+        files[i]->path = chunk_files.files(i);
+        pool.Schedule([&, i] {
+          file_statuses[i] = LoadChunks(
+              tensorflow::io::JoinPath(root_dir_, files[i]->path), &keys,
+              chunk_store,
+              [&](std::shared_ptr<ChunkStore::Chunk> chunk) {
+                file_chunk_by_key[i][chunk->key()] = std::move(chunk);
+                return absl::OkStatus();
+              },
+              [&](ChunkStore::Key key, int64_t num_bytes) {
+                files[i]->num_bytes += num_bytes;
+                if (keys.contains(key)) {
+                  file_chunks[i].emplace_back(key, num_bytes);
+                }
+              });
+        });
       }
-      if (chunk_data.deprecated_data_size()) {
-        if (!chunk_data.data().tensors().empty()) {
-          return absl::InternalError(
-              absl::StrCat("Checkpoint ChunkData at offset: ", chunk_offset,
-              " has both data and deprecated_data."));
-        }
-        chunk_data.mutable_data()->mutable_tensors()->Swap(
-            chunk_data.mutable_deprecated_data());
+    }
+
+    for (int i = 0; i < num_files; i++) {
+      REVERB_RETURN_IF_ERROR(file_statuses[i]);
+      chunk_by_key.merge(file_chunk_by_key[i]);
+      for (const auto& [key, num_bytes] : file_chunks[i]) {
+        stored_chunks[key] = StoredChunk{files[i], num_bytes};
       }
-      chunk_by_key[chunk_data.chunk_key()] = chunk_store->Insert(chunk_data);
-    } while (chunk_status.ok());
-    if (!absl::IsOutOfRange(chunk_status)) {
-      return chunk_status;
     }
+  } else {
+    REVERB_RETURN_IF_ERROR(LoadChunks(
+        tensorflow::io::JoinPath(dir_path, kLegacyChunksFileName),
+        /*keys=*/nullptr, chunk_store,
+        [&](std::shared_ptr<ChunkStore::Chunk> chunk) {
+          chunk_by_key[chunk->key()] = std::move(chunk);
+          return absl::OkStatus();
+        },
+        [](ChunkStore::Key, int64_t) {}));
   }
 
-  RecordReaderUniquePtr table_reader;
-  REVERB_RETURN_IF_ERROR(OpenReader(
-      tensorflow::io::JoinPath(dir_path, kTablesFileName), &table_reader));
+  // The tables are independent of each other so they are filled in parallel.
+  // Each table is bulk loaded so its memory is allocated once for all items.
+  const int num_tables = checkpoints.size();
+  std::vector<int> indices(num_tables);
+  std::vector<std::shared_ptr<Table>> loaded_tables(num_tables);
+  for (int i = 0; i < num_tables; i++) {
+    REVERB_RETURN_IF_ERROR(MakeEmptyTable(&checkpoints[i], tables, &indices[i],
+                                          &loaded_tables[i]));
+  }
+  std::vector<absl::Status> table_statuses(num_tables);
+  if (num_tables > 0) {
+    internal::ThreadPool pool("TFRecordCheckpointer_LoadTables",
+                              std::min(num_shards_, num_tables));
+    for (int i = 0; i < num_tables; i++) {
+      pool.Schedule([&, i] {
+        std::vector<Table::Item> items(checkpoints[i].items_size());
+        for (int j = 0; j < items.size(); j++) {
+          table_statuses[i] = ToTableItem(checkpoints[i].items(j), chunk_store,
+                                          chunk_by_key, &items[j]);
+          if (!table_statuses[i].ok()) return;
+        }
 
-  PriorityTableCheckpoint checkpoint;
-  absl::Status table_status;
-  tensorflow::uint64 table_offset = 0;
-  tensorflow::tstring table_record;
-  do {
-    table_status = FromTensorflowStatus(
-        table_reader->ReadRecord(&table_offset, &table_record));
-    if (!table_status.ok()) break;
-    if (!checkpoint.ParseFromArray(table_record.data(), table_record.size())) {
-      return absl::DataLossError(
-          absl::StrCat("Could not parse TFRecord as Checkpoint: '",
-                       absl::string_view(table_record), "'"));
+        // The original table has already been destroyed so if this fails
+        // then there is way to recover.
+        REVERB_CHECK_OK(loaded_tables[i]->BulkLoad(std::move(items)));
+      });
     }
+  }
 
-    int index = find_table_index(tables, checkpoint.table_name());
-    if (index == -1) {
-      std::vector<std::string> table_names;
-      for (const auto& table : *tables) {
-        table_names.push_back(absl::StrCat("'", table->name(), "'"));
-      }
-      return absl::InvalidArgumentError(absl::StrCat(
-          "Trying to load table ", checkpoint.table_name(),
-          " but table was not found in provided list of tables. Available "
-          "tables: [",
-          absl::StrJoin(table_names, ", "), "]"));
-    }
+  for (int i = 0; i < num_tables; i++) {
+    REVERB_RETURN_IF_ERROR(table_statuses[i]);
+    tables->at(indices[i]).swap(loaded_tables[i]);
+  }
 
-    auto sampler = MakeDistribution(checkpoint.sampler());
-    auto remover = MakeDistribution(checkpoint.remover());
-    auto rate_limiter =
-        std::make_shared<RateLimiter>(checkpoint.rate_limiter());
-    auto extensions = tables->at(index)->UnsafeClearExtensions();
-    auto signature =
-        checkpoint.has_signature()
-            ? absl::make_optional(std::move(checkpoint.signature()))
-            : absl::nullopt;
-
-    auto table = std::make_shared<Table>(
-        /*name=*/checkpoint.table_name(),
-        /*sampler=*/std::move(sampler),
-        /*remover=*/std::move(remover),
-        /*max_size=*/checkpoint.max_size(),
-        /*max_times_sampled=*/checkpoint.max_times_sampled(),
-        /*rate_limiter=*/std::move(rate_limiter),
-        /*extensions=*/std::move(extensions),
-        /*signature=*/std::move(signature));
-    table->set_num_deleted_episodes_from_checkpoint(
-        checkpoint.num_deleted_episodes());
+  stored_chunks_ = std::move(stored_chunks);
+  return absl::OkStatus();
+}
 
-    for (const auto& checkpoint_item : checkpoint.items()) {
-      Table::Item insert_item;
-      insert_item.item = checkpoint_item;
+struct TFRecordCheckpointer::BackgroundLoad {
+  // Reads the chunks of `file` which are in `keys` into `chunk_store` and
+  // `chunk_by_key`.
+  void ReadChunkFile(const std::string& root_dir,
+                     std::shared_ptr<ChunkFile> file,
+                     const internal::flat_hash_set<ChunkStore::Key>& keys,
+                     ChunkStore* chunk_store) ABSL_LOCKS_EXCLUDED(mu) {
+    std::vector<std::pair<ChunkStore::Key, int64_t>> file_chunks;
+    auto status = LoadChunks(
+        tensorflow::io::JoinPath(root_dir, file->path), &keys, chunk_store,
+        [this](std::shared_ptr<ChunkStore::Chunk> chunk) {
+          absl::MutexLock lock(&mu);
+          if (cancelled) return absl::CancelledError("Load was stopped.");
+          chunk_by_key[chunk->key()] = std::move(chunk);
+          return absl::OkStatus();
+        },
+        [&](ChunkStore::Key key, int64_t num_bytes) {
+          file->num_bytes += num_bytes;
+          if (keys.contains(key)) {
+            file_chunks.emplace_back(key, num_bytes);
+          }
+        });
 
-      if (insert_item.item.has_deprecated_sequence_range() &&
-          insert_item.item.has_flat_trajectory()) {
-        return absl::InternalError(
-            absl::StrCat("Item ", insert_item.item.key(),
-                         " has both deprecated and new trajectory format: ",
-                         insert_item.item.DebugString(), "."));
-      }
+    absl::MutexLock lock(&mu);
+    num_pending_files--;
+    this->status.Update(status);
+    for (const auto& [key, num_bytes] : file_chunks) {
+      stored_chunks[key] = StoredChunk{file, num_bytes};
+    }
+  }
 
-      if (insert_item.item.has_deprecated_sequence_range()) {
-        std::vector<std::shared_ptr<ChunkStore::Chunk>> trajectory_chunks;
-        REVERB_CHECK_OK(FromTensorflowStatus(chunk_store->Get(
-            insert_item.item.deprecated_chunk_keys(), &trajectory_chunks)));
+  // Inserts the items of `checkpoint` into `table` in order, each one as soon
+  // as all the chunks it references have been read.
+  void InsertItems(const PriorityTableCheckpoint& checkpoint,
+                   ChunkStore* chunk_store, Table* table)
+      ABSL_LOCKS_EXCLUDED(mu) {
+    for (const auto& checkpoint_item : checkpoint.items()) {
+      const auto keys = ItemChunkKeys(checkpoint_item);
+      auto ready = [&]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu) {
+        if (cancelled || !status.ok() || num_pending_files == 0) return true;
+        for (const auto key : keys) {
+          if (!chunk_by_key.contains(key)) return false;
+        }
+        return true;
+      };
 
-        *insert_item.item.mutable_flat_trajectory() =
-            internal::FlatTimestepTrajectory(
-                trajectory_chunks,
-                insert_item.item.deprecated_sequence_range().offset(),
-                insert_item.item.deprecated_sequence_range().length());
+      Table::Item item;
+      {
+        absl::MutexLock lock(&mu);
+        mu.Await(absl::Condition(&ready));
+        if (cancelled || !status.ok()) return;
 
-        insert_item.item.clear_deprecated_sequence_range();
-        insert_item.item.clear_deprecated_chunk_keys();
+        for (const auto key : keys) {
+          if (!chunk_by_key.contains(key)) {
+            status = absl::DataLossError(absl::StrCat(
+                "Chunk ", key, " referenced by item ", checkpoint_item.key(),
+                " of table ", checkpoint.table_name(),
+                " not found in checkpoint."));
+            return;
+          }
+        }
+        status.Update(
+            ToTableItem(checkpoint_item, chunk_store, chunk_by_key, &item));
+        if (!status.ok()) return;
       }
 
-      for (const auto& key :
-           internal::GetChunkKeys(insert_item.item.flat_trajectory())) {
-        REVERB_CHECK(chunk_by_key.contains(key));
-        insert_item.chunks.push_back(chunk_by_key[key]);
+      auto insert_status = table->InsertRestoredItem(std::move(item));
+      if (!insert_status.ok()) {
+        absl::MutexLock lock(&mu);
+        status.Update(insert_status);
+        return;
       }
-
-      // The original table has already been destroyed so if this fails then
-      // there is way to recover.
-      REVERB_CHECK_OK(table->InsertCheckpointItem(std::move(insert_item)));
     }
+  }
+
+  absl::Mutex mu;
+
+  // The chunks which have been read so far.
+  ChunkByKey chunk_by_key ABSL_GUARDED_BY(mu);
 
-    tables->at(index).swap(table);
-  } while (table_status.ok());
+  // Location of the chunks referenced by the tables of the checkpoint.
+  internal::flat_hash_map<ChunkStore::Key, StoredChunk> stored_chunks
+      ABSL_GUARDED_BY(mu);
+
+  // Number of chunk files which have not yet been read in full.
+  int num_pending_files ABSL_GUARDED_BY(mu) = 0;
+
+  // Set when the load is stopped before it has completed.
+  bool cancelled ABSL_GUARDED_BY(mu) = false;
+
+  // The first error encountered by the load.
+  absl::Status status ABSL_GUARDED_BY(mu);
+
+  // Runs the load. Must be joined before the other members are destroyed.
+  std::unique_ptr<internal::Thread> thread;
+};
+
+absl::Status TFRecordCheckpointer::StartBackgroundLoad(
+    const std::string& dir_path, ChunkStore* chunk_store,
+    std::vector<std::shared_ptr<Table>>* tables) {
+  ChunkFilesCheckpoint chunk_files;
+  REVERB_RETURN_IF_ERROR(FromTensorflowStatus(tensorflow::ReadBinaryProto(
+      tensorflow::Env::Default(),
+      tensorflow::io::JoinPath(dir_path, kChunkFilesFileName), &chunk_files)));
 
-  if (!absl::IsOutOfRange(table_status)) {
-    return table_status;
+  auto checkpoints = std::make_shared<std::vector<PriorityTableCheckpoint>>();
+  REVERB_RETURN_IF_ERROR(ReadTables(dir_path, checkpoints.get()));
+
+  auto keys = std::make_shared<internal::flat_hash_set<ChunkStore::Key>>();
+  CollectChunkKeys(*checkpoints, keys.get());
+
+  // The tables are restored without any items and replace the original tables
+  // right away. The restored items are counted as new inserts by the rate
+  // limiters so sampling is blocked until enough of them are resident.
+  std::vector<std::shared_ptr<Table>> restored_tables;
+  for (auto& checkpoint : *checkpoints) {
+    auto* rate_limiter = checkpoint.mutable_rate_limiter();
+    rate_limiter->set_insert_count(rate_limiter->insert_count() -
+                                   checkpoint.items_size());
+
+    int index;
+    std::shared_ptr<Table> table;
+    REVERB_RETURN_IF_ERROR(MakeEmptyTable(&checkpoint, tables, &index, &table));
+    tables->at(index) = table;
+    restored_tables.push_back(std::move(table));
   }
+
+  std::vector<std::shared_ptr<ChunkFile>> files;
+  for (const auto& path : chunk_files.files()) {
+    files.push_back(std::make_shared<ChunkFile>());
+    files.back()->path = path;
+  }
+
+  auto load = std::make_shared<BackgroundLoad>();
+  {
+    absl::MutexLock lock(&load->mu);
+    load->num_pending_files = files.size();
+  }
+
+  // The thread must not reference `this` as it runs without holding `mu_`.
+  load->thread = internal::StartThread(
+      "TFRecordCheckpointer_BackgroundLoad",
+      [load = load.get(), root_dir = root_dir_, dir_path,
+       num_readers = std::max(1, std::min<int>(num_shards_, files.size())),
+       checkpoints, keys, files, chunk_store, restored_tables] {
+        const absl::Time start = absl::Now();
+
+        std::vector<std::unique_ptr<internal::Thread>> inserters;
+        for (int i = 0; i < restored_tables.size(); i++) {
+          inserters.push_back(internal::StartThread(
+              "TFRecordCheckpointer_BackgroundInsert", [&, i] {
+                load->InsertItems(checkpoints->at(i), chunk_store,
+                                  restored_tables[i].get());
+              }));
+        }
+
+        // The files are listed oldest first, which is also the order in which
+        // the items referencing their chunks were inserted.
+        {
+          internal::ThreadPool pool("TFRecordCheckpointer_BackgroundRead",
+                                    num_readers);
+          for (const auto& file : files) {
+            pool.Schedule([&, file] {
+              load->ReadChunkFile(root_dir, file, *keys, chunk_store);
+            });
+          }
+        }
+        inserters.clear();  // Joins all threads.
+
+        absl::MutexLock lock(&load->mu);
+        // The inserted items now hold the references to their chunks.
+        load->chunk_by_key.clear();
+        if (load->cancelled) {
+          REVERB_LOG(REVERB_INFO)
+              << "Stopped loading checkpoint from " << dir_path;
+        } else if (load->status.ok()) {
+          REVERB_LOG(REVERB_INFO)
+              << "Finished loading checkpoint from " << dir_path << " in "
+              << absl::FormatDuration(absl::Now() - start);
+        } else {
+          REVERB_LOG(REVERB_ERROR) << "Failed to load checkpoint from "
+                                   << dir_path << ": " << load->status;
+        }
+      });
+
+  background_load_ = std::move(load);
   return absl::OkStatus();
 }
 
+void TFRecordCheckpointer::FinishBackgroundLoad(bool cancel) {
+  if (background_load_ == nullptr) return;
+  if (cancel) {
+    absl::MutexLock lock(&background_load_->mu);
+    background_load_->cancelled = true;
+  }
+  background_load_->thread = nullptr;  // Joins the thread.
+
+  absl::MutexLock lock(&background_load_->mu);
+  if (!background_load_->cancelled && background_load_->status.ok()) {
+    stored_chunks_ = std::move(background_load_->stored_chunks);
+  } else {
+    // The chunk files are not known to hold all the chunks of the tables so
+    // the next checkpoint has to write all of them.
+    stored_chunks_.clear();
+  }
+  background_load_ = nullptr;
+}
+
+void TFRecordCheckpointer::StopLoading() {
+  absl::MutexLock lock(&mu_);
+  FinishBackgroundLoad(/*cancel=*/true);
+}
+
 absl::Status TFRecordCheckpointer::LoadLatest(
     ChunkStore* chunk_store, std::vector<std::shared_ptr<Table>>* tables) {
   REVERB_LOG(REVERB_INFO) << "Loading latest checkpoint from " << root_dir_;
   std::vector<std::string> filenames;
-  REVERB_RETURN_IF_ERROR(
-      FromTensorflowStatus(tensorflow::Env::Default()->GetMatchingPaths(
-          tensorflow::io::JoinPath(root_dir_, "*"), &filenames)));
-  std::sort(filenames.begin(), filenames.end());
+  REVERB_RETURN_IF_ERROR(ListCheckpoints(root_dir_, &filenames));
   for (auto it = filenames.rbegin(); it != filenames.rend(); it++) {
     if (HasDone(*it)) {
       return Load(tensorflow::io::Basename(*it), chunk_store, tables);
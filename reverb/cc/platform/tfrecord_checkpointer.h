@@ -19,10 +19,15 @@
 #include <string>
 #include <vector>
 
+#include <cstdint>
+#include "absl/base/thread_annotations.h"
 #include "absl/status/status.h"
 #include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
 #include "reverb/cc/checkpointing/interface.h"
 #include "reverb/cc/chunk_store.h"
+#include "reverb/cc/platform/hash_map.h"
+#include "reverb/cc/support/bandwidth_limiter.h"
 #include "reverb/cc/table.h"
 
 namespace deepmind {
@@ -40,14 +45,65 @@ namespace reverb {
 // for the complete duration of the checkpointing operation.
 //
 // To avoid duplicating data, the union of the referenced chunks are
-// deduplicated before being stored to disk. The stored checkpoint has the
-// following format:
+// deduplicated before being stored to disk. Chunks are furthermore stored in
+// chunk files which are shared between checkpoints so each checkpoint only
+// writes the chunks which have been created since the previous one. The stored
+// checkpoints have the following format:
 //
 //   <root_dir>/
 //     <timestamp of the checkpoint>/
 //       tables.tfrecord
-//       chunks.tfrecord
+//       chunk_files.pb
 //       DONE
+//     chunks/
+//       <timestamp of the checkpoint which wrote the file>_<shard>.tfrecord
+//
+// If `mapped_chunk_files` is set then the chunk files are instead written with
+// `internal::MappedChunkFile` and named `<timestamp>_<shard>.chunks`. Loading
+// such a file only reads its index: the loaded chunks reference the memory
+// mapped file and are parsed the first time their data is used, so a large
+// checkpoint is loaded without reading all of its chunks up front. This
+// requires `root_dir` to be on a local file system. Chunk files of both
+// formats can be loaded regardless of the option.
+//
+// `chunk_files.pb` is a `ChunkFilesCheckpoint` listing the chunk files which
+// hold the chunks referenced by the tables of the checkpoint. Chunk files which
+// are not listed by any of the retained checkpoints are deleted. A chunk file
+// whose referenced chunks make up less than half of its size has its
+// referenced chunks rewritten by the next checkpoint, which bounds the disk
+// space held by chunks that are no longer referenced.
+//
+// The chunks written by a checkpoint are split into up to `num_shards` files
+// which are written in parallel. The chunk files of a checkpoint are likewise
+// read in parallel when it is loaded.
+//
+// If `max_chunk_file_bytes` is positive then each shard is further split into
+// parts of at most `max_chunk_file_bytes` (unless a single chunk is larger),
+// named `<timestamp>_<part>_<shard>`. Object stores (e.g. GCS or S3) upload
+// each file as a single stream, so a large checkpoint is then written as many
+// bounded objects, `num_shards` at a time, rather than as a few very large
+// ones. `chunk_files.pb` serves as the manifest of the parts and `DONE` is
+// still written last.
+//
+// Chunks are written in the order of the first (oldest) item referencing
+// them. If `streaming_load` is set then `Load` returns as soon as the tables
+// have been restored without any items. The chunk files are then read in the
+// background and the items of every table are inserted, oldest first, as soon
+// as all the chunks they reference have been read. Sampling can therefore
+// start as soon as enough items are resident to satisfy the rate limiter.
+//
+// If `compression_type` is "ZLIB" or "GZIP" then `tables.tfrecord` and the
+// record chunk files are compressed and their names get the suffix ".zlib" or
+// ".gz" respectively. The compression of a file is inferred from its name when
+// it is read, so files written with and without compression can be mixed. The
+// chunks themselves are already compressed per tensor, so this mostly shrinks
+// the tables file, where the items otherwise dominate the size of checkpoints
+// with small chunks. Items are furthermore written without the name of their
+// table, which is restored from `table_name` of the table checkpoint.
+//
+// Checkpoints written before chunk files were introduced instead hold all
+// their chunks in `<timestamp of the checkpoint>/chunks.tfrecord`. These can
+// still be loaded.
 //
 // DONE an empty file written once the checkpoint has been successfully written.
 // If DONE does not exist then the checkpoint is in process of being written or
@@ -57,11 +113,26 @@ namespace reverb {
 // The most recent checkpoint can therefore be inferred from the name of the
 // directories within `root_dir`.
 //
+// If `max_bytes_per_second` is positive then the records written by `Save`
+// (over all shards) are throttled to that rate so that a checkpoint does not
+// starve the tables of disk and memory bandwidth while they keep serving.
+//
 // If `group` is nonempty then the directory containing the checkpoint will be
 // created with `group` as group.
 class TFRecordCheckpointer : public Checkpointer {
  public:
-  explicit TFRecordCheckpointer(std::string root_dir, std::string group = "");
+  static constexpr int kDefaultNumShards = 8;
+
+  explicit TFRecordCheckpointer(std::string root_dir, std::string group = "",
+                                int num_shards = kDefaultNumShards,
+                                bool streaming_load = false,
+                                bool mapped_chunk_files = false,
+                                std::string compression_type = "",
+                                int64_t max_bytes_per_second = 0,
+                                int64_t max_chunk_file_bytes = 0);
+
+  // Stops any load which is still running in the background.
+  ~TFRecordCheckpointer() override;
 
   // Save a new checkpoint for every table in `tables` in sub directory
   // inside `root_dir_`. If the call is successful, the ABSOLUTE path to the
@@ -71,11 +142,18 @@ class TFRecordCheckpointer : public Checkpointer {
   // create it before proceeding.
   //
   // After a successful save, all but the `keep_latest` most recent checkpoints
-  // are deleted.
+  // are deleted, together with the chunk files no longer listed by any of
+  // them.
   absl::Status Save(std::vector<Table*> tables, int keep_latest,
                     std::string* path) override;
 
-  // Attempts to load a checkpoint stored within `root_dir_`.
+  // Attempts to load a checkpoint stored within `root_dir_`. The next `Save`
+  // only writes the chunks which are not part of the loaded checkpoint.
+  //
+  // If `streaming_load_` is set then the items are inserted into the returned
+  // tables in the background, see the class comment. Errors encountered by the
+  // background load are logged. Checkpoints written before chunk files were
+  // introduced are always loaded in full before `Load` returns.
   absl::Status Load(absl::string_view relative_path, ChunkStore* chunk_store,
                     std::vector<std::shared_ptr<Table>>* tables) override;
 
@@ -83,6 +161,10 @@ class TFRecordCheckpointer : public Checkpointer {
   absl::Status LoadLatest(ChunkStore* chunk_store,
                           std::vector<std::shared_ptr<Table>>* tables) override;
 
+  // Stops inserting the items of a streaming load and blocks until the
+  // background load has stopped. The items inserted so far are kept.
+  void StopLoading() override ABSL_LOCKS_EXCLUDED(mu_);
+
   // Returns a summary string description.
   std::string DebugString() const override;
 
@@ -91,8 +173,69 @@ class TFRecordCheckpointer : public Checkpointer {
   TFRecordCheckpointer& operator=(const TFRecordCheckpointer&) = delete;
 
  private:
+  // Chunk file and the total size of the chunks it holds.
+  struct ChunkFile {
+    std::string path;  // Relative to `root_dir_`.
+    int64_t num_bytes = 0;
+  };
+
+  // Location of a chunk which has been written to (or loaded from) a chunk
+  // file.
+  struct StoredChunk {
+    std::shared_ptr<ChunkFile> file;
+    int64_t num_bytes;
+  };
+
+  // State of a streaming load which is still running in the background.
+  struct BackgroundLoad;
+
+  // Restores the tables of the checkpoint in `dir_path` without any items and
+  // starts a background load which inserts the items as their chunks are read.
+  absl::Status StartBackgroundLoad(const std::string& dir_path,
+                                   ChunkStore* chunk_store,
+                                   std::vector<std::shared_ptr<Table>>* tables)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Blocks until the background load (if any) has completed, cancelling it
+  // first if `cancel` is set. If the load succeeded then the chunks it read
+  // become `stored_chunks_`.
+  void FinishBackgroundLoad(bool cancel) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Deletes all but the `keep_latest` most recent checkpoints and then the
+  // chunk files which none of the remaining checkpoints list.
+  absl::Status DeleteOldCheckpoints(int keep_latest);
+
   const std::string root_dir_;
   const std::string group_;
+
+  // Maximum number of files the chunks of a checkpoint are written to, and
+  // the number of threads used to write and read them.
+  const int num_shards_;
+
+  // Whether `Load` inserts the items in the background.
+  const bool streaming_load_;
+
+  // Whether `Save` writes chunk files which are memory mapped when loaded.
+  const bool mapped_chunk_files_;
+
+  // Compression of the record files written by `Save`. Empty if uncompressed.
+  const std::string compression_type_;
+
+  // Throttles the writes of `Save`. nullptr if unlimited.
+  const std::unique_ptr<internal::BandwidthLimiter> write_limiter_;
+
+  // Size at which the chunk files of a shard are split. 0 if unlimited.
+  const int64_t max_chunk_file_bytes_;
+
+  // Serializes `Save` and `Load` as both read and modify `stored_chunks_`.
+  absl::Mutex mu_;
+
+  // The chunks referenced by the most recently saved or loaded checkpoint.
+  internal::flat_hash_map<ChunkStore::Key, StoredChunk> stored_chunks_
+      ABSL_GUARDED_BY(mu_);
+
+  // The streaming load started by the most recent `Load`, or nullptr.
+  std::shared_ptr<BackgroundLoad> background_load_ ABSL_GUARDED_BY(mu_);
 };
 
 }  // namespace reverb
@@ -14,6 +14,7 @@
 
 #include "reverb/cc/platform/tfrecord_checkpointer.h"
 
+#include <algorithm>
 #include <cfloat>
 #include <memory>
 #include <string>
@@ -22,12 +23,15 @@
 
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
+#include "reverb/cc/checkpointing/checkpoint.pb.h"
 #include "reverb/cc/chunk_store.h"
 #include "reverb/cc/rate_limiter.h"
 #include "reverb/cc/platform/status_matchers.h"
 #include "reverb/cc/selectors/fifo.h"
 #include "reverb/cc/selectors/heap.h"
 #include "reverb/cc/selectors/prioritized.h"
+#include "reverb/cc/selectors/rank_based.h"
+#include "reverb/cc/selectors/reservoir.h"
 #include "reverb/cc/selectors/uniform.h"
 #include "reverb/cc/support/tf_util.h"
 #include "reverb/cc/table.h"
@@ -65,6 +69,22 @@ std::unique_ptr<Table> MakePrioritizedTable(const std::string& name,
       absl::make_unique<RateLimiter>(1.0, 1, -DBL_MAX, DBL_MAX));
 }
 
+std::unique_ptr<Table> MakeRankBasedTable(const std::string& name,
+                                          double exponent) {
+  return absl::make_unique<Table>(
+      name, absl::make_unique<RankBasedSelector>(exponent),
+      absl::make_unique<FifoSelector>(), 1000, 0,
+      absl::make_unique<RateLimiter>(1.0, 1, -DBL_MAX, DBL_MAX));
+}
+
+std::unique_ptr<Table> MakeReservoirTable(const std::string& name,
+                                          int64_t num_inserted = 0) {
+  return absl::make_unique<Table>(
+      name, absl::make_unique<UniformSelector>(),
+      absl::make_unique<ReservoirSelector>(num_inserted), 50, 0,
+      absl::make_unique<RateLimiter>(1.0, 1, -DBL_MAX, DBL_MAX));
+}
+
 std::unique_ptr<Table> MakeSignatureTable(const std::string& name) {
   tensorflow::StructuredValue signature;
   auto* spec =
@@ -98,6 +118,8 @@ TEST(TFRecordCheckpointerTest, SaveAndLoad) {
   tables.push_back(MakePrioritizedTable("prioritized_a", 0.5));
   tables.push_back(MakePrioritizedTable("prioritized_b", 0.9));
   tables.push_back(MakeSignatureTable("signature"));
+  tables.push_back(MakeRankBasedTable("rank_based", 0.7));
+  tables.push_back(MakeReservoirTable("reservoir"));
 
   std::vector<ChunkStore::Key> chunk_keys;
   for (int i = 0; i < 100; i++) {
@@ -121,8 +143,9 @@ TEST(TFRecordCheckpointerTest, SaveAndLoad) {
 
   std::string path;
   REVERB_ASSERT_OK(checkpointer.Save(
-      {tables[0].get(), tables[1].get(), tables[2].get(), tables[3].get()}, 1,
-      &path));
+      {tables[0].get(), tables[1].get(), tables[2].get(), tables[3].get(),
+       tables[4].get(), tables[5].get()},
+      1, &path));
 
   ChunkStore loaded_chunk_store;
   std::vector<std::shared_ptr<Table>> loaded_tables;
@@ -130,6 +153,8 @@ TEST(TFRecordCheckpointerTest, SaveAndLoad) {
   loaded_tables.push_back(MakePrioritizedTable("prioritized_a", 0.5));
   loaded_tables.push_back(MakePrioritizedTable("prioritized_b", 0.9));
   loaded_tables.push_back(MakeSignatureTable("signature"));
+  loaded_tables.push_back(MakeRankBasedTable("rank_based", 0.7));
+  loaded_tables.push_back(MakeReservoirTable("reservoir"));
   REVERB_ASSERT_OK(checkpointer.Load(tensorflow::io::Basename(path),
                                      &loaded_chunk_store, &loaded_tables));
 
@@ -138,9 +163,12 @@ TEST(TFRecordCheckpointerTest, SaveAndLoad) {
   REVERB_EXPECT_OK(
       FromTensorflowStatus(loaded_chunk_store.Get(chunk_keys, &chunks)));
 
-  // Check that the number of items matches for the loaded tables.
+  // Check that the number of items and the selectors match for the loaded
+  // tables.
   for (int i = 0; i < tables.size(); i++) {
     EXPECT_EQ(loaded_tables[i]->size(), tables[i]->size());
+    EXPECT_THAT(loaded_tables[i]->info().sampler_options(),
+                EqualsProto(tables[i]->info().sampler_options()));
   }
 
   // Check that the signature is properly loaded.
@@ -165,6 +193,89 @@ TEST(TFRecordCheckpointerTest, SaveAndLoad) {
   }
 }
 
+TEST(TFRecordCheckpointerTest, StreamingLoadInsertsItemsInBackground) {
+  ChunkStore chunk_store;
+  std::vector<std::shared_ptr<Table>> tables;
+  tables.push_back(MakeUniformTable("uniform"));
+  tables.push_back(MakeSignatureTable("signature"));
+  for (int i = 0; i < 100; i++) {
+    for (auto& table : tables) {
+      auto chunk = chunk_store.Insert(testing::MakeChunkData(i));
+      REVERB_EXPECT_OK(table->InsertOrAssign(
+          {testing::MakePrioritizedItem(i, i, {chunk->data()}), {chunk}}));
+    }
+  }
+
+  const std::string root = MakeRoot();
+  TFRecordCheckpointer checkpointer(root);
+  std::string path;
+  REVERB_ASSERT_OK(
+      checkpointer.Save({tables[0].get(), tables[1].get()}, 1, &path));
+
+  TFRecordCheckpointer streaming_checkpointer(
+      root, /*group=*/"", TFRecordCheckpointer::kDefaultNumShards,
+      /*streaming_load=*/true);
+  ChunkStore loaded_chunk_store;
+  std::vector<std::shared_ptr<Table>> loaded_tables;
+  loaded_tables.push_back(MakeUniformTable("uniform"));
+  loaded_tables.push_back(MakeSignatureTable("signature"));
+  REVERB_ASSERT_OK(streaming_checkpointer.Load(
+      tensorflow::io::Basename(path), &loaded_chunk_store, &loaded_tables));
+
+  // Sampling blocks until the rate limiter is satisfied by the loaded items.
+  for (auto& table : loaded_tables) {
+    Table::SampledItem sample;
+    REVERB_EXPECT_OK(table->Sample(&sample));
+  }
+
+  // Saving waits for the background load to complete.
+  std::string second_path;
+  REVERB_ASSERT_OK(streaming_checkpointer.Save(
+      {loaded_tables[0].get(), loaded_tables[1].get()}, 2, &second_path));
+  for (int i = 0; i < tables.size(); i++) {
+    EXPECT_EQ(loaded_tables[i]->size(), tables[i]->size());
+    auto original = tables[i]->Checkpoint().checkpoint;
+    auto loaded = loaded_tables[i]->Checkpoint().checkpoint;
+    ASSERT_EQ(loaded.items_size(), original.items_size());
+    for (int j = 0; j < original.items_size(); j++) {
+      EXPECT_EQ(loaded.items(j).key(), original.items(j).key());
+      EXPECT_THAT(loaded.items(j).inserted_at(),
+                  EqualsProto(original.items(j).inserted_at()));
+    }
+    EXPECT_EQ(loaded.rate_limiter().insert_count(),
+              original.rate_limiter().insert_count());
+  }
+}
+
+TEST(TFRecordCheckpointerTest, StopLoadingKeepsInsertedItems) {
+  ChunkStore chunk_store;
+  std::vector<std::shared_ptr<Table>> tables;
+  tables.push_back(MakeUniformTable("uniform"));
+  for (int i = 0; i < 100; i++) {
+    auto chunk = chunk_store.Insert(testing::MakeChunkData(i));
+    REVERB_EXPECT_OK(tables[0]->InsertOrAssign(
+        {testing::MakePrioritizedItem(i, i, {chunk->data()}), {chunk}}));
+  }
+
+  TFRecordCheckpointer checkpointer(MakeRoot(), /*group=*/"",
+                                    TFRecordCheckpointer::kDefaultNumShards,
+                                    /*streaming_load=*/true);
+  std::string path;
+  REVERB_ASSERT_OK(checkpointer.Save({tables[0].get()}, 1, &path));
+
+  ChunkStore loaded_chunk_store;
+  std::vector<std::shared_ptr<Table>> loaded_tables;
+  loaded_tables.push_back(MakeUniformTable("uniform"));
+  REVERB_ASSERT_OK(checkpointer.Load(tensorflow::io::Basename(path),
+                                     &loaded_chunk_store, &loaded_tables));
+  checkpointer.StopLoading();
+  EXPECT_LE(loaded_tables[0]->size(), 100);
+
+  // The next checkpoint writes all the chunks again as the load did not
+  // complete.
+  REVERB_ASSERT_OK(checkpointer.Save({loaded_tables[0].get()}, 2, &path));
+}
+
 TEST(TFRecordCheckpointerTest, SaveDeletesOldData) {
   ChunkStore chunk_store;
 
@@ -205,7 +316,8 @@ TEST(TFRecordCheckpointerTest, SaveDeletesOldData) {
       REVERB_ASSERT_OK(
           FromTensorflowStatus(tensorflow::Env::Default()->GetMatchingPaths(
               tensorflow::io::JoinPath(root, "*"), &filenames)));
-      ASSERT_EQ(filenames.size(), std::min(keep_latest, i + 1));
+      // The checkpoints and the directory holding the shared chunk files.
+      ASSERT_EQ(filenames.size(), std::min(keep_latest, i + 1) + 1);
     }
   };
   test(1);  // Keep one checkpoint.
@@ -213,6 +325,267 @@ TEST(TFRecordCheckpointerTest, SaveDeletesOldData) {
   test(5);  // Edge case keep_latest > num_tables
 }
 
+// Returns the chunk files listed by the checkpoint at `path`.
+std::vector<std::string> ChunkFiles(const std::string& path) {
+  ChunkFilesCheckpoint chunk_files;
+  REVERB_CHECK_OK(FromTensorflowStatus(tensorflow::ReadBinaryProto(
+      tensorflow::Env::Default(),
+      tensorflow::io::JoinPath(path, "chunk_files.pb"), &chunk_files)));
+  return {chunk_files.files().begin(), chunk_files.files().end()};
+}
+
+// Returns the number of files in the chunk files directory of `root`.
+int NumChunkFiles(const std::string& root) {
+  std::vector<std::string> filenames;
+  REVERB_CHECK_OK(
+      FromTensorflowStatus(tensorflow::Env::Default()->GetMatchingPaths(
+          tensorflow::io::JoinPath(root, "chunks", "*"), &filenames)));
+  return filenames.size();
+}
+
+void InsertItem(ChunkStore* chunk_store, Table* table, uint64_t key) {
+  auto chunk = chunk_store->Insert(testing::MakeChunkData(key));
+  REVERB_EXPECT_OK(table->InsertOrAssign(
+      {testing::MakePrioritizedItem(key, 1, {chunk->data()}), {chunk}}));
+}
+
+TEST(TFRecordCheckpointerTest, SaveOnlyWritesNewChunks) {
+  ChunkStore chunk_store;
+  auto table = MakeUniformTable("uniform");
+  for (int i = 0; i < 10; i++) {
+    InsertItem(&chunk_store, table.get(), i);
+  }
+
+  auto root = MakeRoot();
+  TFRecordCheckpointer checkpointer(root, /*group=*/"", /*num_shards=*/1);
+  std::string first_path;
+  REVERB_ASSERT_OK(checkpointer.Save({table.get()}, 2, &first_path));
+  auto first_files = ChunkFiles(first_path);
+  ASSERT_THAT(first_files, ::testing::SizeIs(1));
+
+  // Without any new chunks no chunk file is written.
+  std::string second_path;
+  REVERB_ASSERT_OK(checkpointer.Save({table.get()}, 2, &second_path));
+  EXPECT_EQ(ChunkFiles(second_path), first_files);
+
+  // The new chunks are written to a new file and the old file is reused.
+  for (int i = 10; i < 15; i++) {
+    InsertItem(&chunk_store, table.get(), i);
+  }
+  std::string third_path;
+  REVERB_ASSERT_OK(checkpointer.Save({table.get()}, 2, &third_path));
+  auto third_files = ChunkFiles(third_path);
+  ASSERT_THAT(third_files, ::testing::SizeIs(2));
+  EXPECT_THAT(third_files, ::testing::Contains(first_files[0]));
+
+  ChunkStore loaded_chunk_store;
+  std::vector<std::shared_ptr<Table>> loaded_tables;
+  loaded_tables.push_back(MakeUniformTable("uniform"));
+  REVERB_ASSERT_OK(checkpointer.Load(tensorflow::io::Basename(third_path),
+                                     &loaded_chunk_store, &loaded_tables));
+  EXPECT_EQ(loaded_tables[0]->size(), 15);
+  EXPECT_EQ(loaded_chunk_store.num_chunks(), 15);
+}
+
+TEST(TFRecordCheckpointerTest, SaveDeletesUnreferencedChunkFiles) {
+  ChunkStore chunk_store;
+  auto table = MakeUniformTable("uniform");
+  for (int i = 0; i < 10; i++) {
+    InsertItem(&chunk_store, table.get(), i);
+  }
+
+  auto root = MakeRoot();
+  TFRecordCheckpointer checkpointer(root, /*group=*/"", /*num_shards=*/1);
+  std::string path;
+  REVERB_ASSERT_OK(checkpointer.Save({table.get()}, 1, &path));
+  auto first_files = ChunkFiles(path);
+  EXPECT_EQ(NumChunkFiles(root), 1);
+
+  // Once most of the chunks of a file are no longer referenced the remaining
+  // ones are rewritten so the old file can be deleted.
+  REVERB_ASSERT_OK(table->MutateItems({}, {0, 1, 2, 3, 4, 5, 6}));
+  REVERB_ASSERT_OK(checkpointer.Save({table.get()}, 1, &path));
+  EXPECT_EQ(NumChunkFiles(root), 1);
+  EXPECT_NE(ChunkFiles(path), first_files);
+
+  ChunkStore loaded_chunk_store;
+  std::vector<std::shared_ptr<Table>> loaded_tables;
+  loaded_tables.push_back(MakeUniformTable("uniform"));
+  REVERB_ASSERT_OK(checkpointer.Load(tensorflow::io::Basename(path),
+                                     &loaded_chunk_store, &loaded_tables));
+  EXPECT_EQ(loaded_tables[0]->size(), 3);
+}
+
+TEST(TFRecordCheckpointerTest, SaveAfterLoadReusesChunkFiles) {
+  ChunkStore chunk_store;
+  auto table = MakeUniformTable("uniform");
+  for (int i = 0; i < 10; i++) {
+    InsertItem(&chunk_store, table.get(), i);
+  }
+
+  auto root = MakeRoot();
+  std::string path;
+  REVERB_ASSERT_OK(TFRecordCheckpointer(root).Save({table.get()}, 1, &path));
+  auto files = ChunkFiles(path);
+
+  TFRecordCheckpointer checkpointer(root);
+  ChunkStore loaded_chunk_store;
+  std::vector<std::shared_ptr<Table>> loaded_tables;
+  loaded_tables.push_back(MakeUniformTable("uniform"));
+  REVERB_ASSERT_OK(
+      checkpointer.LoadLatest(&loaded_chunk_store, &loaded_tables));
+
+  REVERB_ASSERT_OK(checkpointer.Save({loaded_tables[0].get()}, 1, &path));
+  EXPECT_EQ(ChunkFiles(path), files);
+  EXPECT_EQ(NumChunkFiles(root), files.size());
+}
+
+TEST(TFRecordCheckpointerTest, SplitsChunksBetweenShards) {
+  ChunkStore chunk_store;
+  auto table = MakeUniformTable("uniform");
+  for (int i = 0; i < 10; i++) {
+    InsertItem(&chunk_store, table.get(), i);
+  }
+
+  auto root = MakeRoot();
+  TFRecordCheckpointer checkpointer(root, /*group=*/"", /*num_shards=*/4);
+  std::string path;
+  REVERB_ASSERT_OK(checkpointer.Save({table.get()}, 1, &path));
+  EXPECT_THAT(ChunkFiles(path), ::testing::SizeIs(4));
+
+  // No more shards than new chunks are written.
+  InsertItem(&chunk_store, table.get(), 10);
+  InsertItem(&chunk_store, table.get(), 11);
+  REVERB_ASSERT_OK(checkpointer.Save({table.get()}, 1, &path));
+  EXPECT_THAT(ChunkFiles(path), ::testing::SizeIs(6));
+
+  ChunkStore loaded_chunk_store;
+  std::vector<std::shared_ptr<Table>> loaded_tables;
+  loaded_tables.push_back(MakeUniformTable("uniform"));
+  REVERB_ASSERT_OK(checkpointer.Load(tensorflow::io::Basename(path),
+                                     &loaded_chunk_store, &loaded_tables));
+  EXPECT_EQ(loaded_tables[0]->size(), 12);
+  EXPECT_EQ(loaded_chunk_store.num_chunks(), 12);
+}
+
+TEST(TFRecordCheckpointerTest, SplitsShardsIntoParts) {
+  ChunkStore chunk_store;
+  auto table = MakeUniformTable("uniform");
+  for (int i = 0; i < 10; i++) {
+    InsertItem(&chunk_store, table.get(), i);
+  }
+
+  // Every chunk exceeds the limit so each is written to its own part.
+  auto root = MakeRoot();
+  TFRecordCheckpointer checkpointer(root, /*group=*/"", /*num_shards=*/2,
+                                    /*streaming_load=*/false,
+                                    /*mapped_chunk_files=*/false,
+                                    /*compression_type=*/"",
+                                    /*max_bytes_per_second=*/0,
+                                    /*max_chunk_file_bytes=*/1);
+  std::string path;
+  REVERB_ASSERT_OK(checkpointer.Save({table.get()}, 1, &path));
+  EXPECT_THAT(ChunkFiles(path), ::testing::SizeIs(10));
+
+  ChunkStore loaded_chunk_store;
+  std::vector<std::shared_ptr<Table>> loaded_tables;
+  loaded_tables.push_back(MakeUniformTable("uniform"));
+  REVERB_ASSERT_OK(checkpointer.Load(tensorflow::io::Basename(path),
+                                     &loaded_chunk_store, &loaded_tables));
+  EXPECT_EQ(loaded_tables[0]->size(), 10);
+  EXPECT_EQ(loaded_chunk_store.num_chunks(), 10);
+}
+
+TEST(TFRecordCheckpointerTest, SaveAndLoadCompressed) {
+  ChunkStore chunk_store;
+  auto table = MakeUniformTable("uniform");
+  for (int i = 0; i < 10; i++) {
+    InsertItem(&chunk_store, table.get(), i);
+  }
+
+  auto root = MakeRoot();
+  TFRecordCheckpointer checkpointer(root, /*group=*/"", /*num_shards=*/2,
+                                    /*streaming_load=*/false,
+                                    /*mapped_chunk_files=*/false,
+                                    /*compression_type=*/"ZLIB");
+  std::string path;
+  REVERB_ASSERT_OK(checkpointer.Save({table.get()}, 1, &path));
+  REVERB_EXPECT_OK(FromTensorflowStatus(tensorflow::Env::Default()->FileExists(
+      tensorflow::io::JoinPath(path, "tables.tfrecord.zlib"))));
+  for (const auto& file : ChunkFiles(path)) {
+    EXPECT_EQ(tensorflow::io::Extension(file), "zlib");
+  }
+
+  // The compression is inferred from the file names when loading.
+  TFRecordCheckpointer uncompressed_checkpointer(root);
+  ChunkStore loaded_chunk_store;
+  std::vector<std::shared_ptr<Table>> loaded_tables;
+  loaded_tables.push_back(MakeUniformTable("uniform"));
+  REVERB_ASSERT_OK(uncompressed_checkpointer.Load(
+      tensorflow::io::Basename(path), &loaded_chunk_store, &loaded_tables));
+  EXPECT_EQ(loaded_chunk_store.num_chunks(), 10);
+
+  // The items are restored with the name of their table.
+  auto items = table->Copy();
+  auto loaded_items = loaded_tables[0]->Copy();
+  ASSERT_EQ(loaded_items.size(), items.size());
+  for (const auto& item : items) {
+    auto it = std::find_if(loaded_items.begin(), loaded_items.end(),
+                           [&](const Table::Item& loaded_item) {
+                             return loaded_item.item.key() == item.item.key();
+                           });
+    ASSERT_NE(it, loaded_items.end());
+    EXPECT_THAT(it->item, EqualsProto(item.item));
+  }
+}
+
+TEST(TFRecordCheckpointerTest, LoadsMappedChunkFilesLazily) {
+  ChunkStore chunk_store;
+  auto table = MakeUniformTable("uniform");
+  for (int i = 0; i < 10; i++) {
+    InsertItem(&chunk_store, table.get(), i);
+  }
+
+  auto root = MakeRoot();
+  TFRecordCheckpointer checkpointer(root, /*group=*/"", /*num_shards=*/2,
+                                    /*streaming_load=*/false,
+                                    /*mapped_chunk_files=*/true);
+  std::string path;
+  REVERB_ASSERT_OK(checkpointer.Save({table.get()}, 1, &path));
+  for (const auto& file : ChunkFiles(path)) {
+    EXPECT_EQ(tensorflow::io::Extension(file), "chunks");
+  }
+
+  ChunkStore loaded_chunk_store;
+  std::vector<std::shared_ptr<Table>> loaded_tables;
+  loaded_tables.push_back(MakeUniformTable("uniform"));
+  REVERB_ASSERT_OK(checkpointer.Load(tensorflow::io::Basename(path),
+                                     &loaded_chunk_store, &loaded_tables));
+  EXPECT_EQ(loaded_tables[0]->size(), 10);
+
+  for (ChunkStore::Key key = 0; key < 10; key++) {
+    std::vector<std::shared_ptr<ChunkStore::Chunk>> chunks;
+    REVERB_ASSERT_OK(
+        FromTensorflowStatus(loaded_chunk_store.Get({key}, &chunks)));
+    EXPECT_FALSE(chunks[0]->is_resident());
+
+    std::shared_ptr<const ChunkData> data;
+    REVERB_ASSERT_OK(chunks[0]->PinData(&data));
+    EXPECT_THAT(*data, EqualsProto(testing::MakeChunkData(key)));
+    EXPECT_TRUE(chunks[0]->is_resident());
+  }
+
+  // The mapped chunk files are shared with checkpoints written without the
+  // option.
+  TFRecordCheckpointer record_checkpointer(root);
+  loaded_tables[0] = MakeUniformTable("uniform");
+  REVERB_ASSERT_OK(record_checkpointer.Load(
+      tensorflow::io::Basename(path), &loaded_chunk_store, &loaded_tables));
+  const auto files = ChunkFiles(path);
+  REVERB_ASSERT_OK(record_checkpointer.Save({loaded_tables[0].get()}, 1, &path));
+  EXPECT_EQ(ChunkFiles(path), files);
+}
+
 TEST(TFRecordCheckpointerTest, KeepLatestZeroReturnsError) {
   ChunkStore chunk_store;
 
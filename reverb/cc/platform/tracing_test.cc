@@ -0,0 +1,49 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/platform/tracing.h"
+
+#include <string>
+
+#include "gtest/gtest.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+namespace {
+
+TEST(TracingTest, NamesAreNotGeneratedWithoutTrace) {
+  ASSERT_FALSE(TraceActive());
+
+  bool generated = false;
+  auto name_generator = [&generated] {
+    generated = true;
+    return std::string("span#key=value#");
+  };
+  {
+    ScopedTrace trace(name_generator);
+    TraceInstant(name_generator);
+  }
+  EXPECT_FALSE(generated);
+}
+
+TEST(TracingTest, SpansCanBeStoppedEarly) {
+  ScopedTrace trace("span");
+  trace.Stop();
+}
+
+}  // namespace
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
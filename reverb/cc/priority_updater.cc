@@ -0,0 +1,176 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/priority_updater.h"
+
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "grpcpp/client_context.h"
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "reverb/cc/platform/thread.h"
+#include "reverb/cc/reverb_service.pb.h"
+#include "reverb/cc/schema.pb.h"
+#include "reverb/cc/support/grpc_util.h"
+
+namespace deepmind {
+namespace reverb {
+
+absl::Status PriorityUpdater::Options::Validate() const {
+  if (max_buffered_updates < 1) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("max_buffered_updates (", max_buffered_updates,
+                     ") must be >= 1"));
+  }
+  if (flush_interval <= absl::ZeroDuration()) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("flush_interval (", absl::FormatDuration(flush_interval),
+                     ") must be > 0"));
+  }
+  return absl::OkStatus();
+}
+
+PriorityUpdater::PriorityUpdater(
+    std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface> stub,
+    Options options)
+    : stub_(std::move(stub)), options_(std::move(options)) {
+  thread_ = internal::StartThread("PriorityUpdater",
+                                  [this] { RunFlushLoop(); });
+}
+
+PriorityUpdater::~PriorityUpdater() { Close(); }
+
+absl::Status PriorityUpdater::Update(
+    absl::string_view table, absl::Span<const KeyWithPriority> updates) {
+  absl::MutexLock lock(&mu_);
+  if (closed_) {
+    return absl::FailedPreconditionError("PriorityUpdater has been closed.");
+  }
+
+  auto& table_updates = pending_[std::string(table)];
+  for (const auto& update : updates) {
+    if (table_updates.insert_or_assign(update.key(), update.priority())
+            .second) {
+      ++num_pending_;
+    }
+  }
+  if (num_pending_ >= options_.max_buffered_updates) {
+    flush_requested_ = true;
+  }
+  return TakeErrorLocked();
+}
+
+absl::Status PriorityUpdater::Flush() {
+  absl::MutexLock lock(&mu_);
+
+  // The updates buffered before the call are sent by the next flush unless
+  // the buffer is empty, in which case only the flush in progress (if any) has
+  // to complete.
+  int64_t target = flushes_started_;
+  if (num_pending_ > 0) {
+    flush_requested_ = true;
+    ++target;
+  }
+  auto done = [this, target]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    return flushes_completed_ >= target;
+  };
+  mu_.Await(absl::Condition(&done));
+
+  return TakeErrorLocked();
+}
+
+void PriorityUpdater::Close() {
+  {
+    absl::MutexLock lock(&mu_);
+    if (closed_) return;
+    closed_ = true;
+  }
+  thread_ = nullptr;
+}
+
+void PriorityUpdater::RunFlushLoop() {
+  while (true) {
+    internal::flat_hash_map<std::string, TableUpdates> updates;
+    bool closed;
+    {
+      absl::MutexLock lock(&mu_);
+      auto wake = [this]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+        return flush_requested_ || closed_;
+      };
+      mu_.AwaitWithTimeout(absl::Condition(&wake), options_.flush_interval);
+
+      closed = closed_;
+      flush_requested_ = false;
+      if (num_pending_ == 0) {
+        pending_.clear();
+        if (closed) return;
+        continue;
+      }
+      std::swap(updates, pending_);
+      num_pending_ = 0;
+      ++flushes_started_;
+    }
+
+    absl::Status status;
+    for (const auto& [table, table_updates] : updates) {
+      if (!table_updates.empty()) {
+        status.Update(Send(table, table_updates, /*retry=*/!closed));
+      }
+    }
+
+    absl::MutexLock lock(&mu_);
+    error_.Update(status);
+    ++flushes_completed_;
+  }
+}
+
+absl::Status PriorityUpdater::Send(const std::string& table,
+                                   const TableUpdates& updates, bool retry) {
+  MutatePrioritiesRequest request;
+  request.set_table(table);
+  request.mutable_updates()->Reserve(updates.size());
+  for (const auto& [key, priority] : updates) {
+    auto* update = request.add_updates();
+    update->set_key(key);
+    update->set_priority(priority);
+  }
+
+  // Like `ReverbClientUpdatePriorities`, calls which fail because the server
+  // went down are retried. Since `wait_for_ready` is set the retry is not sent
+  // until the server is back up. The final flush of `Close` is only attempted
+  // once so closing does not block on an unreachable server.
+  while (true) {
+    grpc::ClientContext context;
+    context.set_wait_for_ready(retry);
+    MutatePrioritiesResponse response;
+    auto status =
+        FromGrpcStatus(stub_->MutatePriorities(&context, request, &response));
+    if (!retry || !absl::IsUnavailable(status)) return status;
+  }
+}
+
+absl::Status PriorityUpdater::TakeErrorLocked() {
+  absl::Status error = std::move(error_);
+  error_ = absl::OkStatus();
+  return error;
+}
+
+}  // namespace reverb
+}  // namespace deepmind
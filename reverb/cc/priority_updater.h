@@ -0,0 +1,128 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_PRIORITY_UPDATER_H_
+#define REVERB_CC_PRIORITY_UPDATER_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/status/status.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "reverb/cc/platform/hash_map.h"
+#include "reverb/cc/platform/thread.h"
+#include "reverb/cc/reverb_service.grpc.pb.h"
+#include "reverb/cc/schema.pb.h"
+
+namespace deepmind {
+namespace reverb {
+
+// Buffers priority updates and sends them to the server in the background.
+//
+// Updates of the same table are merged into a single `MutatePriorities` call
+// and only the most recent priority of each key is sent. The buffer is flushed
+// once it holds `max_buffered_updates` keys or `flush_interval` after the last
+// flush, whichever comes first, so callers (e.g. a learner updating the
+// priorities of every sampled batch) never wait for the server.
+//
+// Failed calls are retried while the server is unavailable. Other errors are
+// returned by the next call to `Update` or `Flush`.
+//
+// All public methods are thread safe.
+class PriorityUpdater {
+ public:
+  struct Options {
+    // Number of buffered keys (over all tables) which triggers a flush.
+    int max_buffered_updates = 1024;
+
+    // Maximum time updates are buffered before they are flushed.
+    absl::Duration flush_interval = absl::Milliseconds(100);
+
+    // Returns `InvalidArgument` if any field value is invalid.
+    absl::Status Validate() const;
+  };
+
+  PriorityUpdater(
+      std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface> stub,
+      Options options);
+
+  // Calls `Close`.
+  ~PriorityUpdater();
+
+  // Buffers `updates` of `table`, replacing buffered updates of the same keys.
+  // Returns the error of a previous flush if one failed since the last error
+  // was returned, `FailedPrecondition` if the updater has been closed and OK
+  // otherwise.
+  absl::Status Update(absl::string_view table,
+                      absl::Span<const KeyWithPriority> updates)
+      ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Blocks until the updates buffered before the call have been sent. Returns
+  // the same errors as `Update`.
+  absl::Status Flush() ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Sends the buffered updates and stops the background thread. Blocks until
+  // the updates have been sent. Unlike earlier flushes, the final flush is not
+  // retried if the server is unavailable. Later calls to `Update` fail.
+  void Close() ABSL_LOCKS_EXCLUDED(mu_);
+
+ private:
+  using TableUpdates = internal::flat_hash_map<uint64_t, double>;
+
+  // Runs on `thread_` until the updater is closed.
+  void RunFlushLoop() ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Sends the updates of `table` in a single `MutatePriorities` call.
+  absl::Status Send(const std::string& table, const TableUpdates& updates,
+                    bool retry);
+
+  // Returns and clears `error_`.
+  absl::Status TakeErrorLocked() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  const std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface> stub_;
+  const Options options_;
+
+  absl::Mutex mu_;
+
+  // Buffered updates by table and the total number of buffered keys.
+  internal::flat_hash_map<std::string, TableUpdates> pending_
+      ABSL_GUARDED_BY(mu_);
+  int64_t num_pending_ ABSL_GUARDED_BY(mu_) = 0;
+
+  // Set when the buffer is full or by `Flush` to wake up the flush loop
+  // before `flush_interval` has passed.
+  bool flush_requested_ ABSL_GUARDED_BY(mu_) = false;
+
+  // Number of flushes which have been started and completed respectively.
+  // `Flush` waits for the flush which takes the updates buffered before it.
+  int64_t flushes_started_ ABSL_GUARDED_BY(mu_) = 0;
+  int64_t flushes_completed_ ABSL_GUARDED_BY(mu_) = 0;
+
+  // First error of the flushes which has not been returned yet.
+  absl::Status error_ ABSL_GUARDED_BY(mu_);
+
+  bool closed_ ABSL_GUARDED_BY(mu_) = false;
+
+  std::unique_ptr<internal::Thread> thread_;
+};
+
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_PRIORITY_UPDATER_H_
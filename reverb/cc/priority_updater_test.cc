@@ -0,0 +1,168 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/priority_updater.h"
+
+#include <memory>
+#include <vector>
+
+#include "grpcpp/impl/codegen/client_context.h"
+#include "grpcpp/impl/codegen/status.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "reverb/cc/platform/status_matchers.h"
+#include "reverb/cc/reverb_service.pb.h"
+#include "reverb/cc/reverb_service_mock.grpc.pb.h"
+#include "reverb/cc/testing/proto_test_util.h"
+
+namespace deepmind {
+namespace reverb {
+namespace {
+
+using ::testing::IsEmpty;
+using ::testing::SizeIs;
+using ::testing::UnorderedElementsAre;
+
+MATCHER_P2(HasUpdate, key, priority, "") {
+  return arg.key() == key && arg.priority() == priority;
+}
+
+class FakeStub : public /* grpc_gen:: */MockReverbServiceStub {
+ public:
+  grpc::Status MutatePriorities(grpc::ClientContext* context,
+                                const MutatePrioritiesRequest& request,
+                                MutatePrioritiesResponse* response) override {
+    absl::MutexLock lock(&mu_);
+    requests_.push_back(request);
+    return status_;
+  }
+
+  std::vector<MutatePrioritiesRequest> requests() {
+    absl::MutexLock lock(&mu_);
+    return requests_;
+  }
+
+  void set_status(grpc::Status status) {
+    absl::MutexLock lock(&mu_);
+    status_ = std::move(status);
+  }
+
+ private:
+  absl::Mutex mu_;
+  std::vector<MutatePrioritiesRequest> requests_ ABSL_GUARDED_BY(mu_);
+  grpc::Status status_ ABSL_GUARDED_BY(mu_);
+};
+
+PriorityUpdater::Options MakeOptions(int max_buffered_updates) {
+  PriorityUpdater::Options options;
+  options.max_buffered_updates = max_buffered_updates;
+  // Long enough for the flushes in the tests to only be triggered explicitly.
+  options.flush_interval = absl::Hours(1);
+  return options;
+}
+
+TEST(PriorityUpdaterTest, MergesUpdatesOfSameTable) {
+  auto stub = std::make_shared<FakeStub>();
+  PriorityUpdater updater(stub, MakeOptions(100));
+
+  REVERB_ASSERT_OK(updater.Update(
+      "table", {testing::MakeKeyWithPriority(1, 1),
+                testing::MakeKeyWithPriority(2, 2)}));
+  REVERB_ASSERT_OK(updater.Update(
+      "table", {testing::MakeKeyWithPriority(1, 3)}));
+  REVERB_ASSERT_OK(updater.Update(
+      "other", {testing::MakeKeyWithPriority(1, 4)}));
+  EXPECT_THAT(stub->requests(), IsEmpty());
+
+  REVERB_ASSERT_OK(updater.Flush());
+  auto requests = stub->requests();
+  ASSERT_THAT(requests, SizeIs(2));
+  for (const auto& request : requests) {
+    if (request.table() == "table") {
+      EXPECT_THAT(request.updates(),
+                  UnorderedElementsAre(HasUpdate(1, 3), HasUpdate(2, 2)));
+    } else {
+      EXPECT_EQ(request.table(), "other");
+      EXPECT_THAT(request.updates(), UnorderedElementsAre(HasUpdate(1, 4)));
+    }
+  }
+}
+
+TEST(PriorityUpdaterTest, FlushesWhenBufferIsFull) {
+  auto stub = std::make_shared<FakeStub>();
+  PriorityUpdater updater(stub, MakeOptions(2));
+
+  REVERB_ASSERT_OK(
+      updater.Update("table", {testing::MakeKeyWithPriority(1, 1),
+                               testing::MakeKeyWithPriority(2, 2)}));
+  while (stub->requests().empty()) {
+    absl::SleepFor(absl::Milliseconds(1));
+  }
+  EXPECT_THAT(stub->requests().front().updates(),
+              UnorderedElementsAre(HasUpdate(1, 1), HasUpdate(2, 2)));
+}
+
+TEST(PriorityUpdaterTest, FlushesOnInterval) {
+  auto stub = std::make_shared<FakeStub>();
+  PriorityUpdater::Options options;
+  options.flush_interval = absl::Milliseconds(1);
+  PriorityUpdater updater(stub, options);
+
+  REVERB_ASSERT_OK(
+      updater.Update("table", {testing::MakeKeyWithPriority(1, 1)}));
+  while (stub->requests().empty()) {
+    absl::SleepFor(absl::Milliseconds(1));
+  }
+}
+
+TEST(PriorityUpdaterTest, CloseSendsBufferedUpdates) {
+  auto stub = std::make_shared<FakeStub>();
+  PriorityUpdater updater(stub, MakeOptions(100));
+
+  REVERB_ASSERT_OK(
+      updater.Update("table", {testing::MakeKeyWithPriority(1, 1)}));
+  updater.Close();
+  EXPECT_THAT(stub->requests(), SizeIs(1));
+  EXPECT_EQ(updater.Update("table", {}).code(),
+            absl::StatusCode::kFailedPrecondition);
+}
+
+TEST(PriorityUpdaterTest, ReturnsErrorOfFailedFlush) {
+  auto stub = std::make_shared<FakeStub>();
+  stub->set_status(grpc::Status(grpc::StatusCode::NOT_FOUND, "no table"));
+  PriorityUpdater updater(stub, MakeOptions(100));
+
+  REVERB_ASSERT_OK(
+      updater.Update("table", {testing::MakeKeyWithPriority(1, 1)}));
+  EXPECT_EQ(updater.Flush().code(), absl::StatusCode::kNotFound);
+
+  // The error is only returned once.
+  REVERB_EXPECT_OK(updater.Flush());
+}
+
+TEST(PriorityUpdaterTest, InvalidOptions) {
+  PriorityUpdater::Options options;
+  options.max_buffered_updates = 0;
+  EXPECT_EQ(options.Validate().code(), absl::StatusCode::kInvalidArgument);
+
+  options = PriorityUpdater::Options();
+  options.flush_interval = absl::ZeroDuration();
+  EXPECT_EQ(options.Validate().code(), absl::StatusCode::kInvalidArgument);
+}
+
+}  // namespace
+}  // namespace reverb
+}  // namespace deepmind
@@ -15,6 +15,7 @@
 #include "reverb/cc/rate_limiter.h"
 
 #include <algorithm>
+#include <deque>
 #include <string>
 #include <utility>
 
@@ -38,6 +39,44 @@ namespace reverb {
 
 namespace {
 
+// Increments a counter which is only modified while holding the lock of the
+// parent table (or the group). Since there are no concurrent writers a
+// (cheaper) load and store can be used instead of an atomic read-modify-write.
+inline void IncrementLocked(std::atomic<int64_t>* counter, int64_t n = 1) {
+  counter->store(counter->load(std::memory_order_relaxed) + n,
+                 std::memory_order_relaxed);
+}
+
+// Returns the largest `n` in [0, `limit`] such that `n == 0 || allowed(n)`.
+// `allowed` must be monotonic, i.e. if `n` operations are allowed then so is any
+// smaller number of operations.
+template <typename Allowed>
+int LargestAllowed(int limit, Allowed allowed) {
+  int lo = 0;
+  int hi = limit;
+  while (lo < hi) {
+    const int mid = lo + (hi - lo + 1) / 2;
+    if (allowed(mid)) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return lo;
+}
+
+// Wakes up to `n` waiters from the front of `queue`.
+template <typename Waiter>
+void WakeFront(int n, std::deque<Waiter*>* queue, int* woken) {
+  for (; n > 0 && !queue->empty(); --n) {
+    Waiter* waiter = queue->front();
+    queue->pop_front();
+    waiter->woken = true;
+    ++*woken;
+    waiter->cv.Signal();
+  }
+}
+
 inline void EncodeAsDurationProto(const absl::Duration& d,
                                   google::protobuf::Duration* proto) {
   proto->set_seconds(absl::ToInt64Seconds(d));
@@ -45,11 +84,38 @@ inline void EncodeAsDurationProto(const absl::Duration& d,
       absl::ToInt64Nanoseconds(d - absl::Seconds(proto->seconds())));
 }
 
+inline absl::Duration DecodeDurationProto(
+    const google::protobuf::Duration& proto) {
+  return absl::Seconds(proto.seconds()) + absl::Nanoseconds(proto.nanos());
+}
+
+RateLimiter::PacingOptions PacingFromProto(const RateLimiterPacing& proto) {
+  RateLimiter::PacingOptions pacing;
+  pacing.max_delay = DecodeDurationProto(proto.max_delay());
+  pacing.proportional_gain = proto.proportional_gain();
+  pacing.integral_gain = proto.integral_gain();
+  return pacing;
+}
+
+void PacingToProto(const RateLimiter::PacingOptions& pacing,
+                   RateLimiterPacing* proto) {
+  EncodeAsDurationProto(pacing.max_delay, proto->mutable_max_delay());
+  proto->set_proportional_gain(pacing.proportional_gain);
+  proto->set_integral_gain(pacing.integral_gain);
+}
+
 }  // namespace
 
 RateLimiter::RateLimiter(double samples_per_insert, int64_t min_size_to_sample,
-                         double min_diff, double max_diff)
-    : samples_per_insert_(samples_per_insert),
+                         double min_diff, double max_diff, bool shared)
+    : RateLimiter(samples_per_insert, min_size_to_sample, min_diff, max_diff,
+                  PacingOptions(), shared) {}
+
+RateLimiter::RateLimiter(double samples_per_insert, int64_t min_size_to_sample,
+                         double min_diff, double max_diff, PacingOptions pacing,
+                         bool shared)
+    : shared_(shared),
+      samples_per_insert_(samples_per_insert),
       min_diff_(min_diff),
       max_diff_(max_diff),
       min_size_to_sample_(min_size_to_sample),
@@ -57,6 +123,8 @@ RateLimiter::RateLimiter(double samples_per_insert, int64_t min_size_to_sample,
       samples_(0),
       deletes_(0),
       cancelled_(false),
+      pacing_(pacing),
+      pacing_updated_at_(absl::Now()),
       insert_stats_(),
       sample_stats_() {
   REVERB_CHECK_GT(min_size_to_sample, 0);
@@ -67,13 +135,27 @@ RateLimiter::RateLimiter(const RateLimiterCheckpoint& checkpoint)
                   /*min_size_to_sample=*/
                   checkpoint.min_size_to_sample(),
                   /*min_diff=*/checkpoint.min_diff(),
-                  /*max_diff=*/checkpoint.max_diff()) {
+                  /*max_diff=*/checkpoint.max_diff(),
+                  /*pacing=*/checkpoint.has_pacing()
+                      ? PacingFromProto(checkpoint.pacing())
+                      : PacingOptions()) {
   inserts_ = checkpoint.insert_count();
   samples_ = checkpoint.sample_count();
   deletes_ = checkpoint.delete_count();
 }
 
-absl::Status RateLimiter::RegisterTable(Table* table) {
+absl::Status RateLimiter::RegisterTable(absl::Mutex* mu, Table* table) {
+  if (shared_) {
+    absl::MutexLock lock(&group_mu_);
+    Member& member = members_[mu];
+    if (member.table != nullptr) {
+      return absl::FailedPreconditionError(absl::StrCat(
+          "Table ", table->name(),
+          " is already registered with this RateLimiter."));
+    }
+    member.table = table;
+    return absl::OkStatus();
+  }
   if (table_) {
     return absl::FailedPreconditionError(absl::StrCat(
         "Attempting to registering a table ", absl::Hex(table),
@@ -86,99 +168,193 @@ absl::Status RateLimiter::RegisterTable(Table* table) {
 }
 
 void RateLimiter::UnregisterTable(absl::Mutex* mu, Table* table) {
-  REVERB_CHECK_EQ(table, table_)
-      << "The wrong Table attempted to unregister this rate limiter.";
+  if (shared_) {
+    absl::MutexLock group_lock(&group_mu_);
+    auto it = members_.find(mu);
+    REVERB_CHECK(it != members_.end() && it->second.table == table)
+        << "The wrong Table attempted to unregister this rate limiter.";
+  } else {
+    REVERB_CHECK_EQ(table, table_)
+        << "The wrong Table attempted to unregister this rate limiter.";
+  }
   absl::MutexLock lock(mu);
   Reset(mu);
-  table_ = nullptr;
+  if (shared_) {
+    absl::MutexLock group_lock(&group_mu_);
+    members_.erase(mu);
+  } else {
+    table_ = nullptr;
+  }
 }
 
 absl::Status RateLimiter::AwaitCanInsert(absl::Mutex* mu,
                                          absl::Duration timeout) {
-  const auto deadline = absl::Now() + timeout;
+  absl::MutexLockMaybe group_lock(shared_ ? &group_mu_ : nullptr);
   {
-    auto event = insert_stats_.CreateEvent(mu);
-    while (!cancelled_ && !CanInsert(mu, 1)) {
+    auto event = insert_stats_.CreateEvent(mu, coarse_clock_.get());
+    const absl::Time deadline = event.start() + timeout;
+    if (AwaitPacing(mu, /*insert=*/true, deadline)) {
+      event.set_was_blocked();
+    }
+    if (!IsCancelled(mu) && !CanInsert(mu, 1)) {
       event.set_was_blocked();
-      if (can_insert_cv_.WaitWithDeadline(mu, deadline)) {
+      if (!AwaitTurn(mu, &insert_waiters_, &woken_inserters_, deadline,
+                     [&] { return CanInsert(mu, 1); })) {
         return errors::RateLimiterTimeout();
       }
     }
   }
-  REVERB_RETURN_IF_ERROR(CheckIfCancelled());
+  REVERB_RETURN_IF_ERROR(CheckIfCancelled(mu));
+  return absl::OkStatus();
+}
+
+absl::Status RateLimiter::AwaitCanInsertBatch(absl::Mutex* mu, int max_inserts,
+                                              int* num_inserts,
+                                              absl::Duration timeout) {
+  REVERB_CHECK_GT(max_inserts, 0);
+  REVERB_RETURN_IF_ERROR(AwaitCanInsert(mu, timeout));
+
+  if (shared_ || (pacing_.max_delay > absl::ZeroDuration() &&
+                  pacing_output_ > 0)) {
+    *num_inserts = 1;
+    return absl::OkStatus();
+  }
+  *num_inserts = std::max(1, NumInsertsAllowed(mu, max_inserts));
   return absl::OkStatus();
 }
 
 void RateLimiter::Insert(absl::Mutex* mu) {
-  inserts_++;
-  MaybeSignalCondVars(mu);
+  absl::MutexLockMaybe group_lock(shared_ ? &group_mu_ : nullptr);
+  IncrementLocked(&inserts_);
+  if (shared_) members_[mu].inserts++;
+  WakeWaitersLocked(mu);
 }
 
 void RateLimiter::Delete(absl::Mutex* mu) {
-  deletes_++;
-  MaybeSignalCondVars(mu);
+  absl::MutexLockMaybe group_lock(shared_ ? &group_mu_ : nullptr);
+  IncrementLocked(&deletes_);
+  if (shared_) members_[mu].deletes++;
+  WakeWaitersLocked(mu);
 }
 
 void RateLimiter::Reset(absl::Mutex* mu) {
-  inserts_ = 0;
-  samples_ = 0;
-  deletes_ = 0;
-  MaybeSignalCondVars(mu);
+  absl::MutexLockMaybe group_lock(shared_ ? &group_mu_ : nullptr);
+  if (shared_) {
+    // The group continues as if the table had never been part of it.
+    Member& member = members_[mu];
+    IncrementLocked(&inserts_, -member.inserts);
+    IncrementLocked(&samples_, -member.samples);
+    IncrementLocked(&deletes_, -member.deletes);
+    member.inserts = 0;
+    member.samples = 0;
+    member.deletes = 0;
+  } else {
+    inserts_ = 0;
+    samples_ = 0;
+    deletes_ = 0;
+  }
+  pacing_integral_ = 0;
+  pacing_output_ = 0;
+  next_insert_slot_ = absl::InfinitePast();
+  next_sample_slot_ = absl::InfinitePast();
+  WakeWaitersLocked(mu);
 }
 
 absl::Status RateLimiter::AwaitAndFinalizeSample(absl::Mutex* mu,
                                                  absl::Duration timeout) {
-  const auto deadline = absl::Now() + timeout;
+  absl::MutexLockMaybe group_lock(shared_ ? &group_mu_ : nullptr);
 
   {
-    auto event = sample_stats_.CreateEvent(mu);
-    while (!cancelled_ && !CanSample(mu, 1)) {
+    auto event = sample_stats_.CreateEvent(mu, coarse_clock_.get());
+    const absl::Time deadline = event.start() + timeout;
+    if (AwaitPacing(mu, /*insert=*/false, deadline)) {
       event.set_was_blocked();
-      if (can_sample_cv_.WaitWithDeadline(mu, deadline)) {
+    }
+    if (!IsCancelled(mu) && !CanSample(mu, 1)) {
+      event.set_was_blocked();
+      if (!AwaitTurn(mu, &sample_waiters_, &woken_samplers_, deadline,
+                     [&] { return CanSample(mu, 1); })) {
         return errors::RateLimiterTimeout();
       }
     }
   }
 
-  REVERB_RETURN_IF_ERROR(CheckIfCancelled());
+  REVERB_RETURN_IF_ERROR(CheckIfCancelled(mu));
 
-  samples_++;
-  MaybeSignalCondVars(mu);
+  IncrementLocked(&samples_);
+  if (shared_) members_[mu].samples++;
+  WakeWaitersLocked(mu);
   return absl::OkStatus();
 }
 
 bool RateLimiter::CanSample(absl::Mutex*, int num_samples) const {
+  return CanSampleWithoutLock(num_samples);
+}
+
+bool RateLimiter::CanInsert(absl::Mutex*, int num_inserts) const {
+  return CanInsertWithoutLock(num_inserts);
+}
+
+bool RateLimiter::CanSampleWithoutLock(int num_samples) const {
   REVERB_CHECK_GT(num_samples, 0);
-  if (inserts_ - deletes_ < min_size_to_sample_) {
+  const int64_t inserts = inserts_.load(std::memory_order_relaxed);
+  const int64_t samples = samples_.load(std::memory_order_relaxed);
+  const int64_t deletes = deletes_.load(std::memory_order_relaxed);
+  if (inserts - deletes < min_size_to_sample_) {
     return false;
   }
-  double diff = inserts_ * samples_per_insert_ - samples_ - num_samples;
+  double diff = inserts * samples_per_insert_ - samples - num_samples;
   return diff >= min_diff_;
 }
 
-bool RateLimiter::CanInsert(absl::Mutex*, int num_inserts) const {
+bool RateLimiter::CanInsertWithoutLock(int num_inserts) const {
   REVERB_CHECK_GT(num_inserts, 0);
+  const int64_t inserts = inserts_.load(std::memory_order_relaxed);
+  const int64_t samples = samples_.load(std::memory_order_relaxed);
+  const int64_t deletes = deletes_.load(std::memory_order_relaxed);
   // Until the min size is reached inserts are free to progress.
-  if (inserts_ + num_inserts - deletes_ <= min_size_to_sample_) {
+  if (inserts + num_inserts - deletes <= min_size_to_sample_) {
     return true;
   }
 
-  double diff = (num_inserts + inserts_) * samples_per_insert_ - samples_;
+  double diff = (num_inserts + inserts) * samples_per_insert_ - samples;
   return diff <= max_diff_;
 }
 
-void RateLimiter::Cancel(absl::Mutex*) {
-  cancelled_ = true;
-  can_insert_cv_.SignalAll();
-  can_sample_cv_.SignalAll();
+void RateLimiter::Cancel(absl::Mutex* mu) {
+  absl::MutexLockMaybe group_lock(shared_ ? &group_mu_ : nullptr);
+  if (shared_) {
+    members_[mu].cancelled = true;
+  } else {
+    cancelled_ = true;
+  }
+  for (auto* queue : {&insert_waiters_, &sample_waiters_}) {
+    for (Waiter* waiter : *queue) {
+      if (!shared_ || waiter->mu == mu) waiter->cv.Signal();
+    }
+  }
+  pacing_cv_.SignalAll();
 }
 
-RateLimiterCheckpoint RateLimiter::CheckpointReader(absl::Mutex*) const {
+RateLimiterCheckpoint RateLimiter::CheckpointReader(absl::Mutex* mu) const {
   RateLimiterCheckpoint checkpoint;
   checkpoint.set_samples_per_insert(samples_per_insert_);
   checkpoint.set_min_diff(min_diff_);
   checkpoint.set_max_diff(max_diff_);
   checkpoint.set_min_size_to_sample(min_size_to_sample_);
+  if (pacing_.max_delay > absl::ZeroDuration()) {
+    PacingToProto(pacing_, checkpoint.mutable_pacing());
+  }
+  if (shared_) {
+    absl::MutexLock group_lock(&group_mu_);
+    auto it = members_.find(mu);
+    if (it != members_.end()) {
+      checkpoint.set_sample_count(it->second.samples);
+      checkpoint.set_insert_count(it->second.inserts);
+      checkpoint.set_delete_count(it->second.deletes);
+    }
+    return checkpoint;
+  }
   checkpoint.set_sample_count(samples_);
   checkpoint.set_insert_count(inserts_);
   checkpoint.set_delete_count(deletes_);
@@ -186,20 +362,165 @@ RateLimiterCheckpoint RateLimiter::CheckpointReader(absl::Mutex*) const {
   return checkpoint;
 }
 
-absl::Status RateLimiter::CheckIfCancelled() const {
-  if (!cancelled_) return absl::OkStatus();
+bool RateLimiter::IsCancelled(absl::Mutex* mu) const {
+  if (!shared_) return cancelled_;
+  auto it = members_.find(mu);
+  return it != members_.end() && it->second.cancelled;
+}
+
+absl::Status RateLimiter::CheckIfCancelled(absl::Mutex* mu) const {
+  if (!IsCancelled(mu)) return absl::OkStatus();
   return absl::CancelledError("RateLimiter has been cancelled");
 }
 
-void RateLimiter::MaybeSignalCondVars(absl::Mutex* mu) {
-  if (CanInsert(mu, 1)) can_insert_cv_.Signal();
-  if (CanSample(mu, 1)) can_sample_cv_.Signal();
+void RateLimiter::WakeWaiters(absl::Mutex* mu) {
+  absl::MutexLockMaybe group_lock(shared_ ? &group_mu_ : nullptr);
+  WakeWaitersLocked(mu);
 }
 
-RateLimiterInfo RateLimiter::Info(absl::Mutex* mu) const {
+void RateLimiter::UndoSamples(absl::Mutex* mu, int num_samples) {
+  absl::MutexLockMaybe group_lock(shared_ ? &group_mu_ : nullptr);
+  IncrementLocked(&samples_, -num_samples);
+  if (shared_) members_[mu].samples -= num_samples;
+  WakeWaitersLocked(mu);
+}
+
+void RateLimiter::WakeWaitersLocked(absl::Mutex* mu) {
+  if (!insert_waiters_.empty()) {
+    const int limit =
+        woken_inserters_ + static_cast<int>(insert_waiters_.size());
+    WakeFront(NumInsertsAllowed(mu, limit) - woken_inserters_,
+              &insert_waiters_, &woken_inserters_);
+  }
+  if (!sample_waiters_.empty()) {
+    const int limit =
+        woken_samplers_ + static_cast<int>(sample_waiters_.size());
+    WakeFront(NumSamplesAllowed(mu, limit) - woken_samplers_,
+              &sample_waiters_, &woken_samplers_);
+  }
+}
+
+int RateLimiter::NumInsertsAllowed(absl::Mutex*, int limit) const {
+  return LargestAllowed(
+      limit, [this](int n) { return CanInsertWithoutLock(n); });
+}
+
+int RateLimiter::NumSamplesAllowed(absl::Mutex*, int limit) const {
+  return LargestAllowed(
+      limit, [this](int n) { return CanSampleWithoutLock(n); });
+}
+
+bool RateLimiter::WaitWithDeadline(absl::Mutex* mu, absl::CondVar* cv,
+                                   absl::Time deadline) {
+  if (!shared_) return cv->WaitWithDeadline(mu, deadline);
+
+  // The lock of the table is released so that it can be used while the call
+  // is blocked. It must be acquired before `group_mu_`.
+  mu->Unlock();
+  const bool timed_out = cv->WaitWithDeadline(&group_mu_, deadline);
+  group_mu_.Unlock();
+  mu->Lock();
+  group_mu_.Lock();
+  return timed_out;
+}
+
+double RateLimiter::UpdatePacing(absl::Mutex* mu, absl::Time now) {
+  const double half_width = (max_diff_ - min_diff_) / 2;
+  const double cursor =
+      inserts_.load(std::memory_order_relaxed) * samples_per_insert_ -
+      samples_.load(std::memory_order_relaxed);
+  const double error =
+      half_width > 0 ? (cursor - min_diff_ - half_width) / half_width : 0;
+
+  if (pacing_.integral_gain > 0) {
+    // The integral is bounded to the range where it can affect the output so
+    // it does not wind up while the output is saturated.
+    const double bound = 1 / pacing_.integral_gain;
+    pacing_integral_ = std::clamp(
+        pacing_integral_ +
+            error * absl::ToDoubleSeconds(now - pacing_updated_at_),
+        -bound, bound);
+  }
+  pacing_updated_at_ = now;
+
+  pacing_output_ = std::clamp(pacing_.proportional_gain * error +
+                                  pacing_.integral_gain * pacing_integral_,
+                              -1.0, 1.0);
+  return pacing_output_;
+}
+
+bool RateLimiter::AwaitPacing(absl::Mutex* mu, bool insert,
+                              absl::Time deadline) {
+  if (pacing_.max_delay <= absl::ZeroDuration() || IsCancelled(mu)) {
+    return false;
+  }
+  // The table fills up to `min_size_to_sample_` without pacing as no samples
+  // can be made before then.
+  if (insert && inserts_.load(std::memory_order_relaxed) -
+                        deletes_.load(std::memory_order_relaxed) <
+                    min_size_to_sample_) {
+    return false;
+  }
+
+  const absl::Time now = absl::Now();
+  const double output = UpdatePacing(mu, now);
+  absl::Time* next_slot = insert ? &next_insert_slot_ : &next_sample_slot_;
+  const absl::Time slot = std::max(now, *next_slot);
+  *next_slot =
+      slot + std::max(0.0, insert ? output : -output) * pacing_.max_delay;
+
+  const absl::Time wait_until = std::min(slot, deadline);
+  if (wait_until <= now) return false;
+  while (absl::Now() < wait_until && !IsCancelled(mu)) {
+    WaitWithDeadline(mu, &pacing_cv_, wait_until);
+  }
+  return true;
+}
+
+absl::Time RateLimiter::NextPacingSlot(absl::Mutex* mu, bool insert) const {
+  absl::MutexLockMaybe group_lock(shared_ ? &group_mu_ : nullptr);
+  if (pacing_.max_delay <= absl::ZeroDuration() || IsCancelled(mu)) {
+    return absl::InfinitePast();
+  }
+  // Same exemption as in `AwaitPacing`.
+  if (insert && inserts_.load(std::memory_order_relaxed) -
+                        deletes_.load(std::memory_order_relaxed) <
+                    min_size_to_sample_) {
+    return absl::InfinitePast();
+  }
+  return insert ? next_insert_slot_ : next_sample_slot_;
+}
+
+template <typename CanProceed>
+bool RateLimiter::AwaitTurn(absl::Mutex* mu, std::deque<Waiter*>* queue,
+                            int* woken, absl::Time deadline,
+                            CanProceed can_proceed) {
+  Waiter waiter;
+  waiter.mu = mu;
+  queue->push_back(&waiter);
+  while (true) {
+    while (!waiter.woken && !IsCancelled(mu)) {
+      if (WaitWithDeadline(mu, &waiter.cv, deadline)) break;
+    }
+    if (!waiter.woken) {
+      // Timed out or cancelled while still queued.
+      queue->erase(std::find(queue->begin(), queue->end(), &waiter));
+      return IsCancelled(mu);
+    }
+    --*woken;
+    if (IsCancelled(mu) || can_proceed()) return true;
+
+    // Calls which did not have to wait took the operations this waiter was
+    // woken for, so it returns to the front of the queue.
+    waiter.woken = false;
+    queue->push_front(&waiter);
+  }
+}
+
+RateLimiterInfo RateLimiter::Info() const {
   RateLimiterInfo info_proto = InfoWithoutCallStats();
-  insert_stats_.ToProto(mu, info_proto.mutable_insert_stats());
-  sample_stats_.ToProto(mu, info_proto.mutable_sample_stats());
+  insert_stats_.ToProto(info_proto.mutable_insert_stats());
+  sample_stats_.ToProto(info_proto.mutable_sample_stats());
   return info_proto;
 }
 
@@ -209,108 +530,155 @@ RateLimiterInfo RateLimiter::InfoWithoutCallStats() const {
   info_proto.set_min_diff(min_diff_);
   info_proto.set_max_diff(max_diff_);
   info_proto.set_min_size_to_sample(min_size_to_sample_);
+  if (pacing_.max_delay > absl::ZeroDuration()) {
+    PacingToProto(pacing_, info_proto.mutable_pacing());
+  }
   return info_proto;
 }
 
 RateLimiterEventHistory RateLimiter::GetEventHistory(
-    absl::Mutex* mu, size_t min_insert_event_id,
-    size_t min_sample_event_id) const {
-  return {insert_stats_.GetEventHistory(mu, min_insert_event_id),
-          sample_stats_.GetEventHistory(mu, min_sample_event_id)};
+    size_t min_insert_event_id, size_t min_sample_event_id) const {
+  return {insert_stats_.GetEventHistory(min_insert_event_id),
+          sample_stats_.GetEventHistory(min_sample_event_id)};
+}
+
+void RateLimiter::UnsafeSetCoarseClock(
+    std::shared_ptr<internal::CoarseClock> clock) {
+  coarse_clock_ = std::move(clock);
 }
 
 std::string RateLimiter::DebugString() const {
   return absl::StrCat("RateLimiter(samples_per_insert=", samples_per_insert_,
                       ", min_diff_=", min_diff_, ", max_diff=", max_diff_,
-                      ", min_size_to_sample=", min_size_to_sample_, ")");
+                      ", min_size_to_sample=", min_size_to_sample_,
+                      pacing_.max_delay > absl::ZeroDuration()
+                          ? absl::StrCat(", pacing_max_delay=",
+                                         absl::FormatDuration(pacing_.max_delay))
+                          : "",
+                      shared_ ? ", shared=true" : "", ")");
 }
 
 RateLimiter::StatsManager::StatsManager()
     : events_(kEventHistoryBufferSize),
       next_event_id_(0),
-      active_(),
+      num_active_(0),
+      active_start_ns_sum_(0),
       completed_(0),
       limited_(0),
-      total_wait_(absl::ZeroDuration()) {}
+      total_wait_ns_(0) {}
 
 RateLimiter::StatsManager::ScopedEvent RateLimiter::StatsManager::CreateEvent(
-    absl::Mutex* mu) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu) {
+    absl::Mutex* mu, const internal::CoarseClock* clock)
+    ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu) {
   // IDs are incremented with each event and the fixed size of `events_` means
   // that it is theoretically possible for collisions between active events.
   // However, this is EXTREMELY unlikely in practice as it would require
   // `kEventHistoryBufferSize` (very large) calls to be blocked concurrently
   // which would grind the system to a halt long before the buffer is exceeded.
-  const size_t id = next_event_id_++;
-  events_[id % events_.size()] = {id, absl::Now(), absl::ZeroDuration()};
-  active_.insert(id);
-  return ScopedEvent(this, &events_[id % events_.size()]);
-}
-
-void RateLimiter::StatsManager::CompleteEvent(RateLimiterEvent* event) {
-  active_.erase(event->id);
-  completed_++;
-  limited_ += event->blocked_for > absl::ZeroDuration() ? 1 : 0;
-  total_wait_ += event->blocked_for;
-}
-
-void RateLimiter::StatsManager::ToProto(absl::Mutex* mu,
-                                        RateLimiterCallStats* proto) const
-    ABSL_SHARED_LOCKS_REQUIRED(mu) {
-  const auto now = absl::Now();
-
-  proto->set_pending(active_.size());
-  proto->set_completed(completed_);
-  proto->set_limited(limited_);
-  EncodeAsDurationProto(total_wait_, proto->mutable_completed_wait_time());
-  absl::Duration pending_wait_time;
-  for (size_t id : active_) {
-    pending_wait_time += now - events_[id % events_.size()].start;
+  const size_t id = next_event_id_.load(std::memory_order_relaxed);
+  const int64_t start_ns =
+      clock != nullptr ? clock->NowNanos() : absl::GetCurrentTimeNanos();
+
+  // The slot is marked as incomplete before the event is published so that
+  // readers never mistake it for the event which previously used the slot.
+  events_[id % events_.size()].completed_id.store(0,
+                                                  std::memory_order_relaxed);
+  next_event_id_.store(id + 1, std::memory_order_release);
+
+  num_active_.store(num_active_.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_relaxed);
+  active_start_ns_sum_.fetch_add(start_ns, std::memory_order_relaxed);
+  return ScopedEvent(this, id, absl::FromUnixNanos(start_ns));
+}
+
+void RateLimiter::StatsManager::CompleteEvent(size_t id, absl::Time start,
+                                              absl::Duration blocked_for) {
+  Slot& slot = events_[id % events_.size()];
+  slot.start_ns.store(absl::ToUnixNanos(start), std::memory_order_relaxed);
+  slot.blocked_for_ns.store(absl::ToInt64Nanoseconds(blocked_for),
+                            std::memory_order_relaxed);
+  slot.completed_id.store(id + 1, std::memory_order_release);
+
+  num_active_.store(num_active_.load(std::memory_order_relaxed) - 1,
+                    std::memory_order_relaxed);
+  active_start_ns_sum_.fetch_sub(absl::ToUnixNanos(start),
+                                 std::memory_order_relaxed);
+  completed_.fetch_add(1, std::memory_order_relaxed);
+  if (blocked_for > absl::ZeroDuration()) {
+    limited_.fetch_add(1, std::memory_order_relaxed);
+    total_wait_ns_.fetch_add(absl::ToInt64Nanoseconds(blocked_for),
+                             std::memory_order_relaxed);
   }
-  EncodeAsDurationProto(pending_wait_time, proto->mutable_pending_wait_time());
+}
+
+void RateLimiter::StatsManager::ToProto(RateLimiterCallStats* proto) const {
+  const int64_t pending = num_active_.load(std::memory_order_relaxed);
+  const int64_t start_ns_sum =
+      active_start_ns_sum_.load(std::memory_order_relaxed);
+  const int64_t now_ns = absl::ToUnixNanos(absl::Now());
+
+  proto->set_pending(pending);
+  proto->set_completed(completed_.load(std::memory_order_relaxed));
+  proto->set_limited(limited_.load(std::memory_order_relaxed));
+  EncodeAsDurationProto(
+      absl::Nanoseconds(total_wait_ns_.load(std::memory_order_relaxed)),
+      proto->mutable_completed_wait_time());
+
+  // The sum of the waiting times of the pending calls is `pending * now - sum
+  // of start times`. Since the two counters are read independently of each
+  // other the result could be slightly off (and even negative) if events are
+  // created or completed concurrently.
+  const int64_t pending_wait_ns =
+      std::max<int64_t>(0, pending * now_ns - start_ns_sum);
+  EncodeAsDurationProto(absl::Nanoseconds(pending_wait_ns),
+                        proto->mutable_pending_wait_time());
 }
 
 std::vector<RateLimiterEvent> RateLimiter::StatsManager::GetEventHistory(
-    absl::Mutex* mu, size_t min_event_id) const ABSL_SHARED_LOCKS_REQUIRED(mu) {
-  REVERB_CHECK_LE(min_event_id, next_event_id_);
+    size_t min_event_id) const {
+  const size_t next_event_id = next_event_id_.load(std::memory_order_acquire);
+  REVERB_CHECK_LE(min_event_id, next_event_id);
 
-  if (const auto diff = next_event_id_ - min_event_id; diff >= events_.size()) {
+  if (const auto diff = next_event_id - min_event_id; diff >= events_.size()) {
     REVERB_LOG(REVERB_ERROR)
         << "Requested rate limiter events older that the maximum age. Request "
            "will be rewritten to include the last "
         << events_.size() << " events. This mean that (up to) "
         << diff - events_.size() << " events will be ignored";
-    min_event_id = next_event_id_ - events_.size();
-  }
-
-  // Non inclusive upper limit.
-  const size_t max_event_id =
-      active_.empty() ? next_event_id_
-                      : *std::min_element(active_.begin(), active_.end());
-  if (max_event_id < min_event_id + 1) {
-    return {};
+    min_event_id = next_event_id - events_.size();
   }
 
-  std::vector<RateLimiterEvent> copy(max_event_id - min_event_id - 1);
-  for (size_t i = 0; i < copy.size(); i++) {
-    copy[i] = events_[(min_event_id + i) % events_.size()];
+  std::vector<RateLimiterEvent> copy;
+  for (size_t id = min_event_id; id < next_event_id; id++) {
+    const Slot& slot = events_[id % events_.size()];
+    if (slot.completed_id.load(std::memory_order_acquire) != id + 1) break;
+    RateLimiterEvent event{
+        id,
+        absl::FromUnixNanos(slot.start_ns.load(std::memory_order_relaxed)),
+        absl::Nanoseconds(
+            slot.blocked_for_ns.load(std::memory_order_relaxed))};
+
+    // If the slot has been reused while it was read then the event has been
+    // overwritten and so have all the events after it.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.completed_id.load(std::memory_order_relaxed) != id + 1) break;
+    copy.push_back(event);
   }
-
   return copy;
 }
 
 RateLimiter::StatsManager::ScopedEvent::ScopedEvent(
-    RateLimiter::StatsManager* parent, RateLimiterEvent* event)
-    : parent_(parent), event_(event), was_blocked_(false) {}
+    RateLimiter::StatsManager* parent, size_t id, absl::Time start)
+    : parent_(parent), id_(id), start_(start), was_blocked_(false) {}
 
 void RateLimiter::StatsManager::ScopedEvent::set_was_blocked() {
   was_blocked_ = true;
 }
 
 RateLimiter::StatsManager::ScopedEvent::~ScopedEvent() {
-  if (was_blocked_) {
-    event_->blocked_for = absl::Now() - event_->start;
-  }
-  parent_->CompleteEvent(event_);
+  parent_->CompleteEvent(
+      id_, start_,
+      was_blocked_ ? absl::Now() - start_ : absl::ZeroDuration());
 }
 
 }  // namespace reverb
@@ -15,6 +15,9 @@
 #ifndef REVERB_CC_RATE_LIMITER_H_
 #define REVERB_CC_RATE_LIMITER_H_
 
+#include <atomic>
+#include <deque>
+#include <memory>
 #include <string>
 
 #include <cstdint>
@@ -24,8 +27,9 @@
 #include "absl/synchronization/mutex.h"
 #include "absl/time/time.h"
 #include "reverb/cc/checkpointing/checkpoint.pb.h"
-#include "reverb/cc/platform/hash_set.h"
+#include "reverb/cc/platform/hash_map.h"
 #include "reverb/cc/schema.pb.h"
+#include "reverb/cc/support/coarse_clock.h"
 
 namespace deepmind {
 namespace reverb {
@@ -59,10 +63,58 @@ struct RateLimiterEventHistory {
 // RateLimiter manages the data throughput for a `Table` by blocking
 // sample or insert calls if the ratio between the two deviates too much from
 // the ratio specified by `samples_per_insert`.
+//
+// Blocked calls wait in FIFO order, one queue for inserts and one for samples.
+// Whenever the state changes the limiter computes how many operations of each
+// kind are allowed and wakes that many calls from the front of the queues
+// (minus the calls already woken), so waking does not cause a stampede of calls
+// which then block again. Calls which can proceed right away do so without
+// queueing, as handing every operation to a sleeping call would force a
+// context switch per operation. A woken call which finds that the operations
+// have been taken by such calls returns to the front of the queue.
+//
+// A limiter constructed with `shared = true` can be used by a group of tables
+// (e.g. tables which receive the same trajectories) so that a single ratio
+// governs the inserts and samples of the whole group. The counters are then
+// combined over the tables and, together with the queues, are guarded by a
+// lock owned by the limiter rather than by the lock of the calling table.
+// Blocked calls release the lock of their table while they wait. Since an
+// insert approved by `AwaitCanInsert` is only committed by the following call
+// to `Insert`, tables inserting concurrently can exceed `max_diff` by (at most)
+// one insert per table of the group.
+//
+// With `PacingOptions` the limiter also spreads out the calls of the side which
+// is ahead, rather than letting both sides run at full speed until one of them
+// hits `min_diff` or `max_diff` and stalls. A PI controller steers the cursor
+// towards the middle of [`min_diff`, `max_diff`]: the further (and the longer)
+// the cursor is above the middle the longer the interval between two inserts,
+// and vice versa for samples. The bounds remain as a hard limit.
 class RateLimiter {
  public:
+  struct PacingOptions {
+    // Interval between two inserts (samples) when the output of the controller
+    // is saturated. Pacing is disabled if not positive.
+    absl::Duration max_delay = absl::ZeroDuration();
+
+    // Gain of the error, which is the distance of the cursor from the middle of
+    // [`min_diff`, `max_diff`] in units of half the width of the range.
+    double proportional_gain = 1.0;
+
+    // Gain of the integral of the error over time (in seconds). Removes the
+    // steady state error left by the proportional term.
+    double integral_gain = 0.1;
+  };
+
+  // If `shared` then the limiter can be registered with more than one table.
+  // Limiters which are only used by a single table should not be shared as
+  // every call then also has to acquire the lock of the limiter.
+  RateLimiter(double samples_per_insert, int64_t min_size_to_sample,
+              double min_diff, double max_diff, bool shared = false);
+
+  // Same as above but paces the calls according to `pacing`.
   RateLimiter(double samples_per_insert, int64_t min_size_to_sample,
-              double min_diff, double max_diff);
+              double min_diff, double max_diff, PacingOptions pacing,
+              bool shared = false);
 
   // Construct and restore a RateLimiter from a previous checkpoint.
   explicit RateLimiter(const RateLimiterCheckpoint& checkpoint);
@@ -78,6 +130,21 @@ class RateLimiter {
                               absl::Duration timeout = kDefaultTimeout)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
 
+  // Same as `AwaitCanInsert` but also computes how many inserts (at most
+  // `max_inserts`) that can proceed in sequence without violating the
+  // conditions of the rate limiter. The result (>= 1) is written to
+  // `num_inserts`.
+  //
+  // As with `AwaitCanInsert` the state is not modified and `Insert` must be
+  // called once for every insert that is committed. The result remains valid
+  // for as long as `mu` is held. Shared limiters always approve a single insert
+  // as the other tables of the group can insert as soon as the call returns, as
+  // do limiters which currently pace inserts.
+  absl::Status AwaitCanInsertBatch(absl::Mutex* mu, int max_inserts,
+                                   int* num_inserts,
+                                   absl::Duration timeout = kDefaultTimeout)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
+
   // Waits until the sample operation can proceed without violating the
   // conditions of the rate limiter. If the condition is fulfilled before the
   // timeout expires or `Cancel` called then the state is updated.
@@ -93,10 +160,12 @@ class RateLimiter {
   // Register that an item have been deleted from the table.
   void Delete(absl::Mutex* mu) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
 
-  // Register that the table has been fully reset.
+  // Register that the table has been fully reset. Shared limiters only remove
+  // the inserts, samples and deletes of the table guarded by `mu`.
   void Reset(absl::Mutex* mu) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
 
-  // Unblocks any `Await` calls with a Cancelled-status.
+  // Unblocks any `Await` calls with a Cancelled-status. Shared limiters only
+  // cancel the calls (current and future) made by the table guarded by `mu`.
   void Cancel(absl::Mutex* mu) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
 
   // Returns true iff the current state would allow for `num_samples` to be
@@ -109,45 +178,160 @@ class RateLimiter {
   bool CanInsert(absl::Mutex* mu, int num_inserts) const
       ABSL_SHARED_LOCKS_REQUIRED(mu);
 
-  // Creates a checkpoint of the current state for the rate limiter.
+  // Time until which the next insert (if `insert`) or sample is held back by
+  // pacing, or `InfinitePast` if it would not be paced. Callers that cannot
+  // block (e.g. the asynchronous worker of `Table`) hold their requests until
+  // this time and then call `AwaitCanInsert` (`AwaitAndFinalizeSample`), which
+  // reserves the following slot.
+  absl::Time NextPacingSlot(absl::Mutex* mu, bool insert) const
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
+
+  // Same as `CanSample` and `CanInsert` but can be called without locking the
+  // parent table. The counters are read one by one and could be modified
+  // concurrently so the result must only be used as a hint (e.g. when polling)
+  // and not to decide whether an operation can proceed.
+  bool CanSampleWithoutLock(int num_samples) const;
+  bool CanInsertWithoutLock(int num_inserts) const;
+
+  // Creates a checkpoint of the current state for the rate limiter. The
+  // checkpoint of a shared limiter only holds the counts of the table guarded
+  // by `mu`, so it is restored as a limiter of that table alone.
   RateLimiterCheckpoint CheckpointReader(absl::Mutex* mu) const
       ABSL_SHARED_LOCKS_REQUIRED(mu);
 
-  // Configuration and call stats of the limiter.
-  RateLimiterInfo Info(absl::Mutex* mu) const ABSL_SHARED_LOCKS_REQUIRED(mu);
+  // Configuration and call stats of the limiter. Can be called without locking
+  // parent table. The call stats are read field by field so, when read while
+  // calls are in progress, the fields might not be consistent with each other.
+  RateLimiterInfo Info() const;
 
   // Same as Info but without call stats. Can be called without locking parent
   // table.
   RateLimiterInfo InfoWithoutCallStats() const;
 
   // Creates a copy of all COMPLETED events created since (inclusive)
-  // `min_X_event_id`.
-  RateLimiterEventHistory GetEventHistory(absl::Mutex* mu,
-                                          size_t min_insert_event_id,
-                                          size_t min_sample_event_id) const
-      ABSL_SHARED_LOCKS_REQUIRED(mu);
+  // `min_X_event_id`, up to the oldest event which is still active. Can be
+  // called without locking the parent table.
+  RateLimiterEventHistory GetEventHistory(size_t min_insert_event_id,
+                                          size_t min_sample_event_id) const;
+
+  // Sets the clock used to timestamp events. Reading a `CoarseClock` is much
+  // cheaper than reading the system clock (which is done once per call, while
+  // holding the lock of the parent table) but the timestamps, and with them
+  // the deadlines of the calls, are only accurate up to the resolution of the
+  // clock. If not set then the system clock is used.
+  //
+  // Note! This method is not thread safe and caller is responsible for making
+  // sure that this method, nor any other method, is called concurrently.
+  void UnsafeSetCoarseClock(std::shared_ptr<internal::CoarseClock> clock);
 
   // Returns a summary string description.
   std::string DebugString() const;
 
  private:
   friend class Table;
-  // `Table` calls these methods on construction and destruction.
-  absl::Status RegisterTable(Table* table);
+  // `Table` calls these methods on construction and destruction. `mu` is the
+  // lock of the table.
+  absl::Status RegisterTable(absl::Mutex* mu, Table* table);
   void UnregisterTable(absl::Mutex* mu, Table* table) ABSL_LOCKS_EXCLUDED(mu);
 
-  // Checks if sample and insert operations can proceed and if so calls `Signal`
-  // on respective `CondVar`
-  void MaybeSignalCondVars(absl::Mutex* mu) ABSL_SHARED_LOCKS_REQUIRED(mu);
+  // A blocked `AwaitCanInsert` or `AwaitAndFinalizeSample` call.
+  struct Waiter {
+    // Signalled when the call is woken or the limiter cancelled.
+    absl::CondVar cv;
+    bool woken = false;
 
-  // Returns Cancelled-status if `Cancel` have been called.
-  absl::Status CheckIfCancelled() const;
+    // Lock of the table which made the call.
+    absl::Mutex* mu = nullptr;
+  };
+
+  // Inserts, samples and deletes made by one of the tables of a shared
+  // limiter.
+  struct Member {
+    Table* table = nullptr;
+    int64_t inserts = 0;
+    int64_t samples = 0;
+    int64_t deletes = 0;
+    bool cancelled = false;
+  };
+
+  // Must be called by `Table` when an approved insert was not committed (e.g.
+  // because the item was inserted by another call while waiting) so that
+  // another insert can proceed.
+  void WakeWaiters(absl::Mutex* mu) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
+
+  // Must be called by `Table` when samples approved by
+  // `AwaitAndFinalizeSample` could not be taken (e.g. because the table was
+  // emptied before the keys were selected) so that they are not counted.
+  void UndoSamples(absl::Mutex* mu, int num_samples)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
+
+  // Computes how many inserts and samples can proceed, on top of the calls
+  // already woken, and wakes that many waiters from the front of the queues.
+  // Must be called after every change of the state. Shared limiters must also
+  // hold `group_mu_`.
+  void WakeWaitersLocked(absl::Mutex* mu) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
+
+  // Largest `n` <= `limit` such that `CanInsert(mu, n)` (`CanSample(mu, n)`),
+  // or 0 if not even a single operation can proceed.
+  int NumInsertsAllowed(absl::Mutex* mu, int limit) const
+      ABSL_SHARED_LOCKS_REQUIRED(mu);
+  int NumSamplesAllowed(absl::Mutex* mu, int limit) const
+      ABSL_SHARED_LOCKS_REQUIRED(mu);
+
+  // Waits on `cv` until it is signalled or `deadline` has passed. Shared
+  // limiters wait on `group_mu_` (which must be held) and release `mu` while
+  // waiting. Returns true if the deadline passed.
+  bool WaitWithDeadline(absl::Mutex* mu, absl::CondVar* cv, absl::Time deadline)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
+
+  // Updates the pacing controller with the state at `now` and returns its
+  // output, in [-1, 1]. Positive outputs delay inserts, negative outputs delay
+  // samples.
+  double UpdatePacing(absl::Mutex* mu, absl::Time now)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
+
+  // Reserves the next pacing slot of an insert (if `insert`) or a sample and
+  // blocks until the slot, `deadline` or cancellation. Calls are never failed
+  // because of pacing, so calls with a short timeout (e.g. the asynchronous
+  // calls of `Table`) are only paced for as long as the timeout allows. Returns
+  // true if the call was blocked.
+  bool AwaitPacing(absl::Mutex* mu, bool insert, absl::Time deadline)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
+
+  // Queues the calling thread at the back of `queue` and blocks until
+  // `can_proceed` returns true (when woken by `WakeWaitersLocked`), `deadline`
+  // has passed or the limiter is cancelled. Shared limiters release `mu` while
+  // blocked. `*woken` is the number of waiters of
+  // `queue` which have been woken but have not yet run. Returns false if the
+  // deadline passed.
+  template <typename CanProceed>
+  bool AwaitTurn(absl::Mutex* mu, std::deque<Waiter*>* queue, int* woken,
+                 absl::Time deadline, CanProceed can_proceed)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
+
+  // Returns true if `Cancel` has been called (by the table guarded by `mu` if
+  // the limiter is shared).
+  bool IsCancelled(absl::Mutex* mu) const;
+
+  // Returns Cancelled-status if `IsCancelled`.
+  absl::Status CheckIfCancelled(absl::Mutex* mu) const;
 
   // Pointer to the table. We expect this to be available (if set), since it's
   // set by a Table calling RegisterTable(this) after it stores a shared_ptr to
-  // this RateLimiter;.
+  // this RateLimiter;. Unused by shared limiters.
   Table* table_ = nullptr;
 
+  // Whether the limiter can be used by more than one table.
+  const bool shared_;
+
+  // Guards the state of a shared limiter, in which case it is acquired after
+  // the lock of the calling table. Unused by limiters which are not shared as
+  // their state is guarded by the lock of their table.
+  mutable absl::Mutex group_mu_;
+
+  // The tables of a shared limiter, by the lock which guards them.
+  internal::flat_hash_map<absl::Mutex*, Member> members_;
+
   // The desired ratio between sample ops and insert operations. This can be
   // interpreted as the average number of times each item is sampled during
   // its total lifetime.
@@ -164,24 +348,61 @@ class RateLimiter {
   // to be allowed.
   const int64_t min_size_to_sample_;
 
+  // The counters are only modified while holding the lock of the parent table
+  // (or `group_mu_` if shared) but are atomic so that they can be read by
+  // `CanSampleWithoutLock` and `CanInsertWithoutLock`.
+
   // Total number of items inserted into table.
-  int64_t inserts_;
+  std::atomic<int64_t> inserts_;
 
   // Total number of times any item has been sampled from the table.
-  int64_t samples_;
+  std::atomic<int64_t> samples_;
 
   // Total number of items that has been deleted from the table.
-  int64_t deletes_;
+  std::atomic<int64_t> deletes_;
 
-  // Whether `Cancel` has been called.
+  // Whether `Cancel` has been called. Unused by shared limiters.
   bool cancelled_;
 
-  // Signal called on respective cv if operation can proceed after state change.
-  absl::CondVar can_insert_cv_;
-  absl::CondVar can_sample_cv_;
+  // Clock used to timestamp events, or null to use the system clock.
+  std::shared_ptr<internal::CoarseClock> coarse_clock_;
+
+  // See `PacingOptions`.
+  const PacingOptions pacing_;
+
+  // State of the pacing controller: integral of the error, time of the last
+  // update and last output.
+  double pacing_integral_ = 0;
+  absl::Time pacing_updated_at_;
+  double pacing_output_ = 0;
+
+  // Earliest time at which the next insert (sample) may be admitted.
+  absl::Time next_insert_slot_ = absl::InfinitePast();
+  absl::Time next_sample_slot_ = absl::InfinitePast();
+
+  // Signalled when the limiter is cancelled to wake calls waiting for their
+  // pacing slot.
+  absl::CondVar pacing_cv_;
+
+  // Calls blocked in `AwaitCanInsert` and `AwaitAndFinalizeSample`, in the
+  // order they arrived.
+  std::deque<Waiter*> insert_waiters_;
+  std::deque<Waiter*> sample_waiters_;
+
+  // Number of waiters which have been woken (and removed from the queues) but
+  // have not yet run.
+  int woken_inserters_ = 0;
+  int woken_samplers_ = 0;
 
   // The StatsManager maintains a circular buffer of `RateLimiterEvent` and a
   // set of all time stats for calls of a single type (sample/insert).
+  //
+  // Events are only created and completed by one thread at a time (while
+  // holding the lock of the parent table, or `group_mu_` if shared) but the
+  // buffer and the stats can be read concurrently without any lock. Every
+  // slot of the buffer holds the id of its event once the event has been
+  // completed, which the readers use to detect events that are still active
+  // or have been overwritten while being copied.
   class StatsManager {
    public:
     StatsManager();
@@ -190,71 +411,87 @@ class RateLimiter {
     // of scope.
     class ScopedEvent {
      public:
-      ScopedEvent(StatsManager* parent, RateLimiterEvent* event);
+      ScopedEvent(StatsManager* parent, size_t id, absl::Time start);
 
       // Should be called to indicate that the event was blocked for any time at
       // all. If this is never called then `blocked_for` will remain as
       // ZeroDuration, ignoring the actual wall time.
       void set_was_blocked();
 
+      // Time when the event was created.
+      absl::Time start() const { return start_; }
+
       ~ScopedEvent();
 
      private:
       StatsManager* parent_;
-      RateLimiterEvent* event_;
+      size_t id_;
+      absl::Time start_;
       bool was_blocked_;
     };
 
-    // Creates an event using the current time as `start`. The event object is
-    // owned by the StatsManager and the pointer must only be used within the
-    // RateLimiter.
-    ScopedEvent CreateEvent(absl::Mutex* mu) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
+    // Creates an event using the time of `clock` (or the system clock if null)
+    // as `start`.
+    ScopedEvent CreateEvent(absl::Mutex* mu,
+                            const internal::CoarseClock* clock)
+        ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
 
-    // Marks the event as completed by removing it from `active_` and
-    // updating the summary metrics. This method should only be called by
-    // ScopedEvent.
-    void CompleteEvent(RateLimiterEvent* event);
+    // Marks the event as completed by writing it to its slot and updating the
+    // summary metrics. This method should only be called by ScopedEvent.
+    void CompleteEvent(size_t id, absl::Time start, absl::Duration blocked_for);
 
-    // Encode the current state as a `RateLimiterCallStats`-proto.
-    void ToProto(absl::Mutex* mu, RateLimiterCallStats* proto) const
-        ABSL_SHARED_LOCKS_REQUIRED(mu);
+    // Encode the current state as a `RateLimiterCallStats`-proto. Can be
+    // called without locking the parent table.
+    void ToProto(RateLimiterCallStats* proto) const;
 
     // Creates a copy of all events starting from `min_event_id` until (but not
-    // including) the oldest active event. If no events are currently active
-    // all events from `min_event_id` are included in the copy.
-    std::vector<RateLimiterEvent> GetEventHistory(absl::Mutex* mu,
-                                                  size_t min_event_id) const
-        ABSL_SHARED_LOCKS_REQUIRED(mu);
+    // including) the oldest event which is still active. Can be called without
+    // locking the parent table.
+    std::vector<RateLimiterEvent> GetEventHistory(size_t min_event_id) const;
 
    private:
+    struct Slot {
+      // One more than the id of the event in the slot if the event has been
+      // completed, otherwise 0. Written last (first) when an event is
+      // completed (created) so that readers can validate the other fields.
+      std::atomic<size_t> completed_id{0};
+      std::atomic<int64_t> start_ns{0};
+      std::atomic<int64_t> blocked_for_ns{0};
+    };
+
     // Preallocated buffer of events to avoid allocation while holding the lock
     // on the parent table. The size of the FIXED SIZE
     // (`kEventHistoryBufferSize`) container is set in the constructor of
     // StatsManager.
-    absl::FixedArray<RateLimiterEvent> events_;
+    absl::FixedArray<Slot> events_;
 
     // Event IDs are incremented with each created events. Since no concurrent
     // operations are possible we can safely assume that events with larger IDs
     // were started after events with smaller IDs.
-    size_t next_event_id_;
+    std::atomic<size_t> next_event_id_;
+
+    // The summary metrics below are only written while holding the lock of
+    // the parent table but are atomic so that they can be read without it.
+
+    // Number of active events, i.e. events which have been created but not yet
+    // completed.
+    std::atomic<int64_t> num_active_;
 
-    // IDs of events that currently are "active". An event is "active" until
-    // for as long as the call is blocked. If no blocking occurs then the event
-    // will be added and removed from the set while holding the lock and thus
-    // it is never possible to observe an active event that weren't blocked by
-    // the rate limiter.
-    absl::flat_hash_set<size_t> active_;
+    // Sum of the `start` (in nanoseconds since the Unix epoch) of the active
+    // events. Used to derive the pending wait time.
+    std::atomic<int64_t> active_start_ns_sum_;
 
     // Number of calls that have been completed.
-    int64_t completed_;
+    std::atomic<int64_t> completed_;
 
     // Number of calls that were blocked for any time at all.
-    int64_t limited_;
+    std::atomic<int64_t> limited_;
 
-    // The total time spent waiting for the all the blocked COMPLETED calls.
-    // Note that concurrent calls are counted independently so the value can be
-    // much larger than the "wall time" since the rate limiter was created.
-    absl::Duration total_wait_;
+    // The total time (in nanoseconds) spent waiting for the all the blocked
+    // COMPLETED calls. Note that concurrent calls are counted independently so
+    // the value can be much larger than the "wall time" since the rate limiter
+    // was created.
+    std::atomic<int64_t> total_wait_ns_;
   };
 
   // Summary statistics and a (large) buffers of recent events.
@@ -14,6 +14,7 @@
 
 #include "reverb/cc/rate_limiter.h"
 
+#include <cfloat>
 #include <memory>
 #include <vector>
 
@@ -21,7 +22,9 @@
 #include "gtest/gtest.h"
 #include "absl/synchronization/mutex.h"
 #include "absl/synchronization/notification.h"
+#include "absl/status/status.h"
 #include "absl/time/time.h"
+#include "reverb/cc/chunk_store.h"
 #include "reverb/cc/platform/status_matchers.h"
 #include "reverb/cc/platform/thread.h"
 #include "reverb/cc/selectors/uniform.h"
@@ -45,6 +48,31 @@ std::unique_ptr<Table> MakeTable(const std::string &name,
                                   0, std::move(limiter));
 }
 
+Table::Item MakeItem(uint64_t key) {
+  Table::Item item;
+  std::vector<ChunkData> data = {
+      testing::MakeChunkData(key, testing::MakeSequenceRange(key, 0, 1))};
+  item.chunks.push_back(std::make_shared<ChunkStore::Chunk>(data[0]));
+  item.item = testing::MakePrioritizedItem(key, 1, data);
+  return item;
+}
+
+// Inserts `item` into `table` unless the rate limiter blocks it for longer
+// than `kTimeout`.
+absl::Status InsertWithTimeout(Table* table, Table::Item item) {
+  absl::Notification done;
+  absl::Status result;
+  table->InsertOrAssignAsync(
+      std::move(item),
+      [&](absl::Status status) {
+        result = std::move(status);
+        done.Notify();
+      },
+      kTimeout);
+  done.WaitForNotification();
+  return result;
+}
+
 TEST(RateLimiterTest, BlocksSamplesUntilMinInsertsReached) {
   auto limiter =
       std::make_shared<RateLimiter>(/*samples_per_insert=*/1.0,
@@ -252,6 +280,311 @@ TEST(RateLimiterTest, CanInsert) {
   EXPECT_FALSE(limiter->CanInsert(&mu, 2));  // diff = 5.5.
 }
 
+TEST(RateLimiterTest, AwaitCanInsertBatchReturnsLargestBatch) {
+  auto limiter =
+      std::make_shared<RateLimiter>(/*samples_per_insert=*/1.5,
+                                    /*min_size_to_sample=*/2, /*min_diff=*/0.0,
+                                    /*max_diff=*/5.0);
+  auto table = MakeTable("table", limiter);
+  absl::Mutex mu;
+  absl::WriterMutexLock lock(&mu);
+
+  // The min size allows for the first two inserts and the error buffer allows
+  // for one additional insert.
+  int num_inserts = 0;
+  REVERB_EXPECT_OK(
+      limiter->AwaitCanInsertBatch(&mu, 10, &num_inserts, kTimeout));
+  EXPECT_EQ(num_inserts, 3);
+
+  // The result is capped by `max_inserts`.
+  REVERB_EXPECT_OK(limiter->AwaitCanInsertBatch(&mu, 2, &num_inserts, kTimeout));
+  EXPECT_EQ(num_inserts, 2);
+
+  for (int i = 0; i < 3; i++) {
+    limiter->Insert(&mu);
+  }
+
+  // No inserts are allowed so the call should time out.
+  EXPECT_EQ(limiter->AwaitCanInsertBatch(&mu, 10, &num_inserts, kTimeout)
+                .code(),
+            absl::StatusCode::kDeadlineExceeded);
+
+  // Sampling two items makes room for one insert.
+  REVERB_EXPECT_OK(limiter->AwaitAndFinalizeSample(&mu, kTimeout));
+  REVERB_EXPECT_OK(limiter->AwaitAndFinalizeSample(&mu, kTimeout));
+  REVERB_EXPECT_OK(
+      limiter->AwaitCanInsertBatch(&mu, 10, &num_inserts, kTimeout));
+  EXPECT_EQ(num_inserts, 1);
+}
+
+TEST(RateLimiterTest, WakesWaitersInArrivalOrder) {
+  auto limiter =
+      std::make_shared<RateLimiter>(/*samples_per_insert=*/1.0,
+                                    /*min_size_to_sample=*/1, /*min_diff=*/0.0,
+                                    /*max_diff=*/100.0);
+  auto table = MakeTable("table", limiter);
+  absl::Mutex mu;
+  std::vector<int> completed;
+
+  // The samples are queued one by one so their order of arrival is known.
+  const int kNumSamplers = 5;
+  std::vector<std::unique_ptr<internal::Thread>> threads;
+  for (int i = 0; i < kNumSamplers; i++) {
+    threads.push_back(internal::StartThread("", [&, i] {
+      absl::WriterMutexLock lock(&mu);
+      REVERB_EXPECT_OK(limiter->AwaitAndFinalizeSample(&mu));
+      completed.push_back(i);
+    }));
+    while (limiter->Info().sample_stats().pending() != i + 1) {
+      absl::SleepFor(absl::Milliseconds(1));
+    }
+  }
+
+  // Every insert allows exactly one sample so every insert completes the
+  // oldest sample still waiting.
+  for (int i = 0; i < kNumSamplers; i++) {
+    {
+      absl::WriterMutexLock lock(&mu);
+      REVERB_EXPECT_OK(limiter->AwaitCanInsert(&mu));
+      limiter->Insert(&mu);
+    }
+    while (limiter->Info().sample_stats().pending() != kNumSamplers - i - 1) {
+      absl::SleepFor(absl::Milliseconds(1));
+    }
+    absl::SleepFor(kTimeout);
+    absl::WriterMutexLock lock(&mu);
+    EXPECT_EQ(completed.size(), i + 1);
+  }
+  threads.clear();
+  EXPECT_THAT(completed, ::testing::ElementsAre(0, 1, 2, 3, 4));
+}
+
+TEST(RateLimiterTest, SharedLimiterCombinesTheCountsOfItsTables) {
+  auto limiter =
+      std::make_shared<RateLimiter>(/*samples_per_insert=*/1.0,
+                                    /*min_size_to_sample=*/1, /*min_diff=*/0.0,
+                                    /*max_diff=*/2.0, /*shared=*/true);
+  auto table_a = MakeTable("a", limiter);
+  auto table_b = MakeTable("b", limiter);
+
+  // The inserts into `a` and `b` use up the buffer of the group.
+  REVERB_EXPECT_OK(table_a->InsertOrAssign(MakeItem(1)));
+  REVERB_EXPECT_OK(table_b->InsertOrAssign(MakeItem(2)));
+  EXPECT_EQ(InsertWithTimeout(table_a.get(), MakeItem(3)).code(),
+            absl::StatusCode::kDeadlineExceeded);
+
+  // A sample from `b` allows another insert into `a`.
+  std::vector<Table::SampledItem> samples;
+  REVERB_EXPECT_OK(table_b->SampleFlexibleBatch(&samples, 1, kTimeout));
+  REVERB_EXPECT_OK(InsertWithTimeout(table_a.get(), MakeItem(3)));
+  EXPECT_EQ(InsertWithTimeout(table_b.get(), MakeItem(4)).code(),
+            absl::StatusCode::kDeadlineExceeded);
+
+  // Samples from `a` make room for a batch inserted into `b`.
+  REVERB_EXPECT_OK(table_a->SampleFlexibleBatch(&samples, 1, kTimeout));
+  REVERB_EXPECT_OK(table_a->SampleFlexibleBatch(&samples, 1, kTimeout));
+  std::vector<Table::Item> items;
+  items.push_back(MakeItem(5));
+  items.push_back(MakeItem(6));
+  REVERB_EXPECT_OK(table_b->InsertOrAssignBatch(std::move(items)));
+  EXPECT_EQ(table_a->size() + table_b->size(), 5);
+}
+
+TEST(RateLimiterTest, SharedLimiterReleasesTheTableLockWhileBlocked) {
+  auto limiter =
+      std::make_shared<RateLimiter>(/*samples_per_insert=*/1.0,
+                                    /*min_size_to_sample=*/1, /*min_diff=*/0.0,
+                                    /*max_diff=*/2.0, /*shared=*/true);
+  auto table_a = MakeTable("a", limiter);
+  auto table_b = MakeTable("b", limiter);
+  REVERB_EXPECT_OK(table_a->InsertOrAssign(MakeItem(1)));
+  std::vector<Table::SampledItem> samples;
+  REVERB_EXPECT_OK(table_a->SampleFlexibleBatch(&samples, 1, kTimeout));
+
+  absl::Notification notification;
+  auto thread = internal::StartThread("", [&] {
+    std::vector<Table::SampledItem> samples;
+    REVERB_EXPECT_OK(table_a->SampleFlexibleBatch(&samples, 1));
+    notification.Notify();
+  });
+  EXPECT_FALSE(notification.WaitForNotificationWithTimeout(kTimeout));
+
+  // The sample is blocked but the lock of `a` can still be acquired.
+  KeyWithPriority update;
+  update.set_key(1);
+  update.set_priority(2);
+  REVERB_EXPECT_OK(table_a->MutateItems({update}, {}));
+
+  // An insert into `b` unblocks the sample from `a`.
+  REVERB_EXPECT_OK(table_b->InsertOrAssign(MakeItem(2)));
+  EXPECT_TRUE(notification.WaitForNotificationWithTimeout(kTimeout));
+  thread = nullptr;
+}
+
+TEST(RateLimiterTest, SharedLimiterResetsAndCancelsTablesIndividually) {
+  auto limiter =
+      std::make_shared<RateLimiter>(/*samples_per_insert=*/1.0,
+                                    /*min_size_to_sample=*/2, /*min_diff=*/-10,
+                                    /*max_diff=*/10, /*shared=*/true);
+  auto table_a = MakeTable("a", limiter);
+  auto table_b = MakeTable("b", limiter);
+
+  REVERB_EXPECT_OK(table_a->InsertOrAssign(MakeItem(1)));
+  REVERB_EXPECT_OK(table_a->InsertOrAssign(MakeItem(2)));
+  REVERB_EXPECT_OK(table_b->InsertOrAssign(MakeItem(3)));
+  std::vector<Table::SampledItem> samples;
+  REVERB_EXPECT_OK(table_b->SampleFlexibleBatch(&samples, 1, kTimeout));
+
+  // Only the item of `b` remains so the group is below `min_size_to_sample`.
+  REVERB_EXPECT_OK(table_a->Reset());
+  EXPECT_EQ(table_b->SampleFlexibleBatch(&samples, 1, kTimeout).code(),
+            absl::StatusCode::kDeadlineExceeded);
+
+  // Closing `a` cancels its calls but not those of `b`.
+  table_a->Close();
+  EXPECT_EQ(table_a->InsertOrAssign(MakeItem(4)).code(),
+            absl::StatusCode::kCancelled);
+  REVERB_EXPECT_OK(table_b->InsertOrAssign(MakeItem(5)));
+  REVERB_EXPECT_OK(table_b->SampleFlexibleBatch(&samples, 1, kTimeout));
+}
+
+TEST(RateLimiterTest, SharedLimiterOutlivesDestroyedTables) {
+  auto limiter =
+      std::make_shared<RateLimiter>(/*samples_per_insert=*/1.0,
+                                    /*min_size_to_sample=*/1,
+                                    /*min_diff=*/-DBL_MAX, /*max_diff=*/6.0,
+                                    /*shared=*/true);
+  auto table_a = MakeTable("a", limiter);
+  auto table_b = MakeTable("b", limiter);
+  for (int i = 0; i < 5; i++) {
+    REVERB_EXPECT_OK(table_a->InsertOrAssign(MakeItem(i)));
+  }
+  REVERB_EXPECT_OK(table_b->InsertOrAssign(MakeItem(5)));
+  EXPECT_EQ(InsertWithTimeout(table_b.get(), MakeItem(6)).code(),
+            absl::StatusCode::kDeadlineExceeded);
+
+  // The group continues as if `a` had never been part of it.
+  table_a = nullptr;
+  for (int i = 6; i < 11; i++) {
+    REVERB_EXPECT_OK(InsertWithTimeout(table_b.get(), MakeItem(i)));
+  }
+  EXPECT_EQ(InsertWithTimeout(table_b.get(), MakeItem(11)).code(),
+            absl::StatusCode::kDeadlineExceeded);
+  std::vector<Table::SampledItem> samples;
+  REVERB_EXPECT_OK(table_b->SampleFlexibleBatch(&samples, 1, kTimeout));
+
+  // A new table can join the group.
+  auto table_c = MakeTable("c", limiter);
+  REVERB_EXPECT_OK(InsertWithTimeout(table_c.get(), MakeItem(12)));
+  EXPECT_EQ(table_b->size() + table_c->size(), 7);
+}
+
+TEST(RateLimiterDeathTest, OnlySharedLimitersCanHaveMultipleTables) {
+  auto limiter =
+      std::make_shared<RateLimiter>(/*samples_per_insert=*/1.0,
+                                    /*min_size_to_sample=*/1, /*min_diff=*/0.0,
+                                    /*max_diff=*/2.0);
+  auto table = MakeTable("a", limiter);
+  ASSERT_DEATH(MakeTable("b", limiter), "already registered");
+}
+
+TEST(RateLimiterTest, PacesInsertsWhichRunAheadOfSamples) {
+  RateLimiter::PacingOptions pacing;
+  pacing.max_delay = absl::Milliseconds(50);
+  pacing.integral_gain = 0;
+  auto limiter = std::make_shared<RateLimiter>(
+      /*samples_per_insert=*/1.0, /*min_size_to_sample=*/1, /*min_diff=*/-10,
+      /*max_diff=*/10, pacing);
+  auto table = MakeTable("table", limiter);
+  absl::Mutex mu;
+  absl::WriterMutexLock lock(&mu);
+
+  // The interval between two inserts grows by 5ms with every insert as the
+  // cursor moves 1/10 of the way from the middle to `max_diff`.
+  const absl::Time start = absl::Now();
+  for (int i = 0; i < 10; i++) {
+    REVERB_EXPECT_OK(limiter->AwaitCanInsert(&mu, absl::Seconds(10)));
+    limiter->Insert(&mu);
+  }
+  EXPECT_GE(absl::Now() - start, absl::Milliseconds(150));
+  EXPECT_EQ(limiter->Info().insert_stats().limited(), 8);
+
+  // Samples are behind so they are not paced.
+  for (int i = 0; i < 5; i++) {
+    REVERB_EXPECT_OK(limiter->AwaitAndFinalizeSample(&mu, kTimeout));
+  }
+  EXPECT_EQ(limiter->Info().sample_stats().limited(), 0);
+
+  // Calls which cannot wait for their slot are not failed.
+  REVERB_EXPECT_OK(limiter->AwaitCanInsert(&mu, absl::ZeroDuration()));
+}
+
+TEST(RateLimiterTest, CheckpointAndInfoIncludePacing) {
+  RateLimiter::PacingOptions pacing;
+  pacing.max_delay = absl::Milliseconds(50);
+  pacing.proportional_gain = 2;
+  pacing.integral_gain = 0.5;
+  auto limiter = std::make_shared<RateLimiter>(
+      /*samples_per_insert=*/1.0, /*min_size_to_sample=*/1, /*min_diff=*/-10,
+      /*max_diff=*/10, pacing);
+  auto table = MakeTable("table", limiter);
+  absl::Mutex mu;
+  absl::WriterMutexLock lock(&mu);
+
+  const char* kPacing =
+      "pacing: { max_delay: { nanos: 50000000 } proportional_gain: 2 "
+      "integral_gain: 0.5 }";
+  EXPECT_THAT(limiter->Info(), Partially(EqualsProto(kPacing)));
+  auto checkpoint = limiter->CheckpointReader(&mu);
+  EXPECT_THAT(checkpoint, Partially(EqualsProto(kPacing)));
+
+  auto restored = std::make_shared<RateLimiter>(checkpoint);
+  EXPECT_THAT(restored->Info(), Partially(EqualsProto(kPacing)));
+}
+
+TEST(RateLimiterTest, EventHistoryStopsAtOldestActiveEvent) {
+  auto limiter =
+      std::make_shared<RateLimiter>(/*samples_per_insert=*/1.0,
+                                    /*min_size_to_sample=*/2, /*min_diff=*/-1.0,
+                                    /*max_diff=*/1.0);
+  auto table = MakeTable("table", limiter);
+  absl::Mutex mu;
+  {
+    absl::WriterMutexLock lock(&mu);
+    REVERB_EXPECT_OK(limiter->AwaitCanInsert(&mu));
+    limiter->Insert(&mu);
+  }
+
+  absl::Notification notification;
+  auto thread = internal::StartThread("", [&] {
+    absl::WriterMutexLock lock(&mu);
+    REVERB_EXPECT_OK(limiter->AwaitAndFinalizeSample(&mu));
+    notification.Notify();
+  });
+  EXPECT_FALSE(notification.WaitForNotificationWithTimeout(kTimeout));
+
+  // The history is read without the lock while the sample is blocked.
+  auto history = limiter->GetEventHistory(0, 0);
+  ASSERT_EQ(history.insert.size(), 1);
+  EXPECT_EQ(history.insert[0].id, 0);
+  EXPECT_EQ(history.insert[0].blocked_for, absl::ZeroDuration());
+  EXPECT_TRUE(history.sample.empty());
+
+  {
+    absl::WriterMutexLock lock(&mu);
+    REVERB_EXPECT_OK(limiter->AwaitCanInsert(&mu));
+    limiter->Insert(&mu);
+  }
+  EXPECT_TRUE(notification.WaitForNotificationWithTimeout(kTimeout));
+  thread = nullptr;
+
+  history = limiter->GetEventHistory(1, 0);
+  ASSERT_EQ(history.insert.size(), 1);
+  EXPECT_EQ(history.insert[0].id, 1);
+  ASSERT_EQ(history.sample.size(), 1);
+  EXPECT_GE(history.sample[0].blocked_for, kTimeout);
+}
+
 TEST(RateLimiterTest, CheckpointSetsBasicOptions) {
   auto limiter =
       std::make_shared<RateLimiter>(/*samples_per_insert=*/1.5,
@@ -430,10 +763,7 @@ TEST(RateLimiterTest, BlocksSamplesIfDeleteBringsSizeBelowMinSize) {
 }
 
 TEST(RateLimiterTest, Info) {
-  absl::Mutex mu;
-  absl::ReaderMutexLock lock(&mu);
-
-  EXPECT_THAT(RateLimiter(1, 1, 0, 5).Info(&mu),
+  EXPECT_THAT(RateLimiter(1, 1, 0, 5).Info(),
               EqualsProto("samples_per_insert: 1 "
                           "min_size_to_sample: 1 "
                           "min_diff: 0 "
@@ -446,7 +776,7 @@ TEST(RateLimiterTest, Info) {
                           "  completed_wait_time: {} "
                           "  pending_wait_time: {} "
                           "}"));
-  EXPECT_THAT(RateLimiter(1.5, 14, -10, 5.3).Info(&mu),
+  EXPECT_THAT(RateLimiter(1.5, 14, -10, 5.3).Info(),
               EqualsProto("samples_per_insert: 1.5 "
                           "min_size_to_sample: 14 "
                           "min_diff: -10 "
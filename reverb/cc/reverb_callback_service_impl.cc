@@ -0,0 +1,1539 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/reverb_callback_service_impl.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/message_lite.h"
+#include "google/protobuf/wire_format_lite.h"
+#include "grpcpp/grpcpp.h"
+#include "grpcpp/support/byte_buffer.h"
+#include "grpcpp/support/slice.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/memory/memory.h"
+#include "absl/random/distributions.h"
+#include "absl/random/random.h"
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "reverb/cc/chunk_store.h"
+#include "reverb/cc/platform/hash_map.h"
+#include "reverb/cc/platform/hash_set.h"
+#include "reverb/cc/platform/logging.h"
+#include "reverb/cc/platform/status_macros.h"
+#include "reverb/cc/reverb_service.grpc.pb.h"
+#include "reverb/cc/reverb_service.pb.h"
+#include "reverb/cc/reverb_service_impl.h"
+#include "reverb/cc/sample_group.h"
+#include "reverb/cc/sampler.h"
+#include "reverb/cc/support/chunk_column_index.h"
+#include "reverb/cc/support/grpc_util.h"
+#include "reverb/cc/support/insert_confirmations.h"
+#include "reverb/cc/support/latency_histogram.h"
+#include "reverb/cc/support/lru_cache.h"
+#include "reverb/cc/support/reclaimer.h"
+#include "reverb/cc/support/thread_pool.h"
+#include "reverb/cc/support/trajectory_util.h"
+#include "reverb/cc/support/workload_recorder.h"
+#include "reverb/cc/table.h"
+
+namespace deepmind {
+namespace reverb {
+namespace {
+
+using TableMap = internal::flat_hash_map<std::string, std::shared_ptr<Table>>;
+
+inline grpc::Status TableNotFound(absl::string_view name) {
+  return grpc::Status(grpc::StatusCode::NOT_FOUND,
+                      absl::StrCat("Priority table ", name, " was not found"));
+}
+
+inline grpc::Status Internal(const std::string& message) {
+  return grpc::Status(grpc::StatusCode::INTERNAL, message);
+}
+
+Table* TableByName(const TableMap& tables, absl::string_view name) {
+  auto it = tables.find(name);
+  if (it == tables.end()) return nullptr;
+  return it->second.get();
+}
+
+// Finishes the call with `status` as soon as the reactor is started.
+template <typename Request, typename Response>
+class FinishedReactor : public grpc::ServerBidiReactor<Request, Response> {
+ public:
+  explicit FinishedReactor(grpc::Status status) { this->Finish(status); }
+
+  void OnDone() override { delete this; }
+};
+
+// Same as `FinishedReactor` for server streaming methods.
+template <typename Response>
+class FinishedWriteReactor : public grpc::ServerWriteReactor<Response> {
+ public:
+  explicit FinishedWriteReactor(grpc::Status status) { this->Finish(status); }
+
+  void OnDone() override { delete this; }
+};
+
+// Reactor of `InsertStream`.
+//
+// Reads are issued one at a time. Chunks are inserted into the chunk store as
+// they are received. The items of a read (i.e. all the items of a batch) are
+// handed over to `Table::InsertOrAssignBatchAsync` with one call per run of
+// consecutive items targeting the same table.
+// A new read is only issued while the requests read for the inserts in flight
+// are smaller than `max_read_ahead_bytes`. Confirmations are written in the
+// order the inserts complete.
+//
+// The reactions and the table callbacks decide which operations to start while
+// holding `mu_` but the operations themselves are started once the lock has
+// been released. `Finish` is always the last thing a method does as the
+// reactor can be deleted (by `OnDone`) as soon as it has been called.
+class InsertStreamReactor
+    : public grpc::ServerBidiReactor<InsertStreamRequest, InsertStreamResponse> {
+ public:
+  InsertStreamReactor(ChunkStore* chunk_store, internal::Reclaimer* reclaimer,
+                      const TableMap* tables,
+                      internal::RpcLatencyHistograms* latency,
+                      internal::WorkloadRecorder* recorder,
+                      bool is_local_peer, int64_t max_read_ahead_bytes,
+                      bool deduplicate_chunks)
+      : chunk_store_(chunk_store),
+        reclaimer_(reclaimer),
+        tables_(tables),
+        latency_(latency),
+        recorder_(recorder),
+        stream_id_(recorder->NewStreamId()),
+        is_local_peer_(is_local_peer),
+        max_read_ahead_bytes_(max_read_ahead_bytes),
+        deduplicate_chunks_(deduplicate_chunks) {
+    reading_ = true;
+    ResetRequest();
+    StartRead(request_.request);
+  }
+
+  void OnReadDone(bool ok) override {
+    if (!ok) {
+      Actions actions;
+      {
+        absl::MutexLock lock(&mu_);
+        reading_ = false;
+        reads_done_ = true;
+        actions = NextActionsLocked();
+      }
+      Run(std::move(actions));
+      return;
+    }
+
+    // Reads are never issued concurrently so `request_` and `chunks_` can be
+    // accessed without holding `mu_`.
+    {
+      absl::MutexLock lock(&mu_);
+      reading_ = false;
+      handling_read_ = true;
+    }
+
+    // The requests of a batch are handled as if they had been read one by one
+    // but their items are inserted together. Items resolved before an invalid
+    // request are still inserted.
+    grpc::Status status;
+    InsertStreamRequest& request = *request_.request;
+    unattributed_bytes_ += request.ByteSizeLong();
+    std::vector<StagedInsert> staged;
+    if (request.has_batch()) {
+      for (auto& batched : *request.mutable_batch()->mutable_requests()) {
+        status = HandleRequestAndStage(&batched, &staged);
+        if (!status.ok()) break;
+      }
+    } else {
+      status = HandleRequestAndStage(&request, &staged);
+    }
+    InsertStaged(std::move(staged));
+
+    Actions actions;
+    {
+      absl::MutexLock lock(&mu_);
+      handling_read_ = false;
+      if (!status.ok()) {
+        MaybeSetErrorLocked(std::move(status));
+      }
+      actions = NextActionsLocked();
+    }
+    Run(std::move(actions));
+  }
+
+  void OnWriteDone(bool ok) override {
+    Actions actions;
+    {
+      absl::MutexLock lock(&mu_);
+      writing_ = false;
+      if (!ok) {
+        MaybeSetErrorLocked(Internal(absl::StrCat(
+            "Error when sending confirmation that item ",
+            responses_.front().key(),
+            " has been successfully inserted/updated.")));
+      }
+      responses_.pop_front();
+      actions = NextActionsLocked();
+    }
+    Run(std::move(actions));
+  }
+
+  void OnDone() override {
+    for (auto& key_and_chunk : chunks_) {
+      reclaimer_->Reclaim(std::move(key_and_chunk.second));
+    }
+    delete this;
+  }
+
+ private:
+  // Operations to start once `mu_` has been released.
+  struct Actions {
+    bool read = false;
+    const InsertStreamResponse* write = nullptr;
+    bool finish = false;
+    grpc::Status status;
+  };
+
+  void OnInsertDone(absl::Status status, uint64_t sequence_number,
+                    int64_t bytes) {
+    Actions actions;
+    {
+      absl::MutexLock lock(&mu_);
+      num_pending_inserts_--;
+      pending_insert_bytes_ -= bytes;
+      std::vector<uint64_t> keys;
+      confirmations_.Done(sequence_number, &keys);
+      if (!status.ok()) {
+        MaybeSetErrorLocked(ToGrpcStatus(status));
+      } else if (status_.ok()) {
+        // Let caller know that the items have been inserted.
+        AddConfirmationsLocked(keys);
+      }
+      actions = NextActionsLocked();
+    }
+    Run(std::move(actions));
+  }
+
+  // Adds `keys` to the last response unless it is being written, in which
+  // case a new response is created. Confirmations released while a response
+  // is being written are thereby batched into the next response.
+  void AddConfirmationsLocked(const std::vector<uint64_t>& keys)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    for (uint64_t key : keys) {
+      if (responses_.empty() || (writing_ && responses_.size() == 1)) {
+        responses_.emplace_back();
+        responses_.back().set_key(key);
+      } else {
+        responses_.back().add_keys(key);
+      }
+    }
+  }
+
+  // An item resolved from a request of the current read.
+  struct StagedInsert {
+    Table* table;
+    Table::Item item;
+    uint64_t sequence_number;
+    int64_t bytes;
+  };
+
+  // Handles `request` (which is owned by `request_`) with `HandleRequest` and
+  // appends the resolved item, if any, to `staged`.
+  grpc::Status HandleRequestAndStage(InsertStreamRequest* request,
+                                     std::vector<StagedInsert>* staged) {
+    Table* table = nullptr;
+    Table::Item item;
+    bool send_confirmation = false;
+    const int64_t request_start = internal::AtomicLatencyHistogram::Start();
+    grpc::Status status =
+        HandleRequest(request, &table, &item, &send_confirmation);
+    latency_->insert_stream_request.Stop(request_start);
+
+    if (status.ok() && table != nullptr) {
+      // The item is charged for the requests (i.e. its chunks) read since the
+      // previous item.
+      const int64_t bytes = unattributed_bytes_;
+      unattributed_bytes_ = 0;
+      uint64_t sequence_number;
+      {
+        absl::MutexLock lock(&mu_);
+        num_pending_inserts_++;
+        pending_insert_bytes_ += bytes;
+        sequence_number =
+            confirmations_.Add(item.item.key(), send_confirmation);
+      }
+      staged->push_back({table, std::move(item), sequence_number, bytes});
+    }
+    return status;
+  }
+
+  // Hands `staged` over to the tables with one `InsertOrAssignBatchAsync` per
+  // run of consecutive items targeting the same table.
+  //
+  // The inserts are issued before the next read so the items of the stream are
+  // queued by the tables in the order they were received. The callbacks may be
+  // invoked before `InsertOrAssignBatchAsync` returns so the lock must not be
+  // held and `handling_read_` prevents the callbacks from finishing the call.
+  void InsertStaged(std::vector<StagedInsert> staged) {
+    const int64_t insert_start = internal::AtomicLatencyHistogram::Start();
+    for (size_t begin = 0; begin < staged.size();) {
+      Table* table = staged[begin].table;
+      std::vector<Table::Item> items;
+      std::vector<Table::InsertCallback> callbacks;
+      size_t end = begin;
+      for (; end < staged.size() && staged[end].table == table; end++) {
+        items.push_back(std::move(staged[end].item));
+        callbacks.push_back(
+            [this, sequence_number = staged[end].sequence_number,
+             bytes = staged[end].bytes, insert_start](absl::Status status) {
+              latency_->insert_stream_items.Stop(insert_start);
+              OnInsertDone(std::move(status), sequence_number, bytes);
+            });
+      }
+      table->InsertOrAssignBatchAsync(std::move(items), std::move(callbacks));
+      begin = end;
+    }
+  }
+
+  // Validates `request` and either inserts the chunk into the chunk store or
+  // resolves the item. If the request is a valid item then `table` is set to
+  // the table it should be inserted into.
+  grpc::Status HandleRequest(InsertStreamRequest* request_ptr, Table** table,
+                             Table::Item* item, bool* send_confirmation) {
+    InsertStreamRequest& request = *request_ptr;
+    if (request.has_batch()) {
+      return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                          "Batches of requests must not be nested.");
+    }
+    if (request.has_shared_memory_chunk()) {
+      if (auto status = internal::ResolveSharedMemoryChunk(
+              is_local_peer_, &segments_, &request);
+          !status.ok()) {
+        return status;
+      }
+    }
+
+    if (request.has_chunk()) {
+      recorder_->RecordChunk(stream_id_, request.chunk());
+      ChunkStore::Key key = request.chunk().chunk_key();
+      chunk_index_.Add(key, request.chunk_column(),
+                       request.chunk().sequence_range());
+      std::shared_ptr<ChunkStore::Chunk> chunk =
+          deduplicate_chunks_
+              ? chunk_store_->InsertDeduplicated(request_.arena,
+                                                 request.mutable_chunk())
+              : chunk_store_->Insert(request_.arena, request.mutable_chunk());
+      if (!chunk) {
+        return grpc::Status(grpc::StatusCode::CANCELLED,
+                            "Service has been closed");
+      }
+      chunks_[key] = std::move(chunk);
+      return grpc::Status::OK;
+    }
+
+    if (!request.has_item()) return grpc::Status::OK;
+
+    if (auto status = internal::ExpandAssembledTrajectory(
+            chunk_index_, request.mutable_item());
+        !status.ok()) {
+      return ToGrpcStatus(status);
+    }
+    recorder_->RecordItem(stream_id_, request.item());
+
+    // Chunks which were deduplicated are stored under the key of the chunk
+    // they share, so the trajectory must refer to them by that key.
+    internal::flat_hash_map<ChunkStore::Key, ChunkStore::Key> shared_keys;
+    for (ChunkStore::Key key :
+         internal::GetChunkKeys(request.item().item().flat_trajectory())) {
+      auto it = chunks_.find(key);
+      if (it == chunks_.end()) {
+        return Internal(
+            absl::StrCat("Could not find sequence chunk ", key, "."));
+      }
+      if (it->second->key() != key) {
+        shared_keys[key] = it->second->key();
+      }
+      // Several keys of the trajectory may share the same chunk.
+      if (!shared_keys.empty() &&
+          std::find(item->chunks.begin(), item->chunks.end(), it->second) !=
+              item->chunks.end()) {
+        continue;
+      }
+      item->chunks.push_back(it->second);
+    }
+
+    const auto& table_name = request.item().item().table();
+    Table* found = TableByName(*tables_, table_name);
+    if (found == nullptr) return TableNotFound(table_name);
+
+    internal::ReleaseChunks(request.item(), &chunks_, &chunk_index_,
+                            reclaimer_);
+
+    *send_confirmation = request.item().send_confirmation();
+    item->item = std::move(*request.mutable_item()->mutable_item());
+    if (!shared_keys.empty()) {
+      auto* trajectory = item->item.mutable_flat_trajectory();
+      for (auto& column : *trajectory->mutable_columns()) {
+        for (auto& slice : *column.mutable_chunk_slices()) {
+          auto it = shared_keys.find(slice.chunk_key());
+          if (it != shared_keys.end()) slice.set_chunk_key(it->second);
+        }
+      }
+    }
+    *table = found;
+    return grpc::Status::OK;
+  }
+
+  // Prepares `request_` for the next read. The arena is reused unless it is
+  // still owned by a chunk received in a previous request.
+  void ResetRequest() {
+    if (request_.arena == nullptr || request_.arena.use_count() > 1) {
+      request_ = internal::NewArenaInsertStreamRequest();
+    } else {
+      request_.arena->Reset();
+      request_.request =
+          google::protobuf::Arena::CreateMessage<InsertStreamRequest>(
+              request_.arena.get());
+    }
+  }
+
+  void MaybeSetErrorLocked(grpc::Status status)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    if (status_.ok()) {
+      status_ = std::move(status);
+      // The confirmations are not sent once the stream has failed.
+      responses_.erase(responses_.begin() + (writing_ ? 1 : 0),
+                       responses_.end());
+    }
+  }
+
+  // Decides which operations to start given the current state.
+  Actions NextActionsLocked() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    Actions actions;
+    if (finished_) return actions;
+
+    if (!writing_ && !responses_.empty()) {
+      writing_ = true;
+      actions.write = &responses_.front();
+    }
+
+    if (status_.ok() && !reading_ && !handling_read_ && !reads_done_ &&
+        (num_pending_inserts_ == 0 ||
+         pending_insert_bytes_ < max_read_ahead_bytes_)) {
+      reading_ = true;
+      actions.read = true;
+    }
+
+    // The table callbacks, the write and `OnReadDone` reference the reactor
+    // so these must complete before the call can be finished. Outstanding
+    // reads on the other hand are cancelled by `Finish`.
+    const bool idle =
+        num_pending_inserts_ == 0 && !writing_ && !handling_read_;
+    if (idle && (!status_.ok() || reads_done_)) {
+      finished_ = true;
+      actions.finish = true;
+      actions.status = status_;
+    }
+    return actions;
+  }
+
+  void Run(Actions actions) {
+    if (actions.write != nullptr) {
+      StartWrite(actions.write);
+    }
+    if (actions.read) {
+      ResetRequest();
+      StartRead(request_.request);
+    }
+    if (actions.finish) {
+      Finish(std::move(actions.status));
+    }
+  }
+
+  ChunkStore* chunk_store_;
+  internal::Reclaimer* reclaimer_;
+  const TableMap* tables_;
+
+  // Latencies reported by `ServerInfo`. Owned by the service.
+  internal::RpcLatencyHistograms* const latency_;
+
+  // Records the requests of the stream. Owned by the service.
+  internal::WorkloadRecorder* const recorder_;
+  const uint64_t stream_id_;
+
+  // True if the client is on the same host and may send chunks through shared
+  // memory.
+  const bool is_local_peer_;
+
+  // Maximum value of `pending_insert_bytes_` at which new requests are read.
+  const int64_t max_read_ahead_bytes_;
+
+  // If true then chunks are inserted with `ChunkStore::InsertDeduplicated`.
+  const bool deduplicate_chunks_;
+
+  // Size of the requests read since the last item was passed to a table. Only
+  // accessed from `OnReadDone`.
+  int64_t unattributed_bytes_ = 0;
+
+  // Segments of chunks sent through shared memory. Only accessed from
+  // `OnReadDone`.
+  internal::SharedMemorySegments segments_;
+
+  // Buffer for the current read, allocated on an arena which is handed over to
+  // the chunk store if the request holds a chunk. Only accessed by `OnReadDone`
+  // (or before the next read is started).
+  internal::ArenaInsertStreamRequest request_;
+
+  // Chunks that can be referenced by the items of the stream. Only accessed
+  // from `OnReadDone` and `OnDone`.
+  internal::StreamChunks chunks_;
+
+  // Index of `chunks_` by writer column, used to expand assembled
+  // trajectories. Only accessed from `OnReadDone`.
+  internal::ChunkColumnIndex chunk_index_;
+
+  absl::Mutex mu_;
+
+  // Confirmations waiting to be written. The front is being written iff
+  // `writing_`.
+  std::deque<InsertStreamResponse> responses_ ABSL_GUARDED_BY(mu_);
+
+  // Number of items passed to a table but not yet inserted.
+  int num_pending_inserts_ ABSL_GUARDED_BY(mu_) = 0;
+
+  // Size of the requests read for the items passed to a table but not yet
+  // inserted.
+  int64_t pending_insert_bytes_ ABSL_GUARDED_BY(mu_) = 0;
+
+  // Orders the confirmations of items inserted into different tables.
+  internal::InsertConfirmations confirmations_ ABSL_GUARDED_BY(mu_);
+
+  bool reading_ ABSL_GUARDED_BY(mu_) = false;
+  bool writing_ ABSL_GUARDED_BY(mu_) = false;
+
+  // Set while `OnReadDone` is processing a request.
+  bool handling_read_ ABSL_GUARDED_BY(mu_) = false;
+
+  // Set when the client has closed its side of the stream.
+  bool reads_done_ ABSL_GUARDED_BY(mu_) = false;
+
+  // Set once `Finish` has been scheduled.
+  bool finished_ ABSL_GUARDED_BY(mu_) = false;
+
+  // First error encountered by the stream.
+  grpc::Status status_ ABSL_GUARDED_BY(mu_);
+};
+
+// Returns the wire encoding of a response which consists of the fields of
+// `header` (which must not have the chunk field set) and the chunk field
+// `chunk_field_number` set to the encoded chunk `serialized` (see
+// `ChunkStore::Chunk::PinSerializedData`). Only the (small) header is
+// serialized. The data is referenced from `serialized` which is kept alive
+// until gRPC no longer needs the buffer.
+grpc::ByteBuffer EncodeResponseWithChunk(
+    const google::protobuf::MessageLite& header, int chunk_field_number,
+    std::shared_ptr<const std::string> serialized) {
+  using ::google::protobuf::internal::WireFormatLite;
+  using ::google::protobuf::io::CodedOutputStream;
+
+  absl::string_view data = *serialized;
+
+  // The tag and length of `data` are at most 5 bytes each.
+  std::string prefix = header.SerializeAsString();
+  uint8_t field_header[10];
+  uint8_t* end = CodedOutputStream::WriteTagToArray(
+      WireFormatLite::MakeTag(chunk_field_number,
+                              WireFormatLite::WIRETYPE_LENGTH_DELIMITED),
+      field_header);
+  end = CodedOutputStream::WriteVarint32ToArray(data.size(), end);
+  prefix.append(reinterpret_cast<const char*>(field_header),
+                end - field_header);
+
+  grpc::Slice slices[] = {
+      grpc::Slice(prefix),
+      grpc::Slice(
+          const_cast<char*>(data.data()), data.size(),
+          [](void* serialized) {
+            delete static_cast<std::shared_ptr<const std::string>*>(
+                serialized);
+          },
+          new std::shared_ptr<const std::string>(std::move(serialized))),
+  };
+  return grpc::ByteBuffer(slices, 2);
+}
+
+// Maximum number of bytes of chunk data, and number of batches, which a
+// `SampleStream` samples ahead of the batch being written. A batch is always
+// sampled when none are waiting to be written.
+constexpr int64_t kSampleStreamMaxLookAheadBytes = 32 * 1024 * 1024;
+constexpr size_t kSampleStreamMaxLookAheadBatches = 2;
+
+// Reactor of `SampleStream`.
+//
+// The reactor reads a request and then samples and writes its samples back to
+// the client (one chunk per message). The next batch is sampled from the table
+// while the previous one is being written, so selector work and rate limiter
+// waits overlap with the network sends, for as long as the batches waiting to
+// be written stay within `kSampleStreamMaxLookAheadBytes` and
+// `kSampleStreamMaxLookAheadBatches`. At most one sample and one write are in
+// flight at any time. The next request is only read once all the samples of
+// the current one have been written.
+//
+// As in `InsertStreamReactor` the operations to start are decided while
+// holding `mu_` and started once it has been released. `Finish` is only
+// called once neither a sample nor a write is in flight.
+//
+// If the first request names a sample group then the batches are taken from
+// the group (see `SampleGroup`) rather than sampled from the table directly.
+class SampleStreamReactor
+    : public grpc::ServerBidiReactor<grpc::ByteBuffer, grpc::ByteBuffer> {
+ public:
+  SampleStreamReactor(grpc::CallbackServerContext* context,
+                      const TableMap* tables,
+                      SampleGroupRegistry* sample_groups,
+                      internal::RpcLatencyHistograms* latency,
+                      internal::WorkloadRecorder* recorder)
+      : context_(context),
+        tables_(tables),
+        sample_groups_(sample_groups),
+        latency_(latency),
+        recorder_(recorder),
+        stream_id_(recorder->NewStreamId()) {
+    StartRead(&request_buffer_);
+  }
+
+  void OnReadDone(bool ok) override {
+    if (!ok) {
+      if (first_request_) {
+        Finish(Internal("Could not read initial request"));
+      } else {
+        Finish(grpc::Status::OK);
+      }
+      return;
+    }
+
+    request_.Clear();
+    auto status = grpc::SerializationTraits<SampleStreamRequest>::Deserialize(
+        &request_buffer_, &request_);
+    if (!status.ok()) {
+      Finish(std::move(status));
+      return;
+    }
+
+    bool join_group = false;
+    if (first_request_) {
+      first_request_ = false;
+      join_group = !request_.sample_group().id().empty();
+      timeout_ = absl::Milliseconds(
+          request_.has_rate_limiter_timeout()
+              ? request_.rate_limiter_timeout().milliseconds()
+              : -1);
+      if (timeout_ < absl::ZeroDuration()) timeout_ = absl::InfiniteDuration();
+
+      if (request_.max_cached_chunks() < 0) {
+        Finish(grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                            "`max_cached_chunks` must be >= 0."));
+        return;
+      }
+      chunk_cache_ = absl::make_unique<internal::LruCache<uint64_t, bool>>(
+          request_.max_cached_chunks());
+
+      if (request_.mixture_size() > 0) {
+        if (join_group) {
+          Finish(grpc::Status(
+              grpc::StatusCode::INVALID_ARGUMENT,
+              "`mixture` and `sample_group` must not both be set."));
+          return;
+        }
+        for (const auto& component : request_.mixture()) {
+          if (!std::isfinite(component.weight()) || component.weight() < 0) {
+            Finish(grpc::Status(
+                grpc::StatusCode::INVALID_ARGUMENT,
+                absl::StrCat("Weight of table ", component.table(),
+                             " in `mixture` must be >= 0 but got ",
+                             component.weight(), ".")));
+            return;
+          }
+          Table* table = TableByName(*tables_, component.table());
+          if (table == nullptr) {
+            Finish(TableNotFound(component.table()));
+            return;
+          }
+          mixture_.emplace_back(table, component.weight());
+          mixture_weight_ += component.weight();
+        }
+        if (mixture_weight_ <= 0) {
+          Finish(grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                              "At least one weight of `mixture` must be > 0."));
+          return;
+        }
+      }
+    }
+
+    if (request_.num_samples() <= 0) {
+      Finish(grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                          "`num_samples` must be > 0."));
+      return;
+    }
+    if (request_.flexible_batch_size() <= 0 &&
+        request_.flexible_batch_size() != Sampler::kAutoSelectValue) {
+      Finish(grpc::Status(
+          grpc::StatusCode::INVALID_ARGUMENT,
+          absl::StrCat("`flexible_batch_size` must be > 0 or ",
+                       Sampler::kAutoSelectValue, " (for auto tuning).")));
+      return;
+    }
+    // The first table of a mixture provides the default flexible batch size.
+    table_ = mixture_.empty() ? TableByName(*tables_, request_.table())
+                              : mixture_.front().first;
+    if (table_ == nullptr) {
+      Finish(TableNotFound(request_.table()));
+      return;
+    }
+    if (join_group) {
+      if (auto status =
+              sample_groups_->Join(table_, request_.sample_group(), &group_);
+          !status.ok()) {
+        Finish(ToGrpcStatus(status));
+        return;
+      }
+      group_rank_ = request_.sample_group().rank();
+    } else if (group_ != nullptr && group_->table() != table_) {
+      Finish(grpc::Status(
+          grpc::StatusCode::INVALID_ARGUMENT,
+          absl::StrCat("Streams in a sample group must only sample from the "
+                       "table of the group (",
+                       group_->table()->name(), ") but got ",
+                       request_.table(), ".")));
+      return;
+    }
+
+    recorder_->RecordSample(stream_id_, request_);
+    mutate_ = request_.priority_updates_size() > 0 ||
+              request_.priority_deletes_size() > 0;
+    Actions actions;
+    {
+      absl::MutexLock lock(&mu_);
+      count_ = 0;
+      actions = NextActionsLocked();
+    }
+    Run(std::move(actions));
+  }
+
+  void OnWriteDone(bool ok) override {
+    response_buffer_.Clear();
+    if (!ok) {
+      OnWriteFailed(Internal("Failed to write to Sample stream."));
+      return;
+    }
+
+    if (++next_chunk_ == samples_[next_sample_].chunks.size()) {
+      next_chunk_ = 0;
+      next_sample_++;
+    }
+    WriteNext();
+  }
+
+  void OnDone() override { delete this; }
+
+ private:
+  // Operations to start once `mu_` has been released.
+  struct Actions {
+    // Start writing `samples_`.
+    bool write = false;
+    // If positive then a batch of at most this many samples is sampled.
+    int32_t sample = 0;
+    bool read = false;
+    bool finish = false;
+    grpc::Status status;
+  };
+
+  // A sampled batch waiting to be written and the bytes of chunk data it
+  // references.
+  struct SampledBatch {
+    std::vector<Table::SampledItem> samples;
+    int64_t bytes = 0;
+  };
+
+  Actions NextActionsLocked() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    Actions actions;
+    if (!status_.ok()) {
+      if (!sampling_ && !writing_) {
+        actions.finish = true;
+        actions.status = status_;
+      }
+      return actions;
+    }
+
+    // Batches sampled ahead are dropped once the call has been cancelled.
+    const bool cancelled = context_->IsCancelled();
+    if (cancelled) {
+      ready_.clear();
+      ready_bytes_ = 0;
+    }
+
+    if (!writing_ && !ready_.empty()) {
+      samples_ = std::move(ready_.front().samples);
+      ready_bytes_ -= ready_.front().bytes;
+      ready_.pop_front();
+      next_sample_ = 0;
+      next_chunk_ = 0;
+      writing_ = true;
+      actions.write = true;
+    }
+
+    if (!sampling_ && !cancelled && count_ < request_.num_samples() &&
+        ready_.size() < kSampleStreamMaxLookAheadBatches &&
+        ready_bytes_ < kSampleStreamMaxLookAheadBytes) {
+      sampling_ = true;
+      actions.sample = std::min<int32_t>(
+          request_.flexible_batch_size() == Sampler::kAutoSelectValue
+              ? table_->DefaultFlexibleBatchSize()
+              : request_.flexible_batch_size(),
+          request_.num_samples() - count_);
+    }
+
+    if (!sampling_ && !writing_ && ready_.empty() &&
+        (cancelled || count_ == request_.num_samples())) {
+      actions.read = true;
+    }
+    return actions;
+  }
+
+  // A write may complete (and start further operations) as soon as it has been
+  // started, and the reactor may be deleted once `Finish` has been called, so
+  // the reactor must not be accessed after either call. A sample, on the other
+  // hand, prevents the reactor from finishing until its callback has run.
+  void Run(Actions actions) {
+    if (actions.sample > 0) {
+      SampleNextBatch(actions.sample);
+    }
+    if (actions.write) {
+      WriteNext();
+    } else if (actions.read) {
+      StartRead(&request_buffer_);
+    } else if (actions.finish) {
+      Finish(std::move(actions.status));
+    }
+  }
+
+  void MaybeSetErrorLocked(grpc::Status status)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    if (status_.ok()) status_ = std::move(status);
+  }
+
+  // Called when the writing of `samples_` has failed.
+  void OnWriteFailed(grpc::Status status) {
+    Actions actions;
+    {
+      absl::MutexLock lock(&mu_);
+      writing_ = false;
+      MaybeSetErrorLocked(std::move(status));
+      actions = NextActionsLocked();
+    }
+    Run(std::move(actions));
+  }
+
+  // Samples a batch of at most `max_batch_size` items for the current request
+  // and passes it to `OnSampleDone`.
+  void SampleNextBatch(int32_t max_batch_size) {
+    // The callback may be invoked before the call returns so the reactor must
+    // not be accessed after the call.
+    auto callback = [this, start = internal::AtomicLatencyHistogram::Start()](
+                        absl::Status status,
+                        std::vector<Table::SampledItem> samples) {
+      latency_->sample_stream_batch.Stop(start);
+      OnSampleDone(std::move(status), std::move(samples));
+    };
+    if (mutate_) {
+      // The mutations are piggybacked on the first sample of the request.
+      mutate_ = false;
+      std::vector<KeyWithPriority> updates(request_.priority_updates().begin(),
+                                           request_.priority_updates().end());
+      if (!mixture_.empty()) {
+        // The keys could belong to any of the tables.
+        for (const auto& [table, weight] : mixture_) {
+          if (auto status =
+                  table->MutateItems(updates, request_.priority_deletes());
+              !status.ok()) {
+            OnSampleDone(std::move(status), {});
+            return;
+          }
+        }
+      } else if (group_ != nullptr) {
+        // The batches of a group are not sampled by a single stream so the
+        // mutations can not share the lock acquisition of the sample.
+        if (auto status =
+                table_->MutateItems(updates, request_.priority_deletes());
+            !status.ok()) {
+          OnSampleDone(std::move(status), {});
+          return;
+        }
+      } else {
+        table_->MutateAndSampleFlexibleBatchAsync(
+            updates, request_.priority_deletes(), max_batch_size,
+            std::move(callback), timeout_);
+        return;
+      }
+    }
+    if (!mixture_.empty()) {
+      SampleMixture(max_batch_size, std::move(callback));
+    } else if (group_ != nullptr) {
+      group_->Next(group_rank_, max_batch_size, timeout_, std::move(callback));
+    } else {
+      table_->SampleFlexibleBatchAsync(max_batch_size, std::move(callback),
+                                       timeout_);
+    }
+  }
+
+  // Draws the table of each of the `batch_size` items of a batch from
+  // `mixture_` and samples the items table by table. `done` is invoked with the
+  // shuffled batch once all tables have returned their items.
+  void SampleMixture(int32_t batch_size, Table::SampleCallback done) {
+    mixture_counts_.assign(mixture_.size(), 0);
+    for (int32_t i = 0; i < batch_size; i++) {
+      // Rounding errors could result in `target` not being covered by any
+      // table in which case the last table with a positive weight is used.
+      double target = absl::Uniform<double>(bit_gen_, 0, mixture_weight_);
+      size_t index = 0;
+      for (size_t j = 0; j < mixture_.size(); j++) {
+        if (mixture_[j].second == 0) continue;
+        index = j;
+        if (target < mixture_[j].second) break;
+        target -= mixture_[j].second;
+      }
+      mixture_counts_[index]++;
+    }
+    mixture_samples_.clear();
+    mixture_done_ = std::move(done);
+    SampleMixtureFrom(0);
+  }
+
+  // Samples the items of the first table of the mixture, starting at `index`,
+  // which has been drawn for the batch.
+  void SampleMixtureFrom(size_t index) {
+    while (index < mixture_.size() && mixture_counts_[index] == 0) index++;
+    if (index == mixture_.size()) {
+      std::shuffle(mixture_samples_.begin(), mixture_samples_.end(), bit_gen_);
+      auto done = std::move(mixture_done_);
+      done(absl::OkStatus(), std::move(mixture_samples_));
+      return;
+    }
+
+    // The callback may be invoked before the call returns so the reactor must
+    // not be accessed after the call.
+    mixture_[index].first->SampleFlexibleBatchAsync(
+        mixture_counts_[index],
+        [this, index](absl::Status status,
+                      std::vector<Table::SampledItem> samples) {
+          if (!status.ok()) {
+            auto done = std::move(mixture_done_);
+            done(std::move(status), {});
+            return;
+          }
+          std::move(samples.begin(), samples.end(),
+                    std::back_inserter(mixture_samples_));
+          SampleMixtureFrom(index + 1);
+        },
+        timeout_);
+  }
+
+  void OnSampleDone(absl::Status status,
+                    std::vector<Table::SampledItem> samples) {
+    Actions actions;
+    {
+      absl::MutexLock lock(&mu_);
+      sampling_ = false;
+      if (!status.ok()) {
+        MaybeSetErrorLocked(ToGrpcStatus(status));
+      } else {
+        // Batches of a group can be sampled by another rank with a larger
+        // batch size so drop the samples beyond the end of the request.
+        const int64_t remaining = request_.num_samples() - count_;
+        if (samples.size() > remaining) {
+          samples.erase(samples.begin() + remaining, samples.end());
+        }
+        count_ += samples.size();
+
+        SampledBatch batch;
+        for (const auto& sample : samples) {
+          for (const auto& chunk : sample.chunks) {
+            batch.bytes += chunk->DataByteSizeLong();
+          }
+        }
+        batch.samples = std::move(samples);
+        ready_bytes_ += batch.bytes;
+        ready_.push_back(std::move(batch));
+      }
+      actions = NextActionsLocked();
+    }
+    Run(std::move(actions));
+  }
+
+  // Writes the next chunk of `samples_` or, if all of them have been written,
+  // moves on to the next batch.
+  void WriteNext() {
+    if (next_sample_ == samples_.size()) {
+      samples_.clear();
+      Actions actions;
+      {
+        absl::MutexLock lock(&mu_);
+        writing_ = false;
+        actions = NextActionsLocked();
+      }
+      Run(std::move(actions));
+      return;
+    }
+
+    internal::ScopedLatencyTimer timer(&latency_->sample_stream_response);
+    auto& sample = samples_[next_sample_];
+    SampleStreamResponse header;
+    header.set_end_of_sequence(next_chunk_ + 1 == sample.chunks.size());
+
+    // Attach the info to the first message. The item must be trimmed before
+    // the info is attached since trimming rewrites its slices.
+    if (next_chunk_ == 0) {
+      trimmed_.clear();
+      if (request_.trim_chunks()) {
+        if (auto status = internal::TrimSampledChunks(&sample, &trimmed_);
+            !status.ok()) {
+          OnWriteFailed(ToGrpcStatus(status));
+          return;
+        }
+      }
+      *header.mutable_info()->mutable_item() = std::move(sample.item);
+      header.mutable_info()->set_probability(sample.probability);
+      header.mutable_info()->set_table_size(sample.table_size);
+    }
+
+    // Chunks which the client still holds are sent as just the key. Otherwise
+    // a pin of the encoded chunk is handed over to the buffer which releases
+    // it once it has been sent.
+    auto& chunk = sample.chunks[next_chunk_];
+    std::shared_ptr<const ChunkData> trimmed =
+        trimmed_.empty() ? nullptr : std::move(trimmed_[next_chunk_]);
+    const uint64_t chunk_key =
+        trimmed != nullptr ? trimmed->chunk_key() : chunk->key();
+    if (chunk_cache_->Get(chunk_key) != nullptr) {
+      header.set_chunk_cached(true);
+      header.mutable_data()->set_chunk_key(chunk_key);
+      grpc::Slice slice(header.SerializeAsString());
+      response_buffer_ = grpc::ByteBuffer(&slice, 1);
+    } else if (trimmed != nullptr) {
+      chunk_cache_->Put(chunk_key, true);
+      response_buffer_ = EncodeResponseWithChunk(
+          header, SampleStreamResponse::kDataFieldNumber,
+          std::make_shared<const std::string>(trimmed->SerializeAsString()));
+    } else {
+      std::shared_ptr<const std::string> serialized;
+      if (auto status = chunk->PinSerializedData(&serialized); !status.ok()) {
+        OnWriteFailed(ToGrpcStatus(status));
+        return;
+      }
+      chunk_cache_->Put(chunk->key(), true);
+      response_buffer_ = EncodeResponseWithChunk(
+          header, SampleStreamResponse::kDataFieldNumber,
+          std::move(serialized));
+    }
+    chunk = nullptr;
+
+    const bool last_of_batch = next_sample_ + 1 == samples_.size() &&
+                               next_chunk_ + 1 == sample.chunks.size();
+    StartWrite(&response_buffer_,
+               SampleStreamWriteOptions(response_buffer_.Length(),
+                                        last_of_batch));
+  }
+
+  grpc::CallbackServerContext* context_;
+  const TableMap* tables_;
+
+  // Sample groups of the service. Owned by the service.
+  SampleGroupRegistry* const sample_groups_;
+
+  // Latencies reported by `ServerInfo`. Owned by the service.
+  internal::RpcLatencyHistograms* const latency_;
+
+  // Records the requests of the stream. Owned by the service.
+  internal::WorkloadRecorder* const recorder_;
+  const uint64_t stream_id_;
+
+  grpc::ByteBuffer request_buffer_;
+  grpc::ByteBuffer response_buffer_;
+
+  // The most recently read request.
+  SampleStreamRequest request_;
+
+  // The rate limiter timeout and chunk cache capacity are set by the first
+  // request of the stream.
+  bool first_request_ = true;
+  absl::Duration timeout_;
+
+  // Keys of the chunks held by the cache of the client.
+  std::unique_ptr<internal::LruCache<uint64_t, bool>> chunk_cache_;
+
+  // Table of the current request.
+  Table* table_ = nullptr;
+
+  absl::Mutex mu_;
+
+  // Number of samples of the current request which have been sampled.
+  int64_t count_ ABSL_GUARDED_BY(mu_) = 0;
+
+  // Whether a batch is being sampled and whether `samples_` is being written.
+  bool sampling_ ABSL_GUARDED_BY(mu_) = false;
+  bool writing_ ABSL_GUARDED_BY(mu_) = false;
+
+  // Batches which have been sampled ahead of `samples_` and the sum of their
+  // bytes.
+  std::deque<SampledBatch> ready_ ABSL_GUARDED_BY(mu_);
+  int64_t ready_bytes_ ABSL_GUARDED_BY(mu_) = 0;
+
+  // First error encountered by a sample or a write. The call is finished with
+  // it once no operation is in flight.
+  grpc::Status status_ ABSL_GUARDED_BY(mu_);
+
+  // True until the priority mutations of the current request have been
+  // applied.
+  bool mutate_ = false;
+
+  // Tables of the mixture set by the first request and their weights. Empty
+  // unless the stream samples from a mixture. See `SampleMixture`.
+  std::vector<std::pair<Table*, double>> mixture_;
+  double mixture_weight_ = 0;
+  absl::BitGen bit_gen_;
+
+  // State of the mixture batch being sampled: the number of items drawn from
+  // each table, the items sampled so far and the callback of the batch.
+  std::vector<int32_t> mixture_counts_;
+  std::vector<Table::SampledItem> mixture_samples_;
+  Table::SampleCallback mixture_done_;
+
+  // Group joined by the first request and the rank of the stream within it.
+  // Null if the stream does not belong to a group.
+  std::shared_ptr<SampleGroup> group_;
+  int group_rank_ = 0;
+
+  // Batch currently being written and the position of the next chunk to write.
+  // Only accessed by the write in flight.
+  std::vector<Table::SampledItem> samples_;
+  size_t next_sample_ = 0;
+  size_t next_chunk_ = 0;
+
+  // Trimmed chunks of the sample being written, aligned with its chunks (see
+  // `internal::TrimSampledChunks`). Empty unless `request_.trim_chunks()`.
+  std::vector<std::shared_ptr<const ChunkData>> trimmed_;
+};
+
+// Reactor of `InitializeConnection`. See `ReverbServiceImpl` for details of
+// the protocol.
+class InitializeConnectionReactor
+    : public grpc::ServerBidiReactor<InitializeConnectionRequest,
+                                     InitializeConnectionResponse> {
+ public:
+  explicit InitializeConnectionReactor(const TableMap* tables)
+      : tables_(tables) {
+    StartRead(&request_);
+  }
+
+  void OnReadDone(bool ok) override {
+    if (!ok) {
+      Finish(Internal("Failed to read from stream."));
+      return;
+    }
+
+    // The second request confirms that the client has taken ownership.
+    if (ptr_ != nullptr) {
+      if (!request_.ownership_transferred()) {
+        Finish(Internal("Received unexpected request"));
+      } else {
+        Finish(grpc::Status::OK);
+      }
+      return;
+    }
+
+    if (!request_.shared_memory_name().empty()) {
+      internal::NegotiateSharedMemory(request_, &response_);
+      StartWriteAndFinish(&response_, grpc::WriteOptions(), grpc::Status::OK);
+      return;
+    }
+
+    if (request_.pid() != getpid()) {
+      // Respond without populating the address field.
+      response_.set_address(0);
+      StartWriteAndFinish(&response_, grpc::WriteOptions(), grpc::Status::OK);
+      return;
+    }
+
+    auto it = tables_->find(request_.table_name());
+    if (it == tables_->end()) {
+      Finish(TableNotFound(request_.table_name()));
+      return;
+    }
+
+    // Allocate a new shared pointer on the heap and transmit its memory
+    // address. The client copies the shared_ptr so the reactor always deletes
+    // the heap allocated object in `OnDone`.
+    ptr_ = new std::shared_ptr<Table>(it->second);
+    response_.set_address(reinterpret_cast<int64_t>(ptr_));
+    StartWrite(&response_);
+  }
+
+  void OnWriteDone(bool ok) override {
+    if (!ok) {
+      Finish(Internal("Failed to write to stream."));
+      return;
+    }
+
+    // Wait for the client to confirm ownership transfer.
+    request_.Clear();
+    StartRead(&request_);
+  }
+
+  void OnDone() override {
+    delete ptr_;
+    delete this;
+  }
+
+ private:
+  const TableMap* tables_;
+  InitializeConnectionRequest request_;
+  InitializeConnectionResponse response_;
+  std::shared_ptr<Table>* ptr_ = nullptr;
+};
+
+// Default of `ExportTableRequest.max_items_per_response`.
+constexpr int kDefaultExportItemsPerResponse = 128;
+
+// Reactor of `ExportTable`.
+//
+// All the work of the stream (taking the snapshot, materializing the items and
+// pinning the chunks) runs on the export thread of the service rather than on
+// the callback executor which serves the inserts and samples. The next
+// response is only prepared once the previous one has been written, so a
+// stream holds at most one response and the export proceeds at the pace of
+// the client.
+//
+// The chunks referenced by the snapshot are released as soon as the last page
+// referencing them has been sent, so the memory held by the stream shrinks as
+// the export progresses.
+class ExportTableReactor : public grpc::ServerWriteReactor<grpc::ByteBuffer> {
+ public:
+  ExportTableReactor(grpc::CallbackServerContext* context, Table* table,
+                     int max_items_per_response, internal::ThreadPool* pool)
+      : context_(context),
+        table_(table),
+        max_items_per_response_(max_items_per_response),
+        pool_(pool) {
+    pool_->Schedule([this] { TakeSnapshot(); });
+  }
+
+  void OnWriteDone(bool ok) override {
+    if (!ok) {
+      Finish(Internal("Failed to write to stream."));
+      return;
+    }
+    if (next_item_ == snapshot_.size() && pending_chunks_.empty()) {
+      Finish(grpc::Status::OK);
+      return;
+    }
+    pool_->Schedule([this] { WriteNext(); });
+  }
+
+  void OnDone() override { delete this; }
+
+ private:
+  void TakeSnapshot() {
+    snapshot_ = table_->SnapshotItems();
+    for (size_t i = 0; i < snapshot_.size(); ++i) {
+      for (const auto& chunk : snapshot_[i].second.data->chunks) {
+        last_use_[chunk->key()] = i;
+      }
+    }
+    WriteNext();
+  }
+
+  // Starts the write of the next response. This must be the last thing done
+  // by the caller as the reactor may be deleted as soon as the write (or
+  // `Finish`) has been started.
+  void WriteNext() {
+    if (context_->IsCancelled()) {
+      Finish(grpc::Status::CANCELLED);
+      return;
+    }
+
+    ExportTableResponse header;
+    if (first_response_) {
+      first_response_ = false;
+      header.set_snapshot_size(snapshot_.size());
+    }
+
+    // The chunks of the page which have not been sent yet are sent first, one
+    // per response.
+    if (!page_prepared_) {
+      page_end_ = std::min(snapshot_.size(),
+                           next_item_ + max_items_per_response_);
+      for (size_t i = next_item_; i < page_end_; ++i) {
+        for (const auto& chunk : snapshot_[i].second.data->chunks) {
+          if (sent_chunks_.insert(chunk->key()).second) {
+            pending_chunks_.push_back(chunk);
+          }
+        }
+      }
+      page_prepared_ = true;
+    }
+    if (!pending_chunks_.empty()) {
+      std::shared_ptr<const std::string> serialized;
+      auto status = pending_chunks_.front()->PinSerializedData(&serialized);
+      pending_chunks_.pop_front();
+      if (!status.ok()) {
+        Finish(ToGrpcStatus(status));
+        return;
+      }
+      response_buffer_ = EncodeResponseWithChunk(
+          header, ExportTableResponse::kChunkFieldNumber,
+          std::move(serialized));
+      StartWrite(&response_buffer_);
+      return;
+    }
+
+    for (size_t i = next_item_; i < page_end_; ++i) {
+      auto& [key, stored] = snapshot_[i];
+      Table::Item item = table_->ToItem(key, stored);
+      *header.add_items() = std::move(item.item);
+      for (const auto& chunk : item.chunks) {
+        auto it = last_use_.find(chunk->key());
+        if (it != last_use_.end() && it->second == i) {
+          header.add_released_chunk_keys(chunk->key());
+          sent_chunks_.erase(chunk->key());
+          last_use_.erase(it);
+        }
+      }
+      stored.data = nullptr;
+    }
+    next_item_ = page_end_;
+    page_prepared_ = false;
+
+    grpc::Slice slice(header.SerializeAsString());
+    response_buffer_ = grpc::ByteBuffer(&slice, 1);
+    StartWrite(&response_buffer_);
+  }
+
+  grpc::CallbackServerContext* const context_;
+  Table* const table_;
+  const size_t max_items_per_response_;
+
+  // Runs the work of the stream. Owned by the service.
+  internal::ThreadPool* const pool_;
+
+  grpc::ByteBuffer response_buffer_;
+  bool first_response_ = true;
+
+  // Items of the table when the stream started, in insertion order.
+  std::vector<std::pair<Table::Key, Table::StoredItem>> snapshot_;
+
+  // Index in `snapshot_` of the last item which references each chunk that
+  // has not been released yet.
+  internal::flat_hash_map<uint64_t, size_t> last_use_;
+
+  // Keys of the chunks which have been sent and not released yet.
+  internal::flat_hash_set<uint64_t> sent_chunks_;
+
+  // Index of the first item of the next page and the end of that page, which
+  // is set once the chunks of the page have been added to `pending_chunks_`.
+  size_t next_item_ = 0;
+  size_t page_end_ = 0;
+  bool page_prepared_ = false;
+
+  // Chunks which must be sent before the next page.
+  std::deque<std::shared_ptr<ChunkStore::Chunk>> pending_chunks_;
+};
+
+}  // namespace
+
+ReverbCallbackServiceImpl::ReverbCallbackServiceImpl(
+    std::unique_ptr<ReverbServiceImpl> impl,
+    int64_t max_insert_read_ahead_bytes)
+    : impl_(std::move(impl)),
+      max_insert_read_ahead_bytes_(max_insert_read_ahead_bytes),
+      export_pool_("export", 1) {}
+
+absl::Status ReverbCallbackServiceImpl::Create(
+    std::vector<std::shared_ptr<Table>> tables,
+    std::shared_ptr<Checkpointer> checkpointer,
+    int64_t max_insert_read_ahead_bytes,
+    std::unique_ptr<ReverbCallbackServiceImpl>* service) {
+  if (max_insert_read_ahead_bytes <= 0) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("max_insert_read_ahead_bytes must be > 0 but got ",
+                     max_insert_read_ahead_bytes, "."));
+  }
+  std::unique_ptr<ReverbServiceImpl> impl;
+  REVERB_RETURN_IF_ERROR(ReverbServiceImpl::Create(
+      std::move(tables), std::move(checkpointer), &impl));
+  // Can't use make_unique because it can't see the private constructor.
+  *service = std::unique_ptr<ReverbCallbackServiceImpl>(
+      new ReverbCallbackServiceImpl(std::move(impl),
+                                    max_insert_read_ahead_bytes));
+  return absl::OkStatus();
+}
+
+absl::Status ReverbCallbackServiceImpl::Create(
+    std::vector<std::shared_ptr<Table>> tables,
+    std::shared_ptr<Checkpointer> checkpointer,
+    std::unique_ptr<ReverbCallbackServiceImpl>* service) {
+  return Create(std::move(tables), std::move(checkpointer),
+                kDefaultMaxInsertReadAheadBytes, service);
+}
+
+absl::Status ReverbCallbackServiceImpl::Create(
+    std::vector<std::shared_ptr<Table>> tables,
+    std::unique_ptr<ReverbCallbackServiceImpl>* service) {
+  return Create(std::move(tables), /*checkpointer=*/nullptr, service);
+}
+
+grpc::ServerUnaryReactor* ReverbCallbackServiceImpl::Checkpoint(
+    grpc::CallbackServerContext* context, const CheckpointRequest* request,
+    CheckpointResponse* response) {
+  // Checkpoints are rare so the (blocking) save is run inline rather than
+  // bringing up a dedicated thread. The unary handlers of `ReverbServiceImpl`
+  // do not use the context.
+  auto* reactor = context->DefaultReactor();
+  reactor->Finish(impl_->Checkpoint(/*context=*/nullptr, request, response));
+  return reactor;
+}
+
+grpc::ServerBidiReactor<InsertStreamRequest, InsertStreamResponse>*
+ReverbCallbackServiceImpl::InsertStream(grpc::CallbackServerContext* context) {
+  return new InsertStreamReactor(&impl_->chunk_store_, impl_->reclaimer_.get(),
+                                 &impl_->tables_, &impl_->rpc_latency_,
+                                 &impl_->recorder_,
+                                 IsLocalhostOrInProcess(context->peer()),
+                                 max_insert_read_ahead_bytes_,
+                                 deduplicate_chunks_.load());
+}
+
+grpc::ServerUnaryReactor* ReverbCallbackServiceImpl::MutatePriorities(
+    grpc::CallbackServerContext* context,
+    const MutatePrioritiesRequest* request,
+    MutatePrioritiesResponse* response) {
+  auto* reactor = context->DefaultReactor();
+  reactor->Finish(
+      impl_->MutatePriorities(/*context=*/nullptr, request, response));
+  return reactor;
+}
+
+grpc::ServerUnaryReactor* ReverbCallbackServiceImpl::Reset(
+    grpc::CallbackServerContext* context, const ResetRequest* request,
+    ResetResponse* response) {
+  auto* reactor = context->DefaultReactor();
+  reactor->Finish(impl_->Reset(/*context=*/nullptr, request, response));
+  return reactor;
+}
+
+grpc::ServerBidiReactor<grpc::ByteBuffer, grpc::ByteBuffer>*
+ReverbCallbackServiceImpl::SampleStream(grpc::CallbackServerContext* context) {
+  return new SampleStreamReactor(context, &impl_->tables_, &sample_groups_,
+                                 &impl_->rpc_latency_, &impl_->recorder_);
+}
+
+grpc::ServerUnaryReactor* ReverbCallbackServiceImpl::ServerInfo(
+    grpc::CallbackServerContext* context, const ServerInfoRequest* request,
+    ServerInfoResponse* response) {
+  auto* reactor = context->DefaultReactor();
+  reactor->Finish(impl_->ServerInfo(/*context=*/nullptr, request, response));
+  return reactor;
+}
+
+grpc::ServerBidiReactor<InitializeConnectionRequest,
+                        InitializeConnectionResponse>*
+ReverbCallbackServiceImpl::InitializeConnection(
+    grpc::CallbackServerContext* context) {
+  if (!IsLocalhostOrInProcess(context->peer())) {
+    return new FinishedReactor<InitializeConnectionRequest,
+                               InitializeConnectionResponse>(grpc::Status::OK);
+  }
+  return new InitializeConnectionReactor(&impl_->tables_);
+}
+
+grpc::ServerWriteReactor<grpc::ByteBuffer>*
+ReverbCallbackServiceImpl::ExportTable(grpc::CallbackServerContext* context,
+                                       const grpc::ByteBuffer* request_buffer) {
+  ExportTableRequest request;
+  grpc::ByteBuffer buffer(*request_buffer);
+  auto status = grpc::SerializationTraits<ExportTableRequest>::Deserialize(
+      &buffer, &request);
+  if (!status.ok()) {
+    return new FinishedWriteReactor<grpc::ByteBuffer>(std::move(status));
+  }
+  Table* table = TableByName(impl_->tables_, request.table());
+  if (table == nullptr) {
+    return new FinishedWriteReactor<grpc::ByteBuffer>(
+        TableNotFound(request.table()));
+  }
+  return new ExportTableReactor(context, table,
+                                request.max_items_per_response() > 0
+                                    ? request.max_items_per_response()
+                                    : kDefaultExportItemsPerResponse,
+                                &export_pool_);
+}
+
+internal::flat_hash_map<std::string, std::shared_ptr<Table>>
+ReverbCallbackServiceImpl::tables() const {
+  return impl_->tables();
+}
+
+void ReverbCallbackServiceImpl::Close() { impl_->Close(); }
+
+void ReverbCallbackServiceImpl::EnableChunkDeduplication() {
+  deduplicate_chunks_.store(true);
+}
+
+absl::Status ReverbCallbackServiceImpl::StartPeriodicCheckpoints(
+    absl::Duration interval) {
+  return impl_->StartPeriodicCheckpoints(interval);
+}
+
+absl::Status ReverbCallbackServiceImpl::StartRecording(
+    const std::string& path) {
+  return impl_->StartRecording(path);
+}
+
+absl::Status ReverbCallbackServiceImpl::StopRecording() {
+  return impl_->StopRecording();
+}
+
+ReverbServiceImpl* ReverbCallbackServiceImpl::sync_service() const {
+  return impl_.get();
+}
+
+std::string ReverbCallbackServiceImpl::DebugString() const {
+  return impl_->DebugString();
+}
+
+}  // namespace reverb
+}  // namespace deepmind
@@ -0,0 +1,193 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_REVERB_CALLBACK_SERVICE_IMPL_H_
+#define REVERB_CC_REVERB_CALLBACK_SERVICE_IMPL_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "grpcpp/grpcpp.h"
+#include "absl/status/status.h"
+#include "absl/time/time.h"
+#include "reverb/cc/checkpointing/interface.h"
+#include "reverb/cc/platform/hash_map.h"
+#include "reverb/cc/reverb_service.grpc.pb.h"
+#include "reverb/cc/reverb_service.pb.h"
+#include "reverb/cc/reverb_service_impl.h"
+#include "reverb/cc/sample_group.h"
+#include "reverb/cc/support/thread_pool.h"
+#include "reverb/cc/table.h"
+
+namespace deepmind {
+namespace reverb {
+
+namespace internal {
+
+// Every method uses the callback API and `SampleStream` and `ExportTable` use
+// the raw (`grpc::ByteBuffer`) variant of it.
+using ReverbCallbackServiceBase =
+    /* grpc_gen:: */ReverbService::WithCallbackMethod_Checkpoint<
+    /* grpc_gen:: */ReverbService::WithCallbackMethod_InsertStream<
+    /* grpc_gen:: */ReverbService::WithCallbackMethod_MutatePriorities<
+    /* grpc_gen:: */ReverbService::WithCallbackMethod_Reset<
+    /* grpc_gen:: */ReverbService::WithRawCallbackMethod_SampleStream<
+    /* grpc_gen:: */ReverbService::WithCallbackMethod_ServerInfo<
+    /* grpc_gen:: */ReverbService::WithCallbackMethod_InitializeConnection<
+    /* grpc_gen:: */ReverbService::WithRawCallbackMethod_ExportTable<
+    /* grpc_gen:: */ReverbService::Service>>>>>>>>;
+
+}  // namespace internal
+
+// Implements ReverbService using the gRPC callback API. See
+// reverb_service.proto for documentation.
+//
+// `ReverbServiceImpl` serves every open stream from its own thread (and insert
+// streams from two) for as long as the stream is open, so the number of
+// threads grows with the number of connected writers and samplers. This
+// implementation instead runs the handlers as reactions on the fixed size
+// callback executor of the gRPC server. The handlers never block: inserts and
+// samples are issued through `Table::InsertOrAssignAsync` and
+// `Table::SampleFlexibleBatchAsync`, so a stream that is waiting for the rate
+// limiter does not occupy a thread.
+//
+// Insert streams read at most `max_insert_read_ahead_bytes` (see `Create`) of
+// requests ahead of the inserts that have completed. Once the limit is reached
+// no more requests are read from the stream until one of the pending inserts
+// completes, which pushes back on the client through gRPC flow control.
+//
+// `SampleStream` is implemented as a raw method. The responses are assembled
+// from a small serialized header (the sample info) followed by the cached wire
+// encoding of the chunk (see `ChunkStore::Chunk::PinSerializedData`), so chunks
+// that are sampled repeatedly are never re-serialized and are sent without
+// being copied. `ExportTable` sends its chunks the same way. Its streams are
+// served by a single export thread owned by the service rather than by the
+// callback executor, so exports cannot starve the inserts and samples.
+//
+// The state (tables, chunk store and checkpointer) is owned by a
+// `ReverbServiceImpl` which is also responsible for the unary methods.
+class ReverbCallbackServiceImpl : public internal::ReverbCallbackServiceBase {
+ public:
+  // Default maximum size of the requests received on an insert stream whose
+  // items are waiting to be inserted before the stream stops reading new
+  // requests. The budget absorbs short stalls of the tables (e.g. on the rate
+  // limiter) without throttling the writers.
+  static constexpr int64_t kDefaultMaxInsertReadAheadBytes = 64 << 20;
+
+  // `max_insert_read_ahead_bytes` bounds the size of the requests (chunks and
+  // items) an insert stream reads ahead of the inserts that have completed. A
+  // stream always reads ahead by at least one item.
+  static absl::Status Create(
+      std::vector<std::shared_ptr<Table>> tables,
+      std::shared_ptr<Checkpointer> checkpointer,
+      int64_t max_insert_read_ahead_bytes,
+      std::unique_ptr<ReverbCallbackServiceImpl>* service);
+
+  static absl::Status Create(
+      std::vector<std::shared_ptr<Table>> tables,
+      std::shared_ptr<Checkpointer> checkpointer,
+      std::unique_ptr<ReverbCallbackServiceImpl>* service);
+
+  static absl::Status Create(
+      std::vector<std::shared_ptr<Table>> tables,
+      std::unique_ptr<ReverbCallbackServiceImpl>* service);
+
+  grpc::ServerUnaryReactor* Checkpoint(grpc::CallbackServerContext* context,
+                                       const CheckpointRequest* request,
+                                       CheckpointResponse* response) override;
+
+  grpc::ServerBidiReactor<InsertStreamRequest, InsertStreamResponse>*
+  InsertStream(grpc::CallbackServerContext* context) override;
+
+  grpc::ServerUnaryReactor* MutatePriorities(
+      grpc::CallbackServerContext* context,
+      const MutatePrioritiesRequest* request,
+      MutatePrioritiesResponse* response) override;
+
+  grpc::ServerUnaryReactor* Reset(grpc::CallbackServerContext* context,
+                                  const ResetRequest* request,
+                                  ResetResponse* response) override;
+
+  grpc::ServerBidiReactor<grpc::ByteBuffer, grpc::ByteBuffer>* SampleStream(
+      grpc::CallbackServerContext* context) override;
+
+  grpc::ServerUnaryReactor* ServerInfo(grpc::CallbackServerContext* context,
+                                       const ServerInfoRequest* request,
+                                       ServerInfoResponse* response) override;
+
+  grpc::ServerBidiReactor<InitializeConnectionRequest,
+                          InitializeConnectionResponse>*
+  InitializeConnection(grpc::CallbackServerContext* context) override;
+
+  grpc::ServerWriteReactor<grpc::ByteBuffer>* ExportTable(
+      grpc::CallbackServerContext* context,
+      const grpc::ByteBuffer* request) override;
+
+  // Gets a copy of the table lookup.
+  internal::flat_hash_map<std::string, std::shared_ptr<Table>> tables() const;
+
+  // Closes all tables and the chunk store.
+  void Close();
+
+  // Deduplicates the chunks received by the insert streams opened from now on
+  // by their content (see `ChunkStore::InsertDeduplicated`), so identical
+  // chunks sent by different writers (or under different keys) are only held
+  // once. The items inserted by the streams then refer to the shared chunks
+  // by the key of the chunk which was received first.
+  void EnableChunkDeduplication();
+
+  // See `ReverbServiceImpl::StartPeriodicCheckpoints`.
+  absl::Status StartPeriodicCheckpoints(absl::Duration interval);
+
+  // See `ReverbServiceImpl::StartRecording` and `StopRecording`.
+  absl::Status StartRecording(const std::string& path);
+  absl::Status StopRecording();
+
+  // The `ReverbServiceImpl` which owns the state of the service. It can be
+  // registered with a gRPC server in place of this service to serve the same
+  // tables with one thread per stream (see `ServerOptions`). Owned by this
+  // service.
+  ReverbServiceImpl* sync_service() const;
+
+  // Returns a summary string description.
+  std::string DebugString() const;
+
+ private:
+  ReverbCallbackServiceImpl(std::unique_ptr<ReverbServiceImpl> impl,
+                            int64_t max_insert_read_ahead_bytes);
+
+  // Owns the state of the service and implements the unary methods.
+  std::unique_ptr<ReverbServiceImpl> impl_;
+
+  // See `Create`.
+  const int64_t max_insert_read_ahead_bytes_;
+
+  // See `EnableChunkDeduplication`.
+  std::atomic<bool> deduplicate_chunks_{false};
+
+  // Groups joined by the sample streams (see `SampleGroupOptions`).
+  SampleGroupRegistry sample_groups_;
+
+  // Runs the work of the `ExportTable` streams. Declared last so that it is
+  // joined before the tables are destroyed.
+  internal::ThreadPool export_pool_;
+};
+
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_REVERB_CALLBACK_SERVICE_IMPL_H_
@@ -0,0 +1,812 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/reverb_callback_service_impl.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <memory>
+#include <vector>
+
+#include "grpcpp/grpcpp.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "reverb/cc/client.h"
+#include "reverb/cc/platform/status_macros.h"
+#include "reverb/cc/platform/status_matchers.h"
+#include "reverb/cc/platform/thread.h"
+#include "reverb/cc/reverb_service.grpc.pb.h"
+#include "reverb/cc/reverb_service.pb.h"
+#include "reverb/cc/schema.pb.h"
+#include "reverb/cc/selectors/fifo.h"
+#include "reverb/cc/selectors/uniform.h"
+#include "reverb/cc/support/grpc_util.h"
+#include "reverb/cc/support/shared_memory.h"
+#include "reverb/cc/testing/proto_test_util.h"
+
+namespace deepmind {
+namespace reverb {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::ElementsAreArray;
+using ::testing::Le;
+using ::testing::SizeIs;
+using ::testing::UnorderedElementsAre;
+
+int64_t nextId = 1;
+
+InsertStreamRequest MakeChunkRequest(int64_t key) {
+  InsertStreamRequest request;
+  request.mutable_chunk()->set_chunk_key(key);
+  return request;
+}
+
+InsertStreamRequest MakeItemRequest(const std::vector<int64_t>& chunk_keys,
+                                    const std::vector<int64_t>& keep_chunks,
+                                    bool send_confirmation = false) {
+  InsertStreamRequest request;
+  auto* item = request.mutable_item()->mutable_item();
+  item->set_key(nextId++);
+  item->set_table("dist");
+  item->set_priority(1);
+  auto* col = item->mutable_flat_trajectory()->add_columns();
+  for (auto chunk_key : chunk_keys) {
+    auto* slice = col->add_chunk_slices();
+    slice->set_chunk_key(chunk_key);
+    slice->set_length(1);
+  }
+  *request.mutable_item()->mutable_keep_chunk_keys() = {keep_chunks.begin(),
+                                                        keep_chunks.end()};
+  request.mutable_item()->set_send_confirmation(send_confirmation);
+  return request;
+}
+
+class ReverbCallbackServiceImplTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    std::vector<std::shared_ptr<Table>> tables;
+    tables.push_back(std::make_shared<Table>(
+        "dist", std::make_shared<UniformSelector>(),
+        std::make_shared<FifoSelector>(), 1000, 0, MakeRateLimiter()));
+    REVERB_CHECK_OK(ReverbCallbackServiceImpl::Create(
+        std::move(tables), /*checkpointer=*/nullptr,
+        max_insert_read_ahead_bytes(), &service_));
+    server_ =
+        grpc::ServerBuilder().RegisterService(service_.get()).BuildAndStart();
+    stub_ = /* grpc_gen:: */ReverbService::NewStub(
+        server_->InProcessChannel(grpc::ChannelArguments()));
+  }
+
+  void TearDown() override {
+    service_->Close();
+    server_->Shutdown();
+  }
+
+  grpc::Status Insert(const std::vector<InsertStreamRequest>& requests,
+                      std::vector<InsertStreamResponse>* responses = nullptr) {
+    grpc::ClientContext context;
+    auto stream = stub_->InsertStream(&context);
+    for (const auto& request : requests) {
+      if (!stream->Write(request)) break;
+    }
+    stream->WritesDone();
+    InsertStreamResponse response;
+    while (stream->Read(&response)) {
+      if (responses != nullptr) responses->push_back(response);
+    }
+    return stream->Finish();
+  }
+
+  Table* table() { return service_->tables()["dist"].get(); }
+
+  virtual int64_t max_insert_read_ahead_bytes() const {
+    return ReverbCallbackServiceImpl::kDefaultMaxInsertReadAheadBytes;
+  }
+
+  virtual std::shared_ptr<RateLimiter> MakeRateLimiter() const {
+    return std::make_shared<RateLimiter>(1.0, 1, -DBL_MAX, DBL_MAX);
+  }
+
+  std::unique_ptr<ReverbCallbackServiceImpl> service_;
+  std::unique_ptr<grpc::Server> server_;
+  std::unique_ptr</* grpc_gen:: */ReverbService::Stub> stub_;
+};
+
+std::vector<ExportTableResponse> ExportTable(
+    /* grpc_gen:: */ReverbService::Stub* stub, const std::string& table,
+    int max_items_per_response, grpc::Status* status) {
+  grpc::ClientContext context;
+  ExportTableRequest request;
+  request.set_table(table);
+  request.set_max_items_per_response(max_items_per_response);
+  auto reader = stub->ExportTable(&context, request);
+  std::vector<ExportTableResponse> responses;
+  ExportTableResponse response;
+  while (reader->Read(&response)) {
+    responses.push_back(response);
+  }
+  *status = reader->Finish();
+  return responses;
+}
+
+TEST_F(ReverbCallbackServiceImplTest, SampleAfterInsertWorks) {
+  REVERB_EXPECT_OK(FromGrpcStatus(
+      Insert({MakeChunkRequest(1), MakeChunkRequest(2),
+              MakeItemRequest({1, 2}, {})})));
+  EXPECT_EQ(table()->size(), 1);
+
+  grpc::ClientContext context;
+  auto stream = stub_->SampleStream(&context);
+  SampleStreamRequest request;
+  request.set_table("dist");
+  request.set_num_samples(3);
+  request.set_flexible_batch_size(-1);
+  ASSERT_TRUE(stream->Write(request));
+  stream->WritesDone();
+
+  std::vector<SampleStreamResponse> responses;
+  SampleStreamResponse response;
+  while (stream->Read(&response)) {
+    responses.push_back(response);
+  }
+  REVERB_EXPECT_OK(FromGrpcStatus(stream->Finish()));
+
+  // Every sample consists of two messages, one per chunk.
+  ASSERT_THAT(responses, SizeIs(6));
+  for (int i = 0; i < 3; i++) {
+    EXPECT_TRUE(responses[2 * i].has_info());
+    EXPECT_EQ(responses[2 * i].info().item().times_sampled(), i + 1);
+    EXPECT_EQ(responses[2 * i].data().chunk_key(), 1);
+    EXPECT_FALSE(responses[2 * i].end_of_sequence());
+    EXPECT_FALSE(responses[2 * i + 1].has_info());
+    EXPECT_EQ(responses[2 * i + 1].data().chunk_key(), 2);
+    EXPECT_TRUE(responses[2 * i + 1].end_of_sequence());
+  }
+}
+
+TEST_F(ReverbCallbackServiceImplTest, SampleTrimsChunksWhenRequested) {
+  // A chunk of 6 rows compressed in blocks of 2 rows and a second column which
+  // the item does not reference. The server never decodes the content.
+  InsertStreamRequest chunk = MakeChunkRequest(1);
+  *chunk.mutable_chunk()->mutable_sequence_range() =
+      testing::MakeSequenceRange(/*episode_id=*/1, 0, 5);
+  auto* tensor = chunk.mutable_chunk()->mutable_data()->add_tensors();
+  tensor->mutable_tensor_shape()->add_dim()->set_size(6);
+  tensor->set_tensor_content("aaabbbccc");
+  auto* blocks = chunk.mutable_chunk()->add_compressed_blocks();
+  blocks->set_rows_per_block(2);
+  *blocks->mutable_block_ends() = {3, 6, 9};
+  *chunk.mutable_chunk()->mutable_data()->add_tensors() = *tensor;
+  *chunk.mutable_chunk()->add_compressed_blocks() = *blocks;
+
+  InsertStreamRequest item = MakeItemRequest({1}, {});
+  auto* slice = item.mutable_item()
+                    ->mutable_item()
+                    ->mutable_flat_trajectory()
+                    ->mutable_columns(0)
+                    ->mutable_chunk_slices(0);
+  slice->set_offset(2);
+  slice->set_length(2);
+  REVERB_EXPECT_OK(FromGrpcStatus(Insert({chunk, item})));
+
+  grpc::ClientContext context;
+  auto stream = stub_->SampleStream(&context);
+  SampleStreamRequest request;
+  request.set_table("dist");
+  request.set_num_samples(1);
+  request.set_flexible_batch_size(-1);
+  request.set_trim_chunks(true);
+  ASSERT_TRUE(stream->Write(request));
+  stream->WritesDone();
+
+  std::vector<SampleStreamResponse> responses;
+  SampleStreamResponse response;
+  while (stream->Read(&response)) {
+    responses.push_back(response);
+  }
+  REVERB_EXPECT_OK(FromGrpcStatus(stream->Finish()));
+
+  // Only the block holding rows 2-3 of the referenced column is sent.
+  ASSERT_THAT(responses, SizeIs(1));
+  const auto& data = responses[0].data();
+  EXPECT_NE(data.chunk_key(), 1);
+  ASSERT_EQ(data.data().tensors_size(), 1);
+  EXPECT_EQ(data.data().tensors(0).tensor_content(), "bbb");
+  EXPECT_EQ(data.data().tensors(0).tensor_shape().dim(0).size(), 2);
+  EXPECT_THAT(data.compressed_blocks(0).block_ends(), ElementsAreArray({3}));
+  EXPECT_THAT(
+      responses[0].info().item().flat_trajectory().columns(0).chunk_slices(0),
+      testing::EqualsProto(absl::StrCat("chunk_key: ", data.chunk_key(),
+                                        " offset: 0 length: 2")));
+}
+
+TEST_F(ReverbCallbackServiceImplTest, SampleOmitsChunksHeldByClientCache) {
+  InsertStreamRequest first_chunk = MakeChunkRequest(1);
+  first_chunk.mutable_chunk()->mutable_data()->add_tensors();
+  InsertStreamRequest second_chunk = MakeChunkRequest(2);
+  second_chunk.mutable_chunk()->mutable_data()->add_tensors();
+  REVERB_EXPECT_OK(FromGrpcStatus(
+      Insert({first_chunk, second_chunk, MakeItemRequest({1, 2}, {})})));
+
+  for (int max_cached_chunks : {1, 2}) {
+    grpc::ClientContext context;
+    auto stream = stub_->SampleStream(&context);
+    SampleStreamRequest request;
+    request.set_table("dist");
+    request.set_num_samples(3);
+    request.set_flexible_batch_size(-1);
+    request.set_max_cached_chunks(max_cached_chunks);
+    ASSERT_TRUE(stream->Write(request));
+    stream->WritesDone();
+
+    std::vector<SampleStreamResponse> responses;
+    SampleStreamResponse response;
+    while (stream->Read(&response)) {
+      responses.push_back(response);
+    }
+    REVERB_EXPECT_OK(FromGrpcStatus(stream->Finish()));
+
+    ASSERT_THAT(responses, SizeIs(6));
+    for (int i = 0; i < responses.size(); i++) {
+      EXPECT_EQ(responses[i].data().chunk_key(), i % 2 + 1);
+      EXPECT_EQ(responses[i].has_info(), i % 2 == 0);
+
+      // Both chunks fit in a cache of size 2 so they are only sent once. With
+      // a cache of size 1 every chunk evicts the other one.
+      const bool cached = max_cached_chunks == 2 && i >= 2;
+      EXPECT_EQ(responses[i].chunk_cached(), cached);
+      EXPECT_EQ(responses[i].data().has_data(), !cached);
+    }
+  }
+}
+
+TEST_F(ReverbCallbackServiceImplTest, SampledChunkMatchesInsertedChunk) {
+  InsertStreamRequest chunk_request = MakeChunkRequest(1);
+  auto* chunk = chunk_request.mutable_chunk();
+  chunk->mutable_sequence_range()->set_episode_id(5);
+  chunk->mutable_sequence_range()->set_end(9);
+  chunk->mutable_data()->add_tensors()->set_tensor_content(
+      std::string(1 << 20, 'x'));
+  chunk->set_delta_encoded(true);
+  REVERB_EXPECT_OK(FromGrpcStatus(
+      Insert({chunk_request, MakeItemRequest({1}, {})})));
+
+  // The same chunk is sent to several samplers.
+  for (int i = 0; i < 3; i++) {
+    grpc::ClientContext context;
+    auto stream = stub_->SampleStream(&context);
+    SampleStreamRequest request;
+    request.set_table("dist");
+    request.set_num_samples(1);
+    request.set_flexible_batch_size(1);
+    ASSERT_TRUE(stream->Write(request));
+    stream->WritesDone();
+
+    SampleStreamResponse response;
+    ASSERT_TRUE(stream->Read(&response));
+    EXPECT_THAT(response.data(), testing::EqualsProto(*chunk));
+    EXPECT_TRUE(response.end_of_sequence());
+    EXPECT_EQ(response.info().item().times_sampled(), i + 1);
+    EXPECT_EQ(response.info().table_size(), 1);
+    EXPECT_FALSE(stream->Read(&response));
+    REVERB_EXPECT_OK(FromGrpcStatus(stream->Finish()));
+  }
+}
+
+TEST_F(ReverbCallbackServiceImplTest, InsertStreamRespondsWithItemKeys) {
+  std::vector<InsertStreamRequest> requests = {MakeChunkRequest(1)};
+  std::vector<uint64_t> keys;
+  for (int i = 0; i < 20; i++) {
+    requests.push_back(MakeItemRequest({1}, {1}, /*send_confirmation=*/i != 5));
+    if (i != 5) keys.push_back(requests.back().item().item().key());
+  }
+
+  std::vector<InsertStreamResponse> responses;
+  REVERB_EXPECT_OK(FromGrpcStatus(Insert(requests, &responses)));
+  EXPECT_EQ(table()->size(), 20);
+
+  // Confirmations which are ready at the same time are batched.
+  std::vector<uint64_t> confirmed;
+  for (const auto& response : responses) {
+    confirmed.push_back(response.key());
+    confirmed.insert(confirmed.end(), response.keys().begin(),
+                     response.keys().end());
+  }
+  EXPECT_THAT(confirmed, ElementsAreArray(keys));
+  EXPECT_THAT(responses, SizeIs(Le(keys.size())));
+}
+
+TEST_F(ReverbCallbackServiceImplTest, InsertStreamKeepsUnreleasedChunks) {
+  auto released = [](std::vector<int64_t> chunk_keys,
+                     std::vector<uint64_t> released_keys) {
+    InsertStreamRequest request = MakeItemRequest(chunk_keys, {});
+    request.mutable_item()->set_keep_unreleased_chunks(true);
+    *request.mutable_item()->mutable_released_chunk_keys() = {
+        released_keys.begin(), released_keys.end()};
+    return request;
+  };
+
+  // The first chunk is kept until it is released by the third item.
+  REVERB_EXPECT_OK(FromGrpcStatus(Insert({
+      MakeChunkRequest(1),
+      released({1}, {}),
+      MakeChunkRequest(2),
+      released({1, 2}, {}),
+      released({2}, {1}),
+      released({2}, {}),
+  })));
+  EXPECT_EQ(table()->size(), 4);
+
+  EXPECT_EQ(Insert({MakeChunkRequest(1), released({1}, {1}), released({1}, {})})
+                .error_code(),
+            grpc::StatusCode::INTERNAL);
+}
+
+TEST_F(ReverbCallbackServiceImplTest, InsertStreamExpandsAssembledTrajectory) {
+  auto chunk = [](int64_t key, int32_t start, int32_t end) {
+    InsertStreamRequest request = MakeChunkRequest(key);
+    request.set_chunk_column(1);
+    *request.mutable_chunk()->mutable_sequence_range() =
+        testing::MakeSequenceRange(/*episode_id=*/7, start, end);
+    return request;
+  };
+  auto assembled = [](int32_t end_step, int32_t num_steps) {
+    InsertStreamRequest request = MakeItemRequest({}, {1, 2});
+    request.mutable_item()->mutable_item()->clear_flat_trajectory();
+    auto* trajectory = request.mutable_item()->mutable_assembled_trajectory();
+    trajectory->set_episode_id(7);
+    trajectory->set_end_step(end_step);
+    auto* column = trajectory->add_columns();
+    column->set_chunk_column(1);
+    column->set_num_steps(num_steps);
+    return request;
+  };
+
+  REVERB_EXPECT_OK(FromGrpcStatus(
+      Insert({chunk(1, 0, 1), chunk(2, 2, 3), assembled(2, 3)})));
+  auto items = table()->Copy();
+  ASSERT_THAT(items, SizeIs(1));
+  EXPECT_THAT(items[0].item.flat_trajectory(), testing::EqualsProto(R"pb(
+                columns {
+                  chunk_slices { chunk_key: 1 offset: 0 length: 2 }
+                  chunk_slices { chunk_key: 2 offset: 0 length: 1 }
+                }
+              )pb"));
+
+  // Steps which are not held by the stream are rejected.
+  EXPECT_EQ(Insert({chunk(1, 0, 1), assembled(2, 3)}).error_code(),
+            grpc::StatusCode::INVALID_ARGUMENT);
+}
+
+// Reads at most one item ahead of the completed inserts.
+class MinimalReadAheadTest : public ReverbCallbackServiceImplTest {
+ protected:
+  int64_t max_insert_read_ahead_bytes() const override { return 1; }
+};
+
+TEST_F(MinimalReadAheadTest, InsertStreamRespondsWithItemKeys) {
+  std::vector<InsertStreamRequest> requests;
+  std::vector<uint64_t> keys;
+  for (int i = 0; i < 20; i++) {
+    requests.push_back(MakeChunkRequest(i + 1));
+    requests.push_back(
+        MakeItemRequest({i + 1}, {i + 1}, /*send_confirmation=*/true));
+    keys.push_back(requests.back().item().item().key());
+  }
+
+  std::vector<InsertStreamResponse> responses;
+  REVERB_EXPECT_OK(FromGrpcStatus(Insert(requests, &responses)));
+  EXPECT_EQ(table()->size(), 20);
+
+  std::vector<uint64_t> confirmed;
+  for (const auto& response : responses) {
+    confirmed.push_back(response.key());
+    confirmed.insert(confirmed.end(), response.keys().begin(),
+                     response.keys().end());
+  }
+  EXPECT_THAT(confirmed, ElementsAreArray(keys));
+}
+
+// Paces the inserts once they run ahead of the samples.
+class PacedInsertTest : public ReverbCallbackServiceImplTest {
+ protected:
+  std::shared_ptr<RateLimiter> MakeRateLimiter() const override {
+    RateLimiter::PacingOptions pacing;
+    pacing.max_delay = absl::Milliseconds(50);
+    pacing.integral_gain = 0;
+    return std::make_shared<RateLimiter>(
+        /*samples_per_insert=*/1.0, /*min_size_to_sample=*/1,
+        /*min_diff=*/-10, /*max_diff=*/10, pacing);
+  }
+};
+
+TEST_F(PacedInsertTest, InsertStreamIsPaced) {
+  std::vector<InsertStreamRequest> requests = {MakeChunkRequest(1)};
+  for (int i = 0; i < 10; i++) {
+    requests.push_back(MakeItemRequest({1}, {1}));
+  }
+
+  // The items are inserted through the asynchronous calls of the table, which
+  // hold the items until their pacing slot rather than blocking. The interval
+  // between two inserts grows by 5ms with every insert beyond the middle of
+  // the range (see `RateLimiterTest.PacesInsertsWhichRunAheadOfSamples`).
+  const absl::Time start = absl::Now();
+  REVERB_EXPECT_OK(FromGrpcStatus(Insert(requests)));
+  EXPECT_GE(absl::Now() - start, absl::Milliseconds(150));
+  EXPECT_EQ(table()->size(), 10);
+}
+
+TEST(ReverbCallbackServiceImplCreateTest, RejectsNonPositiveReadAheadBytes) {
+  std::vector<std::shared_ptr<Table>> tables;
+  tables.push_back(std::make_shared<Table>(
+      "dist", std::make_shared<UniformSelector>(),
+      std::make_shared<FifoSelector>(), 1000, 0,
+      std::make_shared<RateLimiter>(1.0, 1, -DBL_MAX, DBL_MAX)));
+  std::unique_ptr<ReverbCallbackServiceImpl> service;
+  EXPECT_EQ(ReverbCallbackServiceImpl::Create(std::move(tables),
+                                              /*checkpointer=*/nullptr,
+                                              /*max_insert_read_ahead_bytes=*/0,
+                                              &service)
+                .code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+TEST_F(ReverbCallbackServiceImplTest, InsertItemWithMissingChunksFails) {
+  EXPECT_EQ(
+      Insert({MakeChunkRequest(1), MakeItemRequest({2}, {})}).error_code(),
+      grpc::StatusCode::INTERNAL);
+  EXPECT_EQ(table()->size(), 0);
+}
+
+TEST_F(ReverbCallbackServiceImplTest, InsertItemIntoMissingTableFails) {
+  auto request = MakeItemRequest({1}, {});
+  request.mutable_item()->mutable_item()->set_table("missing");
+  EXPECT_EQ(Insert({MakeChunkRequest(1), request}).error_code(),
+            grpc::StatusCode::NOT_FOUND);
+}
+
+TEST_F(ReverbCallbackServiceImplTest, InsertStreamReadsChunksFromSharedMemory) {
+  std::unique_ptr<internal::SharedMemoryRing> ring;
+  REVERB_ASSERT_OK(internal::SharedMemoryRing::Create(1024, &ring));
+
+  ChunkData chunk;
+  chunk.set_chunk_key(1);
+  int64_t offset;
+  uint64_t position;
+  char* data = ring->Allocate(chunk.ByteSizeLong(), &offset, &position);
+  ASSERT_NE(data, nullptr);
+  ASSERT_TRUE(chunk.SerializeToArray(data, chunk.ByteSizeLong()));
+
+  InsertStreamRequest request;
+  auto* ref = request.mutable_shared_memory_chunk();
+  ref->set_segment(ring->name());
+  ref->set_offset(offset);
+  ref->set_length(chunk.ByteSizeLong());
+
+  REVERB_EXPECT_OK(
+      FromGrpcStatus(Insert({request, MakeItemRequest({1}, {})})));
+  EXPECT_EQ(table()->size(), 1);
+}
+
+TEST_F(ReverbCallbackServiceImplTest,
+       InsertStreamRejectsSharedMemoryChunkOutsideOfSegment) {
+  std::unique_ptr<internal::SharedMemoryRing> ring;
+  REVERB_ASSERT_OK(internal::SharedMemoryRing::Create(16, &ring));
+
+  InsertStreamRequest request;
+  auto* ref = request.mutable_shared_memory_chunk();
+  ref->set_segment(ring->name());
+  ref->set_offset(8);
+  ref->set_length(16);
+
+  EXPECT_EQ(Insert({request}).error_code(),
+            grpc::StatusCode::INVALID_ARGUMENT);
+}
+
+TEST_F(ReverbCallbackServiceImplTest,
+       InitializeConnectionRespondsWithSharedMemoryToken) {
+  std::unique_ptr<internal::SharedMemoryRing> ring;
+  REVERB_ASSERT_OK(internal::SharedMemoryRing::Create(16, &ring));
+
+  grpc::ClientContext context;
+  auto stream = stub_->InitializeConnection(&context);
+  InitializeConnectionRequest request;
+  request.set_shared_memory_name(ring->name());
+  ASSERT_TRUE(stream->Write(request));
+
+  InitializeConnectionResponse response;
+  ASSERT_TRUE(stream->Read(&response));
+  EXPECT_EQ(response.shared_memory_token(), ring->token());
+  REVERB_EXPECT_OK(FromGrpcStatus(stream->Finish()));
+}
+
+TEST_F(ReverbCallbackServiceImplTest, SampleCompletesWhenItemInserted) {
+  absl::Notification done;
+  auto thread = internal::StartThread("", [&] {
+    grpc::ClientContext context;
+    auto stream = stub_->SampleStream(&context);
+    SampleStreamRequest request;
+    request.set_table("dist");
+    request.set_num_samples(1);
+    request.set_flexible_batch_size(1);
+    ASSERT_TRUE(stream->Write(request));
+    SampleStreamResponse response;
+    ASSERT_TRUE(stream->Read(&response));
+    EXPECT_TRUE(response.end_of_sequence());
+    stream->WritesDone();
+    REVERB_EXPECT_OK(FromGrpcStatus(stream->Finish()));
+    done.Notify();
+  });
+
+  EXPECT_FALSE(done.WaitForNotificationWithTimeout(absl::Milliseconds(100)));
+  REVERB_EXPECT_OK(FromGrpcStatus(
+      Insert({MakeChunkRequest(1), MakeItemRequest({1}, {})})));
+  done.WaitForNotification();
+}
+
+TEST_F(ReverbCallbackServiceImplTest, SampleTimesOut) {
+  grpc::ClientContext context;
+  auto stream = stub_->SampleStream(&context);
+  SampleStreamRequest request;
+  request.set_table("dist");
+  request.set_num_samples(1);
+  request.set_flexible_batch_size(1);
+  request.mutable_rate_limiter_timeout()->set_milliseconds(50);
+  ASSERT_TRUE(stream->Write(request));
+  SampleStreamResponse response;
+  EXPECT_FALSE(stream->Read(&response));
+  EXPECT_EQ(stream->Finish().error_code(), grpc::StatusCode::DEADLINE_EXCEEDED);
+}
+
+TEST_F(ReverbCallbackServiceImplTest, SampleStreamWritesBatchesInOrder) {
+  REVERB_EXPECT_OK(FromGrpcStatus(
+      Insert({MakeChunkRequest(1), MakeItemRequest({1}, {})})));
+
+  // Every batch is sampled while the previous one is being written.
+  grpc::ClientContext context;
+  auto stream = stub_->SampleStream(&context);
+  SampleStreamRequest request;
+  request.set_table("dist");
+  request.set_num_samples(50);
+  request.set_flexible_batch_size(1);
+  ASSERT_TRUE(stream->Write(request));
+
+  for (int i = 0; i < 50; i++) {
+    SampleStreamResponse response;
+    ASSERT_TRUE(stream->Read(&response));
+    EXPECT_EQ(response.info().item().times_sampled(), i + 1);
+    EXPECT_TRUE(response.end_of_sequence());
+  }
+
+  // The stream accepts another request once all samples have been written.
+  request.set_num_samples(1);
+  ASSERT_TRUE(stream->Write(request));
+  SampleStreamResponse response;
+  ASSERT_TRUE(stream->Read(&response));
+  EXPECT_EQ(response.info().item().times_sampled(), 51);
+  stream->WritesDone();
+  REVERB_EXPECT_OK(FromGrpcStatus(stream->Finish()));
+}
+
+// Allows three samples per inserted item.
+class LimitedSamplesTest : public ReverbCallbackServiceImplTest {
+ protected:
+  std::shared_ptr<RateLimiter> MakeRateLimiter() const override {
+    return std::make_shared<RateLimiter>(
+        /*samples_per_insert=*/1.0, /*min_size_to_sample=*/1,
+        /*min_diff=*/-2, /*max_diff=*/DBL_MAX);
+  }
+};
+
+TEST_F(LimitedSamplesTest, SampleStreamWritesSampledBatchesBeforeFailing) {
+  REVERB_EXPECT_OK(FromGrpcStatus(
+      Insert({MakeChunkRequest(1), MakeItemRequest({1}, {})})));
+
+  grpc::ClientContext context;
+  auto stream = stub_->SampleStream(&context);
+  SampleStreamRequest request;
+  request.set_table("dist");
+  request.set_num_samples(5);
+  request.set_flexible_batch_size(1);
+  request.mutable_rate_limiter_timeout()->set_milliseconds(50);
+  ASSERT_TRUE(stream->Write(request));
+
+  // The sample which times out is sampled ahead of the writes of the previous
+  // samples but the call only fails once they have been written.
+  std::vector<SampleStreamResponse> responses;
+  SampleStreamResponse response;
+  while (stream->Read(&response)) {
+    responses.push_back(response);
+  }
+  EXPECT_THAT(responses, SizeIs(3));
+  EXPECT_EQ(stream->Finish().error_code(), grpc::StatusCode::DEADLINE_EXCEEDED);
+}
+
+TEST_F(ReverbCallbackServiceImplTest, ServesManyConcurrentInsertStreams) {
+  // The streams are all kept open at the same time, which would require two
+  // threads per stream with the synchronous service.
+  constexpr int kNumStreams = 200;
+  std::vector<std::unique_ptr<grpc::ClientContext>> contexts;
+  std::vector<std::unique_ptr<
+      grpc::ClientReaderWriter<InsertStreamRequest, InsertStreamResponse>>>
+      streams;
+  for (int i = 0; i < kNumStreams; i++) {
+    contexts.push_back(absl::make_unique<grpc::ClientContext>());
+    streams.push_back(stub_->InsertStream(contexts.back().get()));
+    ASSERT_TRUE(streams.back()->Write(MakeChunkRequest(i)));
+  }
+  for (int i = 0; i < kNumStreams; i++) {
+    ASSERT_TRUE(streams[i]->Write(MakeItemRequest({i}, {}, true)));
+  }
+  for (int i = 0; i < kNumStreams; i++) {
+    InsertStreamResponse response;
+    ASSERT_TRUE(streams[i]->Read(&response));
+    streams[i]->WritesDone();
+    REVERB_EXPECT_OK(FromGrpcStatus(streams[i]->Finish()));
+  }
+  EXPECT_EQ(table()->size(), kNumStreams);
+}
+
+TEST_F(ReverbCallbackServiceImplTest, ExportTableSendsEachChunkOnce) {
+  REVERB_EXPECT_OK(FromGrpcStatus(
+      Insert({MakeChunkRequest(1), MakeChunkRequest(2),
+              MakeItemRequest({1, 2}, {2}), MakeChunkRequest(3),
+              MakeItemRequest({2, 3}, {3}), MakeItemRequest({3}, {})})));
+  const auto items = table()->Copy();
+
+  grpc::Status status;
+  auto responses = ExportTable(stub_.get(), "dist", 1, &status);
+  REVERB_EXPECT_OK(FromGrpcStatus(status));
+
+  // [CHUNK 1] [CHUNK 2] [ITEM 1, RELEASE 1] [CHUNK 3] [ITEM 2, RELEASE 2]
+  // [ITEM 3, RELEASE 3]
+  ASSERT_THAT(responses, SizeIs(6));
+  EXPECT_EQ(responses[0].snapshot_size(), 3);
+  EXPECT_EQ(responses[0].chunk().chunk_key(), 1);
+  EXPECT_EQ(responses[1].chunk().chunk_key(), 2);
+  EXPECT_THAT(responses[2].items(), SizeIs(1));
+  EXPECT_THAT(responses[2].released_chunk_keys(), ElementsAre(1));
+  EXPECT_EQ(responses[3].chunk().chunk_key(), 3);
+  EXPECT_THAT(responses[4].items(), SizeIs(1));
+  EXPECT_THAT(responses[4].released_chunk_keys(), ElementsAre(2));
+  EXPECT_THAT(responses[5].items(), SizeIs(1));
+  EXPECT_THAT(responses[5].released_chunk_keys(), ElementsAre(3));
+  for (int i = 1; i < responses.size(); i++) {
+    EXPECT_EQ(responses[i].snapshot_size(), 0);
+  }
+
+  // The items are exported in insertion order.
+  std::vector<uint64_t> keys;
+  for (const auto& response : responses) {
+    for (const auto& item : response.items()) keys.push_back(item.key());
+  }
+  ASSERT_THAT(items, SizeIs(3));
+  EXPECT_THAT(keys, UnorderedElementsAre(items[0].item.key(),
+                                         items[1].item.key(),
+                                         items[2].item.key()));
+  EXPECT_TRUE(std::is_sorted(keys.begin(), keys.end()));
+}
+
+TEST_F(ReverbCallbackServiceImplTest, ExportTablePagesItems) {
+  std::vector<InsertStreamRequest> requests = {MakeChunkRequest(1)};
+  for (int i = 0; i < 5; i++) {
+    requests.push_back(MakeItemRequest({1}, {1}));
+  }
+  REVERB_EXPECT_OK(FromGrpcStatus(Insert(requests)));
+
+  grpc::Status status;
+  auto responses = ExportTable(stub_.get(), "dist", 2, &status);
+  REVERB_EXPECT_OK(FromGrpcStatus(status));
+
+  // The chunk followed by pages of 2, 2 and 1 items.
+  ASSERT_THAT(responses, SizeIs(4));
+  EXPECT_TRUE(responses[0].has_chunk());
+  EXPECT_THAT(responses[1].items(), SizeIs(2));
+  EXPECT_THAT(responses[2].items(), SizeIs(2));
+  EXPECT_THAT(responses[3].items(), SizeIs(1));
+  EXPECT_THAT(responses[3].released_chunk_keys(), ElementsAre(1));
+}
+
+TEST_F(ReverbCallbackServiceImplTest, ExportEmptyTable) {
+  grpc::Status status;
+  auto responses = ExportTable(stub_.get(), "dist", 0, &status);
+  REVERB_EXPECT_OK(FromGrpcStatus(status));
+  ASSERT_THAT(responses, SizeIs(1));
+  EXPECT_EQ(responses[0].snapshot_size(), 0);
+  EXPECT_THAT(responses[0].items(), SizeIs(0));
+}
+
+TEST_F(ReverbCallbackServiceImplTest, ExportMissingTableFails) {
+  grpc::Status status;
+  ExportTable(stub_.get(), "missing", 0, &status);
+  EXPECT_EQ(status.error_code(), grpc::StatusCode::NOT_FOUND);
+}
+
+TEST_F(ReverbCallbackServiceImplTest, ClientExportTable) {
+  REVERB_EXPECT_OK(FromGrpcStatus(
+      Insert({MakeChunkRequest(1), MakeChunkRequest(2),
+              MakeItemRequest({1, 2}, {2}), MakeChunkRequest(3),
+              MakeItemRequest({2, 3}, {})})));
+
+  Client client(/* grpc_gen:: */ReverbService::NewStub(
+      server_->InProcessChannel(grpc::ChannelArguments())));
+  std::vector<std::vector<uint64_t>> chunk_keys;
+  REVERB_EXPECT_OK(client.ExportTable(
+      "dist",
+      [&](const PrioritizedItem& item,
+          const std::vector<std::shared_ptr<const ChunkData>>& chunks) {
+        chunk_keys.emplace_back();
+        for (const auto& chunk : chunks) {
+          chunk_keys.back().push_back(chunk->chunk_key());
+        }
+        return absl::OkStatus();
+      },
+      /*max_items_per_response=*/1));
+  EXPECT_THAT(chunk_keys, ElementsAre(ElementsAre(1, 2), ElementsAre(2, 3)));
+
+  // Errors returned by the callback stop the export.
+  int calls = 0;
+  EXPECT_EQ(client
+                .ExportTable("dist",
+                             [&](const PrioritizedItem& item,
+                                 const std::vector<
+                                     std::shared_ptr<const ChunkData>>&) {
+                               calls++;
+                               return absl::CancelledError("stop");
+                             })
+                .code(),
+            absl::StatusCode::kCancelled);
+  EXPECT_EQ(calls, 1);
+}
+
+TEST_F(ReverbCallbackServiceImplTest, UnaryMethodsWork) {
+  REVERB_EXPECT_OK(FromGrpcStatus(
+      Insert({MakeChunkRequest(1), MakeItemRequest({1}, {})})));
+
+  {
+    grpc::ClientContext context;
+    ServerInfoRequest request;
+    ServerInfoResponse response;
+    REVERB_EXPECT_OK(
+        FromGrpcStatus(stub_->ServerInfo(&context, request, &response)));
+    ASSERT_THAT(response.table_info(), SizeIs(1));
+    EXPECT_EQ(response.table_info(0).current_size(), 1);
+  }
+  {
+    grpc::ClientContext context;
+    ResetRequest request;
+    request.set_table("dist");
+    ResetResponse response;
+    REVERB_EXPECT_OK(FromGrpcStatus(stub_->Reset(&context, request, &response)));
+    EXPECT_EQ(table()->size(), 0);
+  }
+  {
+    grpc::ClientContext context;
+    MutatePrioritiesRequest request;
+    request.set_table("missing");
+    MutatePrioritiesResponse response;
+    EXPECT_EQ(stub_->MutatePriorities(&context, request, &response).error_code(),
+              grpc::StatusCode::NOT_FOUND);
+  }
+}
+
+}  // namespace
+}  // namespace reverb
+}  // namespace deepmind
@@ -15,13 +15,18 @@
 #include "reverb/cc/reverb_service_impl.h"
 
 #include <algorithm>
+#include <deque>
 #include <list>
 #include <memory>
+#include <utility>
 #include <vector>
 
+#include "absl/base/thread_annotations.h"
+#include "absl/memory/memory.h"
 #include "absl/status/status.h"
 #include "absl/strings/match.h"
 #include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
 #include "reverb/cc/checkpointing/interface.h"
@@ -35,7 +40,12 @@
 #include "reverb/cc/sampler.h"
 #include "reverb/cc/support/cleanup.h"
 #include "reverb/cc/support/grpc_util.h"
-#include "reverb/cc/support/queue.h"
+#include "reverb/cc/support/latency_histogram.h"
+#include "reverb/cc/support/lock_free_queue.h"
+#include "reverb/cc/support/lru_cache.h"
+#include "reverb/cc/support/periodic_closure.h"
+#include "reverb/cc/support/reclaimer.h"
+#include "reverb/cc/support/shared_memory.h"
 #include "reverb/cc/support/trajectory_util.h"
 #include "reverb/cc/support/uint128.h"
 
@@ -43,6 +53,21 @@ namespace deepmind {
 namespace reverb {
 namespace {
 
+// Maximum number of requests read ahead of time by an insert stream. Items
+// which are available when the previous item is processed are inserted as a
+// batch.
+constexpr int kInsertStreamQueueCapacity = 8;
+
+// Maximum number of items, and of bytes of their `PrioritizedItem`s, which an
+// insert stream buffers before inserting them even if more requests are
+// immediately available. Bounds the latency of the confirmations.
+constexpr int kInsertStreamMaxPendingItems = 1024;
+constexpr int64_t kInsertStreamMaxPendingBytes = 4 * 1024 * 1024;
+
+// Maximum number of bytes of chunk data which a sample stream samples ahead of
+// the responses written to the client.
+constexpr int64_t kSampleStreamMaxBufferedBytes = 32 * 1024 * 1024;
+
 inline grpc::Status TableNotFound(absl::string_view name) {
   return grpc::Status(grpc::StatusCode::NOT_FOUND,
                       absl::StrCat("Priority table ", name, " was not found"));
@@ -52,10 +77,229 @@ inline grpc::Status Internal(const std::string& message) {
   return grpc::Status(grpc::StatusCode::INTERNAL, message);
 }
 
+// Flexible batch of samples taken by a sample stream, with the chunks trimmed
+// to the sampled ranges if the client requested so.
+struct SampleBatch {
+  std::vector<Table::SampledItem> samples;
+  // Trimmed chunks of each sample. Empty if the chunks are not trimmed.
+  std::vector<std::vector<std::shared_ptr<const ChunkData>>> trimmed;
+  // Size of the chunk data referenced by the samples.
+  int64_t bytes = 0;
+  // Error which ended the sampling. `samples` is empty if not OK.
+  grpc::Status status;
+};
+
+// Hands over the batches sampled by the sampling thread of a sample stream to
+// the thread writing the responses. Batches are pushed until the queue holds
+// `max_bytes` or more, but a batch is always accepted by an empty queue so
+// that larger batches do not block forever.
+class SampleBatchQueue {
+ public:
+  explicit SampleBatchQueue(int64_t max_bytes) : max_bytes_(max_bytes) {}
+
+  // Blocks while the queue is full. Returns false without pushing `batch` if
+  // the queue has been closed.
+  bool Push(SampleBatch batch) ABSL_LOCKS_EXCLUDED(mu_) {
+    absl::MutexLock lock(&mu_);
+    mu_.Await(absl::Condition(
+        +[](SampleBatchQueue* q) ABSL_EXCLUSIVE_LOCKS_REQUIRED(q->mu_) {
+          return q->closed_ || q->bytes_ < q->max_bytes_ || q->batches_.empty();
+        },
+        this));
+    if (closed_) return false;
+    bytes_ += batch.bytes;
+    batches_.push_back(std::move(batch));
+    return true;
+  }
+
+  // Blocks until a batch is available. Returns false once the queue has been
+  // closed, or the last batch has been pushed and popped.
+  bool Pop(SampleBatch* batch) ABSL_LOCKS_EXCLUDED(mu_) {
+    absl::MutexLock lock(&mu_);
+    mu_.Await(absl::Condition(
+        +[](SampleBatchQueue* q) ABSL_EXCLUSIVE_LOCKS_REQUIRED(q->mu_) {
+          return q->closed_ || q->last_batch_pushed_ || !q->batches_.empty();
+        },
+        this));
+    if (closed_ || batches_.empty()) return false;
+    *batch = std::move(batches_.front());
+    batches_.pop_front();
+    bytes_ -= batch->bytes;
+    return true;
+  }
+
+  // Marks that no more batches will be pushed.
+  void SetLastBatchPushed() ABSL_LOCKS_EXCLUDED(mu_) {
+    absl::MutexLock lock(&mu_);
+    last_batch_pushed_ = true;
+  }
+
+  // Unblocks all pending and future calls to `Push` and `Pop`.
+  void Close() ABSL_LOCKS_EXCLUDED(mu_) {
+    absl::MutexLock lock(&mu_);
+    closed_ = true;
+  }
+
+ private:
+  const int64_t max_bytes_;
+  absl::Mutex mu_;
+  std::deque<SampleBatch> batches_ ABSL_GUARDED_BY(mu_);
+  int64_t bytes_ ABSL_GUARDED_BY(mu_) = 0;
+  bool last_batch_pushed_ ABSL_GUARDED_BY(mu_) = false;
+  bool closed_ ABSL_GUARDED_BY(mu_) = false;
+};
+
 }  // namespace
 
+namespace internal {
+
+grpc::Status ResolveSharedMemoryChunk(bool is_local_peer,
+                                      SharedMemorySegments* segments,
+                                      InsertStreamRequest* request) {
+  if (!is_local_peer) {
+    return grpc::Status(
+        grpc::StatusCode::PERMISSION_DENIED,
+        "Shared memory chunks are only accepted from clients on the same "
+        "host.");
+  }
+
+  // `mutable_chunk` clears the reference so it must be copied first.
+  const SharedMemoryChunk ref = request->shared_memory_chunk();
+  auto it = segments->find(ref.segment());
+  if (it == segments->end()) {
+    std::unique_ptr<SharedMemorySegment> segment;
+    if (auto status = SharedMemorySegment::Open(ref.segment(), &segment);
+        !status.ok()) {
+      return ToGrpcStatus(status);
+    }
+    it = segments->emplace(ref.segment(), std::move(segment)).first;
+  }
+
+  absl::string_view data;
+  if (auto status = it->second->Read(ref.offset(), ref.length(), &data);
+      !status.ok()) {
+    return ToGrpcStatus(status);
+  }
+
+  // The chunk is parsed in place so it is allocated on the arena (if any) of
+  // `request`.
+  if (!request->mutable_chunk()->ParseFromArray(data.data(), data.size())) {
+    return Internal(absl::StrCat("Failed to parse chunk from shared memory "
+                                 "segment ",
+                                 ref.segment(), "."));
+  }
+  return grpc::Status::OK;
+}
+
+void ReleaseChunks(const InsertStreamRequest::PriorityInsertion& insertion,
+                   StreamChunks* chunks, ChunkColumnIndex* index,
+                   Reclaimer* reclaimer) {
+  if (insertion.keep_unreleased_chunks()) {
+    for (ChunkStore::Key key : insertion.released_chunk_keys()) {
+      auto it = chunks->find(key);
+      if (it == chunks->end()) continue;
+      index->Remove(key);
+      reclaimer->Reclaim(std::move(it->second));
+      chunks->erase(it);
+    }
+    return;
+  }
+
+  // Only keep specified chunks.
+  absl::flat_hash_set<int64_t> keep_keys{insertion.keep_chunk_keys().begin(),
+                                         insertion.keep_chunk_keys().end()};
+  for (auto it = chunks->begin(); it != chunks->end();) {
+    if (keep_keys.find(it->first) == keep_keys.end()) {
+      index->Remove(it->first);
+      reclaimer->Reclaim(std::move(it->second));
+      chunks->erase(it++);
+    } else {
+      ++it;
+    }
+  }
+  REVERB_CHECK_EQ(chunks->size(), keep_keys.size())
+      << "Kept less chunks than expected.";
+}
+
+absl::Status ExpandAssembledTrajectory(
+    const ChunkColumnIndex& index,
+    InsertStreamRequest::PriorityInsertion* insertion) {
+  if (!insertion->has_assembled_trajectory()) return absl::OkStatus();
+  if (insertion->item().has_flat_trajectory()) {
+    return absl::InvalidArgumentError(
+        "Items must not set both `flat_trajectory` and "
+        "`assembled_trajectory`.");
+  }
+  REVERB_RETURN_IF_ERROR(
+      index.Expand(insertion->assembled_trajectory(),
+                   insertion->mutable_item()->mutable_flat_trajectory()));
+  insertion->clear_assembled_trajectory();
+  return absl::OkStatus();
+}
+
+absl::Status TrimSampledChunks(
+    Table::SampledItem* sample,
+    std::vector<std::shared_ptr<const ChunkData>>* trimmed) {
+  trimmed->assign(sample->chunks.size(), nullptr);
+
+  flat_hash_map<uint64_t, std::vector<FlatTrajectory::ChunkSlice*>> slices;
+  for (auto& column :
+       *sample->item.mutable_flat_trajectory()->mutable_columns()) {
+    for (auto& slice : *column.mutable_chunk_slices()) {
+      slices[slice.chunk_key()].push_back(&slice);
+    }
+  }
+
+  for (int i = 0; i < sample->chunks.size(); i++) {
+    auto it = slices.find(sample->chunks[i]->key());
+    if (it == slices.end()) continue;
+
+    std::shared_ptr<const ChunkData> data;
+    REVERB_RETURN_IF_ERROR(sample->chunks[i]->PinData(&data));
+    auto chunk = std::make_shared<ChunkData>();
+    if (TrimChunk(*data, it->second, chunk.get())) {
+      (*trimmed)[i] = std::move(chunk);
+    }
+  }
+  return absl::OkStatus();
+}
+
+ArenaInsertStreamRequest NewArenaInsertStreamRequest() {
+  ArenaInsertStreamRequest request;
+  request.arena = ChunkStore::NewArena();
+  request.request =
+      google::protobuf::Arena::CreateMessage<InsertStreamRequest>(
+          request.arena.get());
+  return request;
+}
+
+void NegotiateSharedMemory(const InitializeConnectionRequest& request,
+                           InitializeConnectionResponse* response) {
+  std::unique_ptr<SharedMemorySegment> segment;
+  if (auto status =
+          SharedMemorySegment::Open(request.shared_memory_name(), &segment);
+      !status.ok()) {
+    REVERB_LOG(REVERB_WARNING)
+        << "Unable to map shared memory segment requested by client: "
+        << status;
+    response->set_shared_memory_token(0);
+    return;
+  }
+  response->set_shared_memory_token(segment->token());
+}
+
+}  // namespace internal
+
 ReverbServiceImpl::ReverbServiceImpl(std::shared_ptr<Checkpointer> checkpointer)
-    : checkpointer_(std::move(checkpointer)) {}
+    : checkpointer_(std::move(checkpointer)),
+      reclaimer_(std::make_shared<internal::Reclaimer>()) {}
+
+ReverbServiceImpl::~ReverbServiceImpl() {
+  StopPeriodicCheckpoints();
+  if (checkpointer_ != nullptr) {
+    checkpointer_->StopLoading();
+  }
+}
 
 absl::Status ReverbServiceImpl::Create(
     std::vector<std::shared_ptr<Table>> tables,
@@ -85,6 +329,7 @@ absl::Status ReverbServiceImpl::Initialize(
   }
 
   for (auto& table : tables) {
+    table->UnsafeSetReclaimer(reclaimer_);
     tables_[table->name()] = std::move(table);
   }
 
@@ -102,20 +347,66 @@ grpc::Status ReverbServiceImpl::Checkpoint(grpc::ServerContext* context,
                         "no Checkpointer configured for the replay service.");
   }
 
+  auto status = SaveCheckpoint(response->mutable_checkpoint_path());
+  if (!status.ok()) return ToGrpcStatus(status);
+  return grpc::Status::OK;
+}
+
+absl::Status ReverbServiceImpl::SaveCheckpoint(std::string* path) {
   std::vector<Table*> tables;
   for (auto& table : tables_) {
     tables.push_back(table.second.get());
   }
 
-  auto status = checkpointer_->Save(std::move(tables), 1,
-                                    response->mutable_checkpoint_path());
-  if (!status.ok()) return ToGrpcStatus(status);
+  absl::MutexLock lock(&checkpoint_mu_);
+  REVERB_RETURN_IF_ERROR(checkpointer_->Save(std::move(tables), 1, path));
+  REVERB_LOG(REVERB_INFO) << "Stored checkpoint to " << *path;
+  return absl::OkStatus();
+}
 
-  REVERB_LOG(REVERB_INFO) << "Stored checkpoint to "
-                          << response->checkpoint_path();
-  return grpc::Status::OK;
+absl::Status ReverbServiceImpl::StartPeriodicCheckpoints(
+    absl::Duration interval) {
+  if (checkpointer_ == nullptr) {
+    return absl::FailedPreconditionError(
+        "no Checkpointer configured for the replay service.");
+  }
+  if (interval <= absl::ZeroDuration()) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Checkpoint interval must be > 0 but got ",
+        absl::FormatDuration(interval), "."));
+  }
+  if (periodic_checkpoints_ != nullptr) {
+    return absl::FailedPreconditionError(
+        "Periodic checkpoints have already been started.");
+  }
+  periodic_checkpoints_ = absl::make_unique<internal::PeriodicClosure>(
+      [this] {
+        std::string path;
+        if (auto status = SaveCheckpoint(&path); !status.ok()) {
+          REVERB_LOG(REVERB_ERROR)
+              << "Periodic checkpoint failed: " << status;
+        }
+      },
+      interval, "PeriodicCheckpoint");
+  return periodic_checkpoints_->Start();
 }
 
+void ReverbServiceImpl::StopPeriodicCheckpoints() {
+  if (periodic_checkpoints_ == nullptr) return;
+  REVERB_CHECK_OK(periodic_checkpoints_->Stop());
+  periodic_checkpoints_ = nullptr;
+}
+
+absl::Status ReverbServiceImpl::StartRecording(const std::string& path) {
+  std::vector<TableInfo> tables;
+  for (const auto& table : tables_) {
+    tables.push_back(table.second->info());
+  }
+  return recorder_.Start(path, std::move(tables));
+}
+
+absl::Status ReverbServiceImpl::StopRecording() { return recorder_.Stop(); }
+
 grpc::Status ReverbServiceImpl::InsertStream(
     grpc::ServerContext* context,
     grpc::ServerReaderWriter<InsertStreamResponse, InsertStreamRequest>*
@@ -127,32 +418,117 @@ grpc::Status ReverbServiceImpl::InsertStreamInternal(
     grpc::ServerContext* context,
     grpc::ServerReaderWriterInterface<InsertStreamResponse,
                                       InsertStreamRequest>* stream) {
-  // Start a background thread that unpacks the data ahead of time.
-  deepmind::reverb::internal::Queue<InsertStreamRequest> queue(1);
+  // Start a background thread that unpacks the data ahead of time. Every
+  // request is parsed onto its own arena which is handed over to the chunk
+  // store if the request holds a chunk. The read thread is the only producer
+  // and this thread the only consumer.
+  internal::SpscQueue<internal::ArenaInsertStreamRequest> queue(
+      kInsertStreamQueueCapacity);
   auto read_thread = internal::StartThread("ReadThread", [stream, &queue]() {
-    InsertStreamRequest request;
-    while (stream->Read(&request) && queue.Push(std::move(request))) {
-      request = InsertStreamRequest();
+    auto request = internal::NewArenaInsertStreamRequest();
+    while (stream->Read(request.request) && queue.Push(std::move(request))) {
+      request = internal::NewArenaInsertStreamRequest();
     }
     queue.SetLastItemPushed();
   });
   auto cleanup = internal::MakeCleanup([&queue] { queue.Close(); });
 
-  internal::flat_hash_map<ChunkStore::Key, std::shared_ptr<ChunkStore::Chunk>>
-      chunks;
+  internal::StreamChunks chunks;
+  internal::ChunkColumnIndex chunk_index;
+  const uint64_t stream_id = recorder_.NewStreamId();
+
+  // Items which have been received but not yet inserted. Items received
+  // back-to-back are buffered and inserted once no more requests are
+  // immediately available or the buffer is full. Consecutive items of the same
+  // table are grouped into a single batch and the batches are inserted in the
+  // order they were received.
+  std::vector<std::pair<Table*, std::vector<Table::Item>>> pending_items;
+  int pending_items_count = 0;
+  int64_t pending_items_bytes = 0;
+  std::vector<uint64_t> pending_confirmations;
+
+  auto pending_items_full = [&]() {
+    return pending_items_count >= kInsertStreamMaxPendingItems ||
+           pending_items_bytes >= kInsertStreamMaxPendingBytes;
+  };
+
+  auto insert_pending_items = [&]() -> grpc::Status {
+    {
+      internal::ScopedLatencyTimer timer(&rpc_latency_.insert_stream_items);
+      for (auto& table_and_items : pending_items) {
+        if (auto status = table_and_items.first->InsertOrAssignBatch(
+                std::move(table_and_items.second));
+            !status.ok()) {
+          return ToGrpcStatus(status);
+        }
+      }
+    }
+    pending_items.clear();
+    pending_items_count = 0;
+    pending_items_bytes = 0;
+
+    // Let caller know that the items have been inserted if requested by the
+    // caller. All the items received so far have been inserted so the
+    // confirmations are sent in a single response.
+    if (!pending_confirmations.empty()) {
+      InsertStreamResponse response;
+      response.set_key(pending_confirmations.front());
+      response.mutable_keys()->Add(pending_confirmations.begin() + 1,
+                                   pending_confirmations.end());
+      if (!stream->Write(response)) {
+        return Internal(absl::StrCat(
+            "Error when sending confirmation that item ",
+            pending_confirmations.front(),
+            " has been successfully inserted/updated."));
+      }
+    }
+    pending_confirmations.clear();
+
+    return grpc::Status::OK;
+  };
+
+  // Segments of chunks sent through shared memory.
+  internal::SharedMemorySegments segments;
+
+  internal::ArenaInsertStreamRequest arena_request;
+
+  // Handles a single (i.e. not batched) request of `arena_request`. Chunks are
+  // inserted into the chunk store and items are buffered in `pending_items`.
+  auto handle_request = [&](InsertStreamRequest& request) -> grpc::Status {
+    internal::ScopedLatencyTimer timer(&rpc_latency_.insert_stream_request);
+    if (request.has_batch()) {
+      return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                          "Batches of requests must not be nested.");
+    }
+
+    if (request.has_shared_memory_chunk()) {
+      if (auto status = internal::ResolveSharedMemoryChunk(
+              IsLocalhostOrInProcess(context->peer()), &segments, &request);
+          !status.ok()) {
+        return status;
+      }
+    }
 
-  InsertStreamRequest request;
-  while (queue.Pop(&request)) {
     if (request.has_chunk()) {
+      recorder_.RecordChunk(stream_id, request.chunk());
       ChunkStore::Key key = request.chunk().chunk_key();
+      chunk_index.Add(key, request.chunk_column(),
+                      request.chunk().sequence_range());
       std::shared_ptr<ChunkStore::Chunk> chunk =
-          chunk_store_.Insert(std::move(*request.mutable_chunk()));
+          chunk_store_.Insert(arena_request.arena, request.mutable_chunk());
       if (!chunk) {
         return grpc::Status(grpc::StatusCode::CANCELLED,
                             "Service has been closed");
       }
       chunks[key] = std::move(chunk);
     } else if (request.has_item()) {
+      if (auto status = internal::ExpandAssembledTrajectory(
+              chunk_index, request.mutable_item());
+          !status.ok()) {
+        return ToGrpcStatus(status);
+      }
+      recorder_.RecordItem(stream_id, request.item());
+
       Table::Item item;
 
       auto push_or = [&chunks, &item](ChunkStore::Key key) -> grpc::Status {
@@ -175,41 +551,51 @@ grpc::Status ReverbServiceImpl::InsertStreamInternal(
       Table* table = TableByName(table_name);
       if (table == nullptr) return TableNotFound(table_name);
 
-      const auto item_key = request.item().item().key();
-      item.item = std::move(*request.mutable_item()->mutable_item());
-
-      if (auto status = table->InsertOrAssign(item); !status.ok()) {
-        return ToGrpcStatus(status);
+      if (request.item().send_confirmation()) {
+        pending_confirmations.push_back(request.item().item().key());
       }
 
-      // Let caller know that the item has been inserted if requested by the
-      // caller.
-      if (request.item().send_confirmation()) {
-        InsertStreamResponse response;
-        response.set_key(item_key);
-        if (!stream->Write(response)) {
-          return Internal(absl::StrCat(
-              "Error when sending confirmation that item ", item_key,
-              " has been successfully inserted/updated."));
-        }
+      internal::ReleaseChunks(request.item(), &chunks, &chunk_index,
+                              reclaimer_.get());
+
+      item.item = std::move(*request.mutable_item()->mutable_item());
+      pending_items_bytes += item.item.ByteSizeLong();
+      pending_items_count++;
+      if (pending_items.empty() || pending_items.back().first != table) {
+        pending_items.emplace_back(table, std::vector<Table::Item>());
       }
+      pending_items.back().second.push_back(std::move(item));
+    }
+    return grpc::Status::OK;
+  };
+
+  while (true) {
+    // Insert the buffered items before blocking on the next request as the
+    // client might be waiting for the confirmations.
+    if (!pending_items.empty() && (queue.size() == 0 || pending_items_full())) {
+      if (auto status = insert_pending_items(); !status.ok()) return status;
+    }
 
-      // Only keep specified chunks.
-      absl::flat_hash_set<int64_t> keep_keys{
-          request.item().keep_chunk_keys().begin(),
-          request.item().keep_chunk_keys().end()};
-      for (auto it = chunks.cbegin(); it != chunks.cend();) {
-        if (keep_keys.find(it->first) == keep_keys.end()) {
-          chunks.erase(it++);
-        } else {
-          ++it;
+    if (!queue.Pop(&arena_request)) break;
+    InsertStreamRequest& request = *arena_request.request;
+
+    // The requests of a batch are handled as if they had been read one by one.
+    if (request.has_batch()) {
+      for (auto& batched : *request.mutable_batch()->mutable_requests()) {
+        if (auto status = handle_request(batched); !status.ok()) return status;
+        if (pending_items_full()) {
+          if (auto status = insert_pending_items(); !status.ok()) return status;
         }
       }
-      REVERB_CHECK_EQ(chunks.size(), keep_keys.size())
-          << "Kept less chunks than expected.";
+    } else if (auto status = handle_request(request); !status.ok()) {
+      return status;
     }
   }
 
+  if (!pending_items.empty()) {
+    if (auto status = insert_pending_items(); !status.ok()) return status;
+  }
+
   return grpc::Status::OK;
 }
 
@@ -218,12 +604,17 @@ grpc::Status ReverbServiceImpl::MutatePriorities(
     MutatePrioritiesResponse* response) {
   Table* table = TableByName(request->table());
   if (table == nullptr) return TableNotFound(request->table());
+  recorder_.RecordMutatePriorities(*request);
 
   auto status = table->MutateItems(
       std::vector<KeyWithPriority>(request->updates().begin(),
                                    request->updates().end()),
       request->delete_keys());
   if (!status.ok()) return ToGrpcStatus(status);
+  for (uint64_t episode_id : request->delete_episodes()) {
+    status = table->DeleteEpisode(episode_id);
+    if (!status.ok()) return ToGrpcStatus(status);
+  }
   return grpc::Status::OK;
 }
 
@@ -232,6 +623,7 @@ grpc::Status ReverbServiceImpl::Reset(grpc::ServerContext* context,
                                       ResetResponse* response) {
   Table* table = TableByName(request->table());
   if (table == nullptr) return TableNotFound(request->table());
+  recorder_.RecordReset(*request);
 
   auto status = table->Reset();
   if (!status.ok()) {
@@ -261,6 +653,24 @@ grpc::Status ReverbServiceImpl::SampleStreamInternal(
                              : -1);
   if (timeout < absl::ZeroDuration()) timeout = absl::InfiniteDuration();
 
+  if (request.max_cached_chunks() < 0) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "`max_cached_chunks` must be >= 0.");
+  }
+  if (!request.sample_group().id().empty()) {
+    return grpc::Status(grpc::StatusCode::UNIMPLEMENTED,
+                        "Sample groups are only supported by the callback "
+                        "service (`ReverbCallbackServiceImpl`).");
+  }
+  if (request.mixture_size() > 0) {
+    return grpc::Status(grpc::StatusCode::UNIMPLEMENTED,
+                        "Mixtures are only supported by the callback service "
+                        "(`ReverbCallbackServiceImpl`).");
+  }
+  // Keys of the chunks held by the cache of the client.
+  internal::LruCache<uint64_t, bool> chunk_cache(request.max_cached_chunks());
+  const uint64_t stream_id = recorder_.NewStreamId();
+
   do {
     if (request.num_samples() <= 0) {
       return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
@@ -276,43 +686,109 @@ grpc::Status ReverbServiceImpl::SampleStreamInternal(
     Table* table = TableByName(request.table());
     if (table == nullptr) return TableNotFound(request.table());
     int32_t default_flexible_batch_size = table->DefaultFlexibleBatchSize();
-
-    int count = 0;
-
-    while (!context->IsCancelled() && count != request.num_samples()) {
-      std::vector<Table::SampledItem> samples;
-      int32_t max_batch_size = std::min<int32_t>(
-          request.flexible_batch_size() == Sampler::kAutoSelectValue
-              ? default_flexible_batch_size
-              : request.flexible_batch_size(),
-          request.num_samples() - count);
-      if (auto status =
-              table->SampleFlexibleBatch(&samples, max_batch_size, timeout);
+    recorder_.RecordSample(stream_id, request);
+
+    // The synchronous sample path has no way of mutating the items under the
+    // lock taken for the sample so the mutations are applied separately.
+    if (request.priority_updates_size() > 0 ||
+        request.priority_deletes_size() > 0) {
+      if (auto status = table->MutateItems(
+              std::vector<KeyWithPriority>(request.priority_updates().begin(),
+                                           request.priority_updates().end()),
+              request.priority_deletes());
           !status.ok()) {
         return ToGrpcStatus(status);
       }
-      count += samples.size();
+    }
+
+    const int32_t batch_size =
+        request.flexible_batch_size() == Sampler::kAutoSelectValue
+            ? default_flexible_batch_size
+            : request.flexible_batch_size();
+
+    // Samples the next batch, of at most `batch_size` samples and `remaining`
+    // samples in total.
+    auto sample_batch = [&](int remaining, SampleBatch* batch) -> grpc::Status {
+      const int64_t batch_start = internal::AtomicLatencyHistogram::Start();
+      auto status = table->SampleFlexibleBatch(
+          &batch->samples, std::min<int32_t>(batch_size, remaining), timeout);
+      rpc_latency_.sample_stream_batch.Stop(batch_start);
+      if (!status.ok()) return ToGrpcStatus(status);
+
+      if (request.trim_chunks()) {
+        batch->trimmed.resize(batch->samples.size());
+        for (int i = 0; i < batch->samples.size(); i++) {
+          if (auto status = internal::TrimSampledChunks(&batch->samples[i],
+                                                        &batch->trimmed[i]);
+              !status.ok()) {
+            return ToGrpcStatus(status);
+          }
+        }
+      }
+      for (const auto& sample : batch->samples) {
+        for (const auto& chunk : sample.chunks) {
+          batch->bytes += chunk->DataByteSizeLong();
+        }
+      }
+      return grpc::Status::OK;
+    };
+
+    // Writes the samples of `batch` to the stream, one response per chunk.
+    auto write_batch = [&](SampleBatch* batch) -> grpc::Status {
+      for (int j = 0; j < batch->samples.size(); j++) {
+        Table::SampledItem& sample = batch->samples[j];
+        std::vector<std::shared_ptr<const ChunkData>>* trimmed =
+            batch->trimmed.empty() ? nullptr : &batch->trimmed[j];
 
-      for (auto& sample : samples) {
         for (int i = 0; i < sample.chunks.size(); i++) {
+          internal::ScopedLatencyTimer timer(
+              &rpc_latency_.sample_stream_response);
           SampleStreamResponse response;
           response.set_end_of_sequence(i + 1 == sample.chunks.size());
 
           // Attach the info to the first message.
           if (i == 0) {
-            *response.mutable_info()->mutable_item() = sample.item;
+            *response.mutable_info()->mutable_item() = std::move(sample.item);
             response.mutable_info()->set_probability(sample.probability);
             response.mutable_info()->set_table_size(sample.table_size);
           }
 
-          // We const cast to avoid copying the proto.
-          response.set_allocated_data(
-              const_cast<ChunkData*>(&sample.chunks[i]->data()));
+          // Chunks which the client still holds are sent as just the key.
+          std::shared_ptr<const ChunkData> chunk_data =
+              trimmed == nullptr || trimmed->empty()
+                  ? nullptr
+                  : std::move((*trimmed)[i]);
+          const uint64_t chunk_key = chunk_data != nullptr
+                                         ? chunk_data->chunk_key()
+                                         : sample.chunks[i]->key();
+          const bool cached = chunk_cache.Get(chunk_key) != nullptr;
+          if (cached) {
+            response.set_chunk_cached(true);
+            response.mutable_data()->set_chunk_key(chunk_key);
+          } else if (chunk_data == nullptr) {
+            // The pin keeps the data alive until it has been written even if
+            // the chunk is spilled in the meantime.
+            if (auto status = sample.chunks[i]->PinData(&chunk_data);
+                !status.ok()) {
+              return ToGrpcStatus(status);
+            }
+          }
+          if (!cached) {
+            chunk_cache.Put(chunk_key, true);
+            // We const cast to avoid copying the proto. The data may be
+            // allocated on the arena of the chunk so the arena checks of
+            // `set_allocated_data` must be bypassed.
+            response.unsafe_arena_set_allocated_data(
+                const_cast<ChunkData*>(chunk_data.get()));
+          }
 
-          grpc::WriteOptions options;
-          options.set_no_compression();  // Data is already compressed.
-          bool ok = stream->Write(response, options);
-          response.release_data();
+          const bool last_of_batch = j + 1 == batch->samples.size() &&
+                                     i + 1 == sample.chunks.size();
+          bool ok = stream->Write(
+              response, SampleStreamWriteOptions(
+                            cached ? 0 : sample.chunks[i]->DataByteSizeLong(),
+                            last_of_batch));
+          if (!cached) response.unsafe_arena_release_data();
           if (!ok) {
             return Internal("Failed to write to Sample stream.");
           }
@@ -321,6 +797,49 @@ grpc::Status ReverbServiceImpl::SampleStreamInternal(
           sample.chunks[i] = nullptr;
         }
       }
+      return grpc::Status::OK;
+    };
+
+    if (request.num_samples() <= batch_size) {
+      // The request is served by a single batch so there is nothing to
+      // overlap.
+      if (!context->IsCancelled()) {
+        SampleBatch batch;
+        if (auto status = sample_batch(request.num_samples(), &batch);
+            !status.ok()) {
+          return status;
+        }
+        if (auto status = write_batch(&batch); !status.ok()) return status;
+      }
+    } else {
+      // The next batch is sampled by a background thread while the previous
+      // batches are written, so the time spent selecting items and waiting
+      // for the rate limiter overlaps with the time spent sending the
+      // responses. The batches sampled ahead are bounded by
+      // `kSampleStreamMaxBufferedBytes`.
+      SampleBatchQueue queue(kSampleStreamMaxBufferedBytes);
+      auto sample_thread = internal::StartThread(
+          "SampleThread", [context, &request, &queue, &sample_batch]() {
+            int count = 0;
+            while (!context->IsCancelled() && count != request.num_samples()) {
+              SampleBatch batch;
+              batch.status =
+                  sample_batch(request.num_samples() - count, &batch);
+              count += batch.samples.size();
+              const bool ok = batch.status.ok();
+              if (!queue.Push(std::move(batch)) || !ok) break;
+            }
+            queue.SetLastBatchPushed();
+          });
+      // Unblocks the sampling thread before it is joined if the responses
+      // could not be written.
+      auto cleanup = internal::MakeCleanup([&queue] { queue.Close(); });
+
+      SampleBatch batch;
+      while (queue.Pop(&batch)) {
+        if (!batch.status.ok()) return batch.status;
+        if (auto status = write_batch(&batch); !status.ok()) return status;
+      }
     }
 
     request.Clear();
@@ -336,6 +855,10 @@ Table* ReverbServiceImpl::TableByName(absl::string_view name) const {
 }
 
 void ReverbServiceImpl::Close() {
+  StopPeriodicCheckpoints();
+  if (auto status = StopRecording(); !status.ok()) {
+    REVERB_LOG(REVERB_ERROR) << "Failed to close workload trace: " << status;
+  }
   for (auto& table : tables_) {
     table.second->Close();
   }
@@ -362,6 +885,23 @@ grpc::Status ReverbServiceImpl::ServerInfo(grpc::ServerContext* context,
     *response->add_table_info() = iter.second->info();
   }
   *response->mutable_tables_state_id() = Uint128ToMessage(tables_state_id_);
+  response->set_num_chunks(chunk_store_.num_chunks());
+  response->set_num_chunk_bytes(chunk_store_.num_bytes());
+  *response->mutable_chunk_sharing() = chunk_store_.sharing_info();
+
+  auto* latency_stats = response->mutable_rpc_latency_stats();
+  rpc_latency_.insert_stream_request.ToProto(
+      latency_stats->mutable_insert_stream_request());
+  rpc_latency_.insert_stream_items.ToProto(
+      latency_stats->mutable_insert_stream_items());
+  rpc_latency_.sample_stream_batch.ToProto(
+      latency_stats->mutable_sample_stream_batch());
+  rpc_latency_.sample_stream_response.ToProto(
+      latency_stats->mutable_sample_stream_response());
+
+  for (auto& contention : chunk_store_.lock_contention()) {
+    *response->add_chunk_store_lock_contention() = std::move(contention);
+  }
   return grpc::Status::OK;
 }
 
@@ -383,6 +923,13 @@ grpc::Status ReverbServiceImpl::InitializeConnection(
     return Internal("Failed to read from stream");
   }
 
+  if (!request.shared_memory_name().empty()) {
+    InitializeConnectionResponse response;
+    internal::NegotiateSharedMemory(request, &response);
+    stream->Write(response);
+    return grpc::Status::OK;
+  }
+
   if (request.pid() != getpid()) {
     // Respond without populating the address field.
     InitializeConnectionResponse response;
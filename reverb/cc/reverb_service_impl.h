@@ -16,23 +16,104 @@
 #define REVERB_CC_REVERB_SERVICE_IMPL_H_
 
 #include <memory>
+#include <string>
+#include <vector>
 
 #include "grpcpp/grpcpp.h"
 #include "absl/numeric/int128.h"
 #include "absl/random/random.h"
 #include "absl/status/status.h"
 #include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "google/protobuf/arena.h"
 #include "reverb/cc/checkpointing/interface.h"
 #include "reverb/cc/chunk_store.h"
 #include "reverb/cc/platform/hash_map.h"
 #include "reverb/cc/reverb_service.grpc.pb.h"
 #include "reverb/cc/reverb_service.pb.h"
 #include "reverb/cc/schema.pb.h"
+#include "reverb/cc/support/chunk_column_index.h"
+#include "reverb/cc/support/latency_histogram.h"
+#include "reverb/cc/support/periodic_closure.h"
+#include "reverb/cc/support/reclaimer.h"
+#include "reverb/cc/support/shared_memory.h"
+#include "reverb/cc/support/workload_recorder.h"
 #include "reverb/cc/table.h"
 
 namespace deepmind {
 namespace reverb {
 
+namespace internal {
+
+// Shared memory segments mapped by an insert stream, keyed by name.
+using SharedMemorySegments =
+    flat_hash_map<std::string, std::unique_ptr<SharedMemorySegment>>;
+
+// `InsertStreamRequest` allocated on an arena created by
+// `ChunkStore::NewArena`. A chunk received in the request is inserted into the
+// chunk store together with the arena so the chunk does not have to be copied
+// and its memory is released as a whole.
+struct ArenaInsertStreamRequest {
+  std::shared_ptr<google::protobuf::Arena> arena;
+  InsertStreamRequest* request = nullptr;
+};
+
+// Creates a new arena and allocates an empty request on it.
+ArenaInsertStreamRequest NewArenaInsertStreamRequest();
+
+// Replaces the `shared_memory_chunk` payload of `request` with the `ChunkData`
+// it refers to. The segment is mapped and added to `segments` the first time
+// it is referenced. Returns `PERMISSION_DENIED` unless `is_local_peer` since
+// only clients on the same host can share memory with the server.
+grpc::Status ResolveSharedMemoryChunk(bool is_local_peer,
+                                      SharedMemorySegments* segments,
+                                      InsertStreamRequest* request);
+
+// Chunks received on an insert stream which can be referenced by its items.
+using StreamChunks =
+    flat_hash_map<ChunkStore::Key, std::shared_ptr<ChunkStore::Chunk>>;
+
+// Drops the references to the chunks that are no longer needed by the stream
+// once the item of `insertion` has been handled and hands them to `reclaimer`.
+// If `insertion.keep_unreleased_chunks()` then only `released_chunk_keys` are
+// dropped, so the cost is proportional to the change rather than to the number
+// of kept chunks. Released chunks are also removed from `index`.
+void ReleaseChunks(const InsertStreamRequest::PriorityInsertion& insertion,
+                   StreamChunks* chunks, ChunkColumnIndex* index,
+                   Reclaimer* reclaimer);
+
+// Replaces the `assembled_trajectory` of `insertion` (if any) with the
+// `flat_trajectory` it describes using the chunks in `index`.
+absl::Status ExpandAssembledTrajectory(
+    const ChunkColumnIndex& index,
+    InsertStreamRequest::PriorityInsertion* insertion);
+
+// Trims the chunks of `sample` to the rows and columns referenced by its
+// trajectory (see `SampleStreamRequest.trim_chunks` and `TrimChunk`) and
+// rewrites the slices of the item to reference the trimmed chunks. `trimmed` is
+// aligned with `sample->chunks` and holds nullptr for chunks which should be
+// sent as is.
+absl::Status TrimSampledChunks(
+    Table::SampledItem* sample,
+    std::vector<std::shared_ptr<const ChunkData>>* trimmed);
+
+// Maps the segment named in the `InitializeConnection` request and populates
+// the token of the response. The token is left as 0 if the segment could not
+// be mapped.
+void NegotiateSharedMemory(const InitializeConnectionRequest& request,
+                           InitializeConnectionResponse* response);
+
+// Histograms of the fields of `RpcLatencyStats`.
+struct RpcLatencyHistograms {
+  AtomicLatencyHistogram insert_stream_request;
+  AtomicLatencyHistogram insert_stream_items;
+  AtomicLatencyHistogram sample_stream_batch;
+  AtomicLatencyHistogram sample_stream_response;
+};
+
+}  // namespace internal
+
 // Implements ReverbService. See reverb_service.proto for documentation.
 class ReverbServiceImpl : public /* grpc_gen:: */ReverbService::Service {
  public:
@@ -43,6 +124,10 @@ class ReverbServiceImpl : public /* grpc_gen:: */ReverbService::Service {
   static absl::Status Create(std::vector<std::shared_ptr<Table>> tables,
                              std::unique_ptr<ReverbServiceImpl>* service);
 
+  // Stops any checkpoint load still running in the background as it inserts
+  // into `chunk_store_`.
+  ~ReverbServiceImpl() override;
+
   grpc::Status Checkpoint(grpc::ServerContext* context,
                           const CheckpointRequest* request,
                           CheckpointResponse* response) override;
@@ -86,13 +171,34 @@ class ReverbServiceImpl : public /* grpc_gen:: */ReverbService::Service {
   // Gets a copy of the table lookup.
   internal::flat_hash_map<std::string, std::shared_ptr<Table>> tables() const;
 
-  // Closes all tables and the chunk store.
+  // Closes all tables and the chunk store. Stops the periodic checkpoints
+  // first, waiting for a checkpoint in progress to complete.
   void Close();
 
+  // Saves a checkpoint of all tables every `interval` in a background thread,
+  // in the same way as `Checkpoint`, until `Close` is called. The first
+  // checkpoint is saved `interval` after the call. Must not be called more than
+  // once, nor concurrently with `Close`. Returns `FailedPrecondition` if no
+  // checkpointer is configured.
+  absl::Status StartPeriodicCheckpoints(absl::Duration interval);
+
+  // Records the requests received by the service, including those received by
+  // a `ReverbCallbackServiceImpl` which shares its state, to a workload trace
+  // at `path` until `StopRecording` or `Close` is called. Returns
+  // `FailedPrecondition` if a recording is already in progress. See
+  // `internal::WorkloadRecorder`.
+  absl::Status StartRecording(const std::string& path);
+
+  // Stops the recording started by `StartRecording`, if any.
+  absl::Status StopRecording();
+
   // Returns a summary string description.
   std::string DebugString() const;
 
  private:
+  // Shares the state of the service.
+  friend class ReverbCallbackServiceImpl;
+
   explicit ReverbServiceImpl(
       std::shared_ptr<Checkpointer> checkpointer = nullptr);
 
@@ -101,17 +207,45 @@ class ReverbServiceImpl : public /* grpc_gen:: */ReverbService::Service {
   // Lookups the table for a given name. Returns nullptr if not found.
   Table* TableByName(absl::string_view name) const;
 
+  // Saves a checkpoint of all tables with `checkpointer_`, which must be set,
+  // and stores its path in `path`.
+  absl::Status SaveCheckpoint(std::string* path)
+      ABSL_LOCKS_EXCLUDED(checkpoint_mu_);
+
+  // Stops `periodic_checkpoints_` if it was started.
+  void StopPeriodicCheckpoints();
+
   // Checkpointer used to restore state in the constructor and to save data
   // when `Checkpoint` is called. Note that if `checkpointer_` is nullptr then
   // `Checkpoint` will return an `InvalidArgumentError`.
   std::shared_ptr<Checkpointer> checkpointer_;
 
+  // Serializes the checkpoints requested by `Checkpoint` with those saved by
+  // `periodic_checkpoints_`.
+  absl::Mutex checkpoint_mu_;
+
+  // Saves checkpoints in the background. nullptr unless
+  // `StartPeriodicCheckpoints` has been called.
+  std::unique_ptr<internal::PeriodicClosure> periodic_checkpoints_;
+
   // Stores chunks and keeps references to them.
   ChunkStore chunk_store_;
 
+  // Destroys items deleted from `tables_` and chunks released by insert
+  // streams in the background so that the handlers don't have to.
+  std::shared_ptr<internal::Reclaimer> reclaimer_;
+
   // Priority tables. Must be destroyed after `chunk_store_`.
   internal::flat_hash_map<std::string, std::shared_ptr<Table>> tables_;
 
+  // Latencies of the streaming calls reported by `ServerInfo`. Also updated by
+  // the reactors of `ReverbCallbackServiceImpl`.
+  internal::RpcLatencyHistograms rpc_latency_;
+
+  // Records the requests while `StartRecording` is in effect. Also used by the
+  // reactors of `ReverbCallbackServiceImpl`.
+  internal::WorkloadRecorder recorder_;
+
   absl::BitGen rnd_;
 
   // A new id must be generated whenever a table is added, deleted, or has its
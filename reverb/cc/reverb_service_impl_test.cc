@@ -15,6 +15,7 @@
 #include "reverb/cc/reverb_service_impl.h"
 
 #include <cfloat>
+#include <iterator>
 #include <list>
 #include <memory>
 #include <vector>
@@ -23,7 +24,10 @@
 #include "gtest/gtest.h"
 #include "absl/memory/memory.h"
 #include "absl/synchronization/notification.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
 #include "absl/types/optional.h"
+#include "reverb/cc/chunk_store.h"
 #include "reverb/cc/platform/checkpointing.h"
 #include "reverb/cc/platform/status_macros.h"
 #include "reverb/cc/platform/status_matchers.h"
@@ -34,6 +38,7 @@
 #include "reverb/cc/selectors/uniform.h"
 #include "reverb/cc/testing/proto_test_util.h"
 #include "tensorflow/core/framework/tensor_shape.h"
+#include "tensorflow/core/lib/io/path.h"
 #include "tensorflow/core/platform/env.h"
 #include "tensorflow/core/protobuf/struct.pb.h"
 
@@ -86,6 +91,17 @@ class FakeInsertStream
     return item;
   }
 
+  // Replaces the last `n` requests with a single batch of them.
+  void BatchLast(int n) {
+    InsertStreamRequest request;
+    auto first = std::prev(read_buffer_.end(), n);
+    for (auto it = first; it != read_buffer_.end(); it++) {
+      *request.mutable_batch()->add_requests() = std::move(*it);
+    }
+    read_buffer_.erase(first, read_buffer_.end());
+    read_buffer_.push_back(std::move(request));
+  }
+
   bool Read(InsertStreamRequest* request) override {
     if (read_buffer_.empty()) return false;
     *request = read_buffer_.front();
@@ -117,10 +133,12 @@ class FakeSampleStream
 
   const std::vector<SampleStreamResponse>& responses() { return buffer_; }
   const grpc::WriteOptions last_options() { return options_; }
+  const std::vector<bool>& buffer_hints() { return buffer_hints_; }
 
   bool Write(const SampleStreamResponse& response,
              grpc::WriteOptions options) override {
     buffer_.push_back(response);
+    buffer_hints_.push_back(options.get_buffer_hint());
     options_ = options;
     return true;
   }
@@ -129,7 +147,8 @@ class FakeSampleStream
     if (requests_.empty()) return false;
     request->set_table(requests_.front().table());
     request->set_num_samples(requests_.front().num_samples());
-    request->set_flexible_batch_size(-1);
+    request->set_flexible_batch_size(requests_.front().flexible_batch_size());
+    request->set_max_cached_chunks(requests_.front().max_cached_chunks());
     requests_.pop_front();
     return true;
   }
@@ -139,10 +158,13 @@ class FakeSampleStream
     return !requests_.empty();
   }
 
-  void AddRequest(std::string table, int num_samples) {
+  void AddRequest(std::string table, int num_samples,
+                  int max_cached_chunks = 0, int flexible_batch_size = -1) {
     SampleStreamRequest request;
     request.set_table(std::move(table));
     request.set_num_samples(num_samples);
+    request.set_max_cached_chunks(max_cached_chunks);
+    request.set_flexible_batch_size(flexible_batch_size);
     requests_.push_back(std::move(request));
   }
 
@@ -151,6 +173,7 @@ class FakeSampleStream
  private:
   std::list<SampleStreamRequest> requests_;
   std::vector<SampleStreamResponse> buffer_;
+  std::vector<bool> buffer_hints_;
   grpc::WriteOptions options_;
 };
 
@@ -163,6 +186,17 @@ tensorflow::StructuredValue MakeSignature() {
   return signature;
 }
 
+// Keys of the items confirmed by `responses`, in order.
+std::vector<uint64_t> ConfirmedKeys(
+    const std::vector<InsertStreamResponse>& responses) {
+  std::vector<uint64_t> keys;
+  for (const auto& response : responses) {
+    keys.push_back(response.key());
+    keys.insert(keys.end(), response.keys().begin(), response.keys().end());
+  }
+  return keys;
+}
+
 std::unique_ptr<ReverbServiceImpl> MakeService(
     int max_size, std::unique_ptr<Checkpointer> checkpointer) {
   std::vector<std::shared_ptr<Table>> tables;
@@ -219,6 +253,80 @@ TEST(ReverbServiceImplTest, SampleAfterInsertWorks) {
   }
 }
 
+TEST(ReverbServiceImplTest, SampleOmitsChunksHeldByClientCache) {
+  std::unique_ptr<ReverbServiceImpl> service = MakeService(10);
+
+  FakeInsertStream insert_stream;
+  insert_stream.AddChunk(1);
+  insert_stream.AddChunk(2);
+  insert_stream.AddItem("dist", {1, 2});
+  ASSERT_TRUE(service->InsertStreamInternal(nullptr, &insert_stream).ok());
+
+  FakeSampleStream stream;
+  stream.AddRequest("dist", 3, /*max_cached_chunks=*/2);
+  grpc::ServerContext context;
+  ASSERT_TRUE(service->SampleStreamInternal(&context, &stream).ok());
+  ASSERT_EQ(stream.responses().size(), 6);
+
+  // Only the first sample carries the chunk data. The following samples refer
+  // to the chunks by key.
+  for (int i = 0; i < stream.responses().size(); i++) {
+    const auto& response = stream.responses()[i];
+    EXPECT_EQ(response.data().chunk_key(), i % 2 + 1);
+    EXPECT_EQ(response.chunk_cached(), i >= 2);
+  }
+}
+
+TEST(ReverbServiceImplTest, SampleWritesAllBatchesOfRequest) {
+  std::unique_ptr<ReverbServiceImpl> service = MakeService(10);
+
+  FakeInsertStream insert_stream;
+  insert_stream.AddChunk(1);
+  insert_stream.AddChunk(2);
+  insert_stream.AddItem("dist", {1, 2});
+  ASSERT_TRUE(service->InsertStreamInternal(nullptr, &insert_stream).ok());
+
+  // Every batch holds a single sample so the samples are taken by the
+  // background thread while the previous ones are written.
+  FakeSampleStream stream;
+  stream.AddRequest("dist", 5, /*max_cached_chunks=*/2,
+                    /*flexible_batch_size=*/1);
+  stream.AddRequest("dist", 3, /*max_cached_chunks=*/2,
+                    /*flexible_batch_size=*/2);
+  grpc::ServerContext context;
+  REVERB_ASSERT_OK(service->SampleStreamInternal(&context, &stream));
+  ASSERT_EQ(stream.responses().size(), 16);
+
+  for (int i = 0; i < stream.responses().size(); i++) {
+    const auto& response = stream.responses()[i];
+    EXPECT_EQ(response.has_info(), i % 2 == 0);
+    EXPECT_EQ(response.end_of_sequence(), i % 2 == 1);
+    EXPECT_EQ(response.data().chunk_key(), i % 2 + 1);
+    EXPECT_EQ(response.chunk_cached(), i >= 2);
+  }
+}
+
+TEST(ReverbServiceImplTest, SampleFlushesResponsesAtEndOfBatch) {
+  std::unique_ptr<ReverbServiceImpl> service = MakeService(10);
+
+  FakeInsertStream insert_stream;
+  insert_stream.AddChunk(1);
+  insert_stream.AddChunk(2);
+  insert_stream.AddItem("dist", {1, 2});
+  ASSERT_TRUE(service->InsertStreamInternal(nullptr, &insert_stream).ok());
+
+  FakeSampleStream stream;
+  stream.AddRequest("dist", 4, /*max_cached_chunks=*/0,
+                    /*flexible_batch_size=*/2);
+  grpc::ServerContext context;
+  REVERB_ASSERT_OK(service->SampleStreamInternal(&context, &stream));
+
+  // The small responses are buffered until the last response of each batch.
+  EXPECT_THAT(stream.buffer_hints(),
+              ::testing::ElementsAre(true, true, true, false, true, true, true,
+                                     false));
+}
+
 TEST(ReverbServiceImplTest, InsertChunksWithoutItemWorks) {
   std::unique_ptr<ReverbServiceImpl> service = MakeService(10);
   grpc::ServerContext context;
@@ -287,9 +395,76 @@ TEST(ReverbServiceImplTest, InsertStreamRespondsWithItemKeys) {
   stream.AddItem("dist", {1}, {1}, /*send_confirmation=*/false);
   stream.AddItem("dist", {1}, {}, /*send_confirmation=*/true);
   REVERB_EXPECT_OK(service->InsertStreamInternal(&context, &stream));
-  EXPECT_THAT(stream.responses(), ::testing::SizeIs(2));
-  EXPECT_EQ(stream.responses()[0].key(), first_id);
-  EXPECT_EQ(stream.responses()[1].key(), first_id + 2);
+  EXPECT_THAT(ConfirmedKeys(stream.responses()),
+              ::testing::ElementsAre(first_id, first_id + 2));
+}
+
+TEST(ReverbServiceImplTest, InsertStreamInsertsBackToBackItems) {
+  std::unique_ptr<ReverbServiceImpl> service = MakeService(100);
+  grpc::ServerContext context;
+
+  FakeInsertStream stream;
+  stream.AddChunk(1);
+  std::vector<int64_t> keys;
+  for (int i = 0; i < 20; i++) {
+    keys.push_back(stream.AddItem("dist", {1}, {1}, true).key());
+  }
+  REVERB_EXPECT_OK(service->InsertStreamInternal(&context, &stream));
+
+  EXPECT_EQ(service->tables()["dist"]->size(), 20);
+  EXPECT_THAT(ConfirmedKeys(stream.responses()),
+              ::testing::ElementsAreArray(keys));
+}
+
+TEST(ReverbServiceImplTest, InsertStreamHandlesBatchedRequests) {
+  std::unique_ptr<ReverbServiceImpl> service = MakeService(10);
+  grpc::ServerContext context;
+
+  FakeInsertStream stream;
+  stream.AddChunk(1);
+  auto first_id = nextId;
+  stream.AddItem("dist", {1}, {1}, /*send_confirmation=*/false);
+  stream.AddItem("dist", {1}, {}, /*send_confirmation=*/true);
+  stream.BatchLast(3);
+  REVERB_EXPECT_OK(service->InsertStreamInternal(&context, &stream));
+
+  EXPECT_EQ(service->tables()["dist"]->size(), 2);
+  EXPECT_THAT(ConfirmedKeys(stream.responses()),
+              ::testing::ElementsAre(first_id + 1));
+}
+
+TEST(ReverbServiceImplTest, InsertStreamFlushesFullBuffers) {
+  std::unique_ptr<ReverbServiceImpl> service = MakeService(3000);
+  grpc::ServerContext context;
+
+  // The items of a single batch are received back-to-back so the buffer is
+  // only flushed early because it is full.
+  FakeInsertStream stream;
+  stream.AddChunk(1);
+  std::vector<int64_t> keys;
+  for (int i = 0; i < 2500; i++) {
+    keys.push_back(stream.AddItem("dist", {1}, {1}, true).key());
+  }
+  stream.BatchLast(2501);
+  REVERB_EXPECT_OK(service->InsertStreamInternal(&context, &stream));
+
+  EXPECT_EQ(service->tables()["dist"]->size(), 2500);
+  EXPECT_GE(stream.responses().size(), 3);
+  EXPECT_THAT(ConfirmedKeys(stream.responses()),
+              ::testing::ElementsAreArray(keys));
+}
+
+TEST(ReverbServiceImplTest, InsertStreamRejectsNestedBatches) {
+  std::unique_ptr<ReverbServiceImpl> service = MakeService(10);
+  grpc::ServerContext context;
+
+  FakeInsertStream stream;
+  stream.AddChunk(1);
+  stream.BatchLast(1);
+  stream.AddChunk(2);
+  stream.BatchLast(2);
+  EXPECT_EQ(service->InsertStreamInternal(&context, &stream).error_code(),
+            grpc::StatusCode::INVALID_ARGUMENT);
 }
 
 TEST(ReverbServiceImplTest, SampleBlocksUntilEnoughInserts) {
@@ -393,7 +568,14 @@ TEST(ReverbServiceImplTest, ServerInfoWorks) {
             std::make_pair(uint64_t{0}, uint64_t{0}));
 
   EXPECT_EQ(server_info_response.table_info_size(), 1);
-  const auto& table_info = server_info_response.table_info()[0];
+  TableInfo table_info = server_info_response.table_info()[0];
+
+  // Every operation which acquires the lock is reported, even before the
+  // lock has been acquired.
+  EXPECT_EQ(table_info.latency_stats().lock_contention_size(), 9);
+  EXPECT_EQ(table_info.latency_stats().lock_contention(0).operation(),
+            "insert");
+  table_info.mutable_latency_stats()->clear_lock_contention();
 
   TableInfo expected_table_info;
   expected_table_info.set_name("dist");
@@ -413,8 +595,25 @@ TEST(ReverbServiceImplTest, ServerInfoWorks) {
   rate_limiter->mutable_sample_stats()->mutable_completed_wait_time();
   rate_limiter->mutable_sample_stats()->mutable_pending_wait_time();
   *expected_table_info.mutable_signature() = MakeSignature();
+  auto* latency_stats = expected_table_info.mutable_latency_stats();
+  for (auto* histogram :
+       {latency_stats->mutable_lock_wait(), latency_stats->mutable_lock_hold(),
+        latency_stats->mutable_selector(),
+        latency_stats->mutable_extensions()}) {
+    histogram->mutable_total();
+    histogram->mutable_max();
+  }
 
   EXPECT_THAT(table_info, testing::EqualsProto(expected_table_info));
+  EXPECT_TRUE(server_info_response.has_rpc_latency_stats());
+
+  // No chunks have been inserted.
+  const auto& chunk_sharing = server_info_response.chunk_sharing();
+  EXPECT_EQ(chunk_sharing.num_chunks_by_num_tables_size(),
+            ChunkStore::kNumSharingBuckets);
+  EXPECT_EQ(chunk_sharing.orphaned_chunk_bytes(), 0);
+  EXPECT_EQ(chunk_sharing.exclusive_chunk_bytes(), 0);
+  EXPECT_EQ(server_info_response.chunk_store_lock_contention_size(), 5);
 }
 
 TEST(ReverbServiceImplTest, CheckpointCalledWithoutCheckpointer) {
@@ -458,6 +657,42 @@ TEST(ReverbServiceImplTest, CheckpointAndLoadFromCheckpoint) {
   EXPECT_EQ(loaded_service->tables()["dist"]->size(), 1);
 }
 
+TEST(ReverbServiceImplTest, PeriodicCheckpointsRequireCheckpointer) {
+  auto service = MakeService(10);
+  EXPECT_EQ(service->StartPeriodicCheckpoints(absl::Seconds(1)).code(),
+            absl::StatusCode::kFailedPrecondition);
+}
+
+TEST(ReverbServiceImplTest, PeriodicCheckpoints) {
+  std::string path = getenv("TEST_TMPDIR");
+  REVERB_CHECK(tensorflow::Env::Default()->CreateUniqueFileName(&path, "temp"));
+  auto service = MakeService(10, CreateDefaultCheckpointer(path));
+  {
+    FakeInsertStream stream;
+    stream.AddChunk(1);
+    stream.AddItem("dist", {1});
+    ASSERT_TRUE(service->InsertStreamInternal(nullptr, &stream).ok());
+  }
+
+  EXPECT_EQ(service->StartPeriodicCheckpoints(absl::ZeroDuration()).code(),
+            absl::StatusCode::kInvalidArgument);
+  REVERB_ASSERT_OK(service->StartPeriodicCheckpoints(absl::Milliseconds(10)));
+
+  // Wait until a checkpoint has been saved and stop the checkpoints.
+  std::vector<std::string> done_files;
+  while (done_files.empty()) {
+    absl::SleepFor(absl::Milliseconds(10));
+    ASSERT_TRUE(tensorflow::Env::Default()
+                    ->GetMatchingPaths(
+                        tensorflow::io::JoinPath(path, "*", "DONE"), &done_files)
+                    .ok());
+  }
+  service->Close();
+
+  auto loaded_service = MakeService(10, CreateDefaultCheckpointer(path));
+  EXPECT_EQ(loaded_service->tables()["dist"]->size(), 1);
+}
+
 }  // namespace
 }  // namespace reverb
 }  // namespace deepmind
@@ -0,0 +1,183 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/sample_group.h"
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "reverb/cc/platform/logging.h"
+#include "reverb/cc/reverb_service.pb.h"
+#include "reverb/cc/table.h"
+
+namespace deepmind {
+namespace reverb {
+
+SampleGroup::SampleGroup(Table* table, int size, bool partition)
+    : table_(table), size_(size), partition_(partition), next_batch_(size, 0) {
+  REVERB_CHECK_GE(size_, 1);
+}
+
+void SampleGroup::Next(int rank, int batch_size, absl::Duration timeout,
+                       Callback callback) {
+  REVERB_CHECK_GE(rank, 0);
+  REVERB_CHECK_LT(rank, size_);
+  REVERB_CHECK_GE(batch_size, 1);
+
+  std::vector<Table::SampledItem> samples;
+  bool sample = false;
+  {
+    absl::MutexLock lock(&mu_);
+    if (!TakeLocked(rank, &samples)) {
+      waiters_.push_back({rank, batch_size, timeout, std::move(callback)});
+      if (!sampling_) {
+        sampling_ = true;
+        sample = true;
+      }
+    }
+  }
+
+  if (!samples.empty()) {
+    callback(absl::OkStatus(), std::move(samples));
+    return;
+  }
+  if (sample) {
+    // The group may be destroyed (by the last stream closing) while the table
+    // still holds the callback.
+    table_->SampleFlexibleBatchAsync(
+        partition_ ? batch_size * size_ : batch_size,
+        [self = shared_from_this()](absl::Status status,
+                                    std::vector<Table::SampledItem> samples) {
+          self->OnSampleDone(std::move(status), std::move(samples));
+        },
+        timeout);
+  }
+}
+
+bool SampleGroup::TakeLocked(int rank,
+                             std::vector<Table::SampledItem>* samples) {
+  uint64_t& next = next_batch_[rank];
+  next = std::max(next, first_batch_);
+  // With partitioning a batch can be too small to hold items for every rank,
+  // in which case the ranks without items move on to the following batch.
+  while (samples->empty() && next < first_batch_ + batches_.size()) {
+    const auto& batch = *batches_[next - first_batch_];
+    if (partition_) {
+      for (size_t i = rank; i < batch.size(); i += size_) {
+        samples->push_back(batch[i]);
+      }
+    } else {
+      *samples = batch;
+    }
+    ++next;
+  }
+  if (samples->empty()) return false;
+
+  DropConsumedLocked();
+  return true;
+}
+
+void SampleGroup::DropConsumedLocked() {
+  uint64_t consumed =
+      *std::min_element(next_batch_.begin(), next_batch_.end());
+  while (!batches_.empty() &&
+         (first_batch_ < consumed || batches_.size() > kMaxBacklog)) {
+    batches_.pop_front();
+    ++first_batch_;
+  }
+}
+
+void SampleGroup::OnSampleDone(absl::Status status,
+                               std::vector<Table::SampledItem> samples) {
+  std::vector<Waiter> waiters;
+  {
+    absl::MutexLock lock(&mu_);
+    sampling_ = false;
+    std::swap(waiters, waiters_);
+    if (status.ok()) {
+      batches_.push_back(
+          std::make_shared<const std::vector<Table::SampledItem>>(
+              std::move(samples)));
+      DropConsumedLocked();
+    }
+  }
+
+  // Requeuing the waiters lets them take their share of the new batch, and
+  // starts sampling the next one if any of them got no items.
+  for (auto& waiter : waiters) {
+    if (status.ok()) {
+      Next(waiter.rank, waiter.batch_size, waiter.timeout,
+           std::move(waiter.callback));
+    } else {
+      waiter.callback(status, {});
+    }
+  }
+}
+
+absl::Status SampleGroupRegistry::Join(Table* table,
+                                       const SampleGroupOptions& options,
+                                       std::shared_ptr<SampleGroup>* group) {
+  if (options.size() < 1) {
+    return absl::InvalidArgument(absl::StrCat(
+        "SampleGroupOptions.size must be >= 1 but got ", options.size(), "."));
+  }
+  if (options.rank() < 0 || options.rank() >= options.size()) {
+    return absl::InvalidArgument(absl::StrCat(
+        "SampleGroupOptions.rank must be in [0, ", options.size(),
+        ") but got ", options.rank(), "."));
+  }
+
+  absl::MutexLock lock(&mu_);
+
+  // Groups are only dropped from the map when a group with the same key is
+  // joined so prune the expired ones here to keep the map bounded.
+  for (auto it = groups_.begin(); it != groups_.end();) {
+    if (it->second.expired()) {
+      groups_.erase(it++);
+    } else {
+      ++it;
+    }
+  }
+
+  auto& entry = groups_[std::make_pair(table, options.id())];
+  *group = entry.lock();
+  if (*group == nullptr) {
+    *group = std::make_shared<SampleGroup>(table, options.size(),
+                                           options.partition());
+    entry = *group;
+    return absl::OkStatus();
+  }
+
+  if ((*group)->size() != options.size() ||
+      (*group)->partition() != options.partition()) {
+    std::shared_ptr<SampleGroup> existing = std::move(*group);
+    group->reset();
+    return absl::InvalidArgument(absl::StrCat(
+        "Sample group '", options.id(), "' of table ", table->name(),
+        " has size ", existing->size(), " and partition ",
+        existing->partition(), " but the stream requested size ",
+        options.size(), " and partition ", options.partition(), "."));
+  }
+  return absl::OkStatus();
+}
+
+}  // namespace reverb
+}  // namespace deepmind
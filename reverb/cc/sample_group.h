@@ -0,0 +1,140 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_SAMPLE_GROUP_H_
+#define REVERB_CC_SAMPLE_GROUP_H_
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/status/status.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "reverb/cc/platform/hash_map.h"
+#include "reverb/cc/reverb_service.pb.h"
+#include "reverb/cc/table.h"
+
+namespace deepmind {
+namespace reverb {
+
+// Shares the samples of a table between the sample streams of a group (see
+// `SampleGroupOptions`).
+//
+// The batches sampled for the group form a sequence which every rank consumes
+// in order. A batch is sampled by the first rank to ask for it and kept until
+// every rank has received it, so the table is sampled once per batch rather
+// than once per rank. A rank which falls more than `kMaxBacklog` batches
+// behind (e.g. because its streams have been closed) skips the oldest batches
+// so the memory held by the group stays bounded.
+//
+// All public methods are thread safe.
+class SampleGroup : public std::enable_shared_from_this<SampleGroup> {
+ public:
+  // Called with the samples of a rank. The samples are empty unless the status
+  // is OK.
+  using Callback =
+      std::function<void(absl::Status, std::vector<Table::SampledItem>)>;
+
+  // Maximum number of batches kept for ranks which have not received them.
+  static constexpr int kMaxBacklog = 16;
+
+  SampleGroup(Table* table, int size, bool partition);
+
+  // Calls `callback` with the next batch of `rank`. If the batch has not been
+  // sampled yet then it is sampled from the table (with at most `batch_size`
+  // items per rank and `timeout` passed on to the rate limiter) unless another
+  // rank is already doing so. The callback may be invoked before the call
+  // returns. If sampling fails then the error is passed to all the callbacks
+  // waiting for the batch.
+  void Next(int rank, int batch_size, absl::Duration timeout,
+            Callback callback) ABSL_LOCKS_EXCLUDED(mu_);
+
+  Table* table() const { return table_; }
+  int size() const { return size_; }
+  bool partition() const { return partition_; }
+
+ private:
+  struct Waiter {
+    int rank;
+    int batch_size;
+    absl::Duration timeout;
+    Callback callback;
+  };
+
+  // Takes the next batch of `rank` if it has been sampled. Returns false
+  // otherwise.
+  bool TakeLocked(int rank, std::vector<Table::SampledItem>* samples)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Drops the batches which all ranks have received or which exceed the
+  // backlog.
+  void DropConsumedLocked() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  void OnSampleDone(absl::Status status,
+                    std::vector<Table::SampledItem> samples)
+      ABSL_LOCKS_EXCLUDED(mu_);
+
+  Table* const table_;
+  const int size_;
+  const bool partition_;
+
+  absl::Mutex mu_;
+
+  // Batches which have not been received by all ranks. The front batch has the
+  // sequence number `first_batch_`.
+  std::deque<std::shared_ptr<const std::vector<Table::SampledItem>>> batches_
+      ABSL_GUARDED_BY(mu_);
+  uint64_t first_batch_ ABSL_GUARDED_BY(mu_) = 0;
+
+  // Sequence number of the next batch of every rank.
+  std::vector<uint64_t> next_batch_ ABSL_GUARDED_BY(mu_);
+
+  // Requests waiting for the batch which is being sampled.
+  std::vector<Waiter> waiters_ ABSL_GUARDED_BY(mu_);
+
+  // True while a batch is being sampled from the table.
+  bool sampling_ ABSL_GUARDED_BY(mu_) = false;
+};
+
+// Maps the ids of the groups of every table to the groups. Groups are owned by
+// the streams which joined them and are destroyed once the last of these has
+// been closed.
+//
+// All public methods are thread safe.
+class SampleGroupRegistry {
+ public:
+  // Returns the group of `table` with the id of `options`, creating it if it
+  // does not exist. Returns `InvalidArgument` if the options are invalid or do
+  // not match those of the existing group.
+  absl::Status Join(Table* table, const SampleGroupOptions& options,
+                    std::shared_ptr<SampleGroup>* group)
+      ABSL_LOCKS_EXCLUDED(mu_);
+
+ private:
+  absl::Mutex mu_;
+  internal::flat_hash_map<std::pair<Table*, std::string>,
+                          std::weak_ptr<SampleGroup>>
+      groups_ ABSL_GUARDED_BY(mu_);
+};
+
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_SAMPLE_GROUP_H_
@@ -0,0 +1,172 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/sample_group.h"
+
+#include <cfloat>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/memory/memory.h"
+#include "absl/status/status.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/time.h"
+#include "reverb/cc/chunk_store.h"
+#include "reverb/cc/platform/status_matchers.h"
+#include "reverb/cc/rate_limiter.h"
+#include "reverb/cc/reverb_service.pb.h"
+#include "reverb/cc/selectors/fifo.h"
+#include "reverb/cc/table.h"
+#include "reverb/cc/testing/proto_test_util.h"
+
+namespace deepmind {
+namespace reverb {
+namespace {
+
+const absl::Duration kTimeout = absl::Seconds(5);
+
+using ::testing::ElementsAre;
+
+MATCHER_P(HasItemKey, key, "") { return arg.item.key() == key; }
+
+// Samples the items in insertion order and removes them once sampled.
+std::unique_ptr<Table> MakeFifoTable(int num_items) {
+  auto table = absl::make_unique<Table>(
+      "queue", absl::make_unique<FifoSelector>(),
+      absl::make_unique<FifoSelector>(), 1000, /*max_times_sampled=*/1,
+      absl::make_unique<RateLimiter>(1.0, 1, -DBL_MAX, DBL_MAX));
+  for (int key = 1; key <= num_items; ++key) {
+    ChunkData data =
+        testing::MakeChunkData(key * 100, testing::MakeSequenceRange(
+                                              key * 100, 0, 1));
+    Table::Item item;
+    item.chunks.push_back(std::make_shared<ChunkStore::Chunk>(data));
+    item.item = testing::MakePrioritizedItem(key, 1.0, {data});
+    REVERB_CHECK_OK(table->InsertOrAssign(std::move(item)));
+  }
+  return table;
+}
+
+absl::Status Next(SampleGroup* group, int rank, int batch_size,
+                  std::vector<Table::SampledItem>* samples,
+                  absl::Duration timeout = kTimeout) {
+  absl::Notification done;
+  absl::Status status;
+  group->Next(rank, batch_size, timeout,
+              [&](absl::Status s, std::vector<Table::SampledItem> items) {
+                status = std::move(s);
+                *samples = std::move(items);
+                done.Notify();
+              });
+  done.WaitForNotification();
+  return status;
+}
+
+SampleGroupOptions MakeOptions(const std::string& id, int size, int rank,
+                               bool partition) {
+  SampleGroupOptions options;
+  options.set_id(id);
+  options.set_size(size);
+  options.set_rank(rank);
+  options.set_partition(partition);
+  return options;
+}
+
+TEST(SampleGroupTest, EveryRankReceivesEveryBatch) {
+  auto table = MakeFifoTable(4);
+  auto group = std::make_shared<SampleGroup>(table.get(), 2, false);
+
+  std::vector<Table::SampledItem> samples;
+  REVERB_ASSERT_OK(Next(group.get(), 0, 2, &samples));
+  EXPECT_THAT(samples, ElementsAre(HasItemKey(1), HasItemKey(2)));
+  REVERB_ASSERT_OK(Next(group.get(), 1, 2, &samples));
+  EXPECT_THAT(samples, ElementsAre(HasItemKey(1), HasItemKey(2)));
+  REVERB_ASSERT_OK(Next(group.get(), 1, 2, &samples));
+  EXPECT_THAT(samples, ElementsAre(HasItemKey(3), HasItemKey(4)));
+  REVERB_ASSERT_OK(Next(group.get(), 0, 2, &samples));
+  EXPECT_THAT(samples, ElementsAre(HasItemKey(3), HasItemKey(4)));
+
+  // The table was only sampled once per batch.
+  EXPECT_EQ(table->size(), 0);
+}
+
+TEST(SampleGroupTest, PartitionSplitsBatchesBetweenRanks) {
+  auto table = MakeFifoTable(4);
+  auto group = std::make_shared<SampleGroup>(table.get(), 2, true);
+
+  std::vector<Table::SampledItem> samples;
+  REVERB_ASSERT_OK(Next(group.get(), 1, 2, &samples));
+  EXPECT_THAT(samples, ElementsAre(HasItemKey(2), HasItemKey(4)));
+  REVERB_ASSERT_OK(Next(group.get(), 0, 2, &samples));
+  EXPECT_THAT(samples, ElementsAre(HasItemKey(1), HasItemKey(3)));
+  EXPECT_EQ(table->size(), 0);
+}
+
+TEST(SampleGroupTest, SamplingErrorIsPassedToWaiters) {
+  auto table = MakeFifoTable(0);
+  auto group = std::make_shared<SampleGroup>(table.get(), 2, false);
+
+  std::vector<Table::SampledItem> samples;
+  EXPECT_EQ(Next(group.get(), 0, 1, &samples, absl::Milliseconds(10)).code(),
+            absl::StatusCode::kDeadlineExceeded);
+  EXPECT_TRUE(samples.empty());
+}
+
+TEST(SampleGroupRegistryTest, ReturnsSameGroupForSameId) {
+  auto table = MakeFifoTable(0);
+  SampleGroupRegistry registry;
+
+  std::shared_ptr<SampleGroup> first, second, other;
+  REVERB_ASSERT_OK(
+      registry.Join(table.get(), MakeOptions("a", 2, 0, false), &first));
+  REVERB_ASSERT_OK(
+      registry.Join(table.get(), MakeOptions("a", 2, 1, false), &second));
+  REVERB_ASSERT_OK(
+      registry.Join(table.get(), MakeOptions("b", 2, 1, false), &other));
+  EXPECT_EQ(first, second);
+  EXPECT_NE(first, other);
+}
+
+TEST(SampleGroupRegistryTest, RejectsInvalidOptions) {
+  auto table = MakeFifoTable(0);
+  SampleGroupRegistry registry;
+
+  std::shared_ptr<SampleGroup> group;
+  EXPECT_EQ(
+      registry.Join(table.get(), MakeOptions("a", 0, 0, false), &group).code(),
+      absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(
+      registry.Join(table.get(), MakeOptions("a", 2, 2, false), &group).code(),
+      absl::StatusCode::kInvalidArgument);
+
+  REVERB_ASSERT_OK(
+      registry.Join(table.get(), MakeOptions("a", 2, 0, false), &group));
+  std::shared_ptr<SampleGroup> mismatch;
+  EXPECT_EQ(
+      registry.Join(table.get(), MakeOptions("a", 3, 0, false), &mismatch)
+          .code(),
+      absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(
+      registry.Join(table.get(), MakeOptions("a", 2, 0, true), &mismatch)
+          .code(),
+      absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(mismatch, nullptr);
+}
+
+}  // namespace
+}  // namespace reverb
+}  // namespace deepmind
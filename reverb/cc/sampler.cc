@@ -15,35 +15,51 @@
 #include "reverb/cc/sampler.h"
 
 #include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <deque>
+#include <limits>
 #include <memory>
+#include <numeric>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "grpcpp/impl/codegen/client_context.h"
 #include "grpcpp/impl/codegen/sync_stream.h"
 #include "absl/memory/memory.h"
+#include "absl/random/distributions.h"
+#include "absl/random/random.h"
 #include "absl/status/status.h"
 #include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
 #include "absl/synchronization/mutex.h"
+#include "absl/synchronization/notification.h"
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "absl/types/optional.h"
 #include "reverb/cc/chunk_store.h"
 #include "reverb/cc/platform/hash_map.h"
 #include "reverb/cc/platform/hash_set.h"
 #include "reverb/cc/platform/logging.h"
 #include "reverb/cc/platform/status_macros.h"
 #include "reverb/cc/platform/thread.h"
+#include "reverb/cc/platform/tracing.h"
 #include "reverb/cc/rate_limiter.h"
 #include "reverb/cc/reverb_service.pb.h"
 #include "reverb/cc/schema.pb.h"
+#include "reverb/cc/support/decompressed_chunk_cache.h"
 #include "reverb/cc/support/grpc_util.h"
+#include "reverb/cc/support/lru_cache.h"
+#include "reverb/cc/support/queue.h"
 #include "reverb/cc/support/tf_util.h"
 #include "reverb/cc/support/trajectory_util.h"
 #include "reverb/cc/table.h"
 #include "reverb/cc/tensor_compression.h"
 #include "tensorflow/core/framework/tensor.h"
 #include "tensorflow/core/framework/tensor_util.h"
+#include "tensorflow/core/framework/types.h"
 
 namespace deepmind {
 namespace reverb {
@@ -68,6 +84,20 @@ inline bool SampleIsDone(const std::vector<SampleStreamResponse>& sample) {
   return true;
 }
 
+// Number of slices in `trajectory` which reference each (chunk key, column)
+// pair. Columns which are referenced more than once are decompressed once per
+// sample and then sliced.
+internal::flat_hash_map<std::pair<uint64_t, int>, int> CountColumnReferences(
+    const FlatTrajectory& trajectory) {
+  internal::flat_hash_map<std::pair<uint64_t, int>, int> counts;
+  for (const auto& column : trajectory.columns()) {
+    for (const auto& slice : column.chunk_slices()) {
+      counts[{slice.chunk_key(), slice.index()}]++;
+    }
+  }
+  return counts;
+}
+
 template <typename T>
 tensorflow::Tensor InitializeTensor(T value, int64_t length) {
   tensorflow::Tensor tensor(tensorflow::DataTypeToEnum<T>::v(),
@@ -97,49 +127,97 @@ absl::Status TimestepTrajectoryAsSample(
   int64_t remaining =
       internal::TimestepTrajectoryLength(info.item().flat_trajectory());
 
+  // Column `i` of a timestep trajectory references the tensor `i` of each chunk
+  // so the remaining tensors of the chunks are never decompressed.
+  const int num_columns = info.item().flat_trajectory().columns_size();
+
   for (auto& response : responses) {
     REVERB_CHECK_GT(remaining, 0);
 
+    auto* tensors = response.mutable_data()->mutable_data()->mutable_tensors();
+    if (tensors->size() < num_columns) {
+      return absl::InternalError(absl::StrCat(
+          "Chunk ", response.data().chunk_key(), " has ", tensors->size(),
+          " columns but the trajectory has ", num_columns, " columns."));
+    }
+    tensors->DeleteSubrange(num_columns, tensors->size() - num_columns);
+
     std::vector<tensorflow::Tensor> batches;
-    batches.resize(response.data().data().tensors_size());
+    batches.resize(num_columns);
 
     int64_t batch_size = -1;
 
     // Convert each chunk tensor and release the chunk memory afterwards.
-    int64_t insert_index = response.data().data().tensors_size() - 1;
+    int64_t insert_index = num_columns - 1;
     while (!response.data().data().tensors().empty()) {
       tensorflow::Tensor batch;
 
+      // Number of rows in the chunk and whether `batch` only holds the rows
+      // [offset, offset + remaining) of it.
+      int64_t chunk_length;
+      bool sliced = false;
+
       {
         // This ensures we release the response proto after converting the
-        // result to a tensor.
-        auto chunk = absl::WrapUnique(response.mutable_data()
-                                          ->mutable_data()
-                                          ->mutable_tensors()
-                                          ->ReleaseLast());
-        batch = DecompressTensorFromProto(*chunk);
+        // result to a tensor, unless the tensor shares its content.
+        std::shared_ptr<const tensorflow::TensorProto> chunk(
+            tensors->ReleaseLast());
+        tensorflow::TensorShape shape(chunk->tensor_shape());
+        if (HasCompressedBlocks(response.data(), insert_index) &&
+            !response.data().delta_encoded() && shape.dims() > 0) {
+          // Only the blocks covering the rows of the sample are decompressed.
+          chunk_length = shape.dim_size(0);
+          const int64_t length =
+              std::min<int64_t>(remaining, chunk_length - offset);
+          shape.set_dim(0, length);
+          batch = tensorflow::Tensor(chunk->dtype(), shape);
+          REVERB_RETURN_IF_ERROR(DecompressRowsIntoBuffer(
+              *chunk, response.data().codec(),
+              response.data().compressed_blocks(insert_index), offset, length,
+              &batch));
+          sliced = true;
+        } else if (!AliasUncompressedTensor(*chunk, response.data().codec(),
+                                            chunk, &batch)) {
+          batch = DecompressTensorFromProto(*chunk, response.data().codec());
+        }
+      }
+
+      if (HasDeduplicatedFrames(response.data(), insert_index)) {
+        REVERB_RETURN_IF_ERROR(ExpandDeduplicatedFrames(
+            batch, response.data().deduplicated_frames(insert_index), &batch));
+      }
+
+      if (IsQuantized(response.data(), insert_index)) {
+        REVERB_RETURN_IF_ERROR(DequantizeTensor(
+            batch, response.data().quantized_columns(insert_index), &batch));
       }
 
       if (response.data().delta_encoded()) {
         batch = DeltaEncode(batch, /*encode=*/false);
       }
 
+      if (!sliced) {
+        chunk_length = batch.dim_size(0);
+      }
+
       if (batch_size < 0) {
-        batch_size = batch.dim_size(0);
+        batch_size = chunk_length;
       } else {
-        if (batch_size != batch.dim_size(0)) {
+        if (batch_size != chunk_length) {
           return absl::InternalError(absl::StrCat(
               "Chunks of the same response must have identical batch size, but "
               "first chunk has batch size ",
               batch_size, " while the current chunk has batch size ",
-              batch.dim_size(0)));
+              chunk_length));
         }
       }
 
-      batch =
-          batch.Slice(offset, std::min<int64_t>(offset + remaining, batch_size));
-      if (!batch.IsAligned()) {
-        batch = tensorflow::tensor::DeepCopy(batch);
+      if (!sliced) {
+        batch = batch.Slice(offset,
+                            std::min<int64_t>(offset + remaining, batch_size));
+        if (!batch.IsAligned()) {
+          batch = tensorflow::tensor::DeepCopy(batch);
+        }
       }
 
       batches[insert_index--] = std::move(batch);
@@ -164,6 +242,223 @@ absl::Status TimestepTrajectoryAsSample(
   return absl::OkStatus();
 }
 
+// Writes the rows of the chunk column selected by `slice` into `out`, which
+// must have room for exactly `slice.length()` rows. If the column is neither
+// delta encoded, deduplicated nor quantized then the chunk is decompressed
+// straight into `out` when the slice covers the whole column or when the column
+// has been compressed in blocks, in which case only the blocks covering the
+// slice are decompressed. Otherwise the column is unpacked (through `cache` if
+// non-null) and the rows copied.
+absl::Status UnpackChunkSliceInto(const ChunkData& chunk_data,
+                                  const FlatTrajectory::ChunkSlice& slice,
+                                  internal::DecompressedChunkCache* cache,
+                                  tensorflow::Tensor* out) {
+  if (slice.index() < 0 || slice.index() >= chunk_data.data().tensors_size()) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Cannot unpack column ", slice.index(), " in chunk ",
+        chunk_data.chunk_key(), " which has ",
+        chunk_data.data().tensors_size(), " columns."));
+  }
+
+  const auto& proto = chunk_data.data().tensors(slice.index());
+  tensorflow::TensorShape chunk_shape(proto.tensor_shape());
+  if (cache == nullptr && !chunk_data.delta_encoded() &&
+      HasCompressedBlocks(chunk_data, slice.index()) &&
+      !IsQuantized(chunk_data, slice.index())) {
+    return DecompressRowsIntoBuffer(proto, chunk_data.codec(),
+                                    chunk_data.compressed_blocks(slice.index()),
+                                    slice.offset(), slice.length(), out);
+  }
+  if (cache == nullptr && !chunk_data.delta_encoded() &&
+      !HasCompressedBlocks(chunk_data, slice.index()) &&
+      !HasDeduplicatedFrames(chunk_data, slice.index()) &&
+      !IsQuantized(chunk_data, slice.index()) && slice.offset() == 0 &&
+      chunk_shape.dims() > 0 && slice.length() == chunk_shape.dim_size(0) &&
+      chunk_shape == out->shape()) {
+    return DecompressTensorIntoBuffer(proto, chunk_data.codec(), out);
+  }
+
+  tensorflow::Tensor unpacked;
+  if (cache != nullptr) {
+    REVERB_RETURN_IF_ERROR(
+        cache->UnpackChunkColumnAndSlice(chunk_data, slice, &unpacked));
+  } else {
+    REVERB_RETURN_IF_ERROR(
+        internal::UnpackChunkColumnAndSlice(chunk_data, slice, &unpacked));
+  }
+
+  if (unpacked.dtype() != out->dtype() || unpacked.shape() != out->shape()) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Slice of chunk ", chunk_data.chunk_key(), " has dtype ",
+        tensorflow::DataTypeString(unpacked.dtype()), " and shape ",
+        unpacked.shape().DebugString(), " but expected dtype ",
+        tensorflow::DataTypeString(out->dtype()), " and shape ",
+        out->shape().DebugString(), "."));
+  }
+
+  if (tensorflow::DataTypeCanUseMemcpy(out->dtype())) {
+    auto src = unpacked.tensor_data();
+    std::memcpy(const_cast<char*>(out->tensor_data().data()), src.data(),
+                src.size());
+  } else {
+    auto src = unpacked.flat<tensorflow::tstring>();
+    auto dst = out->flat<tensorflow::tstring>();
+    for (int64_t i = 0; i < src.size(); i++) {
+      dst(i) = src(i);
+    }
+  }
+  return absl::OkStatus();
+}
+
+// Sets `out` to the rows of the chunk column selected by `slice` without
+// copying them (see `AliasUncompressedTensor`). `out` keeps `chunk_data` alive
+// until it is destroyed. Returns false, without modifying `out`, if the column
+// is not stored uncompressed (i.e. with `NONE`), if it has to be decoded (delta
+// encoded, deduplicated or quantized) or if the rows are not aligned.
+bool AliasChunkSlice(std::shared_ptr<const ChunkData> chunk_data,
+                     const FlatTrajectory::ChunkSlice& slice,
+                     tensorflow::Tensor* out) {
+  if (slice.index() < 0 || slice.index() >= chunk_data->data().tensors_size() ||
+      chunk_data->delta_encoded() ||
+      HasDeduplicatedFrames(*chunk_data, slice.index()) ||
+      IsQuantized(*chunk_data, slice.index())) {
+    return false;
+  }
+  const auto& proto = chunk_data->data().tensors(slice.index());
+  tensorflow::Tensor column;
+  if (!AliasUncompressedTensor(proto, chunk_data->codec(), chunk_data,
+                               &column) ||
+      column.dims() == 0 || slice.offset() < 0 || slice.length() <= 0 ||
+      slice.offset() + slice.length() > column.dim_size(0)) {
+    return false;
+  }
+  tensorflow::Tensor rows =
+      column.Slice(slice.offset(), slice.offset() + slice.length());
+  if (!rows.IsAligned()) return false;
+  *out = std::move(rows);
+  return true;
+}
+
+// Gathers the columns of `trajectory` from the chunks returned by `get_chunk`
+// (which maps a chunk key to the chunk, or nullptr if missing). Columns made up
+// of a single slice of a chunk stored uncompressed share the memory of the
+// chunk (see `AliasChunkSlice`). Every other column is allocated once and the
+// slices of its chunks are unpacked directly into it, so no intermediate
+// tensors are created per chunk and no concat is needed. If `cache` is non-null
+// then the chunk columns are decompressed through it. Otherwise chunk columns
+// referenced by more than one slice are decompressed once for the whole
+// trajectory.
+template <typename GetChunk>
+absl::Status GatherTrajectory(const FlatTrajectory& trajectory,
+                              GetChunk get_chunk,
+                              internal::DecompressedChunkCache* cache,
+                              std::vector<tensorflow::Tensor>* columns) {
+  const auto num_references = CountColumnReferences(trajectory);
+  internal::DecompressedChunkCache shared_columns(
+      std::numeric_limits<int64_t>::max());
+
+  columns->clear();
+  columns->reserve(trajectory.columns_size());
+  for (const auto& column : trajectory.columns()) {
+    if (column.chunk_slices().empty()) {
+      return absl::InvalidArgumentError(
+          "Cannot unpack column without any chunk slices.");
+    }
+    for (const auto& slice : column.chunk_slices()) {
+      if (get_chunk(slice.chunk_key()) == nullptr) {
+        return absl::InternalError(absl::StrCat(
+            "Chunk ", slice.chunk_key(), " could not be found when unpacking "
+            "the trajectory."));
+      }
+    }
+
+    tensorflow::Tensor aliased;
+    if (column.chunk_slices_size() == 1 &&
+        AliasChunkSlice(get_chunk(column.chunk_slices(0).chunk_key()),
+                        column.chunk_slices(0), &aliased)) {
+      columns->push_back(std::move(aliased));
+      continue;
+    }
+
+    // The dtype and the shape of a row are taken from the first chunk and the
+    // remaining chunks are validated against them while unpacking.
+    const auto& first_slice = column.chunk_slices(0);
+    const ChunkData& first_chunk = *get_chunk(first_slice.chunk_key());
+    if (first_slice.index() < 0 ||
+        first_slice.index() >= first_chunk.data().tensors_size()) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Cannot unpack column ", first_slice.index(), " in chunk ",
+          first_chunk.chunk_key(), " which has ",
+          first_chunk.data().tensors_size(), " columns."));
+    }
+    tensorflow::TensorShape shape(
+        ColumnShape(first_chunk, first_slice.index()));
+    if (shape.dims() == 0) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Chunk ", first_chunk.chunk_key(), " holds a scalar in column ",
+          first_slice.index(), "."));
+    }
+    int64_t num_rows = 0;
+    for (const auto& slice : column.chunk_slices()) {
+      num_rows += slice.length();
+    }
+    shape.set_dim(0, num_rows);
+
+    tensorflow::Tensor unpacked(ColumnDtype(first_chunk, first_slice.index()),
+                                shape);
+    int64_t row = 0;
+    for (const auto& slice : column.chunk_slices()) {
+      tensorflow::Tensor rows = unpacked.Slice(row, row + slice.length());
+      auto* slice_cache =
+          cache == nullptr &&
+                  num_references.at({slice.chunk_key(), slice.index()}) > 1
+              ? &shared_columns
+              : cache;
+      REVERB_RETURN_IF_ERROR(UnpackChunkSliceInto(
+          *get_chunk(slice.chunk_key()), slice, slice_cache, &rows));
+      row += slice.length();
+    }
+
+    columns->push_back(std::move(unpacked));
+  }
+  return absl::OkStatus();
+}
+
+// Unpacks the chunks of `sampled_item` (see `GatherTrajectory`).
+absl::Status AsSample(const Table::SampledItem& sampled_item,
+                      internal::DecompressedChunkCache* cache,
+                      std::unique_ptr<Sample>* sample) {
+  // The data of the chunks is pinned so it stays in memory (see
+  // `ChunkStore::EnableSpilling`) until the sample has been unpacked.
+  internal::flat_hash_map<uint64_t, std::shared_ptr<const ChunkData>> chunks(
+      sampled_item.chunks.size());
+  for (auto& chunk : sampled_item.chunks) {
+    REVERB_RETURN_IF_ERROR(chunk->PinData(&chunks[chunk->key()]));
+  }
+
+  std::vector<tensorflow::Tensor> flat_trajectory;
+  REVERB_RETURN_IF_ERROR(GatherTrajectory(
+      sampled_item.item.flat_trajectory(),
+      [&chunks](uint64_t key) -> std::shared_ptr<const ChunkData> {
+        auto it = chunks.find(key);
+        return it == chunks.end() ? nullptr : it->second;
+      },
+      cache, &flat_trajectory));
+
+  std::vector<bool> squeeze_columns;
+  for (const auto& col : sampled_item.item.flat_trajectory().columns()) {
+    squeeze_columns.push_back(col.squeeze());
+  }
+
+  *sample = absl::make_unique<deepmind::reverb::Sample>(
+      sampled_item.item.key(), sampled_item.probability,
+      sampled_item.table_size, sampled_item.item.priority(),
+      std::deque<std::vector<tensorflow::Tensor>>({std::move(flat_trajectory)}),
+      std::move(squeeze_columns));
+
+  return absl::OkStatus();
+}
+
 absl::Status AsSample(std::vector<SampleStreamResponse> responses,
                       std::unique_ptr<Sample>* sample) {
   const auto& info = responses.front().info();
@@ -174,34 +469,20 @@ absl::Status AsSample(std::vector<SampleStreamResponse> responses,
     return TimestepTrajectoryAsSample(std::move(responses), sample);
   }
 
-  internal::flat_hash_map<uint64_t, std::unique_ptr<ChunkData>> chunks;
+  internal::flat_hash_map<uint64_t, std::shared_ptr<const ChunkData>> chunks;
   for (auto& response : responses) {
     auto key = response.data().chunk_key();
-    chunks[key] = absl::WrapUnique<ChunkData>(response.release_data());
+    chunks[key] = std::shared_ptr<const ChunkData>(response.release_data());
   }
 
-  // Extract all chunks belonging to this sample.
   std::vector<tensorflow::Tensor> unpacked_columns;
-  for (const auto& column : info.item().flat_trajectory().columns()) {
-    std::vector<tensorflow::Tensor> unpacked_chunks;
-    for (const auto& slice : column.chunk_slices()) {
-      auto it = chunks.find(slice.chunk_key());
-      if (it == chunks.end()) {
-        return absl::InternalError(
-            absl::StrCat("Chunk ", slice.chunk_key(),
-                         " could not be found when unpacking item ",
-                         info.item().key(), "."));
-      }
-      unpacked_chunks.emplace_back();
-      REVERB_RETURN_IF_ERROR(internal::UnpackChunkColumnAndSlice(
-          *it->second, slice, &unpacked_chunks.back()));
-    }
-
-    // TODO(b/177655596): Avoid this concat when timesteps are emitted.
-    unpacked_columns.emplace_back();
-    REVERB_RETURN_IF_ERROR(FromTensorflowStatus(
-        tensorflow::tensor::Concat(unpacked_chunks, &unpacked_columns.back())));
-  }
+  REVERB_RETURN_IF_ERROR(GatherTrajectory(
+      info.item().flat_trajectory(),
+      [&chunks](uint64_t key) -> std::shared_ptr<const ChunkData> {
+        auto it = chunks.find(key);
+        return it == chunks.end() ? nullptr : it->second;
+      },
+      /*cache=*/nullptr, &unpacked_columns));
 
   std::vector<bool> squeeze_columns;
   for (const auto& col : info.item().flat_trajectory().columns()) {
@@ -218,45 +499,80 @@ absl::Status AsSample(std::vector<SampleStreamResponse> responses,
   return absl::OkStatus();
 }
 
-absl::Status AsSample(const Table::SampledItem& sampled_item,
-                      std::unique_ptr<Sample>* sample) {
-  internal::flat_hash_map<uint64_t, std::shared_ptr<ChunkStore::Chunk>> chunks(
-      sampled_item.chunks.size());
-  for (auto& chunk : sampled_item.chunks) {
-    chunks[chunk->key()] = chunk;
+// Fills in the data of `response` from `cache` if it was omitted by the server
+// and otherwise adds the received chunk to `cache`.
+absl::Status ResolveCachedChunk(internal::LruCache<uint64_t, ChunkData>* cache,
+                                SampleStreamResponse* response) {
+  if (response->chunk_cached()) {
+    const ChunkData* chunk = cache->Get(response->data().chunk_key());
+    if (chunk == nullptr) {
+      return absl::InternalError(
+          absl::StrCat("Chunk ", response->data().chunk_key(),
+                       " was sent as cached but is not held by the cache."));
+    }
+    *response->mutable_data() = *chunk;
+    response->set_chunk_cached(false);
+  } else if (cache->capacity() > 0 && response->has_data()) {
+    cache->Put(response->data().chunk_key(), response->data());
   }
+  return absl::OkStatus();
+}
 
-  std::vector<tensorflow::Tensor> flat_trajectory;
-  flat_trajectory.reserve(sampled_item.item.flat_trajectory().columns_size());
+// Converts `SampleStreamResponse`s into `Sample`s on a pool of background
+// threads so that the (Snappy and delta) decoding of large chunks does not
+// limit the rate at which a worker can read from its stream. The pool may be
+// shared by several workers. Each task carries its own completion notification
+// which allows the worker to push the decoded samples in the order they were
+// received.
+//
+// This object is thread-safe.
+class SampleDecoderPool {
+ public:
+  struct Task {
+    // Responses which make up the sample. Consumed by the decoding.
+    std::vector<SampleStreamResponse> responses;
 
-  for (const auto& column : sampled_item.item.flat_trajectory().columns()) {
-    std::vector<tensorflow::Tensor> unpacked_chunks;
-    unpacked_chunks.reserve(column.chunk_slices_size());
+    // Result of the decoding. Must only be accessed once `done` is notified.
+    absl::Status status;
+    std::unique_ptr<Sample> sample;
 
-    for (const auto& slice : column.chunk_slices()) {
-      unpacked_chunks.emplace_back();
-      REVERB_RETURN_IF_ERROR(internal::UnpackChunkColumnAndSlice(
-          chunks[slice.chunk_key()]->data(), slice, &unpacked_chunks.back()));
+    absl::Notification done;
+  };
+
+  explicit SampleDecoderPool(int num_threads) : tasks_(num_threads * 4) {
+    REVERB_CHECK_GE(num_threads, 1);
+    threads_.reserve(num_threads);
+    for (int i = 0; i < num_threads; i++) {
+      threads_.push_back(internal::StartThread("SampleDecoder", [this] {
+        std::shared_ptr<Task> task;
+        while (tasks_.Pop(&task)) {
+          internal::ScopedTrace trace("SampleStream/Decode");
+          task->status = AsSample(std::move(task->responses), &task->sample);
+          task->done.Notify();
+          task = nullptr;
+        }
+      }));
     }
+  }
 
-    flat_trajectory.emplace_back();
-    REVERB_RETURN_IF_ERROR(FromTensorflowStatus(
-        tensorflow::tensor::Concat(unpacked_chunks, &flat_trajectory.back())));
+  // Stops the threads. Tasks which have not been decoded yet are dropped
+  // without being notified.
+  ~SampleDecoderPool() {
+    tasks_.Close();
+    threads_.clear();
   }
 
-  std::vector<bool> squeeze_columns;
-  for (const auto& col : sampled_item.item.flat_trajectory().columns()) {
-    squeeze_columns.push_back(col.squeeze());
+  // Schedules `task` to be decoded. Blocks if the pool is saturated.
+  void Schedule(std::shared_ptr<Task> task) {
+    REVERB_CHECK(tasks_.Push(std::move(task)));
   }
 
-  *sample = absl::make_unique<deepmind::reverb::Sample>(
-      sampled_item.item.key(), sampled_item.probability,
-      sampled_item.table_size, sampled_item.item.priority(),
-      std::deque<std::vector<tensorflow::Tensor>>({std::move(flat_trajectory)}),
-      std::move(squeeze_columns));
+  int num_threads() const { return threads_.size(); }
 
-  return absl::OkStatus();
-}
+ private:
+  internal::Queue<std::shared_ptr<Task>> tasks_;
+  std::vector<std::unique_ptr<internal::Thread>> threads_;
+};
 
 class GrpcSamplerWorker : public SamplerWorker {
  public:
@@ -264,11 +580,20 @@ class GrpcSamplerWorker : public SamplerWorker {
   GrpcSamplerWorker(
       std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface> stub,
       std::string table_name, int64_t samples_per_request,
-      int flexible_batch_size)
+      int flexible_batch_size, int max_cached_chunks,
+      std::shared_ptr<SampleDecoderPool> decoder_pool,
+      int64_t max_in_flight_bytes, bool trim_chunks,
+      SampleGroupOptions sample_group, std::vector<TableWeight> mixture)
       : stub_(std::move(stub)),
         table_name_(std::move(table_name)),
         samples_per_request_(samples_per_request),
-        flexible_batch_size_(flexible_batch_size) {}
+        flexible_batch_size_(flexible_batch_size),
+        max_cached_chunks_(max_cached_chunks),
+        decoder_pool_(std::move(decoder_pool)),
+        max_in_flight_bytes_(max_in_flight_bytes),
+        trim_chunks_(trim_chunks),
+        sample_group_(std::move(sample_group)),
+        mixture_(std::move(mixture)) {}
 
   // Cancels the stream and marks the worker as closed. Active and future
   // calls to `OpenStreamAndFetch` will return status `CANCELLED`.
@@ -278,6 +603,30 @@ class GrpcSamplerWorker : public SamplerWorker {
     if (context_ != nullptr) context_->TryCancel();
   }
 
+  absl::Status MutatePriorities(absl::Span<const KeyWithPriority> updates,
+                                absl::Span<const uint64_t> deletes) override {
+    absl::MutexLock lock(&mu_);
+    if (closed_) {
+      return absl::CancelledError("`Close` called on Sampler.");
+    }
+    pending_updates_.insert(pending_updates_.end(), updates.begin(),
+                            updates.end());
+    pending_deletes_.insert(pending_deletes_.end(), deletes.begin(),
+                            deletes.end());
+    return absl::OkStatus();
+  }
+
+  // Sets the adjustment applied to the info of the samples fetched by future
+  // calls to `FetchSamples`. Used when the table is sharded across several
+  // servers to report the probability and table size of the whole table
+  // rather than of the shard. Must not be called concurrently with
+  // `FetchSamples`.
+  void SetShardAdjustment(double probability_scale,
+                          int64_t table_size_offset) {
+    probability_scale_ = probability_scale;
+    table_size_offset_ = table_size_offset;
+  }
+
   // Opens a new `SampleStream` to a server and requests `num_samples` samples
   // in batches with maximum size `samples_per_request`, with a timeout to
   // pass to the `Table::Sample` call. Once complete (either
@@ -286,8 +635,12 @@ class GrpcSamplerWorker : public SamplerWorker {
   // with the status of the stream.  A timeout will cause the Status type
   // DeadlineExceeded to be returned.
   std::pair<int64_t, absl::Status> FetchSamples(
-      internal::Queue<std::unique_ptr<Sample>>* queue, int64_t num_samples,
+      internal::MpmcQueue<std::unique_ptr<Sample>>* queue, int64_t num_samples,
       absl::Duration rate_limiter_timeout) override {
+    internal::ScopedTrace trace([&] {
+      return absl::StrCat("GrpcSamplerWorker::FetchSamples#table=",
+                          table_name_, ",num_samples=", num_samples, "#");
+    });
     std::unique_ptr<grpc::ClientReaderWriterInterface<SampleStreamRequest,
                                                       SampleStreamResponse>>
         stream;
@@ -296,48 +649,171 @@ class GrpcSamplerWorker : public SamplerWorker {
       if (closed_) {
         return {0, absl::CancelledError("`Close` called on Sampler.")};
       }
+      internal::ScopedTrace open_trace("SampleStream/Open");
       context_ = absl::make_unique<grpc::ClientContext>();
       context_->set_wait_for_ready(false);
       stream = stub_->SampleStream(context_.get());
     }
 
+    // Chunks received on the stream which the server may refer to by key only.
+    // The server tracks the same cache so the two never diverge.
+    internal::LruCache<uint64_t, ChunkData> chunk_cache(max_cached_chunks_);
+
+    // Samples which have been received but not yet pushed to `queue`, in the
+    // order they were received. Without a decoder pool the samples are decoded
+    // inline and pushed right away.
+    const size_t max_decoding =
+        decoder_pool_ == nullptr ? 0 : 2 * decoder_pool_->num_threads();
+    std::deque<std::shared_ptr<SampleDecoderPool::Task>> decoding;
+
     int64_t num_samples_returned = 0;
-    while (num_samples_returned < num_samples) {
-      SampleStreamRequest request;
-      request.set_table(table_name_);
-      request.set_num_samples(
-          std::min(samples_per_request_, num_samples - num_samples_returned));
-      request.mutable_rate_limiter_timeout()->set_milliseconds(
-          NonnegativeDurationToInt64Millis(rate_limiter_timeout));
-      request.set_flexible_batch_size(flexible_batch_size_);
-
-      if (!stream->Write(request)) {
-        return {num_samples_returned, FromGrpcStatus(stream->Finish())};
-      }
 
-      for (int64_t i = 0; i < request.num_samples(); i++) {
-        std::vector<SampleStreamResponse> responses;
-        while (!SampleIsDone(responses)) {
-          SampleStreamResponse response;
-          if (!stream->Read(&response)) {
-            return {num_samples_returned, FromGrpcStatus(stream->Finish())};
+    // Pushes decoded samples to `queue` until at most `max_pending` samples
+    // are being decoded.
+    auto push_decoded = [&](size_t max_pending) -> absl::Status {
+      while (decoding.size() > max_pending) {
+        auto task = std::move(decoding.front());
+        decoding.pop_front();
+        task->done.WaitForNotification();
+        REVERB_RETURN_IF_ERROR(task->status);
+        internal::ScopedTrace push_trace("Sampler/QueuePush");
+        if (!queue->Push(std::move(task->sample))) {
+          return absl::CancelledError("`Close` called on Sampler");
+        }
+        ++num_samples_returned;
+      }
+      return absl::OkStatus();
+    };
+
+    // Samples which were fully received before the stream failed are still
+    // returned.
+    auto finish_stream = [&]() -> std::pair<int64_t, absl::Status> {
+      auto status = push_decoded(0);
+      if (!status.ok()) return {num_samples_returned, status};
+      return {num_samples_returned, FromGrpcStatus(stream->Finish())};
+    };
+
+    // When pipelining, the next request is sent once at most half of the
+    // samples of the window are outstanding so the server never runs out of
+    // requests. Otherwise the next request is only sent once all the samples
+    // of the previous one have been received.
+    const bool pipelined = max_in_flight_bytes_ > 0;
+    int64_t num_samples_requested = 0;
+    int64_t num_samples_received = 0;
+
+    // Time the last request was sent when no samples were outstanding. Used to
+    // measure the round trip time.
+    absl::optional<absl::Time> round_trip_start;
+
+    // Time when the first sample of the stream was received. Used to measure
+    // the rate at which samples arrive.
+    absl::Time first_sample_received;
+
+    while (num_samples_received < num_samples) {
+      const int64_t window = pipelined ? InFlightWindow() : samples_per_request_;
+      const int64_t outstanding = num_samples_requested - num_samples_received;
+      if (num_samples_requested < num_samples &&
+          (outstanding == 0 || (pipelined && outstanding <= window / 2))) {
+        SampleStreamRequest request;
+        request.set_table(table_name_);
+        request.set_max_cached_chunks(max_cached_chunks_);
+        request.set_trim_chunks(trim_chunks_);
+        if (num_samples_requested == 0 && !sample_group_.id().empty()) {
+          *request.mutable_sample_group() = sample_group_;
+        }
+        if (num_samples_requested == 0) {
+          request.mutable_mixture()->Add(mixture_.begin(), mixture_.end());
+        }
+        {
+          absl::MutexLock lock(&mu_);
+          for (auto& update : pending_updates_) {
+            *request.add_priority_updates() = std::move(update);
           }
-          responses.push_back(std::move(response));
+          request.mutable_priority_deletes()->Add(pending_deletes_.begin(),
+                                                  pending_deletes_.end());
+          pending_updates_.clear();
+          pending_deletes_.clear();
+        }
+        request.set_num_samples(
+            std::min(window, num_samples - num_samples_requested));
+        request.mutable_rate_limiter_timeout()->set_milliseconds(
+            NonnegativeDurationToInt64Millis(rate_limiter_timeout));
+        request.set_flexible_batch_size(flexible_batch_size_);
+
+        if (!stream->Write(request)) {
+          return finish_stream();
         }
+        internal::TraceInstant([&request] {
+          return absl::StrCat("SampleStream/RequestSent#num_samples=",
+                              request.num_samples(), "#");
+        });
+        if (outstanding == 0) round_trip_start = absl::Now();
+        num_samples_requested += request.num_samples();
+      }
 
-        std::unique_ptr<Sample> sample;
-        auto status = AsSample(std::move(responses), &sample);
-        if (!status.ok()) {
+      auto task = std::make_shared<SampleDecoderPool::Task>();
+      int64_t sample_bytes = 0;
+      internal::ScopedTrace receive_trace("SampleStream/Receive");
+      while (!SampleIsDone(task->responses)) {
+        SampleStreamResponse response;
+        if (!stream->Read(&response)) {
+          return finish_stream();
+        }
+        if (num_samples_received == 0 && task->responses.empty()) {
+          internal::TraceInstant("SampleStream/FirstResponse");
+        }
+        if (pipelined) sample_bytes += response.ByteSizeLong();
+        if (auto status = ResolveCachedChunk(&chunk_cache, &response);
+            !status.ok()) {
           return {num_samples_returned, status};
         }
-        if (!queue->Push(std::move(sample))) {
-          return {num_samples_returned,
-                  absl::CancelledError("`Close` called on Sampler")};
+        task->responses.push_back(std::move(response));
+      }
+      ++num_samples_received;
+      receive_trace.Stop();
+
+      if (probability_scale_ != 1 || table_size_offset_ != 0) {
+        auto* info = task->responses.front().mutable_info();
+        info->set_probability(info->probability() * probability_scale_);
+        info->set_table_size(info->table_size() + table_size_offset_);
+      }
+
+      if (pipelined) {
+        const absl::Time now = absl::Now();
+        if (round_trip_start.has_value()) {
+          round_trip_time_ = now - *round_trip_start;
+          round_trip_start = absl::nullopt;
         }
-        ++num_samples_returned;
+        if (num_samples_received == 1) {
+          first_sample_received = now;
+        } else if (now > first_sample_received) {
+          samples_per_second_ =
+              (num_samples_received - 1) /
+              absl::ToDoubleSeconds(now - first_sample_received);
+        }
+        bytes_per_sample_ = bytes_per_sample_ == 0
+                                ? sample_bytes
+                                : 0.9 * bytes_per_sample_ + 0.1 * sample_bytes;
+      }
+
+      decoding.push_back(task);
+      if (decoder_pool_ != nullptr) {
+        decoder_pool_->Schedule(std::move(task));
+      } else {
+        internal::ScopedTrace decode_trace("SampleStream/Decode");
+        task->status = AsSample(std::move(task->responses), &task->sample);
+        task->done.Notify();
+      }
+
+      if (auto status = push_decoded(max_decoding); !status.ok()) {
+        return {num_samples_returned, status};
       }
     }
 
+    if (auto status = push_decoded(0); !status.ok()) {
+      return {num_samples_returned, status};
+    }
+
     if (num_samples_returned != num_samples) {
       return {num_samples_returned,
               absl::InternalError(
@@ -348,6 +824,26 @@ class GrpcSamplerWorker : public SamplerWorker {
   }
 
  private:
+  // Number of samples to request in each request when pipelining. The window
+  // is sized to cover the samples that arrive during one round trip (with a
+  // margin of 2x) but never less than `samples_per_request_`. The window is
+  // capped by `max_in_flight_bytes_` unless that would make it smaller than
+  // `samples_per_request_`.
+  int64_t InFlightWindow() const {
+    int64_t window = samples_per_request_;
+    if (round_trip_time_ > absl::ZeroDuration() && samples_per_second_ > 0) {
+      window = std::max<int64_t>(
+          window, std::ceil(2 * samples_per_second_ *
+                            absl::ToDoubleSeconds(round_trip_time_)));
+    }
+    if (bytes_per_sample_ > 0) {
+      window = std::min<int64_t>(
+          window, std::max<int64_t>(samples_per_request_,
+                                    max_in_flight_bytes_ / bytes_per_sample_));
+    }
+    return window;
+  }
+
   // Stub used to open `SampleStream`-streams to a server.
   std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface> stub_;
 
@@ -362,6 +858,46 @@ class GrpcSamplerWorker : public SamplerWorker {
   // `Table::SampleFlexibleBatch` (lock not released between samples).
   const int flexible_batch_size_;
 
+  // Number of chunks to keep cached for the duration of each stream.
+  const int max_cached_chunks_;
+
+  // Pool used to decode the received samples. If nullptr then the samples are
+  // decoded by the thread reading from the stream.
+  std::shared_ptr<SampleDecoderPool> decoder_pool_;
+
+  // Maximum number of bytes worth of samples to keep in flight when
+  // pipelining requests. 0 disables pipelining.
+  const int64_t max_in_flight_bytes_;
+
+  // Whether the server is asked to trim chunks to the referenced rows and
+  // columns (see `SampleStreamRequest.trim_chunks`).
+  const bool trim_chunks_;
+
+  // Priority mutations to send with the next request. See
+  // `Sampler::MutatePriorities`.
+  std::vector<KeyWithPriority> pending_updates_ ABSL_GUARDED_BY(mu_);
+  std::vector<uint64_t> pending_deletes_ ABSL_GUARDED_BY(mu_);
+
+  // Group joined by the streams of the worker. Only sent with the first
+  // request of each stream (see `SampleStreamRequest.sample_group`).
+  const SampleGroupOptions sample_group_;
+
+  // Tables sampled by the streams of the worker. Only sent with the first
+  // request of each stream (see `SampleStreamRequest.mixture`).
+  const std::vector<TableWeight> mixture_;
+
+  // Observed round trip time (from sending a request to receiving its first
+  // sample), the rate at which samples are received and the average size of a
+  // sample. Only updated when pipelining requests and only accessed by the
+  // thread running `FetchSamples`.
+  absl::Duration round_trip_time_ = absl::ZeroDuration();
+  double samples_per_second_ = 0;
+  double bytes_per_sample_ = 0;
+
+  // See `SetShardAdjustment`.
+  double probability_scale_ = 1;
+  int64_t table_size_offset_ = 0;
+
   // Context of the active stream.
   std::unique_ptr<grpc::ClientContext> context_ ABSL_GUARDED_BY(mu_);
 
@@ -371,11 +907,180 @@ class GrpcSamplerWorker : public SamplerWorker {
   absl::Mutex mu_;
 };
 
+// Samples from a table which is sharded across several servers.
+//
+// Every call to `FetchSamples` refreshes the state of the shards through
+// `ServerInfo` and distributes the requested samples across the shards such
+// that each sample is drawn from a shard with probability proportional to the
+// total sampler weight (e.g. the priority mass) of the shard. The shards are
+// then sampled from concurrently, each through its own stream, and all of
+// them push to the same queue. The probability and table size of the samples
+// are adjusted to describe the table as a whole (see `ShardedTable`).
+class ShardedGrpcSamplerWorker : public SamplerWorker {
+ public:
+  static constexpr auto kServerInfoTimeout = absl::Seconds(10);
+
+  ShardedGrpcSamplerWorker(
+      std::vector<std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface>>
+          stubs,
+      std::string table_name,
+      std::vector<std::unique_ptr<GrpcSamplerWorker>> shards)
+      : stubs_(std::move(stubs)),
+        table_name_(std::move(table_name)),
+        shards_(std::move(shards)) {
+    REVERB_CHECK_EQ(stubs_.size(), shards_.size());
+    REVERB_CHECK(!shards_.empty());
+  }
+
+  void Cancel() override {
+    for (auto& shard : shards_) {
+      shard->Cancel();
+    }
+  }
+
+  // The shard holding each key is not known so the mutations are sent to all
+  // of them. Keys which do not exist are ignored by the servers.
+  absl::Status MutatePriorities(absl::Span<const KeyWithPriority> updates,
+                                absl::Span<const uint64_t> deletes) override {
+    for (auto& shard : shards_) {
+      REVERB_RETURN_IF_ERROR(shard->MutatePriorities(updates, deletes));
+    }
+    return absl::OkStatus();
+  }
+
+  std::pair<int64_t, absl::Status> FetchSamples(
+      internal::MpmcQueue<std::unique_ptr<Sample>>* queue, int64_t num_samples,
+      absl::Duration rate_limiter_timeout) override {
+    std::vector<double> weights;
+    std::vector<int64_t> sizes;
+    if (auto status = GetShardWeights(&weights, &sizes); !status.ok()) {
+      return {0, status};
+    }
+    const double total_weight =
+        std::accumulate(weights.begin(), weights.end(), 0.0);
+    const int64_t total_size =
+        std::accumulate(sizes.begin(), sizes.end(), int64_t{0});
+
+    // Draw the shard of every sample. If all shards are empty then the shards
+    // are selected uniformly and we wait for their rate limiters.
+    std::vector<int64_t> shard_samples(shards_.size(), 0);
+    for (int64_t i = 0; i < num_samples; i++) {
+      if (total_weight == 0) {
+        shard_samples[absl::Uniform<size_t>(bit_gen_, 0, shards_.size())]++;
+        continue;
+      }
+      // Rounding errors could result in `target` not being covered by any
+      // shard in which case the last shard with a positive weight is used.
+      double target = absl::Uniform<double>(bit_gen_, 0, total_weight);
+      size_t index = 0;
+      for (size_t j = 0; j < shards_.size(); j++) {
+        if (weights[j] == 0) continue;
+        index = j;
+        if (target < weights[j]) break;
+        target -= weights[j];
+      }
+      shard_samples[index]++;
+    }
+
+    std::vector<std::pair<int64_t, absl::Status>> results(
+        shards_.size(), {0, absl::OkStatus()});
+    std::vector<std::unique_ptr<internal::Thread>> threads;
+    for (size_t i = 0; i < shards_.size(); i++) {
+      if (shard_samples[i] == 0) continue;
+      shards_[i]->SetShardAdjustment(
+          total_weight == 0 ? 1.0 / shards_.size() : weights[i] / total_weight,
+          total_size - sizes[i]);
+      threads.push_back(internal::StartThread(
+          "ShardedSamplerWorker",
+          [this, i, queue, &results, &shard_samples, rate_limiter_timeout] {
+            results[i] = shards_[i]->FetchSamples(queue, shard_samples[i],
+                                                  rate_limiter_timeout);
+          }));
+    }
+    threads.clear();  // Joins the threads.
+
+    // Errors which are not transient take precedence as they stop the sampler.
+    int64_t num_samples_returned = 0;
+    absl::Status status;
+    for (const auto& result : results) {
+      num_samples_returned += result.first;
+      if (!result.second.ok() &&
+          (status.ok() || absl::IsUnavailable(status))) {
+        status = result.second;
+      }
+    }
+    return {num_samples_returned, status};
+  }
+
+ private:
+  // Populates `weights` and `sizes` with the total sampler weight and size of
+  // the table on each shard. Shards which cannot be reached or which do not
+  // have the table are given zero weight.
+  absl::Status GetShardWeights(std::vector<double>* weights,
+                               std::vector<int64_t>* sizes) {
+    weights->assign(stubs_.size(), 0);
+    sizes->assign(stubs_.size(), 0);
+    bool found = false;
+    absl::Status last_error;
+    for (size_t i = 0; i < stubs_.size(); i++) {
+      grpc::ClientContext context;
+      context.set_deadline(absl::ToChronoTime(absl::Now() + kServerInfoTimeout));
+      ServerInfoRequest request;
+      ServerInfoResponse response;
+      auto status =
+          FromGrpcStatus(stubs_[i]->ServerInfo(&context, request, &response));
+      if (!status.ok()) {
+        last_error = status;
+        continue;
+      }
+      for (const auto& info : response.table_info()) {
+        if (info.name() != table_name_) continue;
+        found = true;
+        (*weights)[i] = info.total_sampler_weight();
+        (*sizes)[i] = info.current_size();
+      }
+    }
+    if (!found) {
+      if (!last_error.ok()) return last_error;
+      return absl::NotFoundError(absl::StrCat(
+          "Table ", table_name_, " was not found on any of the ",
+          stubs_.size(), " servers."));
+    }
+
+    // Selectors fall back to uniform sampling when all items have zero weight
+    // so we do the same when selecting the shard.
+    if (std::all_of(weights->begin(), weights->end(),
+                    [](double w) { return w == 0; })) {
+      for (size_t i = 0; i < sizes->size(); i++) {
+        (*weights)[i] = (*sizes)[i];
+      }
+    }
+    return absl::OkStatus();
+  }
+
+  // Stubs of the servers holding a shard each. Used to call `ServerInfo`.
+  std::vector<std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface>>
+      stubs_;
+
+  // Name of the `Table` to sample from.
+  const std::string table_name_;
+
+  // Workers sampling from the shard with the same index.
+  std::vector<std::unique_ptr<GrpcSamplerWorker>> shards_;
+
+  // Only used by the thread running `FetchSamples`.
+  absl::BitGen bit_gen_;
+};
+
 class LocalSamplerWorker : public SamplerWorker {
  public:
-  // Constructs a new worker without creating a stream to a server.
-  LocalSamplerWorker(std::shared_ptr<Table> table, int flexible_batch_size)
-      : table_(table), flexible_batch_size_(flexible_batch_size) {
+  // Constructs a new worker without creating a stream to a server. If `cache`
+  // is non-null then the sampled chunks are decompressed through it.
+  LocalSamplerWorker(std::shared_ptr<Table> table, int flexible_batch_size,
+                     std::shared_ptr<internal::DecompressedChunkCache> cache)
+      : table_(table),
+        flexible_batch_size_(flexible_batch_size),
+        cache_(std::move(cache)) {
     REVERB_CHECK_GE(flexible_batch_size_, 1);
   }
 
@@ -384,8 +1089,13 @@ class LocalSamplerWorker : public SamplerWorker {
     closed_ = true;
   }
 
+  absl::Status MutatePriorities(absl::Span<const KeyWithPriority> updates,
+                                absl::Span<const uint64_t> deletes) override {
+    return table_->MutateItems(updates, deletes);
+  }
+
   std::pair<int64_t, absl::Status> FetchSamples(
-      internal::Queue<std::unique_ptr<Sample>>* queue, int64_t num_samples,
+      internal::MpmcQueue<std::unique_ptr<Sample>>* queue, int64_t num_samples,
       absl::Duration rate_limiter_timeout) override {
     static const auto kWakeupTimeout = absl::Seconds(3);
     auto final_deadline = absl::Now() + rate_limiter_timeout;
@@ -428,7 +1138,7 @@ class LocalSamplerWorker : public SamplerWorker {
       // Push sampled items to queue.
       for (const auto& item : items) {
         std::unique_ptr<Sample> sample;
-        if (status = AsSample(item, &sample); !status.ok()) {
+        if (status = AsSample(item, cache_.get(), &sample); !status.ok()) {
           return {num_samples_returned, status};
         }
         if (!queue->Push(std::move(sample))) {
@@ -451,6 +1161,7 @@ class LocalSamplerWorker : public SamplerWorker {
  private:
   std::shared_ptr<Table> table_;
   const int flexible_batch_size_;
+  const std::shared_ptr<internal::DecompressedChunkCache> cache_;
   bool closed_ ABSL_GUARDED_BY(mu_) = false;
   absl::Mutex mu_;
 };
@@ -459,9 +1170,11 @@ int64_t GetNumWorkers(const Sampler::Options& options) {
   int64_t max_samples = options.max_samples == Sampler::kUnlimitedMaxSamples
                           ? INT64_MAX
                           : options.max_samples;
-  int64_t num_workers = options.num_workers == Sampler::kAutoSelectValue
-                          ? Sampler::kDefaultNumWorkers
-                          : options.num_workers;
+  int64_t num_workers = options.num_workers != Sampler::kAutoSelectValue
+                            ? options.num_workers
+                        : options.autotune_num_workers
+                            ? Sampler::kDefaultMaxAutotunedNumWorkers
+                            : Sampler::kDefaultNumWorkers;
 
   // If a subset of the workers are able to fetch all of `max_samples` in the
   // first batch then there is no point in creating all of them.
@@ -471,22 +1184,81 @@ int64_t GetNumWorkers(const Sampler::Options& options) {
                       max_samples / options.max_in_flight_samples_per_worker));
 }
 
+SampleGroupOptions MakeSampleGroupOptions(const Sampler::Options& options) {
+  SampleGroupOptions group;
+  if (!options.sample_group.empty()) {
+    group.set_id(options.sample_group);
+    group.set_size(options.sample_group_size);
+    group.set_rank(options.sample_group_rank);
+    group.set_partition(options.partition_sample_group);
+  }
+  return group;
+}
+
+std::vector<TableWeight> MakeMixture(const Sampler::Options& options) {
+  std::vector<TableWeight> mixture;
+  mixture.reserve(options.mixture.size());
+  for (const auto& [table, weight] : options.mixture) {
+    TableWeight& table_weight = mixture.emplace_back();
+    table_weight.set_table(table);
+    table_weight.set_weight(weight);
+  }
+  return mixture;
+}
+
 std::vector<std::unique_ptr<SamplerWorker>> MakeGrpcWorkers(
     std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface> stub,
     const std::string& table_name, const Sampler::Options& options) {
   int64_t num_workers = GetNumWorkers(options);
   REVERB_CHECK_GE(num_workers, 1);
+  std::shared_ptr<SampleDecoderPool> decoder_pool;
+  if (options.num_decoder_threads > 0) {
+    decoder_pool =
+        std::make_shared<SampleDecoderPool>(options.num_decoder_threads);
+  }
   std::vector<std::unique_ptr<SamplerWorker>> workers;
   workers.reserve(num_workers);
   for (int i = 0; i < num_workers; i++) {
     workers.push_back(absl::make_unique<GrpcSamplerWorker>(
         stub, table_name, options.max_in_flight_samples_per_worker,
-        options.flexible_batch_size));
+        options.flexible_batch_size, options.max_cached_chunks, decoder_pool,
+        options.max_in_flight_bytes_per_worker, options.trim_chunks,
+        MakeSampleGroupOptions(options), MakeMixture(options)));
   }
 
   return workers;
 }
 
+std::vector<std::unique_ptr<SamplerWorker>> MakeShardedGrpcWorkers(
+    std::vector<std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface>>
+        stubs,
+    const std::string& table_name, const Sampler::Options& options) {
+  REVERB_CHECK(!stubs.empty()) << "At least one stub must be provided.";
+  int64_t num_workers = GetNumWorkers(options);
+  REVERB_CHECK_GE(num_workers, 1);
+  std::shared_ptr<SampleDecoderPool> decoder_pool;
+  if (options.num_decoder_threads > 0) {
+    decoder_pool =
+        std::make_shared<SampleDecoderPool>(options.num_decoder_threads);
+  }
+  std::vector<std::unique_ptr<SamplerWorker>> workers;
+  workers.reserve(num_workers);
+  for (int i = 0; i < num_workers; i++) {
+    std::vector<std::unique_ptr<GrpcSamplerWorker>> shards;
+    shards.reserve(stubs.size());
+    for (const auto& stub : stubs) {
+      shards.push_back(absl::make_unique<GrpcSamplerWorker>(
+          stub, table_name, options.max_in_flight_samples_per_worker,
+          options.flexible_batch_size, options.max_cached_chunks, decoder_pool,
+          options.max_in_flight_bytes_per_worker, options.trim_chunks,
+          MakeSampleGroupOptions(options), MakeMixture(options)));
+    }
+    workers.push_back(absl::make_unique<ShardedGrpcSamplerWorker>(
+        stubs, table_name, std::move(shards)));
+  }
+  return workers;
+}
+
 std::vector<std::unique_ptr<SamplerWorker>> MakeLocalWorkers(
     std::shared_ptr<Table> table, const Sampler::Options& options) {
   int64_t num_workers = GetNumWorkers(options);
@@ -506,11 +1278,17 @@ std::vector<std::unique_ptr<SamplerWorker>> MakeLocalWorkers(
   flexible_batch_size =
       std::min(flexible_batch_size, options.max_in_flight_samples_per_worker);
 
+  std::shared_ptr<internal::DecompressedChunkCache> cache;
+  if (options.max_decompressed_chunk_cache_bytes > 0) {
+    cache = std::make_shared<internal::DecompressedChunkCache>(
+        options.max_decompressed_chunk_cache_bytes);
+  }
+
   std::vector<std::unique_ptr<SamplerWorker>> workers;
   workers.reserve(num_workers);
   for (int i = 0; i < num_workers; ++i) {
-    workers.push_back(
-        absl::make_unique<LocalSamplerWorker>(table, flexible_batch_size));
+    workers.push_back(absl::make_unique<LocalSamplerWorker>(
+        table, flexible_batch_size, cache));
   }
   return workers;
 }
@@ -534,9 +1312,12 @@ Sampler::Sampler(std::vector<std::unique_ptr<SamplerWorker>> workers,
                                   ? kDefaultMaxSamplesPerStream
                                   : options.max_samples_per_stream),
       rate_limiter_timeout_(options.rate_limiter_timeout),
+      batch_allocator_(options.batch_allocator),
       workers_(std::move(workers)),
+      autotune_num_workers_(options.autotune_num_workers),
       active_sample_(nullptr),
-      samples_(std::max<int>(options.num_workers, 1)),
+      samples_(std::max<int>(
+          autotune_num_workers_ ? workers_.size() : options.num_workers, 1)),
       dtypes_and_shapes_(std::move(dtypes_and_shapes)) {
   REVERB_CHECK_GT(max_samples_, 0);
   REVERB_CHECK_GT(options.max_in_flight_samples_per_worker, 0);
@@ -545,19 +1326,36 @@ Sampler::Sampler(std::vector<std::unique_ptr<SamplerWorker>> workers,
   REVERB_CHECK(options.flexible_batch_size == kAutoSelectValue ||
                options.flexible_batch_size > 0);
 
+  {
+    absl::MutexLock lock(&mu_);
+    num_active_workers_ = autotune_num_workers_ ? 1 : workers_.size();
+  }
   for (int i = 0; i < workers_.size(); i++) {
     worker_threads_.push_back(internal::StartThread(
         absl::StrCat("SamplerWorker_", i),
-        [this, worker = workers_[i].get()] { RunWorker(worker); }));
+        [this, worker = workers_[i].get(), i] { RunWorker(worker, i); }));
   }
 }
 
+Sampler::Sampler(
+    std::vector<std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface>>
+        stubs,
+    const std::string& table_name, const Options& options,
+    internal::DtypesAndShapes dtypes_and_shapes)
+    : Sampler(MakeShardedGrpcWorkers(std::move(stubs), table_name, options),
+              table_name, options, std::move(dtypes_and_shapes)) {}
+
 Sampler::Sampler(std::shared_ptr<Table> table, const Options& options,
                  internal::DtypesAndShapes dtypes_and_shapes)
     : Sampler(MakeLocalWorkers(table, options), table->name(), options,
               std::move(dtypes_and_shapes)) {}
 
-Sampler::~Sampler() { Close(); }
+Sampler::~Sampler() {
+  Close();
+  for (auto& shapes : validated_shapes_) {
+    delete shapes.load(std::memory_order_relaxed);
+  }
+}
 
 absl::Status Sampler::GetNextTimestep(
     std::vector<tensorflow::Tensor>* data, bool* end_of_sequence) {
@@ -583,8 +1381,38 @@ absl::Status Sampler::GetNextTimestep(
   return absl::OkStatus();
 }
 
+absl::Status Sampler::GetNextTimesteps(int max_timesteps,
+                                       std::vector<tensorflow::Tensor>* data,
+                                       bool* end_of_sequence) {
+  if (max_timesteps < 1) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("max_timesteps (", max_timesteps, ") must be >= 1"));
+  }
+  REVERB_RETURN_IF_ERROR(MaybeSampleNext());
+  if (!active_sample_->is_composed_of_timesteps()) {
+    return absl::InvalidArgumentError(
+        "Sampled trajectory cannot be decomposed into timesteps.");
+  }
+
+  *data = active_sample_->GetNextTimesteps(max_timesteps);
+  REVERB_RETURN_IF_ERROR(
+      ValidateAgainstOutputSpec(*data, ValidationMode::kBatchedTimestep));
+
+  if (end_of_sequence != nullptr) {
+    *end_of_sequence = active_sample_->is_end_of_sample();
+  }
+
+  if (active_sample_->is_end_of_sample()) {
+    absl::WriterMutexLock lock(&mu_);
+    if (++returned_ == max_samples_) samples_.Close();
+  }
+
+  return absl::OkStatus();
+}
+
 absl::Status Sampler::GetNextSample(
     std::vector<tensorflow::Tensor>* data) {
+  internal::ScopedTrace trace("Sampler::GetNextSample");
   std::unique_ptr<Sample> sample;
   REVERB_RETURN_IF_ERROR(PopNextSample(&sample));
   REVERB_RETURN_IF_ERROR(sample->AsBatchedTimesteps(data));
@@ -597,6 +1425,7 @@ absl::Status Sampler::GetNextSample(
 }
 
 absl::Status Sampler::GetNextTrajectory(std::vector<tensorflow::Tensor>* data) {
+  internal::ScopedTrace trace("Sampler::GetNextTrajectory");
   std::unique_ptr<Sample> sample;
   REVERB_RETURN_IF_ERROR(PopNextSample(&sample));
   REVERB_RETURN_IF_ERROR(sample->AsTrajectory(data));
@@ -608,6 +1437,43 @@ absl::Status Sampler::GetNextTrajectory(std::vector<tensorflow::Tensor>* data) {
   return absl::OkStatus();
 }
 
+absl::Status Sampler::GetNextBatch(int batch_size,
+                                   std::vector<tensorflow::Tensor>* data) {
+  if (batch_size < 1) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("batch_size (", batch_size, ") must be >= 1"));
+  }
+  {
+    absl::ReaderMutexLock lock(&mu_);
+    if (max_samples_ != kUnlimitedMaxSamples &&
+        max_samples_ - returned_ < batch_size) {
+      return absl::OutOfRangeError(absl::StrCat(
+          "Only ", max_samples_ - returned_, " of `max_samples` (",
+          max_samples_, ") remains which is less than the batch size (",
+          batch_size, ")."));
+    }
+  }
+
+  std::vector<tensorflow::Tensor> batch;
+  for (int i = 0; i < batch_size; i++) {
+    std::unique_ptr<Sample> sample;
+    REVERB_RETURN_IF_ERROR(PopNextSample(&sample));
+    if (i == 0) {
+      REVERB_RETURN_IF_ERROR(sample->AllocateTrajectoryBatch(
+          batch_size, &batch, batch_allocator_));
+    }
+    REVERB_RETURN_IF_ERROR(sample->WriteTrajectoryToBatch(i, &batch));
+
+    absl::WriterMutexLock lock(&mu_);
+    if (++returned_ == max_samples_) samples_.Close();
+  }
+
+  REVERB_RETURN_IF_ERROR(
+      ValidateAgainstOutputSpec(batch, ValidationMode::kBatchedTrajectory));
+  std::swap(batch, *data);
+  return absl::OkStatus();
+}
+
 absl::Status Sampler::ValidateAgainstOutputSpec(
     const std::vector<tensorflow::Tensor>& data, Sampler::ValidationMode mode) {
   if (!dtypes_and_shapes_) {
@@ -625,11 +1491,25 @@ absl::Status Sampler::ValidateAgainstOutputSpec(
         internal::DtypesShapesString(internal::SpecsFromTensors(data))));
   }
 
+  auto& cached = validated_shapes_[static_cast<int>(mode)];
+  const std::vector<tensorflow::TensorShape>* validated =
+      cached.load(std::memory_order_acquire);
+  if (validated != nullptr) {
+    bool matches = true;
+    for (int i = 4; matches && i < data.size(); ++i) {
+      matches = data[i].dtype() == dtypes_and_shapes_->at(i).dtype &&
+                (*validated)[i] == data[i].shape();
+    }
+    if (matches) return absl::OkStatus();
+  }
+
   for (int i = 4; i < data.size(); ++i) {
     tensorflow::TensorShape elem_shape;
-    if (mode == ValidationMode::kBatchedTimestep) {
+    if (mode == ValidationMode::kBatchedTimestep ||
+        mode == ValidationMode::kBatchedTrajectory) {
       // Remove the outer dimension from data[i].shape() so we can properly
-      // compare against the spec (which doesn't have the sequence dimension).
+      // compare against the spec (which doesn't have the sequence or batch
+      // dimension).
       elem_shape = data[i].shape();
       if (elem_shape.dims() == 0) {
         return absl::InvalidArgumentError(
@@ -660,6 +1540,20 @@ absl::Status Sampler::ValidateAgainstOutputSpec(
           internal::DtypesShapesString(*dtypes_and_shapes_)));
     }
   }
+
+  // Only the first data to pass is cached. Should another caller publish its
+  // shapes first then those are kept.
+  if (validated == nullptr) {
+    auto shapes = absl::make_unique<std::vector<tensorflow::TensorShape>>();
+    shapes->reserve(data.size());
+    for (const auto& tensor : data) {
+      shapes->push_back(tensor.shape());
+    }
+    if (cached.compare_exchange_strong(validated, shapes.get(),
+                                       std::memory_order_acq_rel)) {
+      shapes.release();
+    }
+  }
   return absl::OkStatus();
 }
 
@@ -667,6 +1561,18 @@ bool Sampler::should_stop_workers() const {
   return closed_ || returned_ == max_samples_ || !worker_status_.ok();
 }
 
+absl::Status Sampler::MutatePriorities(
+    absl::Span<const KeyWithPriority> updates,
+    absl::Span<const uint64_t> deletes) {
+  {
+    absl::ReaderMutexLock lock(&mu_);
+    if (closed_) {
+      return absl::CancelledError("`Close` called on Sampler.");
+    }
+  }
+  return workers_.front()->MutatePriorities(updates, deletes);
+}
+
 void Sampler::Close() {
   {
     absl::WriterMutexLock lock(&mu_);
@@ -691,7 +1597,14 @@ absl::Status Sampler::MaybeSampleNext() {
 }
 
 absl::Status Sampler::PopNextSample(std::unique_ptr<Sample>* sample) {
-  if (samples_.Pop(sample)) return absl::OkStatus();
+  if (autotune_num_workers_) {
+    MaybeAutotuneNumWorkers(samples_.size());
+  }
+  {
+    // Time the consumer spends waiting for the workers.
+    internal::ScopedTrace trace("Sampler/QueuePop");
+    if (samples_.Pop(sample)) return absl::OkStatus();
+  }
 
   absl::ReaderMutexLock lock(&mu_);
   if (returned_ == max_samples_) {
@@ -703,9 +1616,33 @@ absl::Status Sampler::PopNextSample(std::unique_ptr<Sample>* sample) {
   return worker_status_;
 }
 
-void Sampler::RunWorker(SamplerWorker* worker) {
-  auto trigger = [this]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
-    return should_stop_workers() || requested_ < max_samples_;
+void Sampler::MaybeAutotuneNumWorkers(int num_queued_samples) {
+  autotune_num_pops_++;
+  if (num_queued_samples == 0) {
+    autotune_num_empty_++;
+  } else if (num_queued_samples >= workers_.size()) {
+    autotune_num_full_++;
+  }
+  if (autotune_num_pops_ < kAutotuneWindow) return;
+
+  absl::MutexLock lock(&mu_);
+  if (autotune_num_empty_ * 10 > autotune_num_pops_ &&
+      num_active_workers_ < workers_.size()) {
+    num_active_workers_++;
+  } else if (autotune_num_full_ * 10 >= autotune_num_pops_ * 9 &&
+             num_active_workers_ > 1) {
+    // The deactivated worker finishes the stream it is currently fetching.
+    num_active_workers_--;
+  }
+  autotune_num_pops_ = 0;
+  autotune_num_empty_ = 0;
+  autotune_num_full_ = 0;
+}
+
+void Sampler::RunWorker(SamplerWorker* worker, int index) {
+  auto trigger = [this, index]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    return should_stop_workers() ||
+           (requested_ < max_samples_ && index < num_active_workers_);
   };
 
   while (true) {
@@ -798,6 +1735,50 @@ std::vector<tensorflow::Tensor> Sample::GetNextTimestep() {
   return result;
 }
 
+std::vector<tensorflow::Tensor> Sample::GetNextTimesteps(
+    int64_t max_timesteps) {
+  REVERB_CHECK(!is_end_of_sample());
+  REVERB_CHECK(is_composed_of_timesteps());
+  REVERB_CHECK_GT(max_timesteps, 0);
+
+  const int64_t chunk_length = chunks_.front().front().dim_size(0);
+  const int64_t length =
+      std::min(max_timesteps, chunk_length - next_timestep_index_);
+
+  // Construct the output tensors.
+  std::vector<tensorflow::Tensor> result;
+  result.reserve(num_data_tensors_ + 4);
+  result.push_back(InitializeTensor(key_, length));
+  result.push_back(InitializeTensor(probability_, length));
+  result.push_back(InitializeTensor(table_size_, length));
+  result.push_back(InitializeTensor(priority_, length));
+
+  for (auto& t : chunks_.front()) {
+    // The tensors of a chunk which is returned in full are passed on as is.
+    if (length == chunk_length) {
+      result.push_back(std::move(t));
+      continue;
+    }
+    auto slice = t.Slice(next_timestep_index_, next_timestep_index_ + length);
+    if (slice.IsAligned()) {
+      result.push_back(std::move(slice));
+    } else {
+      result.push_back(tensorflow::tensor::DeepCopy(slice));
+    }
+  }
+
+  // Advance the iterator.
+  next_timestep_index_ += length;
+  if (next_timestep_index_ == chunk_length) {
+    // Go to the next chunk.
+    chunks_.pop_front();
+    next_timestep_index_ = 0;
+  }
+  next_timestep_called_ = true;
+
+  return result;
+}
+
 bool Sample::is_end_of_sample() const { return chunks_.empty(); }
 
 bool Sample::is_composed_of_timesteps() const {
@@ -926,6 +1907,134 @@ absl::Status Sample::AsTrajectory(std::vector<tensorflow::Tensor>* data) {
   return absl::OkStatus();
 }
 
+absl::Status Sample::TrajectoryColumnShape(
+    int column, tensorflow::TensorShape* shape) const {
+  *shape = chunks_.front()[column].shape();
+  int64_t length = 0;
+  for (const auto& batches : chunks_) {
+    length += batches[column].dim_size(0);
+  }
+  shape->set_dim(0, length);
+  if (column < squeeze_columns_.size() && squeeze_columns_[column]) {
+    if (length != 1) {
+      return absl::InternalError(absl::StrCat(
+          "Tried to squeeze column with batch size ", length, "."));
+    }
+    shape->RemoveDim(0);
+  }
+  return absl::OkStatus();
+}
+
+absl::Status Sample::AllocateTrajectoryBatch(
+    int batch_size, std::vector<tensorflow::Tensor>* batch,
+    tensorflow::Allocator* allocator) const {
+  if (next_timestep_called_ || chunks_.empty()) {
+    return absl::DataLossError(
+        "Sample::AllocateTrajectoryBatch: Some time steps have been lost.");
+  }
+
+  std::vector<tensorflow::Tensor> tensors;
+  tensors.reserve(num_data_tensors_ + 4);
+  const tensorflow::TensorShape batch_shape({batch_size});
+  tensors.emplace_back(tensorflow::DT_UINT64, batch_shape);
+  tensors.emplace_back(tensorflow::DT_DOUBLE, batch_shape);
+  tensors.emplace_back(tensorflow::DT_INT64, batch_shape);
+  tensors.emplace_back(tensorflow::DT_DOUBLE, batch_shape);
+
+  for (int i = 0; i < num_data_tensors_; i++) {
+    tensorflow::TensorShape column_shape;
+    REVERB_RETURN_IF_ERROR(TrajectoryColumnShape(i, &column_shape));
+    tensorflow::TensorShape shape = batch_shape;
+    shape.AppendShape(column_shape);
+    if (allocator != nullptr) {
+      tensors.emplace_back(allocator, chunks_.front()[i].dtype(), shape);
+    } else {
+      tensors.emplace_back(chunks_.front()[i].dtype(), shape);
+    }
+  }
+
+  std::swap(tensors, *batch);
+  return absl::OkStatus();
+}
+
+absl::Status Sample::WriteTrajectoryToBatch(
+    int64_t index, std::vector<tensorflow::Tensor>* batch) {
+  if (next_timestep_called_ || chunks_.empty()) {
+    return absl::DataLossError(
+        "Sample::WriteTrajectoryToBatch: Some time steps have been lost.");
+  }
+  if (batch->size() != num_data_tensors_ + 4) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Sample has ", num_data_tensors_ + 4, " tensors but the batch has ",
+        batch->size(), "."));
+  }
+  if (index < 0 || index >= (*batch)[0].dim_size(0)) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Index ", index, " is out of range for batch of size ",
+                     (*batch)[0].dim_size(0), "."));
+  }
+
+  for (int i = 0; i < num_data_tensors_; i++) {
+    const auto& column = (*batch)[i + 4];
+    tensorflow::TensorShape expected = column.shape();
+    expected.RemoveDim(0);
+    tensorflow::TensorShape shape;
+    REVERB_RETURN_IF_ERROR(TrajectoryColumnShape(i, &shape));
+    if (column.dtype() != chunks_.front()[i].dtype() || expected != shape) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "All samples of a batch must have the same dtypes and shapes but "
+          "column ", i, " of the batch has (dtype, shape): (",
+          tensorflow::DataTypeString(column.dtype()), ", ",
+          expected.DebugString(), ") and the sample has: (",
+          tensorflow::DataTypeString(chunks_.front()[i].dtype()), ", ",
+          shape.DebugString(), ")."));
+    }
+    if (!tensorflow::DataTypeCanUseMemcpy(column.dtype()) &&
+        column.dtype() != tensorflow::DT_STRING) {
+      return absl::UnimplementedError(
+          absl::StrCat("Batching of tensors with dtype ",
+                       tensorflow::DataTypeString(column.dtype()),
+                       " is not supported."));
+    }
+  }
+
+  (*batch)[0].flat<tensorflow::uint64>()(index) = key_;
+  (*batch)[1].flat<double>()(index) = probability_;
+  (*batch)[2].flat<tensorflow::int64>()(index) = table_size_;
+  (*batch)[3].flat<double>()(index) = priority_;
+
+  // Offset (in elements) of the next chunk of each column.
+  std::vector<int64_t> offsets(num_data_tensors_);
+  for (int i = 0; i < num_data_tensors_; i++) {
+    offsets[i] = index * (*batch)[i + 4].NumElements() /
+                 (*batch)[i + 4].dim_size(0);
+  }
+
+  while (!chunks_.empty()) {
+    for (int i = 0; i < num_data_tensors_; i++) {
+      const auto& src = chunks_.front()[i];
+      auto& dst = (*batch)[i + 4];
+      if (dst.dtype() == tensorflow::DT_STRING) {
+        auto src_t = src.flat<tensorflow::tstring>();
+        auto dst_t = dst.flat<tensorflow::tstring>();
+        for (int64_t j = 0; j < src_t.size(); j++) {
+          dst_t(offsets[i] + j) = src_t(j);
+        }
+      } else {
+        const int64_t element_size = tensorflow::DataTypeSize(dst.dtype());
+        absl::string_view src_data = src.tensor_data();
+        std::memcpy(const_cast<char*>(dst.tensor_data().data()) +
+                        offsets[i] * element_size,
+                    src_data.data(), src_data.size());
+      }
+      offsets[i] += src.NumElements();
+    }
+    chunks_.pop_front();
+  }
+
+  return absl::OkStatus();
+}
+
 absl::Status Sampler::Options::Validate() const {
   if (max_samples < 1 && max_samples != kUnlimitedMaxSamples) {
     return absl::InvalidArgumentError(
@@ -958,6 +2067,54 @@ absl::Status Sampler::Options::Validate() const {
         absl::StrCat("flexible_batch_size (", flexible_batch_size, ") must be ",
                      kAutoSelectValue, " or >= 1"));
   }
+  if (max_in_flight_bytes_per_worker < 0) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("max_in_flight_bytes_per_worker (",
+                     max_in_flight_bytes_per_worker, ") must be >= 0"));
+  }
+  if (num_decoder_threads < 0) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "num_decoder_threads (", num_decoder_threads, ") must be >= 0"));
+  }
+  if (max_cached_chunks < 0) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "max_cached_chunks (", max_cached_chunks, ") must be >= 0"));
+  }
+  if (max_decompressed_chunk_cache_bytes < 0) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("max_decompressed_chunk_cache_bytes (",
+                     max_decompressed_chunk_cache_bytes, ") must be >= 0"));
+  }
+  if (!sample_group.empty()) {
+    if (sample_group_size < 1) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "sample_group_size (", sample_group_size, ") must be >= 1"));
+    }
+    if (sample_group_rank < 0 || sample_group_rank >= sample_group_size) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "sample_group_rank (", sample_group_rank, ") must be >= 0 and < ",
+          "sample_group_size (", sample_group_size, ")"));
+    }
+  }
+  if (!mixture.empty()) {
+    if (!sample_group.empty()) {
+      return absl::InvalidArgumentError(
+          "mixture must not be combined with sample_group");
+    }
+    double total_weight = 0;
+    for (const auto& [table, weight] : mixture) {
+      if (!std::isfinite(weight) || weight < 0) {
+        return absl::InvalidArgumentError(absl::StrCat(
+            "mixture weight of table ", table, " (", weight,
+            ") must be finite and >= 0"));
+      }
+      total_weight += weight;
+    }
+    if (total_weight <= 0) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "sum of mixture weights (", total_weight, ") must be > 0"));
+    }
+  }
   return absl::OkStatus();
 }
 
@@ -17,20 +17,26 @@
 
 #include <stddef.h>
 
+#include <array>
+#include <atomic>
 #include <deque>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "absl/base/attributes.h"
 #include <cstdint>
 #include "absl/status/status.h"
 #include "absl/time/time.h"
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
 #include "reverb/cc/platform/thread.h"
 #include "reverb/cc/reverb_service.grpc.pb.h"
-#include "reverb/cc/support/queue.h"
+#include "reverb/cc/support/lock_free_queue.h"
 #include "reverb/cc/support/signature.h"
 #include "reverb/cc/table.h"
+#include "tensorflow/core/framework/allocator.h"
 #include "tensorflow/core/framework/tensor.h"
 
 namespace deepmind {
@@ -62,6 +68,20 @@ class Sample {
   // CHECK-fails if the entire sample has already been returned.
   std::vector<tensorflow::Tensor> GetNextTimestep();
 
+  // Returns up to `max_timesteps` consecutive time steps from this sample,
+  // batched along a new leading dimension, as a flat sequence of tensors. The
+  // time steps never span more than one chunk so the data tensors are slices
+  // of the decoded chunk rather than copies (unless a slice is not aligned).
+  // CHECK-fails if the entire sample has already been returned.
+  //
+  // Return:
+  //   K+4 tensors each having a leading dimension of size n, where
+  //   1 <= n <= `max_timesteps`. The first four tensors are 1D tensors with
+  //   the key, sample probability, table size and priority, as by
+  //   `AsBatchedTimesteps`, and the last K tensors hold the data of the time
+  //   steps.
+  std::vector<tensorflow::Tensor> GetNextTimesteps(int64_t max_timesteps);
+
   // Returns the entire sample as a flat sequence of batched tensors.
   //
   // Fails with `DataLossError` if `GetNextTimestep()` has already been called
@@ -88,6 +108,34 @@ class Sample {
   //   last K tensors holds the actual trajectory data.
   absl::Status AsTrajectory(std::vector<tensorflow::Tensor>* data);
 
+  // Allocates the tensors of a batch of `batch_size` trajectories with the same
+  // shapes as this sample.
+  //
+  // Return:
+  //   K+4 tensors each having a leading dimension of size `batch_size`. The
+  //   first four tensors are 1D tensors which will hold the key, sample
+  //   probability, table size and priority of each sample. The last K tensors
+  //   have shape [batch_size, ...trajectory_column_shape] (see
+  //   `AsTrajectory`).
+  //
+  // The trajectory columns are allocated with `allocator`, or with the default
+  // CPU allocator if nullptr.
+  absl::Status AllocateTrajectoryBatch(
+      int batch_size, std::vector<tensorflow::Tensor>* batch,
+      tensorflow::Allocator* allocator = nullptr) const;
+
+  // Writes the sample into row `index` of a batch allocated by
+  // `AllocateTrajectoryBatch`. The content of the chunks is copied straight
+  // into the batch tensors so no per sample tensors are allocated. The
+  // tensors of the sample are released as they are copied.
+  //
+  // Fails with `DataLossError` if `GetNextTimestep()` has already been called
+  // on this sample.
+  // Fails with `InvalidArgumentError` if the shapes or dtypes of the sample
+  // does not match those of `batch`.
+  absl::Status WriteTrajectoryToBatch(int64_t index,
+                                      std::vector<tensorflow::Tensor>* batch);
+
   // Returns true if the end of the sample has been reached.
   ABSL_MUST_USE_RESULT bool is_end_of_sample() const;
 
@@ -95,6 +143,10 @@ class Sample {
   ABSL_MUST_USE_RESULT bool is_composed_of_timesteps() const;
 
  private:
+  // Shape of column `column` of the trajectory (see `AsTrajectory`).
+  absl::Status TrajectoryColumnShape(int column,
+                                     tensorflow::TensorShape* shape) const;
+
   // The key of the replay item this time step was sampled from.
   tensorflow::uint64 key_;
   // The probability of the replay item this time step was sampled from.
@@ -136,8 +188,16 @@ class SamplerWorker {
   // Attempt to sample up to `num_samples` and push results to `queue`. Returns
   // when `num_samples` pushed to `queue` or error encountered.
   virtual std::pair<int64_t, absl::Status> FetchSamples(
-      internal::Queue<std::unique_ptr<Sample>>* queue, int64_t num_samples,
+      internal::MpmcQueue<std::unique_ptr<Sample>>* queue, int64_t num_samples,
       absl::Duration rate_limiter_timeout) = 0;
+
+  // Updates the priorities of and deletes items in the table sampled from.
+  // Workers which sample over gRPC send the mutations with the next request
+  // of their stream (see `SampleStreamRequest.priority_updates`) rather than
+  // applying them before returning.
+  virtual absl::Status MutatePriorities(
+      absl::Span<const KeyWithPriority> updates,
+      absl::Span<const uint64_t> deletes) = 0;
 };
 
 // The `Sampler` class should be used to retrieve samples from a
@@ -202,6 +262,14 @@ class Sampler {
   // By default samples are fetched one by one.
   static const int kDefaultFlexibleBatchSize = 1;
 
+  // Maximum number of workers when `autotune_num_workers` is set and
+  // `num_workers` is `kAutoSelectValue`.
+  static const int kDefaultMaxAutotunedNumWorkers = 8;
+
+  // Number of popped samples over which the occupancy of the sample queue is
+  // observed before the number of active workers is adjusted.
+  static const int kAutotuneWindow = 100;
+
   struct Options {
     // `max_samples` is the maximum number of samples the object will return.
     // Must be a positive number or `kUnlimitedMaxSamples`.
@@ -209,7 +277,8 @@ class Sampler {
 
     // `max_in_flight_samples_per_worker` is the number of samples requested by
     // a worker in each batch. A new batch is requested once all the requested
-    // samples have been received.
+    // samples have been received (see `max_in_flight_bytes_per_worker` for
+    // pipelining the batches).
     int max_in_flight_samples_per_worker = 100;
 
     // `num_workers` is the number of worker threads started.
@@ -247,6 +316,112 @@ class Sampler {
     // When set to `kAutoSelectValue`, `kDefaultFlexibleBatchSize` is used.
     int flexible_batch_size = kAutoSelectValue;
 
+    // `num_decoder_threads` is the number of threads used to decompress and
+    // unpack the samples received by the workers. The decoding of large chunks
+    // is CPU intensive so without decoder threads a single stream can be
+    // limited by the speed of one core rather than by the network. The threads
+    // are shared by all workers and every worker still returns its samples in
+    // the order they were received.
+    //
+    // Ignored by samplers which sample directly from a local table. Defaults
+    // to 0 which decodes the samples on the worker threads.
+    int num_decoder_threads = 0;
+
+    // `max_cached_chunks` is the number of chunks each worker keeps cached for
+    // the duration of a stream. The server only sends the key of chunks which
+    // are still in the cache so chunks shared by consecutive samples (e.g.
+    // overlapping trajectories from the same episode) are only transferred
+    // once per stream. The cached chunks are kept in memory (compressed) so
+    // the value should be scaled with the expected chunk size.
+    //
+    // Ignored by samplers which sample directly from a local table. Defaults
+    // to 0 which disables the cache.
+    int max_cached_chunks = 0;
+
+    // `trim_chunks` asks the server to only send the rows and columns of each
+    // chunk which are referenced by the sampled item rather than the whole
+    // chunk. Rows are only trimmed from columns compressed in blocks (see
+    // `TrajectoryWriter::Options::rows_per_block`) so this mostly helps when
+    // short trajectories are sampled from long chunks. Trimmed chunks are
+    // cached (see `max_cached_chunks`) separately from the full chunk.
+    //
+    // Ignored by samplers which sample directly from a local table. Defaults
+    // to false.
+    bool trim_chunks = false;
+
+    // `max_in_flight_bytes_per_worker` enables pipelining of the requests sent
+    // by the gRPC workers when > 0. Instead of waiting for all the samples of
+    // a request before sending the next one, the next request is sent once
+    // half of the previous one has been received which removes the stall at
+    // every request boundary. The number of samples per request is tuned from
+    // the observed round trip time and rate of incoming samples so that the
+    // stream stays busy on high latency connections. It starts at (and never
+    // goes below) `max_in_flight_samples_per_worker` and is capped so that
+    // roughly `max_in_flight_bytes_per_worker` bytes of samples are requested
+    // at a time.
+    //
+    // Ignored by samplers which sample directly from a local table. Defaults
+    // to 0 which disables pipelining.
+    int64_t max_in_flight_bytes_per_worker = 0;
+
+    // `max_decompressed_chunk_cache_bytes` enables a cache of decompressed
+    // chunks when > 0. The cache is shared by all workers and holds at most
+    // this many bytes of decompressed tensors, evicting the least recently
+    // used chunks once full. Chunks which are sampled repeatedly (e.g. when
+    // `max_times_sampled` > 1 or the trajectories overlap) are then only
+    // decompressed once.
+    //
+    // Only used by samplers which sample directly from a local table. Defaults
+    // to 0 which disables the cache.
+    int64_t max_decompressed_chunk_cache_bytes = 0;
+
+    // `batch_allocator` allocates the trajectory columns returned by
+    // `GetNextBatch`. The samples are decoded straight into these tensors so
+    // an allocator of pinned (page-locked) host memory lets a learner copy, or
+    // export through DLPack, the batch to an accelerator without staging it in
+    // yet another host buffer. Must outlive the `Sampler`.
+    //
+    // Defaults to nullptr which uses the default CPU allocator.
+    tensorflow::Allocator* batch_allocator = nullptr;
+
+    // `autotune_num_workers` adjusts the number of workers which fetch samples
+    // to the rate at which they are consumed. `num_workers` (or
+    // `kDefaultMaxAutotunedNumWorkers` if `kAutoSelectValue`) workers are
+    // created but only one is active at first. Every `kAutotuneWindow` popped
+    // samples another worker is activated if the caller often had to wait for
+    // a sample, and a worker is deactivated if the queue of samples was
+    // almost always full, i.e. the workers were waiting for the caller.
+    //
+    // Must not be used with tables which return items in FIFO order (e.g.
+    // queues) since more than one worker can reorder the items.
+    bool autotune_num_workers = false;
+
+    // `sample_group` makes the streams of the sampler join the sample group
+    // with this id on the server (see `SampleGroupOptions`). The samplers of a
+    // data parallel learner (one per replica, each with its own
+    // `sample_group_rank`) then share the batches sampled from the table
+    // rather than each sampling the table separately. If
+    // `partition_sample_group` is true then every batch is split between the
+    // ranks, otherwise every rank receives all of it.
+    //
+    // Ignored by samplers which sample directly from a local table. Defaults
+    // to the empty string which does not join a group.
+    std::string sample_group;
+    int sample_group_size = 1;
+    int sample_group_rank = 0;
+    bool partition_sample_group = false;
+
+    // `mixture` makes the streams of the sampler sample from several tables at
+    // once, drawing the table of every item with probability proportional to
+    // its weight (see `SampleStreamRequest.mixture`). The table name passed to
+    // the sampler is then only used to validate the signature. Sharded
+    // samplers send the same mixture to every shard.
+    //
+    // Must not be combined with `sample_group`. Ignored by samplers which
+    // sample directly from a local table. Defaults to empty which samples only
+    // from the named table.
+    std::vector<std::pair<std::string, double>> mixture;
+
     // Checks that field values are valid and returns `InvalidArgument` if any
     // field value invalid.
     absl::Status Validate() const;
@@ -262,6 +437,25 @@ class Sampler {
           const std::string& table_name, const Options& options,
           internal::DtypesAndShapes dtypes_and_shapes = absl::nullopt);
 
+  // Constructs a new `Sampler` for a table which is sharded across several
+  // servers.
+  //
+  // `stubs` are connected gRPC stubs to each of the servers. Unlike a single
+  // load balanced `stub`, every worker holds a stream to each server and
+  // draws the shard of each sample proportionally to the total sampler weight
+  // (e.g. the priority mass) of the table on the server, as reported by
+  // `ServerInfo`. The weights are refreshed every `max_samples_per_stream`
+  // samples. The probability and table size of the samples describe the
+  // table as a whole.
+  // `table_name` is the name of the `Table` to sample from.
+  // `options` defines details of how to samples.
+  // `dtypes_and_shapes` describes the output signature (if any) to expect.
+  Sampler(std::vector<
+              std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface>>
+              stubs,
+          const std::string& table_name, const Options& options,
+          internal::DtypesAndShapes dtypes_and_shapes = absl::nullopt);
+
   // Constructs a new `Sampler` which samples directly from local `table`.
   //
   // `table` is the table to sample from.
@@ -278,6 +472,17 @@ class Sampler {
   absl::Status GetNextTimestep(std::vector<tensorflow::Tensor>* data,
                                bool* end_of_sequence);
 
+  // Like `GetNextTimestep` but returns up to `max_timesteps` consecutive
+  // timesteps of the same sample at once, batched along a new leading
+  // dimension (see `Sample::GetNextTimesteps`). The timesteps are sliced out
+  // of the same chunk so the result is the same as calling `GetNextTimestep`
+  // up to `max_timesteps` times and concatenating the results column wise,
+  // but without the per call overhead. `end_of_sequence` is set if the last
+  // of the returned timesteps is the last timestep of the sample.
+  absl::Status GetNextTimesteps(int max_timesteps,
+                                std::vector<tensorflow::Tensor>* data,
+                                bool* end_of_sequence);
+
   // Blocks until a complete (timestep sequence) sample has been retrieved or
   // until a non transient error is encountered or `Close` has been called.
   //
@@ -301,6 +506,35 @@ class Sampler {
   //   has been deleted.
   absl::Status GetNextTrajectory(std::vector<tensorflow::Tensor>* data);
 
+  // Blocks until `batch_size` complete samples have been retrieved or until a
+  // non transient error is encountered or `Close` has been called.
+  //
+  // The samples are unpacked as by `GetNextTrajectory` but batched along a new
+  // leading dimension, i.e. the result is 4+K tensors where the first 4 are
+  // 1D tensors of length `batch_size` and the remaining K have shape
+  // [batch_size, ...trajectory_column_shape]. The batch is allocated once and
+  // the data of each sample is copied straight into its slot which avoids
+  // allocating (and later concatenating) tensors for every sample.
+  //
+  // All samples of the batch must have the same shapes. Fails with
+  // `OutOfRangeError` without popping any samples if fewer than `batch_size`
+  // samples remain before `max_samples` is reached.
+  absl::Status GetNextBatch(int batch_size,
+                            std::vector<tensorflow::Tensor>* data);
+
+  // Updates the priorities of and deletes items in the table sampled from.
+  // Samplers which sample over gRPC send the mutations with the next request
+  // of the first worker's stream, which saves a `MutatePriorities` call per
+  // learner step. The mutations are then applied under the same lock
+  // acquisition as the next sample on the server but are not visible before
+  // that request has been sent. Mutations sent on a stream which fails may
+  // not be applied. Samplers of a local table apply the mutations right away.
+  //
+  // Returns `CancelledError` if the sampler has been closed.
+  absl::Status MutatePriorities(absl::Span<const KeyWithPriority> updates,
+                                absl::Span<const uint64_t> deletes)
+      ABSL_LOCKS_EXCLUDED(mu_);
+
   // Cancels all workers and joins their threads. Any blocking or future call
   // to `GetNextTimestep` or `GetNextSample` will return CancelledError without
   // blocking.
@@ -320,18 +554,31 @@ class Sampler {
     // timestep and so do does the provided data.
     kTimestep,
 
-    // `GetNextSample` is the caller. The signature represents a single timestep
-    // and the data is a sequence of batched timesteps.
+    // `GetNextSample` or `GetNextTimesteps` is the caller. The signature
+    // represents a single timestep and the data is a sequence of batched
+    // timesteps.
     kBatchedTimestep,
 
     // `GetNextTrajectory` is the caller. The signature represents a complete
     // trajectory and so does the data.
     kTrajectory,
+
+    // `GetNextBatch` is the caller. The signature represents a complete
+    // trajectory and the data is a batch of trajectories.
+    kBatchedTrajectory,
   };
   absl::Status ValidateAgainstOutputSpec(
       const std::vector<tensorflow::Tensor>& data, ValidationMode mode);
 
-  void RunWorker(SamplerWorker* worker) ABSL_LOCKS_EXCLUDED(mu_);
+  // Fetches samples with `worker` whenever the worker is active, i.e. if
+  // `index` < `num_active_workers_`.
+  void RunWorker(SamplerWorker* worker, int index) ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Records whether the caller had to wait for the next sample (i.e. the queue
+  // was empty) or the workers had to wait for the caller (the queue was full)
+  // and adjusts `num_active_workers_` at the end of every window. See
+  // `Options::autotune_num_workers`.
+  void MaybeAutotuneNumWorkers(int num_queued_samples) ABSL_LOCKS_EXCLUDED(mu_);
 
   // If `active_sample_` has been read, blocks until a sample has been retrieved
   // (popped from `samples_`) and populates `active_sample_`.
@@ -371,6 +618,10 @@ class Sampler {
   // The rate limiter timeout argument that all workers pass to SampleStream.
   const absl::Duration rate_limiter_timeout_;
 
+  // Allocator of the trajectory columns returned by `GetNextBatch`. See
+  // `Options::batch_allocator`.
+  tensorflow::Allocator* const batch_allocator_;
+
   // The number of complete samples that have been successfully requested.
   int64_t requested_ ABSL_GUARDED_BY(mu_) = 0;
 
@@ -382,6 +633,17 @@ class Sampler {
   std::vector<std::unique_ptr<SamplerWorker>> workers_;
   std::vector<std::unique_ptr<internal::Thread>> worker_threads_;
 
+  // Number of workers (starting from the first) which fetch samples. Equal to
+  // the number of workers unless `autotune_num_workers_` is set.
+  const bool autotune_num_workers_;
+  int num_active_workers_ ABSL_GUARDED_BY(mu_) = 0;
+
+  // Observations of the current autotune window. Not protected by mutex as
+  // concurrent calls to the sampling methods are not supported.
+  int autotune_num_pops_ = 0;
+  int autotune_num_empty_ = 0;
+  int autotune_num_full_ = 0;
+
   // OK or the first non transient error encountered by a worker.
   absl::Status worker_status_ ABSL_GUARDED_BY(mu_);
 
@@ -391,7 +653,7 @@ class Sampler {
   std::unique_ptr<Sample> active_sample_;
 
   // Queue of complete samples (timesteps batched up by into sequence).
-  internal::Queue<std::unique_ptr<Sample>> samples_;
+  internal::MpmcQueue<std::unique_ptr<Sample>> samples_;
 
   // The dtypes and shapes users expect from either `GetNextTimestep` or
   // `GetNextSample` (whichever they plan to call).  May be absl::nullopt,
@@ -399,6 +661,16 @@ class Sampler {
   const internal::DtypesAndShapes dtypes_and_shapes_;
   const internal::DtypesAndShapes dtypes_and_shapes_for_sequence_;
 
+  // Shapes of the tensors of the first data which passed
+  // `ValidateAgainstOutputSpec`, per `ValidationMode`. The samples of a table
+  // almost always have the same shapes (and the dtypes and shapes they are
+  // validated against never change) so only data whose shapes differ from the
+  // cached ones has to be checked against `dtypes_and_shapes_`. The shapes are
+  // published once and never modified afterwards so concurrent callers read
+  // them without a lock. Owned by the sampler.
+  std::array<std::atomic<const std::vector<tensorflow::TensorShape>*>, 4>
+      validated_shapes_ = {};
+
   // Set if `Close` called.
   bool closed_ ABSL_GUARDED_BY(mu_) = false;
 
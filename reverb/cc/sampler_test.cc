@@ -14,7 +14,12 @@
 
 #include "reverb/cc/sampler.h"
 
+#include <atomic>
+#include <cfloat>
+#include <cstring>
 #include <list>
+#include <numeric>
+#include <string>
 #include <vector>
 
 #include "grpcpp/client_context.h"
@@ -24,6 +29,7 @@
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include "absl/base/thread_annotations.h"
+#include "absl/memory/memory.h"
 #include "absl/synchronization/mutex.h"
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
@@ -37,6 +43,7 @@
 #include "reverb/cc/testing/proto_test_util.h"
 #include "reverb/cc/testing/tensor_testutil.h"
 #include "reverb/cc/testing/time_testutil.h"
+#include "tensorflow/core/framework/allocator.h"
 #include "tensorflow/core/framework/tensor_shape.h"
 #include "tensorflow/core/framework/tensor_util.h"
 #include "tensorflow/core/framework/types.pb.h"
@@ -47,6 +54,7 @@ namespace {
 
 using test::ExpectTensorEqual;
 using testing::MakeSequenceRange;
+using ::testing::ElementsAre;
 using ::testing::SizeIs;
 
 class FakeStream
@@ -127,7 +135,21 @@ class FakeStub : public /* grpc_gen:: */MockReverbServiceStub {
     return requests_;
   }
 
+  grpc::Status ServerInfo(grpc::ClientContext* context,
+                          const ServerInfoRequest& request,
+                          ServerInfoResponse* response) override {
+    absl::ReaderMutexLock lock(&mu_);
+    *response->mutable_table_info() = {table_info_.begin(), table_info_.end()};
+    return grpc::Status::OK;
+  }
+
+  void AddTableInfo(TableInfo info) {
+    absl::WriterMutexLock lock(&mu_);
+    table_info_.push_back(std::move(info));
+  }
+
  private:
+  std::vector<TableInfo> table_info_ ABSL_GUARDED_BY(mu_);
   std::list<std::unique_ptr<FakeStream>> streams_ ABSL_GUARDED_BY(mu_);
   std::vector<SampleStreamRequest> requests_ ABSL_GUARDED_BY(mu_);
   mutable absl::Mutex mu_;
@@ -144,6 +166,34 @@ std::shared_ptr<FakeStub> MakeFlakyStub(
   return stub;
 }
 
+// Stores the data uncompressed and counts the calls to `Uncompress`. Registered
+// as the `LZ4` codec by `RegisterCountingCodec`.
+std::atomic<int> num_uncompress_calls(0);
+
+class CountingCodec : public TensorCodec {
+ public:
+  void Compress(absl::string_view input, std::string* output) const override {
+    output->assign(input.data(), input.size());
+  }
+
+  bool Uncompress(absl::string_view input, size_t output_size,
+                  char* output) const override {
+    if (input.size() != output_size) return false;
+    std::memcpy(output, input.data(), input.size());
+    num_uncompress_calls++;
+    return true;
+  }
+};
+
+void RegisterCountingCodec() {
+  static const bool registered = [] {
+    RegisterTensorCodec(ChunkData::LZ4, absl::make_unique<CountingCodec>());
+    return true;
+  }();
+  (void)registered;
+  num_uncompress_calls = 0;
+}
+
 std::shared_ptr<FakeStub> MakeGoodStub(
     std::vector<SampleStreamResponse> responses) {
   return MakeFlakyStub(std::move(responses), /*errors=*/{});
@@ -298,6 +348,38 @@ TEST(SampleTest, IsComposedOfTimesteps) {
   EXPECT_FALSE(non_timestep_sample.is_composed_of_timesteps());
 }
 
+TEST(SampleTest, GetNextTimestepsStaysWithinChunk) {
+  Sample sample(
+      /*key=*/100,
+      /*probability=*/0.5,
+      /*table_size=*/2,
+      /*priority=*/1,
+      /*chunks=*/{{MakeTensor(5)}, {MakeTensor(3)}},
+      /*squeeze_columns=*/{false});
+
+  auto timesteps = sample.GetNextTimesteps(2);
+  ASSERT_THAT(timesteps, SizeIs(5));
+  EXPECT_EQ(timesteps[0].shape(), tensorflow::TensorShape({2}));
+  EXPECT_EQ(timesteps[0].flat<tensorflow::uint64>()(1), 100);
+  EXPECT_EQ(timesteps[4].shape(), tensorflow::TensorShape({2, 2}));
+  EXPECT_EQ(timesteps[4].flat<tensorflow::uint64>()(3), 3);
+
+  // Only the remainder of the first chunk is returned.
+  timesteps = sample.GetNextTimesteps(10);
+  EXPECT_EQ(timesteps[4].shape(), tensorflow::TensorShape({3, 2}));
+  EXPECT_EQ(timesteps[4].flat<tensorflow::uint64>()(0), 4);
+  EXPECT_FALSE(sample.is_end_of_sample());
+
+  timesteps = sample.GetNextTimesteps(10);
+  EXPECT_EQ(timesteps[3].shape(), tensorflow::TensorShape({3}));
+  EXPECT_EQ(timesteps[4].shape(), tensorflow::TensorShape({3, 2}));
+  EXPECT_TRUE(sample.is_end_of_sample());
+
+  std::vector<tensorflow::Tensor> data;
+  EXPECT_EQ(sample.AsBatchedTimesteps(&data).code(),
+            absl::StatusCode::kDataLoss);
+}
+
 TEST(GrpcSamplerTest, SendsFirstRequest) {
   auto stub = MakeGoodStub({MakeResponse(1)});
   Sampler sampler(stub, "table", {1, 1, 1});
@@ -355,6 +437,34 @@ TEST(LocalSamplerTest, SetsEndOfSequence) {
   EXPECT_TRUE(end_of_sequence);
 }
 
+TEST(LocalSamplerTest, GetNextTimestepsSetsEndOfSequence) {
+  auto table = MakeTable();
+  InsertItem(table.get(), 1, 1.0, {2, 3});
+  InsertItem(table.get(), 2, 1.0, {1});
+
+  Sampler sampler(table, {2});
+
+  std::vector<tensorflow::Tensor> timesteps;
+  bool end_of_sequence;
+  EXPECT_EQ(sampler.GetNextTimesteps(0, &timesteps, &end_of_sequence).code(),
+            absl::StatusCode::kInvalidArgument);
+
+  // The timesteps of the first sequence are returned chunk by chunk.
+  REVERB_EXPECT_OK(
+      sampler.GetNextTimesteps(10, &timesteps, &end_of_sequence));
+  EXPECT_EQ(timesteps[0].dim_size(0), 2);
+  EXPECT_FALSE(end_of_sequence);
+  REVERB_EXPECT_OK(
+      sampler.GetNextTimesteps(10, &timesteps, &end_of_sequence));
+  EXPECT_EQ(timesteps[0].dim_size(0), 3);
+  EXPECT_TRUE(end_of_sequence);
+
+  REVERB_EXPECT_OK(
+      sampler.GetNextTimesteps(10, &timesteps, &end_of_sequence));
+  EXPECT_EQ(timesteps[0].dim_size(0), 1);
+  EXPECT_TRUE(end_of_sequence);
+}
+
 TEST(GrpcSamplerTest, GetNextSampleReturnsPriority) {
   std::vector<SampleStreamResponse> responses = {MakeResponse(5),
                                                  MakeResponse(3)};
@@ -378,6 +488,149 @@ TEST(GrpcSamplerTest, GetNextSampleReturnsPriority) {
       second[3], MakeConstantTensor<tensorflow::DT_DOUBLE>({3}, 101.0));
 }
 
+TEST(GrpcSamplerTest, DecoderThreadsPreserveOrderOfSamples) {
+  const int kNumSamples = 50;
+  std::vector<SampleStreamResponse> responses;
+  for (int i = 0; i < kNumSamples; i++) {
+    responses.push_back(MakeResponse(i % 5 + 1));
+    responses.back().mutable_info()->mutable_item()->set_priority(i);
+  }
+  auto stub = MakeGoodStub(responses);
+
+  Sampler::Options options;
+  options.max_samples = kNumSamples;
+  options.max_in_flight_samples_per_worker = kNumSamples;
+  options.num_workers = 1;
+  options.num_decoder_threads = 4;
+  Sampler sampler(stub, "table", options);
+
+  for (int i = 0; i < kNumSamples; i++) {
+    std::vector<tensorflow::Tensor> sample;
+    REVERB_ASSERT_OK(sampler.GetNextSample(&sample));
+    ASSERT_THAT(sample, SizeIs(5));  // ID, probability, table size, priority,
+                                     // data.
+    ExpectTensorEqual<double>(
+        sample[3],
+        MakeConstantTensor<tensorflow::DT_DOUBLE>({i % 5 + 1}, double(i)));
+  }
+}
+
+TEST(GrpcSamplerTest, GetNextBatchReturnsBatchedTrajectories) {
+  std::vector<SampleStreamResponse> responses;
+  for (int i = 0; i < 4; i++) {
+    responses.push_back(MakeResponse(3));
+    responses.back().mutable_info()->mutable_item()->set_key(i);
+    responses.back().mutable_info()->mutable_item()->set_priority(100.0 + i);
+  }
+  auto stub = MakeGoodStub(responses);
+  Sampler sampler(stub, "table", {4, 4});
+
+  tensorflow::Tensor expected_data(tensorflow::DT_UINT64, {2, 3, 2});
+  for (int i = 0; i < expected_data.NumElements(); i++) {
+    expected_data.flat<tensorflow::uint64>()(i) = i % 6;
+  }
+
+  for (int batch_index = 0; batch_index < 2; batch_index++) {
+    std::vector<tensorflow::Tensor> batch;
+    REVERB_ASSERT_OK(sampler.GetNextBatch(2, &batch));
+    ASSERT_THAT(batch, SizeIs(5));  // ID, probability, table size, priority,
+                                    // data.
+    tensorflow::Tensor expected_keys(tensorflow::DT_UINT64, {2});
+    expected_keys.flat<tensorflow::uint64>()(0) = 2 * batch_index;
+    expected_keys.flat<tensorflow::uint64>()(1) = 2 * batch_index + 1;
+    ExpectTensorEqual<tensorflow::uint64>(batch[0], expected_keys);
+
+    tensorflow::Tensor expected_priorities(tensorflow::DT_DOUBLE, {2});
+    expected_priorities.flat<double>()(0) = 100.0 + 2 * batch_index;
+    expected_priorities.flat<double>()(1) = 101.0 + 2 * batch_index;
+    ExpectTensorEqual<double>(batch[3], expected_priorities);
+
+    ExpectTensorEqual<tensorflow::uint64>(batch[4], expected_data);
+  }
+
+  // All samples have been returned.
+  std::vector<tensorflow::Tensor> batch;
+  EXPECT_EQ(sampler.GetNextBatch(1, &batch).code(),
+            absl::StatusCode::kOutOfRange);
+}
+
+TEST(GrpcSamplerTest, GetNextBatchUsesBatchAllocator) {
+  // Counts the allocations made through it.
+  class CountingAllocator : public tensorflow::Allocator {
+   public:
+    std::string Name() override { return "counting"; }
+    void* AllocateRaw(size_t alignment, size_t num_bytes) override {
+      num_allocations++;
+      return tensorflow::cpu_allocator()->AllocateRaw(alignment, num_bytes);
+    }
+    void DeallocateRaw(void* ptr) override {
+      tensorflow::cpu_allocator()->DeallocateRaw(ptr);
+    }
+    int num_allocations = 0;
+  };
+
+  CountingAllocator allocator;
+  {
+    auto stub = MakeGoodStub({MakeResponse(3), MakeResponse(3)});
+    Sampler::Options options{2, 2};
+    options.batch_allocator = &allocator;
+    Sampler sampler(stub, "table", options);
+
+    std::vector<tensorflow::Tensor> batch;
+    REVERB_ASSERT_OK(sampler.GetNextBatch(2, &batch));
+    ASSERT_THAT(batch, SizeIs(5));
+  }
+
+  // Only the trajectory column is allocated with the batch allocator.
+  EXPECT_EQ(allocator.num_allocations, 1);
+}
+
+TEST(GrpcSamplerTest, GetNextBatchFailsIfShapesDiffer) {
+  auto stub = MakeGoodStub({MakeResponse(3), MakeResponse(2)});
+  Sampler sampler(stub, "table", {2, 2});
+
+  std::vector<tensorflow::Tensor> batch;
+  EXPECT_EQ(sampler.GetNextBatch(2, &batch).code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+TEST(GrpcSamplerTest, CachedShapesDoNotHideMismatchingSamples) {
+  // Info columns followed by the data of trajectories of length 3.
+  std::vector<internal::TensorSpec> specs = {
+      {"key", tensorflow::DT_UINT64, tensorflow::PartialTensorShape({})},
+      {"probability", tensorflow::DT_DOUBLE,
+       tensorflow::PartialTensorShape({})},
+      {"table_size", tensorflow::DT_INT64, tensorflow::PartialTensorShape({})},
+      {"priority", tensorflow::DT_DOUBLE, tensorflow::PartialTensorShape({})},
+      {"data", tensorflow::DT_UINT64, tensorflow::PartialTensorShape({3, 2})},
+  };
+  auto stub =
+      MakeGoodStub({MakeResponse(3), MakeResponse(3), MakeResponse(2)});
+  Sampler sampler(stub, "table", {3, 1, 1}, std::move(specs));
+
+  // The shapes of the first sample are cached and matched by the second.
+  std::vector<tensorflow::Tensor> data;
+  REVERB_EXPECT_OK(sampler.GetNextTrajectory(&data));
+  REVERB_EXPECT_OK(sampler.GetNextTrajectory(&data));
+
+  // The third sample does not match the cached shapes so it is checked
+  // against the spec, which it violates.
+  EXPECT_EQ(sampler.GetNextTrajectory(&data).code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+TEST(GrpcSamplerTest, GetNextBatchFailsIfTooFewSamplesRemain) {
+  auto stub = MakeGoodStub({MakeResponse(3), MakeResponse(3)});
+  Sampler sampler(stub, "table", {2, 2});
+
+  std::vector<tensorflow::Tensor> batch;
+  EXPECT_EQ(sampler.GetNextBatch(3, &batch).code(),
+            absl::StatusCode::kOutOfRange);
+
+  // No samples were consumed by the failed call.
+  REVERB_EXPECT_OK(sampler.GetNextBatch(2, &batch));
+}
+
 TEST(LocalSamplerTest, GetNextSampleReturnsPriority) {
   auto table = MakeTable();
   InsertItem(table.get(), 1, 100.0, {5});
@@ -402,6 +655,31 @@ TEST(LocalSamplerTest, GetNextSampleReturnsPriority) {
       second[3], MakeConstantTensor<tensorflow::DT_DOUBLE>({3}, 101.0));
 }
 
+TEST(LocalSamplerTest, AutotunedWorkersReturnAllSamples) {
+  constexpr int kNumItems = 3 * Sampler::kAutotuneWindow;
+  auto table = MakeTable(kNumItems);
+  for (int i = 0; i < kNumItems; i++) {
+    InsertItem(table.get(), i + 1, 1.0, {1});
+  }
+
+  Sampler::Options options;
+  options.max_samples = kNumItems;
+  options.num_workers = 4;
+  options.autotune_num_workers = true;
+  Sampler sampler(table, options);
+
+  // The order is not preserved once more than one worker is active.
+  std::vector<tensorflow::uint64> keys;
+  for (int i = 0; i < kNumItems; i++) {
+    std::vector<tensorflow::Tensor> sample;
+    REVERB_ASSERT_OK(sampler.GetNextSample(&sample));
+    keys.push_back(sample[0].flat<tensorflow::uint64>()(0));
+  }
+  std::vector<tensorflow::uint64> want(kNumItems);
+  std::iota(want.begin(), want.end(), 1);
+  EXPECT_THAT(keys, ::testing::UnorderedElementsAreArray(want));
+}
+
 TEST(GrpcSamplerTest, GetNextSampleReturnsWholeSequence) {
   auto stub = MakeGoodStub({MakeResponse(5), MakeResponse(3)});
   Sampler sampler(stub, "table", {2, 1});
@@ -439,6 +717,59 @@ TEST(LocalSamplerTest, GetNextSampleReturnsWholeSequence) {
   ExpectTensorEqual<tensorflow::uint64>(second[4], MakeTensor(3));
 }
 
+TEST(LocalSamplerTest, GetNextSampleDecompressesThroughCache) {
+  auto table = std::make_shared<Table>(
+      /*name=*/"queue",
+      /*sampler=*/std::make_shared<FifoSelector>(),
+      /*remover=*/std::make_shared<FifoSelector>(),
+      /*max_size=*/100,
+      /*max_times_sampled=*/0,
+      /*rate_limiter=*/
+      std::make_shared<RateLimiter>(1, 1, -DBL_MAX, DBL_MAX));
+  InsertItem(table.get(), 1, 1.0, {5});
+
+  Sampler::Options options;
+  options.num_workers = 1;
+  options.max_in_flight_samples_per_worker = 1;
+  options.max_decompressed_chunk_cache_bytes = 1 << 20;
+  Sampler sampler(table, options);
+
+  // The same item is sampled every time so all but the first sample are
+  // served from the cache.
+  for (int i = 0; i < 3; i++) {
+    std::vector<tensorflow::Tensor> sample;
+    REVERB_EXPECT_OK(sampler.GetNextSample(&sample));
+    ASSERT_THAT(sample, SizeIs(5));  // ID, probability, size, priority, data.
+    ExpectTensorEqual<tensorflow::uint64>(sample[4], MakeTensor(5));
+  }
+}
+
+TEST(LocalSamplerTest, SampleOfUncompressedChunkOutlivesTable) {
+  auto table = MakeTable();
+  TableItem item = MakeItem(1, 1.0, {MakeSequenceRange(100, 0, 4)}, 1, 3);
+
+  // The sampled column shares the memory of a chunk stored uncompressed.
+  ChunkData data = item.chunks[0]->data();
+  data.set_codec(ChunkData::NONE);
+  data.mutable_data()->clear_tensors();
+  CompressTensorAsProto(MakeTensor(5), data.mutable_data()->add_tensors(),
+                        ChunkData::NONE);
+  item.chunks[0] = std::make_shared<ChunkStore::Chunk>(std::move(data));
+  REVERB_ASSERT_OK(table->InsertOrAssign(std::move(item)));
+
+  std::vector<tensorflow::Tensor> sample;
+  {
+    Sampler sampler(table, {1, 1});
+    REVERB_ASSERT_OK(sampler.GetNextTrajectory(&sample));
+  }
+  REVERB_ASSERT_OK(table->Reset());
+  table = nullptr;
+
+  ASSERT_THAT(sample, SizeIs(5));  // ID, probability, table size, priority, data.
+  ExpectTensorEqual<tensorflow::uint64>(
+      sample[4], tensorflow::tensor::DeepCopy(MakeTensor(5).Slice(1, 4)));
+}
+
 TEST(GrpcSamplerTest, GetNextSampleTrimsSequence) {
   auto stub = MakeGoodStub({
       MakeResponse(5, false, 1, 6),   // Trim offset at the start.
@@ -555,6 +886,48 @@ TEST(LocalSamplerTest, Close) {
   EXPECT_EQ(sampler.GetNextSample(&third).code(), absl::StatusCode::kCancelled);
 }
 
+TEST(LocalSamplerTest, MutatePrioritiesAppliesMutationsToTable) {
+  auto table = MakeTable();
+  InsertItem(table.get(), 1, 1.0, {5});
+  InsertItem(table.get(), 2, 1.0, {3});
+
+  Sampler sampler(table, {3});
+  REVERB_EXPECT_OK(
+      sampler.MutatePriorities({testing::MakeKeyWithPriority(2, 5)}, {1}));
+  EXPECT_EQ(table->size(), 1);
+
+  sampler.Close();
+  EXPECT_EQ(sampler.MutatePriorities({}, {2}).code(),
+            absl::StatusCode::kCancelled);
+}
+
+TEST(GrpcSamplerTest, MutatePrioritiesSendsMutationsWithNextRequest) {
+  const int kNumSamples = 10;
+  std::vector<SampleStreamResponse> responses;
+  for (int i = 0; i < kNumSamples; i++) responses.push_back(MakeResponse(1));
+  auto stub = MakeGoodStub(std::move(responses));
+
+  Sampler sampler(stub, "table", {kNumSamples, 1, 1});
+  REVERB_EXPECT_OK(
+      sampler.MutatePriorities({testing::MakeKeyWithPriority(2, 5)}, {1}));
+
+  for (int i = 0; i < kNumSamples; i++) {
+    std::vector<tensorflow::Tensor> sample;
+    REVERB_EXPECT_OK(sampler.GetNextSample(&sample));
+  }
+
+  int num_mutating_requests = 0;
+  for (const auto& request : stub->requests()) {
+    if (request.priority_updates_size() == 0) continue;
+    ++num_mutating_requests;
+    EXPECT_THAT(request.priority_updates(),
+                ElementsAre(testing::EqualsProto(
+                    testing::MakeKeyWithPriority(2, 5))));
+    EXPECT_THAT(request.priority_deletes(), ElementsAre(1));
+  }
+  EXPECT_EQ(num_mutating_requests, 1);
+}
+
 TEST(GrpcSamplerTest, RespectsBufferSizeAndMaxSamples) {
   const int kMaxSamples = 20;
   const int kMaxInFlightSamplesPerWorker = 11;
@@ -621,6 +994,100 @@ TEST(GrpcSamplerTest, RespectsBufferSizeAndMaxSamples) {
   EXPECT_THAT(stub->requests(), SizeIs(2));
 }
 
+TEST(GrpcSamplerTest, PipelinesRequestsWhenInFlightBytesIsSet) {
+  const int kMaxSamples = 20;
+  std::vector<SampleStreamResponse> responses;
+  for (int i = 0; i < kMaxSamples; i++) {
+    responses.push_back(MakeResponse(1));
+    responses.back().mutable_info()->mutable_item()->set_key(i);
+  }
+  auto stub = MakeGoodStub(std::move(responses));
+
+  Sampler::Options options;
+  options.max_samples = kMaxSamples;
+  options.max_in_flight_samples_per_worker = 4;
+  options.num_workers = 1;
+  // A budget this small keeps the window at `max_in_flight_samples_per_worker`.
+  options.max_in_flight_bytes_per_worker = 1;
+  Sampler sampler(stub, "table", options);
+
+  for (int i = 0; i < kMaxSamples; i++) {
+    std::vector<tensorflow::Tensor> sample;
+    REVERB_ASSERT_OK(sampler.GetNextTrajectory(&sample));
+    EXPECT_EQ(sample[0].scalar<tensorflow::uint64>()(), i);
+  }
+
+  // All the samples are requested on the same stream without exceeding
+  // `max_samples`.
+  int64_t num_requested = 0;
+  for (const auto& request : stub->requests()) {
+    EXPECT_EQ(request.num_samples(), 4);
+    num_requested += request.num_samples();
+  }
+  EXPECT_EQ(num_requested, kMaxSamples);
+}
+
+TEST(ShardedGrpcSamplerTest, SamplesShardsProportionallyToTheirWeight) {
+  const int kNumSamples = 400;
+  std::vector<std::shared_ptr<FakeStub>> stubs;
+  for (int shard = 0; shard < 2; shard++) {
+    std::vector<SampleStreamResponse> responses;
+    for (int i = 0; i < kNumSamples; i++) {
+      responses.push_back(MakeResponse(1));
+      responses.back().mutable_info()->mutable_item()->set_key(shard);
+      responses.back().mutable_info()->set_probability(0.5);
+      responses.back().mutable_info()->set_table_size(shard == 0 ? 3 : 1);
+    }
+    auto stub = MakeGoodStub(std::move(responses));
+    TableInfo info;
+    info.set_name("table");
+    info.set_current_size(shard == 0 ? 3 : 1);
+    info.set_total_sampler_weight(shard == 0 ? 3 : 1);
+    stub->AddTableInfo(info);
+    stubs.push_back(std::move(stub));
+  }
+
+  Sampler::Options options;
+  options.max_samples = kNumSamples;
+  options.max_samples_per_stream = kNumSamples;
+  options.num_workers = 1;
+  Sampler sampler(
+      std::vector<std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface>>(
+          stubs.begin(), stubs.end()),
+      "table", options);
+
+  int num_first_shard = 0;
+  for (int i = 0; i < kNumSamples; i++) {
+    std::vector<tensorflow::Tensor> sample;
+    REVERB_ASSERT_OK(sampler.GetNextTrajectory(&sample));
+    const bool first_shard = sample[0].scalar<tensorflow::uint64>()() == 0;
+    num_first_shard += first_shard;
+
+    // The probability and size describe the table as a whole.
+    EXPECT_DOUBLE_EQ(sample[1].scalar<double>()(),
+                     first_shard ? 0.5 * 0.75 : 0.5 * 0.25);
+    EXPECT_EQ(sample[2].scalar<tensorflow::int64>()(), 4);
+  }
+
+  // The first shard holds 75% of the weight. The bounds are more than 6
+  // standard deviations away from the expected value.
+  EXPECT_GT(num_first_shard, 250);
+  EXPECT_LT(num_first_shard, 350);
+}
+
+TEST(ShardedGrpcSamplerTest, FailsIfTableIsNotFoundOnAnyServer) {
+  std::vector<std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface>>
+      stubs = {MakeGoodStub({MakeResponse(1)}), MakeGoodStub({MakeResponse(1)})};
+
+  Sampler::Options options;
+  options.max_samples = 1;
+  Sampler sampler(stubs, "table", options);
+
+  std::vector<tensorflow::Tensor> sample;
+  EXPECT_EQ(sampler.GetNextTrajectory(&sample).code(),
+            absl::StatusCode::kNotFound);
+}
+
 TEST(GrpcSamplerTest, UnpacksDeltaEncodedTensors) {
   auto stub = MakeGoodStub({MakeResponse(10, false), MakeResponse(10, true)});
   Sampler sampler(stub, "table", {2, 1});
@@ -635,6 +1102,98 @@ TEST(GrpcSamplerTest, UnpacksDeltaEncodedTensors) {
   }
 }
 
+TEST(GrpcSamplerTest, OnlyDecompressesReferencedColumns) {
+  RegisterCountingCodec();
+
+  // The chunk holds two columns but the (timestep) trajectory only references
+  // the first one.
+  auto response = MakeResponse(3);
+  auto* data = response.mutable_data();
+  data->mutable_data()->clear_tensors();
+  data->set_codec(ChunkData::LZ4);
+  for (int i = 0; i < 2; i++) {
+    CompressTensorAsProto(MakeTensor(3), data->mutable_data()->add_tensors(),
+                          ChunkData::LZ4);
+  }
+
+  auto stub = MakeGoodStub({std::move(response)});
+  Sampler sampler(stub, "table", {1, 1});
+  std::vector<tensorflow::Tensor> sample;
+  REVERB_ASSERT_OK(sampler.GetNextSample(&sample));
+  ASSERT_THAT(sample, SizeIs(5));  // ID, probability, table size, priority, data.
+  ExpectTensorEqual<tensorflow::uint64>(sample[4], MakeTensor(3));
+  EXPECT_EQ(num_uncompress_calls, 1);
+}
+
+TEST(GrpcSamplerTest, DecompressesSharedColumnsOnce) {
+  RegisterCountingCodec();
+
+  // Both columns of the trajectory are slices of the same chunk column.
+  auto response = MakeResponse(2, false, 1, 3);
+  auto* data = response.mutable_data();
+  data->mutable_data()->clear_tensors();
+  data->set_codec(ChunkData::LZ4);
+  CompressTensorAsProto(MakeTensor(3), data->mutable_data()->add_tensors(),
+                        ChunkData::LZ4);
+  auto* slice = response.mutable_info()
+                    ->mutable_item()
+                    ->mutable_flat_trajectory()
+                    ->add_columns()
+                    ->add_chunk_slices();
+  slice->set_offset(0);
+  slice->set_length(3);
+
+  auto stub = MakeGoodStub({std::move(response)});
+  Sampler sampler(stub, "table", {1, 1});
+  std::vector<tensorflow::Tensor> sample;
+  REVERB_ASSERT_OK(sampler.GetNextTrajectory(&sample));
+  ASSERT_THAT(sample, SizeIs(6));
+  ExpectTensorEqual<tensorflow::uint64>(
+      sample[4], tensorflow::tensor::DeepCopy(MakeTensor(3).Slice(1, 3)));
+  ExpectTensorEqual<tensorflow::uint64>(sample[5], MakeTensor(3));
+  EXPECT_EQ(num_uncompress_calls, 1);
+}
+
+TEST(GrpcSamplerTest, UnpacksUncompressedChunks) {
+  auto response = MakeResponse(2, false, 1, 3);
+  auto* data = response.mutable_data();
+  data->mutable_data()->clear_tensors();
+  data->set_codec(ChunkData::NONE);
+  CompressTensorAsProto(MakeTensor(3), data->mutable_data()->add_tensors(),
+                        ChunkData::NONE);
+
+  auto stub = MakeGoodStub({std::move(response)});
+  Sampler sampler(stub, "table", {1, 1});
+  std::vector<tensorflow::Tensor> sample;
+  REVERB_ASSERT_OK(sampler.GetNextSample(&sample));
+  ASSERT_THAT(sample, SizeIs(5));  // ID, probability, table size, priority, data.
+  ExpectTensorEqual<tensorflow::uint64>(
+      sample[4], tensorflow::tensor::DeepCopy(MakeTensor(3).Slice(1, 3)));
+}
+
+TEST(GrpcSamplerTest, OnlyDecompressesBlocksCoveringTheSample) {
+  RegisterCountingCodec();
+
+  // The sample covers rows 3-5 of a chunk of 10 rows compressed in blocks of 2
+  // rows, so only the second and third blocks have to be decompressed.
+  auto response = MakeResponse(3, false, 3, 10);
+  auto* data = response.mutable_data();
+  data->mutable_data()->clear_tensors();
+  data->set_codec(ChunkData::LZ4);
+  ASSERT_TRUE(CompressTensorAsBlocks(MakeTensor(10), 2, ChunkData::LZ4,
+                                     data->mutable_data()->add_tensors(),
+                                     data->add_compressed_blocks()));
+
+  auto stub = MakeGoodStub({std::move(response)});
+  Sampler sampler(stub, "table", {1, 1});
+  std::vector<tensorflow::Tensor> sample;
+  REVERB_ASSERT_OK(sampler.GetNextSample(&sample));
+  ASSERT_THAT(sample, SizeIs(5));  // ID, probability, table size, priority, data.
+  ExpectTensorEqual<tensorflow::uint64>(
+      sample[4], tensorflow::tensor::DeepCopy(MakeTensor(10).Slice(3, 6)));
+  EXPECT_EQ(num_uncompress_calls, 2);
+}
+
 TEST(GrpcSamplerTest, GetNextTimestepForwardsFatalServerError) {
   const int kNumWorkers = 4;
   const int kItemLength = 10;
@@ -1016,6 +1575,58 @@ TEST(SamplerOptionsTest, ValidateChecksFlexibleBatchSize) {
   EXPECT_EQ(options.Validate().code(), absl::StatusCode::kInvalidArgument);
 }
 
+TEST(SamplerOptionsTest, ValidateChecksMaxInFlightBytesPerWorker) {
+  Sampler::Options options;
+  options.max_in_flight_bytes_per_worker = -1;
+  EXPECT_EQ(options.Validate().code(), absl::StatusCode::kInvalidArgument);
+  options.max_in_flight_bytes_per_worker = 0;
+  REVERB_EXPECT_OK(options.Validate());
+  options.max_in_flight_bytes_per_worker = 1 << 20;
+  REVERB_EXPECT_OK(options.Validate());
+}
+
+TEST(SamplerOptionsTest, ValidateChecksNumDecoderThreads) {
+  Sampler::Options options;
+  options.num_decoder_threads = -1;
+  EXPECT_EQ(options.Validate().code(), absl::StatusCode::kInvalidArgument);
+  options.num_decoder_threads = 0;
+  REVERB_EXPECT_OK(options.Validate());
+  options.num_decoder_threads = 4;
+  REVERB_EXPECT_OK(options.Validate());
+}
+
+TEST(SamplerOptionsTest, ValidateChecksMaxCachedChunks) {
+  Sampler::Options options;
+  options.max_cached_chunks = -1;
+  EXPECT_EQ(options.Validate().code(), absl::StatusCode::kInvalidArgument);
+  options.max_cached_chunks = 0;
+  REVERB_EXPECT_OK(options.Validate());
+  options.max_cached_chunks = 10;
+  REVERB_EXPECT_OK(options.Validate());
+}
+
+TEST(SamplerOptionsTest, ValidateChecksMaxDecompressedChunkCacheBytes) {
+  Sampler::Options options;
+  options.max_decompressed_chunk_cache_bytes = -1;
+  EXPECT_EQ(options.Validate().code(), absl::StatusCode::kInvalidArgument);
+  options.max_decompressed_chunk_cache_bytes = 0;
+  REVERB_EXPECT_OK(options.Validate());
+  options.max_decompressed_chunk_cache_bytes = 1 << 20;
+  REVERB_EXPECT_OK(options.Validate());
+}
+
+TEST(SamplerOptionsTest, ValidateChecksMixture) {
+  Sampler::Options options;
+  options.mixture = {{"a", 1.0}, {"b", -1.0}};
+  EXPECT_EQ(options.Validate().code(), absl::StatusCode::kInvalidArgument);
+  options.mixture = {{"a", 0.0}, {"b", 0.0}};
+  EXPECT_EQ(options.Validate().code(), absl::StatusCode::kInvalidArgument);
+  options.mixture = {{"a", 0.0}, {"b", 2.0}};
+  REVERB_EXPECT_OK(options.Validate());
+  options.sample_group = "group";
+  EXPECT_EQ(options.Validate().code(), absl::StatusCode::kInvalidArgument);
+}
+
 }  // namespace
 }  // namespace reverb
 }  // namespace deepmind
@@ -0,0 +1,106 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_SELECTORS_DENSE_KEY_MAP_H_
+#define REVERB_CC_SELECTORS_DENSE_KEY_MAP_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "reverb/cc/platform/logging.h"
+#include "reverb/cc/selectors/interface.h"
+
+namespace deepmind {
+namespace reverb {
+
+// Maps the keys held by an `ItemSelector` to values of type `T`. The keys of
+// selectors are dense (see `ItemSelector`) so the values are stored in a vector
+// indexed by the key, which replaces the hash and probe of a hash map with a
+// single array access. The memory used is proportional to the largest key
+// inserted since the last `Clear`.
+template <typename T>
+class DenseKeyMap {
+ public:
+  using Key = ItemSelector::Key;
+
+  // Keys must be less than this value. It is far above the number of items any
+  // table can hold and guards against keys which are not dense.
+  static constexpr Key kMaxKey = std::numeric_limits<uint32_t>::max();
+
+  // Returns the value of `key` or nullptr if `key` is not present.
+  T* Find(Key key) {
+    return key < entries_.size() && entries_[key].present
+               ? &entries_[key].value
+               : nullptr;
+  }
+  const T* Find(Key key) const {
+    return const_cast<DenseKeyMap*>(this)->Find(key);
+  }
+
+  bool contains(Key key) const { return Find(key) != nullptr; }
+
+  // Inserts `value` for `key` and returns true, or returns false without any
+  // change if `key` is already present.
+  bool Insert(Key key, T value) {
+    REVERB_CHECK_LT(key, kMaxKey) << "Keys of selectors must be dense.";
+    if (key >= entries_.size()) {
+      entries_.resize(std::max<size_t>(key + 1, entries_.size() * 2));
+    }
+    Entry& entry = entries_[key];
+    if (entry.present) return false;
+    entry.value = std::move(value);
+    entry.present = true;
+    size_++;
+    return true;
+  }
+
+  // Reserves memory for the keys below `num_keys`.
+  void Reserve(size_t num_keys) { entries_.reserve(num_keys); }
+
+  // Removes `key` and returns true, or returns false if `key` is not present.
+  bool Erase(Key key) {
+    if (key >= entries_.size() || !entries_[key].present) return false;
+    entries_[key] = Entry();
+    size_--;
+    return true;
+  }
+
+  // Number of keys present.
+  size_t size() const { return size_; }
+
+  bool empty() const { return size_ == 0; }
+
+  // Removes all keys and releases the memory.
+  void Clear() {
+    entries_ = std::vector<Entry>();
+    size_ = 0;
+  }
+
+ private:
+  struct Entry {
+    T value{};
+    bool present = false;
+  };
+
+  std::vector<Entry> entries_;
+  size_t size_ = 0;
+};
+
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_SELECTORS_DENSE_KEY_MAP_H_
@@ -0,0 +1,79 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/selectors/dense_key_map.h"
+
+#include <memory>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace deepmind {
+namespace reverb {
+namespace {
+
+TEST(DenseKeyMapTest, InsertFindErase) {
+  DenseKeyMap<int> map;
+  EXPECT_EQ(map.Find(3), nullptr);
+  EXPECT_FALSE(map.Erase(3));
+
+  EXPECT_TRUE(map.Insert(3, 30));
+  EXPECT_FALSE(map.Insert(3, 31));
+  EXPECT_TRUE(map.Insert(0, 0));
+  EXPECT_EQ(map.size(), 2);
+  EXPECT_EQ(*map.Find(3), 30);
+  EXPECT_EQ(map.Find(1), nullptr);
+  EXPECT_EQ(map.Find(100), nullptr);
+
+  *map.Find(3) = 32;
+  EXPECT_EQ(*map.Find(3), 32);
+
+  EXPECT_TRUE(map.Erase(3));
+  EXPECT_FALSE(map.contains(3));
+  EXPECT_TRUE(map.contains(0));
+  EXPECT_EQ(map.size(), 1);
+
+  // Erased keys can be inserted again.
+  EXPECT_TRUE(map.Insert(3, 33));
+  EXPECT_EQ(*map.Find(3), 33);
+}
+
+TEST(DenseKeyMapTest, ErasedValuesAreDestroyed) {
+  DenseKeyMap<std::shared_ptr<int>> map;
+  auto value = std::make_shared<int>(1);
+  EXPECT_TRUE(map.Insert(5, value));
+  EXPECT_EQ(value.use_count(), 2);
+  EXPECT_TRUE(map.Erase(5));
+  EXPECT_EQ(value.use_count(), 1);
+}
+
+TEST(DenseKeyMapTest, Clear) {
+  DenseKeyMap<int> map;
+  for (int i = 0; i < 100; i++) {
+    EXPECT_TRUE(map.Insert(i, i));
+  }
+  map.Clear();
+  EXPECT_TRUE(map.empty());
+  EXPECT_EQ(map.Find(10), nullptr);
+  EXPECT_TRUE(map.Insert(10, 10));
+}
+
+TEST(DenseKeyMapDeathTest, KeysMustBeDense) {
+  DenseKeyMap<int> map;
+  EXPECT_DEATH(map.Insert(DenseKeyMap<int>::kMaxKey, 0), "dense");
+}
+
+}  // namespace
+}  // namespace reverb
+}  // namespace deepmind
@@ -0,0 +1,58 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_SELECTORS_DISPATCH_H_
+#define REVERB_CC_SELECTORS_DISPATCH_H_
+
+#include <utility>
+
+#include "reverb/cc/selectors/fifo.h"
+#include "reverb/cc/selectors/interface.h"
+#include "reverb/cc/selectors/prioritized.h"
+#include "reverb/cc/selectors/uniform.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+
+// Calls `fn` with `selector` downcast to its concrete type if `kind` (which
+// must be `selector->kind()`, cached by the caller) names one, and with the
+// `ItemSelector` interface otherwise. `fn` is typically a generic lambda, which
+// is instantiated once per selector type. The concrete selectors are final so
+// the calls made through the downcast pointers are direct calls rather than
+// virtual ones.
+//
+// Used by `Table` on its hot paths, where almost every table uses one of a
+// handful of selectors as sampler and `FifoSelector` as remover.
+template <typename Fn>
+decltype(auto) VisitSelector(SelectorKind kind, ItemSelector* selector,
+                             Fn&& fn) {
+  switch (kind) {
+    case SelectorKind::kFifo:
+      return std::forward<Fn>(fn)(static_cast<FifoSelector*>(selector));
+    case SelectorKind::kUniform:
+      return std::forward<Fn>(fn)(static_cast<UniformSelector*>(selector));
+    case SelectorKind::kPrioritized:
+      return std::forward<Fn>(fn)(static_cast<PrioritizedSelector*>(selector));
+    case SelectorKind::kGeneric:
+      break;
+  }
+  return std::forward<Fn>(fn)(selector);
+}
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_SELECTORS_DISPATCH_H_
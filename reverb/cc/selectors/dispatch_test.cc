@@ -0,0 +1,78 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/selectors/dispatch.h"
+
+#include <memory>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/memory/memory.h"
+#include "reverb/cc/platform/status_matchers.h"
+#include "reverb/cc/selectors/heap.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+namespace {
+
+// Returns the kind matching the static type of `selector`.
+struct StaticKind {
+  SelectorKind operator()(FifoSelector*) const { return SelectorKind::kFifo; }
+  SelectorKind operator()(UniformSelector*) const {
+    return SelectorKind::kUniform;
+  }
+  SelectorKind operator()(PrioritizedSelector*) const {
+    return SelectorKind::kPrioritized;
+  }
+  SelectorKind operator()(ItemSelector*) const {
+    return SelectorKind::kGeneric;
+  }
+};
+
+TEST(VisitSelectorTest, DowncastsToConcreteType) {
+  std::unique_ptr<ItemSelector> selectors[] = {
+      absl::make_unique<FifoSelector>(),
+      absl::make_unique<UniformSelector>(),
+      absl::make_unique<PrioritizedSelector>(1.0),
+      absl::make_unique<HeapSelector>(),
+  };
+  const SelectorKind expected[] = {
+      SelectorKind::kFifo,
+      SelectorKind::kUniform,
+      SelectorKind::kPrioritized,
+      SelectorKind::kGeneric,
+  };
+  for (int i = 0; i < 4; i++) {
+    EXPECT_EQ(selectors[i]->kind(), expected[i]);
+    EXPECT_EQ(
+        VisitSelector(selectors[i]->kind(), selectors[i].get(), StaticKind()),
+        expected[i]);
+  }
+}
+
+TEST(VisitSelectorTest, ForwardsCalls) {
+  std::unique_ptr<ItemSelector> selector = absl::make_unique<FifoSelector>();
+  auto insert = [](auto* s) { return s->Insert(7, 1.0); };
+  REVERB_EXPECT_OK(VisitSelector(selector->kind(), selector.get(), insert));
+  EXPECT_EQ(VisitSelector(selector->kind(), selector.get(),
+                          [](auto* s) { return s->Sample(); })
+                .key,
+            7);
+}
+
+}  // namespace
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
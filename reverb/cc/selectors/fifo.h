@@ -15,11 +15,9 @@
 #ifndef REVERB_CC_SELECTORS_FIFO_H_
 #define REVERB_CC_SELECTORS_FIFO_H_
 
-#include <list>
-
 #include "reverb/cc/checkpointing/checkpoint.pb.h"
-#include "reverb/cc/platform/hash_map.h"
 #include "reverb/cc/selectors/interface.h"
+#include "reverb/cc/selectors/key_ring_buffer.h"
 
 namespace deepmind {
 namespace reverb {
@@ -28,7 +26,7 @@ namespace reverb {
 // returns the key that was inserted first until this key is deleted. All
 // operations take O(1) time. See ItemSelector for documentation
 // about the methods.
-class FifoSelector : public ItemSelector {
+class FifoSelector final : public ItemSelector {
  public:
   absl::Status Delete(Key key) override;
 
@@ -40,15 +38,23 @@ class FifoSelector : public ItemSelector {
 
   KeyWithProbability Sample() override;
 
+  KeyWithProbability SampleShared(absl::BitGen* bit_gen) const override;
+
+  bool SupportsSampleShared() const override { return true; }
+
   void Clear() override;
 
+  // Returns the number of keys. O(1) time.
+  double TotalWeight() const override;
+
   KeyDistributionOptions options() const override;
 
+  SelectorKind kind() const override { return SelectorKind::kFifo; }
+
   std::string DebugString() const override;
 
  private:
-  std::list<Key> keys_;
-  internal::flat_hash_map<Key, std::list<Key>::iterator> key_to_iterator_;
+  KeyRingBuffer keys_;
 };
 
 }  // namespace reverb
@@ -14,8 +14,11 @@
 
 #include "reverb/cc/selectors/heap.h"
 
+#include <algorithm>
+
 #include "absl/strings/str_cat.h"
 #include "reverb/cc/checkpointing/checkpoint.pb.h"
+#include "reverb/cc/platform/logging.h"
 #include "reverb/cc/schema.pb.h"
 #include "reverb/cc/selectors/interface.h"
 
@@ -26,46 +29,96 @@ HeapSelector::HeapSelector(bool min_heap)
     : sign_(min_heap ? 1 : -1), update_count_(0) {}
 
 absl::Status HeapSelector::Delete(ItemSelector::Key key) {
-  auto it = nodes_.find(key);
-  if (it == nodes_.end()) {
+  const size_t* found = heap_positions_.Find(key);
+  if (found == nullptr) {
     return absl::InvalidArgumentError(absl::StrCat("Key ", key, " not found."));
   }
-  heap_.Remove(it->second.get());
-  nodes_.erase(it);
+  const size_t position = *found;
+  heap_positions_.Erase(key);
+
+  // Move the last entry into the position of the deleted entry.
+  HeapEntry last = heap_.back();
+  heap_.pop_back();
+  if (position < heap_.size()) {
+    Place(last, position);
+    Adjust(position);
+  }
   return absl::OkStatus();
 }
 
 absl::Status HeapSelector::Insert(ItemSelector::Key key, double priority) {
-  if (nodes_.contains(key)) {
+  if (!heap_positions_.Insert(key, heap_.size())) {
     return absl::InvalidArgumentError(
         absl::StrCat("Key ", key, " already inserted."));
   }
-  nodes_[key] =
-      absl::make_unique<HeapNode>(key, priority * sign_, update_count_++);
-  heap_.Push(nodes_[key].get());
+  heap_.push_back({priority * sign_, update_count_++, key});
+  SiftUp(heap_.size() - 1);
+  return absl::OkStatus();
+}
+
+absl::Status HeapSelector::InsertBatch(
+    absl::Span<const KeyWithPriority> items) {
+  DenseKeyMap<bool> batch_keys;
+  for (const auto& item : items) {
+    if (heap_positions_.contains(item.key()) ||
+        !batch_keys.Insert(item.key(), true)) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Key ", item.key(), " already inserted."));
+    }
+  }
+
+  const size_t first = heap_.size();
+  heap_.reserve(first + items.size());
+  heap_positions_.Reserve(first + items.size());
+  for (const auto& item : items) {
+    heap_positions_.Insert(item.key(), heap_.size());
+    heap_.push_back({item.priority() * sign_, update_count_++, item.key()});
+  }
+
+  // Sifting down every inner node, bottom-up, builds the heap in linear time.
+  // Sifting up the new entries is cheaper when the batch is small.
+  if (items.size() >= first) {
+    const size_t num_inner = (heap_.size() + kArity - 2) / kArity;
+    for (size_t position = num_inner; position-- > 0;) {
+      SiftDown(position);
+    }
+  } else {
+    for (size_t position = first; position < heap_.size(); ++position) {
+      SiftUp(position);
+    }
+  }
   return absl::OkStatus();
 }
 
 absl::Status HeapSelector::Update(ItemSelector::Key key, double priority) {
-  if (!nodes_.contains(key)) {
+  const size_t* found = heap_positions_.Find(key);
+  if (found == nullptr) {
     return absl::InvalidArgumentError(absl::StrCat("Key ", key, " not found."));
   }
-  nodes_[key]->priority = priority * sign_;
-  nodes_[key]->update_number = update_count_++;
-  heap_.Adjust(nodes_[key].get());
+  const size_t position = *found;
+  heap_[position].priority = priority * sign_;
+  heap_[position].update_number = update_count_++;
+  Adjust(position);
   return absl::OkStatus();
 }
 
 ItemSelector::KeyWithProbability HeapSelector::Sample() {
-  REVERB_CHECK(!nodes_.empty());
-  return {heap_.top()->key, 1.};
+  return SampleShared(/*bit_gen=*/nullptr);
+}
+
+ItemSelector::KeyWithProbability HeapSelector::SampleShared(
+    absl::BitGen* bit_gen) const {
+  REVERB_CHECK(!heap_.empty());
+  return {heap_.front().key, 1.};
 }
 
 void HeapSelector::Clear() {
-  nodes_.clear();
-  heap_.Clear();
+  heap_.clear();
+  heap_positions_.Clear();
 }
 
+double HeapSelector::TotalWeight() const { return heap_.size(); }
+
 
 KeyDistributionOptions HeapSelector::options() const {
   KeyDistributionOptions options;
@@ -78,5 +131,47 @@ std::string HeapSelector::DebugString() const {
   return absl::StrCat("HeapSelector(sign=", sign_, ")");
 }
 
+void HeapSelector::Place(HeapEntry entry, size_t position) {
+  *heap_positions_.Find(entry.key) = position;
+  heap_[position] = entry;
+}
+
+void HeapSelector::Adjust(size_t position) {
+  if (position != 0 && Precedes(heap_[position], heap_[Parent(position)])) {
+    SiftUp(position);
+  } else {
+    SiftDown(position);
+  }
+}
+
+void HeapSelector::SiftUp(size_t position) {
+  const HeapEntry entry = heap_[position];
+  while (position != 0) {
+    const size_t parent = Parent(position);
+    if (!Precedes(entry, heap_[parent])) break;
+    Place(heap_[parent], position);
+    position = parent;
+  }
+  Place(entry, position);
+}
+
+void HeapSelector::SiftDown(size_t position) {
+  const HeapEntry entry = heap_[position];
+  const size_t size = heap_.size();
+  while (true) {
+    const size_t first_child = kArity * position + 1;
+    if (first_child >= size) break;
+    const size_t last_child = std::min(first_child + kArity, size);
+    size_t child = first_child;
+    for (size_t i = first_child + 1; i < last_child; ++i) {
+      if (Precedes(heap_[i], heap_[child])) child = i;
+    }
+    if (!Precedes(heap_[child], entry)) break;
+    Place(heap_[child], position);
+    position = child;
+  }
+  Place(entry, position);
+}
+
 }  // namespace reverb
 }  // namespace deepmind
@@ -15,10 +15,12 @@
 #ifndef REVERB_CC_SELECTORS_HEAP_H_
 #define REVERB_CC_SELECTORS_HEAP_H_
 
+#include <cstddef>
 #include <cstdint>
-#include "reverb/cc/platform/hash_map.h"
+#include <vector>
+
+#include "reverb/cc/selectors/dense_key_map.h"
 #include "reverb/cc/selectors/interface.h"
-#include "reverb/cc/support/intrusive_heap.h"
 
 namespace deepmind {
 namespace reverb {
@@ -26,8 +28,21 @@ namespace reverb {
 // HeapSelector always samples the item with the lowest or highest priority
 // (controlled by `min_heap`). If multiple items share the same priority then
 // the least recently inserted or updated key is sampled.
+//
+// The heap is a dense array of entries which hold everything needed to order
+// them, so sifting an entry only touches the heap itself and the (equally
+// dense) positions of the moved entries, which are indexed by key. Inserts and
+// deletes do not allocate once the vectors have grown to the size of the
+// heap.
+//
+// Every node has `kArity` children, which are adjacent in the heap. Compared
+// to a binary heap this halves the depth of the heap and thus the number of
+// cache misses per sift in large tables, at the cost of a few more comparisons
+// between children that share a cache line.
 class HeapSelector : public ItemSelector {
  public:
+  static constexpr size_t kArity = 4;
+
   explicit HeapSelector(bool min_heap = true);
 
   // O(log n) time.
@@ -36,50 +51,70 @@ class HeapSelector : public ItemSelector {
   // O(log n) time.
   absl::Status Insert(Key key, double priority) override;
 
+  // Returns an error without any change if any of the keys exist or the keys
+  // are not unique. Unless the batch is small compared to the keys already
+  // held, the entries are appended and the whole heap is rebuilt bottom-up.
+  // O(n + k) time for k inserts.
+  absl::Status InsertBatch(absl::Span<const KeyWithPriority> items) override;
+
   // O(log n) time.
   absl::Status Update(Key key, double priority) override;
 
   // O(1) time.
   KeyWithProbability Sample() override;
 
+  // O(1) time.
+  KeyWithProbability SampleShared(absl::BitGen* bit_gen) const override;
+
+  bool SupportsSampleShared() const override { return true; }
+
   // O(n) time.
   void Clear() override;
 
+  // Returns the number of keys. O(1) time.
+  double TotalWeight() const override;
+
   KeyDistributionOptions options() const override;
 
   std::string DebugString() const override;
 
  private:
-  struct HeapNode {
-    Key key;
+  struct HeapEntry {
     double priority;
-    IntrusiveHeapLink heap;
     uint64_t update_number;
-
-    HeapNode(Key key, double priority, uint64_t update_number)
-        : key(key), priority(priority), update_number(update_number) {}
+    Key key;
   };
 
-  struct HeapNodeCompare {
-    bool operator()(const HeapNode* a, const HeapNode* b) const {
-      // Lexicographic ordering by (priority, update_number).
-      return (a->priority < b->priority) ||
-             ((a->priority == b->priority) &&
-              (a->update_number < b->update_number));
-    }
-  };
+  // Lexicographic ordering by (priority, update_number).
+  static bool Precedes(const HeapEntry& a, const HeapEntry& b) {
+    return (a.priority < b.priority) ||
+           ((a.priority == b.priority) && (a.update_number < b.update_number));
+  }
+
+  // Writes `entry` to `position` of `heap_` and records the position.
+  void Place(HeapEntry entry, size_t position);
+
+  // Position of the parent of the entry at `position` > 0.
+  static size_t Parent(size_t position) { return (position - 1) / kArity; }
+
+  // Restores the heap invariant after the entry at `position` changed.
+  void Adjust(size_t position);
+
+  // Moves the entry at `position` towards the top / bottom of the heap until
+  // the heap invariant holds.
+  void SiftUp(size_t position);
+  void SiftDown(size_t position);
 
   // 1 if `min_heap` = true, else -1. Priorities are multiplied by this number
   // to control whether the min or max priority item should be sampled.
   const double sign_;
 
-  // Heap where the top item is the one with the lowest/highest priority in the
-  // distribution.
-  IntrusiveHeap<HeapNode, HeapNodeCompare> heap_;
+  // `kArity`-ary heap where the top entry (index 0) is the one with the
+  // lowest/highest priority in the distribution.
+  std::vector<HeapEntry> heap_;
 
-  // `IntrusiveHeap` does not manage the memory of its nodes so they are stored
-  // in `nodes_`. The content of nodes_ and heap_ are always kept in sync.
-  internal::flat_hash_map<Key, std::unique_ptr<HeapNode>> nodes_;
+  // Position in `heap_` of the entry of every key.
+  DenseKeyMap<size_t> heap_positions_;
 
   // Keep track of the number of inserts/updates for most-recent tie-breaking.
   uint64_t update_count_;
@@ -14,8 +14,15 @@
 
 #include "reverb/cc/selectors/heap.h"
 
+#include <algorithm>
+#include <map>
+#include <utility>
+#include <vector>
+
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
+#include "absl/random/distributions.h"
+#include "absl/random/random.h"
 #include "reverb/cc/schema.pb.h"
 #include "reverb/cc/platform/status_matchers.h"
 #include "reverb/cc/selectors/interface.h"
@@ -160,6 +167,61 @@ TEST(HeapSelectorTest, ProbabilityIsAlwaysOne) {
   }
 }
 
+TEST(HeapSelectorTest, MatchesSortedOrderAfterRandomOperations) {
+  HeapSelector heap;
+  // Reference of the (priority, update number) of every key.
+  std::map<ItemSelector::Key, std::pair<double, int>> reference;
+  absl::BitGen bit_gen;
+  for (int i = 0; i < 10000; i++) {
+    const ItemSelector::Key key = absl::Uniform<int>(bit_gen, 0, 100);
+    const double priority = absl::Uniform<int>(bit_gen, 0, 10);
+    const int operation = absl::Uniform<int>(bit_gen, 0, 3);
+    if (reference.count(key) == 0) {
+      REVERB_EXPECT_OK(heap.Insert(key, priority));
+      reference[key] = {priority, i};
+    } else if (operation == 0) {
+      REVERB_EXPECT_OK(heap.Delete(key));
+      reference.erase(key);
+    } else {
+      REVERB_EXPECT_OK(heap.Update(key, priority));
+      reference[key] = {priority, i};
+    }
+
+    if (reference.empty()) continue;
+    auto top = std::min_element(
+        reference.begin(), reference.end(),
+        [](const auto& a, const auto& b) { return a.second < b.second; });
+    EXPECT_EQ(heap.Sample().key, top->first);
+  }
+  EXPECT_EQ(heap.TotalWeight(), reference.size());
+}
+
+TEST(HeapSelectorTest, InsertBatchMatchesSortedOrder) {
+  HeapSelector heap;
+  REVERB_EXPECT_OK(heap.Insert(1000, 5));
+
+  // Priorities with ties, which are broken by the order of the batch.
+  std::vector<std::pair<double, ItemSelector::Key>> reference = {{5, 1000}};
+  std::vector<KeyWithPriority> items;
+  absl::BitGen bit_gen;
+  for (int i = 0; i < 1000; i++) {
+    const double priority = absl::Uniform<int>(bit_gen, 0, 10);
+    items.push_back(testing::MakeKeyWithPriority(i, priority));
+    reference.emplace_back(priority, i);
+  }
+  REVERB_EXPECT_OK(heap.InsertBatch(items));
+  EXPECT_EQ(heap.InsertBatch({testing::MakeKeyWithPriority(1000, 1)}).code(),
+            absl::StatusCode::kInvalidArgument);
+
+  std::stable_sort(
+      reference.begin(), reference.end(),
+      [](const auto& a, const auto& b) { return a.first < b.first; });
+  for (const auto& [priority, key] : reference) {
+    ASSERT_EQ(heap.Sample().key, key);
+    REVERB_EXPECT_OK(heap.Delete(key));
+  }
+}
+
 TEST(HeapSelectorTest, Options) {
   HeapSelector min_heap;
   HeapSelector max_heap(false);
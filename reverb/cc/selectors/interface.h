@@ -16,18 +16,42 @@
 #define REVERB_CC_SELECTORS_INTERFACE_H_
 
 #include <cstdint>
+#include <string>
+#include <vector>
+
+#include "absl/random/random.h"
 #include "absl/status/status.h"
+#include "absl/types/span.h"
 #include "reverb/cc/checkpointing/checkpoint.pb.h"
+#include "reverb/cc/platform/logging.h"
+#include "reverb/cc/schema.pb.h"
 
 namespace deepmind {
 namespace reverb {
 
+// Concrete type of an `ItemSelector` which `Table` calls without virtual
+// dispatch (see `internal::VisitSelector`).
+enum class SelectorKind {
+  kGeneric,
+  kFifo,
+  kUniform,
+  kPrioritized,
+};
+
 // Allows sampling from a population of keys with a specified priority per key.
 //
 // Member methods will not be called concurrently, so implementations do not
 // need to be thread-safe.  More to the point, a number of subclasses use bit
 // generators that are not thread-safe, so methods like `Sample` are not
-// thread-safe.
+// thread-safe. The exceptions are `SampleShared` and `SampleBatchShared`,
+// which may be called concurrently with each other (but not with any other
+// method).
+//
+// Keys are dense: `Table` assigns every item a slot id when it is inserted and
+// passes the slot ids rather than the (random) item keys to its selectors. Slot
+// ids are reused once their item has been deleted, so they stay below the
+// largest number of items the table has held. Implementations should index
+// per key state by key (see `DenseKeyMap`) rather than hash the keys.
 class ItemSelector {
  public:
   using Key = uint64_t;
@@ -47,22 +71,103 @@ class ItemSelector {
   // if the key already exists.
   virtual absl::Status Insert(Key key, double priority) = 0;
 
+  // Inserts `items` in order, as if by calling `Insert` for each of them.
+  // Used to bulk load the keys of a table (e.g. when restoring a checkpoint),
+  // so implementations can size their state for all the keys at once and build
+  // it in a single pass. The default implementation calls `Insert` for each
+  // item and stops at the first error.
+  virtual absl::Status InsertBatch(absl::Span<const KeyWithPriority> items) {
+    for (const auto& item : items) {
+      if (auto status = Insert(item.key(), item.priority()); !status.ok()) {
+        return status;
+      }
+    }
+    return absl::OkStatus();
+  }
+
   // Updates a key and associated priority. Returns an error if the key does
   // not exist.
   virtual absl::Status Update(Key key, double priority) = 0;
 
+  // Applies `updates` in order, as if by calling `Update` for each of them.
+  // Implementations can check that all the updates are valid before applying
+  // any of them, and coalesce the work shared between the updates. The default
+  // implementation calls `Update` for each update and stops at the first
+  // error.
+  virtual absl::Status UpdateBatch(absl::Span<const KeyWithPriority> updates) {
+    for (const auto& update : updates) {
+      if (auto status = Update(update.key(), update.priority()); !status.ok()) {
+        return status;
+      }
+    }
+    return absl::OkStatus();
+  }
+
   // Samples a key. Must contain keys when this is called.
   virtual KeyWithProbability Sample() = 0;
 
+  // Samples `n` keys and appends them to `samples`. Must contain keys when this
+  // is called. Every key of the batch is selected with the probability
+  // returned by `Sample`, but implementations may correlate the keys within a
+  // batch (e.g. by stratifying them) to reduce the variance of the batch. The
+  // default implementation calls `Sample` `n` times.
+  virtual void SampleBatch(int n, std::vector<KeyWithProbability>* samples) {
+    samples->reserve(samples->size() + n);
+    for (int i = 0; i < n; i++) {
+      samples->push_back(Sample());
+    }
+  }
+
+  // Same as `Sample` but draws random numbers from `bit_gen` and does not
+  // change the state of the selector. This allows multiple threads, each with
+  // their own `bit_gen`, to sample concurrently (e.g. while holding a shared
+  // lock on the table). Only called if `SupportsSampleShared` returns true.
+  // The default implementation CHECK-fails.
+  virtual KeyWithProbability SampleShared(absl::BitGen* bit_gen) const {
+    REVERB_CHECK(false) << "SampleShared is not implemented by "
+                        << DebugString();
+    return {};
+  }
+
+  // True if the selector implements `SampleShared`. Tables select the keys of
+  // selectors which do not (the default) while holding their lock exclusively.
+  virtual bool SupportsSampleShared() const { return false; }
+
+  // Same as `SampleBatch` but with the guarantees of `SampleShared`. The
+  // default implementation calls `SampleShared` `n` times.
+  virtual void SampleBatchShared(
+      int n, absl::BitGen* bit_gen,
+      std::vector<KeyWithProbability>* samples) const {
+    samples->reserve(samples->size() + n);
+    for (int i = 0; i < n; i++) {
+      samples->push_back(SampleShared(bit_gen));
+    }
+  }
+
   // Clear the distribution of all data.
   virtual void Clear() = 0;
 
+  // Total (unnormalized) sampling weight of the keys currently held. This is
+  // used when sampling across several selectors (e.g. the shards of a
+  // `ShardedTable`) to select one of them proportionally to its share of the
+  // combined distribution. Selectors where the priority does not affect the
+  // probability of a key being selected return the number of keys.
+  //
+  // Called by the table after every mutation so implementations must be cheap.
+  // The default implementation returns a negative value which tells the table
+  // that the weight is unknown, in which case the number of keys is used.
+  virtual double TotalWeight() const { return -1; }
+
   // Options for dynamically constructing the distribution. Required when
   // reconstructing class from checkpoint.  Also used to query table metadata.
   virtual KeyDistributionOptions options() const = 0;
 
   // Returns a summary string description.
   virtual std::string DebugString() const = 0;
+
+  // Concrete type of the selector. Only the (final) selectors listed in
+  // `SelectorKind` return anything but `kGeneric`.
+  virtual SelectorKind kind() const { return SelectorKind::kGeneric; }
 };
 
 }  // namespace reverb
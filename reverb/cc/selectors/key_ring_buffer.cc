@@ -0,0 +1,111 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/selectors/key_ring_buffer.h"
+
+#include <utility>
+
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "reverb/cc/platform/logging.h"
+
+namespace deepmind {
+namespace reverb {
+namespace {
+
+// Tombstones are only compacted once there are at least this many of them so
+// small buffers are not compacted over and over.
+constexpr size_t kMinTombstonesToCompact = 64;
+
+}  // namespace
+
+absl::Status KeyRingBuffer::Insert(Key key) {
+  if (!sequence_numbers_.Insert(key, end_)) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Key ", key, " already inserted."));
+  }
+  if (end_ - begin_ == slots_.size()) Grow();
+  SlotOf(end_++) = {key, /*deleted=*/false};
+  return absl::OkStatus();
+}
+
+absl::Status KeyRingBuffer::Delete(Key key) {
+  const uint64_t* found = sequence_numbers_.Find(key);
+  if (found == nullptr) {
+    return absl::InvalidArgumentError(absl::StrCat("Key ", key, " not found."));
+  }
+  const uint64_t sequence_number = *found;
+  sequence_numbers_.Erase(key);
+
+  if (sequence_numbers_.empty()) {
+    begin_ = end_;
+    num_tombstones_ = 0;
+  } else if (sequence_number == begin_) {
+    while (SlotOf(++begin_).deleted) num_tombstones_--;
+  } else if (sequence_number == end_ - 1) {
+    while (SlotOf(--end_ - 1).deleted) num_tombstones_--;
+  } else {
+    SlotOf(sequence_number).deleted = true;
+    if (++num_tombstones_ >= kMinTombstonesToCompact &&
+        num_tombstones_ > sequence_numbers_.size()) {
+      Compact();
+    }
+  }
+  return absl::OkStatus();
+}
+
+bool KeyRingBuffer::Contains(Key key) const {
+  return sequence_numbers_.contains(key);
+}
+
+KeyRingBuffer::Key KeyRingBuffer::Oldest() const {
+  REVERB_CHECK(!empty());
+  return SlotOf(begin_).key;
+}
+
+KeyRingBuffer::Key KeyRingBuffer::Newest() const {
+  REVERB_CHECK(!empty());
+  return SlotOf(end_ - 1).key;
+}
+
+void KeyRingBuffer::Clear() {
+  slots_ = std::vector<Slot>();
+  begin_ = 0;
+  end_ = 0;
+  num_tombstones_ = 0;
+  sequence_numbers_.Clear();
+}
+
+void KeyRingBuffer::Grow() {
+  std::vector<Slot> slots(slots_.empty() ? 16 : slots_.size() * 2);
+  for (uint64_t i = begin_; i < end_; i++) {
+    slots[i & (slots.size() - 1)] = SlotOf(i);
+  }
+  slots_ = std::move(slots);
+}
+
+void KeyRingBuffer::Compact() {
+  uint64_t next = begin_;
+  for (uint64_t i = begin_; i < end_; i++) {
+    const Slot& slot = SlotOf(i);
+    if (slot.deleted) continue;
+    *sequence_numbers_.Find(slot.key) = next;
+    SlotOf(next++) = slot;
+  }
+  end_ = next;
+  num_tombstones_ = 0;
+}
+
+}  // namespace reverb
+}  // namespace deepmind
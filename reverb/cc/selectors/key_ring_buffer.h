@@ -0,0 +1,107 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_SELECTORS_KEY_RING_BUFFER_H_
+#define REVERB_CC_SELECTORS_KEY_RING_BUFFER_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "reverb/cc/selectors/dense_key_map.h"
+#include "reverb/cc/selectors/interface.h"
+
+namespace deepmind {
+namespace reverb {
+
+// Keys in insertion order, used by `FifoSelector` and `LifoSelector`.
+//
+// Every inserted key is assigned the next sequence number and is stored in a
+// ring buffer at the slot of that number, so the oldest and newest keys are
+// found and removed in O(1) time without touching any other memory. The
+// sequence numbers are indexed by key to delete arbitrary keys.
+//
+// Deleting a key other than the oldest or newest leaves a tombstone in its
+// slot which is skipped once it reaches either end. The live keys are
+// compacted when the tombstones outnumber them so the memory stays
+// proportional to the number of keys. All operations take amortized O(1)
+// time.
+class KeyRingBuffer {
+ public:
+  using Key = ItemSelector::Key;
+
+  // Appends `key` as the newest key. Returns an error if `key` is already
+  // present.
+  absl::Status Insert(Key key);
+
+  // Removes `key`. Returns an error if `key` is not present.
+  absl::Status Delete(Key key);
+
+  // Returns true if `key` is present.
+  bool Contains(Key key) const;
+
+  // Returns the least recently inserted key. Must not be empty.
+  Key Oldest() const;
+
+  // Returns the most recently inserted key. Must not be empty.
+  Key Newest() const;
+
+  // Number of keys.
+  size_t size() const { return sequence_numbers_.size(); }
+
+  bool empty() const { return sequence_numbers_.empty(); }
+
+  // Removes all keys and releases the buffer.
+  void Clear();
+
+ private:
+  struct Slot {
+    Key key;
+    bool deleted;
+  };
+
+  Slot& SlotOf(uint64_t sequence_number) {
+    return slots_[sequence_number & (slots_.size() - 1)];
+  }
+
+  const Slot& SlotOf(uint64_t sequence_number) const {
+    return slots_[sequence_number & (slots_.size() - 1)];
+  }
+
+  // Doubles the capacity of `slots_`, keeping every slot at its sequence
+  // number.
+  void Grow();
+
+  // Moves the live keys next to each other and renumbers them, removing all
+  // tombstones.
+  void Compact();
+
+  // Ring buffer whose size is zero or a power of two. The slots of the
+  // sequence numbers in [`begin_`, `end_`) are in use, the others are free.
+  std::vector<Slot> slots_;
+  uint64_t begin_ = 0;
+  uint64_t end_ = 0;
+
+  // Number of slots in [`begin_`, `end_`) holding deleted keys. The slots at
+  // `begin_` and `end_ - 1` never do.
+  size_t num_tombstones_ = 0;
+
+  // Sequence number of every key present.
+  DenseKeyMap<uint64_t> sequence_numbers_;
+};
+
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_SELECTORS_KEY_RING_BUFFER_H_
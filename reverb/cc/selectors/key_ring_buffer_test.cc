@@ -0,0 +1,112 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/selectors/key_ring_buffer.h"
+
+#include <deque>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/random/distributions.h"
+#include "absl/random/random.h"
+#include "absl/status/status.h"
+#include "reverb/cc/platform/status_matchers.h"
+
+namespace deepmind {
+namespace reverb {
+namespace {
+
+TEST(KeyRingBufferTest, ReturnValueSantiyChecks) {
+  KeyRingBuffer keys;
+
+  EXPECT_EQ(keys.Delete(123).code(), absl::StatusCode::kInvalidArgument);
+  EXPECT_FALSE(keys.Contains(123));
+
+  REVERB_EXPECT_OK(keys.Insert(123));
+  EXPECT_EQ(keys.Insert(123).code(), absl::StatusCode::kInvalidArgument);
+  EXPECT_TRUE(keys.Contains(123));
+
+  REVERB_EXPECT_OK(keys.Delete(123));
+  EXPECT_EQ(keys.Delete(123).code(), absl::StatusCode::kInvalidArgument);
+  EXPECT_TRUE(keys.empty());
+}
+
+TEST(KeyRingBufferTest, KeepsInsertionOrder) {
+  KeyRingBuffer keys;
+  for (int i = 0; i < 100; i++) {
+    REVERB_EXPECT_OK(keys.Insert(i));
+  }
+  // Tombstones in the middle are skipped once they reach either end.
+  for (int i = 1; i < 99; i++) {
+    if (i % 10 != 5) REVERB_EXPECT_OK(keys.Delete(i));
+  }
+  EXPECT_EQ(keys.size(), 12);
+
+  REVERB_EXPECT_OK(keys.Delete(0));
+  EXPECT_EQ(keys.Oldest(), 5);
+  REVERB_EXPECT_OK(keys.Delete(99));
+  EXPECT_EQ(keys.Newest(), 95);
+  EXPECT_EQ(keys.size(), 10);
+}
+
+TEST(KeyRingBufferTest, MatchesDequeAfterRandomOperations) {
+  KeyRingBuffer keys;
+  std::deque<int> reference;
+  absl::BitGen bit_gen;
+  int next_key = 0;
+  for (int i = 0; i < 100000; i++) {
+    // Grow the buffer at first and let it shrink back afterwards, deleting
+    // mostly keys at either end.
+    const bool insert = reference.empty() ||
+                        absl::Bernoulli(bit_gen, i < 50000 ? 0.6 : 0.4);
+    if (insert) {
+      REVERB_EXPECT_OK(keys.Insert(next_key));
+      reference.push_back(next_key++);
+    } else {
+      const double choice = absl::Uniform<double>(bit_gen, 0, 1);
+      auto it = choice < 0.4   ? reference.begin()
+                : choice < 0.6 ? reference.end() - 1
+                               : reference.begin() +
+                                     absl::Uniform<size_t>(bit_gen, 0,
+                                                           reference.size());
+      REVERB_EXPECT_OK(keys.Delete(*it));
+      reference.erase(it);
+    }
+    ASSERT_EQ(keys.size(), reference.size());
+    if (!reference.empty()) {
+      ASSERT_EQ(keys.Oldest(), reference.front());
+      ASSERT_EQ(keys.Newest(), reference.back());
+    }
+  }
+  for (int key : reference) {
+    EXPECT_TRUE(keys.Contains(key));
+  }
+}
+
+TEST(KeyRingBufferTest, Clear) {
+  KeyRingBuffer keys;
+  for (int i = 0; i < 100; i++) {
+    REVERB_EXPECT_OK(keys.Insert(i));
+  }
+  keys.Clear();
+  EXPECT_TRUE(keys.empty());
+  EXPECT_FALSE(keys.Contains(0));
+  REVERB_EXPECT_OK(keys.Insert(0));
+  EXPECT_EQ(keys.Oldest(), 0);
+  EXPECT_EQ(keys.Newest(), 0);
+}
+
+}  // namespace
+}  // namespace reverb
+}  // namespace deepmind
@@ -23,40 +23,36 @@ namespace deepmind {
 namespace reverb {
 
 absl::Status LifoSelector::Delete(ItemSelector::Key key) {
-  auto it = key_to_iterator_.find(key);
-  if (it == key_to_iterator_.end())
-    return absl::InvalidArgumentError(absl::StrCat("Key ", key, " not found."));
-  keys_.erase(it->second);
-  key_to_iterator_.erase(it);
-  return absl::OkStatus();
+  return keys_.Delete(key);
 }
 
 absl::Status LifoSelector::Insert(ItemSelector::Key key, double priority) {
-  if (key_to_iterator_.find(key) != key_to_iterator_.end()) {
-    return absl::InvalidArgumentError(
-        absl::StrCat("Key ", key, " already inserted."));
-  }
-  key_to_iterator_.emplace(key, keys_.emplace(keys_.begin(), key));
-  return absl::OkStatus();
+  return keys_.Insert(key);
 }
 
 absl::Status LifoSelector::Update(ItemSelector::Key key, double priority) {
-  if (key_to_iterator_.find(key) == key_to_iterator_.end()) {
+  if (!keys_.Contains(key)) {
     return absl::InvalidArgumentError(absl::StrCat("Key ", key, " not found."));
   }
   return absl::OkStatus();
 }
 
 ItemSelector::KeyWithProbability LifoSelector::Sample() {
+  return SampleShared(/*bit_gen=*/nullptr);
+}
+
+ItemSelector::KeyWithProbability LifoSelector::SampleShared(
+    absl::BitGen* bit_gen) const {
   REVERB_CHECK(!keys_.empty());
-  return {keys_.front(), 1.};
+  return {keys_.Newest(), 1.};
 }
 
 void LifoSelector::Clear() {
-  keys_.clear();
-  key_to_iterator_.clear();
+  keys_.Clear();
 }
 
+double LifoSelector::TotalWeight() const { return keys_.size(); }
+
 KeyDistributionOptions LifoSelector::options() const {
   KeyDistributionOptions options;
   options.set_lifo(true);
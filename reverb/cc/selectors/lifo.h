@@ -15,12 +15,10 @@
 #ifndef REVERB_CC_SELECTORS_LIFO_H_
 #define REVERB_CC_SELECTORS_LIFO_H_
 
-#include <list>
-
 #include "absl/status/status.h"
 #include "reverb/cc/checkpointing/checkpoint.pb.h"
-#include "reverb/cc/platform/hash_map.h"
 #include "reverb/cc/selectors/interface.h"
+#include "reverb/cc/selectors/key_ring_buffer.h"
 
 namespace deepmind {
 namespace reverb {
@@ -41,15 +39,21 @@ class LifoSelector : public ItemSelector {
 
   KeyWithProbability Sample() override;
 
+  KeyWithProbability SampleShared(absl::BitGen* bit_gen) const override;
+
+  bool SupportsSampleShared() const override { return true; }
+
   void Clear() override;
 
+  // Returns the number of keys. O(1) time.
+  double TotalWeight() const override;
+
   KeyDistributionOptions options() const override;
 
   std::string DebugString() const override;
 
  private:
-  std::list<Key> keys_;
-  internal::flat_hash_map<Key, std::list<Key>::iterator> key_to_iterator_;
+  KeyRingBuffer keys_;
 };
 
 }  // namespace reverb
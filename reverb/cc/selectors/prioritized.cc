@@ -14,8 +14,11 @@
 
 #include "reverb/cc/selectors/prioritized.h"
 
+#include <algorithm>
 #include <cmath>
 #include <cstddef>
+#include <utility>
+#include <vector>
 
 #include "absl/random/distributions.h"
 #include "absl/status/status.h"
@@ -28,15 +31,30 @@ namespace deepmind {
 namespace reverb {
 namespace {
 
-// If the approximation error at a node exceeds this threshold, the sum tree is
-// reinitialized.
-constexpr double kMaxApproximationError = 1e-4;
+// Functions turning a priority into a weight by raising it to the exponent. A
+// priority of zero should correspond to zero probability, even if the priority
+// exponent is zero. Expect the priority and the exponent to be non-negative.
+// The common exponents avoid the comparatively slow std::pow.
+double PowWeight(double priority, double exponent) {
+  return priority == 0. ? 0. : std::pow(priority, exponent);
+}
+
+double ZeroExponentWeight(double priority, double) {
+  return priority == 0. ? 0. : 1.;
+}
+
+double SqrtWeight(double priority, double) { return std::sqrt(priority); }
+
+double IdentityWeight(double priority, double) { return priority; }
 
-// A priority of zero should correspond to zero probability, even if the
-// priority exponent is zero. So this modified version of std::pow is used to
-// turn priorities into weights. Expects base and exponent to be non-negative.
-inline double power(double base, double exponent) {
-  return base == 0. ? 0. : std::pow(base, exponent);
+double SquareWeight(double priority, double) { return priority * priority; }
+
+PrioritizedSelector::WeightFn SelectWeightFn(double exponent) {
+  if (exponent == 0.) return &ZeroExponentWeight;
+  if (exponent == 0.5) return &SqrtWeight;
+  if (exponent == 1.) return &IdentityWeight;
+  if (exponent == 2.) return &SquareWeight;
+  return &PowWeight;
 }
 
 absl::Status CheckValidPriority(double priority) {
@@ -51,111 +69,255 @@ absl::Status CheckValidPriority(double priority) {
 }  // namespace
 
 PrioritizedSelector::PrioritizedSelector(double priority_exponent)
-    : priority_exponent_(priority_exponent), capacity_(std::pow(2, 17)) {
+    : priority_exponent_(priority_exponent),
+      weight_fn_(SelectWeightFn(priority_exponent)),
+      capacity_(kFanOut) {
   REVERB_CHECK_GE(priority_exponent_, 0);
-  sum_tree_.resize(capacity_);
+  ResizeSumTree();
 }
 
 absl::Status PrioritizedSelector::Delete(Key key) {
-  const size_t last_index = key_to_index_.size() - 1;
-  const auto it = key_to_index_.find(key);
-  if (it == key_to_index_.end())
+  const size_t last_index = keys_.size() - 1;
+  const size_t* found = key_to_index_.Find(key);
+  if (found == nullptr)
     return absl::InvalidArgumentError(absl::StrCat("Key ", key, " not found."));
-  const size_t index = it->second;
+  const size_t index = *found;
 
   if (index != last_index) {
     // Replace the element that we want to remove with the last element.
-    SetNode(index, NodeValue(last_index));
-    const Key last_key = sum_tree_[last_index].key;
-    sum_tree_[index].key = last_key;
-    key_to_index_[last_key] = index;
+    SetWeight(index, levels_[0][last_index]);
+    keys_[index] = keys_[last_index];
+    priorities_[index] = priorities_[last_index];
+    *key_to_index_.Find(keys_[index]) = index;
   }
 
-  SetNode(last_index, 0);
-  key_to_index_.erase(it);  // Note that this must occur after SetNode.
+  SetWeight(last_index, 0);
+  keys_.pop_back();
+  priorities_.pop_back();
+  key_to_index_.Erase(key);
 
   return absl::OkStatus();
 }
 
 absl::Status PrioritizedSelector::Insert(Key key, double priority) {
   REVERB_RETURN_IF_ERROR(CheckValidPriority(priority));
-  const size_t index = key_to_index_.size();
+  const size_t index = keys_.size();
+  if (!key_to_index_.Insert(key, index)) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Key ", key, " already inserted."));
+  }
   if (index == capacity_) {
     capacity_ *= 2;
-    sum_tree_.resize(capacity_);
+    ResizeSumTree();
   }
-  if (!key_to_index_.try_emplace(key, index).second) {
-    return absl::InvalidArgumentError(
-        absl::StrCat("Key ", key, " already inserted."));
+  keys_.push_back(key);
+  priorities_.push_back(priority);
+
+  SetWeight(index, Weight(priority));
+  return absl::OkStatus();
+}
+
+absl::Status PrioritizedSelector::InsertBatch(
+    absl::Span<const KeyWithPriority> items) {
+  // Everything is validated up front so the selector is left unchanged if any
+  // of the items is invalid.
+  DenseKeyMap<bool> batch_keys;
+  for (const auto& item : items) {
+    REVERB_RETURN_IF_ERROR(CheckValidPriority(item.priority()));
+    if (key_to_index_.contains(item.key()) ||
+        !batch_keys.Insert(item.key(), true)) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Key ", item.key(), " already inserted."));
+    }
+  }
+
+  const size_t first = keys_.size();
+  const size_t size = first + items.size();
+  keys_.reserve(size);
+  priorities_.reserve(size);
+  key_to_index_.Reserve(size);
+  if (size > capacity_) {
+    capacity_ = (size + kFanOut - 1) / kFanOut * kFanOut;
+    ResizeSumTree();
   }
-  sum_tree_[index].key = key;
 
-  SetNode(index, power(priority, priority_exponent_));
+  for (const auto& item : items) {
+    key_to_index_.Insert(item.key(), keys_.size());
+    levels_[0][keys_.size()] = Weight(item.priority());
+    keys_.push_back(item.key());
+    priorities_.push_back(item.priority());
+  }
+
+  // Rebuilding the whole tree visits every node once, which is cheaper than
+  // recomputing the ancestors of every new key unless the tree already holds
+  // many more keys than the batch.
+  if (items.size() >= first) {
+    ReinitializeSumTree();
+  } else {
+    for (size_t index = first; index < size; ++index) {
+      SetWeight(index, levels_[0][index]);
+    }
+  }
   return absl::OkStatus();
 }
 
 absl::Status PrioritizedSelector::Update(Key key, double priority) {
   REVERB_RETURN_IF_ERROR(CheckValidPriority(priority));
-  const auto it = key_to_index_.find(key);
-  if (it == key_to_index_.end()) {
+  const size_t* index = key_to_index_.Find(key);
+  if (index == nullptr) {
     return absl::InvalidArgumentError(absl::StrCat("Key ", key, " not found."));
   }
-  SetNode(it->second, power(priority, priority_exponent_));
+  priorities_[*index] = priority;
+  SetWeight(*index, Weight(priority));
+  return absl::OkStatus();
+}
+
+absl::Status PrioritizedSelector::UpdateBatch(
+    absl::Span<const KeyWithPriority> updates) {
+  std::vector<std::pair<size_t, double>> priorities;
+  priorities.reserve(updates.size());
+  for (const auto& update : updates) {
+    REVERB_RETURN_IF_ERROR(CheckValidPriority(update.priority()));
+    const size_t* index = key_to_index_.Find(update.key());
+    if (index == nullptr) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Key ", update.key(), " not found."));
+    }
+    priorities.emplace_back(*index, update.priority());
+  }
+
+  // The weights are written in the order of the tree, so every level is
+  // visited front to back. The sort is stable so the last update of a key
+  // is applied last.
+  std::stable_sort(
+      priorities.begin(), priorities.end(),
+      [](const auto& a, const auto& b) { return a.first < b.first; });
+  std::vector<size_t> indices;
+  indices.reserve(priorities.size());
+  for (const auto& [index, priority] : priorities) {
+    priorities_[index] = priority;
+    levels_[0][index] = Weight(priority);
+    indices.push_back(index);
+  }
+
+  // Recompute the sums of the ancestors from their children, once per
+  // ancestor.
+  for (size_t l = 1; l < levels_.size(); ++l) {
+    for (auto& index : indices) index /= kFanOut;
+    indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+    for (size_t index : indices) {
+      levels_[l][index] = SumOfChildren(l, index);
+    }
+  }
   return absl::OkStatus();
 }
 
 ItemSelector::KeyWithProbability PrioritizedSelector::Sample() {
-  const size_t size = key_to_index_.size();
+  // This should never be called concurrently from multiple threads.
+  return SampleShared(&bit_gen_);
+}
+
+ItemSelector::KeyWithProbability PrioritizedSelector::SampleShared(
+    absl::BitGen* bit_gen) const {
+  const size_t size = keys_.size();
   REVERB_CHECK_NE(size, 0);
 
-  // This should never be called concurrently from multiple threads.
-  const double target = absl::Uniform<double>(bit_gen_, 0, 1);
-  const double total_weight = sum_tree_[0].sum;
+  const double target = absl::Uniform<double>(*bit_gen, 0, 1);
+  const double total_weight = TotalWeight();
 
   // All keys have zero priority so treat as if uniformly sampling.
   if (total_weight == 0) {
     const size_t pos = static_cast<size_t>(target * size);
-    return {sum_tree_[pos].key, 1. / size};
+    return {keys_[pos], 1. / size};
   }
 
-  // We begin traversing the `sum_tree_` from the root to the children in order
-  // to find the `index` corresponding to the sampled `target_weight`.
+  // We begin traversing the tree from the root to the leaves in order to find
+  // the `index` corresponding to the sampled `target_weight`.
   size_t index = 0;
   double target_weight = target * total_weight;
-  while (true) {
-    // Go to the left sub tree if it contains our sampled `target_weight`.
-    const size_t left_index = 2 * index + 1;
-    const double left_sum = NodeSum(left_index);
-    if (target_weight < left_sum) {
-      index = left_index;
-      continue;
-    }
-    target_weight -= left_sum;
-    // Go to the right sub tree if it contains our sampled `target_weight`.
-    const size_t right_index = 2 * index + 2;
-    const double right_sum = NodeSum(right_index);
-    if (target_weight < right_sum) {
-      index = right_index;
-      continue;
-    }
-    target_weight -= right_sum;
-    // Otherwise it is the current index.
-    break;
+  for (auto level = levels_.rbegin(); level != levels_.rend(); ++level) {
+    index = SelectChild(*level, index, &target_weight);
   }
   REVERB_CHECK_LT(index, size);
-  const double picked_weight = NodeValue(index);
+  const double picked_weight = levels_[0][index];
   REVERB_LOG_IF(REVERB_ERROR, target_weight >= picked_weight)
       << "Target weight should be smaller than picked weight (target_weight: "
       << target_weight << " >= picked_weight:" << picked_weight << ").";
-  return {sum_tree_[index].key, picked_weight / total_weight};
+  return {keys_[index], picked_weight / total_weight};
+}
+
+void PrioritizedSelector::SampleBatch(
+    int n, std::vector<KeyWithProbability>* samples) {
+  SampleBatchShared(n, &bit_gen_, samples);
+}
+
+void PrioritizedSelector::SampleBatchShared(
+    int n, absl::BitGen* bit_gen,
+    std::vector<KeyWithProbability>* samples) const {
+  const size_t size = keys_.size();
+  REVERB_CHECK_NE(size, 0);
+  const double total_weight = TotalWeight();
+  samples->reserve(samples->size() + n);
+
+  // All keys have zero priority so there is nothing to stratify.
+  if (total_weight == 0) {
+    for (int i = 0; i < n; i++) {
+      samples->push_back(SampleShared(bit_gen));
+    }
+    return;
+  }
+
+  // The targets are drawn from consecutive strata so they are sorted, as are
+  // the nodes they select at every level.
+  std::vector<double> target_weights(n);
+  for (int i = 0; i < n; i++) {
+    target_weights[i] =
+        (i + absl::Uniform<double>(*bit_gen, 0, 1)) / n * total_weight;
+  }
+  std::vector<size_t> indices(n, 0);
+  for (auto level = levels_.rbegin(); level != levels_.rend(); ++level) {
+    for (int i = 0; i < n; i++) {
+      indices[i] = SelectChild(*level, indices[i], &target_weights[i]);
+    }
+  }
+
+  const size_t first = samples->size();
+  for (size_t index : indices) {
+    REVERB_CHECK_LT(index, size);
+    samples->push_back({keys_[index], levels_[0][index] / total_weight});
+  }
+  std::shuffle(samples->begin() + first, samples->end(), *bit_gen);
 }
 
 void PrioritizedSelector::Clear() {
-  for (size_t i = 0; i < key_to_index_.size(); ++i) {
-    sum_tree_[i].sum = 0;
-    sum_tree_[i].value = 0;
+  for (auto& level : levels_) {
+    std::fill(level.begin(), level.end(), 0);
+  }
+  keys_.clear();
+  priorities_.clear();
+  key_to_index_.Clear();
+}
+
+absl::Status PrioritizedSelector::SetPriorityExponent(
+    double priority_exponent) {
+  if (!(priority_exponent >= 0)) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Priority exponent must be non-negative, got ", priority_exponent,
+        "."));
+  }
+  priority_exponent_ = priority_exponent;
+  weight_fn_ = SelectWeightFn(priority_exponent);
+  for (size_t i = 0; i < priorities_.size(); i++) {
+    levels_[0][i] = Weight(priorities_[i]);
   }
-  key_to_index_.clear();
+  ReinitializeSumTree();
+  return absl::OkStatus();
+}
+
+double PrioritizedSelector::TotalWeight() const {
+  double total = 0;
+  for (double sum : levels_.back()) total += sum;
+  return total;
 }
 
 KeyDistributionOptions PrioritizedSelector::options() const {
@@ -170,60 +332,67 @@ std::string PrioritizedSelector::DebugString() const {
       "PrioritizedSelector(priority_exponent=", priority_exponent_, ")");
 }
 
-double PrioritizedSelector::NodeValue(size_t index) const {
-  return sum_tree_[index].value;
-}
-
-double PrioritizedSelector::NodeSum(size_t index) const {
-  return index < key_to_index_.size() ? sum_tree_[index].sum : 0;
+size_t PrioritizedSelector::SelectChild(const std::vector<double>& level,
+                                        size_t index,
+                                        double* target_weight) const {
+  // The children of the node are scanned for the first one whose range of the
+  // cumulative sum contains `target_weight`. Rounding errors can make
+  // `target_weight` exceed the sum of all the children in which case the last
+  // child with a non zero sum is picked.
+  const double* children = level.data() + index * kFanOut;
+  size_t child = 0;
+  size_t last_non_zero = 0;
+  for (; child < kFanOut; ++child) {
+    if (children[child] == 0) continue;
+    if (*target_weight < children[child]) break;
+    *target_weight -= children[child];
+    last_non_zero = child;
+  }
+  return index * kFanOut + (child < kFanOut ? child : last_non_zero);
 }
 
-double PrioritizedSelector::NodeSumTestingOnly(size_t index) const {
-  return NodeSum(index);
+double PrioritizedSelector::SumOfChildren(size_t level, size_t index) const {
+  const double* children = levels_[level - 1].data() + index * kFanOut;
+  double sum = 0;
+  for (size_t child = 0; child < kFanOut; ++child) {
+    sum += children[child];
+  }
+  return sum;
 }
 
-// Updates the sum stored in a node and tracks if the tree needs to be
-// re-initialized.
-// Ensure the sum never becomes negative (it may happen because of rounding
-// errors).
-#define UPDATE_SUM(i)                                          \
-  sum_tree_[(i)].sum += difference;                            \
-  if (sum_tree_[(i)].sum < 0) sum_tree_[(i)].sum = 0.0;        \
-  error = std::abs(sum_tree_[(i)].sum - NodeSum(2 * (i) + 1) - \
-                   NodeSum(2 * (i) + 2) - sum_tree_[(i)].value);
-
-void PrioritizedSelector::SetNode(size_t index, double value) {
-  const double difference = value - NodeValue(index);
-
-  // The floating point approximation error of the last node update.
-  double error = 0.0;
+void PrioritizedSelector::SetWeight(size_t index, double weight) {
+  levels_[0][index] = weight;
 
-  // Update the subject node.
-  sum_tree_[index].value = value;
-  UPDATE_SUM(index);
-
-  // Update all parents until we find the root node.
-  while (index != 0 && error <= kMaxApproximationError) {
-    index = (index - 1) / 2;
-    UPDATE_SUM(index);
+  // Every ancestor is recomputed from its children rather than adjusted by the
+  // difference of the weight, so rounding errors cannot accumulate over time.
+  // The children share a cache line so this is no more expensive.
+  for (size_t l = 1; l < levels_.size(); ++l) {
+    index /= kFanOut;
+    levels_[l][index] = SumOfChildren(l, index);
   }
+}
 
-  // If floating-point errors have built up, re-initialize the tree.
-  if (error > kMaxApproximationError) {
-    REVERB_LOG(REVERB_WARNING)
-        << "Tree needs to be initialized because node with index " << index
-        << " has approximation error " << error
-        << ", which exceeds the threshold of " << kMaxApproximationError;
-    ReinitializeSumTree();
+void PrioritizedSelector::ResizeSumTree() {
+  levels_.resize(1);
+  levels_[0].resize(capacity_, 0);
+  while (levels_.back().size() > kFanOut) {
+    const size_t num_nodes = (levels_.back().size() + kFanOut - 1) / kFanOut;
+    levels_.emplace_back((num_nodes + kFanOut - 1) / kFanOut * kFanOut, 0);
+  }
+  // Pad the lower levels so that every node of a level has all its children
+  // in the level below, even the nodes which only exist as padding.
+  for (int l = levels_.size() - 2; l >= 0; --l) {
+    levels_[l].resize(levels_[l + 1].size() * kFanOut, 0);
   }
+  ReinitializeSumTree();
 }
 
-#undef UPDATE_SUM
-
 void PrioritizedSelector::ReinitializeSumTree() {
-  // Re-initialize the sums from the leaves to the root node.
-  for (int64_t i = sum_tree_.size() - 1; i >= 0; --i) {
-    sum_tree_[i].sum = NodeValue(i) + NodeSum(2 * i + 1) + NodeSum(2 * i + 2);
+  // Re-initialize the sums from the leaves to the last level.
+  for (size_t l = 1; l < levels_.size(); ++l) {
+    for (size_t i = 0; i < levels_[l].size(); ++i) {
+      levels_[l][i] = SumOfChildren(l, i);
+    }
   }
 }
 
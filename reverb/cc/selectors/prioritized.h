@@ -20,7 +20,7 @@
 #include "absl/random/random.h"
 #include "absl/status/status.h"
 #include "reverb/cc/checkpointing/checkpoint.pb.h"
-#include "reverb/cc/platform/hash_map.h"
+#include "reverb/cc/selectors/dense_key_map.h"
 #include "reverb/cc/selectors/interface.h"
 
 namespace deepmind {
@@ -31,16 +31,18 @@ namespace reverb {
 // sampling a key is proportional to its priority raised to a configurable
 // exponent.
 //
-// Since the priorities and probabilities are stored as doubles, numerical
-// rounding errors may be introduced especially when the relative size of
-// probabilities for keys is large. Ideally when using this class priorities are
-// roughly the same scale and the priority exponent is not large, e.g. less than
-// 2.
+// The weights are summed in a tree where every inner node is recomputed from
+// its children whenever one of them changes, rather than adjusted by the
+// difference. The sums therefore only carry the rounding error of adding up the
+// current weights and do not drift as updates accumulate, however large the
+// range of the weights (and hence the priority exponent) is. Weights which are
+// many orders of magnitude smaller than the total weight are still lost to
+// rounding when added to it, so their probability is only approximate.
 //
 // This was forked from:
 // ## proportional_picker.h
 //
-class PrioritizedSelector : public ItemSelector {
+class PrioritizedSelector final : public ItemSelector {
  public:
   explicit PrioritizedSelector(double priority_exponent);
 
@@ -50,72 +52,134 @@ class PrioritizedSelector : public ItemSelector {
   // The priority must be non-negative. O(log n) time.
   absl::Status Insert(Key key, double priority) override;
 
+  // Returns an error without any change unless none of the keys exist, the
+  // keys are unique and all the priorities are non-negative. The sum tree is
+  // resized once to hold exactly the keys and, unless the batch is small
+  // compared to the keys already held, rebuilt bottom-up. O(n + k) time for k
+  // inserts.
+  absl::Status InsertBatch(absl::Span<const KeyWithPriority> items) override;
+
   // The priority must be non-negative. O(log n) time.
   absl::Status Update(Key key, double priority) override;
 
+  // Returns an error without any change unless all the keys exist and all the
+  // priorities are non-negative. The weights are set first and then the sum
+  // of every ancestor of an updated key is recomputed once, level by level.
+  // O(k log n) time for k updates, but ancestors shared between the updates
+  // (in particular the upper levels of the tree) are only visited once.
+  absl::Status UpdateBatch(absl::Span<const KeyWithPriority> updates) override;
+
   // O(log n) time.
   KeyWithProbability Sample() override;
 
+  // O(log n) time.
+  KeyWithProbability SampleShared(absl::BitGen* bit_gen) const override;
+
+  bool SupportsSampleShared() const override { return true; }
+
+  // Stratified sampling: the cumulative weight is split into `n` strata of
+  // equal weight and one key is sampled from each, so a key with a `1 / n`
+  // share of the total weight is sampled about once per batch. The targets of
+  // all strata are sorted so they descend the tree together, level by level,
+  // touching each node once. The keys are returned in random order.
+  // O(n log n) time.
+  void SampleBatch(int n, std::vector<KeyWithProbability>* samples) override;
+
+  // Same as `SampleBatch`. O(n log n) time.
+  void SampleBatchShared(
+      int n, absl::BitGen* bit_gen,
+      std::vector<KeyWithProbability>* samples) const override;
+
   // O(n) time.
   void Clear() override;
 
+  // Returns the sum of the exponentiated priorities. O(1) time.
+  double TotalWeight() const override;
+
   KeyDistributionOptions options() const override;
 
+  SelectorKind kind() const override { return SelectorKind::kPrioritized; }
+
   std::string DebugString() const override;
 
-  // Returns the sum stored at a node for testing purposes only.
-  double NodeSumTestingOnly(size_t index) const;
+  // Changes the exponent the priorities are raised to, e.g. to anneal the
+  // degree of prioritization during training. The weights of all keys are
+  // recomputed from their stored priorities in one pass, so the keys need not
+  // be reinserted. Returns an error without any change if the exponent is
+  // negative. O(n) time.
+  absl::Status SetPriorityExponent(double priority_exponent);
+
+  // Turns a priority into a weight given the priority exponent.
+  using WeightFn = double (*)(double priority, double priority_exponent);
+
+  // Number of children of every inner node of the sum tree. The sums of the
+  // children of a node are stored contiguously and fill one cache line.
+  static constexpr size_t kFanOut = 8;
 
  private:
-  struct Node {
-    Key key;
-    // Sum of the exponentiated priority of this node and all its descendants.
-    // This includes the entire sub tree with inner and leaf nodes.
-    // `NodeValue()` can be used to get the exponentiated priority of a node
-    // without its children.
-    double sum = 0;
-    // The exponentiated priority of this node. This can be computed from `sum`,
-    // however, this calculation becomes less accurate over time as rounding
-    // errors accumulate.
-    double value = 0;
-  };
-
-  // Gets the individual value of a node in `sum_tree_` without the summed up
-  // value of all its descendants.
-  double NodeValue(size_t index) const;
-
-  // Sum of the exponentiated priority of this node and all its descendants.
-  // If the index is out of bounds, then 0 is returned.
-  double NodeSum(size_t index) const;
-
-  // Sets the individual value of a node in the `sum_tree_`. This does not
-  // include the value of the descendants. Usually, this operation's runtime is
-  // in O(log n). However, if floating point rounding errors have accumulated to
-  // a point where the intermediate sums deviate from their true values more
-  // than 1e-4, the tree is reinitialized, which takes O(n) time.
-  void SetNode(size_t index, double value);
-
-  // Computes the sum tree. This may be necessary if rounding errors have
-  // compounded due to repeated partial tree updates. For example, sums may
-  // become negative due to rounding errors (e.g. x - (x + epsilon) < 0 where
-  // epsilon is a small rounding error).
+  // Returns the index in `level` of the child of the node at `index` of the
+  // level above whose range of the cumulative weight contains
+  // `target_weight`, and subtracts the weight of the preceding children from
+  // `target_weight`.
+  size_t SelectChild(const std::vector<double>& level, size_t index,
+                     double* target_weight) const;
+
+  // Sum of the children of the node at `index` in `levels_[level]`, i.e. the
+  // value the node should hold. `level` must be positive.
+  double SumOfChildren(size_t level, size_t index) const;
+
+  // Sets the exponentiated priority of the key at `index` and recomputes the
+  // sums of all its ancestors. O(log n) time.
+  void SetWeight(size_t index, double weight);
+
+  // Resizes the levels of the sum tree to hold `capacity_` keys and
+  // recomputes all sums.
+  void ResizeSumTree();
+
+  // Computes the sums of all inner nodes from the weights. O(n) time.
   void ReinitializeSumTree();
 
+  // The priority raised to `priority_exponent_`.
+  double Weight(double priority) const {
+    return weight_fn_(priority, priority_exponent_);
+  }
+
   // Controls the degree of prioritization. Priorities are raised to this
   // exponent before adding them to the `SumTree` as weights. A non-negative
   // number where a value of zero corresponds each key having the same
   // probability (except for keys with zero priority).
-  const double priority_exponent_;
+  double priority_exponent_;
 
-  // Capacity of the summary tree. Starts at ~130000 and grows exponentially.
-  size_t capacity_;
+  // Computes `Weight`. Selected whenever the exponent is set, using a
+  // specialized function without std::pow for the exponents 0, 0.5, 1 and 2.
+  WeightFn weight_fn_;
 
-  // A tree stored as a flat vector were each node is the sum of its children
-  // plus its own exponentiated priority.
-  std::vector<Node> sum_tree_;
+  // Number of keys the sum tree can hold before it has to be resized. Starts at
+  // `kFanOut` so that empty selectors are cheap to construct and grows
+  // exponentially, or to the exact size of the batch in `InsertBatch`. Always
+  // a multiple of `kFanOut`.
+  size_t capacity_;
 
-  // Maps a key to the index where this key can be found in `sum_tree_`.
-  internal::flat_hash_map<Key, size_t> key_to_index_;
+  // The keys in the order of their index in the sum tree.
+  std::vector<Key> keys_;
+
+  // The priorities of the keys, with the same indices as `keys_`. Kept so the
+  // weights can be recomputed when the priority exponent changes.
+  std::vector<double> priorities_;
+
+  // A `kFanOut`-ary sum tree stored level by level, leaves first. The leaves
+  // (`levels_[0]`) hold the exponentiated priority of the key with the same
+  // index in `keys_` and every other element the sum of its `kFanOut` children
+  // in the level below, i.e. `levels_[l][i]` is the sum of the range
+  // `[i * kFanOut, (i + 1) * kFanOut)` of `levels_[l - 1]`. Every level is
+  // padded with zeros to a multiple of `kFanOut` and the last level, whose sum
+  // is the total weight, holds exactly `kFanOut` elements. Keeping the weights
+  // apart from the keys means that a sample or an update only touches one
+  // cache line per level.
+  std::vector<std::vector<double>> levels_;
+
+  // Maps a key to its index in `keys_` and `levels_[0]`.
+  DenseKeyMap<size_t> key_to_index_;
 
   // Used for sampling, not thread-safe.
   absl::BitGen bit_gen_;
@@ -15,6 +15,7 @@
 #include "reverb/cc/selectors/prioritized.h"
 
 #include <cmath>
+#include <memory>
 #include <vector>
 
 #include "gmock/gmock.h"
@@ -23,6 +24,7 @@
 #include "absl/random/random.h"
 #include "reverb/cc/platform/hash_map.h"
 #include "reverb/cc/platform/status_matchers.h"
+#include "reverb/cc/platform/thread.h"
 #include "reverb/cc/schema.pb.h"
 #include "reverb/cc/testing/proto_test_util.h"
 
@@ -127,6 +129,188 @@ TEST(PrioritizedSelectorTest, SampledDistributionMatchesProbabilities) {
   }
 }
 
+TEST(PrioritizedSelectorTest, SampledBatchDistributionMatchesProbabilities) {
+  const int kItems = 100;
+  const int kBatchSize = 64;
+  const int kBatches = 10000;
+
+  PrioritizedSelector prioritized(kInitialPriorityExponent);
+  double sum = 0;
+  for (int i = 0; i < kItems; i++) {
+    REVERB_EXPECT_OK(prioritized.Insert(i, i));
+    sum += i;
+  }
+
+  std::vector<int64_t> counts(kItems);
+  std::vector<ItemSelector::KeyWithProbability> samples;
+  for (int i = 0; i < kBatches; i++) {
+    samples.clear();
+    prioritized.SampleBatch(kBatchSize, &samples);
+    ASSERT_EQ(samples.size(), kBatchSize);
+    for (const auto& sample : samples) {
+      EXPECT_DOUBLE_EQ(sample.probability, sample.key / sum);
+      counts[sample.key]++;
+    }
+  }
+  for (int k = 0; k < kItems; k++) {
+    EXPECT_NEAR(static_cast<double>(counts[k]) / (kBatches * kBatchSize),
+                k / sum, 0.001);
+  }
+}
+
+TEST(PrioritizedSelectorTest, SampleBatchIsStratified) {
+  PrioritizedSelector prioritized(kInitialPriorityExponent);
+  REVERB_EXPECT_OK(prioritized.Insert(1, 1));
+  REVERB_EXPECT_OK(prioritized.Insert(2, 3));
+
+  // Every quarter of the cumulative weight yields one sample, so the key with
+  // three quarters of the weight is sampled exactly three times per batch.
+  for (int i = 0; i < 100; i++) {
+    std::vector<ItemSelector::KeyWithProbability> samples;
+    prioritized.SampleBatch(4, &samples);
+    std::vector<int> counts(3);
+    for (const auto& sample : samples) counts[sample.key]++;
+    EXPECT_EQ(counts[1], 1);
+    EXPECT_EQ(counts[2], 3);
+  }
+}
+
+TEST(PrioritizedSelectorTest, SampleSharedFromMultipleThreads) {
+  const int kItems = 100;
+  const int kSamples = 100000;
+
+  PrioritizedSelector prioritized(kInitialPriorityExponent);
+  double sum = 0;
+  for (int i = 0; i < kItems; i++) {
+    REVERB_EXPECT_OK(prioritized.Insert(i, i));
+    sum += i;
+  }
+
+  std::vector<std::vector<int64_t>> counts(4, std::vector<int64_t>(kItems));
+  std::vector<std::unique_ptr<internal::Thread>> bundle;
+  for (auto& thread_counts : counts) {
+    bundle.push_back(internal::StartThread("", [&, sum] {
+      absl::BitGen bit_gen;
+      std::vector<ItemSelector::KeyWithProbability> samples;
+      prioritized.SampleBatchShared(kSamples, &bit_gen, &samples);
+      for (const auto& sample : samples) {
+        EXPECT_DOUBLE_EQ(sample.probability, sample.key / sum);
+        thread_counts[sample.key]++;
+      }
+    }));
+  }
+  bundle.clear();  // Joins all threads.
+
+  for (const auto& thread_counts : counts) {
+    for (int k = 0; k < kItems; k++) {
+      EXPECT_NEAR(static_cast<double>(thread_counts[k]) / kSamples, k / sum,
+                  0.005);
+    }
+  }
+}
+
+TEST(PrioritizedSelectorTest, UpdateBatchMatchesSequentialUpdates) {
+  PrioritizedSelector batched(2);
+  PrioritizedSelector sequential(2);
+  absl::BitGen bit_gen;
+  for (int i = 0; i < 1000; i++) {
+    REVERB_EXPECT_OK(batched.Insert(i, 1));
+    REVERB_EXPECT_OK(sequential.Insert(i, 1));
+  }
+
+  // Updates of keys spread over the tree, including duplicates.
+  std::vector<KeyWithPriority> updates;
+  for (int i = 0; i < 300; i++) {
+    updates.push_back(testing::MakeKeyWithPriority(
+        absl::Uniform<int>(bit_gen, 0, 1000),
+        absl::Uniform<double>(bit_gen, 0, 10)));
+  }
+  REVERB_EXPECT_OK(batched.UpdateBatch(updates));
+  for (const auto& update : updates) {
+    REVERB_EXPECT_OK(sequential.Update(update.key(), update.priority()));
+  }
+  EXPECT_NEAR(batched.TotalWeight(), sequential.TotalWeight(), 1e-6);
+
+  // Deleting all but one key leaves only the weight of the last update of it.
+  for (int i = 1; i < 1000; i++) {
+    REVERB_EXPECT_OK(batched.Delete(i));
+    REVERB_EXPECT_OK(sequential.Delete(i));
+  }
+  EXPECT_NEAR(batched.TotalWeight(), sequential.TotalWeight(), 1e-6);
+}
+
+TEST(PrioritizedSelectorTest, InvalidUpdateBatchIsNotApplied) {
+  PrioritizedSelector prioritized(kInitialPriorityExponent);
+  REVERB_EXPECT_OK(prioritized.Insert(1, 1));
+  REVERB_EXPECT_OK(prioritized.Insert(2, 2));
+
+  EXPECT_EQ(prioritized
+                .UpdateBatch({testing::MakeKeyWithPriority(1, 5),
+                              testing::MakeKeyWithPriority(3, 5)})
+                .code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(prioritized
+                .UpdateBatch({testing::MakeKeyWithPriority(1, 5),
+                              testing::MakeKeyWithPriority(2, -1)})
+                .code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(prioritized.TotalWeight(), 3);
+}
+
+TEST(PrioritizedSelectorTest, InsertBatchMatchesSequentialInserts) {
+  PrioritizedSelector batched(2);
+  PrioritizedSelector sequential(2);
+  absl::BitGen bit_gen;
+
+  // The first batch fills the empty tree and the second one is appended to
+  // the keys already held, both beyond the initial capacity.
+  int next_key = 0;
+  for (int batch_size : {1000, 100}) {
+    std::vector<KeyWithPriority> items;
+    for (int i = 0; i < batch_size; i++) {
+      items.push_back(testing::MakeKeyWithPriority(
+          next_key++, absl::Uniform<double>(bit_gen, 0, 10)));
+    }
+    REVERB_EXPECT_OK(batched.InsertBatch(items));
+    for (const auto& item : items) {
+      REVERB_EXPECT_OK(sequential.Insert(item.key(), item.priority()));
+    }
+    EXPECT_NEAR(batched.TotalWeight(), sequential.TotalWeight(), 1e-6);
+  }
+
+  for (int i = 1; i < 1100; i++) {
+    REVERB_EXPECT_OK(batched.Delete(i));
+    REVERB_EXPECT_OK(sequential.Delete(i));
+  }
+  EXPECT_NEAR(batched.TotalWeight(), sequential.TotalWeight(), 1e-6);
+  for (int i = 0; i < 10; i++) {
+    EXPECT_EQ(batched.Sample().key, 0);
+  }
+}
+
+TEST(PrioritizedSelectorTest, InvalidInsertBatchIsNotApplied) {
+  PrioritizedSelector prioritized(kInitialPriorityExponent);
+  REVERB_EXPECT_OK(prioritized.Insert(1, 1));
+
+  EXPECT_EQ(prioritized
+                .InsertBatch({testing::MakeKeyWithPriority(2, 5),
+                              testing::MakeKeyWithPriority(1, 5)})
+                .code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(prioritized
+                .InsertBatch({testing::MakeKeyWithPriority(2, 5),
+                              testing::MakeKeyWithPriority(2, 5)})
+                .code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(prioritized
+                .InsertBatch({testing::MakeKeyWithPriority(2, 5),
+                              testing::MakeKeyWithPriority(3, -1)})
+                .code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(prioritized.TotalWeight(), 1);
+  REVERB_EXPECT_OK(prioritized.Insert(2, 2));
+}
+
 TEST(PrioritizedSelectorTest, SetsPriorityExponentInOptions) {
   PrioritizedSelector prioritized_a(0.1);
   PrioritizedSelector prioritized_b(0.5);
@@ -140,6 +324,23 @@ TEST(PrioritizedSelectorTest, SetsPriorityExponentInOptions) {
           "prioritized: { priority_exponent: 0.5 } is_deterministic: false"));
 }
 
+TEST(PrioritizedSelectorTest, TotalWeightIsSumOfExponentiatedPriorities) {
+  PrioritizedSelector prioritized(2);
+  EXPECT_EQ(prioritized.TotalWeight(), 0);
+
+  REVERB_EXPECT_OK(prioritized.Insert(1, 1));
+  REVERB_EXPECT_OK(prioritized.Insert(2, 2));
+  REVERB_EXPECT_OK(prioritized.Insert(3, 3));
+  EXPECT_DOUBLE_EQ(prioritized.TotalWeight(), 1 + 4 + 9);
+
+  REVERB_EXPECT_OK(prioritized.Update(2, 0));
+  REVERB_EXPECT_OK(prioritized.Delete(3));
+  EXPECT_DOUBLE_EQ(prioritized.TotalWeight(), 1);
+
+  prioritized.Clear();
+  EXPECT_EQ(prioritized.TotalWeight(), 0);
+}
+
 TEST(PrioritizedSelector, RoundingErrors) {
   PrioritizedSelector prioritized(1.0);
 
@@ -152,9 +353,101 @@ TEST(PrioritizedSelector, RoundingErrors) {
     REVERB_EXPECT_OK(prioritized.Delete(i + 1));
   }
 
-  // The root node should now have a value of 1e-15. However, due to rounding
-  // errors the value will be negative unless we re-initialize the tree.
-  EXPECT_GE(prioritized.NodeSumTestingOnly(0), 0.0);
+  // The total weight should now be 1e-15. However, due to rounding errors the
+  // value will be negative unless we re-initialize the tree.
+  EXPECT_GE(prioritized.TotalWeight(), 0.0);
+}
+
+TEST(PrioritizedSelectorTest, SamplesKeysBeyondInitialCapacity) {
+  // Enough keys to grow the sum tree many times.
+  const int kItems = 4 * std::pow(2, 17) + 3;
+
+  PrioritizedSelector prioritized(kInitialPriorityExponent);
+  for (int i = 0; i < kItems; i++) {
+    REVERB_EXPECT_OK(prioritized.Insert(i, 0));
+  }
+
+  // Only keys with a non zero priority are sampled, wherever they are stored.
+  REVERB_EXPECT_OK(prioritized.Update(kItems - 1, 3));
+  REVERB_EXPECT_OK(prioritized.Update(7, 1));
+  for (int i = 0; i < 1000; i++) {
+    auto sample = prioritized.Sample();
+    if (sample.key == kItems - 1) {
+      EXPECT_DOUBLE_EQ(sample.probability, 0.75);
+    } else {
+      EXPECT_EQ(sample.key, 7);
+      EXPECT_DOUBLE_EQ(sample.probability, 0.25);
+    }
+  }
+
+  // The last key is moved into the position of the deleted key.
+  REVERB_EXPECT_OK(prioritized.Delete(7));
+  EXPECT_DOUBLE_EQ(prioritized.TotalWeight(), 3);
+  for (int i = 0; i < 100; i++) {
+    EXPECT_EQ(prioritized.Sample().key, kItems - 1);
+  }
+  REVERB_EXPECT_OK(prioritized.Delete(kItems - 1));
+  EXPECT_EQ(prioritized.TotalWeight(), 0);
+}
+
+TEST(PrioritizedSelector, SumsDoNotDriftAfterManyUpdates) {
+  // A large exponent spreads the weights over many orders of magnitude.
+  const double kExponent = 8;
+  const int kItems = 1000;
+  PrioritizedSelector prioritized(kExponent);
+  std::vector<double> priorities(kItems);
+  absl::BitGen bit_gen;
+  for (int i = 0; i < kItems; i++) {
+    priorities[i] = absl::Uniform<double>(bit_gen, 0, 100);
+    REVERB_EXPECT_OK(prioritized.Insert(i, priorities[i]));
+  }
+  for (int i = 0; i < 200000; i++) {
+    const int key = absl::Uniform<int>(bit_gen, 0, kItems);
+    priorities[key] = absl::Uniform<double>(bit_gen, 0, 100);
+    REVERB_EXPECT_OK(prioritized.Update(key, priorities[key]));
+  }
+
+  double expected = 0;
+  for (double priority : priorities) expected += std::pow(priority, kExponent);
+  EXPECT_NEAR(prioritized.TotalWeight(), expected, expected * 1e-12);
+}
+
+TEST(PrioritizedSelector, SpecializedExponentsMatchPow) {
+  for (double exponent : {0., 0.5, 1., 2., 0.7}) {
+    PrioritizedSelector prioritized(exponent);
+    double expected = 0;
+    for (int i = 0; i < 10; i++) {
+      REVERB_EXPECT_OK(prioritized.Insert(i, i * 1.5));
+      expected += i == 0 ? 0 : std::pow(i * 1.5, exponent);
+    }
+    EXPECT_DOUBLE_EQ(prioritized.TotalWeight(), expected) << exponent;
+  }
+}
+
+TEST(PrioritizedSelector, SetPriorityExponentReweightsKeys) {
+  PrioritizedSelector prioritized(1);
+  for (int i = 0; i < 10; i++) {
+    REVERB_EXPECT_OK(prioritized.Insert(i, i));
+  }
+  REVERB_EXPECT_OK(prioritized.Update(3, 7));
+  REVERB_EXPECT_OK(prioritized.Delete(5));
+
+  REVERB_EXPECT_OK(prioritized.SetPriorityExponent(2));
+  EXPECT_EQ(prioritized.options().prioritized().priority_exponent(), 2);
+  double expected = 0;
+  for (int priority : {1, 2, 7, 4, 6, 7, 8, 9}) expected += priority * priority;
+  EXPECT_DOUBLE_EQ(prioritized.TotalWeight(), expected);
+
+  // Keys with zero priority are never sampled, whatever the exponent.
+  REVERB_EXPECT_OK(prioritized.SetPriorityExponent(0));
+  EXPECT_DOUBLE_EQ(prioritized.TotalWeight(), 8);
+  for (int i = 0; i < 100; i++) {
+    EXPECT_NE(prioritized.Sample().key, 0);
+  }
+
+  EXPECT_EQ(prioritized.SetPriorityExponent(-1).code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(prioritized.options().prioritized().priority_exponent(), 0);
 }
 
 TEST(PrioritizedDeathTest, ClearThenSample) {
@@ -0,0 +1,213 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/selectors/rank_based.h"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+#include "absl/memory/memory.h"
+#include "absl/random/distributions.h"
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "reverb/cc/checkpointing/checkpoint.pb.h"
+#include "reverb/cc/platform/logging.h"
+#include "reverb/cc/schema.pb.h"
+#include "reverb/cc/selectors/interface.h"
+
+namespace deepmind {
+namespace reverb {
+
+RankBasedSelector::RankBasedSelector(double priority_exponent)
+    : priority_exponent_(priority_exponent) {
+  REVERB_CHECK_GE(priority_exponent_, 0);
+}
+
+absl::Status RankBasedSelector::Delete(Key key) {
+  std::unique_ptr<Node>* node = nodes_.Find(key);
+  if (node == nullptr) {
+    return absl::InvalidArgumentError(absl::StrCat("Key ", key, " not found."));
+  }
+  root_ = Remove(root_, node->get());
+  nodes_.Erase(key);
+  return absl::OkStatus();
+}
+
+absl::Status RankBasedSelector::Insert(Key key, double priority) {
+  if (std::isnan(priority)) {
+    return absl::InvalidArgumentError("Priority must not be NaN.");
+  }
+  if (nodes_.contains(key)) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Key ", key, " already inserted."));
+  }
+  auto node = absl::make_unique<Node>(key, priority, update_count_++,
+                                      absl::Uniform<uint64_t>(bit_gen_));
+  InsertNode(node.get());
+  nodes_.Insert(key, std::move(node));
+
+  if (nodes_.size() > cumulative_weights_.size()) {
+    const size_t rank = cumulative_weights_.size();
+    cumulative_weights_.push_back(
+        (rank == 0 ? 0 : cumulative_weights_.back()) + RankWeight(rank));
+  }
+  return absl::OkStatus();
+}
+
+absl::Status RankBasedSelector::Update(Key key, double priority) {
+  if (std::isnan(priority)) {
+    return absl::InvalidArgumentError("Priority must not be NaN.");
+  }
+  std::unique_ptr<Node>* found = nodes_.Find(key);
+  if (found == nullptr) {
+    return absl::InvalidArgumentError(absl::StrCat("Key ", key, " not found."));
+  }
+  Node* node = found->get();
+  root_ = Remove(root_, node);
+  node->priority = priority;
+  node->update_number = update_count_++;
+  node->left = nullptr;
+  node->right = nullptr;
+  node->size = 1;
+  InsertNode(node);
+  return absl::OkStatus();
+}
+
+ItemSelector::KeyWithProbability RankBasedSelector::Sample() {
+  return SampleShared(&bit_gen_);
+}
+
+ItemSelector::KeyWithProbability RankBasedSelector::SampleShared(
+    absl::BitGen* bit_gen) const {
+  const size_t size = nodes_.size();
+  REVERB_CHECK_NE(size, 0);
+
+  const double total_weight = TotalWeight();
+  const double target = absl::Uniform<double>(*bit_gen, 0, total_weight);
+  const auto end = cumulative_weights_.begin() + size;
+  // Rounding can put the target at the very end of the range.
+  const size_t rank = std::min<size_t>(
+      std::upper_bound(cumulative_weights_.begin(), end, target) -
+          cumulative_weights_.begin(),
+      size - 1);
+  return {NodeAtRank(rank)->key, RankWeight(rank) / total_weight};
+}
+
+void RankBasedSelector::Clear() {
+  root_ = nullptr;
+  nodes_.Clear();
+}
+
+double RankBasedSelector::TotalWeight() const {
+  return nodes_.empty() ? 0 : cumulative_weights_[nodes_.size() - 1];
+}
+
+KeyDistributionOptions RankBasedSelector::options() const {
+  KeyDistributionOptions options;
+  options.mutable_rank_based()->set_priority_exponent(priority_exponent_);
+  options.set_is_deterministic(false);
+  return options;
+}
+
+std::string RankBasedSelector::DebugString() const {
+  return absl::StrCat("RankBasedSelector(priority_exponent=",
+                      priority_exponent_, ")");
+}
+
+bool RankBasedSelector::RanksBefore(const Node* a, const Node* b) {
+  return (a->priority > b->priority) ||
+         ((a->priority == b->priority) &&
+          (a->update_number < b->update_number));
+}
+
+size_t RankBasedSelector::SubtreeSize(const Node* node) {
+  return node == nullptr ? 0 : node->size;
+}
+
+void RankBasedSelector::UpdateSize(Node* node) {
+  node->size = 1 + SubtreeSize(node->left) + SubtreeSize(node->right);
+}
+
+void RankBasedSelector::Split(Node* root, const Node* node, Node** before,
+                              Node** after) {
+  if (root == nullptr) {
+    *before = nullptr;
+    *after = nullptr;
+    return;
+  }
+  if (RanksBefore(root, node)) {
+    Split(root->right, node, &root->right, after);
+    *before = root;
+  } else {
+    Split(root->left, node, before, &root->left);
+    *after = root;
+  }
+  UpdateSize(root);
+}
+
+RankBasedSelector::Node* RankBasedSelector::Merge(Node* before, Node* after) {
+  if (before == nullptr) return after;
+  if (after == nullptr) return before;
+  if (before->heap_priority > after->heap_priority) {
+    before->right = Merge(before->right, after);
+    UpdateSize(before);
+    return before;
+  }
+  after->left = Merge(before, after->left);
+  UpdateSize(after);
+  return after;
+}
+
+RankBasedSelector::Node* RankBasedSelector::Remove(Node* root,
+                                                   const Node* node) {
+  if (root == node) return Merge(root->left, root->right);
+  if (RanksBefore(node, root)) {
+    root->left = Remove(root->left, node);
+  } else {
+    root->right = Remove(root->right, node);
+  }
+  UpdateSize(root);
+  return root;
+}
+
+void RankBasedSelector::InsertNode(Node* node) {
+  Node* before;
+  Node* after;
+  Split(root_, node, &before, &after);
+  root_ = Merge(Merge(before, node), after);
+}
+
+const RankBasedSelector::Node* RankBasedSelector::NodeAtRank(
+    size_t rank) const {
+  const Node* node = root_;
+  while (true) {
+    const size_t left_size = SubtreeSize(node->left);
+    if (rank < left_size) {
+      node = node->left;
+    } else if (rank == left_size) {
+      return node;
+    } else {
+      rank -= left_size + 1;
+      node = node->right;
+    }
+  }
+}
+
+double RankBasedSelector::RankWeight(size_t rank) const {
+  return std::pow(static_cast<double>(rank + 1), -priority_exponent_);
+}
+
+}  // namespace reverb
+}  // namespace deepmind
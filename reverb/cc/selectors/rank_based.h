@@ -0,0 +1,154 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_SELECTORS_RANK_BASED_H_
+#define REVERB_CC_SELECTORS_RANK_BASED_H_
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "absl/random/random.h"
+#include "absl/status/status.h"
+#include "reverb/cc/checkpointing/checkpoint.pb.h"
+#include "reverb/cc/selectors/dense_key_map.h"
+#include "reverb/cc/selectors/interface.h"
+
+namespace deepmind {
+namespace reverb {
+
+// RankBasedSelector samples keys with a probability proportional to
+// `1 / rank^priority_exponent`, where the key with the highest priority has
+// rank 1. Only the order of the priorities affects the distribution, so a few
+// keys with outlying priorities do not dominate the samples as they do with
+// `PrioritizedSelector`. If multiple keys share the same priority then the
+// least recently inserted or updated key has the lowest rank.
+//
+// The keys are stored in a treap (a binary search tree balanced by random node
+// priorities) ordered by rank, where every node holds the size of its subtree
+// so the key of a given rank is found in O(log n) time. The weights of the
+// ranks only depend on the number of keys, so their cumulative sums are
+// computed once for every size reached and the rank is sampled by a binary
+// search over them.
+class RankBasedSelector : public ItemSelector {
+ public:
+  explicit RankBasedSelector(double priority_exponent);
+
+  // O(log n) time.
+  absl::Status Delete(Key key) override;
+
+  // The priority must not be NaN. O(log n) time.
+  absl::Status Insert(Key key, double priority) override;
+
+  // The priority must not be NaN. O(log n) time.
+  absl::Status Update(Key key, double priority) override;
+
+  // O(log n) time.
+  KeyWithProbability Sample() override;
+
+  // O(log n) time.
+  KeyWithProbability SampleShared(absl::BitGen* bit_gen) const override;
+
+  bool SupportsSampleShared() const override { return true; }
+
+  // O(n) time.
+  void Clear() override;
+
+  // Returns the sum of the weights of the ranks of the keys. O(1) time.
+  double TotalWeight() const override;
+
+  KeyDistributionOptions options() const override;
+
+  std::string DebugString() const override;
+
+ private:
+  struct Node {
+    Key key;
+    double priority;
+    uint64_t update_number;
+
+    // Random priority of the node in the treap. Every node has a higher
+    // priority than its children.
+    uint64_t heap_priority;
+    Node* left = nullptr;
+    Node* right = nullptr;
+
+    // Number of nodes in the subtree rooted at this node.
+    size_t size = 1;
+
+    Node(Key key, double priority, uint64_t update_number,
+         uint64_t heap_priority)
+        : key(key),
+          priority(priority),
+          update_number(update_number),
+          heap_priority(heap_priority) {}
+  };
+
+  // Returns true if `a` has a lower rank than `b`, i.e. a higher priority or
+  // the same priority and an earlier update.
+  static bool RanksBefore(const Node* a, const Node* b);
+
+  static size_t SubtreeSize(const Node* node);
+
+  // Recomputes the size of `node` from its children.
+  static void UpdateSize(Node* node);
+
+  // Splits the subtree `root` into the nodes ranked before `node` and the
+  // remaining ones.
+  static void Split(Node* root, const Node* node, Node** before, Node** after);
+
+  // Merges two subtrees where every node of `before` ranks before every node
+  // of `after`, and returns the root of the result.
+  static Node* Merge(Node* before, Node* after);
+
+  // Removes `node`, which must be in the subtree `root`, and returns the root
+  // of the remaining subtree.
+  static Node* Remove(Node* root, const Node* node);
+
+  // Adds `node`, which must not have any children, to the treap.
+  void InsertNode(Node* node);
+
+  // Returns the node with the given (zero based) rank. Must be less than the
+  // number of keys.
+  const Node* NodeAtRank(size_t rank) const;
+
+  // Weight of the key with the given (zero based) rank.
+  double RankWeight(size_t rank) const;
+
+  // Controls the degree of prioritization. A non-negative number where a value
+  // of zero corresponds to each key having the same probability.
+  const double priority_exponent_;
+
+  // Root of the treap holding all the nodes of `nodes_`.
+  Node* root_ = nullptr;
+
+  // The treap does not manage the memory of its nodes so they are stored in
+  // `nodes_`.
+  DenseKeyMap<std::unique_ptr<Node>> nodes_;
+
+  // `cumulative_weights_[i]` is the sum of the weights of the ranks 0 to `i`.
+  // Extended whenever the number of keys exceeds its size.
+  std::vector<double> cumulative_weights_;
+
+  // Keep track of the number of inserts/updates for breaking ties.
+  uint64_t update_count_ = 0;
+
+  // Used for sampling and for the priorities of the nodes, not thread-safe.
+  absl::BitGen bit_gen_;
+};
+
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_SELECTORS_RANK_BASED_H_
@@ -0,0 +1,189 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/selectors/rank_based.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/random/distributions.h"
+#include "absl/random/random.h"
+#include "reverb/cc/platform/status_matchers.h"
+#include "reverb/cc/schema.pb.h"
+#include "reverb/cc/testing/proto_test_util.h"
+
+namespace deepmind {
+namespace reverb {
+namespace {
+
+// Normalized probabilities of the ranks of `num_keys` keys.
+std::vector<double> RankProbabilities(int num_keys, double exponent) {
+  std::vector<double> probabilities(num_keys);
+  double sum = 0;
+  for (int i = 0; i < num_keys; i++) {
+    probabilities[i] = std::pow(i + 1, -exponent);
+    sum += probabilities[i];
+  }
+  for (double& probability : probabilities) probability /= sum;
+  return probabilities;
+}
+
+TEST(RankBasedSelectorTest, ReturnValueSantiyChecks) {
+  RankBasedSelector rank_based(1);
+
+  // Non existent keys cannot be deleted or updated.
+  EXPECT_EQ(rank_based.Delete(123).code(), absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(rank_based.Update(123, 4).code(),
+            absl::StatusCode::kInvalidArgument);
+
+  // Keys cannot be inserted twice.
+  REVERB_EXPECT_OK(rank_based.Insert(123, 4));
+  EXPECT_EQ(rank_based.Insert(123, 4).code(),
+            absl::StatusCode::kInvalidArgument);
+
+  // Existing keys can be updated and sampled.
+  REVERB_EXPECT_OK(rank_based.Update(123, 5));
+  EXPECT_EQ(rank_based.Sample().key, 123);
+
+  // NAN priorites are not allowed.
+  EXPECT_EQ(rank_based.Update(123, NAN).code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(rank_based.Insert(456, NAN).code(),
+            absl::StatusCode::kInvalidArgument);
+
+  // Existing keys cannot be deleted twice.
+  REVERB_EXPECT_OK(rank_based.Delete(123));
+  EXPECT_EQ(rank_based.Delete(123).code(), absl::StatusCode::kInvalidArgument);
+}
+
+TEST(RankBasedSelectorTest, SampledDistributionMatchesRanks) {
+  const int kItems = 50;
+  const int kSamples = 1000000;
+  const double kExponent = 0.7;
+
+  // Key `i` has rank `i` regardless of how far apart the priorities are.
+  RankBasedSelector rank_based(kExponent);
+  for (int i = kItems - 1; i >= 0; i--) {
+    REVERB_EXPECT_OK(rank_based.Insert(i, std::pow(10, kItems - i)));
+  }
+  const std::vector<double> expected = RankProbabilities(kItems, kExponent);
+
+  std::vector<int64_t> counts(kItems);
+  for (int i = 0; i < kSamples; i++) {
+    ItemSelector::KeyWithProbability sample = rank_based.Sample();
+    EXPECT_DOUBLE_EQ(sample.probability, expected[sample.key]);
+    counts[sample.key]++;
+  }
+  for (int k = 0; k < kItems; k++) {
+    EXPECT_NEAR(static_cast<double>(counts[k]) / kSamples, expected[k], 0.005);
+  }
+}
+
+TEST(RankBasedSelectorTest, UpdatesAndDeletesChangeRanks) {
+  const int kItems = 1000;
+  RankBasedSelector rank_based(1);
+  std::vector<double> priorities(kItems);
+  absl::BitGen bit_gen;
+  for (int i = 0; i < kItems; i++) {
+    priorities[i] = absl::Uniform<double>(bit_gen, -100, 100);
+    REVERB_EXPECT_OK(rank_based.Insert(i, priorities[i]));
+  }
+  for (int i = 0; i < 5000; i++) {
+    const int key = absl::Uniform<int>(bit_gen, 0, kItems);
+    priorities[key] = absl::Uniform<double>(bit_gen, -100, 100);
+    REVERB_EXPECT_OK(rank_based.Update(key, priorities[key]));
+  }
+  for (int i = 0; i < kItems / 2; i++) {
+    REVERB_EXPECT_OK(rank_based.Delete(i));
+  }
+
+  // The key with the highest priority remaining is the most likely one.
+  int top = kItems / 2;
+  for (int i = kItems / 2; i < kItems; i++) {
+    if (priorities[i] > priorities[top]) top = i;
+  }
+  const std::vector<double> expected = RankProbabilities(kItems / 2, 1);
+  EXPECT_DOUBLE_EQ(rank_based.TotalWeight(), 1 / expected[0]);
+  bool top_sampled = false;
+  for (int i = 0; i < 1000 && !top_sampled; i++) {
+    auto sample = rank_based.Sample();
+    EXPECT_GE(sample.key, kItems / 2);
+    if (sample.key == top) {
+      EXPECT_DOUBLE_EQ(sample.probability, expected[0]);
+      top_sampled = true;
+    }
+  }
+  EXPECT_TRUE(top_sampled);
+
+  // The probability of every key matches its rank.
+  std::vector<int> order;
+  for (int i = kItems / 2; i < kItems; i++) order.push_back(i);
+  std::sort(order.begin(), order.end(), [&priorities](int a, int b) {
+    return priorities[a] > priorities[b];
+  });
+  for (int i = 0; i < 1000; i++) {
+    auto sample = rank_based.Sample();
+    const int rank =
+        std::find(order.begin(), order.end(), sample.key) - order.begin();
+    EXPECT_DOUBLE_EQ(sample.probability, expected[rank]);
+  }
+}
+
+TEST(RankBasedSelectorTest, BreakTiesByUpdateOrder) {
+  // With a large exponent only the first rank is practically ever sampled.
+  RankBasedSelector rank_based(100);
+  REVERB_EXPECT_OK(rank_based.Insert(1, 5));
+  REVERB_EXPECT_OK(rank_based.Insert(2, 5));
+  EXPECT_EQ(rank_based.Sample().key, 1);
+
+  // An updated key ranks after the keys with the same priority.
+  REVERB_EXPECT_OK(rank_based.Update(1, 5));
+  EXPECT_EQ(rank_based.Sample().key, 2);
+}
+
+TEST(RankBasedSelectorTest, ZeroExponentIsUniform) {
+  RankBasedSelector rank_based(0);
+  for (int i = 0; i < 10; i++) {
+    REVERB_EXPECT_OK(rank_based.Insert(i, i));
+  }
+  EXPECT_EQ(rank_based.TotalWeight(), 10);
+  for (int i = 0; i < 100; i++) {
+    EXPECT_DOUBLE_EQ(rank_based.Sample().probability, 0.1);
+  }
+}
+
+TEST(RankBasedSelectorTest, Options) {
+  RankBasedSelector rank_based(0.6);
+  EXPECT_THAT(rank_based.options(),
+              testing::EqualsProto("rank_based: { priority_exponent: 0.6 } "
+                                   "is_deterministic: false"));
+}
+
+TEST(RankBasedDeathTest, ClearThenSample) {
+  RankBasedSelector rank_based(1);
+  for (int i = 0; i < 100; i++) {
+    REVERB_EXPECT_OK(rank_based.Insert(i, i));
+  }
+  rank_based.Sample();
+  rank_based.Clear();
+  EXPECT_EQ(rank_based.TotalWeight(), 0);
+  EXPECT_DEATH(rank_based.Sample(), "");
+}
+
+}  // namespace
+}  // namespace reverb
+}  // namespace deepmind
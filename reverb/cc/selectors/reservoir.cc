@@ -0,0 +1,143 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/selectors/reservoir.h"
+
+#include <algorithm>
+
+#include "absl/random/distributions.h"
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "reverb/cc/checkpointing/checkpoint.pb.h"
+#include "reverb/cc/platform/logging.h"
+#include "reverb/cc/platform/status_macros.h"
+#include "reverb/cc/schema.pb.h"
+
+namespace deepmind {
+namespace reverb {
+
+ReservoirSelector::ReservoirSelector(int64_t num_inserted)
+    : num_inserted_(num_inserted) {
+  REVERB_CHECK_GE(num_inserted_, 0);
+}
+
+absl::Status ReservoirSelector::Delete(Key key) {
+  const size_t* found = key_to_index_.Find(key);
+  if (found == nullptr)
+    return absl::InvalidArgumentError(absl::StrCat("Key ", key, " not found."));
+  const size_t index = *found;
+  key_to_index_.Erase(key);
+
+  const size_t last_index = keys_.size() - 1;
+  const Key last_key = keys_.back();
+  if (index != last_index) {
+    keys_[index] = last_key;
+    *key_to_index_.Find(last_key) = index;
+  }
+
+  keys_.pop_back();
+  if (has_newest_ && newest_key_ == key) has_newest_ = false;
+  return absl::OkStatus();
+}
+
+absl::Status ReservoirSelector::AddKey(Key key) {
+  const size_t index = keys_.size();
+  if (!key_to_index_.Insert(key, index))
+    return absl::InvalidArgumentError(
+        absl::StrCat("Key ", key, " already inserted."));
+  keys_.push_back(key);
+  return absl::OkStatus();
+}
+
+absl::Status ReservoirSelector::Insert(Key key, double priority) {
+  REVERB_RETURN_IF_ERROR(AddKey(key));
+  ++num_inserted_;
+  has_newest_ = true;
+  newest_key_ = key;
+  return absl::OkStatus();
+}
+
+absl::Status ReservoirSelector::InsertBatch(
+    absl::Span<const KeyWithPriority> items) {
+  for (const auto& item : items) {
+    REVERB_RETURN_IF_ERROR(AddKey(item.key()));
+  }
+  // The restored items are part of the insert history. Every item in the
+  // table has been inserted at least once, so this only matters if the count
+  // was not provided.
+  num_inserted_ = std::max<int64_t>(num_inserted_, keys_.size());
+  has_newest_ = false;
+  return absl::OkStatus();
+}
+
+absl::Status ReservoirSelector::Update(Key key, double priority) {
+  if (!key_to_index_.contains(key))
+    return absl::InvalidArgumentError(absl::StrCat("Key ", key, " not found."));
+  return absl::OkStatus();
+}
+
+ItemSelector::KeyWithProbability ReservoirSelector::Sample() {
+  // This code is not thread-safe, because bit_gen_ is not protected by a mutex
+  // and is not itself thread-safe.
+  return SampleShared(&bit_gen_);
+}
+
+ItemSelector::KeyWithProbability ReservoirSelector::SampleShared(
+    absl::BitGen* bit_gen) const {
+  REVERB_CHECK(!keys_.empty());
+  if (!has_newest_) {
+    const size_t index = absl::Uniform<size_t>(*bit_gen, 0, keys_.size());
+    return {keys_[index], 1.0 / static_cast<double>(keys_.size())};
+  }
+
+  // Every key in `keys_` has been inserted, so `num_inserted_` is at least
+  // `keys_.size()` and `others / total` is a valid probability. Drawing an
+  // index among the first `total` inserts decides whether the newest key (the
+  // `total`-th insert) would have made it into a reservoir of `others` keys.
+  const size_t others = keys_.size() - 1;
+  const auto total = static_cast<uint64_t>(num_inserted_);
+  const uint64_t draw = absl::Uniform<uint64_t>(*bit_gen, 0, total);
+  if (draw >= others) {
+    return {newest_key_, 1.0 - static_cast<double>(others) /
+                                   static_cast<double>(total)};
+  }
+
+  // Evict one of the other keys uniformly, skipping over the newest one.
+  const size_t newest_index = *key_to_index_.Find(newest_key_);
+  size_t index = static_cast<size_t>(draw);
+  if (index >= newest_index) ++index;
+  return {keys_[index], 1.0 / static_cast<double>(total)};
+}
+
+void ReservoirSelector::Clear() {
+  keys_.clear();
+  key_to_index_.Clear();
+  has_newest_ = false;
+}
+
+double ReservoirSelector::TotalWeight() const { return keys_.size(); }
+
+KeyDistributionOptions ReservoirSelector::options() const {
+  KeyDistributionOptions options;
+  options.mutable_reservoir()->set_num_inserted(num_inserted_);
+  options.set_is_deterministic(false);
+  return options;
+}
+
+std::string ReservoirSelector::DebugString() const {
+  return absl::StrCat("ReservoirSelector(num_inserted=", num_inserted_, ")");
+}
+
+}  // namespace reverb
+}  // namespace deepmind
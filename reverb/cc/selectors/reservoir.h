@@ -0,0 +1,106 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_SELECTORS_RESERVOIR_H_
+#define REVERB_CC_SELECTORS_RESERVOIR_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "absl/random/random.h"
+#include "absl/status/status.h"
+#include "absl/types/span.h"
+#include "reverb/cc/checkpointing/checkpoint.pb.h"
+#include "reverb/cc/selectors/dense_key_map.h"
+#include "reverb/cc/selectors/interface.h"
+
+namespace deepmind {
+namespace reverb {
+
+// Remover which implements reservoir sampling (Algorithm R). When used as the
+// remover of a table with `max_size` N, every item ever inserted remains in the
+// table with probability N / t after t inserts, so the table holds a uniform
+// sample over the whole insert history.
+//
+// The table calls `Sample` right after an insert has made it exceed its
+// capacity. With t items inserted so far and k = N items other than the newest
+// one, the newest item is returned (i.e. the insert is rejected) with
+// probability 1 - k / t and otherwise one of the other k items is returned
+// uniformly at random. Unlike a `UniformSelector` remover, which always evicts
+// an item at random and thereby favours recent inserts, old items are thus
+// replaced at the rate reservoir sampling requires. If the newest item has
+// been deleted the key is sampled uniformly.
+//
+// Priority values have no effect. All operations take O(1) time. See
+// ItemSelector for documentation of public methods.
+class ReservoirSelector final : public ItemSelector {
+ public:
+  // `num_inserted` is the number of items inserted before the selector was
+  // created, e.g. when it is restored from a checkpoint.
+  explicit ReservoirSelector(int64_t num_inserted = 0);
+
+  absl::Status Delete(Key key) override;
+
+  absl::Status Insert(Key key, double priority) override;
+
+  // Inserts items which were already counted in the `num_inserted` passed to
+  // the constructor, e.g. when a table is restored from a checkpoint.
+  absl::Status InsertBatch(absl::Span<const KeyWithPriority> items) override;
+
+  absl::Status Update(Key key, double priority) override;
+
+  KeyWithProbability Sample() override;
+
+  KeyWithProbability SampleShared(absl::BitGen* bit_gen) const override;
+
+  bool SupportsSampleShared() const override { return true; }
+
+  void Clear() override;
+
+  // Returns the number of keys. O(1) time.
+  double TotalWeight() const override;
+
+  KeyDistributionOptions options() const override;
+
+  std::string DebugString() const override;
+
+  // Number of items inserted over the lifetime of the selector.
+  int64_t num_inserted() const { return num_inserted_; }
+
+ private:
+  // Adds `key` to `keys_` without touching the insert count.
+  absl::Status AddKey(Key key);
+
+  // All keys.
+  std::vector<Key> keys_;
+
+  // Maps a key to the index where this key can be found in `keys_.
+  DenseKeyMap<size_t> key_to_index_;
+
+  // Number of items inserted over the lifetime of the selector, including
+  // those which have since been deleted.
+  int64_t num_inserted_;
+
+  // The most recently inserted key, if it has not been deleted since.
+  bool has_newest_ = false;
+  Key newest_key_ = 0;
+
+  // Used for sampling, not thread-safe.
+  absl::BitGen bit_gen_;
+};
+
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_SELECTORS_RESERVOIR_H_
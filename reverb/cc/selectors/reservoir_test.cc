@@ -0,0 +1,178 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/selectors/reservoir.h"
+
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/status/status.h"
+#include "reverb/cc/schema.pb.h"
+#include "reverb/cc/platform/status_matchers.h"
+#include "reverb/cc/selectors/interface.h"
+#include "reverb/cc/testing/proto_test_util.h"
+
+namespace deepmind {
+namespace reverb {
+namespace {
+
+TEST(ReservoirSelectorTest, ReturnValueSantiyChecks) {
+  ReservoirSelector reservoir;
+
+  // Non existent keys cannot be deleted or updated.
+  EXPECT_EQ(reservoir.Delete(123).code(), absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(reservoir.Update(123, 4).code(),
+            absl::StatusCode::kInvalidArgument);
+
+  // Keys cannot be inserted twice.
+  REVERB_EXPECT_OK(reservoir.Insert(123, 4));
+  EXPECT_EQ(reservoir.Insert(123, 4).code(),
+            absl::StatusCode::kInvalidArgument);
+
+  // Existing keys can be updated and sampled.
+  REVERB_EXPECT_OK(reservoir.Update(123, 5));
+  EXPECT_EQ(reservoir.Sample().key, 123);
+
+  // Existing keys cannot be deleted twice.
+  REVERB_EXPECT_OK(reservoir.Delete(123));
+  EXPECT_EQ(reservoir.Delete(123).code(), absl::StatusCode::kInvalidArgument);
+}
+
+TEST(ReservoirSelectorTest, RejectsNewestKeyWithReservoirProbability) {
+  ReservoirSelector reservoir;
+  for (int i = 0; i < 10; i++) {
+    REVERB_EXPECT_OK(reservoir.Insert(i, 0));
+  }
+  REVERB_EXPECT_OK(reservoir.Delete(0));
+  REVERB_EXPECT_OK(reservoir.Insert(10, 0));
+
+  // 11 items have been inserted and the reservoir holds 9 others, so the
+  // newest key is returned with probability 1 - 9 / 11 and each of the others
+  // with probability 1 / 11.
+  const int kSamples = 100000;
+  int newest = 0;
+  for (int i = 0; i < kSamples; i++) {
+    ItemSelector::KeyWithProbability sample = reservoir.Sample();
+    if (sample.key == 10) {
+      EXPECT_DOUBLE_EQ(sample.probability, 2. / 11);
+      newest++;
+    } else {
+      EXPECT_DOUBLE_EQ(sample.probability, 1. / 11);
+    }
+  }
+  EXPECT_NEAR(static_cast<double>(newest) / kSamples, 2. / 11, 0.01);
+}
+
+TEST(ReservoirSelectorTest, RetainsUniformSampleOfHistory) {
+  const int kCapacity = 10;
+  const int kInserts = 100;
+  const int kTrials = 20000;
+
+  // Emulates a table with `kCapacity` slots which removes the sampled key
+  // whenever an insert exceeds the capacity.
+  std::vector<int64_t> retained(kInserts);
+  for (int trial = 0; trial < kTrials; trial++) {
+    ReservoirSelector reservoir;
+    std::vector<bool> present(kInserts);
+    int size = 0;
+    for (int i = 0; i < kInserts; i++) {
+      REVERB_ASSERT_OK(reservoir.Insert(i, 0));
+      present[i] = true;
+      if (++size > kCapacity) {
+        const auto key = reservoir.Sample().key;
+        REVERB_ASSERT_OK(reservoir.Delete(key));
+        present[key] = false;
+        size--;
+      }
+    }
+    for (int i = 0; i < kInserts; i++) {
+      retained[i] += present[i];
+    }
+  }
+
+  // Every insert is retained with probability kCapacity / kInserts.
+  for (int i = 0; i < kInserts; i++) {
+    EXPECT_NEAR(static_cast<double>(retained[i]) / kTrials,
+                static_cast<double>(kCapacity) / kInserts, 0.02)
+        << "Key " << i;
+  }
+}
+
+TEST(ReservoirSelectorTest, SamplesUniformlyWithoutNewestKey) {
+  const int64_t kItems = 10;
+  ReservoirSelector reservoir;
+  for (int i = 0; i < kItems; i++) {
+    REVERB_EXPECT_OK(reservoir.Insert(i, 0));
+  }
+  REVERB_EXPECT_OK(reservoir.Delete(kItems - 1));
+
+  std::vector<int64_t> counts(kItems);
+  const int kSamples = 100000;
+  for (int i = 0; i < kSamples; i++) {
+    ItemSelector::KeyWithProbability sample = reservoir.Sample();
+    EXPECT_DOUBLE_EQ(sample.probability, 1. / (kItems - 1));
+    counts[sample.key]++;
+  }
+  EXPECT_EQ(counts[kItems - 1], 0);
+  for (int i = 0; i < kItems - 1; i++) {
+    EXPECT_NEAR(static_cast<double>(counts[i]) / kSamples, 1. / (kItems - 1),
+                0.01);
+  }
+}
+
+TEST(ReservoirSelectorTest, InsertBatchDoesNotCountRestoredItems) {
+  ReservoirSelector reservoir(/*num_inserted=*/50);
+  std::vector<KeyWithPriority> items;
+  for (int i = 0; i < 10; i++) {
+    items.push_back(testing::MakeKeyWithPriority(i, 0));
+  }
+  REVERB_EXPECT_OK(reservoir.InsertBatch(items));
+  EXPECT_EQ(reservoir.num_inserted(), 50);
+  EXPECT_EQ(reservoir.InsertBatch({testing::MakeKeyWithPriority(0, 1)}).code(),
+            absl::StatusCode::kInvalidArgument);
+
+  // Without a count the restored items are the whole history.
+  ReservoirSelector fresh;
+  REVERB_EXPECT_OK(fresh.InsertBatch(items));
+  EXPECT_EQ(fresh.num_inserted(), 10);
+
+  REVERB_EXPECT_OK(reservoir.Insert(10, 0));
+  EXPECT_EQ(reservoir.num_inserted(), 51);
+}
+
+TEST(ReservoirSelectorTest, Options) {
+  ReservoirSelector reservoir;
+  REVERB_EXPECT_OK(reservoir.Insert(1, 0));
+  REVERB_EXPECT_OK(reservoir.Insert(2, 0));
+  REVERB_EXPECT_OK(reservoir.Delete(1));
+  EXPECT_THAT(reservoir.options(),
+              testing::EqualsProto("reservoir: { num_inserted: 2 } "
+                                   "is_deterministic: false"));
+}
+
+TEST(ReservoirSelectorTest, TotalWeightIsNumberOfKeys) {
+  ReservoirSelector reservoir;
+  EXPECT_EQ(reservoir.TotalWeight(), 0);
+  for (int i = 0; i < 10; i++) {
+    REVERB_EXPECT_OK(reservoir.Insert(i, 0));
+    EXPECT_EQ(reservoir.TotalWeight(), i + 1);
+  }
+  reservoir.Clear();
+  EXPECT_EQ(reservoir.TotalWeight(), 0);
+}
+
+}  // namespace
+}  // namespace reverb
+}  // namespace deepmind
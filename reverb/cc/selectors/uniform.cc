@@ -24,17 +24,17 @@ namespace deepmind {
 namespace reverb {
 
 absl::Status UniformSelector::Delete(Key key) {
-  const auto it = key_to_index_.find(key);
-  if (it == key_to_index_.end())
+  const size_t* found = key_to_index_.Find(key);
+  if (found == nullptr)
     return absl::InvalidArgumentError(absl::StrCat("Key ", key, " not found."));
-  const size_t index = it->second;
-  key_to_index_.erase(it);
+  const size_t index = *found;
+  key_to_index_.Erase(key);
 
   const size_t last_index = keys_.size() - 1;
   const Key last_key = keys_.back();
   if (index != last_index) {
     keys_[index] = last_key;
-    key_to_index_[last_key] = index;
+    *key_to_index_.Find(last_key) = index;
   }
 
   keys_.pop_back();
@@ -43,7 +43,7 @@ absl::Status UniformSelector::Delete(Key key) {
 
 absl::Status UniformSelector::Insert(Key key, double priority) {
   const size_t index = keys_.size();
-  if (!key_to_index_.emplace(key, index).second)
+  if (!key_to_index_.Insert(key, index))
     return absl::InvalidArgumentError(
         absl::StrCat("Key ", key, " already inserted."));
   keys_.push_back(key);
@@ -51,25 +51,31 @@ absl::Status UniformSelector::Insert(Key key, double priority) {
 }
 
 absl::Status UniformSelector::Update(Key key, double priority) {
-  if (key_to_index_.find(key) == key_to_index_.end())
+  if (!key_to_index_.contains(key))
     return absl::InvalidArgumentError(absl::StrCat("Key ", key, " not found."));
   return absl::OkStatus();
 }
 
 ItemSelector::KeyWithProbability UniformSelector::Sample() {
-  REVERB_CHECK(!keys_.empty());
-
   // This code is not thread-safe, because bit_gen_ is not protected by a mutex
   // and is not itself thread-safe.
-  const size_t index = absl::Uniform<size_t>(bit_gen_, 0, keys_.size());
+  return SampleShared(&bit_gen_);
+}
+
+ItemSelector::KeyWithProbability UniformSelector::SampleShared(
+    absl::BitGen* bit_gen) const {
+  REVERB_CHECK(!keys_.empty());
+  const size_t index = absl::Uniform<size_t>(*bit_gen, 0, keys_.size());
   return {keys_[index], 1.0 / static_cast<double>(keys_.size())};
 }
 
 void UniformSelector::Clear() {
   keys_.clear();
-  key_to_index_.clear();
+  key_to_index_.Clear();
 }
 
+double UniformSelector::TotalWeight() const { return keys_.size(); }
+
 KeyDistributionOptions UniformSelector::options() const {
   KeyDistributionOptions options;
   options.set_uniform(true);
@@ -20,7 +20,7 @@
 #include "absl/random/random.h"
 #include "absl/status/status.h"
 #include "reverb/cc/checkpointing/checkpoint.pb.h"
-#include "reverb/cc/platform/hash_map.h"
+#include "reverb/cc/selectors/dense_key_map.h"
 #include "reverb/cc/selectors/interface.h"
 
 namespace deepmind {
@@ -29,7 +29,7 @@ namespace reverb {
 // Samples items uniformly and thus priority values have no effect. All
 // operations take O(1) time. See ItemSelector for documentation of
 // public methods.
-class UniformSelector : public ItemSelector {
+class UniformSelector final : public ItemSelector {
  public:
   absl::Status Delete(Key key) override;
 
@@ -39,10 +39,19 @@ class UniformSelector : public ItemSelector {
 
   KeyWithProbability Sample() override;
 
+  KeyWithProbability SampleShared(absl::BitGen* bit_gen) const override;
+
+  bool SupportsSampleShared() const override { return true; }
+
   void Clear() override;
 
+  // Returns the number of keys. O(1) time.
+  double TotalWeight() const override;
+
   KeyDistributionOptions options() const override;
 
+  SelectorKind kind() const override { return SelectorKind::kUniform; }
+
   std::string DebugString() const override;
 
  private:
@@ -50,7 +59,7 @@ class UniformSelector : public ItemSelector {
   std::vector<Key> keys_;
 
   // Maps a key to the index where this key can be found in `keys_.
-  internal::flat_hash_map<Key, size_t> key_to_index_;
+  DenseKeyMap<size_t> key_to_index_;
 
   // Used for sampling, not thread-safe.
   absl::BitGen bit_gen_;
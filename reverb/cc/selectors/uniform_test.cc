@@ -74,6 +74,19 @@ TEST(UniformSelectorTest, Options) {
               testing::EqualsProto("uniform: true is_deterministic: false"));
 }
 
+TEST(UniformSelectorTest, TotalWeightIsNumberOfKeys) {
+  UniformSelector uniform;
+  EXPECT_EQ(uniform.TotalWeight(), 0);
+  for (int i = 0; i < 10; i++) {
+    REVERB_EXPECT_OK(uniform.Insert(i, i));
+  }
+  EXPECT_EQ(uniform.TotalWeight(), 10);
+  REVERB_EXPECT_OK(uniform.Delete(3));
+  EXPECT_EQ(uniform.TotalWeight(), 9);
+  uniform.Clear();
+  EXPECT_EQ(uniform.TotalWeight(), 0);
+}
+
 TEST(UniformDeathTest, ClearThenSample) {
   UniformSelector uniform;
   for (int i = 0; i < 100; i++) {
@@ -0,0 +1,247 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/sharded_table.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/random/distributions.h"
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "reverb/cc/platform/logging.h"
+#include "reverb/cc/platform/status_macros.h"
+#include "reverb/cc/schema.pb.h"
+#include "reverb/cc/table.h"
+
+namespace deepmind {
+namespace reverb {
+
+ShardedTable::ShardedTable(std::string name,
+                           std::vector<std::shared_ptr<Table>> shards)
+    : name_(std::move(name)), shards_(std::move(shards)) {
+  REVERB_CHECK(!shards_.empty()) << "ShardedTable requires at least one shard.";
+  const std::string sampler_options =
+      shards_[0]->info().sampler_options().SerializeAsString();
+  for (const auto& shard : shards_) {
+    REVERB_CHECK_EQ(shard->info().sampler_options().SerializeAsString(),
+                    sampler_options)
+        << "All shards of ShardedTable " << name_
+        << " must use the same sampler.";
+  }
+}
+
+int ShardedTable::ShardIndex(Key key) const {
+  // Keys are generated randomly by the writers so the low bits are uniformly
+  // distributed.
+  return key % shards_.size();
+}
+
+absl::Status ShardedTable::InsertOrAssign(Item item) {
+  return shards_[ShardIndex(item.item.key())]->InsertOrAssign(std::move(item));
+}
+
+absl::Status ShardedTable::MutateItems(
+    absl::Span<const KeyWithPriority> updates, absl::Span<const Key> deletes) {
+  if (shards_.size() == 1) {
+    return shards_[0]->MutateItems(updates, deletes);
+  }
+
+  std::vector<std::vector<KeyWithPriority>> shard_updates(shards_.size());
+  std::vector<std::vector<Key>> shard_deletes(shards_.size());
+  for (const auto& update : updates) {
+    shard_updates[ShardIndex(update.key())].push_back(update);
+  }
+  for (Key key : deletes) {
+    shard_deletes[ShardIndex(key)].push_back(key);
+  }
+
+  for (int i = 0; i < shards_.size(); i++) {
+    if (shard_updates[i].empty() && shard_deletes[i].empty()) continue;
+    REVERB_RETURN_IF_ERROR(
+        shards_[i]->MutateItems(shard_updates[i], shard_deletes[i]));
+  }
+  return absl::OkStatus();
+}
+
+absl::Status ShardedTable::Sample(SampledItem* item, absl::Duration timeout) {
+  std::vector<SampledItem> items;
+  REVERB_RETURN_IF_ERROR(SampleFlexibleBatch(&items, 1, timeout));
+  *item = std::move(items[0]);
+  return absl::OkStatus();
+}
+
+absl::Status ShardedTable::SampleFlexibleBatch(std::vector<SampledItem>* items,
+                                               int batch_size,
+                                               absl::Duration timeout) {
+  // Snapshot the state of every shard. The shards are not locked (the size,
+  // weight and rate limiter state are all published by the shards and read
+  // without acquiring their mutex) so the snapshot could be slightly out of
+  // date by the time the sample is executed. This only affects the reported
+  // probabilities.
+  std::vector<double> weights(shards_.size(), 0);
+  std::vector<int64_t> sizes(shards_.size(), 0);
+  double total_weight = 0;
+  int64_t total_size = 0;
+  for (int i = 0; i < shards_.size(); i++) {
+    sizes[i] = shards_[i]->size();
+    total_size += sizes[i];
+    if (shards_[i]->CanSample(1)) {
+      weights[i] = shards_[i]->TotalSamplerWeight();
+      total_weight += weights[i];
+    }
+  }
+
+  // If all the items that can be sampled have zero weight (e.g. all priorities
+  // are zero) then the selectors fall back to uniform sampling so we do the
+  // same when selecting the shard.
+  if (total_weight == 0) {
+    for (int i = 0; i < shards_.size(); i++) {
+      if (weights[i] == 0 && shards_[i]->CanSample(1)) {
+        weights[i] = sizes[i];
+        total_weight += weights[i];
+      }
+    }
+  }
+
+  int index = 0;
+  double shard_probability;
+  {
+    absl::MutexLock lock(&bit_gen_mu_);
+    if (total_weight == 0) {
+      // None of the shards can be sampled from without blocking so we select
+      // one at random and wait for it.
+      index = absl::Uniform<int>(bit_gen_, 0, shards_.size());
+      shard_probability = 1.0 / shards_.size();
+    } else {
+      // Rounding errors could result in `target` not being covered by any
+      // shard in which case the last shard with a positive weight is used.
+      double target = absl::Uniform<double>(bit_gen_, 0, total_weight);
+      for (int i = 0; i < shards_.size(); i++) {
+        if (weights[i] == 0) continue;
+        index = i;
+        if (target < weights[i]) break;
+        target -= weights[i];
+      }
+      shard_probability = weights[index] / total_weight;
+    }
+  }
+
+  const size_t offset = items->size();
+  REVERB_RETURN_IF_ERROR(
+      shards_[index]->SampleFlexibleBatch(items, batch_size, timeout));
+
+  for (size_t i = offset; i < items->size(); i++) {
+    auto& sampled = (*items)[i];
+    sampled.probability *= shard_probability;
+    sampled.table_size += total_size - sizes[index];
+  }
+
+  return absl::OkStatus();
+}
+
+bool ShardedTable::Get(Key key, Item* item) {
+  return shards_[ShardIndex(key)]->Get(key, item);
+}
+
+bool ShardedTable::CanSample(int num_samples) const {
+  for (const auto& shard : shards_) {
+    if (shard->CanSample(num_samples)) return true;
+  }
+  return false;
+}
+
+bool ShardedTable::CanInsert(int num_inserts) const {
+  for (const auto& shard : shards_) {
+    if (shard->CanInsert(num_inserts)) return true;
+  }
+  return false;
+}
+
+absl::Status ShardedTable::Reset() {
+  for (auto& shard : shards_) {
+    REVERB_RETURN_IF_ERROR(shard->Reset());
+  }
+  return absl::OkStatus();
+}
+
+void ShardedTable::Close() {
+  for (auto& shard : shards_) {
+    shard->Close();
+  }
+}
+
+int64_t ShardedTable::size() const {
+  int64_t size = 0;
+  for (const auto& shard : shards_) {
+    size += shard->size();
+  }
+  return size;
+}
+
+const std::string& ShardedTable::name() const { return name_; }
+
+TableInfo ShardedTable::info() const {
+  TableInfo info = shards_[0]->info();
+  info.set_name(name_);
+  for (int i = 1; i < shards_.size(); i++) {
+    TableInfo shard_info = shards_[i]->info();
+    info.set_max_size(info.max_size() + shard_info.max_size());
+    info.set_current_size(info.current_size() + shard_info.current_size());
+    info.set_num_episodes(info.num_episodes() + shard_info.num_episodes());
+    info.set_num_deleted_episodes(info.num_deleted_episodes() +
+                                  shard_info.num_deleted_episodes());
+    info.set_total_sampler_weight(info.total_sampler_weight() +
+                                  shard_info.total_sampler_weight());
+    info.set_max_chunk_bytes(info.max_chunk_bytes() +
+                             shard_info.max_chunk_bytes());
+    info.set_num_chunks(info.num_chunks() + shard_info.num_chunks());
+    info.set_num_chunk_bytes(info.num_chunk_bytes() +
+                             shard_info.num_chunk_bytes());
+    info.set_num_inserted_bytes(info.num_inserted_bytes() +
+                                shard_info.num_inserted_bytes());
+    info.set_num_sampled_bytes(info.num_sampled_bytes() +
+                               shard_info.num_sampled_bytes());
+    info.set_num_expired_items(info.num_expired_items() +
+                               shard_info.num_expired_items());
+  }
+  return info;
+}
+
+int ShardedTable::num_shards() const { return shards_.size(); }
+
+const std::shared_ptr<Table>& ShardedTable::shard(int index) const {
+  return shards_[index];
+}
+
+std::string ShardedTable::DebugString() const {
+  std::string str = absl::StrCat("ShardedTable(name=", name_, ", shards=[");
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    absl::StrAppend(&str, shards_[i]->DebugString());
+    if (i != shards_.size() - 1) {
+      absl::StrAppend(&str, ", ");
+    }
+  }
+  absl::StrAppend(&str, "])");
+  return str;
+}
+
+}  // namespace reverb
+}  // namespace deepmind
@@ -0,0 +1,163 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_SHARDED_TABLE_H_
+#define REVERB_CC_SHARDED_TABLE_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/random/random.h"
+#include "absl/status/status.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "reverb/cc/schema.pb.h"
+#include "reverb/cc/table.h"
+
+namespace deepmind {
+namespace reverb {
+
+// A `ShardedTable` partitions the items of a logical table across a number of
+// independent `Table` shards. Each shard owns its own items, selectors,
+// episode references, rate limiter and (most importantly) mutex, so inserts
+// and samples that end up in different shards never contend for the same
+// lock.
+//
+// Items are assigned to a shard based on their key. Since keys are generated
+// randomly by the writers this results in the items being spread evenly
+// across the shards. Samples are drawn by first selecting a shard with
+// probability proportional to the total weight of its sampler (see
+// `ItemSelector::TotalWeight`) and then sampling from the selected shard. For
+// prioritized samplers this is (up to concurrent mutations) equivalent to
+// sampling from a single table containing all the items.
+//
+// Note that every shard enforces `max_size`, `max_times_sampled` and rate
+// limits independently of the other shards (see the constructor). The shards
+// should therefore be configured with the per shard share of the logical table
+// (e.g. `max_size / num_shards`). Deterministic selectors (e.g. FIFO) only
+// preserve their ordering within each shard.
+//
+// `ShardedTable` is a C++ building block for embedding a replay buffer in a
+// process. It is neither served by `ReverbService` nor exposed to Python, and
+// serving it requires a `Table` interface which the service can dispatch to.
+//
+// The class is thread safe.
+class ShardedTable {
+ public:
+  using Key = Table::Key;
+  using Item = Table::Item;
+  using SampledItem = Table::SampledItem;
+
+  // Constructor.
+  // `name` is the name of the logical table.
+  // `shards` are the tables which holds the data. Must not be empty and all
+  //   shards must use the same type of sampler. Every shard must have a rate
+  //   limiter of its own, which enforces `min_size_to_sample`,
+  //   `samples_per_insert` and the error buffer on the inserts and samples of
+  //   that shard alone. A limiter shared by the shards (see
+  //   `RateLimiter(..., shared = true)`) must not be used as it would approve
+  //   samples from empty shards. Since items are spread evenly the shards
+  //   approximate the rate limit of the logical table with its
+  //   `samples_per_insert` and with `min_size_to_sample` and the error buffer
+  //   divided by the number of shards.
+  ShardedTable(std::string name, std::vector<std::shared_ptr<Table>> shards);
+
+  // Inserts (or updates) the item in the shard that owns the key. See
+  // `Table::InsertOrAssign` for details.
+  absl::Status InsertOrAssign(Item item);
+
+  // Groups the operations by shard and applies them to each of the affected
+  // shards. See `Table::MutateItems` for details.
+  absl::Status MutateItems(absl::Span<const KeyWithPriority> updates,
+                           absl::Span<const Key> deletes);
+
+  // Samples a single item. See `SampleFlexibleBatch` for details.
+  absl::Status Sample(SampledItem* item,
+                      absl::Duration timeout = kDefaultTimeout);
+
+  // Selects a shard and samples up to `batch_size` items from it. Only shards
+  // which allow a sample to proceed without blocking are considered. If no
+  // such shard exists then a shard is selected uniformly at random and the
+  // call blocks (for at most `timeout`) on that shard.
+  //
+  // The probability of the returned items is the probability of selecting the
+  // item from its shard multiplied with the probability of selecting the shard.
+  // The table size is the combined size of all shards.
+  absl::Status SampleFlexibleBatch(std::vector<SampledItem>* items,
+                                   int batch_size,
+                                   absl::Duration timeout = kDefaultTimeout);
+
+  // Lookup a single item. Returns true if found, else false.
+  bool Get(Key key, Item* item);
+
+  // Returns true iff any of the shards would allow `num_samples` to be
+  // sampled.
+  bool CanSample(int num_samples) const;
+
+  // Returns true iff any of the shards would allow `num_inserts` to be
+  // inserted.
+  bool CanInsert(int num_inserts) const;
+
+  // Removes all items from and resets the rate limiter of every shard.
+  absl::Status Reset();
+
+  // Cancels pending calls on all shards. Object must be abandoned after
+  // `Close` called.
+  void Close();
+
+  // Combined number of items in all shards.
+  int64_t size() const;
+
+  // Name of the logical table.
+  const std::string& name() const;
+
+  // Metadata about the logical table. Sizes and episode counts are summed over
+  // the shards. Note that an episode that is referenced by items in multiple
+  // shards is counted once per shard. The rate limiter and selector options
+  // are those of the first shard, use `shard(i)->info()` for the details of
+  // each individual shard.
+  TableInfo info() const;
+
+  // Number of shards.
+  int num_shards() const;
+
+  // The shard at `index`.
+  const std::shared_ptr<Table>& shard(int index) const;
+
+  // Index of the shard that owns `key`.
+  int ShardIndex(Key key) const;
+
+  // Returns a summary string description.
+  std::string DebugString() const;
+
+ private:
+  // Name of the logical table.
+  const std::string name_;
+
+  // Tables holding the items.
+  const std::vector<std::shared_ptr<Table>> shards_;
+
+  // Used when selecting which shard to sample from.
+  absl::Mutex bit_gen_mu_;
+  absl::BitGen bit_gen_ ABSL_GUARDED_BY(bit_gen_mu_);
+};
+
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_SHARDED_TABLE_H_
@@ -0,0 +1,231 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/sharded_table.h"
+
+#include <cfloat>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include <cstdint>
+#include "absl/memory/memory.h"
+#include "absl/time/time.h"
+#include "reverb/cc/chunk_store.h"
+#include "reverb/cc/platform/status_matchers.h"
+#include "reverb/cc/platform/thread.h"
+#include "reverb/cc/rate_limiter.h"
+#include "reverb/cc/schema.pb.h"
+#include "reverb/cc/selectors/fifo.h"
+#include "reverb/cc/selectors/prioritized.h"
+#include "reverb/cc/selectors/uniform.h"
+#include "reverb/cc/table.h"
+#include "reverb/cc/testing/proto_test_util.h"
+
+namespace deepmind {
+namespace reverb {
+namespace {
+
+const absl::Duration kTimeout = absl::Milliseconds(100);
+
+using ::testing::SizeIs;
+
+TableItem MakeItem(uint64_t key, double priority) {
+  TableItem item;
+  auto data = testing::MakeChunkData(key);
+  item.chunks.push_back(std::make_shared<ChunkStore::Chunk>(data));
+  item.item = testing::MakePrioritizedItem(key, priority, {data});
+  return item;
+}
+
+std::shared_ptr<Table> MakeShard(std::shared_ptr<ItemSelector> sampler,
+                                 int64_t max_size = 1000,
+                                 int32_t max_times_sampled = 0) {
+  return std::make_shared<Table>(
+      "shard", std::move(sampler), std::make_shared<FifoSelector>(), max_size,
+      max_times_sampled,
+      std::make_shared<RateLimiter>(1.0, 1, -DBL_MAX, DBL_MAX));
+}
+
+std::unique_ptr<ShardedTable> MakeUniformShardedTable(int num_shards) {
+  std::vector<std::shared_ptr<Table>> shards;
+  for (int i = 0; i < num_shards; i++) {
+    shards.push_back(MakeShard(std::make_shared<UniformSelector>()));
+  }
+  return absl::make_unique<ShardedTable>("table", std::move(shards));
+}
+
+TEST(ShardedTableTest, InsertRoutesItemsByKey) {
+  auto table = MakeUniformShardedTable(4);
+  for (int i = 0; i < 100; i++) {
+    REVERB_EXPECT_OK(table->InsertOrAssign(MakeItem(i, 1)));
+  }
+
+  EXPECT_EQ(table->size(), 100);
+  for (int i = 0; i < table->num_shards(); i++) {
+    EXPECT_EQ(table->shard(i)->size(), 25);
+  }
+  for (int i = 0; i < 100; i++) {
+    TableItem item;
+    EXPECT_TRUE(table->shard(table->ShardIndex(i))->Get(i, &item));
+    EXPECT_TRUE(table->Get(i, &item));
+  }
+}
+
+TEST(ShardedTableTest, MutateItemsAppliesToOwningShards) {
+  auto table = MakeUniformShardedTable(3);
+  for (int i = 0; i < 9; i++) {
+    REVERB_EXPECT_OK(table->InsertOrAssign(MakeItem(i, 1)));
+  }
+
+  REVERB_EXPECT_OK(table->MutateItems(
+      {testing::MakeKeyWithPriority(1, 10), testing::MakeKeyWithPriority(5, 50),
+       testing::MakeKeyWithPriority(100, 1)},
+      {2, 3, 4}));
+
+  EXPECT_EQ(table->size(), 6);
+  TableItem item;
+  EXPECT_FALSE(table->Get(3, &item));
+  ASSERT_TRUE(table->Get(1, &item));
+  EXPECT_EQ(item.item.priority(), 10);
+  ASSERT_TRUE(table->Get(5, &item));
+  EXPECT_EQ(item.item.priority(), 50);
+}
+
+TEST(ShardedTableTest, SampleReportsCombinedProbabilityAndSize) {
+  std::vector<std::shared_ptr<Table>> shards = {
+      MakeShard(std::make_shared<PrioritizedSelector>(1)),
+      MakeShard(std::make_shared<PrioritizedSelector>(1)),
+  };
+  ShardedTable table("table", shards);
+
+  // Shard 0 holds key 0 and 2 (total weight 4), shard 1 holds key 1 (total
+  // weight 4).
+  REVERB_EXPECT_OK(table.InsertOrAssign(MakeItem(0, 1)));
+  REVERB_EXPECT_OK(table.InsertOrAssign(MakeItem(1, 4)));
+  REVERB_EXPECT_OK(table.InsertOrAssign(MakeItem(2, 3)));
+
+  for (int i = 0; i < 100; i++) {
+    ShardedTable::SampledItem sample;
+    REVERB_EXPECT_OK(table.Sample(&sample, kTimeout));
+    EXPECT_EQ(sample.table_size, 3);
+    EXPECT_DOUBLE_EQ(sample.probability, sample.item.priority() / 8.0);
+  }
+}
+
+TEST(ShardedTableTest, SampleMatchesPriorityDistribution) {
+  std::vector<std::shared_ptr<Table>> shards;
+  for (int i = 0; i < 4; i++) {
+    shards.push_back(MakeShard(std::make_shared<PrioritizedSelector>(1)));
+  }
+  ShardedTable table("table", shards);
+
+  // Every item is inserted into its own shard.
+  for (int i = 0; i < 4; i++) {
+    REVERB_EXPECT_OK(table.InsertOrAssign(MakeItem(i, i + 1)));
+  }
+
+  const int kSamples = 100000;
+  std::vector<int> counts(4);
+  for (int i = 0; i < kSamples; i++) {
+    ShardedTable::SampledItem sample;
+    REVERB_EXPECT_OK(table.Sample(&sample, kTimeout));
+    counts[sample.item.key()]++;
+  }
+  for (int i = 0; i < 4; i++) {
+    EXPECT_NEAR(static_cast<double>(counts[i]) / kSamples, (i + 1) / 10.0,
+                0.01);
+  }
+}
+
+TEST(ShardedTableTest, SampleSkipsShardsThatCannotBeSampled) {
+  auto table = MakeUniformShardedTable(3);
+  REVERB_EXPECT_OK(table->InsertOrAssign(MakeItem(4, 1)));
+
+  for (int i = 0; i < 10; i++) {
+    ShardedTable::SampledItem sample;
+    REVERB_EXPECT_OK(table->Sample(&sample, kTimeout));
+    EXPECT_EQ(sample.item.key(), 4);
+    EXPECT_EQ(sample.probability, 1);
+  }
+}
+
+TEST(ShardedTableTest, SampleFlexibleBatchReturnsItemsFromOneShard) {
+  auto table = MakeUniformShardedTable(2);
+  for (int i = 0; i < 10; i++) {
+    REVERB_EXPECT_OK(table->InsertOrAssign(MakeItem(i, 1)));
+  }
+
+  std::vector<ShardedTable::SampledItem> items;
+  REVERB_EXPECT_OK(table->SampleFlexibleBatch(&items, 5, kTimeout));
+  ASSERT_THAT(items, SizeIs(5));
+  for (const auto& item : items) {
+    EXPECT_EQ(table->ShardIndex(item.item.key()),
+              table->ShardIndex(items[0].item.key()));
+    EXPECT_EQ(item.table_size, 10);
+  }
+}
+
+TEST(ShardedTableTest, SampleBlocksUntilItemInserted) {
+  auto table = MakeUniformShardedTable(1);
+
+  ShardedTable::SampledItem sample;
+  EXPECT_EQ(table->Sample(&sample, kTimeout).code(),
+            absl::StatusCode::kDeadlineExceeded);
+
+  auto thread = internal::StartThread("", [&table] {
+    absl::SleepFor(kTimeout);
+    REVERB_EXPECT_OK(table->InsertOrAssign(MakeItem(1, 1)));
+  });
+  REVERB_EXPECT_OK(table->Sample(&sample, 10 * kTimeout));
+  EXPECT_EQ(sample.item.key(), 1);
+}
+
+TEST(ShardedTableTest, InfoSumsShards) {
+  auto table = MakeUniformShardedTable(4);
+  for (int i = 0; i < 10; i++) {
+    REVERB_EXPECT_OK(table->InsertOrAssign(MakeItem(i, 1)));
+  }
+
+  auto info = table->info();
+  EXPECT_EQ(info.name(), "table");
+  EXPECT_EQ(info.max_size(), 4000);
+  EXPECT_EQ(info.current_size(), 10);
+  EXPECT_EQ(info.num_episodes(), 10);
+  EXPECT_EQ(info.total_sampler_weight(), 10);
+}
+
+TEST(ShardedTableTest, ResetClearsAllShards) {
+  auto table = MakeUniformShardedTable(4);
+  for (int i = 0; i < 10; i++) {
+    REVERB_EXPECT_OK(table->InsertOrAssign(MakeItem(i, 1)));
+  }
+  REVERB_EXPECT_OK(table->Reset());
+  EXPECT_EQ(table->size(), 0);
+  EXPECT_FALSE(table->CanSample(1));
+}
+
+TEST(ShardedTableDeathTest, DiesIfShardsUseDifferentSamplers) {
+  std::vector<std::shared_ptr<Table>> shards = {
+      MakeShard(std::make_shared<UniformSelector>()),
+      MakeShard(std::make_shared<PrioritizedSelector>(1)),
+  };
+  EXPECT_DEATH(ShardedTable("table", shards), "");
+}
+
+}  // namespace
+}  // namespace reverb
+}  // namespace deepmind
@@ -0,0 +1,180 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/sharded_trajectory_writer.h"
+
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "grpcpp/impl/codegen/client_context.h"
+#include "absl/hash/hash.h"
+#include "absl/memory/memory.h"
+#include "absl/random/distributions.h"
+#include "absl/random/random.h"
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "reverb/cc/platform/logging.h"
+#include "reverb/cc/platform/status_macros.h"
+#include "reverb/cc/reverb_service.pb.h"
+#include "reverb/cc/schema.pb.h"
+
+namespace deepmind {
+namespace reverb {
+namespace {
+
+uint64_t NewEpisodeId() {
+  absl::BitGen gen;
+  return absl::Uniform<uint64_t>(gen, 0, UINT64_MAX);
+}
+
+}  // namespace
+
+ShardedTrajectoryWriter::ShardedTrajectoryWriter(
+    std::vector<std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface>>
+        stubs,
+    const Options& options)
+    : stubs_(std::move(stubs)), options_(options), active_shard_(-1) {
+  REVERB_CHECK(!stubs_.empty());
+  REVERB_CHECK_OK(options.Validate());
+  for (const auto& stub : stubs_) {
+    writers_.push_back(
+        absl::make_unique<TrajectoryWriter>(stub, options_.writer_options));
+  }
+  StartEpisode();
+}
+
+absl::Status ShardedTrajectoryWriter::Append(
+    std::vector<absl::optional<tensorflow::Tensor>> data,
+    std::vector<absl::optional<std::weak_ptr<CellRef>>>* refs) {
+  return writers_[active_shard_]->Append(std::move(data), refs);
+}
+
+absl::Status ShardedTrajectoryWriter::CreateItem(
+    absl::string_view table, double priority,
+    absl::Span<const TrajectoryColumn> trajectory) {
+  return writers_[active_shard_]->CreateItem(table, priority, trajectory);
+}
+
+absl::Status ShardedTrajectoryWriter::Flush(int ignore_last_num_items,
+                                            absl::Duration timeout) {
+  return writers_[active_shard_]->Flush(ignore_last_num_items, timeout);
+}
+
+absl::Status ShardedTrajectoryWriter::EndEpisode(bool clear_buffers,
+                                                 absl::Duration timeout) {
+  REVERB_RETURN_IF_ERROR(
+      writers_[active_shard_]->EndEpisode(clear_buffers, timeout));
+  StartEpisode();
+  return absl::OkStatus();
+}
+
+void ShardedTrajectoryWriter::Close() {
+  for (auto& writer : writers_) {
+    writer->Close();
+  }
+}
+
+absl::Status ShardedTrajectoryWriter::ConfigureChunker(
+    int column, const TrajectoryWriter::Options& options) {
+  for (auto& writer : writers_) {
+    REVERB_RETURN_IF_ERROR(writer->ConfigureChunker(column, options));
+  }
+  return absl::OkStatus();
+}
+
+int ShardedTrajectoryWriter::active_shard() const { return active_shard_; }
+
+void ShardedTrajectoryWriter::StartEpisode() {
+  uint64_t episode_id = NewEpisodeId();
+  active_shard_ = SelectShard(episode_id);
+  writers_[active_shard_]->SetEpisodeId(episode_id);
+}
+
+int ShardedTrajectoryWriter::SelectShard(uint64_t episode_id) const {
+  const int num_shards = writers_.size();
+  const int next_shard = (active_shard_ + 1) % num_shards;
+  switch (options_.routing) {
+    case Routing::kEpisodeIdHash:
+      return absl::Hash<uint64_t>()(episode_id) % num_shards;
+    case Routing::kRoundRobin:
+      return next_shard;
+    case Routing::kLeastLoaded: {
+      int shard = LeastLoadedShard();
+      return shard == -1 ? next_shard : shard;
+    }
+  }
+  REVERB_LOG(REVERB_FATAL) << "Unknown routing "
+                           << static_cast<int>(options_.routing);
+  return next_shard;
+}
+
+int ShardedTrajectoryWriter::LeastLoadedShard() const {
+  int best_shard = -1;
+  int64_t best_pending = std::numeric_limits<int64_t>::max();
+  int64_t best_size = std::numeric_limits<int64_t>::max();
+
+  for (int i = 0; i < stubs_.size(); ++i) {
+    grpc::ClientContext context;
+    context.set_deadline(absl::ToChronoTime(
+        absl::Now() + options_.server_info_timeout));
+    ServerInfoRequest request;
+    ServerInfoResponse response;
+    auto status = stubs_[i]->ServerInfo(&context, request, &response);
+    if (!status.ok()) {
+      REVERB_LOG(REVERB_WARNING)
+          << "ServerInfo failed for shard " << i
+          << " and it will not be considered when routing the episode: "
+          << status.error_message();
+      continue;
+    }
+
+    int64_t pending = 0;
+    int64_t size = 0;
+    for (const auto& table : response.table_info()) {
+      pending += table.rate_limiter_info().insert_stats().pending();
+      size += table.current_size();
+    }
+    if (pending < best_pending ||
+        (pending == best_pending && size < best_size)) {
+      best_shard = i;
+      best_pending = pending;
+      best_size = size;
+    }
+  }
+
+  return best_shard;
+}
+
+absl::Status ShardedTrajectoryWriter::Options::Validate() const {
+  REVERB_RETURN_IF_ERROR(writer_options.Validate());
+  if (writer_options.num_episodes != 1) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("writer_options.num_episodes must be 1 but got ",
+                     writer_options.num_episodes, "."));
+  }
+  if (server_info_timeout <= absl::ZeroDuration()) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("server_info_timeout must be > 0 but got ",
+                     absl::FormatDuration(server_info_timeout), "."));
+  }
+  return absl::OkStatus();
+}
+
+}  // namespace reverb
+}  // namespace deepmind
@@ -0,0 +1,148 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_SHARDED_TRAJECTORY_WRITER_H_
+#define REVERB_CC_SHARDED_TRAJECTORY_WRITER_H_
+
+#include <memory>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/time.h"
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
+#include "reverb/cc/reverb_service.grpc.pb.h"
+#include "reverb/cc/trajectory_writer.h"
+#include "tensorflow/core/framework/tensor.h"
+
+namespace deepmind {
+namespace reverb {
+
+// Writes trajectories to a table which is sharded across multiple servers.
+//
+// Every shard is served by its own `TrajectoryWriter` and all data of an
+// episode (i.e everything appended between two `EndEpisode` calls) is routed
+// to the same shard. Items created within an episode can therefore share
+// chunks, also across tables, exactly as they would with a single
+// `TrajectoryWriter`. The shard is selected by `Options::routing` whenever a
+// new episode begins.
+//
+// `CellRef`s created in a previous episode (i.e when `EndEpisode` was called
+// with `clear_buffers=false`) may still be referenced by new items. If the new
+// episode is routed to a different shard then the referenced chunks are
+// transmitted to that shard as well.
+//
+// With the exception of `Close`, none of the methods are thread safe.
+class ShardedTrajectoryWriter {
+ public:
+  enum class Routing {
+    // The shard is selected using the hash of the episode ID. The episode ID
+    // is shared by all shards so the `CellRef`s carry the same ID regardless
+    // of which shard the episode was written to.
+    kEpisodeIdHash,
+
+    // Episodes are written to the shards in turn.
+    kRoundRobin,
+
+    // Queries every shard with `ServerInfo` and selects the one with the
+    // fewest inserts blocked by the rate limiters, using the total number of
+    // items as the tie breaker. Shards which fail to respond within
+    // `Options::server_info_timeout` are not considered. If no shard responds
+    // then the next shard in turn is used.
+    kLeastLoaded,
+  };
+
+  struct Options {
+    // Options used to construct the `TrajectoryWriter` of every shard.
+    TrajectoryWriter::Options writer_options;
+
+    // How episodes are assigned to shards.
+    Routing routing = Routing::kEpisodeIdHash;
+
+    // Deadline of the `ServerInfo` calls issued by `Routing::kLeastLoaded`.
+    absl::Duration server_info_timeout = absl::Seconds(1);
+
+    // Checks that field values are valid and returns `InvalidArgument` if any
+    // field value, or combination of field values, are invalid.
+    absl::Status Validate() const;
+  };
+
+  // `stubs` must not be empty and `options` must be valid.
+  ShardedTrajectoryWriter(
+      std::vector<std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface>>
+          stubs,
+      const Options& options);
+
+  // See `TrajectoryWriter::Append`. The data is appended to the shard which
+  // the active episode is routed to.
+  absl::Status Append(
+      std::vector<absl::optional<tensorflow::Tensor>> data,
+      std::vector<absl::optional<std::weak_ptr<CellRef>>>* refs);
+
+  // See `TrajectoryWriter::CreateItem`. The item is written to the shard which
+  // the active episode is routed to.
+  absl::Status CreateItem(absl::string_view table, double priority,
+                          absl::Span<const TrajectoryColumn> trajectory);
+
+  // See `TrajectoryWriter::Flush`. Only the shard of the active episode can
+  // have pending items since `EndEpisode` confirms all items before the next
+  // episode is routed.
+  absl::Status Flush(int ignore_last_num_items = 0,
+                     absl::Duration timeout = absl::InfiniteDuration());
+
+  // See `TrajectoryWriter::EndEpisode`. Once the items of the episode have been
+  // confirmed a shard is selected for the next episode.
+  absl::Status EndEpisode(
+      bool clear_buffers, absl::Duration timeout = absl::InfiniteDuration());
+
+  // Closes the writers of all shards.
+  void Close();
+
+  // Configures the column on the writers of all shards. See
+  // `TrajectoryWriter::ConfigureChunker`.
+  absl::Status ConfigureChunker(int column,
+                                const TrajectoryWriter::Options& options);
+
+  // Index of the shard that the active episode is routed to.
+  int active_shard() const;
+
+ private:
+  // Selects the shard of a new episode with ID `episode_id`.
+  int SelectShard(uint64_t episode_id) const;
+
+  // Index of the shard with the fewest blocked inserts. Returns -1 if none of
+  // the shards responded to `ServerInfo`.
+  int LeastLoadedShard() const;
+
+  // Generates a new episode ID, routes it and starts the episode on the
+  // selected writer.
+  void StartEpisode();
+
+  std::vector<std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface>>
+      stubs_;
+
+  Options options_;
+
+  // One writer per stub.
+  std::vector<std::unique_ptr<TrajectoryWriter>> writers_;
+
+  // Index in `writers_` of the shard that the active episode is routed to.
+  int active_shard_;
+};
+
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_SHARDED_TRAJECTORY_WRITER_H_
@@ -0,0 +1,256 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/sharded_trajectory_writer.h"
+
+#include <memory>
+#include <vector>
+
+#include "grpcpp/impl/codegen/client_context.h"
+#include "grpcpp/impl/codegen/status.h"
+#include "grpcpp/test/mock_stream.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/hash/hash.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "absl/types/optional.h"
+#include "reverb/cc/platform/logging.h"
+#include "reverb/cc/platform/status_matchers.h"
+#include "reverb/cc/reverb_service.grpc.pb.h"
+#include "reverb/cc/reverb_service.pb.h"
+#include "reverb/cc/reverb_service_mock.grpc.pb.h"
+#include "reverb/cc/support/queue.h"
+#include "reverb/cc/trajectory_writer.h"
+#include "tensorflow/core/framework/tensor.h"
+#include "tensorflow/core/framework/types.h"
+
+namespace deepmind {
+namespace reverb {
+namespace {
+
+using ::grpc::testing::MockClientReaderWriter;
+using ::testing::ElementsAre;
+using ::testing::IsEmpty;
+using ::testing::SizeIs;
+
+using Step = ::std::vector<::absl::optional<::tensorflow::Tensor>>;
+using StepRef = ::std::vector<::absl::optional<::std::weak_ptr<CellRef>>>;
+
+MATCHER(IsChunk, "") { return arg.has_chunk(); }
+
+MATCHER(IsItem, "") { return arg.item().send_confirmation(); }
+
+TrajectoryColumn MakeColumn(const StepRef& step) {
+  return TrajectoryColumn({step[0].value()}, /*squeeze=*/false);
+}
+
+class FakeStream
+    : public MockClientReaderWriter<InsertStreamRequest, InsertStreamResponse> {
+ public:
+  FakeStream() : pending_confirmation_(10) {}
+
+  ~FakeStream() { pending_confirmation_.Close(); }
+
+  bool Write(const InsertStreamRequest& msg,
+             grpc::WriteOptions options) override {
+    absl::MutexLock lock(&mu_);
+    requests_.push_back(msg);
+    if (msg.item().send_confirmation()) {
+      REVERB_CHECK(pending_confirmation_.Push(msg.item().item().key()));
+    }
+    return true;
+  }
+
+  bool Read(InsertStreamResponse* response) override {
+    uint64_t confirm_id;
+    if (!pending_confirmation_.Pop(&confirm_id)) {
+      return false;
+    }
+    response->set_key(confirm_id);
+    return true;
+  }
+
+  grpc::Status Finish() override {
+    pending_confirmation_.Close();
+    return grpc::Status::OK;
+  }
+
+  std::vector<InsertStreamRequest> requests() const {
+    absl::MutexLock lock(&mu_);
+    return requests_;
+  }
+
+ private:
+  mutable absl::Mutex mu_;
+  std::vector<InsertStreamRequest> requests_ ABSL_GUARDED_BY(mu_);
+  internal::Queue<uint64_t> pending_confirmation_;
+};
+
+// Hands out a single `FakeStream` and reports `num_pending_inserts` blocked
+// inserts in `ServerInfo`.
+class FakeStub : public /* grpc_gen:: */MockReverbServiceStub {
+ public:
+  explicit FakeStub(int64_t num_pending_inserts = 0)
+      : stream_(new FakeStream()), num_pending_inserts_(num_pending_inserts) {}
+
+  ~FakeStub() override {
+    absl::MutexLock lock(&mu_);
+    if (!stream_taken_) delete stream_;
+  }
+
+  grpc::ClientReaderWriterInterface<InsertStreamRequest, InsertStreamResponse>*
+  InsertStreamRaw(grpc::ClientContext* context) override {
+    absl::MutexLock lock(&mu_);
+    REVERB_CHECK(!stream_taken_);
+    stream_taken_ = true;
+    return stream_;
+  }
+
+  grpc::Status ServerInfo(grpc::ClientContext* context,
+                          const ServerInfoRequest& request,
+                          ServerInfoResponse* response) override {
+    auto* table = response->add_table_info();
+    table->set_name("table");
+    table->mutable_rate_limiter_info()->mutable_insert_stats()->set_pending(
+        num_pending_inserts_);
+    return grpc::Status::OK;
+  }
+
+  // Only valid for as long as the writer which took the stream is alive.
+  const FakeStream& stream() const { return *stream_; }
+
+ private:
+  absl::Mutex mu_;
+  bool stream_taken_ ABSL_GUARDED_BY(mu_) = false;
+  FakeStream* stream_;
+  const int64_t num_pending_inserts_;
+};
+
+ShardedTrajectoryWriter::Options MakeOptions(
+    ShardedTrajectoryWriter::Routing routing) {
+  ShardedTrajectoryWriter::Options options;
+  options.writer_options = {/*max_chunk_length=*/1, /*num_keep_alive_refs=*/1};
+  options.routing = routing;
+  return options;
+}
+
+// Appends a step, creates an item referencing it in `table` and ends the
+// episode.
+void WriteEpisode(ShardedTrajectoryWriter* writer,
+                  absl::string_view table = "table") {
+  StepRef step;
+  REVERB_ASSERT_OK(writer->Append(
+      Step({tensorflow::Tensor(tensorflow::DT_INT32, {1})}), &step));
+  REVERB_ASSERT_OK(writer->CreateItem(table, 1.0, {MakeColumn(step)}));
+  REVERB_ASSERT_OK(writer->EndEpisode(/*clear_buffers=*/true));
+}
+
+TEST(ShardedTrajectoryWriter, RoundRobinWritesEpisodesToShardsInTurn) {
+  auto first = std::make_shared<FakeStub>();
+  auto second = std::make_shared<FakeStub>();
+  ShardedTrajectoryWriter writer(
+      {first, second},
+      MakeOptions(ShardedTrajectoryWriter::Routing::kRoundRobin));
+
+  EXPECT_EQ(writer.active_shard(), 0);
+  WriteEpisode(&writer);
+  EXPECT_EQ(writer.active_shard(), 1);
+  WriteEpisode(&writer);
+  EXPECT_EQ(writer.active_shard(), 0);
+  WriteEpisode(&writer);
+
+  EXPECT_THAT(first->stream().requests(),
+              ElementsAre(IsChunk(), IsItem(), IsChunk(), IsItem()));
+  EXPECT_THAT(second->stream().requests(), ElementsAre(IsChunk(), IsItem()));
+}
+
+TEST(ShardedTrajectoryWriter, ItemsOfEpisodeShareChunksOnOneShard) {
+  auto first = std::make_shared<FakeStub>();
+  auto second = std::make_shared<FakeStub>();
+  ShardedTrajectoryWriter writer(
+      {first, second},
+      MakeOptions(ShardedTrajectoryWriter::Routing::kRoundRobin));
+
+  StepRef step;
+  REVERB_ASSERT_OK(writer.Append(
+      Step({tensorflow::Tensor(tensorflow::DT_INT32, {1})}), &step));
+  REVERB_ASSERT_OK(writer.CreateItem("a", 1.0, {MakeColumn(step)}));
+  REVERB_ASSERT_OK(writer.CreateItem("b", 1.0, {MakeColumn(step)}));
+  REVERB_ASSERT_OK(writer.Flush());
+
+  // The chunk is only sent once even though it is referenced by items in two
+  // different tables.
+  EXPECT_THAT(first->stream().requests(),
+              ElementsAre(IsChunk(), IsItem(), IsItem()));
+  EXPECT_THAT(second->stream().requests(), IsEmpty());
+}
+
+TEST(ShardedTrajectoryWriter, EpisodeIdHashSelectsShardFromEpisodeId) {
+  std::vector<std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface>>
+      stubs;
+  for (int i = 0; i < 3; i++) {
+    stubs.push_back(std::make_shared<FakeStub>());
+  }
+  ShardedTrajectoryWriter writer(
+      stubs,
+      MakeOptions(ShardedTrajectoryWriter::Routing::kEpisodeIdHash));
+
+  for (int i = 0; i < 10; i++) {
+    StepRef step;
+    REVERB_ASSERT_OK(writer.Append(
+        Step({tensorflow::Tensor(tensorflow::DT_INT32, {1})}), &step));
+    uint64_t episode_id = step[0]->lock()->episode_id();
+    EXPECT_EQ(writer.active_shard(),
+              static_cast<int>(absl::Hash<uint64_t>()(episode_id) % 3));
+    REVERB_ASSERT_OK(writer.EndEpisode(/*clear_buffers=*/true));
+  }
+}
+
+TEST(ShardedTrajectoryWriter, LeastLoadedSelectsShardWithFewestPendingInserts) {
+  auto busy = std::make_shared<FakeStub>(/*num_pending_inserts=*/5);
+  auto idle = std::make_shared<FakeStub>(/*num_pending_inserts=*/0);
+  ShardedTrajectoryWriter writer(
+      {busy, idle},
+      MakeOptions(ShardedTrajectoryWriter::Routing::kLeastLoaded));
+
+  for (int i = 0; i < 3; i++) {
+    EXPECT_EQ(writer.active_shard(), 1);
+    WriteEpisode(&writer);
+  }
+
+  EXPECT_THAT(idle->stream().requests(), SizeIs(6));
+}
+
+TEST(ShardedTrajectoryWriterOptions, Valid) {
+  REVERB_EXPECT_OK(
+      MakeOptions(ShardedTrajectoryWriter::Routing::kRoundRobin).Validate());
+}
+
+TEST(ShardedTrajectoryWriterOptions, ValidatesWriterOptions) {
+  auto options = MakeOptions(ShardedTrajectoryWriter::Routing::kRoundRobin);
+  options.writer_options.max_chunk_length = 0;
+  EXPECT_EQ(options.Validate().code(), absl::StatusCode::kInvalidArgument);
+}
+
+TEST(ShardedTrajectoryWriterOptions, ZeroServerInfoTimeout) {
+  auto options = MakeOptions(ShardedTrajectoryWriter::Routing::kLeastLoaded);
+  options.server_info_timeout = absl::ZeroDuration();
+  EXPECT_EQ(options.Validate().code(), absl::StatusCode::kInvalidArgument);
+}
+
+}  // namespace
+}  // namespace reverb
+}  // namespace deepmind
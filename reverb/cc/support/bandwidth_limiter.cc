@@ -0,0 +1,54 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/support/bandwidth_limiter.h"
+
+#include <algorithm>
+#include <cstdint>
+
+#include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "reverb/cc/platform/logging.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+
+BandwidthLimiter::BandwidthLimiter(int64_t bytes_per_second)
+    : bytes_per_second_(bytes_per_second) {
+  REVERB_CHECK_GT(bytes_per_second_, 0);
+}
+
+void BandwidthLimiter::Acquire(int64_t num_bytes) {
+  if (num_bytes <= 0) return;
+
+  const absl::Time now = absl::Now();
+  absl::Time wake_up;
+  {
+    absl::MutexLock lock(&mu_);
+    // At most one second worth of unused budget is carried over.
+    paid_until_ = std::max(paid_until_, now - absl::Seconds(1));
+    paid_until_ +=
+        absl::Seconds(static_cast<double>(num_bytes) / bytes_per_second_);
+    wake_up = paid_until_;
+  }
+  if (wake_up > now) {
+    absl::SleepFor(wake_up - now);
+  }
+}
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
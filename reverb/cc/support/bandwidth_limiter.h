@@ -0,0 +1,59 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_SUPPORT_BANDWIDTH_LIMITER_H_
+#define REVERB_CC_SUPPORT_BANDWIDTH_LIMITER_H_
+
+#include <cstdint>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+
+// Limits the rate at which bytes are consumed (e.g. written to disk) to
+// `bytes_per_second`. Bytes which were not consumed while the limiter was idle
+// can be spent in a burst, up to one second worth of bytes. Each call is
+// charged in full and waits until its bytes have been paid for, so a request
+// larger than the burst blocks for the time its bytes take at
+// `bytes_per_second`, less the unused budget, and the calls that follow it
+// wait behind it.
+//
+// This object is thread-safe and callers share the budget.
+class BandwidthLimiter {
+ public:
+  explicit BandwidthLimiter(int64_t bytes_per_second);
+
+  // Blocks until `num_bytes` may be consumed.
+  void Acquire(int64_t num_bytes) ABSL_LOCKS_EXCLUDED(mu_);
+
+  int64_t bytes_per_second() const { return bytes_per_second_; }
+
+ private:
+  const int64_t bytes_per_second_;
+
+  absl::Mutex mu_;
+
+  // Time at which the bytes acquired so far have been paid for.
+  absl::Time paid_until_ ABSL_GUARDED_BY(mu_) = absl::InfinitePast();
+};
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_SUPPORT_BANDWIDTH_LIMITER_H_
@@ -0,0 +1,56 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/support/bandwidth_limiter.h"
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+namespace {
+
+TEST(BandwidthLimiterTest, AdmitsBurstOfOneSecond) {
+  BandwidthLimiter limiter(/*bytes_per_second=*/1000);
+  const absl::Time start = absl::Now();
+  limiter.Acquire(600);
+  limiter.Acquire(400);
+  EXPECT_LT(absl::Now() - start, absl::Milliseconds(200));
+}
+
+TEST(BandwidthLimiterTest, ThrottlesBeyondBurst) {
+  BandwidthLimiter limiter(/*bytes_per_second=*/1000);
+  limiter.Acquire(1000);
+
+  const absl::Time start = absl::Now();
+  limiter.Acquire(300);
+  EXPECT_GE(absl::Now() - start, absl::Milliseconds(250));
+}
+
+TEST(BandwidthLimiterTest, IgnoresEmptyRequests) {
+  BandwidthLimiter limiter(/*bytes_per_second=*/1);
+  limiter.Acquire(1);
+
+  const absl::Time start = absl::Now();
+  limiter.Acquire(0);
+  EXPECT_LT(absl::Now() - start, absl::Milliseconds(200));
+}
+
+}  // namespace
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
@@ -0,0 +1,126 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/support/channel_pool.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "grpc/grpc.h"
+#include "grpcpp/channel.h"
+#include "grpcpp/support/channel_arguments.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_join.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "reverb/cc/platform/grpc_utils.h"
+#include "reverb/cc/platform/logging.h"
+
+namespace deepmind {
+namespace reverb {
+namespace {
+
+// Channel argument which keeps gRPC from sharing subchannels between the
+// channels of the same pool entry.
+constexpr char kChannelIndexArg[] = "reverb.channel_pool_index";
+
+// Returns a string which identifies `target` and `arguments`. Pointer
+// arguments are identified by their address.
+std::string MakeKey(absl::string_view target,
+                    const grpc::ChannelArguments& arguments) {
+  const grpc_channel_args args = arguments.c_channel_args();
+  std::vector<std::string> parts;
+  parts.reserve(args.num_args);
+  for (size_t i = 0; i < args.num_args; ++i) {
+    const grpc_arg& arg = args.args[i];
+    switch (arg.type) {
+      case GRPC_ARG_STRING:
+        parts.push_back(absl::StrCat(arg.key, "=s:", arg.value.string));
+        break;
+      case GRPC_ARG_INTEGER:
+        parts.push_back(absl::StrCat(arg.key, "=i:", arg.value.integer));
+        break;
+      case GRPC_ARG_POINTER:
+        parts.push_back(absl::StrCat(
+            arg.key, "=p:", reinterpret_cast<uintptr_t>(arg.value.pointer.p)));
+        break;
+    }
+  }
+  std::sort(parts.begin(), parts.end());
+  return absl::StrCat(target, "|", absl::StrJoin(parts, ","));
+}
+
+}  // namespace
+
+ChannelPool::ChannelPool(int channels_per_target)
+    : channels_per_target_(channels_per_target) {
+  REVERB_CHECK_GT(channels_per_target, 0);
+}
+
+ChannelPool* ChannelPool::Global() {
+  static auto* pool = new ChannelPool(kDefaultChannelsPerTarget);
+  return pool;
+}
+
+std::shared_ptr<grpc::ChannelInterface> ChannelPool::GetChannel(
+    absl::string_view target, const grpc::ChannelArguments& arguments) {
+  const std::string key = MakeKey(target, arguments);
+
+  absl::MutexLock lock(&mu_);
+  Entry& entry = entries_[key];
+  if (entry.channels.size() != static_cast<size_t>(channels_per_target_)) {
+    entry.channels.resize(channels_per_target_);
+  }
+  const size_t index = entry.next++ % entry.channels.size();
+  if (auto channel = entry.channels[index].lock()) {
+    return channel;
+  }
+
+  // Creating a channel does not connect to the server, so it is cheap enough
+  // to do while holding the lock.
+  grpc::ChannelArguments channel_arguments = arguments;
+  channel_arguments.SetInt(kChannelIndexArg, index);
+  auto channel = CreateCustomGrpcChannel(target, MakeChannelCredentials(),
+                                         channel_arguments);
+  entry.channels[index] = channel;
+  return channel;
+}
+
+void ChannelPool::SetChannelsPerTarget(int channels_per_target) {
+  REVERB_CHECK_GT(channels_per_target, 0);
+  absl::MutexLock lock(&mu_);
+  channels_per_target_ = channels_per_target;
+}
+
+int ChannelPool::channels_per_target() const {
+  absl::MutexLock lock(&mu_);
+  return channels_per_target_;
+}
+
+int ChannelPool::num_open_channels() const {
+  absl::MutexLock lock(&mu_);
+  int count = 0;
+  for (const auto& [key, entry] : entries_) {
+    for (const auto& channel : entry.channels) {
+      count += !channel.expired();
+    }
+  }
+  return count;
+}
+
+}  // namespace reverb
+}  // namespace deepmind
@@ -0,0 +1,85 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_SUPPORT_CHANNEL_POOL_H_
+#define REVERB_CC_SUPPORT_CHANNEL_POOL_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "grpcpp/channel.h"
+#include "grpcpp/security/credentials.h"
+#include "grpcpp/support/channel_arguments.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "reverb/cc/platform/hash_map.h"
+
+namespace deepmind {
+namespace reverb {
+
+// Shares gRPC channels between clients which connect to the same target with
+// the same channel arguments. Every (target, arguments) pair is served by up to
+// `channels_per_target` channels which are handed out in round robin order.
+// Each of these channels is given a distinct channel argument so that gRPC
+// does not share their subchannels, i.e. every pooled channel has its own
+// connection to the server.
+//
+// The pool only holds weak references, so a channel (and its connection) is
+// closed as soon as the last client using it is destroyed. The next request
+// for the same slot then creates a new channel.
+//
+// This object is thread-safe.
+class ChannelPool {
+ public:
+  explicit ChannelPool(int channels_per_target);
+
+  // Process-wide pool used by `Client`. Holds `kDefaultChannelsPerTarget`
+  // channels per target unless changed with `SetChannelsPerTarget`.
+  static ChannelPool* Global();
+
+  static constexpr int kDefaultChannelsPerTarget = 1;
+
+  // Returns a channel to `target` created with `MakeChannelCredentials()` and
+  // `arguments`.
+  std::shared_ptr<grpc::ChannelInterface> GetChannel(
+      absl::string_view target, const grpc::ChannelArguments& arguments)
+      ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Sets the number of channels per (target, arguments) pair. Only affects
+  // channels returned after the call. `channels_per_target` must be positive.
+  void SetChannelsPerTarget(int channels_per_target) ABSL_LOCKS_EXCLUDED(mu_);
+
+  int channels_per_target() const ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Number of pooled channels which are still in use. O(#pooled channels).
+  int num_open_channels() const ABSL_LOCKS_EXCLUDED(mu_);
+
+ private:
+  struct Entry {
+    std::vector<std::weak_ptr<grpc::ChannelInterface>> channels;
+    int64_t next = 0;
+  };
+
+  mutable absl::Mutex mu_;
+  int channels_per_target_ ABSL_GUARDED_BY(mu_);
+  internal::flat_hash_map<std::string, Entry> entries_ ABSL_GUARDED_BY(mu_);
+};
+
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_SUPPORT_CHANNEL_POOL_H_
@@ -0,0 +1,103 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/support/channel_pool.h"
+
+#include <memory>
+#include <vector>
+
+#include "grpcpp/support/channel_arguments.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace deepmind {
+namespace reverb {
+namespace {
+
+grpc::ChannelArguments MakeArguments(int max_message_size) {
+  grpc::ChannelArguments arguments;
+  arguments.SetMaxReceiveMessageSize(max_message_size);
+  return arguments;
+}
+
+// Channels only connect when they are first used, so none of the tests need a
+// server to be running.
+
+TEST(ChannelPoolTest, SharesChannelForSameTargetAndArguments) {
+  ChannelPool pool(1);
+  auto a = pool.GetChannel("localhost:1234", MakeArguments(-1));
+  auto b = pool.GetChannel("localhost:1234", MakeArguments(-1));
+  EXPECT_EQ(a, b);
+  EXPECT_EQ(pool.num_open_channels(), 1);
+}
+
+TEST(ChannelPoolTest, DifferentTargetsAndArgumentsGetDifferentChannels) {
+  ChannelPool pool(1);
+  auto a = pool.GetChannel("localhost:1234", MakeArguments(-1));
+  auto b = pool.GetChannel("localhost:1235", MakeArguments(-1));
+  auto c = pool.GetChannel("localhost:1234", MakeArguments(100));
+  EXPECT_NE(a, b);
+  EXPECT_NE(a, c);
+  EXPECT_NE(b, c);
+  EXPECT_EQ(pool.num_open_channels(), 3);
+}
+
+TEST(ChannelPoolTest, HandsOutChannelsInRoundRobinOrder) {
+  ChannelPool pool(3);
+  std::vector<std::shared_ptr<grpc::ChannelInterface>> channels;
+  for (int i = 0; i < 6; i++) {
+    channels.push_back(pool.GetChannel("localhost:1234", MakeArguments(-1)));
+  }
+  EXPECT_NE(channels[0], channels[1]);
+  EXPECT_NE(channels[0], channels[2]);
+  EXPECT_NE(channels[1], channels[2]);
+  for (int i = 0; i < 3; i++) {
+    EXPECT_EQ(channels[i], channels[i + 3]);
+  }
+  EXPECT_EQ(pool.num_open_channels(), 3);
+}
+
+TEST(ChannelPoolTest, RecreatesChannelsNoLongerInUse) {
+  ChannelPool pool(1);
+  auto channel = pool.GetChannel("localhost:1234", MakeArguments(-1));
+  EXPECT_EQ(pool.num_open_channels(), 1);
+
+  channel = nullptr;
+  EXPECT_EQ(pool.num_open_channels(), 0);
+
+  EXPECT_NE(pool.GetChannel("localhost:1234", MakeArguments(-1)), nullptr);
+}
+
+TEST(ChannelPoolTest, SetChannelsPerTarget) {
+  ChannelPool pool(1);
+  auto a = pool.GetChannel("localhost:1234", MakeArguments(-1));
+  EXPECT_EQ(pool.GetChannel("localhost:1234", MakeArguments(-1)), a);
+
+  pool.SetChannelsPerTarget(2);
+  EXPECT_EQ(pool.channels_per_target(), 2);
+  auto b = pool.GetChannel("localhost:1234", MakeArguments(-1));
+  auto c = pool.GetChannel("localhost:1234", MakeArguments(-1));
+  EXPECT_NE(b, c);
+  EXPECT_TRUE(b == a || c == a);
+}
+
+TEST(ChannelPoolTest, GlobalPoolIsShared) {
+  EXPECT_EQ(ChannelPool::Global(), ChannelPool::Global());
+  EXPECT_EQ(ChannelPool::Global()->channels_per_target(),
+            ChannelPool::kDefaultChannelsPerTarget);
+}
+
+}  // namespace
+}  // namespace reverb
+}  // namespace deepmind
@@ -0,0 +1,109 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/support/chunk_column_index.h"
+
+#include <algorithm>
+#include <iterator>
+
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+
+void ChunkColumnIndex::Add(uint64_t chunk_key, int32_t column,
+                           const SequenceRange& range) {
+  if (column <= 0) return;
+  Remove(chunk_key);
+  chunks_[chunk_key] = {column, range};
+  columns_[column][{range.episode_id(), range.start()}] = chunk_key;
+}
+
+void ChunkColumnIndex::Remove(uint64_t chunk_key) {
+  auto it = chunks_.find(chunk_key);
+  if (it == chunks_.end()) return;
+
+  auto column_it = columns_.find(it->second.column);
+  column_it->second.erase(
+      {it->second.range.episode_id(), it->second.range.start()});
+  if (column_it->second.empty()) {
+    columns_.erase(column_it);
+  }
+  chunks_.erase(it);
+}
+
+absl::Status ChunkColumnIndex::Expand(
+    const InsertStreamRequest::AssembledTrajectory& assembled,
+    FlatTrajectory* trajectory) const {
+  const uint64_t episode_id = assembled.episode_id();
+  const int32_t end_step = assembled.end_step();
+
+  for (const auto& assembled_column : assembled.columns()) {
+    if (assembled_column.num_steps() <= 0) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Assembled columns must have a positive number of steps but got ",
+          assembled_column.num_steps(), "."));
+    }
+
+    auto column_it = columns_.find(assembled_column.chunk_column());
+    if (column_it == columns_.end()) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("No chunks held for column ",
+                       assembled_column.chunk_column(), "."));
+    }
+    const ColumnChunks& column_chunks = column_it->second;
+
+    auto* column = trajectory->add_columns();
+    column->set_squeeze(assembled_column.squeeze());
+
+    int32_t step = end_step - assembled_column.num_steps() + 1;
+    while (step <= end_step) {
+      // The chunk covering `step` is the last one starting at or before it.
+      auto it = column_chunks.upper_bound({episode_id, step});
+      if (it != column_chunks.begin()) it = std::prev(it);
+
+      const IndexedChunk* chunk = nullptr;
+      if (it != column_chunks.end() && it->first.first == episode_id &&
+          it->first.second <= step) {
+        chunk = &chunks_.at(it->second);
+      }
+      if (chunk == nullptr || chunk->range.end() < step) {
+        return absl::InvalidArgumentError(absl::StrCat(
+            "Step ", step, " of episode ", episode_id, " in column ",
+            assembled_column.chunk_column(),
+            " is not held by the stream."));
+      }
+      if (chunk->range.sparse()) {
+        return absl::InvalidArgumentError(
+            absl::StrCat("Chunk ", it->second,
+                         " is sparse and cannot be used in an assembled "
+                         "trajectory."));
+      }
+
+      const int32_t length = std::min(end_step, chunk->range.end()) - step + 1;
+      auto* slice = column->add_chunk_slices();
+      slice->set_chunk_key(it->second);
+      slice->set_offset(step - chunk->range.start());
+      slice->set_length(length);
+      step += length;
+    }
+  }
+  return absl::OkStatus();
+}
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
@@ -0,0 +1,72 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_SUPPORT_CHUNK_COLUMN_INDEX_H_
+#define REVERB_CC_SUPPORT_CHUNK_COLUMN_INDEX_H_
+
+#include <cstdint>
+#include <map>
+#include <utility>
+
+#include "absl/status/status.h"
+#include "reverb/cc/platform/hash_map.h"
+#include "reverb/cc/reverb_service.pb.h"
+#include "reverb/cc/schema.pb.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+
+// Index of the chunks held by an insert stream by the writer column they
+// belong to (see `InsertStreamRequest.chunk_column`) and the steps they cover.
+// Used to expand `AssembledTrajectory` into a `FlatTrajectory`.
+//
+// This object is not thread-safe.
+class ChunkColumnIndex {
+ public:
+  // Adds the chunk with key `chunk_key` covering `range` of `column`. Chunks
+  // with a non-positive `column` are ignored.
+  void Add(uint64_t chunk_key, int32_t column, const SequenceRange& range);
+
+  // Removes the chunk with key `chunk_key`. No-op if the chunk was never added.
+  void Remove(uint64_t chunk_key);
+
+  // Builds the `FlatTrajectory` described by `assembled`. Returns
+  // `InvalidArgumentError` if a step is not covered by an indexed chunk or if
+  // the covering chunk is sparse.
+  absl::Status Expand(
+      const InsertStreamRequest::AssembledTrajectory& assembled,
+      FlatTrajectory* trajectory) const;
+
+  // Number of indexed chunks.
+  size_t size() const { return chunks_.size(); }
+
+ private:
+  struct IndexedChunk {
+    int32_t column;
+    SequenceRange range;
+  };
+
+  // Chunks of a column keyed by episode and first step.
+  using ColumnChunks = std::map<std::pair<uint64_t, int32_t>, uint64_t>;
+
+  internal::flat_hash_map<uint64_t, IndexedChunk> chunks_;
+  internal::flat_hash_map<int32_t, ColumnChunks> columns_;
+};
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_SUPPORT_CHUNK_COLUMN_INDEX_H_
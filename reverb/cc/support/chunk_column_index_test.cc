@@ -0,0 +1,118 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/support/chunk_column_index.h"
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/status/status.h"
+#include "reverb/cc/platform/status_matchers.h"
+#include "reverb/cc/testing/proto_test_util.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+namespace {
+
+using ::deepmind::reverb::testing::EqualsProto;
+using ::deepmind::reverb::testing::MakeSequenceRange;
+
+InsertStreamRequest::AssembledTrajectory MakeAssembled(
+    uint64_t episode_id, int32_t end_step, int32_t column, int32_t num_steps) {
+  InsertStreamRequest::AssembledTrajectory assembled;
+  assembled.set_episode_id(episode_id);
+  assembled.set_end_step(end_step);
+  auto* col = assembled.add_columns();
+  col->set_chunk_column(column);
+  col->set_num_steps(num_steps);
+  return assembled;
+}
+
+TEST(ChunkColumnIndexTest, ExpandsStepsAcrossChunks) {
+  ChunkColumnIndex index;
+  index.Add(10, 1, MakeSequenceRange(100, 0, 3));
+  index.Add(11, 1, MakeSequenceRange(100, 4, 7));
+  index.Add(20, 2, MakeSequenceRange(100, 0, 7));
+
+  auto assembled = MakeAssembled(100, 5, 1, 4);
+  auto* second = assembled.add_columns();
+  second->set_chunk_column(2);
+  second->set_num_steps(1);
+  second->set_squeeze(true);
+
+  FlatTrajectory trajectory;
+  REVERB_ASSERT_OK(index.Expand(assembled, &trajectory));
+  EXPECT_THAT(trajectory, EqualsProto(R"pb(
+                columns {
+                  chunk_slices { chunk_key: 10 offset: 2 length: 2 }
+                  chunk_slices { chunk_key: 11 offset: 0 length: 2 }
+                }
+                columns {
+                  chunk_slices { chunk_key: 20 offset: 5 length: 1 }
+                  squeeze: true
+                }
+              )pb"));
+}
+
+TEST(ChunkColumnIndexTest, ExpandFailsForMissingSteps) {
+  ChunkColumnIndex index;
+  index.Add(10, 1, MakeSequenceRange(100, 4, 7));
+
+  FlatTrajectory trajectory;
+  // Steps before the first chunk.
+  EXPECT_EQ(index.Expand(MakeAssembled(100, 5, 1, 4), &trajectory).code(),
+            absl::StatusCode::kInvalidArgument);
+  // Other episode.
+  EXPECT_EQ(index.Expand(MakeAssembled(101, 5, 1, 1), &trajectory).code(),
+            absl::StatusCode::kInvalidArgument);
+  // Unknown column.
+  EXPECT_EQ(index.Expand(MakeAssembled(100, 5, 2, 1), &trajectory).code(),
+            absl::StatusCode::kInvalidArgument);
+  // Steps after the last chunk.
+  EXPECT_EQ(index.Expand(MakeAssembled(100, 8, 1, 1), &trajectory).code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+TEST(ChunkColumnIndexTest, ExpandFailsForSparseChunks) {
+  ChunkColumnIndex index;
+  SequenceRange range = MakeSequenceRange(100, 0, 7);
+  range.set_sparse(true);
+  index.Add(10, 1, range);
+
+  FlatTrajectory trajectory;
+  EXPECT_EQ(index.Expand(MakeAssembled(100, 5, 1, 2), &trajectory).code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+TEST(ChunkColumnIndexTest, RemovedChunksAreNotUsed) {
+  ChunkColumnIndex index;
+  index.Add(10, 1, MakeSequenceRange(100, 0, 3));
+  index.Add(11, 1, MakeSequenceRange(100, 4, 7));
+  index.Add(12, 0, MakeSequenceRange(100, 8, 9));  // Not indexed.
+  EXPECT_EQ(index.size(), 2);
+
+  index.Remove(10);
+  index.Remove(12);
+  EXPECT_EQ(index.size(), 1);
+
+  FlatTrajectory trajectory;
+  EXPECT_EQ(index.Expand(MakeAssembled(100, 4, 1, 2), &trajectory).code(),
+            absl::StatusCode::kInvalidArgument);
+  REVERB_EXPECT_OK(index.Expand(MakeAssembled(100, 4, 1, 1), &trajectory));
+}
+
+}  // namespace
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
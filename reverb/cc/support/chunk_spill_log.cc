@@ -0,0 +1,204 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/support/chunk_spill_log.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <utility>
+
+#include "absl/random/distributions.h"
+#include "absl/random/random.h"
+#include "absl/strings/str_cat.h"
+#include "reverb/cc/platform/logging.h"
+#include "reverb/cc/platform/status_macros.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+namespace {
+
+absl::Status ErrnoError(absl::string_view what, absl::string_view path) {
+  return absl::InternalError(absl::StrCat(what, " failed for spill segment ",
+                                          path, ": ", std::strerror(errno)));
+}
+
+}  // namespace
+
+absl::Status ChunkSpillLog::Create(const std::string& directory,
+                                   int64_t max_segment_bytes,
+                                   std::unique_ptr<ChunkSpillLog>* log) {
+  if (max_segment_bytes <= 0) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "max_segment_bytes must be > 0 but got ", max_segment_bytes, "."));
+  }
+
+  struct stat info;
+  if (stat(directory.c_str(), &info) != 0 || !S_ISDIR(info.st_mode)) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Spill directory ", directory, " does not exist."));
+  }
+
+  // The random part of the prefix allows multiple logs (e.g. of different
+  // servers) to share the same directory.
+  absl::BitGen gen;
+  std::string path_prefix =
+      absl::StrCat(directory, "/reverb_spill_", getpid(), "_",
+                   absl::Uniform<uint64_t>(gen), "_");
+
+  std::unique_ptr<ChunkSpillLog> new_log(
+      new ChunkSpillLog(std::move(path_prefix), max_segment_bytes));
+  {
+    absl::MutexLock lock(&new_log->mu_);
+    REVERB_RETURN_IF_ERROR(new_log->StartSegmentLocked());
+  }
+  *log = std::move(new_log);
+  return absl::OkStatus();
+}
+
+ChunkSpillLog::ChunkSpillLog(std::string path_prefix, int64_t max_segment_bytes)
+    : path_prefix_(std::move(path_prefix)),
+      max_segment_bytes_(max_segment_bytes) {}
+
+ChunkSpillLog::~ChunkSpillLog() {
+  absl::MutexLock lock(&mu_);
+  for (const auto& id_and_segment : segments_) {
+    DeleteSegment(id_and_segment.second);
+  }
+}
+
+absl::Status ChunkSpillLog::StartSegmentLocked() {
+  Segment segment;
+  segment.path = absl::StrCat(path_prefix_, next_segment_);
+  segment.fd = open(segment.path.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (segment.fd < 0) return ErrnoError("open", segment.path);
+  segment.size = 0;
+  segment.num_live_records = 0;
+
+  // The previous active segment is no longer appended to so it can be deleted
+  // as soon as it is empty.
+  if (auto it = segments_.find(active_segment_);
+      it != segments_.end() && it->second.num_live_records == 0) {
+    DeleteSegment(it->second);
+    segments_.erase(it);
+  }
+
+  active_segment_ = next_segment_++;
+  segments_.emplace(active_segment_, std::move(segment));
+  return absl::OkStatus();
+}
+
+void ChunkSpillLog::DeleteSegment(const Segment& segment) {
+  close(segment.fd);
+  if (unlink(segment.path.c_str()) != 0) {
+    REVERB_LOG(REVERB_WARNING)
+        << ErrnoError("unlink", segment.path).message();
+  }
+}
+
+absl::Status ChunkSpillLog::Append(absl::string_view data,
+                                   Location* location) {
+  int fd;
+  {
+    absl::MutexLock lock(&mu_);
+    if (segments_.at(active_segment_).size > 0 &&
+        segments_.at(active_segment_).size + data.size() >
+            max_segment_bytes_) {
+      REVERB_RETURN_IF_ERROR(StartSegmentLocked());
+    }
+    Segment& segment = segments_.at(active_segment_);
+    location->segment = active_segment_;
+    location->offset = segment.size;
+    location->length = data.size();
+    segment.size += data.size();
+    segment.num_live_records++;
+    live_bytes_ += data.size();
+    fd = segment.fd;
+  }
+
+  // The range is reserved so the write can happen without holding the lock.
+  // The segment cannot be deleted while the record is live.
+  int64_t written = 0;
+  while (written < location->length) {
+    ssize_t n = pwrite(fd, data.data() + written, location->length - written,
+                       location->offset + written);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      absl::Status status = ErrnoError(
+          "pwrite", absl::StrCat(path_prefix_, location->segment));
+      Release(*location);
+      return status;
+    }
+    written += n;
+  }
+  return absl::OkStatus();
+}
+
+absl::Status ChunkSpillLog::Read(const Location& location,
+                                 std::string* data) const {
+  int fd;
+  {
+    absl::MutexLock lock(&mu_);
+    auto it = segments_.find(location.segment);
+    if (it == segments_.end()) {
+      return absl::NotFoundError(
+          absl::StrCat("Spill segment ", location.segment, " not found."));
+    }
+    fd = it->second.fd;
+  }
+
+  data->resize(location.length);
+  int64_t read = 0;
+  while (read < location.length) {
+    ssize_t n = pread(fd, &(*data)[read], location.length - read,
+                      location.offset + read);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      return ErrnoError("pread", absl::StrCat(path_prefix_, location.segment));
+    }
+    read += n;
+  }
+  return absl::OkStatus();
+}
+
+void ChunkSpillLog::Release(const Location& location) {
+  absl::MutexLock lock(&mu_);
+  auto it = segments_.find(location.segment);
+  REVERB_CHECK(it != segments_.end());
+  live_bytes_ -= location.length;
+  if (--it->second.num_live_records == 0 &&
+      location.segment != active_segment_) {
+    DeleteSegment(it->second);
+    segments_.erase(it);
+  }
+}
+
+int64_t ChunkSpillLog::num_segments() const {
+  absl::MutexLock lock(&mu_);
+  return segments_.size();
+}
+
+int64_t ChunkSpillLog::live_bytes() const {
+  absl::MutexLock lock(&mu_);
+  return live_bytes_;
+}
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
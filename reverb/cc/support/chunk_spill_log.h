@@ -0,0 +1,109 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_SUPPORT_CHUNK_SPILL_LOG_H_
+#define REVERB_CC_SUPPORT_CHUNK_SPILL_LOG_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/status/status.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "reverb/cc/platform/hash_map.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+
+// Append-only log of variable sized records (serialized chunks) stored in
+// segment files on a local disk.
+//
+// Records are appended to the active segment until it reaches
+// `max_segment_bytes`, at which point a new segment is started. Records are
+// never moved or rewritten. Instead every segment counts its live records and
+// is deleted once all of them have been released, so the disk usage follows
+// the records in use as long as records are released in roughly the order they
+// were appended (e.g. chunks removed by a FIFO remover).
+//
+// All segments are deleted when the log is destroyed.
+//
+// This object is thread-safe. Appends and reads of different records run
+// concurrently, only the bookkeeping happens under the lock.
+class ChunkSpillLog {
+ public:
+  // Position of a record in the log.
+  struct Location {
+    int64_t segment;
+    int64_t offset;
+    int64_t length;
+  };
+
+  // Creates a log writing its segments to `directory`, which must exist.
+  static absl::Status Create(const std::string& directory,
+                             int64_t max_segment_bytes,
+                             std::unique_ptr<ChunkSpillLog>* log);
+
+  ~ChunkSpillLog();
+
+  // Appends `data` and sets `location` to the position of the new record.
+  absl::Status Append(absl::string_view data, Location* location)
+      ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Reads the record at `location`, which must not have been released.
+  absl::Status Read(const Location& location, std::string* data) const
+      ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Releases the record at `location`. The segment of the record is deleted if
+  // it no longer holds any live records and is not the active segment.
+  void Release(const Location& location) ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Number of segment files and the total size of the live records.
+  int64_t num_segments() const ABSL_LOCKS_EXCLUDED(mu_);
+  int64_t live_bytes() const ABSL_LOCKS_EXCLUDED(mu_);
+
+ private:
+  struct Segment {
+    std::string path;
+    int fd;
+    int64_t size;
+    int64_t num_live_records;
+  };
+
+  ChunkSpillLog(std::string path_prefix, int64_t max_segment_bytes);
+
+  // Creates a new segment and makes it the active segment.
+  absl::Status StartSegmentLocked() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Closes and deletes the file of `segment`.
+  static void DeleteSegment(const Segment& segment);
+
+  // Prefix of the paths of all segments. The id of the segment is appended.
+  const std::string path_prefix_;
+  const int64_t max_segment_bytes_;
+
+  mutable absl::Mutex mu_;
+  flat_hash_map<int64_t, Segment> segments_ ABSL_GUARDED_BY(mu_);
+  int64_t active_segment_ ABSL_GUARDED_BY(mu_) = -1;
+  int64_t next_segment_ ABSL_GUARDED_BY(mu_) = 0;
+  int64_t live_bytes_ ABSL_GUARDED_BY(mu_) = 0;
+};
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_SUPPORT_CHUNK_SPILL_LOG_H_
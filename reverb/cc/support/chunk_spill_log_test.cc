@@ -0,0 +1,112 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/support/chunk_spill_log.h"
+
+#include <cstdlib>
+#include <memory>
+#include <string>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/status/status.h"
+#include "reverb/cc/platform/status_matchers.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+namespace {
+
+std::string TestDirectory() {
+  const char* dir = std::getenv("TEST_TMPDIR");
+  return dir != nullptr ? dir : "/tmp";
+}
+
+TEST(ChunkSpillLog, CreateRejectsInvalidArguments) {
+  std::unique_ptr<ChunkSpillLog> log;
+  EXPECT_EQ(ChunkSpillLog::Create(TestDirectory(), 0, &log).code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(
+      ChunkSpillLog::Create("/this/directory/does/not/exist", 100, &log).code(),
+      absl::StatusCode::kInvalidArgument);
+}
+
+TEST(ChunkSpillLog, ReadsAppendedRecords) {
+  std::unique_ptr<ChunkSpillLog> log;
+  REVERB_ASSERT_OK(ChunkSpillLog::Create(TestDirectory(), 100, &log));
+
+  ChunkSpillLog::Location first;
+  ChunkSpillLog::Location second;
+  REVERB_ASSERT_OK(log->Append("hello", &first));
+  REVERB_ASSERT_OK(log->Append("world!", &second));
+  EXPECT_EQ(log->live_bytes(), 11);
+
+  std::string data;
+  REVERB_ASSERT_OK(log->Read(second, &data));
+  EXPECT_EQ(data, "world!");
+  REVERB_ASSERT_OK(log->Read(first, &data));
+  EXPECT_EQ(data, "hello");
+}
+
+TEST(ChunkSpillLog, StartsNewSegmentWhenFull) {
+  std::unique_ptr<ChunkSpillLog> log;
+  REVERB_ASSERT_OK(ChunkSpillLog::Create(TestDirectory(), 8, &log));
+
+  ChunkSpillLog::Location first;
+  ChunkSpillLog::Location second;
+  ChunkSpillLog::Location large;
+  REVERB_ASSERT_OK(log->Append("12345", &first));
+  REVERB_ASSERT_OK(log->Append("12345", &second));
+  EXPECT_NE(first.segment, second.segment);
+
+  // Records larger than a segment get a segment of their own.
+  REVERB_ASSERT_OK(log->Append("0123456789", &large));
+  EXPECT_NE(second.segment, large.segment);
+  EXPECT_EQ(log->num_segments(), 3);
+
+  std::string data;
+  REVERB_ASSERT_OK(log->Read(large, &data));
+  EXPECT_EQ(data, "0123456789");
+}
+
+TEST(ChunkSpillLog, DeletesSegmentsOnceAllRecordsReleased) {
+  std::unique_ptr<ChunkSpillLog> log;
+  REVERB_ASSERT_OK(ChunkSpillLog::Create(TestDirectory(), 8, &log));
+
+  ChunkSpillLog::Location first;
+  ChunkSpillLog::Location second;
+  ChunkSpillLog::Location third;
+  REVERB_ASSERT_OK(log->Append("1234", &first));
+  REVERB_ASSERT_OK(log->Append("1234", &second));
+  REVERB_ASSERT_OK(log->Append("1234", &third));
+  EXPECT_EQ(log->num_segments(), 2);
+
+  log->Release(first);
+  EXPECT_EQ(log->num_segments(), 2);
+  log->Release(second);
+  EXPECT_EQ(log->num_segments(), 1);
+
+  // The active segment is kept even when empty.
+  log->Release(third);
+  EXPECT_EQ(log->num_segments(), 1);
+  EXPECT_EQ(log->live_bytes(), 0);
+
+  std::string data;
+  EXPECT_EQ(log->Read(first, &data).code(), absl::StatusCode::kNotFound);
+}
+
+}  // namespace
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
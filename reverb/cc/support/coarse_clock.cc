@@ -0,0 +1,55 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/support/coarse_clock.h"
+
+#include <algorithm>
+#include <cstdint>
+
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "reverb/cc/platform/logging.h"
+#include "reverb/cc/platform/status_macros.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+
+CoarseClock::CoarseClock(absl::Duration resolution)
+    : now_ns_(absl::GetCurrentTimeNanos()),
+      ticker_([this] { Tick(); }, resolution, "CoarseClock") {
+  REVERB_CHECK_GT(resolution, absl::ZeroDuration());
+  REVERB_CHECK_OK(ticker_.Start());
+}
+
+CoarseClock::~CoarseClock() { REVERB_CHECK_OK(ticker_.Stop()); }
+
+absl::Time CoarseClock::Now() const { return absl::FromUnixNanos(NowNanos()); }
+
+int64_t CoarseClock::NowNanos() const {
+  return now_ns_.load(std::memory_order_relaxed);
+}
+
+void CoarseClock::Tick() {
+  // The system clock could be adjusted backwards so the refreshed value is
+  // never allowed to be smaller than the previous one. Only `Tick` writes to
+  // `now_ns_` so no read-modify-write is required.
+  now_ns_.store(std::max(now_ns_.load(std::memory_order_relaxed),
+                         absl::GetCurrentTimeNanos()),
+                std::memory_order_relaxed);
+}
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
@@ -0,0 +1,70 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_SUPPORT_COARSE_CLOCK_H_
+#define REVERB_CC_SUPPORT_COARSE_CLOCK_H_
+
+#include <atomic>
+#include <cstdint>
+
+#include "absl/time/time.h"
+#include "reverb/cc/support/periodic_closure.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+
+// A clock which is refreshed by a background thread every `resolution`.
+//
+// Reading the time from `CoarseClock` is a single atomic load which makes it
+// suitable for use in critical sections that are too hot for `absl::Now()`.
+// The returned time trails the real time by (up to) `resolution` and is only
+// guaranteed to be non decreasing.
+//
+// This object is thread-safe.
+class CoarseClock {
+ public:
+  static constexpr absl::Duration kDefaultResolution = absl::Milliseconds(1);
+
+  explicit CoarseClock(absl::Duration resolution = kDefaultResolution);
+
+  // Stops the background thread.
+  ~CoarseClock();
+
+  // Time of the most recent refresh.
+  absl::Time Now() const;
+
+  // Same as `Now` but as nanoseconds since the Unix epoch.
+  int64_t NowNanos() const;
+
+  // CoarseClock is neither copyable nor movable.
+  CoarseClock(const CoarseClock&) = delete;
+  CoarseClock& operator=(const CoarseClock&) = delete;
+
+ private:
+  // Reads the system clock and updates `now_ns_`.
+  void Tick();
+
+  // Time of the most recent refresh in nanoseconds since the Unix epoch.
+  std::atomic<int64_t> now_ns_;
+
+  // Calls `Tick` every `resolution`.
+  PeriodicClosure ticker_;
+};
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_SUPPORT_COARSE_CLOCK_H_
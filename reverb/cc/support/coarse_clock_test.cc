@@ -0,0 +1,49 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/support/coarse_clock.h"
+
+#include "gtest/gtest.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+namespace {
+
+TEST(CoarseClockTest, IsCloseToRealTime) {
+  CoarseClock clock(absl::Milliseconds(1));
+  EXPECT_LE(clock.Now(), absl::Now());
+  EXPECT_GE(clock.Now(), absl::Now() - absl::Seconds(1));
+}
+
+TEST(CoarseClockTest, AdvancesWithRealTime) {
+  CoarseClock clock(absl::Milliseconds(1));
+  const absl::Time start = clock.Now();
+  absl::SleepFor(absl::Milliseconds(50));
+  EXPECT_GT(clock.Now(), start);
+}
+
+TEST(CoarseClockTest, IsConstantBetweenTicks) {
+  CoarseClock clock(absl::Hours(1));
+  const int64_t start = clock.NowNanos();
+  absl::SleepFor(absl::Milliseconds(10));
+  EXPECT_EQ(clock.NowNanos(), start);
+}
+
+}  // namespace
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
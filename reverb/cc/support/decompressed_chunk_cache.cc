@@ -0,0 +1,118 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/support/decompressed_chunk_cache.h"
+
+#include "absl/strings/str_cat.h"
+#include "reverb/cc/platform/logging.h"
+#include "reverb/cc/platform/status_macros.h"
+#include "reverb/cc/support/trajectory_util.h"
+#include "tensorflow/core/framework/tensor_util.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+
+DecompressedChunkCache::DecompressedChunkCache(int64_t max_bytes)
+    : max_bytes_(max_bytes) {
+  REVERB_CHECK_GE(max_bytes_, 0);
+}
+
+absl::Status DecompressedChunkCache::UnpackChunkColumn(
+    const ChunkData& chunk_data, int column, tensorflow::Tensor* out) {
+  const Key key(chunk_data.chunk_key(), column);
+  {
+    absl::MutexLock lock(&mu_);
+    if (auto it = index_.find(key); it != index_.end()) {
+      entries_.splice(entries_.begin(), entries_, it->second);
+      *out = it->second->second;
+      ++num_hits_;
+      return absl::OkStatus();
+    }
+    ++num_misses_;
+  }
+
+  REVERB_RETURN_IF_ERROR(
+      ::deepmind::reverb::internal::UnpackChunkColumn(chunk_data, column, out));
+
+  const int64_t bytes = out->TotalBytes();
+  if (bytes > max_bytes_) {
+    return absl::OkStatus();
+  }
+
+  absl::MutexLock lock(&mu_);
+
+  // Another thread may have decoded the same column while the lock was
+  // released.
+  if (index_.contains(key)) {
+    return absl::OkStatus();
+  }
+
+  while (size_bytes_ + bytes > max_bytes_) {
+    size_bytes_ -= entries_.back().second.TotalBytes();
+    index_.erase(entries_.back().first);
+    entries_.pop_back();
+  }
+
+  entries_.emplace_front(key, *out);
+  index_[key] = entries_.begin();
+  size_bytes_ += bytes;
+  return absl::OkStatus();
+}
+
+absl::Status DecompressedChunkCache::UnpackChunkColumnAndSlice(
+    const ChunkData& chunk_data, const FlatTrajectory::ChunkSlice& slice,
+    tensorflow::Tensor* out) {
+  REVERB_RETURN_IF_ERROR(UnpackChunkColumn(chunk_data, slice.index(), out));
+
+  if (slice.offset() < 0 ||
+      slice.offset() + slice.length() > out->shape().dim_size(0)) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Cannot slice (", slice.offset(), ", ",
+                     slice.offset() + slice.length(),
+                     ") out of tensor with shape ",
+                     out->shape().DebugString(), "."));
+  }
+
+  *out = out->Slice(slice.offset(), slice.offset() + slice.length());
+  if (!out->IsAligned()) {
+    *out = tensorflow::tensor::DeepCopy(*out);
+  }
+
+  return absl::OkStatus();
+}
+
+int64_t DecompressedChunkCache::size_bytes() const {
+  absl::MutexLock lock(&mu_);
+  return size_bytes_;
+}
+
+int64_t DecompressedChunkCache::num_entries() const {
+  absl::MutexLock lock(&mu_);
+  return entries_.size();
+}
+
+int64_t DecompressedChunkCache::num_hits() const {
+  absl::MutexLock lock(&mu_);
+  return num_hits_;
+}
+
+int64_t DecompressedChunkCache::num_misses() const {
+  absl::MutexLock lock(&mu_);
+  return num_misses_;
+}
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
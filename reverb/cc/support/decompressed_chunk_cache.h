@@ -0,0 +1,97 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_SUPPORT_DECOMPRESSED_CHUNK_CACHE_H_
+#define REVERB_CC_SUPPORT_DECOMPRESSED_CHUNK_CACHE_H_
+
+#include <cstdint>
+#include <list>
+#include <utility>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/status/status.h"
+#include "absl/synchronization/mutex.h"
+#include "reverb/cc/platform/hash_map.h"
+#include "reverb/cc/schema.pb.h"
+#include "tensorflow/core/framework/tensor.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+
+// Holds the decompressed columns of recently used chunks so that chunks which
+// are sampled many times (e.g. when `max_times_sampled` > 1 or trajectories
+// overlap) are only decoded once. The cache is bounded by the total number of
+// bytes of the decompressed tensors and evicts the least recently used column
+// once full. Columns which alone exceed the capacity are never cached.
+//
+// The returned tensors share their buffer with the cached tensor so they must
+// not be modified.
+//
+// Decompression happens without holding the lock so concurrent misses on the
+// same column may both decode it, in which case only one copy is kept.
+//
+// This object is thread-safe.
+class DecompressedChunkCache {
+ public:
+  explicit DecompressedChunkCache(int64_t max_bytes);
+
+  // Same as `UnpackChunkColumn` but returns the cached tensor if present and
+  // otherwise adds the decompressed tensor to the cache.
+  absl::Status UnpackChunkColumn(const ChunkData& chunk_data, int column,
+                                 tensorflow::Tensor* out);
+
+  // Same as `UnpackChunkColumnAndSlice` but unpacks the column through the
+  // cache.
+  absl::Status UnpackChunkColumnAndSlice(const ChunkData& chunk_data,
+                                         const FlatTrajectory::ChunkSlice& slice,
+                                         tensorflow::Tensor* out);
+
+  // Total size of the cached tensors in bytes.
+  int64_t size_bytes() const;
+
+  // Number of cached columns.
+  int64_t num_entries() const;
+
+  // Number of calls which were served from and missed the cache respectively.
+  int64_t num_hits() const;
+  int64_t num_misses() const;
+
+  int64_t max_bytes() const { return max_bytes_; }
+
+ private:
+  // Chunk key and column index.
+  using Key = std::pair<uint64_t, int>;
+  using Entry = std::pair<Key, tensorflow::Tensor>;
+
+  const int64_t max_bytes_;
+
+  mutable absl::Mutex mu_;
+
+  // Entries ordered from the most to the least recently used.
+  std::list<Entry> entries_ ABSL_GUARDED_BY(mu_);
+
+  // Position of every key in `entries_`.
+  flat_hash_map<Key, std::list<Entry>::iterator> index_ ABSL_GUARDED_BY(mu_);
+
+  int64_t size_bytes_ ABSL_GUARDED_BY(mu_) = 0;
+  int64_t num_hits_ ABSL_GUARDED_BY(mu_) = 0;
+  int64_t num_misses_ ABSL_GUARDED_BY(mu_) = 0;
+};
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_SUPPORT_DECOMPRESSED_CHUNK_CACHE_H_
@@ -0,0 +1,133 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/support/decompressed_chunk_cache.h"
+
+#include <cstdint>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "reverb/cc/platform/status_matchers.h"
+#include "reverb/cc/schema.pb.h"
+#include "reverb/cc/tensor_compression.h"
+#include "reverb/cc/testing/tensor_testutil.h"
+#include "tensorflow/core/framework/tensor.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+namespace {
+
+// Creates a chunk with a single column of `length` int32 elements (i.e. 4 *
+// `length` bytes when decompressed) with values `0, 1, ..., length - 1`.
+ChunkData MakeChunk(uint64_t key, int length) {
+  tensorflow::Tensor tensor(tensorflow::DT_INT32,
+                            tensorflow::TensorShape({length}));
+  for (int i = 0; i < length; i++) {
+    tensor.flat<int32_t>()(i) = i;
+  }
+  ChunkData chunk;
+  chunk.set_chunk_key(key);
+  CompressTensorAsProto(tensor, chunk.mutable_data()->add_tensors());
+  return chunk;
+}
+
+TEST(DecompressedChunkCacheTest, ReturnsCachedTensorOnHit) {
+  DecompressedChunkCache cache(1024);
+  auto chunk = MakeChunk(1, 10);
+
+  tensorflow::Tensor first;
+  REVERB_ASSERT_OK(cache.UnpackChunkColumn(chunk, 0, &first));
+  tensorflow::Tensor second;
+  REVERB_ASSERT_OK(cache.UnpackChunkColumn(chunk, 0, &second));
+
+  test::ExpectTensorEqual<int32_t>(first, second);
+  EXPECT_EQ(first.tensor_data().data(), second.tensor_data().data());
+  EXPECT_EQ(cache.num_hits(), 1);
+  EXPECT_EQ(cache.num_misses(), 1);
+  EXPECT_EQ(cache.num_entries(), 1);
+  EXPECT_EQ(cache.size_bytes(), 40);
+}
+
+TEST(DecompressedChunkCacheTest, SlicesCachedColumn) {
+  DecompressedChunkCache cache(1024);
+  auto chunk = MakeChunk(1, 10);
+
+  FlatTrajectory::ChunkSlice slice;
+  slice.set_chunk_key(1);
+  slice.set_index(0);
+  slice.set_offset(2);
+  slice.set_length(3);
+
+  tensorflow::Tensor got;
+  REVERB_ASSERT_OK(cache.UnpackChunkColumnAndSlice(chunk, slice, &got));
+  ASSERT_EQ(got.NumElements(), 3);
+  EXPECT_EQ(got.flat<int32_t>()(0), 2);
+  EXPECT_EQ(got.flat<int32_t>()(2), 4);
+
+  // The whole column is cached, not just the slice.
+  EXPECT_EQ(cache.size_bytes(), 40);
+
+  slice.set_length(20);
+  EXPECT_EQ(cache.UnpackChunkColumnAndSlice(chunk, slice, &got).code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+TEST(DecompressedChunkCacheTest, EvictsLeastRecentlyUsedWhenFull) {
+  // Room for exactly two of the 40 byte columns.
+  DecompressedChunkCache cache(80);
+  auto first = MakeChunk(1, 10);
+  auto second = MakeChunk(2, 10);
+  auto third = MakeChunk(3, 10);
+
+  tensorflow::Tensor got;
+  REVERB_ASSERT_OK(cache.UnpackChunkColumn(first, 0, &got));
+  REVERB_ASSERT_OK(cache.UnpackChunkColumn(second, 0, &got));
+
+  // Touching the first chunk makes the second the least recently used.
+  REVERB_ASSERT_OK(cache.UnpackChunkColumn(first, 0, &got));
+  REVERB_ASSERT_OK(cache.UnpackChunkColumn(third, 0, &got));
+  EXPECT_EQ(cache.num_entries(), 2);
+  EXPECT_EQ(cache.size_bytes(), 80);
+
+  EXPECT_EQ(cache.num_hits(), 1);
+  REVERB_ASSERT_OK(cache.UnpackChunkColumn(first, 0, &got));
+  EXPECT_EQ(cache.num_hits(), 2);
+  REVERB_ASSERT_OK(cache.UnpackChunkColumn(second, 0, &got));
+  EXPECT_EQ(cache.num_hits(), 2);
+}
+
+TEST(DecompressedChunkCacheTest, DoesNotCacheColumnsLargerThanCapacity) {
+  DecompressedChunkCache cache(16);
+  auto chunk = MakeChunk(1, 10);
+
+  tensorflow::Tensor got;
+  REVERB_ASSERT_OK(cache.UnpackChunkColumn(chunk, 0, &got));
+  EXPECT_EQ(got.NumElements(), 10);
+  EXPECT_EQ(cache.num_entries(), 0);
+  EXPECT_EQ(cache.size_bytes(), 0);
+}
+
+TEST(DecompressedChunkCacheTest, ReturnsErrorForMissingColumn) {
+  DecompressedChunkCache cache(1024);
+  tensorflow::Tensor got;
+  EXPECT_EQ(cache.UnpackChunkColumn(MakeChunk(1, 10), 1, &got).code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(cache.num_entries(), 0);
+}
+
+}  // namespace
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
@@ -64,6 +64,25 @@ inline std::string FormatGrpcStatus(const grpc::Status& s) {
   return absl::Substitute("[$0] $1", s.error_code(), s.error_message());
 }
 
+// Responses of a sample stream up to this size are written with the buffer
+// hint set unless they are the last response of the batch, so that gRPC can
+// coalesce consecutive small responses (cached chunks, small chunks) into
+// fewer transport writes. Larger responses are sent right away.
+constexpr size_t kMaxCoalescedResponseBytes = 64 * 1024;
+
+// Returns the options for writing a sample stream response which holds
+// `data_bytes` of chunk data. `last_of_batch` must be set for the last
+// response of the sampled batch, which flushes the buffered responses.
+inline grpc::WriteOptions SampleStreamWriteOptions(size_t data_bytes,
+                                                   bool last_of_batch) {
+  grpc::WriteOptions options;
+  options.set_no_compression();  // Data is already compressed.
+  if (!last_of_batch && data_bytes <= kMaxCoalescedResponseBytes) {
+    options.set_buffer_hint();
+  }
+  return options;
+}
+
 inline bool IsLocalhostOrInProcess(absl::string_view hostname) {
   return absl::StrContains(hostname, ":127.0.0.1:") ||
          absl::StrContains(hostname, "[::1]") || hostname == "unknown";
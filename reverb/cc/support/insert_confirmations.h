@@ -0,0 +1,83 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_SUPPORT_INSERT_CONFIRMATIONS_H_
+#define REVERB_CC_SUPPORT_INSERT_CONFIRMATIONS_H_
+
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include "reverb/cc/platform/logging.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+
+// Orders the confirmations of the items received on an insert stream.
+//
+// The items of a stream can be inserted into different tables, and thus
+// complete out of order, but clients only request the confirmation of some of
+// the items and take the confirmation of an item to mean that all items sent
+// before it have been inserted as well. The confirmation of an item is
+// therefore released once the item and every item received before it have
+// been inserted.
+//
+// This object is not thread-safe.
+class InsertConfirmations {
+ public:
+  // Registers the next item received on the stream and returns its sequence
+  // number, which must be passed to `Done` once the item has been inserted.
+  uint64_t Add(uint64_t key, bool send_confirmation) {
+    pending_.push_back({key, send_confirmation, false});
+    return first_sequence_number_ + pending_.size() - 1;
+  }
+
+  // Marks the item with `sequence_number` as inserted and appends the keys of
+  // the items whose confirmations are released by it to `keys`, in the order
+  // the items were received.
+  void Done(uint64_t sequence_number, std::vector<uint64_t>* keys) {
+    REVERB_CHECK_GE(sequence_number, first_sequence_number_);
+    REVERB_CHECK_LT(sequence_number - first_sequence_number_, pending_.size());
+    pending_[sequence_number - first_sequence_number_].done = true;
+    while (!pending_.empty() && pending_.front().done) {
+      if (pending_.front().send_confirmation) {
+        keys->push_back(pending_.front().key);
+      }
+      pending_.pop_front();
+      first_sequence_number_++;
+    }
+  }
+
+  // Number of items which have been added but not yet released.
+  size_t num_pending() const { return pending_.size(); }
+
+ private:
+  struct Item {
+    uint64_t key;
+    bool send_confirmation;
+    bool done;
+  };
+
+  // Items which are waiting to be inserted or for an earlier item to be
+  // inserted. The front item has sequence number `first_sequence_number_`.
+  std::deque<Item> pending_;
+  uint64_t first_sequence_number_ = 0;
+};
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_SUPPORT_INSERT_CONFIRMATIONS_H_
@@ -0,0 +1,60 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/support/insert_confirmations.h"
+
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::IsEmpty;
+
+TEST(InsertConfirmationsTest, ReleasesConfirmationsInReceiveOrder) {
+  InsertConfirmations confirmations;
+  uint64_t first = confirmations.Add(10, /*send_confirmation=*/true);
+  uint64_t second = confirmations.Add(11, /*send_confirmation=*/false);
+  uint64_t third = confirmations.Add(12, /*send_confirmation=*/true);
+
+  // The third item is held back until the items before it are done.
+  std::vector<uint64_t> keys;
+  confirmations.Done(third, &keys);
+  EXPECT_THAT(keys, IsEmpty());
+  confirmations.Done(first, &keys);
+  EXPECT_THAT(keys, ElementsAre(10));
+
+  // Items without a requested confirmation release the items after them.
+  keys.clear();
+  confirmations.Done(second, &keys);
+  EXPECT_THAT(keys, ElementsAre(12));
+  EXPECT_EQ(confirmations.num_pending(), 0);
+
+  // Sequence numbers continue after the released items.
+  uint64_t fourth = confirmations.Add(13, /*send_confirmation=*/true);
+  EXPECT_EQ(fourth, third + 1);
+  keys.clear();
+  confirmations.Done(fourth, &keys);
+  EXPECT_THAT(keys, ElementsAre(13));
+}
+
+}  // namespace
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
@@ -29,6 +29,7 @@
 
 #include <stddef.h>
 
+#include <algorithm>
 #include <memory>
 #include <ostream>  // NOLINT
 #include <vector>
@@ -75,7 +76,7 @@ struct DefaultIntrusiveHeapLinkAccess {
   void Set(T* elem, IntrusiveHeapLink link) const { elem->heap = link; }
 };
 
-// IntrusiveHeap<T, PtrCompare, LinkAccess, Alloc>
+// IntrusiveHeap<T, PtrCompare, LinkAccess, Alloc, Arity>
 //
 //   A min-heap (under PtrCompare ordering) of pointers to T.
 //
@@ -100,13 +101,21 @@ struct DefaultIntrusiveHeapLinkAccess {
 //      LinkAccessor policy's Get(elem) and Set(link,elem) functions
 //      manipulate the member accessed by 'elem->heap'.
 //   Alloc: an STL allocator for T* elements. Default is std::allocator<T*>.
+//   Arity: the number of children of every node. A higher arity makes the
+//      heap shallower, so sifting towards the top (Push) touches fewer
+//      levels while sifting towards the bottom (Pop, Remove) compares more
+//      children per level. The children of a node are adjacent so for large
+//      heaps, where every level is a cache miss, 4 or 8 is usually faster
+//      than the default binary heap.
 //
 //   Note that the IntrusiveHeap does not hold or own any T objects,
 //   only pointers to them. Users must manage storage on their own.
 template <typename T, typename PtrCompare,
           typename LinkAccess = DefaultIntrusiveHeapLinkAccess<T>,
-          typename Alloc = std::allocator<T*> >
+          typename Alloc = std::allocator<T*>, size_t Arity = 2>
 class IntrusiveHeap {
+  static_assert(Arity >= 2, "IntrusiveHeap requires an arity of at least 2.");
+
  public:
   typedef typename IntrusiveHeapLink::size_type size_type;
   typedef T value_type;
@@ -154,7 +163,7 @@ class IntrusiveHeap {
   void Adjust(pointer t) {
     REVERB_CHECK(Contains(t));
     size_type h = GetPositionOf(t);
-    if (h != 0 && compare()(t, heap()[(h - 1) >> 1])) {
+    if (h != 0 && compare()(t, heap()[Parent(h)])) {
       FixHeapUp(t);
     } else {
       FixHeapDown(t);
@@ -229,10 +238,12 @@ class IntrusiveHeap {
     return link_access().Set(t, IntrusiveHeapLink(pos));
   }
 
+  static size_type Parent(size_type h) { return (h - 1) / Arity; }
+
   void FixHeapUp(pointer t) {
     size_type h = GetPositionOf(t);
     while (h != 0) {
-      size_type parent = (h - 1) >> 1;
+      size_type parent = Parent(h);
       if (compare()(heap()[parent], t)) {
         break;
       }
@@ -247,13 +258,16 @@ class IntrusiveHeap {
   void FixHeapDown(pointer t) {
     size_type h = GetPositionOf(t);
     for (;;) {
-      size_type kid = (h << 1) + 1;
-      if (kid >= heap().size()) {
+      size_type first_kid = h * Arity + 1;
+      if (first_kid >= heap().size()) {
         break;
       }
-      if (kid + 1 < heap().size() &&
-          compare()(heap()[kid + 1], heap()[kid])) {
-        ++kid;
+      size_type last_kid = std::min(first_kid + Arity, heap().size());
+      size_type kid = first_kid;
+      for (size_type i = first_kid + 1; i < last_kid; ++i) {
+        if (compare()(heap()[i], heap()[kid])) {
+          kid = i;
+        }
       }
       if (compare()(t, heap()[kid])) {
         break;
@@ -15,7 +15,9 @@
 #include "reverb/cc/support/intrusive_heap.h"
 
 #include <algorithm>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
@@ -101,6 +103,43 @@ class IntrusiveHeapTest : public testing::Test {
     EXPECT_EQ(0, heap_.size());
     EXPECT_TRUE(heap_.empty());
   }
+
+  // Pushes, adjusts and removes elements of a heap with `Arity` children per
+  // node and verifies that the remaining elements are popped in order.
+  template <size_t Arity>
+  void VerifyHeapWithArity() {
+    IntrusiveHeap<Elem, ElemLess, DefaultIntrusiveHeapLinkAccess<Elem>,
+                  std::allocator<Elem*>, Arity>
+        heap;
+    std::vector<Elem> elems(kNumElems);
+    for (int i = 0; i < kNumElems; i++) {
+      elems[i].val = absl::Uniform<uint32_t>(rnd_);
+      elems[i].iota = i;
+      heap.Push(&elems[i]);
+    }
+    for (int i = 0; i < kNumElems; i += 2) {
+      elems[i].val = absl::Uniform<uint32_t>(rnd_);
+      heap.Adjust(&elems[i]);
+    }
+
+    std::vector<Elem> expected;
+    for (int i = 0; i < kNumElems; i++) {
+      if (i % 3 == 0) {
+        heap.Remove(&elems[i]);
+      } else {
+        expected.push_back(elems[i]);
+      }
+    }
+    std::sort(expected.begin(), expected.end(), ElemValLess());
+
+    ASSERT_EQ(heap.size(), expected.size());
+    for (const Elem& e : expected) {
+      Elem* popped = heap.Pop();
+      EXPECT_EQ(e.iota, popped->iota);
+      EXPECT_EQ(e.val, popped->val);
+    }
+    EXPECT_TRUE(heap.empty());
+  }
 };
 
 TEST_F(IntrusiveHeapTest, PushPop) {
@@ -173,6 +212,12 @@ TEST_F(IntrusiveHeapTest, Adjust) {
   VerifyHeap();
 }
 
+TEST_F(IntrusiveHeapTest, HigherArity) {
+  VerifyHeapWithArity<3>();
+  VerifyHeapWithArity<4>();
+  VerifyHeapWithArity<8>();
+}
+
 TEST_F(IntrusiveHeapTest, EmptyBaseClassOptimization) {
   // EBC optimization reduces size from 32 to 24 bytes.
   // Testing that neither stateless PtrCompare nor stateless
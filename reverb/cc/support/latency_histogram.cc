@@ -0,0 +1,180 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/support/latency_histogram.h"
+
+#include <algorithm>
+#include <cstdint>
+
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+namespace {
+
+// The timed lock which the thread holds most recently acquired, if any.
+thread_local LockTimer* current_lock_timer = nullptr;
+
+// Returns true for about one in `kSamplePeriod` calls. Uses a per thread
+// xorshift generator so that no state is shared between threads.
+bool ShouldTime() {
+  thread_local uint64_t state =
+      reinterpret_cast<uintptr_t>(&state) * 0x9E3779B97F4A7C15ull | 1;
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  return state % AtomicLatencyHistogram::kSamplePeriod == 0;
+}
+
+// Latencies in [0, 4) ns each have their own bucket. Above that, bucket `i`
+// holds the latencies in [2^e + k * 2^(e-2), 2^e + (k + 1) * 2^(e-2)) where
+// `e = i / 4 + 1` and `k = i % 4`.
+int BucketIndex(int64_t ns) {
+  if (ns < 4) return std::max<int64_t>(ns, 0);
+  // Only timed operations are recorded so a loop is cheap enough.
+  int e = 2;
+  while ((ns >> (e + 1)) != 0) e++;
+  int k = (ns >> (e - 2)) & 3;
+  return std::min(4 * (e - 1) + k,
+                  AtomicLatencyHistogram::kNumBuckets - 1);
+}
+
+// Largest latency held by bucket `i`, which must not be the last bucket.
+int64_t BucketUpperBound(int i) {
+  if (i < 4) return i;
+  int e = i / 4 + 1;
+  int k = i % 4;
+  return ((int64_t{5} + k) << (e - 2)) - 1;
+}
+
+void EncodeNanos(int64_t ns, google::protobuf::Duration* proto) {
+  proto->set_seconds(ns / 1000000000);
+  proto->set_nanos(ns % 1000000000);
+}
+
+}  // namespace
+
+AtomicLatencyHistogram::AtomicLatencyHistogram()
+    : count_(0), total_ns_(0), max_ns_(0) {
+  for (auto& bucket : buckets_) {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+}
+
+int64_t AtomicLatencyHistogram::Start() {
+  return ShouldTime() ? absl::GetCurrentTimeNanos() : kNotTimed;
+}
+
+void AtomicLatencyHistogram::Stop(int64_t start_ns) {
+  if (start_ns == kNotTimed) return;
+  RecordNanos(absl::GetCurrentTimeNanos() - start_ns);
+}
+
+void AtomicLatencyHistogram::Record(absl::Duration latency) {
+  RecordNanos(absl::ToInt64Nanoseconds(latency));
+}
+
+void AtomicLatencyHistogram::RecordNanos(int64_t ns) {
+  // The wall clock can go backwards.
+  ns = std::max<int64_t>(ns, 0);
+  buckets_[BucketIndex(ns)].fetch_add(1, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+  total_ns_.fetch_add(ns, std::memory_order_relaxed);
+  int64_t max_ns = max_ns_.load(std::memory_order_relaxed);
+  while (ns > max_ns && !max_ns_.compare_exchange_weak(
+                            max_ns, ns, std::memory_order_relaxed)) {
+  }
+}
+
+void AtomicLatencyHistogram::ToProto(LatencyHistogram* proto) const {
+  ToProto({this}, proto);
+}
+
+void AtomicLatencyHistogram::ToProto(
+    std::initializer_list<const AtomicLatencyHistogram*> histograms,
+    LatencyHistogram* proto) {
+  int64_t count = 0;
+  int64_t total_ns = 0;
+  int64_t max_ns = 0;
+  for (const auto* histogram : histograms) {
+    count += histogram->count_.load(std::memory_order_relaxed);
+    total_ns += histogram->total_ns_.load(std::memory_order_relaxed);
+    max_ns =
+        std::max(max_ns, histogram->max_ns_.load(std::memory_order_relaxed));
+  }
+
+  proto->Clear();
+  proto->set_count(count);
+  EncodeNanos(total_ns, proto->mutable_total());
+  EncodeNanos(max_ns, proto->mutable_max());
+  for (int i = 0; i < kNumBuckets; i++) {
+    int64_t bucket_count = 0;
+    for (const auto* histogram : histograms) {
+      bucket_count += histogram->buckets_[i].load(std::memory_order_relaxed);
+    }
+    if (bucket_count == 0) continue;
+    auto* bucket = proto->add_buckets();
+    // The maximum is read separately from the buckets so the bound of the last
+    // bucket may be slightly off while latencies are being recorded.
+    EncodeNanos(i == kNumBuckets - 1 ? max_ns : BucketUpperBound(i),
+                bucket->mutable_upper_bound());
+    bucket->set_count(bucket_count);
+  }
+}
+
+void LockContentionHistograms::ToProto(LockContention* proto) const {
+  wait.ToProto(proto->mutable_wait());
+  hold.ToProto(proto->mutable_hold());
+  condition_wait.ToProto(proto->mutable_condition_wait());
+}
+
+LockTimer::LockTimer(LockContentionHistograms* histograms)
+    : histograms_(histograms), start_ns_(AtomicLatencyHistogram::Start()) {}
+
+void LockTimer::Acquired() {
+  outer_ = current_lock_timer;
+  current_lock_timer = this;
+  if (start_ns_ == AtomicLatencyHistogram::kNotTimed) return;
+  int64_t now_ns = absl::GetCurrentTimeNanos();
+  histograms_->wait.Record(absl::Nanoseconds(now_ns - start_ns_));
+  start_ns_ = now_ns;
+}
+
+void LockTimer::Released() {
+  current_lock_timer = outer_;
+  if (start_ns_ == AtomicLatencyHistogram::kNotTimed) return;
+  histograms_->hold.Record(absl::Nanoseconds(
+      absl::GetCurrentTimeNanos() - start_ns_ - excluded_ns_));
+}
+
+ScopedExcludeFromLockHold::ScopedExcludeFromLockHold()
+    : timer_(current_lock_timer), start_ns_(AtomicLatencyHistogram::kNotTimed) {
+  if (timer_ != nullptr &&
+      timer_->start_ns_ != AtomicLatencyHistogram::kNotTimed) {
+    start_ns_ = absl::GetCurrentTimeNanos();
+  }
+}
+
+ScopedExcludeFromLockHold::~ScopedExcludeFromLockHold() {
+  if (start_ns_ == AtomicLatencyHistogram::kNotTimed) return;
+  const int64_t excluded_ns = absl::GetCurrentTimeNanos() - start_ns_;
+  timer_->excluded_ns_ += excluded_ns;
+  timer_->histograms_->condition_wait.Record(absl::Nanoseconds(excluded_ns));
+}
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
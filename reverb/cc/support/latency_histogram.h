@@ -0,0 +1,218 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_SUPPORT_LATENCY_HISTOGRAM_H_
+#define REVERB_CC_SUPPORT_LATENCY_HISTOGRAM_H_
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <initializer_list>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "reverb/cc/schema.pb.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+
+// Lock-free histogram of latencies with exponentially growing buckets. Each
+// power of two (in nanoseconds) is split into `kBucketsPerDoubling` buckets.
+//
+// Reading the clock twice per operation is too expensive for the hot paths
+// it instruments, so `Start` only times a random sample of about one in
+// `kSamplePeriod` operations and the histogram describes the timed operations.
+//
+// Usage:
+//
+//   int64_t start = histogram.Start();
+//   ...
+//   histogram.Stop(start);
+//
+// or `ScopedLatencyTimer`. This object is thread-safe.
+class AtomicLatencyHistogram {
+ public:
+  static constexpr int kBucketsPerDoubling = 4;
+
+  // The last bucket holds everything above 2^40 ns (~18 minutes).
+  static constexpr int kNumBuckets = 40 * kBucketsPerDoubling + 1;
+
+  static constexpr int kSamplePeriod = 16;
+
+  // Returned by `Start` when the operation is not timed.
+  static constexpr int64_t kNotTimed = -1;
+
+  AtomicLatencyHistogram();
+
+  // Returns the current time in nanoseconds if the operation should be timed
+  // and `kNotTimed` otherwise. The result must be passed to `Stop`.
+  static int64_t Start();
+
+  // Records the time since `start_ns` unless it is `kNotTimed`.
+  void Stop(int64_t start_ns);
+
+  // Records `latency` regardless of sampling.
+  void Record(absl::Duration latency);
+
+  void ToProto(LatencyHistogram* proto) const;
+
+  // Writes the sum of `histograms` to `proto`.
+  static void ToProto(
+      std::initializer_list<const AtomicLatencyHistogram*> histograms,
+      LatencyHistogram* proto);
+
+  // AtomicLatencyHistogram is neither copyable nor movable.
+  AtomicLatencyHistogram(const AtomicLatencyHistogram&) = delete;
+  AtomicLatencyHistogram& operator=(const AtomicLatencyHistogram&) = delete;
+
+ private:
+  void RecordNanos(int64_t ns);
+
+  std::array<std::atomic<int64_t>, kNumBuckets> buckets_;
+  std::atomic<int64_t> count_;
+  std::atomic<int64_t> total_ns_;
+  std::atomic<int64_t> max_ns_;
+};
+
+// Times the scope it is declared in with `histogram`.
+class ScopedLatencyTimer {
+ public:
+  explicit ScopedLatencyTimer(AtomicLatencyHistogram* histogram)
+      : histogram_(histogram), start_ns_(AtomicLatencyHistogram::Start()) {}
+
+  ~ScopedLatencyTimer() { histogram_->Stop(start_ns_); }
+
+  ScopedLatencyTimer(const ScopedLatencyTimer&) = delete;
+  ScopedLatencyTimer& operator=(const ScopedLatencyTimer&) = delete;
+
+ private:
+  AtomicLatencyHistogram* histogram_;
+  int64_t start_ns_;
+};
+
+// Contention of a lock attributed to one operation (see `LockContention`).
+struct LockContentionHistograms {
+  // Time spent waiting for the lock.
+  AtomicLatencyHistogram wait;
+
+  // Time the lock was held, excluding `condition_wait`.
+  AtomicLatencyHistogram hold;
+
+  // Time spent inside the critical section waiting for a condition, during
+  // which the lock is released (see `ScopedExcludeFromLockHold`).
+  AtomicLatencyHistogram condition_wait;
+
+  void ToProto(LockContention* proto) const;
+};
+
+// Times how long a lock is waited for and held. Used by `TimedMutexLock` and
+// `TimedReaderMutexLock`.
+class LockTimer {
+ public:
+  explicit LockTimer(LockContentionHistograms* histograms);
+
+  // Must be called once the lock has been acquired and released respectively.
+  void Acquired();
+  void Released();
+
+  LockTimer(const LockTimer&) = delete;
+  LockTimer& operator=(const LockTimer&) = delete;
+
+ private:
+  friend class ScopedExcludeFromLockHold;
+
+  LockContentionHistograms* histograms_;
+
+  // When the wait started or the lock was acquired, or `kNotTimed`.
+  int64_t start_ns_;
+
+  // Time to subtract from the hold time (see `ScopedExcludeFromLockHold`).
+  int64_t excluded_ns_ = 0;
+
+  // The timed lock which the thread held when this one was acquired.
+  LockTimer* outer_ = nullptr;
+};
+
+// Excludes its lifetime from the hold time of the innermost timed lock held by
+// the calling thread and records it as `condition_wait` instead. Declared
+// around calls which release the lock while waiting (e.g.
+// `absl::Mutex::Await`). Free unless that lock is being timed.
+class ScopedExcludeFromLockHold {
+ public:
+  ScopedExcludeFromLockHold();
+  ~ScopedExcludeFromLockHold();
+
+  ScopedExcludeFromLockHold(const ScopedExcludeFromLockHold&) = delete;
+  ScopedExcludeFromLockHold& operator=(const ScopedExcludeFromLockHold&) =
+      delete;
+
+ private:
+  LockTimer* timer_;
+  int64_t start_ns_;
+};
+
+// Same as `absl::MutexLock` but records the time spent waiting for and holding
+// `mu` in `histograms` (for a sample of the acquisitions).
+class ABSL_SCOPED_LOCKABLE TimedMutexLock {
+ public:
+  TimedMutexLock(absl::Mutex* mu, LockContentionHistograms* histograms)
+      ABSL_EXCLUSIVE_LOCK_FUNCTION(mu)
+      : mu_(mu), timer_(histograms) {
+    mu_->Lock();
+    timer_.Acquired();
+  }
+
+  ~TimedMutexLock() ABSL_UNLOCK_FUNCTION() {
+    timer_.Released();
+    mu_->Unlock();
+  }
+
+  TimedMutexLock(const TimedMutexLock&) = delete;
+  TimedMutexLock& operator=(const TimedMutexLock&) = delete;
+
+ private:
+  absl::Mutex* const mu_;
+  LockTimer timer_;
+};
+
+// Same as `TimedMutexLock` but acquires `mu` in shared mode.
+class ABSL_SCOPED_LOCKABLE TimedReaderMutexLock {
+ public:
+  TimedReaderMutexLock(absl::Mutex* mu, LockContentionHistograms* histograms)
+      ABSL_SHARED_LOCK_FUNCTION(mu)
+      : mu_(mu), timer_(histograms) {
+    mu_->ReaderLock();
+    timer_.Acquired();
+  }
+
+  ~TimedReaderMutexLock() ABSL_UNLOCK_FUNCTION() {
+    timer_.Released();
+    mu_->ReaderUnlock();
+  }
+
+  TimedReaderMutexLock(const TimedReaderMutexLock&) = delete;
+  TimedReaderMutexLock& operator=(const TimedReaderMutexLock&) = delete;
+
+ private:
+  absl::Mutex* const mu_;
+  LockTimer timer_;
+};
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_SUPPORT_LATENCY_HISTOGRAM_H_
@@ -0,0 +1,184 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/support/latency_histogram.h"
+
+#include <cstdint>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "reverb/cc/schema.pb.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+namespace {
+
+absl::Duration Decode(const google::protobuf::Duration& proto) {
+  return absl::Seconds(proto.seconds()) + absl::Nanoseconds(proto.nanos());
+}
+
+TEST(AtomicLatencyHistogramTest, EmptyHistogram) {
+  AtomicLatencyHistogram histogram;
+  LatencyHistogram proto;
+  histogram.ToProto(&proto);
+  EXPECT_EQ(proto.count(), 0);
+  EXPECT_EQ(Decode(proto.total()), absl::ZeroDuration());
+  EXPECT_EQ(proto.buckets_size(), 0);
+}
+
+TEST(AtomicLatencyHistogramTest, BucketsHoldRecordedLatencies) {
+  AtomicLatencyHistogram histogram;
+  histogram.Record(absl::Nanoseconds(2));
+  histogram.Record(absl::Microseconds(10));
+  histogram.Record(absl::Microseconds(10));
+  histogram.Record(absl::Seconds(1));
+
+  LatencyHistogram proto;
+  histogram.ToProto(&proto);
+  EXPECT_EQ(proto.count(), 4);
+  EXPECT_EQ(Decode(proto.total()),
+            absl::Seconds(1) + absl::Microseconds(20) + absl::Nanoseconds(2));
+  EXPECT_EQ(Decode(proto.max()), absl::Seconds(1));
+
+  ASSERT_EQ(proto.buckets_size(), 3);
+  EXPECT_EQ(Decode(proto.buckets(0).upper_bound()), absl::Nanoseconds(2));
+  EXPECT_EQ(proto.buckets(0).count(), 1);
+
+  // Buckets are at most 25% wider than the values they hold.
+  for (int i = 1; i < 3; i++) {
+    absl::Duration value = i == 1 ? absl::Microseconds(10) : absl::Seconds(1);
+    EXPECT_GE(Decode(proto.buckets(i).upper_bound()), value);
+    EXPECT_LE(Decode(proto.buckets(i).upper_bound()), value * 1.25);
+  }
+  EXPECT_EQ(proto.buckets(1).count(), 2);
+  EXPECT_EQ(proto.buckets(2).count(), 1);
+}
+
+TEST(AtomicLatencyHistogramTest, ClampsNegativeAndHugeLatencies) {
+  AtomicLatencyHistogram histogram;
+  histogram.Record(absl::Nanoseconds(-5));
+  histogram.Record(absl::Hours(24));
+
+  LatencyHistogram proto;
+  histogram.ToProto(&proto);
+  ASSERT_EQ(proto.buckets_size(), 2);
+  EXPECT_EQ(Decode(proto.buckets(0).upper_bound()), absl::ZeroDuration());
+  EXPECT_EQ(Decode(proto.buckets(1).upper_bound()), absl::Hours(24));
+}
+
+TEST(AtomicLatencyHistogramTest, StartSamplesOperations) {
+  AtomicLatencyHistogram histogram;
+  constexpr int kOperations = 16000;
+  for (int i = 0; i < kOperations; i++) {
+    histogram.Stop(AtomicLatencyHistogram::Start());
+  }
+
+  LatencyHistogram proto;
+  histogram.ToProto(&proto);
+  const int expected = kOperations / AtomicLatencyHistogram::kSamplePeriod;
+  EXPECT_GT(proto.count(), expected / 2);
+  EXPECT_LT(proto.count(), expected * 2);
+}
+
+TEST(AtomicLatencyHistogramTest, IsThreadSafe) {
+  AtomicLatencyHistogram histogram;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; i++) {
+    threads.emplace_back([&histogram] {
+      for (int j = 0; j < 1000; j++) {
+        histogram.Record(absl::Microseconds(j));
+      }
+    });
+  }
+  for (auto& thread : threads) thread.join();
+
+  LatencyHistogram proto;
+  histogram.ToProto(&proto);
+  EXPECT_EQ(proto.count(), 8000);
+  EXPECT_EQ(Decode(proto.max()), absl::Microseconds(999));
+
+  int64_t total = 0;
+  for (const auto& bucket : proto.buckets()) total += bucket.count();
+  EXPECT_EQ(total, 8000);
+}
+
+TEST(AtomicLatencyHistogramTest, MergesHistograms) {
+  AtomicLatencyHistogram a;
+  AtomicLatencyHistogram b;
+  a.Record(absl::Microseconds(10));
+  b.Record(absl::Microseconds(10));
+  b.Record(absl::Seconds(1));
+
+  LatencyHistogram proto;
+  AtomicLatencyHistogram::ToProto({&a, &b}, &proto);
+  EXPECT_EQ(proto.count(), 3);
+  EXPECT_EQ(Decode(proto.total()), absl::Seconds(1) + absl::Microseconds(20));
+  EXPECT_EQ(Decode(proto.max()), absl::Seconds(1));
+  ASSERT_EQ(proto.buckets_size(), 2);
+  EXPECT_EQ(proto.buckets(0).count(), 2);
+  EXPECT_EQ(proto.buckets(1).count(), 1);
+}
+
+TEST(TimedMutexLockTest, ExcludesConditionWaitFromHold) {
+  absl::Mutex mu;
+  LockContentionHistograms histograms;
+
+  // Acquire the lock until it has been timed a few times.
+  LockContention proto;
+  while (proto.hold().count() < 3) {
+    TimedMutexLock lock(&mu, &histograms);
+    {
+      ScopedExcludeFromLockHold exclude;
+      absl::SleepFor(absl::Milliseconds(1));
+    }
+    histograms.ToProto(&proto);
+  }
+  histograms.ToProto(&proto);
+  EXPECT_LT(Decode(proto.hold().max()), absl::Milliseconds(1));
+  EXPECT_GE(proto.wait().count(), 3);
+  EXPECT_EQ(proto.condition_wait().count(), proto.hold().count());
+  EXPECT_GE(Decode(proto.condition_wait().total()),
+            absl::Milliseconds(proto.condition_wait().count()));
+}
+
+TEST(TimedMutexLockTest, AttributesToInnermostLock) {
+  absl::Mutex outer_mu;
+  absl::Mutex inner_mu;
+  LockContentionHistograms outer;
+  LockContentionHistograms inner;
+
+  for (int i = 0; i < 1000; i++) {
+    TimedMutexLock outer_lock(&outer_mu, &outer);
+    TimedReaderMutexLock inner_lock(&inner_mu, &inner);
+    ScopedExcludeFromLockHold exclude;
+  }
+
+  LockContention proto;
+  outer.ToProto(&proto);
+  EXPECT_GT(proto.hold().count(), 0);
+  EXPECT_EQ(proto.condition_wait().count(), 0);
+  inner.ToProto(&proto);
+  EXPECT_GT(proto.hold().count(), 0);
+  EXPECT_EQ(proto.condition_wait().count(), proto.hold().count());
+}
+
+}  // namespace
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
@@ -0,0 +1,363 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_SUPPORT_LOCK_FREE_QUEUE_H_
+#define REVERB_CC_SUPPORT_LOCK_FREE_QUEUE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+#include "reverb/cc/platform/logging.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+
+// Blocks threads until a condition, which is changed without holding any
+// lock, becomes true. Waiting threads first spin on the condition for a short
+// while and only then park on a condition variable. This keeps the handoff
+// latency low when the other side of a queue is active while not burning a
+// core when it is idle.
+//
+// Threads which change the state observed by the condition must call `Notify`
+// afterwards. `Notify` is cheap when no thread is parked.
+class SpinThenParkWaiter {
+ public:
+  // Number of times the condition is evaluated before the thread is parked.
+  // Spinning is skipped on machines with a single core since the thread which
+  // would change the condition cannot make progress while this one spins.
+  static constexpr int kSpinIterations = 2000;
+
+  // Blocks until `ready()` returns true. `ready` may be called any number of
+  // times (including while `mu_` is held) and must therefore be cheap and not
+  // block.
+  template <typename Fn>
+  void Wait(Fn ready) ABSL_LOCKS_EXCLUDED(mu_) {
+    static const int num_spins =
+        std::thread::hardware_concurrency() > 1 ? kSpinIterations : 1;
+    for (int i = 0; i < num_spins; i++) {
+      if (ready()) return;
+      CpuRelax();
+    }
+
+    absl::MutexLock lock(&mu_);
+    // All updates of `num_parked_` are read-modify-writes and thus totally
+    // ordered. Either `Notify` observes the parked thread or this thread
+    // observes the state change made before `Notify` was called.
+    num_parked_.fetch_add(1, std::memory_order_acq_rel);
+    while (!ready()) {
+      cv_.Wait(&mu_);
+    }
+    num_parked_.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  // Wakes up all parked threads so they reevaluate their conditions.
+  void Notify() ABSL_LOCKS_EXCLUDED(mu_) {
+    if (num_parked_.fetch_add(0, std::memory_order_acq_rel) == 0) return;
+    absl::MutexLock lock(&mu_);
+    cv_.SignalAll();
+  }
+
+ private:
+  static void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield" ::: "memory");
+#endif
+  }
+
+  absl::Mutex mu_;
+  absl::CondVar cv_;
+  std::atomic<int> num_parked_{0};
+};
+
+// Lock-free alternative to `Queue` for exactly one producer and one consumer
+// thread. The behavior of `Push`, `Pop`, `Close`, `SetLastItemPushed` and
+// `size` is the same as for `Queue`. `Close` may be called from any thread.
+template <typename T>
+class SpscQueue {
+ public:
+  // `capacity` is the maximum number of elements which the queue can hold.
+  explicit SpscQueue(int capacity) : buffer_(capacity) {
+    REVERB_CHECK_GT(capacity, 0);
+  }
+
+  // Closes the queue. All pending and future calls to `Push()` and `Pop()` are
+  // unblocked and return false without performing the operation.
+  void Close() {
+    closed_.store(true, std::memory_order_release);
+    not_empty_.Notify();
+    not_full_.Notify();
+  }
+
+  // Pushes an item to the queue. Blocks if the queue has reached `capacity`. On
+  // success, `true` is returned. If the queue is closed, `false` is returned.
+  //
+  // Must only be called by the producer thread.
+  bool Push(T x) {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    not_full_.Wait([this, tail] {
+      return IsClosedForPush() ||
+             tail - head_.load(std::memory_order_acquire) < buffer_.size();
+    });
+    if (IsClosedForPush()) return false;
+    buffer_[tail % buffer_.size()] = std::move(x);
+    tail_.store(tail + 1, std::memory_order_release);
+    not_empty_.Notify();
+    return true;
+  }
+
+  // Marks that no more items will be pushed to the queue. Must only be called
+  // by the producer thread.
+  void SetLastItemPushed() {
+    last_item_pushed_.store(true, std::memory_order_release);
+    not_empty_.Notify();
+    not_full_.Notify();
+  }
+
+  // Removes an element from the queue and move-assigns it to *item. Blocks if
+  // the queue is empty. On success, `true` is returned. If the queue was
+  // closed, `false` is returned.
+  //
+  // If called after `SetLastItemPushed` and the final item of the queue is
+  // returned then queue is closed.
+  //
+  // Must only be called by the consumer thread.
+  bool Pop(T* item) {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    not_empty_.Wait([this, head] {
+      return closed_.load(std::memory_order_acquire) ||
+             last_item_pushed_.load(std::memory_order_acquire) ||
+             tail_.load(std::memory_order_acquire) != head;
+    });
+    if (closed_.load(std::memory_order_acquire)) return false;
+
+    // The tail can no longer change once the last item has been pushed so it
+    // must be loaded after the flag.
+    const bool last_item_pushed =
+        last_item_pushed_.load(std::memory_order_acquire);
+    const size_t tail = tail_.load(std::memory_order_acquire);
+    if (tail == head) {
+      REVERB_CHECK(last_item_pushed);
+      Close();
+      return false;
+    }
+
+    *item = std::move(buffer_[head % buffer_.size()]);
+    head_.store(head + 1, std::memory_order_release);
+    if (last_item_pushed && head + 1 == tail) {
+      Close();
+    } else {
+      not_full_.Notify();
+    }
+    return true;
+  }
+
+  // Current number of elements.
+  int size() const {
+    const size_t head = head_.load(std::memory_order_acquire);
+    return tail_.load(std::memory_order_acquire) - head;
+  }
+
+ private:
+  bool IsClosedForPush() const {
+    return closed_.load(std::memory_order_acquire) ||
+           last_item_pushed_.load(std::memory_order_acquire);
+  }
+
+  // Circular buffer. Initialized with fixed size `capacity`.
+  std::vector<T> buffer_;
+
+  // Number of items popped and pushed since the queue was created. The indices
+  // are only written by the consumer and producer respectively and are kept on
+  // separate cache lines to avoid false sharing.
+  alignas(64) std::atomic<size_t> head_{0};
+  alignas(64) std::atomic<size_t> tail_{0};
+
+  alignas(64) std::atomic<bool> closed_{false};
+  std::atomic<bool> last_item_pushed_{false};
+
+  // Waited on by the consumer and producer respectively.
+  SpinThenParkWaiter not_empty_;
+  SpinThenParkWaiter not_full_;
+};
+
+// Lock-free alternative to `Queue` for any number of producer and consumer
+// threads. It is a bounded queue where every slot carries a sequence number
+// which tells producers and consumers whether the slot is ready to be written
+// or read (D. Vyukov's bounded MPMC queue).
+//
+// The behavior of `Push`, `Pop`, `Close`, `SetLastItemPushed` and `size` is
+// the same as for `Queue`, with the difference that `SetLastItemPushed` must
+// only be called once all calls to `Push` have returned.
+template <typename T>
+class MpmcQueue {
+ public:
+  // `capacity` is the maximum number of elements which the queue can hold.
+  explicit MpmcQueue(int capacity)
+      : capacity_(capacity), slots_(new Slot[capacity]) {
+    REVERB_CHECK_GT(capacity, 0);
+  }
+
+  // Closes the queue. All pending and future calls to `Push()` and `Pop()` are
+  // unblocked and return false without performing the operation.
+  void Close() {
+    closed_.store(true, std::memory_order_release);
+    not_empty_.Notify();
+    not_full_.Notify();
+  }
+
+  // Pushes an item to the queue. Blocks if the queue has reached `capacity`. On
+  // success, `true` is returned. If the queue is closed, `false` is returned.
+  bool Push(T x) {
+    bool pushed = false;
+    not_full_.Wait([this, &x, &pushed] {
+      return IsClosedForPush() || (pushed = TryPush(&x));
+    });
+    if (!pushed) return false;
+    not_empty_.Notify();
+    return true;
+  }
+
+  // Marks that no more items will be pushed to the queue.
+  void SetLastItemPushed() {
+    last_item_pushed_.store(true, std::memory_order_release);
+    if (size() == 0) {
+      Close();
+    } else {
+      not_empty_.Notify();
+      not_full_.Notify();
+    }
+  }
+
+  // Removes an element from the queue and move-assigns it to *item. Blocks if
+  // the queue is empty. On success, `true` is returned. If the queue was
+  // closed, `false` is returned.
+  //
+  // If called after `SetLastItemPushed` and the final item of the queue is
+  // returned then queue is closed.
+  bool Pop(T* item) {
+    bool popped = false;
+    not_empty_.Wait([this, item, &popped] {
+      return closed_.load(std::memory_order_acquire) ||
+             (popped = TryPop(item)) ||
+             (last_item_pushed_.load(std::memory_order_acquire) &&
+              size() == 0);
+    });
+    if (!popped) {
+      if (!closed_.load(std::memory_order_acquire)) Close();
+      return false;
+    }
+    if (last_item_pushed_.load(std::memory_order_acquire) && size() == 0) {
+      Close();
+    } else {
+      not_full_.Notify();
+    }
+    return true;
+  }
+
+  // Current number of elements. Pushes and pops which are in progress are
+  // counted as completed.
+  int size() const {
+    const size_t dequeue = dequeue_pos_.load(std::memory_order_acquire);
+    const size_t enqueue = enqueue_pos_.load(std::memory_order_acquire);
+    return enqueue > dequeue ? enqueue - dequeue : 0;
+  }
+
+ private:
+  struct Slot {
+    // Every slot is used by the pushes and pops at positions `pos` where
+    // `pos % capacity_` is the slot index. For the `n`th of these, the
+    // sequence is `2 * n` while the slot is ready to be written and
+    // `2 * n + 1` while it holds the pushed value.
+    std::atomic<size_t> sequence{0};
+    T value;
+  };
+
+  bool IsClosedForPush() const {
+    return closed_.load(std::memory_order_acquire) ||
+           last_item_pushed_.load(std::memory_order_acquire);
+  }
+
+  // Moves `*x` into the queue unless it is full. Returns true on success.
+  bool TryPush(T* x) {
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    while (true) {
+      Slot& slot = slots_[pos % capacity_];
+      const size_t turn = 2 * (pos / capacity_);
+      const size_t sequence = slot.sequence.load(std::memory_order_acquire);
+      if (sequence == turn) {
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+          slot.value = std::move(*x);
+          slot.sequence.store(turn + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (sequence < turn) {
+        return false;  // The slot has not been consumed yet: full.
+      } else {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Moves the oldest item of the queue into `*item` unless it is empty.
+  // Returns true on success.
+  bool TryPop(T* item) {
+    size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+    while (true) {
+      Slot& slot = slots_[pos % capacity_];
+      const size_t turn = 2 * (pos / capacity_);
+      const size_t sequence = slot.sequence.load(std::memory_order_acquire);
+      if (sequence == turn + 1) {
+        if (dequeue_pos_.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+          *item = std::move(slot.value);
+          slot.sequence.store(turn + 2, std::memory_order_release);
+          return true;
+        }
+      } else if (sequence < turn + 1) {
+        return false;  // The slot has not been produced yet: empty.
+      } else {
+        pos = dequeue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  const size_t capacity_;
+  std::unique_ptr<Slot[]> slots_;
+
+  alignas(64) std::atomic<size_t> enqueue_pos_{0};
+  alignas(64) std::atomic<size_t> dequeue_pos_{0};
+
+  alignas(64) std::atomic<bool> closed_{false};
+  std::atomic<bool> last_item_pushed_{false};
+
+  // Waited on by consumers and producers respectively.
+  SpinThenParkWaiter not_empty_;
+  SpinThenParkWaiter not_full_;
+};
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_SUPPORT_LOCK_FREE_QUEUE_H_
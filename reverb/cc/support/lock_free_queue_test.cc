@@ -0,0 +1,220 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/support/lock_free_queue.h"
+
+#include <algorithm>
+#include <memory>
+#include <numeric>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/synchronization/notification.h"
+#include "reverb/cc/platform/logging.h"
+#include "reverb/cc/platform/thread.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+namespace {
+
+template <typename Q>
+class LockFreeQueueTest : public ::testing::Test {};
+
+using QueueTypes = ::testing::Types<SpscQueue<int>, MpmcQueue<int>>;
+TYPED_TEST_SUITE(LockFreeQueueTest, QueueTypes);
+
+TYPED_TEST(LockFreeQueueTest, PushAndPopAreConsistent) {
+  TypeParam q(10);
+  int output;
+  for (int i = 0; i < 100; i++) {
+    ASSERT_TRUE(q.Push(i));
+    ASSERT_TRUE(q.Pop(&output));
+    EXPECT_EQ(output, i);
+  }
+}
+
+TYPED_TEST(LockFreeQueueTest, PushBlocksWhenFull) {
+  TypeParam q(2);
+  ASSERT_TRUE(q.Push(1));
+  ASSERT_TRUE(q.Push(2));
+  absl::Notification n;
+  auto t = StartThread("", [&q, &n] {
+    REVERB_CHECK(q.Push(3));
+    n.Notify();
+  });
+  ASSERT_FALSE(n.HasBeenNotified());
+  int output;
+  ASSERT_TRUE(q.Pop(&output));
+  n.WaitForNotification();
+  EXPECT_EQ(output, 1);
+}
+
+TYPED_TEST(LockFreeQueueTest, PopBlocksWhenEmpty) {
+  TypeParam q(2);
+  absl::Notification n;
+  int output;
+  auto t = StartThread("", [&q, &n, &output] {
+    REVERB_CHECK(q.Pop(&output));
+    n.Notify();
+  });
+  ASSERT_FALSE(n.HasBeenNotified());
+  ASSERT_TRUE(q.Push(1));
+  n.WaitForNotification();
+  EXPECT_EQ(output, 1);
+}
+
+TYPED_TEST(LockFreeQueueTest, AfterClosePushAndPopReturnFalse) {
+  TypeParam q(2);
+  q.Close();
+  EXPECT_FALSE(q.Push(1));
+  EXPECT_FALSE(q.Pop(nullptr));
+}
+
+TYPED_TEST(LockFreeQueueTest, CloseUnblocksPush) {
+  TypeParam q(1);
+  ASSERT_TRUE(q.Push(1));
+  absl::Notification n;
+  bool ok;
+  auto t = StartThread("", [&q, &n, &ok] {
+    ok = q.Push(2);
+    n.Notify();
+  });
+  ASSERT_FALSE(n.HasBeenNotified());
+  q.Close();
+  n.WaitForNotification();
+  EXPECT_FALSE(ok);
+}
+
+TYPED_TEST(LockFreeQueueTest, CloseUnblocksPop) {
+  TypeParam q(2);
+  absl::Notification n;
+  bool ok;
+  auto t = StartThread("", [&q, &n, &ok] {
+    int output;
+    ok = q.Pop(&output);
+    n.Notify();
+  });
+  ASSERT_FALSE(n.HasBeenNotified());
+  q.Close();
+  n.WaitForNotification();
+  EXPECT_FALSE(ok);
+}
+
+TYPED_TEST(LockFreeQueueTest, SizeReturnsNumberOfElements) {
+  TypeParam q(3);
+  EXPECT_EQ(q.size(), 0);
+
+  q.Push(20);
+  q.Push(30);
+  EXPECT_EQ(q.size(), 2);
+
+  int v;
+  ASSERT_TRUE(q.Pop(&v));
+  EXPECT_EQ(q.size(), 1);
+}
+
+TYPED_TEST(LockFreeQueueTest, ExistingItemsCanBePoppedAfterSetLastItemPushed) {
+  TypeParam q(3);
+  q.Push(1);
+  q.Push(2);
+  q.SetLastItemPushed();
+  EXPECT_FALSE(q.Push(3));
+
+  int v;
+  ASSERT_TRUE(q.Pop(&v));
+  EXPECT_EQ(v, 1);
+  ASSERT_TRUE(q.Pop(&v));
+  EXPECT_EQ(v, 2);
+
+  // Queue is now empty and no items can be pushed so it is effectively closed.
+  EXPECT_FALSE(q.Pop(&v));
+}
+
+TYPED_TEST(LockFreeQueueTest, BlockingPopReturnsIfSetLastItemPushedCalled) {
+  TypeParam q(2);
+  absl::Notification n;
+  bool ok;
+  auto t = StartThread("", [&q, &n, &ok] {
+    int output;
+    ok = q.Pop(&output);
+    n.Notify();
+  });
+  ASSERT_FALSE(n.HasBeenNotified());
+  q.SetLastItemPushed();
+  n.WaitForNotification();
+  EXPECT_FALSE(ok);
+}
+
+TYPED_TEST(LockFreeQueueTest, TransfersAllItemsBetweenThreads) {
+  constexpr int kNumItems = 10000;
+  TypeParam q(2);
+  auto t = StartThread("", [&q] {
+    for (int i = 0; i < kNumItems; i++) {
+      REVERB_CHECK(q.Push(i));
+    }
+    q.SetLastItemPushed();
+  });
+
+  int v;
+  for (int i = 0; i < kNumItems; i++) {
+    ASSERT_TRUE(q.Pop(&v));
+    ASSERT_EQ(v, i);
+  }
+  EXPECT_FALSE(q.Pop(&v));
+}
+
+TEST(MpmcQueueTest, TransfersAllItemsBetweenManyThreads) {
+  constexpr int kNumThreads = 4;
+  constexpr int kItemsPerThread = 10000;
+  MpmcQueue<int> q(8);
+
+  std::vector<std::unique_ptr<Thread>> producers;
+  for (int i = 0; i < kNumThreads; i++) {
+    producers.push_back(StartThread("", [&q, i] {
+      for (int j = 0; j < kItemsPerThread; j++) {
+        REVERB_CHECK(q.Push(i * kItemsPerThread + j));
+      }
+    }));
+  }
+
+  absl::Mutex mu;
+  std::vector<int> popped;
+  std::vector<std::unique_ptr<Thread>> consumers;
+  for (int i = 0; i < kNumThreads; i++) {
+    consumers.push_back(StartThread("", [&q, &mu, &popped] {
+      int v;
+      while (q.Pop(&v)) {
+        absl::MutexLock lock(&mu);
+        popped.push_back(v);
+      }
+    }));
+  }
+
+  producers.clear();  // Joins the threads.
+  q.SetLastItemPushed();
+  consumers.clear();
+
+  std::sort(popped.begin(), popped.end());
+  std::vector<int> want(kNumThreads * kItemsPerThread);
+  std::iota(want.begin(), want.end(), 0);
+  EXPECT_EQ(popped, want);
+}
+
+}  // namespace
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
@@ -0,0 +1,92 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_SUPPORT_LRU_CACHE_H_
+#define REVERB_CC_SUPPORT_LRU_CACHE_H_
+
+#include <cstdint>
+#include <list>
+#include <utility>
+
+#include "reverb/cc/platform/hash_map.h"
+#include "reverb/cc/platform/logging.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+
+// Fixed capacity map which evicts the least recently used entry when full.
+//
+// The eviction order only depends on the sequence of `Get` and `Put` calls so
+// two caches with the same capacity that see the same sequence of calls hold
+// the same keys. `SampleStream` relies on this to keep the chunk cache of the
+// client and the server side view of it in sync without any acknowledgements.
+//
+// This object is not thread-safe.
+template <typename K, typename V>
+class LruCache {
+ public:
+  explicit LruCache(int64_t capacity) : capacity_(capacity) {
+    REVERB_CHECK_GE(capacity_, 0);
+  }
+
+  // Returns the value of `key` and marks it as the most recently used entry, or
+  // nullptr if `key` is not in the cache. The pointer is valid until the entry
+  // is evicted.
+  V* Get(const K& key) {
+    auto it = index_.find(key);
+    if (it == index_.end()) return nullptr;
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return &it->second->second;
+  }
+
+  // Inserts (or replaces) `key` as the most recently used entry. If the cache
+  // is full then the least recently used entry is evicted. Nothing is inserted
+  // if the capacity is 0.
+  void Put(const K& key, V value) {
+    if (capacity_ == 0) return;
+    if (V* existing = Get(key)) {
+      *existing = std::move(value);
+      return;
+    }
+    if (entries_.size() == capacity_) {
+      index_.erase(entries_.back().first);
+      entries_.pop_back();
+    }
+    entries_.emplace_front(key, std::move(value));
+    index_[key] = entries_.begin();
+  }
+
+  // True if `key` is in the cache. Does not affect the eviction order.
+  bool contains(const K& key) const { return index_.contains(key); }
+
+  int64_t size() const { return entries_.size(); }
+
+  int64_t capacity() const { return capacity_; }
+
+ private:
+  const int64_t capacity_;
+
+  // Entries ordered from the most to the least recently used.
+  std::list<std::pair<K, V>> entries_;
+
+  // Position of every key in `entries_`.
+  flat_hash_map<K, typename std::list<std::pair<K, V>>::iterator> index_;
+};
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_SUPPORT_LRU_CACHE_H_
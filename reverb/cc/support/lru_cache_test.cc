@@ -0,0 +1,76 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/support/lru_cache.h"
+
+#include <string>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+namespace {
+
+TEST(LruCacheTest, GetReturnsNullptrForMissingKey) {
+  LruCache<int, std::string> cache(2);
+  EXPECT_EQ(cache.Get(1), nullptr);
+}
+
+TEST(LruCacheTest, PutAndGet) {
+  LruCache<int, std::string> cache(2);
+  cache.Put(1, "a");
+  cache.Put(2, "b");
+  ASSERT_NE(cache.Get(1), nullptr);
+  EXPECT_EQ(*cache.Get(1), "a");
+  ASSERT_NE(cache.Get(2), nullptr);
+  EXPECT_EQ(*cache.Get(2), "b");
+  EXPECT_EQ(cache.size(), 2);
+}
+
+TEST(LruCacheTest, PutReplacesExistingValue) {
+  LruCache<int, std::string> cache(2);
+  cache.Put(1, "a");
+  cache.Put(1, "b");
+  EXPECT_EQ(cache.size(), 1);
+  EXPECT_EQ(*cache.Get(1), "b");
+}
+
+TEST(LruCacheTest, EvictsLeastRecentlyUsed) {
+  LruCache<int, std::string> cache(2);
+  cache.Put(1, "a");
+  cache.Put(2, "b");
+
+  // Touching 1 makes 2 the least recently used entry.
+  EXPECT_NE(cache.Get(1), nullptr);
+  cache.Put(3, "c");
+
+  EXPECT_TRUE(cache.contains(1));
+  EXPECT_FALSE(cache.contains(2));
+  EXPECT_TRUE(cache.contains(3));
+  EXPECT_EQ(cache.size(), 2);
+}
+
+TEST(LruCacheTest, ZeroCapacityHoldsNothing) {
+  LruCache<int, std::string> cache(0);
+  cache.Put(1, "a");
+  EXPECT_EQ(cache.size(), 0);
+  EXPECT_EQ(cache.Get(1), nullptr);
+}
+
+}  // namespace
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
@@ -0,0 +1,212 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/support/mapped_chunk_file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <utility>
+
+#include "absl/strings/str_cat.h"
+#include "reverb/cc/platform/logging.h"
+#include "reverb/cc/platform/status_macros.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+namespace {
+
+constexpr char kMagic[] = "RVBCHNK1";
+constexpr int64_t kMagicSize = sizeof(kMagic) - 1;
+constexpr int64_t kIntSize = sizeof(uint64_t);
+constexpr int64_t kEntrySize = 6 * kIntSize;
+constexpr int64_t kFooterSize = 2 * kIntSize + kMagicSize;
+
+absl::Status ErrnoError(absl::string_view what, absl::string_view path) {
+  return absl::InternalError(absl::StrCat(what, " failed for chunk file ", path,
+                                          ": ", std::strerror(errno)));
+}
+
+void AppendInt(uint64_t value, std::string* out) {
+  out->append(reinterpret_cast<const char*>(&value), kIntSize);
+}
+
+uint64_t ReadInt(const char* data) {
+  uint64_t value;
+  std::memcpy(&value, data, kIntSize);
+  return value;
+}
+
+}  // namespace
+
+MappedChunkFile::Writer::Writer(std::string path, int fd)
+    : path_(std::move(path)), fd_(fd) {}
+
+MappedChunkFile::Writer::~Writer() {
+  if (fd_ >= 0) close(fd_);
+}
+
+absl::Status MappedChunkFile::Writer::Create(const std::string& path,
+                                             std::unique_ptr<Writer>* writer) {
+  int fd = open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+  if (fd < 0) return ErrnoError("open", path);
+  std::unique_ptr<Writer> new_writer(new Writer(path, fd));
+  REVERB_RETURN_IF_ERROR(
+      new_writer->Write(absl::string_view(kMagic, kMagicSize)));
+  *writer = std::move(new_writer);
+  return absl::OkStatus();
+}
+
+absl::Status MappedChunkFile::Writer::Append(const Entry& entry,
+                                             absl::string_view payload) {
+  REVERB_RETURN_IF_ERROR(Pad(kIntSize));
+  std::string length;
+  AppendInt(payload.size(), &length);
+  REVERB_RETURN_IF_ERROR(Write(length));
+
+  entries_.push_back(entry);
+  entries_.back().offset = size_;
+  entries_.back().length = payload.size();
+  return Write(payload);
+}
+
+absl::Status MappedChunkFile::Writer::Close() {
+  REVERB_RETURN_IF_ERROR(Pad(0));
+  const int64_t index_offset = size_;
+
+  std::string index;
+  index.reserve(entries_.size() * kEntrySize + kFooterSize);
+  for (const Entry& entry : entries_) {
+    AppendInt(entry.key, &index);
+    AppendInt(entry.episode_id, &index);
+    AppendInt(entry.num_rows, &index);
+    AppendInt(entry.num_columns, &index);
+    AppendInt(entry.offset, &index);
+    AppendInt(entry.length, &index);
+  }
+  AppendInt(entries_.size(), &index);
+  AppendInt(index_offset, &index);
+  index.append(kMagic, kMagicSize);
+  REVERB_RETURN_IF_ERROR(Write(index));
+
+  const int fd = fd_;
+  fd_ = -1;
+  if (close(fd) != 0) return ErrnoError("close", path_);
+  return absl::OkStatus();
+}
+
+absl::Status MappedChunkFile::Writer::Pad(int64_t reserve) {
+  const int64_t padding =
+      (kAlignment - (size_ + reserve) % kAlignment) % kAlignment;
+  return Write(std::string(padding, '\0'));
+}
+
+absl::Status MappedChunkFile::Writer::Write(absl::string_view data) {
+  int64_t written = 0;
+  while (written < data.size()) {
+    ssize_t n = write(fd_, data.data() + written, data.size() - written);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return ErrnoError("write", path_);
+    written += n;
+  }
+  size_ += data.size();
+  return absl::OkStatus();
+}
+
+absl::Status MappedChunkFile::Open(
+    const std::string& path, std::shared_ptr<const MappedChunkFile>* file) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return ErrnoError("open", path);
+
+  struct stat info;
+  if (fstat(fd, &info) != 0) {
+    absl::Status status = ErrnoError("fstat", path);
+    close(fd);
+    return status;
+  }
+  const int64_t size = info.st_size;
+  if (size < kMagicSize + kFooterSize) {
+    close(fd);
+    return absl::DataLossError(
+        absl::StrCat("Chunk file ", path, " is truncated."));
+  }
+
+  // The mapping remains valid after the file has been closed.
+  void* mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  absl::Status status =
+      mapping == MAP_FAILED ? ErrnoError("mmap", path) : absl::OkStatus();
+  close(fd);
+  REVERB_RETURN_IF_ERROR(status);
+  const char* data = static_cast<const char*>(mapping);
+
+  const char* footer = data + size - kFooterSize;
+  const int64_t num_entries = ReadInt(footer);
+  const int64_t index_offset = ReadInt(footer + kIntSize);
+  if (std::memcmp(data, kMagic, kMagicSize) != 0 ||
+      std::memcmp(footer + 2 * kIntSize, kMagic, kMagicSize) != 0 ||
+      index_offset < 0 || index_offset > size - kFooterSize ||
+      num_entries != (size - kFooterSize - index_offset) / kEntrySize) {
+    munmap(mapping, size);
+    return absl::DataLossError(
+        absl::StrCat("Chunk file ", path, " is corrupt or incomplete."));
+  }
+
+  std::vector<Entry> entries(num_entries);
+  for (int64_t i = 0; i < num_entries; i++) {
+    const char* entry = data + index_offset + i * kEntrySize;
+    entries[i].key = ReadInt(entry);
+    entries[i].episode_id = ReadInt(entry + kIntSize);
+    entries[i].num_rows = ReadInt(entry + 2 * kIntSize);
+    entries[i].num_columns = ReadInt(entry + 3 * kIntSize);
+    entries[i].offset = ReadInt(entry + 4 * kIntSize);
+    entries[i].length = ReadInt(entry + 5 * kIntSize);
+    if (entries[i].offset < 0 || entries[i].length < 0 ||
+        entries[i].offset + entries[i].length > index_offset) {
+      munmap(mapping, size);
+      return absl::DataLossError(absl::StrCat(
+          "Chunk file ", path, " has an index entry out of bounds."));
+    }
+  }
+
+  file->reset(new MappedChunkFile(data, size, std::move(entries)));
+  return absl::OkStatus();
+}
+
+MappedChunkFile::MappedChunkFile(const char* data, int64_t size,
+                                 std::vector<Entry> entries)
+    : data_(data), size_(size), entries_(std::move(entries)) {}
+
+MappedChunkFile::~MappedChunkFile() {
+  if (munmap(const_cast<char*>(data_), size_) != 0) {
+    REVERB_LOG(REVERB_WARNING) << "munmap failed: " << std::strerror(errno);
+  }
+}
+
+const std::vector<MappedChunkFile::Entry>& MappedChunkFile::entries() const {
+  return entries_;
+}
+
+absl::string_view MappedChunkFile::Payload(const Entry& entry) const {
+  return absl::string_view(data_ + entry.offset, entry.length);
+}
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
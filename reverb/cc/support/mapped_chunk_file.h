@@ -0,0 +1,128 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_SUPPORT_MAPPED_CHUNK_FILE_H_
+#define REVERB_CC_SUPPORT_MAPPED_CHUNK_FILE_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/strings/string_view.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+
+// File of serialized chunks which is memory mapped when read. Opening a file
+// only reads its index, the payloads are accessed in place through the mapping
+// so the cost of reading a chunk is paid (as page faults) when it is used.
+//
+// The file has the following layout, where all integers are 64 bit and stored
+// in the byte order of the host:
+//
+//   <magic> <padding>
+//   for every chunk:
+//     <length of payload> <payload> <padding>
+//   <index entry> * <number of entries>
+//   <number of entries> <offset of the index> <magic>
+//
+// Every payload starts at a multiple of `kAlignment` and is preceded by its
+// length, so the file can also be scanned without the index. An index entry
+// holds the fields of `Entry`, which allows chunks to be created without
+// parsing their payloads.
+//
+// Files are written to a local file system using POSIX I/O.
+class MappedChunkFile {
+ public:
+  static constexpr int kAlignment = 64;
+
+  // Metadata and location of a chunk in the file.
+  struct Entry {
+    uint64_t key;
+    uint64_t episode_id;
+    int64_t num_rows;
+    int64_t num_columns;
+
+    // Position of the payload (excluding its length prefix) in the file.
+    int64_t offset;
+    int64_t length;
+  };
+
+  // Writes a new file. Not thread safe.
+  class Writer {
+   public:
+    // Creates (or truncates) the file at `path`.
+    static absl::Status Create(const std::string& path,
+                               std::unique_ptr<Writer>* writer);
+
+    // Closes the file if `Close` has not been called. The file is then
+    // incomplete and cannot be opened.
+    ~Writer();
+
+    // Appends `payload` as the chunk described by `entry`. The location fields
+    // of `entry` are ignored.
+    absl::Status Append(const Entry& entry, absl::string_view payload);
+
+    // Writes the index and closes the file.
+    absl::Status Close();
+
+   private:
+    Writer(std::string path, int fd);
+
+    // Writes zeros until `reserve` bytes before the next multiple of
+    // `kAlignment`.
+    absl::Status Pad(int64_t reserve);
+
+    absl::Status Write(absl::string_view data);
+
+    const std::string path_;
+    int fd_;
+    int64_t size_ = 0;
+    std::vector<Entry> entries_;
+  };
+
+  // Maps the file at `path` and reads its index.
+  static absl::Status Open(const std::string& path,
+                           std::shared_ptr<const MappedChunkFile>* file);
+
+  // Unmaps the file. Payloads must not be accessed after this.
+  ~MappedChunkFile();
+
+  // The chunks of the file in the order they were appended.
+  const std::vector<Entry>& entries() const;
+
+  // The payload of `entry`, which must be one of `entries`. Points into the
+  // mapping so it remains valid for the lifetime of this object.
+  absl::string_view Payload(const Entry& entry) const;
+
+  // MappedChunkFile is neither copyable nor movable.
+  MappedChunkFile(const MappedChunkFile&) = delete;
+  MappedChunkFile& operator=(const MappedChunkFile&) = delete;
+
+ private:
+  MappedChunkFile(const char* data, int64_t size, std::vector<Entry> entries);
+
+  const char* const data_;
+  const int64_t size_;
+  const std::vector<Entry> entries_;
+};
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_SUPPORT_MAPPED_CHUNK_FILE_H_
@@ -0,0 +1,87 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/support/mapped_chunk_file.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <string>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "reverb/cc/platform/status_matchers.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+namespace {
+
+std::string TestPath(absl::string_view name) {
+  const char* dir = std::getenv("TEST_TMPDIR");
+  return absl::StrCat(dir != nullptr ? dir : "/tmp", "/", name);
+}
+
+TEST(MappedChunkFile, ReadsAppendedChunks) {
+  const std::string path = TestPath("reads_appended_chunks");
+  std::unique_ptr<MappedChunkFile::Writer> writer;
+  REVERB_ASSERT_OK(MappedChunkFile::Writer::Create(path, &writer));
+  REVERB_ASSERT_OK(writer->Append({1, 10, 5, 2}, "hello"));
+  REVERB_ASSERT_OK(writer->Append({2, 20, 6, 3}, ""));
+  REVERB_ASSERT_OK(writer->Append({3, 30, 7, 4}, std::string(100, 'x')));
+  REVERB_ASSERT_OK(writer->Close());
+
+  std::shared_ptr<const MappedChunkFile> file;
+  REVERB_ASSERT_OK(MappedChunkFile::Open(path, &file));
+  ASSERT_EQ(file->entries().size(), 3);
+
+  const auto& first = file->entries()[0];
+  EXPECT_EQ(first.key, 1);
+  EXPECT_EQ(first.episode_id, 10);
+  EXPECT_EQ(first.num_rows, 5);
+  EXPECT_EQ(first.num_columns, 2);
+  EXPECT_EQ(file->Payload(first), "hello");
+  EXPECT_EQ(file->Payload(file->entries()[1]), "");
+  EXPECT_EQ(file->Payload(file->entries()[2]), std::string(100, 'x'));
+
+  for (const auto& entry : file->entries()) {
+    EXPECT_EQ(entry.offset % MappedChunkFile::kAlignment, 0);
+  }
+}
+
+TEST(MappedChunkFile, OpenRejectsIncompleteFile) {
+  const std::string path = TestPath("rejects_incomplete_file");
+  {
+    std::unique_ptr<MappedChunkFile::Writer> writer;
+    REVERB_ASSERT_OK(MappedChunkFile::Writer::Create(path, &writer));
+    REVERB_ASSERT_OK(writer->Append({1, 10, 5, 2}, std::string(100, 'x')));
+  }
+
+  std::shared_ptr<const MappedChunkFile> file;
+  EXPECT_EQ(MappedChunkFile::Open(path, &file).code(),
+            absl::StatusCode::kDataLoss);
+}
+
+TEST(MappedChunkFile, OpenFailsForMissingFile) {
+  std::shared_ptr<const MappedChunkFile> file;
+  EXPECT_FALSE(
+      MappedChunkFile::Open(TestPath("this_file_does_not_exist"), &file).ok());
+}
+
+}  // namespace
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
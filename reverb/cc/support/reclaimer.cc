@@ -0,0 +1,87 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/support/reclaimer.h"
+
+#include <memory>
+#include <vector>
+
+#include "absl/synchronization/mutex.h"
+#include "reverb/cc/platform/logging.h"
+#include "reverb/cc/platform/thread.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+
+Reclaimer::Reclaimer(int64_t max_pending) : max_pending_(max_pending) {
+  REVERB_CHECK_GT(max_pending_, 0);
+  thread_ = StartThread("Reclaimer", [this] { RunWorker(); });
+}
+
+Reclaimer::~Reclaimer() {
+  {
+    absl::MutexLock lock(&mu_);
+    closed_ = true;
+  }
+  thread_ = nullptr;
+}
+
+void Reclaimer::RunWorker() {
+  std::vector<std::shared_ptr<void>> batch;
+  while (true) {
+    {
+      absl::MutexLock lock(&mu_);
+      mu_.Await(absl::Condition(
+          +[](Reclaimer* r) ABSL_EXCLUSIVE_LOCKS_REQUIRED(r->mu_) {
+            return r->closed_ || !r->pending_.empty();
+          },
+          this));
+
+      // Objects which are still pending when the reclaimer is closed are
+      // destroyed together with the rest of the members.
+      if (closed_) return;
+
+      batch.swap(pending_);
+      reclaiming_ = true;
+    }
+
+    // Destroy the objects outside of the lock so callers are never blocked by
+    // the deallocation.
+    batch.clear();
+
+    absl::MutexLock lock(&mu_);
+    reclaiming_ = false;
+    num_reclaimed_batches_++;
+  }
+}
+
+void Reclaimer::Flush() {
+  absl::MutexLock lock(&mu_);
+  const int64_t target = num_reclaimed_batches_ + (reclaiming_ ? 1 : 0) +
+                         (pending_.empty() ? 0 : 1);
+  auto done = [this, target]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    return closed_ || num_reclaimed_batches_ >= target;
+  };
+  mu_.Await(absl::Condition(&done));
+}
+
+int64_t Reclaimer::num_pending() const {
+  absl::MutexLock lock(&mu_);
+  return pending_.size();
+}
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
@@ -0,0 +1,105 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_SUPPORT_RECLAIMER_H_
+#define REVERB_CC_SUPPORT_RECLAIMER_H_
+
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+#include "reverb/cc/platform/thread.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+
+// Destroys objects on a background thread.
+//
+// Freeing items and chunks can be expensive as the last reference to a chunk
+// owns the (potentially multi MB) tensor data. `Reclaimer` allows callers on
+// latency sensitive paths (e.g. gRPC handlers) to hand over ownership of
+// objects which are no longer needed and have them destroyed in batches by a
+// background thread instead.
+//
+// If more than `max_pending` objects are waiting to be destroyed then the
+// caller destroys the object inline. This bounds the amount of memory that is
+// kept alive by the reclaimer when the background thread is unable to keep up.
+//
+// This object is thread-safe.
+class Reclaimer {
+ public:
+  static constexpr int64_t kDefaultMaxPending = 100000;
+
+  explicit Reclaimer(int64_t max_pending = kDefaultMaxPending);
+
+  // Stops the background thread and destroys all pending objects.
+  ~Reclaimer();
+
+  // Takes ownership of `object` and destroys it on the background thread.
+  template <typename T>
+  void Reclaim(T object) ABSL_LOCKS_EXCLUDED(mu_) {
+    std::shared_ptr<void> garbage = std::make_shared<T>(std::move(object));
+    {
+      absl::MutexLock lock(&mu_);
+      if (!closed_ && pending_.size() < max_pending_) {
+        pending_.push_back(std::move(garbage));
+        return;
+      }
+    }
+    // The reclaimer is full (or closed) so the object is destroyed by the
+    // caller once the lock has been released.
+  }
+
+  // Blocks until all objects handed over before the call have been destroyed.
+  void Flush() ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Number of objects waiting to be destroyed.
+  int64_t num_pending() const ABSL_LOCKS_EXCLUDED(mu_);
+
+ private:
+  // Loop run by `thread_`. Swaps out and destroys `pending_` until closed.
+  void RunWorker() ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Maximum number of objects which can be held by `pending_`.
+  const int64_t max_pending_;
+
+  mutable absl::Mutex mu_;
+
+  // Objects waiting to be destroyed. `shared_ptr<void>` is used as it destroys
+  // the object using the destructor of the type it was created with.
+  std::vector<std::shared_ptr<void>> pending_ ABSL_GUARDED_BY(mu_);
+
+  // Incremented by the worker every time a batch of objects has been
+  // destroyed. Used by `Flush`.
+  int64_t num_reclaimed_batches_ ABSL_GUARDED_BY(mu_) = 0;
+
+  // Set when the worker has swapped out `pending_` but not yet destroyed the
+  // objects.
+  bool reclaiming_ ABSL_GUARDED_BY(mu_) = false;
+
+  // Set in the destructor to stop the worker.
+  bool closed_ ABSL_GUARDED_BY(mu_) = false;
+
+  std::unique_ptr<Thread> thread_;
+};
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_SUPPORT_RECLAIMER_H_
@@ -0,0 +1,114 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/support/reclaimer.h"
+
+#include <atomic>
+#include <memory>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/synchronization/notification.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+namespace {
+
+// Records the thread that destroyed the object.
+class Tracked {
+ public:
+  Tracked(std::atomic<int>* destroyed, std::thread::id* destroyed_by)
+      : destroyed_(destroyed), destroyed_by_(destroyed_by) {}
+  Tracked(Tracked&& other)
+      : destroyed_(other.destroyed_), destroyed_by_(other.destroyed_by_) {
+    other.destroyed_ = nullptr;
+  }
+  ~Tracked() {
+    if (destroyed_ == nullptr) return;
+    if (destroyed_by_ != nullptr) *destroyed_by_ = std::this_thread::get_id();
+    destroyed_->fetch_add(1);
+  }
+
+ private:
+  std::atomic<int>* destroyed_;
+  std::thread::id* destroyed_by_;
+};
+
+TEST(ReclaimerTest, DestroysObjectsOnBackgroundThread) {
+  Reclaimer reclaimer;
+  std::atomic<int> destroyed(0);
+  std::thread::id destroyed_by;
+
+  reclaimer.Reclaim(Tracked(&destroyed, &destroyed_by));
+  reclaimer.Flush();
+
+  EXPECT_EQ(destroyed, 1);
+  EXPECT_NE(destroyed_by, std::this_thread::get_id());
+  EXPECT_EQ(reclaimer.num_pending(), 0);
+}
+
+TEST(ReclaimerTest, FlushWaitsForAllObjects) {
+  Reclaimer reclaimer;
+  std::atomic<int> destroyed(0);
+  for (int i = 0; i < 1000; i++) {
+    reclaimer.Reclaim(Tracked(&destroyed, nullptr));
+  }
+  reclaimer.Flush();
+  EXPECT_EQ(destroyed, 1000);
+}
+
+TEST(ReclaimerTest, DestroysInlineWhenFull) {
+  Reclaimer reclaimer(/*max_pending=*/1);
+  std::atomic<int> destroyed(0);
+  std::thread::id destroyed_by;
+
+  // Block the background thread so nothing is reclaimed.
+  absl::Notification blocked;
+  absl::Notification release;
+  reclaimer.Reclaim(std::shared_ptr<void>(nullptr, [&](void*) {
+    blocked.Notify();
+    release.WaitForNotification();
+  }));
+  blocked.WaitForNotification();
+
+  // The first object is buffered and the second is destroyed inline.
+  reclaimer.Reclaim(Tracked(&destroyed, nullptr));
+  EXPECT_EQ(destroyed, 0);
+  reclaimer.Reclaim(Tracked(&destroyed, &destroyed_by));
+  EXPECT_EQ(destroyed, 1);
+  EXPECT_EQ(destroyed_by, std::this_thread::get_id());
+
+  release.Notify();
+  reclaimer.Flush();
+  EXPECT_EQ(destroyed, 2);
+}
+
+TEST(ReclaimerTest, DestructorDestroysPendingObjects) {
+  std::atomic<int> destroyed(0);
+  {
+    Reclaimer reclaimer;
+    for (int i = 0; i < 100; i++) {
+      reclaimer.Reclaim(Tracked(&destroyed, nullptr));
+    }
+  }
+  EXPECT_EQ(destroyed, 100);
+}
+
+}  // namespace
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
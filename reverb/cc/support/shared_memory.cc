@@ -0,0 +1,223 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/support/shared_memory.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <utility>
+
+#include "absl/random/distributions.h"
+#include "absl/random/random.h"
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "reverb/cc/platform/logging.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+namespace {
+
+constexpr uint64_t kMagic = 0x5245564552425348;  // "REVERBSH"
+
+// Header at the start of every segment. Padded to a cache line so that the
+// data area is well aligned.
+struct alignas(64) Header {
+  uint64_t magic;
+  uint64_t token;
+  int64_t capacity;
+};
+
+absl::Status ErrnoError(absl::string_view what, absl::string_view name) {
+  return absl::InternalError(
+      absl::StrCat(what, " failed for shared memory segment ", name, ": ",
+                   std::strerror(errno)));
+}
+
+}  // namespace
+
+absl::Status SharedMemoryRing::Create(int64_t capacity,
+                                      std::unique_ptr<SharedMemoryRing>* ring) {
+  if (capacity <= 0) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("capacity must be > 0 but got ", capacity, "."));
+  }
+
+  absl::BitGen gen;
+  const uint64_t token = absl::Uniform<uint64_t>(gen, 1, UINT64_MAX);
+  const std::string name = absl::StrCat(kSharedMemoryPrefix, getpid(), "_",
+                                        absl::Uniform<uint64_t>(gen));
+
+  int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd < 0) return ErrnoError("shm_open", name);
+
+  const int64_t mapping_size = sizeof(Header) + capacity;
+  if (ftruncate(fd, mapping_size) != 0) {
+    auto status = ErrnoError("ftruncate", name);
+    close(fd);
+    shm_unlink(name.c_str());
+    return status;
+  }
+
+  void* mapping =
+      mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    auto status = ErrnoError("mmap", name);
+    shm_unlink(name.c_str());
+    return status;
+  }
+
+  auto* header = static_cast<Header*>(mapping);
+  header->magic = kMagic;
+  header->token = token;
+  header->capacity = capacity;
+
+  ring->reset(
+      new SharedMemoryRing(name, token, capacity, mapping, mapping_size));
+  return absl::OkStatus();
+}
+
+SharedMemoryRing::SharedMemoryRing(std::string name, uint64_t token,
+                                   int64_t capacity, void* mapping,
+                                   int64_t mapping_size)
+    : name_(std::move(name)),
+      token_(token),
+      capacity_(capacity),
+      mapping_(mapping),
+      mapping_size_(mapping_size),
+      data_(static_cast<char*>(mapping) + sizeof(Header)) {}
+
+SharedMemoryRing::~SharedMemoryRing() {
+  munmap(mapping_, mapping_size_);
+  shm_unlink(name_.c_str());
+}
+
+char* SharedMemoryRing::Allocate(int64_t size, int64_t* offset,
+                                 uint64_t* position) {
+  if (size <= 0 || size > capacity_) return nullptr;
+
+  absl::MutexLock lock(&mu_);
+  int64_t start = head_ % capacity_;
+  int64_t padding = 0;
+  if (start + size > capacity_) {
+    // The record would wrap around the end so it is placed at the start of the
+    // ring instead.
+    padding = capacity_ - start;
+    start = 0;
+  }
+  if (head_ + padding + size - tail_ > capacity_) return nullptr;
+
+  head_ += padding + size;
+  *offset = start;
+  *position = head_;
+  return data_ + start;
+}
+
+void SharedMemoryRing::Release(uint64_t position) {
+  absl::MutexLock lock(&mu_);
+  REVERB_CHECK_LE(position, head_);
+  tail_ = std::max(tail_, position);
+}
+
+void SharedMemoryRing::Reset() {
+  absl::MutexLock lock(&mu_);
+  tail_ = head_;
+}
+
+int64_t SharedMemoryRing::used() const {
+  absl::MutexLock lock(&mu_);
+  return head_ - tail_;
+}
+
+absl::Status SharedMemorySegment::Open(
+    absl::string_view name, std::unique_ptr<SharedMemorySegment>* segment) {
+  if (!absl::StartsWith(name, kSharedMemoryPrefix) ||
+      absl::StrContains(name.substr(1), "/")) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Invalid shared memory segment name: ", name));
+  }
+
+  const std::string name_str(name);
+  int fd = shm_open(name_str.c_str(), O_RDONLY, 0);
+  if (fd < 0) return ErrnoError("shm_open", name);
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    auto status = ErrnoError("fstat", name);
+    close(fd);
+    return status;
+  }
+  if (st.st_size < sizeof(Header)) {
+    close(fd);
+    return absl::InvalidArgumentError(
+        absl::StrCat("Shared memory segment ", name, " is too small."));
+  }
+
+  void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) return ErrnoError("mmap", name);
+
+  const auto* header = static_cast<const Header*>(mapping);
+  if (header->magic != kMagic ||
+      header->capacity != st.st_size - static_cast<int64_t>(sizeof(Header))) {
+    munmap(mapping, st.st_size);
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Shared memory segment ", name, " was not created by Reverb."));
+  }
+
+  segment->reset(new SharedMemorySegment(mapping, st.st_size));
+  return absl::OkStatus();
+}
+
+SharedMemorySegment::SharedMemorySegment(const void* mapping,
+                                         int64_t mapping_size)
+    : mapping_(mapping), mapping_size_(mapping_size) {}
+
+SharedMemorySegment::~SharedMemorySegment() {
+  munmap(const_cast<void*>(mapping_), mapping_size_);
+}
+
+uint64_t SharedMemorySegment::token() const {
+  return static_cast<const Header*>(mapping_)->token;
+}
+
+int64_t SharedMemorySegment::capacity() const {
+  return mapping_size_ - sizeof(Header);
+}
+
+absl::Status SharedMemorySegment::Read(int64_t offset, int64_t length,
+                                       absl::string_view* data) const {
+  if (offset < 0 || length < 0 || offset > capacity() ||
+      length > capacity() - offset) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Record [", offset, ", ", offset + length,
+        ") is outside of the shared memory segment of size ", capacity(),
+        "."));
+  }
+  *data = absl::string_view(
+      static_cast<const char*>(mapping_) + sizeof(Header) + offset, length);
+  return absl::OkStatus();
+}
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
@@ -0,0 +1,149 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_SUPPORT_SHARED_MEMORY_H_
+#define REVERB_CC_SUPPORT_SHARED_MEMORY_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/status/status.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+
+// Prefix of the names of all segments created by `SharedMemoryRing`.
+// `SharedMemorySegment::Open` refuses to open segments with other names.
+inline constexpr absl::string_view kSharedMemoryPrefix = "/reverb_shm_";
+
+// POSIX shared memory segment owned by a single producer and used as a ring
+// buffer of variable sized records.
+//
+// The segment starts with a small header, holding a random token and the
+// capacity, which is followed by the record data. Only the producer tracks
+// which parts of the ring are in use: records are allocated at the head and
+// released, in allocation order, once the consumer has acknowledged them
+// through some other channel (e.g a gRPC stream). The offsets handed out are
+// relative to the start of the data area and records never wrap around the end
+// of the ring so every record can be read as a single contiguous region.
+//
+// The segment is unlinked when the ring is destroyed.
+//
+// This object is thread-safe.
+class SharedMemoryRing {
+ public:
+  // Creates and maps a new segment with room for `capacity` bytes of records.
+  static absl::Status Create(int64_t capacity,
+                             std::unique_ptr<SharedMemoryRing>* ring);
+
+  ~SharedMemoryRing();
+
+  // Name that consumers use to open the segment.
+  const std::string& name() const { return name_; }
+
+  // Random value written to the header. Consumers echo it back to prove that
+  // they have mapped the same segment.
+  uint64_t token() const { return token_; }
+
+  int64_t capacity() const { return capacity_; }
+
+  // Allocates `size` contiguous bytes at the head of the ring. Returns nullptr
+  // if there is not enough free space. Otherwise `offset` is set to the offset
+  // of the record within the data area and `position` to the position which
+  // must be passed to `Release` to free the record (and all records allocated
+  // before it).
+  char* Allocate(int64_t size, int64_t* offset, uint64_t* position)
+      ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Releases all records allocated up to `position`.
+  void Release(uint64_t position) ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Releases all records.
+  void Reset() ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Number of bytes that are currently allocated, including padding skipped to
+  // avoid wrapping records around the end of the ring.
+  int64_t used() const ABSL_LOCKS_EXCLUDED(mu_);
+
+  SharedMemoryRing(const SharedMemoryRing&) = delete;
+  SharedMemoryRing& operator=(const SharedMemoryRing&) = delete;
+
+ private:
+  SharedMemoryRing(std::string name, uint64_t token, int64_t capacity,
+                   void* mapping, int64_t mapping_size);
+
+  const std::string name_;
+  const uint64_t token_;
+  const int64_t capacity_;
+
+  // The full mapping (i.e header and data area).
+  void* const mapping_;
+  const int64_t mapping_size_;
+
+  // Start of the data area.
+  char* const data_;
+
+  mutable absl::Mutex mu_;
+
+  // Total number of bytes allocated and released since the ring was created.
+  // The head of the ring is at `head_ % capacity_`.
+  uint64_t head_ ABSL_GUARDED_BY(mu_) = 0;
+  uint64_t tail_ ABSL_GUARDED_BY(mu_) = 0;
+};
+
+// Read-only mapping of a segment created by a `SharedMemoryRing` in another
+// process.
+//
+// This object is thread-safe.
+class SharedMemorySegment {
+ public:
+  // Maps the segment `name`. Returns `InvalidArgumentError` if `name` does not
+  // start with `kSharedMemoryPrefix` or if the segment was not created by a
+  // `SharedMemoryRing`.
+  static absl::Status Open(absl::string_view name,
+                           std::unique_ptr<SharedMemorySegment>* segment);
+
+  ~SharedMemorySegment();
+
+  // Token written by the producer.
+  uint64_t token() const;
+
+  // Capacity of the data area.
+  int64_t capacity() const;
+
+  // Points `data` to the record at `offset` of the data area. Returns
+  // `InvalidArgumentError` if the record is not within the data area.
+  absl::Status Read(int64_t offset, int64_t length,
+                    absl::string_view* data) const;
+
+  SharedMemorySegment(const SharedMemorySegment&) = delete;
+  SharedMemorySegment& operator=(const SharedMemorySegment&) = delete;
+
+ private:
+  SharedMemorySegment(const void* mapping, int64_t mapping_size);
+
+  const void* const mapping_;
+  const int64_t mapping_size_;
+};
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_SUPPORT_SHARED_MEMORY_H_
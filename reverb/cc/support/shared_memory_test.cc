@@ -0,0 +1,138 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/support/shared_memory.h"
+
+#include <cstring>
+#include <memory>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/status/status.h"
+#include "reverb/cc/platform/status_matchers.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+namespace {
+
+TEST(SharedMemoryRing, CreateRejectsNonPositiveCapacity) {
+  std::unique_ptr<SharedMemoryRing> ring;
+  EXPECT_EQ(SharedMemoryRing::Create(0, &ring).code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+TEST(SharedMemoryRing, SegmentSeesRecordsWrittenByRing) {
+  std::unique_ptr<SharedMemoryRing> ring;
+  REVERB_ASSERT_OK(SharedMemoryRing::Create(64, &ring));
+
+  std::unique_ptr<SharedMemorySegment> segment;
+  REVERB_ASSERT_OK(SharedMemorySegment::Open(ring->name(), &segment));
+  EXPECT_EQ(segment->token(), ring->token());
+  EXPECT_EQ(segment->capacity(), 64);
+
+  int64_t offset;
+  uint64_t position;
+  char* data = ring->Allocate(5, &offset, &position);
+  ASSERT_NE(data, nullptr);
+  std::memcpy(data, "hello", 5);
+
+  absl::string_view record;
+  REVERB_ASSERT_OK(segment->Read(offset, 5, &record));
+  EXPECT_EQ(record, "hello");
+}
+
+TEST(SharedMemoryRing, AllocateFailsWhenFullAndSucceedsAfterRelease) {
+  std::unique_ptr<SharedMemoryRing> ring;
+  REVERB_ASSERT_OK(SharedMemoryRing::Create(10, &ring));
+
+  int64_t offset;
+  uint64_t first;
+  uint64_t second;
+  ASSERT_NE(ring->Allocate(6, &offset, &first), nullptr);
+  EXPECT_EQ(offset, 0);
+  ASSERT_NE(ring->Allocate(4, &offset, &second), nullptr);
+  EXPECT_EQ(offset, 6);
+  EXPECT_EQ(ring->Allocate(1, &offset, &second), nullptr);
+
+  ring->Release(first);
+  EXPECT_EQ(ring->used(), 4);
+  ASSERT_NE(ring->Allocate(6, &offset, &first), nullptr);
+  EXPECT_EQ(offset, 0);
+}
+
+TEST(SharedMemoryRing, RecordsDoNotWrapAroundTheEnd) {
+  std::unique_ptr<SharedMemoryRing> ring;
+  REVERB_ASSERT_OK(SharedMemoryRing::Create(10, &ring));
+
+  int64_t offset;
+  uint64_t position;
+  ASSERT_NE(ring->Allocate(7, &offset, &position), nullptr);
+  ring->Release(position);
+
+  // Only 3 bytes remain before the end so the record is placed at the start
+  // and the remaining bytes are counted as used until it is released.
+  ASSERT_NE(ring->Allocate(4, &offset, &position), nullptr);
+  EXPECT_EQ(offset, 0);
+  EXPECT_EQ(ring->used(), 7);
+
+  ring->Reset();
+  EXPECT_EQ(ring->used(), 0);
+}
+
+TEST(SharedMemoryRing, AllocateRejectsRecordsLargerThanCapacity) {
+  std::unique_ptr<SharedMemoryRing> ring;
+  REVERB_ASSERT_OK(SharedMemoryRing::Create(10, &ring));
+
+  int64_t offset;
+  uint64_t position;
+  EXPECT_EQ(ring->Allocate(11, &offset, &position), nullptr);
+}
+
+TEST(SharedMemorySegment, OpenRejectsForeignNames) {
+  std::unique_ptr<SharedMemorySegment> segment;
+  EXPECT_EQ(SharedMemorySegment::Open("/some_other_segment", &segment).code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(SharedMemorySegment::Open("/reverb_shm_/../x", &segment).code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+TEST(SharedMemorySegment, ReadRejectsRecordsOutsideOfSegment) {
+  std::unique_ptr<SharedMemoryRing> ring;
+  REVERB_ASSERT_OK(SharedMemoryRing::Create(10, &ring));
+  std::unique_ptr<SharedMemorySegment> segment;
+  REVERB_ASSERT_OK(SharedMemorySegment::Open(ring->name(), &segment));
+
+  absl::string_view record;
+  EXPECT_EQ(segment->Read(8, 3, &record).code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(segment->Read(-1, 1, &record).code(),
+            absl::StatusCode::kInvalidArgument);
+  REVERB_EXPECT_OK(segment->Read(8, 2, &record));
+}
+
+TEST(SharedMemorySegment, SegmentIsRemovedWithRing) {
+  std::unique_ptr<SharedMemoryRing> ring;
+  REVERB_ASSERT_OK(SharedMemoryRing::Create(10, &ring));
+  std::string name = ring->name();
+  ring = nullptr;
+
+  std::unique_ptr<SharedMemorySegment> segment;
+  EXPECT_FALSE(SharedMemorySegment::Open(name, &segment).ok());
+}
+
+}  // namespace
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
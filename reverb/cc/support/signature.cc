@@ -14,6 +14,7 @@
 
 #include "reverb/cc/support/signature.h"
 
+#include <memory>
 #include <string>
 
 #include "absl/status/status.h"
@@ -24,6 +25,7 @@
 #include "reverb/cc/schema.pb.h"
 #include "reverb/cc/support/trajectory_util.h"
 #include "reverb/cc/table.h"
+#include "reverb/cc/tensor_compression.h"
 #include "tensorflow/core/framework/tensor.h"
 #include "tensorflow/core/framework/tensor.pb.h"
 #include "tensorflow/core/framework/types.h"
@@ -153,13 +155,12 @@ tensorflow::StructuredValue StructuredValueFromChunkData(
     const ChunkData& chunk_data) {
   tensorflow::StructuredValue value;
   for (int i = 0; i < chunk_data.data().tensors_size(); i++) {
-    const auto& chunk = chunk_data.data().tensors(i);
-    tensorflow::PartialTensorShape shape(chunk.tensor_shape());
+    tensorflow::PartialTensorShape shape(ColumnShape(chunk_data, i));
     shape.RemoveDim(0);
 
     auto* spec =
         value.mutable_list_value()->add_values()->mutable_tensor_spec_value();
-    spec->set_dtype(chunk.dtype());
+    spec->set_dtype(ColumnDtype(chunk_data, i));
     shape.AsProto(spec->mutable_shape());
   }
 
@@ -169,10 +170,12 @@ tensorflow::StructuredValue StructuredValueFromChunkData(
 tensorflow::StructuredValue StructuredValueFromItem(const TableItem& item) {
   tensorflow::StructuredValue value;
 
-  auto get_tensor = [&](const FlatTrajectory::ChunkSlice& slice) {
+  auto get_chunk = [&](const FlatTrajectory::ChunkSlice& slice) {
     for (const auto& chunk : item.chunks) {
       if (chunk->key() == slice.chunk_key()) {
-        return &chunk->data().data().tensors(slice.index());
+        std::shared_ptr<const ChunkData> data;
+        REVERB_CHECK_OK(chunk->PinData(&data));
+        return data;
       }
     }
     REVERB_CHECK(false) << "Invalid item.";
@@ -181,12 +184,13 @@ tensorflow::StructuredValue StructuredValueFromItem(const TableItem& item) {
   for (int col_idx = 0; col_idx < item.item.flat_trajectory().columns_size();
        col_idx++) {
     const auto& col = item.item.flat_trajectory().columns(col_idx);
-    const auto* tensor_proto = get_tensor(col.chunk_slices(0));
+    const auto& slice = col.chunk_slices(0);
+    const auto chunk_data = get_chunk(slice);
 
     auto* spec =
         value.mutable_list_value()->add_values()->mutable_tensor_spec_value();
-    spec->set_dtype(tensor_proto->dtype());
-    *spec->mutable_shape() = tensor_proto->tensor_shape();
+    spec->set_dtype(ColumnDtype(*chunk_data, slice.index()));
+    *spec->mutable_shape() = ColumnShape(*chunk_data, slice.index());
 
     if (col.squeeze()) {
       spec->mutable_shape()->mutable_dim()->DeleteSubrange(0, 1);
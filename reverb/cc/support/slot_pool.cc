@@ -0,0 +1,69 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/support/slot_pool.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "absl/synchronization/mutex.h"
+#include "reverb/cc/platform/logging.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+
+SlotPool::SlotPool(int slots_per_slab) : slots_per_slab_(slots_per_slab) {
+  REVERB_CHECK_GT(slots_per_slab_, 0);
+}
+
+void* SlotPool::Allocate(size_t size, size_t alignment) {
+  REVERB_CHECK_LE(alignment, alignof(std::max_align_t));
+  // Slots are measured in units of `max_align_t` so every slot is aligned.
+  const size_t units =
+      (size + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t);
+
+  absl::MutexLock lock(&mu_);
+  if (slot_size_ == 0) slot_size_ = units;
+  REVERB_CHECK_EQ(slot_size_, units)
+      << "All slots of a SlotPool must have the same size.";
+
+  if (free_slots_.empty()) {
+    // The slab is deliberately left uninitialized.
+    slabs_.emplace_back(new std::max_align_t[units * slots_per_slab_]);
+    std::max_align_t* slab = slabs_.back().get();
+    for (int i = slots_per_slab_ - 1; i >= 0; i--) {
+      free_slots_.push_back(slab + i * units);
+    }
+  }
+  void* slot = free_slots_.back();
+  free_slots_.pop_back();
+  return slot;
+}
+
+void SlotPool::Deallocate(void* slot) {
+  absl::MutexLock lock(&mu_);
+  free_slots_.push_back(slot);
+}
+
+int64_t SlotPool::num_slots() const {
+  absl::MutexLock lock(&mu_);
+  return static_cast<int64_t>(slabs_.size()) * slots_per_slab_;
+}
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
@@ -0,0 +1,111 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_SUPPORT_SLOT_POOL_H_
+#define REVERB_CC_SUPPORT_SLOT_POOL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+
+// Pool of equally sized memory slots. Slots are carved out of slabs of
+// `slots_per_slab` slots and recycled through a free list, so objects which
+// are created and destroyed at a high rate (e.g. the `CellRef` of every
+// appended step) cost one allocation per slab rather than one per object.
+// Memory is only returned when the pool is destroyed, so the pool holds on to
+// as many slots as were ever alive at the same time.
+//
+// The slot size is set by the first `Allocate` call and all subsequent calls
+// must request the same size.
+//
+// This object is thread-safe.
+class SlotPool {
+ public:
+  explicit SlotPool(int slots_per_slab);
+
+  // Returns a slot of `size` bytes aligned to `alignment`, which must not
+  // exceed `alignof(std::max_align_t)`.
+  void* Allocate(size_t size, size_t alignment) ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Returns a slot allocated by `Allocate` to the pool.
+  void Deallocate(void* slot) ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Number of slots allocated from the system, in use or not.
+  int64_t num_slots() const ABSL_LOCKS_EXCLUDED(mu_);
+
+ private:
+  const int slots_per_slab_;
+
+  mutable absl::Mutex mu_;
+  size_t slot_size_ ABSL_GUARDED_BY(mu_) = 0;
+  std::vector<std::unique_ptr<std::max_align_t[]>> slabs_ ABSL_GUARDED_BY(mu_);
+  std::vector<void*> free_slots_ ABSL_GUARDED_BY(mu_);
+};
+
+// Standard allocator which allocates single objects from a shared `SlotPool`
+// and falls back to `std::allocator` for arrays. Intended for
+// `std::allocate_shared`, which allocates the object and its control block in
+// a single slot and keeps a copy of the allocator (and thereby the pool) alive
+// until the slot has been returned.
+template <typename T>
+class SlotPoolAllocator {
+ public:
+  using value_type = T;
+
+  explicit SlotPoolAllocator(std::shared_ptr<SlotPool> pool)
+      : pool_(std::move(pool)) {}
+
+  template <typename U>
+  SlotPoolAllocator(const SlotPoolAllocator<U>& other)  // NOLINT
+      : pool_(other.pool()) {}
+
+  T* allocate(size_t n) {
+    if (n != 1) return std::allocator<T>().allocate(n);
+    return static_cast<T*>(pool_->Allocate(sizeof(T), alignof(T)));
+  }
+
+  void deallocate(T* p, size_t n) {
+    if (n != 1) return std::allocator<T>().deallocate(p, n);
+    pool_->Deallocate(p);
+  }
+
+  const std::shared_ptr<SlotPool>& pool() const { return pool_; }
+
+  template <typename U>
+  bool operator==(const SlotPoolAllocator<U>& other) const {
+    return pool_ == other.pool();
+  }
+  template <typename U>
+  bool operator!=(const SlotPoolAllocator<U>& other) const {
+    return pool_ != other.pool();
+  }
+
+ private:
+  std::shared_ptr<SlotPool> pool_;
+};
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_SUPPORT_SLOT_POOL_H_
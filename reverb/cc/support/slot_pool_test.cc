@@ -0,0 +1,84 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/support/slot_pool.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+namespace {
+
+TEST(SlotPoolTest, RecyclesSlots) {
+  SlotPool pool(/*slots_per_slab=*/2);
+  void* first = pool.Allocate(24, 8);
+  void* second = pool.Allocate(24, 8);
+  EXPECT_NE(first, second);
+  EXPECT_EQ(pool.num_slots(), 2);
+
+  // A third slot requires a new slab.
+  void* third = pool.Allocate(24, 8);
+  EXPECT_EQ(pool.num_slots(), 4);
+
+  // Returned slots are reused before new slabs are allocated.
+  pool.Deallocate(second);
+  EXPECT_EQ(pool.Allocate(24, 8), second);
+  EXPECT_EQ(pool.num_slots(), 4);
+
+  pool.Deallocate(first);
+  pool.Deallocate(second);
+  pool.Deallocate(third);
+}
+
+TEST(SlotPoolTest, SlotsAreAligned) {
+  SlotPool pool(/*slots_per_slab=*/4);
+  for (int i = 0; i < 4; i++) {
+    auto address = reinterpret_cast<uintptr_t>(pool.Allocate(3, 1));
+    EXPECT_EQ(address % alignof(std::max_align_t), 0);
+  }
+}
+
+TEST(SlotPoolTest, AllocateSharedKeepsPoolAlive) {
+  auto pool = std::make_shared<SlotPool>(/*slots_per_slab=*/8);
+  std::vector<std::shared_ptr<int64_t>> values;
+  for (int i = 0; i < 16; i++) {
+    values.push_back(std::allocate_shared<int64_t>(
+        SlotPoolAllocator<int64_t>(pool), i));
+  }
+  EXPECT_EQ(pool->num_slots(), 16);
+  std::weak_ptr<int64_t> weak = values.back();
+
+  // The objects keep the pool alive after the last external reference to it
+  // has been dropped.
+  std::weak_ptr<SlotPool> weak_pool = pool;
+  pool = nullptr;
+  EXPECT_FALSE(weak_pool.expired());
+  for (int i = 0; i < 16; i++) {
+    EXPECT_EQ(*values[i], i);
+  }
+  values.clear();
+  EXPECT_TRUE(weak.expired());
+  EXPECT_TRUE(weak_pool.expired());
+}
+
+}  // namespace
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
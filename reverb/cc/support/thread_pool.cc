@@ -0,0 +1,53 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "reverb/cc/support/thread_pool.h"
+
+#include "absl/strings/str_cat.h"
+#include "reverb/cc/platform/logging.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+
+ThreadPool::ThreadPool(absl::string_view name_prefix, int num_threads) {
+  REVERB_CHECK_GT(num_threads, 0);
+  threads_.reserve(num_threads);
+  for (int i = 0; i < num_threads; i++) {
+    threads_.push_back(StartThread(absl::StrCat(name_prefix, "_", i), [this] {
+      std::function<void()> fn;
+      while (queue_.Pop(&fn)) {
+        fn();
+      }
+    }));
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  // The queue is closed once the last scheduled closure has been popped which
+  // in turn makes the threads return.
+  queue_.SetLastItemPushed();
+  threads_.clear();
+}
+
+void ThreadPool::Schedule(std::function<void()> fn) {
+  REVERB_CHECK(queue_.Push(std::move(fn)));
+}
+
+int ThreadPool::num_pending() const { return queue_.size(); }
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
@@ -0,0 +1,60 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef REVERB_CC_SUPPORT_THREAD_POOL_H_
+#define REVERB_CC_SUPPORT_THREAD_POOL_H_
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "reverb/cc/platform/thread.h"
+#include "reverb/cc/support/unbounded_queue.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+
+// Fixed number of threads which run scheduled closures in FIFO order.
+//
+// The destructor runs all closures which have already been scheduled and then
+// joins the threads, so objects referenced by the closures must outlive the
+// pool.
+//
+// This object is thread-safe.
+class ThreadPool {
+ public:
+  ThreadPool(absl::string_view name_prefix, int num_threads);
+
+  // Blocks until all scheduled closures have completed.
+  ~ThreadPool();
+
+  // Adds `fn` to the queue. It is run by the first idle thread.
+  void Schedule(std::function<void()> fn);
+
+  // Number of closures which are scheduled but not yet picked up by a thread.
+  int num_pending() const;
+
+ private:
+  UnboundedQueue<std::function<void()>> queue_;
+  std::vector<std::unique_ptr<Thread>> threads_;
+};
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_SUPPORT_THREAD_POOL_H_
@@ -0,0 +1,69 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "reverb/cc/support/thread_pool.h"
+
+#include <atomic>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/synchronization/notification.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+namespace {
+
+TEST(ThreadPoolTest, RunsAllScheduledClosuresBeforeDestruction) {
+  std::atomic<int> count(0);
+  {
+    ThreadPool pool("test", 4);
+    for (int i = 0; i < 100; i++) {
+      pool.Schedule([&count] { count++; });
+    }
+  }
+  EXPECT_EQ(count, 100);
+}
+
+TEST(ThreadPoolTest, RunsClosuresConcurrently) {
+  ThreadPool pool("test", 2);
+  absl::Notification first_started;
+  absl::Notification second_done;
+  pool.Schedule([&] {
+    first_started.Notify();
+    // Only returns if the second closure can run while this one is blocked.
+    second_done.WaitForNotification();
+  });
+  first_started.WaitForNotification();
+  pool.Schedule([&] { second_done.Notify(); });
+  second_done.WaitForNotification();
+}
+
+TEST(ThreadPoolTest, SingleThreadRunsClosuresInOrder) {
+  std::vector<int> order;
+  {
+    ThreadPool pool("test", 1);
+    for (int i = 0; i < 10; i++) {
+      pool.Schedule([&order, i] { order.push_back(i); });
+    }
+  }
+  EXPECT_THAT(order, ::testing::ElementsAre(0, 1, 2, 3, 4, 5, 6, 7, 8, 9));
+}
+
+}  // namespace
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
@@ -16,8 +16,11 @@
 
 #include <algorithm>
 #include <functional>
+#include <limits>
+#include <tuple>
 #include <vector>
 
+#include "absl/hash/hash.h"
 #include "absl/status/status.h"
 #include "absl/strings/str_cat.h"
 #include "absl/types/span.h"
@@ -150,7 +153,29 @@ absl::Status UnpackChunkColumn(const ChunkData& chunk_data, int column,
         " which has ", chunk_data.data().tensors_size(), " columns."));
   }
 
-  *out = DecompressTensorFromProto(chunk_data.data().tensors(column));
+  const auto& proto = chunk_data.data().tensors(column);
+  if (HasCompressedBlocks(chunk_data, column)) {
+    tensorflow::TensorShape shape(proto.tensor_shape());
+    if (shape.dims() == 0) {
+      return absl::DataLossError(absl::StrCat(
+          "Column ", column, " of chunk ", chunk_data.chunk_key(),
+          " is compressed in blocks but holds a scalar."));
+    }
+    *out = tensorflow::Tensor(proto.dtype(), shape);
+    REVERB_RETURN_IF_ERROR(DecompressRowsIntoBuffer(
+        proto, chunk_data.codec(), chunk_data.compressed_blocks(column), 0,
+        shape.dim_size(0), out));
+  } else {
+    *out = DecompressTensorFromProto(proto, chunk_data.codec());
+  }
+  if (HasDeduplicatedFrames(chunk_data, column)) {
+    REVERB_RETURN_IF_ERROR(ExpandDeduplicatedFrames(
+        *out, chunk_data.deduplicated_frames(column), out));
+  }
+  if (IsQuantized(chunk_data, column)) {
+    REVERB_RETURN_IF_ERROR(
+        DequantizeTensor(*out, chunk_data.quantized_columns(column), out));
+  }
   if (chunk_data.delta_encoded()) {
     *out = DeltaEncode(*out, /*encode=*/false);
   }
@@ -161,6 +186,32 @@ absl::Status UnpackChunkColumn(const ChunkData& chunk_data, int column,
 absl::Status UnpackChunkColumnAndSlice(const ChunkData& chunk_data, int column,
                                        int offset, int length,
                                        tensorflow::Tensor* out) {
+  // Only the blocks of rows covering the slice are decompressed. This is not
+  // possible for delta encoded chunks as every row depends on all the rows
+  // before it.
+  if (column >= 0 && column < chunk_data.data().tensors_size() &&
+      HasCompressedBlocks(chunk_data, column) &&
+      !chunk_data.delta_encoded()) {
+    const auto& proto = chunk_data.data().tensors(column);
+    tensorflow::TensorShape shape(proto.tensor_shape());
+    if (shape.dims() == 0 || offset < 0 || length < 0 ||
+        offset + length > shape.dim_size(0)) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Cannot slice (", offset, ", ", offset + length,
+          ") out of tensor with shape ", shape.DebugString(), "."));
+    }
+    shape.set_dim(0, length);
+    *out = tensorflow::Tensor(proto.dtype(), shape);
+    REVERB_RETURN_IF_ERROR(DecompressRowsIntoBuffer(
+        proto, chunk_data.codec(), chunk_data.compressed_blocks(column), offset,
+        length, out));
+    if (IsQuantized(chunk_data, column)) {
+      REVERB_RETURN_IF_ERROR(
+          DequantizeTensor(*out, chunk_data.quantized_columns(column), out));
+    }
+    return absl::OkStatus();
+  }
+
   REVERB_RETURN_IF_ERROR(UnpackChunkColumn(chunk_data, column, out));
 
   if (offset < 0 || offset + length > out->shape().dim_size(0)) {
@@ -188,6 +239,140 @@ int TimestepTrajectoryOffset(const FlatTrajectory& trajectory) {
   return trajectory.columns(0).chunk_slices(0).offset();
 }
 
+bool TrimChunk(const ChunkData& chunk_data,
+               absl::Span<FlatTrajectory::ChunkSlice* const> slices,
+               ChunkData* trimmed) {
+  if (slices.empty()) return false;
+
+  // Referenced columns (in order) and rows.
+  std::vector<int> columns;
+  int64_t row_begin = std::numeric_limits<int64_t>::max();
+  int64_t row_end = 0;
+  for (const auto* slice : slices) {
+    REVERB_CHECK_EQ(slice->chunk_key(), chunk_data.chunk_key());
+    if (slice->index() < 0 ||
+        slice->index() >= chunk_data.data().tensors_size()) {
+      return false;
+    }
+    columns.push_back(slice->index());
+    row_begin = std::min<int64_t>(row_begin, slice->offset());
+    row_end = std::max<int64_t>(row_end, slice->offset() + slice->length());
+  }
+  std::sort(columns.begin(), columns.end());
+  columns.erase(std::unique(columns.begin(), columns.end()), columns.end());
+
+  // Rows can only be dropped in whole blocks of the same size across columns.
+  int64_t rows_per_block = 0;
+  int64_t num_rows = -1;
+  bool trim_rows = !chunk_data.delta_encoded() &&
+                   !chunk_data.sequence_range().sparse() && row_end > row_begin;
+  for (int column : columns) {
+    const auto& shape = chunk_data.data().tensors(column).tensor_shape();
+    if (!trim_rows || !HasCompressedBlocks(chunk_data, column) ||
+        HasDeduplicatedFrames(chunk_data, column) || shape.dim_size() == 0) {
+      trim_rows = false;
+      break;
+    }
+    const int64_t column_rows_per_block =
+        chunk_data.compressed_blocks(column).rows_per_block();
+    if ((rows_per_block != 0 && column_rows_per_block != rows_per_block) ||
+        (num_rows != -1 && shape.dim(0).size() != num_rows)) {
+      trim_rows = false;
+      break;
+    }
+    rows_per_block = column_rows_per_block;
+    num_rows = shape.dim(0).size();
+  }
+
+  int64_t first_block = 0;
+  int64_t last_block = 0;
+  int64_t row_offset = 0;
+  int64_t kept_rows = num_rows;
+  if (trim_rows && rows_per_block > 0 && row_end <= num_rows) {
+    first_block = row_begin / rows_per_block;
+    last_block = (row_end - 1) / rows_per_block;
+    row_offset = first_block * rows_per_block;
+    kept_rows =
+        std::min(num_rows, (last_block + 1) * rows_per_block) - row_offset;
+  } else {
+    trim_rows = false;
+  }
+  if (trim_rows && kept_rows == num_rows) trim_rows = false;
+
+  if (!trim_rows && static_cast<int>(columns.size()) == chunk_data.data().tensors_size()) {
+    return false;
+  }
+
+  trimmed->Clear();
+  const auto trimmed_id = std::make_tuple(
+      chunk_data.chunk_key(), row_offset, trim_rows ? kept_rows : -1, columns);
+  trimmed->set_chunk_key(absl::Hash<decltype(trimmed_id)>{}(trimmed_id));
+  *trimmed->mutable_sequence_range() = chunk_data.sequence_range();
+  if (trim_rows) {
+    auto* range = trimmed->mutable_sequence_range();
+    range->set_start(range->start() + row_offset);
+    range->set_end(range->start() + kept_rows - 1);
+  }
+  trimmed->set_delta_encoded(chunk_data.delta_encoded());
+  trimmed->set_codec(chunk_data.codec());
+
+  for (int column : columns) {
+    const auto& proto = chunk_data.data().tensors(column);
+    auto* tensor = trimmed->mutable_data()->add_tensors();
+    if (!trim_rows) {
+      *tensor = proto;
+    } else {
+      const auto& blocks = chunk_data.compressed_blocks(column);
+      const int64_t byte_begin =
+          first_block == 0 ? 0 : blocks.block_ends(first_block - 1);
+      const int64_t byte_end = blocks.block_ends(last_block);
+      tensor->set_dtype(proto.dtype());
+      *tensor->mutable_tensor_shape() = proto.tensor_shape();
+      tensor->mutable_tensor_shape()->mutable_dim(0)->set_size(kept_rows);
+      tensor->set_tensor_content(
+          proto.tensor_content().substr(byte_begin, byte_end - byte_begin));
+    }
+
+    // The metadata is either empty or aligned with the columns.
+    if (!chunk_data.deduplicated_frames().empty()) {
+      *trimmed->add_deduplicated_frames() =
+          HasDeduplicatedFrames(chunk_data, column)
+              ? chunk_data.deduplicated_frames(column)
+              : ChunkData::DeduplicatedFrames();
+    }
+    if (!chunk_data.quantized_columns().empty()) {
+      *trimmed->add_quantized_columns() =
+          column < chunk_data.quantized_columns_size()
+              ? chunk_data.quantized_columns(column)
+              : ChunkData::QuantizedColumn();
+    }
+    if (!chunk_data.compressed_blocks().empty()) {
+      auto* blocks = trimmed->add_compressed_blocks();
+      if (column < chunk_data.compressed_blocks_size()) {
+        *blocks = chunk_data.compressed_blocks(column);
+      }
+      if (trim_rows) {
+        const auto& source = chunk_data.compressed_blocks(column);
+        const int64_t byte_begin =
+            first_block == 0 ? 0 : source.block_ends(first_block - 1);
+        blocks->clear_block_ends();
+        for (int64_t i = first_block; i <= last_block; i++) {
+          blocks->add_block_ends(source.block_ends(i) - byte_begin);
+        }
+      }
+    }
+  }
+
+  for (auto* slice : slices) {
+    slice->set_chunk_key(trimmed->chunk_key());
+    slice->set_offset(slice->offset() - row_offset);
+    slice->set_index(std::lower_bound(columns.begin(), columns.end(),
+                                      slice->index()) -
+                     columns.begin());
+  }
+  return true;
+}
+
 }  // namespace internal
 }  // namespace reverb
 }  // namespace deepmind
@@ -67,7 +67,9 @@ absl::Status UnpackChunkColumn(const ChunkData& chunk_data, int column,
                                tensorflow::Tensor* out);
 
 // Unpacks content of column (see `UnpackChunkColumn`) and returns an aligned
-// tensor of the desired slice,
+// tensor of the desired slice. If the column has been compressed in blocks (see
+// `CompressTensorAsBlocks`) then only the blocks covering the slice are
+// decompressed.
 absl::Status UnpackChunkColumnAndSlice(const ChunkData& chunk_data, int column,
                                        int offset, int length,
                                        tensorflow::Tensor* out);
@@ -78,6 +80,19 @@ absl::Status UnpackChunkColumnAndSlice(const ChunkData& chunk_data,
                                        const FlatTrajectory::ChunkSlice& slice,
                                        tensorflow::Tensor* out);
 
+// Builds in `trimmed` a copy of `chunk_data` which only holds the columns and
+// rows referenced by `slices`, all of which must reference `chunk_data`, and
+// rewrites `slices` to reference `trimmed` instead. Rows are only dropped when
+// every referenced column has been compressed in blocks of the same size (see
+// `CompressTensorAsBlocks`), in which case the blocks are copied without being
+// re-encoded. The key of `trimmed` is derived from the key of `chunk_data` and
+// the kept rows and columns so trimming a chunk the same way always yields the
+// same key. Returns false, leaving `slices` unchanged, if nothing would be
+// dropped.
+bool TrimChunk(const ChunkData& chunk_data,
+               absl::Span<FlatTrajectory::ChunkSlice* const> slices,
+               ChunkData* trimmed);
+
 }  // namespace internal
 }  // namespace reverb
 }  // namespace deepmind
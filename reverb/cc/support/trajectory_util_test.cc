@@ -255,6 +255,78 @@ TEST(UnpackChunkColumn, SelectsCorrectColumn) {
   test::ExpectTensorEqual<int32_t>(second_got, second_col_tensor);
 }
 
+TEST(TrimChunk, KeepsOnlyReferencedBlocksAndColumns) {
+  tensorflow::Tensor tensor(tensorflow::DT_INT32, {10, 2});
+  for (int i = 0; i < tensor.NumElements(); i++) {
+    tensor.flat<int32_t>()(i) = i;
+  }
+
+  ChunkData chunk;
+  chunk.set_chunk_key(1);
+  *chunk.mutable_sequence_range() = testing::MakeSequenceRange(5, 0, 9);
+  ASSERT_TRUE(CompressTensorAsBlocks(tensor, /*rows_per_block=*/3,
+                                     chunk.codec(),
+                                     chunk.mutable_data()->add_tensors(),
+                                     chunk.add_compressed_blocks()));
+  // The second column is never referenced.
+  CompressTensorAsProto(tensor, chunk.mutable_data()->add_tensors());
+  chunk.add_compressed_blocks();
+
+  FlatTrajectory::ChunkSlice slice;
+  slice.set_chunk_key(1);
+  slice.set_offset(4);
+  slice.set_length(3);
+  slice.set_index(0);
+  FlatTrajectory::ChunkSlice* slices[] = {&slice};
+
+  ChunkData trimmed;
+  ASSERT_TRUE(TrimChunk(chunk, slices, &trimmed));
+
+  // Rows 4-6 are held by the blocks covering rows 3-8.
+  EXPECT_NE(trimmed.chunk_key(), chunk.chunk_key());
+  EXPECT_EQ(trimmed.data().tensors_size(), 1);
+  EXPECT_EQ(trimmed.sequence_range().start(), 3);
+  EXPECT_EQ(trimmed.sequence_range().end(), 8);
+  EXPECT_EQ(slice.chunk_key(), trimmed.chunk_key());
+  EXPECT_EQ(slice.offset(), 1);
+  EXPECT_EQ(slice.index(), 0);
+
+  tensorflow::Tensor want(tensorflow::DT_INT32, {3, 2});
+  for (int i = 0; i < want.NumElements(); i++) {
+    want.flat<int32_t>()(i) = 8 + i;
+  }
+  tensorflow::Tensor got;
+  REVERB_ASSERT_OK(UnpackChunkColumnAndSlice(trimmed, slice, &got));
+  test::ExpectTensorEqual<int32_t>(got, want);
+
+  // The same trim of the chunk always gets the same key.
+  slice.set_chunk_key(1);
+  slice.set_offset(5);
+  slice.set_length(1);
+  ChunkData again;
+  ASSERT_TRUE(TrimChunk(chunk, slices, &again));
+  EXPECT_EQ(again.chunk_key(), trimmed.chunk_key());
+}
+
+TEST(TrimChunk, ReturnsFalseIfNothingCanBeDropped) {
+  tensorflow::Tensor tensor(tensorflow::DT_INT32, {10});
+  ChunkData chunk;
+  chunk.set_chunk_key(1);
+  *chunk.mutable_sequence_range() = testing::MakeSequenceRange(5, 0, 9);
+  CompressTensorAsProto(tensor, chunk.mutable_data()->add_tensors());
+
+  FlatTrajectory::ChunkSlice slice;
+  slice.set_chunk_key(1);
+  slice.set_offset(4);
+  slice.set_length(3);
+  FlatTrajectory::ChunkSlice* slices[] = {&slice};
+
+  ChunkData trimmed;
+  EXPECT_FALSE(TrimChunk(chunk, slices, &trimmed));
+  EXPECT_EQ(slice.chunk_key(), 1);
+  EXPECT_EQ(slice.offset(), 4);
+}
+
 }  // namespace
 }  // namespace internal
 }  // namespace reverb
@@ -0,0 +1,217 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "reverb/cc/support/workload_recorder.h"
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/memory/memory.h"
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "reverb/cc/platform/logging.h"
+#include "reverb/cc/platform/status_macros.h"
+#include "reverb/cc/support/tf_util.h"
+#include "reverb/cc/support/trajectory_util.h"
+#include "tensorflow/core/lib/io/record_reader.h"
+#include "tensorflow/core/platform/env.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+
+WorkloadRecorder::~WorkloadRecorder() {
+  if (auto status = Stop(); !status.ok()) {
+    REVERB_LOG(REVERB_ERROR) << "Failed to close workload trace: " << status;
+  }
+}
+
+absl::Status WorkloadRecorder::Start(const std::string& path,
+                                     std::vector<TableInfo> tables) {
+  absl::MutexLock lock(&mu_);
+  if (writer_ != nullptr) {
+    return absl::FailedPreconditionError(
+        "A workload recording is already in progress.");
+  }
+
+  std::unique_ptr<tensorflow::WritableFile> file;
+  REVERB_RETURN_IF_ERROR(FromTensorflowStatus(
+      tensorflow::Env::Default()->NewWritableFile(path, &file)));
+  auto writer = absl::make_unique<tensorflow::io::RecordWriter>(file.get());
+
+  WorkloadTraceHeader header;
+  for (auto& table : tables) {
+    // The state of the table is not needed to replay the requests.
+    table.clear_current_size();
+    table.clear_num_episodes();
+    table.clear_num_deleted_episodes();
+    *header.add_tables() = std::move(table);
+  }
+  REVERB_RETURN_IF_ERROR(FromTensorflowStatus(
+      writer->WriteRecord(header.SerializeAsString())));
+
+  file_ = std::move(file);
+  writer_ = std::move(writer);
+  start_ = absl::Now();
+  num_failed_writes_ = 0;
+  recording_.store(true, std::memory_order_relaxed);
+  REVERB_LOG(REVERB_INFO) << "Started recording the workload to " << path
+                          << ".";
+  return absl::OkStatus();
+}
+
+absl::Status WorkloadRecorder::Stop() {
+  absl::MutexLock lock(&mu_);
+  return StopLocked();
+}
+
+absl::Status WorkloadRecorder::StopLocked() {
+  if (writer_ == nullptr) return absl::OkStatus();
+  recording_.store(false, std::memory_order_relaxed);
+  if (num_failed_writes_ > 0) {
+    REVERB_LOG(REVERB_WARNING) << num_failed_writes_
+                               << " events could not be written to the "
+                                  "workload trace.";
+  }
+
+  absl::Status status = FromTensorflowStatus(writer_->Close());
+  writer_ = nullptr;
+  if (status.ok()) {
+    status = FromTensorflowStatus(file_->Close());
+  }
+  file_ = nullptr;
+  return status;
+}
+
+uint64_t WorkloadRecorder::NewStreamId() {
+  return next_stream_id_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void WorkloadRecorder::RecordChunk(uint64_t stream_id,
+                                   const ChunkData& chunk) {
+  if (!recording()) return;
+  WorkloadTraceEvent event;
+  event.set_stream_id(stream_id);
+  auto* recorded = event.mutable_chunk();
+  recorded->set_chunk_key(chunk.chunk_key());
+  recorded->set_num_rows(chunk.sequence_range().end() -
+                         chunk.sequence_range().start() + 1);
+  recorded->set_num_bytes(chunk.ByteSizeLong());
+  Write(&event);
+}
+
+void WorkloadRecorder::RecordItem(
+    uint64_t stream_id, const InsertStreamRequest::PriorityInsertion& item) {
+  if (!recording()) return;
+  WorkloadTraceEvent event;
+  event.set_stream_id(stream_id);
+  auto* recorded = event.mutable_item();
+  recorded->set_table(item.item().table());
+  recorded->set_key(item.item().key());
+  recorded->set_priority(item.item().priority());
+  for (uint64_t key : GetChunkKeys(item.item().flat_trajectory())) {
+    recorded->add_chunk_keys(key);
+  }
+  *recorded->mutable_keep_chunk_keys() = item.keep_chunk_keys();
+  recorded->set_keep_unreleased_chunks(item.keep_unreleased_chunks());
+  *recorded->mutable_released_chunk_keys() = item.released_chunk_keys();
+  recorded->set_send_confirmation(item.send_confirmation());
+  Write(&event);
+}
+
+void WorkloadRecorder::RecordSample(uint64_t stream_id,
+                                    const SampleStreamRequest& request) {
+  if (!recording()) return;
+  WorkloadTraceEvent event;
+  event.set_stream_id(stream_id);
+  auto* recorded = event.mutable_sample();
+  recorded->set_table(request.table());
+  recorded->set_num_samples(request.num_samples());
+  recorded->set_flexible_batch_size(request.flexible_batch_size());
+  recorded->set_max_cached_chunks(request.max_cached_chunks());
+  recorded->set_trim_chunks(request.trim_chunks());
+  Write(&event);
+}
+
+void WorkloadRecorder::RecordMutatePriorities(
+    const MutatePrioritiesRequest& request) {
+  if (!recording()) return;
+  WorkloadTraceEvent event;
+  *event.mutable_mutate_priorities() = request;
+  Write(&event);
+}
+
+void WorkloadRecorder::RecordReset(const ResetRequest& request) {
+  if (!recording()) return;
+  WorkloadTraceEvent event;
+  *event.mutable_reset() = request;
+  Write(&event);
+}
+
+void WorkloadRecorder::Write(WorkloadTraceEvent* event) {
+  absl::MutexLock lock(&mu_);
+  // The recording may have been stopped since `recording()` was checked.
+  if (writer_ == nullptr) return;
+  event->set_offset_us(absl::ToInt64Microseconds(absl::Now() - start_));
+  auto status =
+      FromTensorflowStatus(writer_->WriteRecord(event->SerializeAsString()));
+  if (!status.ok()) {
+    if (num_failed_writes_++ == 0) {
+      REVERB_LOG(REVERB_ERROR)
+          << "Failed to write to the workload trace: " << status;
+    }
+  }
+}
+
+absl::Status ReadWorkloadTrace(const std::string& path,
+                               WorkloadTraceHeader* header,
+                               std::vector<WorkloadTraceEvent>* events) {
+  std::unique_ptr<tensorflow::RandomAccessFile> file;
+  REVERB_RETURN_IF_ERROR(FromTensorflowStatus(
+      tensorflow::Env::Default()->NewRandomAccessFile(path, &file)));
+  tensorflow::io::RecordReader reader(file.get());
+
+  tensorflow::uint64 offset = 0;
+  tensorflow::tstring record;
+  REVERB_RETURN_IF_ERROR(
+      FromTensorflowStatus(reader.ReadRecord(&offset, &record)));
+  if (!header->ParseFromArray(record.data(), record.size())) {
+    return absl::DataLossError(
+        absl::StrCat("Could not parse the header of workload trace ", path,
+                     "."));
+  }
+
+  events->clear();
+  absl::Status status;
+  while ((status = FromTensorflowStatus(reader.ReadRecord(&offset, &record)))
+             .ok()) {
+    events->emplace_back();
+    if (!events->back().ParseFromArray(record.data(), record.size())) {
+      return absl::DataLossError(absl::StrCat(
+          "Could not parse event ", events->size(), " of workload trace ",
+          path, "."));
+    }
+  }
+  return absl::IsOutOfRange(status) ? absl::OkStatus() : status;
+}
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
@@ -0,0 +1,119 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef REVERB_CC_SUPPORT_WORKLOAD_RECORDER_H_
+#define REVERB_CC_SUPPORT_WORKLOAD_RECORDER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/status/status.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "reverb/cc/reverb_service.pb.h"
+#include "reverb/cc/schema.pb.h"
+#include "reverb/cc/support/workload_trace.pb.h"
+#include "tensorflow/core/lib/io/record_writer.h"
+#include "tensorflow/core/platform/file_system.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+
+// Records the requests received by a service into a workload trace (see
+// `WorkloadTraceEvent`) so that the traffic of a production server can be
+// replayed against another server (see `tools::WorkloadReplayer`).
+//
+// The recorder is owned by the service and the handlers call the `Record*`
+// methods for every request they receive. The methods return immediately
+// unless a recording has been started with `Start`, so the recorder costs a
+// single relaxed load per request when it is idle. Failures to write the trace
+// are logged and never fail the requests.
+//
+// This object is thread-safe.
+class WorkloadRecorder {
+ public:
+  WorkloadRecorder() = default;
+
+  // Stops the recording in progress, if any.
+  ~WorkloadRecorder();
+
+  // Starts writing a trace to `path`, beginning with a header which holds
+  // `tables`. Returns `FailedPrecondition` if a recording is already in
+  // progress.
+  absl::Status Start(const std::string& path, std::vector<TableInfo> tables)
+      ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Stops the recording in progress, if any, and closes the trace.
+  absl::Status Stop() ABSL_LOCKS_EXCLUDED(mu_);
+
+  bool recording() const {
+    return recording_.load(std::memory_order_relaxed);
+  }
+
+  // Returns a new id for a stream. Ids are positive and unique for the
+  // lifetime of the recorder.
+  uint64_t NewStreamId();
+
+  // Records a chunk received by the insert stream `stream_id`.
+  void RecordChunk(uint64_t stream_id, const ChunkData& chunk)
+      ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Records an item received by the insert stream `stream_id`. The trajectory
+  // of the item must have been expanded (see `ExpandAssembledTrajectory`).
+  void RecordItem(uint64_t stream_id,
+                  const InsertStreamRequest::PriorityInsertion& item)
+      ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Records a request received by the sample stream `stream_id`.
+  void RecordSample(uint64_t stream_id, const SampleStreamRequest& request)
+      ABSL_LOCKS_EXCLUDED(mu_);
+
+  void RecordMutatePriorities(const MutatePrioritiesRequest& request)
+      ABSL_LOCKS_EXCLUDED(mu_);
+
+  void RecordReset(const ResetRequest& request) ABSL_LOCKS_EXCLUDED(mu_);
+
+ private:
+  // Sets the offset of `event` and appends it to the trace.
+  void Write(WorkloadTraceEvent* event) ABSL_LOCKS_EXCLUDED(mu_);
+
+  absl::Status StopLocked() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  std::atomic<bool> recording_{false};
+  std::atomic<uint64_t> next_stream_id_{1};
+
+  absl::Mutex mu_;
+  absl::Time start_ ABSL_GUARDED_BY(mu_);
+  std::unique_ptr<tensorflow::WritableFile> file_ ABSL_GUARDED_BY(mu_);
+  std::unique_ptr<tensorflow::io::RecordWriter> writer_ ABSL_GUARDED_BY(mu_);
+  int64_t num_failed_writes_ ABSL_GUARDED_BY(mu_) = 0;
+};
+
+// Reads a trace written by `WorkloadRecorder`. The events are returned in the
+// order they were recorded, i.e. by increasing `offset_us`.
+absl::Status ReadWorkloadTrace(const std::string& path,
+                               WorkloadTraceHeader* header,
+                               std::vector<WorkloadTraceEvent>* events);
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_SUPPORT_WORKLOAD_RECORDER_H_
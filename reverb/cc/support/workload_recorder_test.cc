@@ -0,0 +1,159 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "reverb/cc/support/workload_recorder.h"
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "reverb/cc/platform/status_matchers.h"
+#include "reverb/cc/reverb_service.pb.h"
+#include "reverb/cc/schema.pb.h"
+#include "reverb/cc/support/workload_trace.pb.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+namespace {
+
+using ::testing::ElementsAre;
+
+std::string TracePath(const std::string& name) {
+  const char* dir = std::getenv("TEST_TMPDIR");
+  return absl::StrCat(dir != nullptr ? dir : "/tmp", "/", name);
+}
+
+TEST(WorkloadRecorderTest, RecordsEventsInOrder) {
+  WorkloadRecorder recorder;
+  const uint64_t insert_stream = recorder.NewStreamId();
+  const uint64_t sample_stream = recorder.NewStreamId();
+  EXPECT_GT(insert_stream, 0);
+  EXPECT_NE(insert_stream, sample_stream);
+
+  TableInfo table;
+  table.set_name("dist");
+  table.set_max_size(10);
+  table.set_current_size(5);
+  REVERB_ASSERT_OK(
+      recorder.Start(TracePath("records_events_in_order"), {table}));
+  EXPECT_TRUE(recorder.recording());
+
+  ChunkData chunk;
+  chunk.set_chunk_key(1);
+  chunk.mutable_sequence_range()->set_start(10);
+  chunk.mutable_sequence_range()->set_end(14);
+  recorder.RecordChunk(insert_stream, chunk);
+
+  InsertStreamRequest::PriorityInsertion item;
+  item.mutable_item()->set_table("dist");
+  item.mutable_item()->set_key(2);
+  item.mutable_item()->set_priority(0.5);
+  auto* slice = item.mutable_item()
+                    ->mutable_flat_trajectory()
+                    ->add_columns()
+                    ->add_chunk_slices();
+  slice->set_chunk_key(1);
+  slice->set_length(5);
+  item.add_keep_chunk_keys(1);
+  item.set_send_confirmation(true);
+  recorder.RecordItem(insert_stream, item);
+
+  SampleStreamRequest sample;
+  sample.set_table("dist");
+  sample.set_num_samples(3);
+  sample.set_flexible_batch_size(-1);
+  recorder.RecordSample(sample_stream, sample);
+
+  MutatePrioritiesRequest mutation;
+  mutation.set_table("dist");
+  mutation.add_delete_keys(2);
+  recorder.RecordMutatePriorities(mutation);
+
+  ResetRequest reset;
+  reset.set_table("dist");
+  recorder.RecordReset(reset);
+
+  REVERB_ASSERT_OK(recorder.Stop());
+  EXPECT_FALSE(recorder.recording());
+
+  // Requests received after the recording stopped are not recorded.
+  recorder.RecordReset(reset);
+
+  WorkloadTraceHeader header;
+  std::vector<WorkloadTraceEvent> events;
+  REVERB_ASSERT_OK(ReadWorkloadTrace(TracePath("records_events_in_order"),
+                                     &header, &events));
+  ASSERT_EQ(header.tables_size(), 1);
+  EXPECT_EQ(header.tables(0).name(), "dist");
+  EXPECT_EQ(header.tables(0).max_size(), 10);
+  EXPECT_EQ(header.tables(0).current_size(), 0);
+
+  ASSERT_EQ(events.size(), 5);
+  for (int i = 1; i < events.size(); i++) {
+    EXPECT_GE(events[i].offset_us(), events[i - 1].offset_us());
+  }
+
+  EXPECT_EQ(events[0].stream_id(), insert_stream);
+  EXPECT_EQ(events[0].chunk().chunk_key(), 1);
+  EXPECT_EQ(events[0].chunk().num_rows(), 5);
+  EXPECT_EQ(events[0].chunk().num_bytes(), chunk.ByteSizeLong());
+
+  EXPECT_EQ(events[1].stream_id(), insert_stream);
+  EXPECT_EQ(events[1].item().table(), "dist");
+  EXPECT_EQ(events[1].item().key(), 2);
+  EXPECT_EQ(events[1].item().priority(), 0.5);
+  EXPECT_THAT(events[1].item().chunk_keys(), ElementsAre(1));
+  EXPECT_THAT(events[1].item().keep_chunk_keys(), ElementsAre(1));
+  EXPECT_TRUE(events[1].item().send_confirmation());
+
+  EXPECT_EQ(events[2].stream_id(), sample_stream);
+  EXPECT_EQ(events[2].sample().num_samples(), 3);
+  EXPECT_EQ(events[2].sample().flexible_batch_size(), -1);
+
+  EXPECT_EQ(events[3].stream_id(), 0);
+  EXPECT_THAT(events[3].mutate_priorities().delete_keys(), ElementsAre(2));
+
+  EXPECT_EQ(events[4].reset().table(), "dist");
+}
+
+TEST(WorkloadRecorderTest, StartFailsWhileRecording) {
+  WorkloadRecorder recorder;
+  REVERB_ASSERT_OK(
+      recorder.Start(TracePath("start_fails_while_recording"), {}));
+  EXPECT_EQ(
+      recorder.Start(TracePath("start_fails_while_recording_2"), {}).code(),
+      absl::StatusCode::kFailedPrecondition);
+  REVERB_ASSERT_OK(recorder.Stop());
+
+  // Stopping an idle recorder is a no-op.
+  REVERB_EXPECT_OK(recorder.Stop());
+}
+
+TEST(WorkloadRecorderTest, ReadFailsIfTraceDoesNotExist) {
+  WorkloadTraceHeader header;
+  std::vector<WorkloadTraceEvent> events;
+  EXPECT_FALSE(
+      ReadWorkloadTrace(TracePath("does_not_exist"), &header, &events).ok());
+}
+
+}  // namespace
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
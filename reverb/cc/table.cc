@@ -17,14 +17,17 @@
 #include <algorithm>
 #include <cstddef>
 #include <initializer_list>
+#include <iterator>
 #include <memory>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "google/protobuf/duration.pb.h"
 #include "google/protobuf/timestamp.pb.h"
 #include <cstdint>
 #include "absl/memory/memory.h"
+#include "absl/random/random.h"
 #include "absl/status/status.h"
 #include "absl/strings/str_cat.h"
 #include "absl/synchronization/mutex.h"
@@ -33,13 +36,20 @@
 #include "absl/types/span.h"
 #include "reverb/cc/checkpointing/checkpoint.pb.h"
 #include "reverb/cc/chunk_store.h"
+#include "reverb/cc/errors.h"
 #include "reverb/cc/platform/hash_map.h"
 #include "reverb/cc/platform/hash_set.h"
 #include "reverb/cc/platform/logging.h"
+#include "reverb/cc/platform/numa.h"
 #include "reverb/cc/platform/status_macros.h"
+#include "reverb/cc/platform/thread.h"
 #include "reverb/cc/rate_limiter.h"
 #include "reverb/cc/schema.pb.h"
+#include "reverb/cc/selectors/dispatch.h"
 #include "reverb/cc/selectors/interface.h"
+#include "reverb/cc/selectors/prioritized.h"
+#include "reverb/cc/support/latency_histogram.h"
+#include "reverb/cc/support/periodic_closure.h"
 #include "reverb/cc/support/trajectory_util.h"
 #include "reverb/cc/table_extensions/interface.h"
 
@@ -49,11 +59,34 @@ namespace {
 
 using Extensions = std::vector<std::shared_ptr<TableExtension>>;
 
-inline bool IsInsertedBefore(const PrioritizedItem& a,
-                             const PrioritizedItem& b) {
-  return a.inserted_at().seconds() < b.inserted_at().seconds() ||
-         (a.inserted_at().seconds() == b.inserted_at().seconds() &&
-          a.inserted_at().nanos() < b.inserted_at().nanos());
+// Indexed by `Table::LockOperation`.
+constexpr const char* kLockOperationNames[] = {
+    "insert",       "sample", "mutate", "info", "reset", "checkpoint",
+    "async_worker", "expire", "export",
+};
+
+// Sorts `entries` in ascending order of their insertion time.
+void SortByInsertionTime(
+    std::vector<std::pair<Table::Key, Table::StoredItem>>* entries) {
+  std::sort(entries->begin(), entries->end(),
+            [](const auto& a, const auto& b) {
+              return a.second.inserted_at_ns < b.second.inserted_at_ns;
+            });
+}
+
+// Maximum number of items which `ExpireItems` inspects (and deletes) each time
+// it acquires the lock of the table.
+constexpr int kMaxExpiredItemsPerLock = 128;
+
+// The expired items are deleted at most `kMaxExpirySweepPeriod` (or a tenth of
+// `max_age` if shorter) after they expired.
+constexpr absl::Duration kMaxExpirySweepPeriod = absl::Seconds(1);
+
+inline void EncodeAsDurationProto(const absl::Duration& d,
+                                  google::protobuf::Duration* proto) {
+  proto->set_seconds(absl::ToInt64Seconds(d));
+  proto->set_nanos(
+      absl::ToInt64Nanoseconds(d - absl::Seconds(proto->seconds())));
 }
 
 inline void EncodeAsTimestampProto(absl::Time t,
@@ -63,6 +96,30 @@ inline void EncodeAsTimestampProto(absl::Time t,
   proto->set_nanos((t - absl::FromUnixSeconds(s)) / absl::Nanoseconds(1));
 }
 
+inline int64_t DecodeTimestampProtoAsNanos(
+    const google::protobuf::Timestamp& proto) {
+  return proto.seconds() * 1000000000 + proto.nanos();
+}
+
+// Converts `item` into its stored representation. The key and table name are
+// not part of the stored item.
+inline Table::StoredItem ToStoredItem(Table::Item item) {
+  auto data = std::make_shared<Table::StoredItem::Data>();
+  item.item.flat_trajectory().SerializeToString(&data->trajectory);
+  data->chunks.assign(std::make_move_iterator(item.chunks.begin()),
+                      std::make_move_iterator(item.chunks.end()));
+  for (const auto& chunk : data->chunks) {
+    data->chunk_bytes += chunk->DataByteSizeLong();
+  }
+
+  Table::StoredItem stored;
+  stored.data = std::move(data);
+  stored.priority = item.item.priority();
+  stored.inserted_at_ns = DecodeTimestampProtoAsNanos(item.item.inserted_at());
+  stored.times_sampled = item.item.times_sampled();
+  return stored;
+}
+
 inline absl::Status CheckItemValidity(const Table::Item& item) {
   if (item.item.flat_trajectory().columns().empty() ||
       item.item.flat_trajectory().columns(0).chunk_slices().empty()) {
@@ -88,33 +145,105 @@ inline absl::Status CheckItemValidity(const Table::Item& item) {
   return absl::OkStatus();
 }
 
+// Calls `fn` once for every distinct episode referenced by the chunks of
+// `data`. Items only reference a handful of chunks so the quadratic scan is
+// cheaper than building a set.
+template <typename Fn>
+void ForEachDistinctEpisode(const Table::StoredItem::Data& data, Fn fn) {
+  const auto& chunks = data.chunks;
+  for (int i = 0; i < chunks.size(); i++) {
+    const uint64_t episode_id = chunks[i]->episode_id();
+    bool seen = false;
+    for (int j = 0; j < i && !seen; j++) {
+      seen = chunks[j]->episode_id() == episode_id;
+    }
+    if (!seen) fn(episode_id);
+  }
+}
+
 }  // namespace
 
+template <typename Fn>
+absl::Status Table::ForEachSelector(Fn fn) {
+  REVERB_RETURN_IF_ERROR(
+      internal::VisitSelector(sampler_kind_, sampler_.get(), fn));
+  return internal::VisitSelector(remover_kind_, remover_.get(), fn);
+}
+
 Table::Table(std::string name, std::shared_ptr<ItemSelector> sampler,
              std::shared_ptr<ItemSelector> remover, int64_t max_size,
              int32_t max_times_sampled, std::shared_ptr<RateLimiter> rate_limiter,
              Extensions extensions,
-             absl::optional<tensorflow::StructuredValue> signature)
+             absl::optional<tensorflow::StructuredValue> signature,
+             int64_t max_chunk_bytes, absl::Duration max_age,
+             bool index_episodes)
     : sampler_(std::move(sampler)),
       remover_(std::move(remover)),
+      sampler_options_(sampler_->options()),
+      remover_options_(remover_->options()),
+      sampler_kind_(sampler_->kind()),
+      remover_kind_(remover_->kind()),
+      sampler_supports_shared_(sampler_->SupportsSampleShared()),
+      index_episodes_(index_episodes),
       num_deleted_episodes_(0),
+      num_items_(0),
+      num_episodes_(0),
       max_size_(max_size),
+      max_chunk_bytes_(max_chunk_bytes),
+      max_age_(max_age),
       max_times_sampled_(max_times_sampled),
       name_(std::move(name)),
       rate_limiter_(std::move(rate_limiter)),
       extensions_(std::move(extensions)),
       signature_(std::move(signature)) {
-  REVERB_CHECK_OK(rate_limiter_->RegisterTable(this));
+  REVERB_CHECK_OK(rate_limiter_->RegisterTable(&mu_, this));
   for (auto& extension : extensions_) {
     REVERB_CHECK_OK(extension->RegisterTable(&mu_, this));
   }
+
+  REVERB_CHECK_GT(max_age_, absl::ZeroDuration());
+  if (max_age_ != absl::InfiniteDuration()) {
+    expiry_sweeper_ = absl::make_unique<internal::PeriodicClosure>(
+        [this] { ExpireItems(); },
+        std::min(max_age_ / 10, kMaxExpirySweepPeriod), "ExpirySweeper");
+    REVERB_CHECK_OK(expiry_sweeper_->Start());
+  }
 }
 
 Table::~Table() {
+  if (expiry_sweeper_ != nullptr) {
+    REVERB_CHECK_OK(expiry_sweeper_->Stop());
+  }
+
+  // Pending asynchronous requests are completed (with a Cancelled-status) by
+  // the worker before it exits.
+  {
+    absl::MutexLock lock(&mu_);
+    async_worker_stopped_ = true;
+  }
+  async_worker_ = nullptr;
+
   rate_limiter_->UnregisterTable(&mu_, this);
   for (auto& extension : extensions_) {
     extension->UnregisterTable(&mu_, this);
   }
+
+  // The chunks may outlive the table (e.g. when shared with other tables).
+  absl::MutexLock lock(&mu_);
+  ReleaseChunkReferencesLocked(data_);
+}
+
+void Table::ReleaseChunkReferencesLocked(
+    const internal::flat_hash_map<Key, StoredItem>& items) {
+  for (const auto& key_and_item : items) {
+    for (const auto& chunk : key_and_item.second.data->chunks) {
+      if (chunk_refs_.erase(chunk->key()) > 0) {
+        chunk->RemoveTableReference();
+      }
+    }
+  }
+  REVERB_CHECK(chunk_refs_.empty());
+  chunk_bytes_ = 0;
 }
 
 std::vector<Table::Item> Table::Copy(size_t count) const {
@@ -123,7 +252,7 @@ std::vector<Table::Item> Table::Copy(size_t count) const {
   items.reserve(count == 0 ? data_.size() : count);
   for (auto it = data_.cbegin();
        it != data_.cend() && (count == 0 || items.size() < count); it++) {
-    items.push_back(it->second);
+    items.push_back(ToItem(it->first, it->second));
   }
   return items;
 }
@@ -131,76 +260,385 @@ std::vector<Table::Item> Table::Copy(size_t count) const {
 absl::Status Table::InsertOrAssign(Item item) {
   REVERB_RETURN_IF_ERROR(CheckItemValidity(item));
 
+  // If items are deleted as part of the insert then we keep the data alive
+  // until the lock has been released.
+  std::vector<StoredItem> deleted_items;
+  absl::Status status;
+  {
+    internal::TimedMutexLock lock(&mu_, &latency_.lock[kInsertLock]);
+    status = InsertOrAssignLocked(std::move(item), kDefaultTimeout,
+                                  &deleted_items);
+  }
+
+  if (!deleted_items.empty()) {
+    Reclaim(std::move(deleted_items));
+  }
+
+  return status;
+}
+
+absl::Status Table::InsertOrAssignLocked(
+    Item item, absl::Duration timeout, std::vector<StoredItem>* deleted_items) {
+  REVERB_RETURN_IF_ERROR(CheckNotFrozen());
   auto key = item.item.key();
   auto priority = item.item.priority();
 
-  // If an item is deleted as part of the insert then we keep the data alive
-  // until the lock has been released.
-  Item deleted_item;
+  /// If item already exists in table then update its priority.
+  if (data_.contains(key)) {
+    return UpdateItem(key, priority);
+  }
+
+  // Wait for the insert to be staged. While waiting the lock is released but
+  // once it returns the lock is acquired again. While waiting for the right
+  // to insert the operation might have transformed into an update.
   {
-    absl::MutexLock lock(&mu_);
+    internal::ScopedExcludeFromLockHold exclude;
+    REVERB_RETURN_IF_ERROR(rate_limiter_->AwaitCanInsert(&mu_, timeout));
+  }
+
+  if (data_.contains(key)) {
+    // If the insert was transformed into an update while waiting we need to
+    // notify the limiter so it let another insert call to proceed.
+    rate_limiter_->WakeWaiters(&mu_);
+    return UpdateItem(key, priority);
+  }
+
+  // Set the insertion timestamp after the lock has been acquired as this
+  // represents the order it was inserted into the sampler and remover.
+  return InsertNewItem(std::move(item), NowNanos(), deleted_items);
+}
 
-    /// If item already exists in table then update its priority.
-    if (data_.contains(key)) {
-      return UpdateItem(key, priority);
+void Table::InsertOrAssignAsync(Item item, InsertCallback callback,
+                                absl::Duration timeout) {
+  if (auto status = CheckItemValidity(item); !status.ok()) {
+    callback(std::move(status));
+    return;
+  }
+
+  std::vector<StoredItem> deleted_items;
+  absl::Status status;
+  {
+    internal::TimedMutexLock lock(&mu_, &latency_.lock[kInsertLock]);
+
+    // Requests are completed in the order they were received so the insert
+    // can only be executed inline if no other insert is waiting.
+    if (!pending_inserts_.empty() || !CanInsertOrAssignLocked(item) ||
+        IsPacedLocked(&item, absl::Now())) {
+      pending_inserts_.push_back({
+          .item = std::move(item),
+          .callback = std::move(callback),
+          .deadline = absl::Now() + timeout,
+      });
+      MaybeStartAsyncWorker();
+      return;
     }
 
-    // Wait for the insert to be staged. While waiting the lock is released but
-    // once it returns the lock is acquired again. While waiting for the right
-    // to insert the operation might have transformed into an update.
-    REVERB_RETURN_IF_ERROR(rate_limiter_->AwaitCanInsert(&mu_));
+    status = InsertOrAssignLocked(std::move(item), absl::ZeroDuration(),
+                                  &deleted_items);
+  }
+
+  if (!deleted_items.empty()) {
+    Reclaim(std::move(deleted_items));
+  }
+  callback(std::move(status));
+}
 
-    if (data_.contains(key)) {
-      // If the insert was transformed into an update while waiting we need to
-      // notify the limiter so it let another insert call to proceed.
-      rate_limiter_->MaybeSignalCondVars(&mu_);
-      return UpdateItem(key, priority);
+void Table::InsertOrAssignBatchAsync(std::vector<Item> items,
+                                     std::vector<InsertCallback> callbacks,
+                                     absl::Duration timeout) {
+  REVERB_CHECK_EQ(items.size(), callbacks.size());
+
+  // The results of the items executed inline (or rejected as invalid) are
+  // reported once the lock has been released.
+  std::vector<absl::Status> statuses(items.size());
+  std::vector<bool> completed(items.size(), false);
+  for (int i = 0; i < items.size(); i++) {
+    if (auto status = CheckItemValidity(items[i]); !status.ok()) {
+      statuses[i] = std::move(status);
+      completed[i] = true;
     }
+  }
 
-    // Set the insertion timestamp after the lock has been acquired as this
-    // represents the order it was inserted into the sampler and remover.
-    EncodeAsTimestampProto(absl::Now(), item.item.mutable_inserted_at());
-    data_[key] = std::move(item);
+  std::vector<StoredItem> deleted_items;
+  {
+    internal::TimedMutexLock lock(&mu_, &latency_.lock[kInsertLock]);
+    const absl::Time deadline = absl::Now() + timeout;
+    bool queued = false;
+    for (int i = 0; i < items.size(); i++) {
+      if (completed[i]) continue;
+
+      // Once an item has been queued all following items must be queued as
+      // well to preserve the order of the batch.
+      if (!pending_inserts_.empty() || !CanInsertOrAssignLocked(items[i]) ||
+          IsPacedLocked(&items[i], absl::Now())) {
+        pending_inserts_.push_back({
+            .item = std::move(items[i]),
+            .callback = std::move(callbacks[i]),
+            .deadline = deadline,
+        });
+        queued = true;
+        continue;
+      }
 
-    REVERB_RETURN_IF_ERROR(sampler_->Insert(key, priority));
-    REVERB_RETURN_IF_ERROR(remover_->Insert(key, priority));
+      statuses[i] = InsertOrAssignLocked(
+          std::move(items[i]), absl::ZeroDuration(), &deleted_items);
+      completed[i] = true;
+    }
+    if (queued) {
+      MaybeStartAsyncWorker();
+    }
+  }
 
-    auto it = data_.find(key);
-    for (auto& extension : extensions_) {
-      extension->OnInsert(&mu_, it->second);
+  if (!deleted_items.empty()) {
+    Reclaim(std::move(deleted_items));
+  }
+  for (int i = 0; i < items.size(); i++) {
+    if (completed[i]) {
+      callbacks[i](std::move(statuses[i]));
+    }
+  }
+}
+
+absl::Status Table::InsertOrAssignBatch(std::vector<Item> items) {
+  for (const auto& item : items) {
+    REVERB_RETURN_IF_ERROR(CheckItemValidity(item));
+  }
+
+  // Items deleted as part of the inserts are kept alive until the lock has
+  // been released.
+  std::vector<StoredItem> deleted_items;
+  {
+    internal::TimedMutexLock lock(&mu_, &latency_.lock[kInsertLock]);
+    REVERB_RETURN_IF_ERROR(CheckNotFrozen());
+
+    // Number of inserts that the rate limiter allows to proceed without the
+    // lock being released.
+    int num_approved = 0;
+
+    // The clock is only read when the lock has (potentially) been released.
+    // Items inserted without releasing the lock are still given increasing
+    // timestamps by `InsertNewItem`.
+    int64_t now_ns = 0;
+
+    for (int i = 0; i < items.size(); i++) {
+      const auto key = items[i].item.key();
+      const auto priority = items[i].item.priority();
+
+      if (!data_.contains(key) && num_approved == 0) {
+        // While waiting for the insert to be approved the lock may have been
+        // released so another thread might have inserted the key.
+        internal::ScopedExcludeFromLockHold exclude;
+        REVERB_RETURN_IF_ERROR(rate_limiter_->AwaitCanInsertBatch(
+            &mu_, items.size() - i, &num_approved));
+        now_ns = NowNanos();
+      }
+
+      if (data_.contains(key)) {
+        REVERB_RETURN_IF_ERROR(UpdateItem(key, priority));
+        continue;
+      }
+
+      REVERB_RETURN_IF_ERROR(
+          InsertNewItem(std::move(items[i]), now_ns, &deleted_items));
+      num_approved--;
+    }
+
+    // If some approved inserts turned into updates then the limiter must be
+    // notified so it can let other insert calls proceed.
+    if (num_approved > 0) {
+      rate_limiter_->WakeWaiters(&mu_);
+    }
+  }
+
+  if (!deleted_items.empty()) {
+    Reclaim(std::move(deleted_items));
+  }
+
+  return absl::OkStatus();
+}
+
+absl::Status Table::InsertNewItem(Item item, int64_t now_ns,
+                                  std::vector<StoredItem>* deleted_items) {
+  const auto key = item.item.key();
+  StoredItem stored = ToStoredItem(std::move(item));
+  num_inserted_bytes_.fetch_add(stored.data->chunk_bytes,
+                                std::memory_order_relaxed);
+  last_inserted_at_ns_ = std::max(now_ns, last_inserted_at_ns_ + 1);
+  stored.inserted_at_ns = last_inserted_at_ns_;
+
+  // The item must be fully inserted (including the episode references) before
+  // a possible call to DeleteItem since the remover can return this key.
+  REVERB_RETURN_IF_ERROR(InsertStoredItem(key, std::move(stored)));
+  return FinalizeInsert(deleted_items);
+}
+
+absl::Status Table::FinalizeInsert(std::vector<StoredItem>* deleted_items) {
+  // Remove an item if we exceeded `max_size_`.
+  if (data_.size() > max_size_) {
+    deleted_items->emplace_back();
+    REVERB_RETURN_IF_ERROR(
+        DeleteItem(SelectItemToRemove(), &deleted_items->back()));
+  }
+
+  // Remove items until the referenced chunks fit within `max_chunk_bytes_`.
+  while (max_chunk_bytes_ > 0 && chunk_bytes_ > max_chunk_bytes_ &&
+         !data_.empty()) {
+    deleted_items->emplace_back();
+    REVERB_RETURN_IF_ERROR(
+        DeleteItem(SelectItemToRemove(), &deleted_items->back()));
+  }
+
+  // Now that the new item has been inserted and an older item has
+  // (potentially) been removed the insert can be finalized.
+  rate_limiter_->Insert(&mu_);
+
+  return absl::OkStatus();
+}
+
+Table::Key Table::SelectItemToRemove() {
+  internal::ScopedLatencyTimer timer(&latency_.selector);
+  return slot_keys_[internal::VisitSelector(remover_kind_, remover_.get(),
+                                            [](auto* remover) {
+                                              return remover->Sample();
+                                            })
+                        .key];
+}
+
+void Table::ExpireItems() {
+  bool done = false;
+  while (!done) {
+    std::vector<StoredItem> deleted_items;
+    absl::Status status;
+    {
+      internal::TimedMutexLock lock(&mu_, &latency_.lock[kExpireLock]);
+      const int64_t expired_before_ns =
+          absl::GetCurrentTimeNanos() - absl::ToInt64Nanoseconds(max_age_);
+      int num_inspected = 0;
+      while (!age_index_.empty() &&
+             age_index_.front().first < expired_before_ns &&
+             num_inspected++ < kMaxExpiredItemsPerLock) {
+        const int64_t inserted_at_ns = age_index_.front().first;
+        const Key key = age_index_.front().second;
+        age_index_.pop_front();
+
+        // Skip the entries of items which have already been deleted (and
+        // possibly reinserted since).
+        auto it = data_.find(key);
+        if (it == data_.end() || it->second.inserted_at_ns != inserted_at_ns) {
+          continue;
+        }
+
+        deleted_items.emplace_back();
+        status = DeleteItem(key, &deleted_items.back());
+        if (!status.ok()) break;
+        num_expired_items_.fetch_add(1, std::memory_order_relaxed);
+      }
+      done = !status.ok() || age_index_.empty() ||
+             age_index_.front().first >= expired_before_ns;
     }
 
-    // Increment references to the episode/s the item is referencing.
-    // We increment before a possible call to DeleteItem since the sampler can
-    // return this key.
-    for (const auto& chunk : it->second.chunks) {
-      ++episode_refs_[chunk->episode_id()];
+    if (!deleted_items.empty()) {
+      Reclaim(std::move(deleted_items));
     }
+    if (!status.ok()) {
+      REVERB_LOG(REVERB_ERROR) << "Failed to delete expired items from table "
+                               << name_ << ": " << status;
+    }
+  }
+}
 
-    // Remove an item if we exceeded `max_size_`.
-    if (data_.size() > max_size_) {
-      REVERB_RETURN_IF_ERROR(DeleteItem(remover_->Sample().key, &deleted_item));
+absl::Status Table::InsertStoredItem(
+    Key key, StoredItem stored,
+    std::vector<KeyWithPriority>* selector_inserts) {
+  REVERB_RETURN_IF_ERROR(CheckNotFrozen());
+  const auto priority = stored.priority;
+  if (free_slots_.empty()) {
+    stored.slot = slot_keys_.size();
+    slot_keys_.push_back(key);
+  } else {
+    stored.slot = free_slots_.back();
+    free_slots_.pop_back();
+    slot_keys_[stored.slot] = key;
+  }
+  const Key slot = stored.slot;
+  if (max_age_ != absl::InfiniteDuration()) {
+    age_index_.emplace_back(stored.inserted_at_ns, key);
+  }
+  auto it = data_.emplace(key, std::move(stored)).first;
+
+  if (selector_inserts != nullptr) {
+    selector_inserts->emplace_back();
+    selector_inserts->back().set_key(slot);
+    selector_inserts->back().set_priority(priority);
+  } else {
+    internal::ScopedLatencyTimer timer(&latency_.selector);
+    REVERB_RETURN_IF_ERROR(ForEachSelector(
+        [&](auto* selector) { return selector->Insert(slot, priority); }));
+  }
+
+  if (!extensions_.empty()) {
+    internal::ScopedLatencyTimer timer(&latency_.extensions);
+    const TableItemView item = ToItemView(key, it->second);
+    for (auto& extension : extensions_) {
+      extension->OnInsert(&mu_, item);
     }
+  }
 
-    // Now that the new item has been inserted and an older item has
-    // (potentially) been removed the insert can be finalized.
-    rate_limiter_->Insert(&mu_);
+  // Increment references to the episode/s and chunks the item is referencing.
+  for (const auto& chunk : it->second.data->chunks) {
+    ++episode_refs_[chunk->episode_id()];
+    if (++chunk_refs_[chunk->key()] == 1) {
+      chunk_bytes_ += chunk->DataByteSizeLong();
+      chunk->AddTableReference();
+    }
+  }
+  if (index_episodes_) {
+    ForEachDistinctEpisode(*it->second.data, [&](uint64_t episode_id) {
+      episode_index_[episode_id].push_back(key);
+    });
   }
+  PublishStats();
 
   return absl::OkStatus();
 }
 
+PrioritizedItem Table::ToPrioritizedItem(Key key,
+                                         const StoredItem& stored) const {
+  PrioritizedItem item;
+  item.set_key(key);
+  item.set_table(name_);
+  item.set_priority(stored.priority);
+  item.set_times_sampled(stored.times_sampled);
+  EncodeAsTimestampProto(absl::FromUnixNanos(stored.inserted_at_ns),
+                         item.mutable_inserted_at());
+  REVERB_CHECK(item.mutable_flat_trajectory()->ParseFromString(
+      stored.data->trajectory));
+  return item;
+}
+
+Table::Item Table::ToItem(Key key, const StoredItem& stored) const {
+  Item item;
+  item.item = ToPrioritizedItem(key, stored);
+  item.chunks.assign(stored.data->chunks.begin(), stored.data->chunks.end());
+  return item;
+}
+
+TableItemView Table::ToItemView(Key key, const StoredItem& stored) const {
+  return TableItemView(key, stored, &name_);
+}
+
 absl::Status Table::MutateItems(absl::Span<const KeyWithPriority> updates,
                                 absl::Span<const Key> deletes) {
-  std::vector<Item> deleted_items(deletes.size());
+  std::vector<StoredItem> deleted_items(deletes.size());
   {
-    absl::MutexLock lock(&mu_);
+    internal::TimedMutexLock lock(&mu_, &latency_.lock[kMutateLock]);
     for (int i = 0; i < deletes.size(); i++) {
       REVERB_RETURN_IF_ERROR(DeleteItem(deletes[i], &deleted_items[i]));
     }
-    for (const auto& item : updates) {
-      REVERB_RETURN_IF_ERROR(UpdateItem(item.key(), item.priority()));
-    }
+    REVERB_RETURN_IF_ERROR(UpdateItems(updates));
+  }
+  if (!deleted_items.empty()) {
+    Reclaim(std::move(deleted_items));
   }
   return absl::OkStatus();
 }
@@ -216,67 +654,464 @@ absl::Status Table::SampleFlexibleBatch(std::vector<SampledItem>* items,
                                         int batch_size,
                                         absl::Duration timeout) {
   // Allocate memory outside of critical section.
-  items->reserve(batch_size);
+  std::vector<StoredSample> samples;
+  samples.reserve(batch_size);
 
   // Keep references to the (potentially) deleted items alive until the lock has
   // been released.
-  std::vector<Item> deleted_items;
+  std::vector<StoredItem> deleted_items;
+  absl::Status status;
+  if (frozen_.load(std::memory_order_acquire)) {
+    SampleFrozen(batch_size, &samples);
+    MaterializeSamples(samples, items);
+    return absl::OkStatus();
+  }
+  while (true) {
+    int num_approved = 0;
+    int64_t num_resets = 0;
+    {
+      internal::TimedMutexLock lock(&mu_, &latency_.lock[kSampleLock]);
+      if (!CanSampleShared()) {
+        status = SampleFlexibleBatchLocked(batch_size, timeout, &samples,
+                                           &deleted_items);
+        break;
+      }
+      status = AwaitSampleApprovals(batch_size, timeout, &num_approved);
+      num_resets = num_resets_;
+    }
+    if (!status.ok()) break;
+
+    {
+      // Approvals cleared by a reset must not be used to sample the items
+      // inserted after it.
+      internal::TimedReaderMutexLock lock(&mu_, &latency_.lock[kSampleLock]);
+      if (num_resets_ == num_resets) {
+        SampleApprovedShared(num_approved, &samples);
+      }
+    }
+    if (!samples.empty()) break;
+
+    // The table was emptied (e.g. by a reset, a delete or an expiry sweep)
+    // between the approval and the selection of the samples. Unless a reset
+    // already cleared them, the approvals are returned to the rate limiter
+    // before new ones are awaited.
+    internal::TimedMutexLock lock(&mu_, &latency_.lock[kSampleLock]);
+    if (num_resets_ == num_resets) {
+      rate_limiter_->UndoSamples(&mu_, num_approved);
+    }
+  }
+
+  if (!deleted_items.empty()) {
+    Reclaim(std::move(deleted_items));
+  }
+
+  REVERB_RETURN_IF_ERROR(status);
+  MaterializeSamples(samples, items);
+  return absl::OkStatus();
+}
+
+absl::Status Table::SampleFlexibleBatchLocked(
+    int batch_size, absl::Duration timeout, std::vector<StoredSample>* samples,
+    std::vector<StoredItem>* deleted_items) {
+  // Items are deleted as soon as they reach `max_times_sampled_`, which changes
+  // both the keys that can be selected and whether the rate limiter approves
+  // another sample. Unless this can happen all the samples are approved up
+  // front and their keys selected as one batch.
+  const bool select_batch = max_times_sampled_ <= 0;
+  std::vector<ItemSelector::KeyWithProbability> batch;
+  if (select_batch) {
+    int num_approved = 0;
+    REVERB_RETURN_IF_ERROR(
+        AwaitSampleApprovals(batch_size, timeout, &num_approved));
+    internal::ScopedLatencyTimer timer(&latency_.selector);
+    internal::VisitSelector(sampler_kind_, sampler_.get(), [&](auto* sampler) {
+      sampler->SampleBatch(num_approved, &batch);
+    });
+  }
+
+  // Extensions are notified of all samples of a batch at once. When items can
+  // be deleted after being sampled (or the lock released while waiting for
+  // the rate limiter) they are notified of every sample right away instead,
+  // so that they see the sample before anything else happens to the item.
+  std::vector<TableItemView> sampled_items;
+  const int num_samples = select_batch ? batch.size() : batch_size;
+  absl::Status status;
+  for (int i = 0; i < num_samples; i++) {
+    if (!select_batch && !AwaitSampleApproval(i, timeout, &status)) {
+      REVERB_RETURN_IF_ERROR(status);
+      break;
+    }
+    ItemSelector::KeyWithProbability sample;
+    if (select_batch) {
+      sample = batch[i];
+    } else {
+      internal::ScopedLatencyTimer timer(&latency_.selector);
+      sample = internal::VisitSelector(
+          sampler_kind_, sampler_.get(),
+          [](auto* sampler) { return sampler->Sample(); });
+    }
+    const Key key = slot_keys_[sample.key];
+    auto it = data_.find(key);
+    REVERB_CHECK(it != data_.end());
+    StoredItem& stored = it->second;
+
+    // Increment the sample count.
+    stored.times_sampled.Increment();
+
+    // Notify extensions which item was sampled.
+    if (!extensions_.empty()) {
+      internal::ScopedLatencyTimer timer(&latency_.extensions);
+      sampled_items.push_back(ToItemView(key, stored));
+      if (!select_batch) NotifySampled(&sampled_items);
+    }
+
+    // The sampled items are materialized once the lock has been released so
+    // only the (refcounted) immutable data of the item together with the
+    // fields which can change after the item was inserted are copied.
+    samples->push_back({
+        .key = key,
+        .stored = stored,
+        .probability = sample.probability,
+        .table_size = static_cast<int64_t>(data_.size()),
+    });
+
+    // If there is an upper bound of the number of times an item can be
+    // sampled and it is now reached then delete the item before the lock is
+    // released.
+    if (stored.times_sampled == max_times_sampled_) {
+      deleted_items->emplace_back();
+      REVERB_RETURN_IF_ERROR(DeleteItem(key, &deleted_items->back()));
+    }
+  }
+
+  if (!sampled_items.empty()) {
+    internal::ScopedLatencyTimer timer(&latency_.extensions);
+    NotifySampled(&sampled_items);
+  }
+
+  return absl::OkStatus();
+}
+
+void Table::NotifySampled(std::vector<TableItemView>* items) {
+  std::vector<const TableItemView*> pointers;
+  pointers.reserve(items->size());
+  for (const TableItemView& item : *items) pointers.push_back(&item);
+  for (auto& extension : extensions_) {
+    extension->OnSampleBatch(&mu_, pointers);
+  }
+  items->clear();
+}
+
+bool Table::AwaitSampleApproval(int index, absl::Duration timeout,
+                                absl::Status* status) {
+  internal::ScopedExcludeFromLockHold exclude;
+  *status = rate_limiter_->AwaitAndFinalizeSample(
+      &mu_, index == 0 ? timeout : absl::ZeroDuration());
+  // Deadline exceeded errors encountered after the first call means that it
+  // was not possible to proceed with another sample without awaiting changes.
+  // If this happens then we simply return the items that we sampled so far.
+  if (index != 0 && absl::IsDeadlineExceeded(*status)) {
+    *status = absl::OkStatus();
+    return false;
+  }
+  return status->ok();
+}
+
+absl::Status Table::AwaitSampleApprovals(int batch_size,
+                                         absl::Duration timeout,
+                                         int* num_approved) {
+  absl::Status status;
+  *num_approved = 0;
+  while (*num_approved < batch_size &&
+         AwaitSampleApproval(*num_approved, timeout, &status)) {
+    ++*num_approved;
+  }
+  return status;
+}
+
+bool Table::CanSampleShared() const {
+  return sampler_supports_shared_ && max_times_sampled_ <= 0 &&
+         extensions_.empty();
+}
+
+void Table::SampleApprovedShared(int num_samples,
+                                 std::vector<StoredSample>* samples) {
+  if (data_.empty()) return;
+
+  // Every thread draws from its own generator so the samplers do not need to
+  // synchronize with each other.
+  thread_local absl::BitGen bit_gen;
+  std::vector<ItemSelector::KeyWithProbability> batch;
   {
-    absl::MutexLock lock(&mu_);
-    for (int i = 0; i < batch_size; i++) {
-      if (auto status = rate_limiter_->AwaitAndFinalizeSample(&mu_, timeout);
-          !status.ok()) {
-        // Deadline exceeded errors encountered after the first call means that
-        // it was not possible to proceed with another sample without awaiting
-        // changes. If this happens then we simply return the items that we
-        // sampled so far.
-        if (i != 0 && absl::IsDeadlineExceeded(status)) {
-          return absl::OkStatus();
-        }
-        return status;
+    internal::ScopedLatencyTimer timer(&latency_.selector);
+    internal::VisitSelector(sampler_kind_, sampler_.get(), [&](auto* sampler) {
+      sampler->SampleBatchShared(num_samples, &bit_gen, &batch);
+    });
+  }
+
+  const int64_t table_size = data_.size();
+  for (const auto& sample : batch) {
+    const Key key = slot_keys_[sample.key];
+    auto it = data_.find(key);
+    REVERB_CHECK(it != data_.end());
+    StoredItem& stored = it->second;
+    stored.times_sampled.Increment();
+    samples->push_back({
+        .key = key,
+        .stored = stored,
+        .probability = sample.probability,
+        .table_size = table_size,
+    });
+  }
+}
+
+void Table::SampleFrozen(int num_samples,
+                         std::vector<StoredSample>* samples) {
+  SampleApprovedShared(num_samples, samples);
+}
+
+absl::Status Table::CheckNotFrozen() const {
+  if (frozen_.load(std::memory_order_relaxed)) {
+    return absl::FailedPreconditionError(
+        absl::StrCat("Table ", name_, " is frozen and cannot be modified."));
+  }
+  return absl::OkStatus();
+}
+
+void Table::MaterializeSamples(const std::vector<StoredSample>& samples,
+                               std::vector<SampledItem>* items) {
+  items->reserve(items->size() + samples.size());
+  int64_t bytes = 0;
+  for (const auto& sample : samples) {
+    bytes += sample.stored.data->chunk_bytes;
+    items->push_back({
+        .item = ToPrioritizedItem(sample.key, sample.stored),
+        .chunks = {sample.stored.data->chunks.begin(),
+                   sample.stored.data->chunks.end()},
+        .probability = sample.probability,
+        .table_size = sample.table_size,
+    });
+  }
+  num_sampled_bytes_.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void Table::SampleFlexibleBatchAsync(int batch_size, SampleCallback callback,
+                                     absl::Duration timeout) {
+  MutateAndSampleFlexibleBatchAsync({}, {}, batch_size, std::move(callback),
+                                    timeout);
+}
+
+void Table::MutateAndSampleFlexibleBatchAsync(
+    absl::Span<const KeyWithPriority> updates, absl::Span<const Key> deletes,
+    int batch_size, SampleCallback callback, absl::Duration timeout) {
+  std::vector<StoredSample> samples;
+  std::vector<StoredItem> deleted_items;
+  absl::Status status;
+  bool queued = false;
+  if (frozen_.load(std::memory_order_acquire)) {
+    std::vector<SampledItem> items;
+    if (!updates.empty() || !deletes.empty()) {
+      status = CheckNotFrozen();
+    } else {
+      SampleFrozen(batch_size, &samples);
+      MaterializeSamples(samples, &items);
+    }
+    callback(std::move(status), std::move(items));
+    return;
+  }
+  {
+    internal::TimedMutexLock lock(&mu_, &latency_.lock[kSampleLock]);
+
+    for (Key key : deletes) {
+      deleted_items.emplace_back();
+      status = DeleteItem(key, &deleted_items.back());
+      if (!status.ok()) break;
+    }
+    if (status.ok()) {
+      status = UpdateItems(updates);
+    }
+
+    // Requests are completed in the order they were received so the sample
+    // can only be executed inline if no other sample is waiting.
+    if (status.ok()) {
+      if (!pending_samples_.empty() || !rate_limiter_->CanSample(&mu_, 1) ||
+          IsPacedLocked(nullptr, absl::Now())) {
+        pending_samples_.push_back({
+            .batch_size = batch_size,
+            .callback = std::move(callback),
+            .deadline = absl::Now() + timeout,
+        });
+        MaybeStartAsyncWorker();
+        queued = true;
+      } else {
+        status = SampleFlexibleBatchLocked(batch_size, absl::ZeroDuration(),
+                                           &samples, &deleted_items);
       }
+    }
+  }
+
+  if (!deleted_items.empty()) {
+    Reclaim(std::move(deleted_items));
+  }
+  if (queued) return;
+
+  std::vector<SampledItem> items;
+  if (status.ok()) {
+    MaterializeSamples(samples, &items);
+  }
+  callback(std::move(status), std::move(items));
+}
+
+bool Table::CanInsertOrAssignLocked(const Item& item) const {
+  return data_.contains(item.item.key()) || rate_limiter_->CanInsert(&mu_, 1);
+}
+
+bool Table::IsPacedLocked(const Item* item, absl::Time now) const {
+  if (item != nullptr && data_.contains(item->item.key())) return false;
+  return rate_limiter_->NextPacingSlot(&mu_, /*insert=*/item != nullptr) > now;
+}
 
-      // All calls but the first should return immediately if the rate limiter
-      // does not allow for another sample call to proceed.
-      timeout = absl::ZeroDuration();
+void Table::MaybeStartAsyncWorker() {
+  if (async_worker_ == nullptr) {
+    async_worker_ = internal::StartThread("TableAsyncWorker", [this] {
+      if (numa_node_ >= 0) {
+        auto status = internal::PinCurrentThreadToNumaNode(numa_node_);
+        if (!status.ok()) {
+          REVERB_LOG(REVERB_WARNING)
+              << "Unable to pin the async worker of table " << name_
+              << " to NUMA node " << numa_node_ << ": " << status;
+        }
+      }
+      RunAsyncWorker();
+    });
+  }
+}
 
-      auto sample = sampler_->Sample();
-      Item& item = data_[sample.key];
+bool Table::AsyncWorkerCanProceed() const {
+  if (async_worker_stopped_) return true;
+
+  // Once the table has been closed all requests are completed right away.
+  // Requests which are paced are woken by the deadline of `RunAsyncWorker`.
+  const absl::Time now = absl::Now();
+  return (!pending_samples_.empty() &&
+          (closed_ || (rate_limiter_->CanSample(&mu_, 1) &&
+                       !IsPacedLocked(nullptr, now)))) ||
+         (!pending_inserts_.empty() &&
+          (closed_ ||
+           (CanInsertOrAssignLocked(pending_inserts_.front().item) &&
+            !IsPacedLocked(&pending_inserts_.front().item, now))));
+}
 
-      // Increment the sample count.
-      item.item.set_times_sampled(item.item.times_sampled() + 1);
+void Table::RunAsyncWorker() {
+  while (true) {
+    // Callbacks (and the materialization of the samples) are run once the lock
+    // has been released.
+    std::vector<std::function<void()>> completions;
+    std::vector<StoredItem> deleted_items;
+    bool stopped;
+    {
+      internal::TimedMutexLock lock(&mu_, &latency_.lock[kAsyncWorkerLock]);
+
+      absl::Time deadline = absl::InfiniteFuture();
+      for (const auto& request : pending_samples_) {
+        deadline = std::min(deadline, request.deadline);
+      }
+      for (const auto& request : pending_inserts_) {
+        deadline = std::min(deadline, request.deadline);
+      }
 
-      // Copy Details of the sampled item.
-      SampledItem sampled_item = {
-          .item = item.item,
-          .chunks = item.chunks,
-          .probability = sample.probability,
-          .table_size = static_cast<int64_t>(data_.size()),
-      };
-      items->push_back(std::move(sampled_item));
+      // The requests at the front are also woken when their pacing slot is
+      // reached. Slots which have already passed are not considered as the
+      // requests then wait for the bounds of the rate limiter.
+      const absl::Time wait_start = absl::Now();
+      for (bool insert : {false, true}) {
+        if (insert ? pending_inserts_.empty() : pending_samples_.empty()) {
+          continue;
+        }
+        const absl::Time slot = rate_limiter_->NextPacingSlot(&mu_, insert);
+        if (slot > wait_start) deadline = std::min(deadline, slot);
+      }
+      {
+        internal::ScopedExcludeFromLockHold exclude;
+        mu_.AwaitWithDeadline(
+            absl::Condition(this, &Table::AsyncWorkerCanProceed), deadline);
+      }
 
-      // Notify extensions which item was sampled.
-      for (auto& extension : extensions_) {
-        extension->OnSample(&mu_, item);
+      stopped = async_worker_stopped_;
+      const absl::Time now = absl::Now();
+
+      while (!pending_samples_.empty()) {
+        auto& request = pending_samples_.front();
+        absl::Status status;
+        std::vector<StoredSample> samples;
+        if (stopped) {
+          status = absl::CancelledError("Table has been destroyed");
+        } else if (closed_ || (rate_limiter_->CanSample(&mu_, 1) &&
+                               (request.deadline <= now ||
+                                !IsPacedLocked(nullptr, now)))) {
+          // Pacing only holds a request back until its deadline.
+          status = SampleFlexibleBatchLocked(
+              request.batch_size, absl::ZeroDuration(), &samples,
+              &deleted_items);
+        } else if (request.deadline <= now) {
+          status = errors::RateLimiterTimeout();
+        } else {
+          break;
+        }
+        completions.push_back(
+            [this, status = std::move(status), samples = std::move(samples),
+             callback = std::move(request.callback)]() mutable {
+              std::vector<SampledItem> items;
+              if (status.ok()) {
+                MaterializeSamples(samples, &items);
+              }
+              callback(std::move(status), std::move(items));
+            });
+        pending_samples_.pop_front();
       }
 
-      // If there is an upper bound of the number of times an item can be
-      // sampled and it is now reached then delete the item before the lock is
-      // released.
-      if (item.item.times_sampled() == max_times_sampled_) {
-        deleted_items.emplace_back();
-        REVERB_RETURN_IF_ERROR(
-            DeleteItem(item.item.key(), &deleted_items.back()));
+      while (!pending_inserts_.empty()) {
+        auto& request = pending_inserts_.front();
+        absl::Status status;
+        if (stopped) {
+          status = absl::CancelledError("Table has been destroyed");
+        } else if (closed_ || (CanInsertOrAssignLocked(request.item) &&
+                               (request.deadline <= now ||
+                                !IsPacedLocked(&request.item, now)))) {
+          status = InsertOrAssignLocked(std::move(request.item),
+                                        absl::ZeroDuration(), &deleted_items);
+        } else if (request.deadline <= now) {
+          status = errors::RateLimiterTimeout();
+        } else {
+          break;
+        }
+        completions.push_back(
+            [status = std::move(status),
+             callback = std::move(request.callback)]() mutable {
+              callback(std::move(status));
+            });
+        pending_inserts_.pop_front();
       }
     }
-  }
 
-  return absl::OkStatus();
+    if (!deleted_items.empty()) {
+      Reclaim(std::move(deleted_items));
+    }
+
+    for (auto& completion : completions) {
+      completion();
+    }
+
+    if (stopped) return;
+  }
 }
 
 int64_t Table::size() const {
-  absl::MutexLock lock(&mu_);
-  return data_.size();
+  return num_items_.load(std::memory_order_relaxed);
+}
+
+double Table::TotalSamplerWeight() const {
+  return total_sampler_weight_.load(std::memory_order_relaxed);
 }
 
 const std::string& Table::name() const { return name_; }
@@ -286,126 +1121,438 @@ TableInfo Table::info() const {
 
   info.set_name(name_);
   info.set_max_size(max_size_);
+  info.set_max_chunk_bytes(max_chunk_bytes_);
   info.set_max_times_sampled(max_times_sampled_);
+  if (max_age_ != absl::InfiniteDuration()) {
+    EncodeAsDurationProto(max_age_, info.mutable_max_age());
+  }
+  info.set_num_expired_items(
+      num_expired_items_.load(std::memory_order_relaxed));
 
   if (signature_) {
     *info.mutable_signature() = *signature_;
   }
 
-  absl::MutexLock lock(&mu_);
-  *info.mutable_rate_limiter_info() = rate_limiter_->Info(&mu_);
-  *info.mutable_sampler_options() = sampler_->options();
-  *info.mutable_remover_options() = remover_->options();
-  info.set_current_size(data_.size());
-  info.set_num_episodes(episode_refs_.size());
-  info.set_num_deleted_episodes(num_deleted_episodes_);
+  *info.mutable_rate_limiter_info() = rate_limiter_->Info();
+  {
+    absl::MutexLock lock(&options_mu_);
+    *info.mutable_sampler_options() = sampler_options_;
+    *info.mutable_remover_options() = remover_options_;
+  }
+  info.set_current_size(num_items_.load(std::memory_order_relaxed));
+  info.set_num_episodes(num_episodes_.load(std::memory_order_relaxed));
+  info.set_num_deleted_episodes(
+      num_deleted_episodes_.load(std::memory_order_relaxed));
+  info.set_num_chunks(num_chunks_.load(std::memory_order_relaxed));
+  info.set_num_chunk_bytes(num_chunk_bytes_.load(std::memory_order_relaxed));
+  info.set_num_inserted_bytes(
+      num_inserted_bytes_.load(std::memory_order_relaxed));
+  info.set_num_sampled_bytes(num_sampled_bytes_.load(std::memory_order_relaxed));
+
+  auto* latency_stats = info.mutable_latency_stats();
+  const auto& lock = latency_.lock;
+  internal::AtomicLatencyHistogram::ToProto(
+      {&lock[kInsertLock].wait, &lock[kSampleLock].wait,
+       &lock[kMutateLock].wait, &lock[kAsyncWorkerLock].wait,
+       &lock[kExpireLock].wait},
+      latency_stats->mutable_lock_wait());
+  internal::AtomicLatencyHistogram::ToProto(
+      {&lock[kInsertLock].hold, &lock[kSampleLock].hold,
+       &lock[kMutateLock].hold, &lock[kAsyncWorkerLock].hold,
+       &lock[kExpireLock].hold},
+      latency_stats->mutable_lock_hold());
+  for (int op = 0; op < kNumLockOperations; op++) {
+    auto* contention = latency_stats->add_lock_contention();
+    contention->set_operation(kLockOperationNames[op]);
+    lock[op].ToProto(contention);
+  }
+  latency_.selector.ToProto(latency_stats->mutable_selector());
+  latency_.extensions.ToProto(latency_stats->mutable_extensions());
+  info.set_total_sampler_weight(
+      total_sampler_weight_.load(std::memory_order_relaxed));
 
   return info;
 }
 
 void Table::Close() {
   absl::MutexLock lock(&mu_);
+  closed_ = true;
   rate_limiter_->Cancel(&mu_);
 }
 
-absl::Status Table::DeleteItem(Table::Key key, Item* deleted_item) {
+absl::Status Table::DeleteItem(Table::Key key, StoredItem* deleted_item) {
+  REVERB_RETURN_IF_ERROR(CheckNotFrozen());
   auto it = data_.find(key);
   if (it == data_.end()) return absl::OkStatus();
 
-  for (auto& extension : extensions_) {
-    extension->OnDelete(&mu_, it->second);
+  if (!extensions_.empty()) {
+    internal::ScopedLatencyTimer timer(&latency_.extensions);
+    const TableItemView item = ToItemView(key, it->second);
+    for (auto& extension : extensions_) {
+      extension->OnDelete(&mu_, item);
+    }
   }
 
-  // Decrement counts to the episodes the item is referencing.
-  for (const auto& chunk : it->second.chunks) {
+  // Decrement counts to the episodes and chunks the item is referencing.
+  for (const auto& chunk : it->second.data->chunks) {
     auto ep_it = episode_refs_.find(chunk->episode_id());
     REVERB_CHECK(ep_it != episode_refs_.end());
     if (--(ep_it->second) == 0) {
       episode_refs_.erase(ep_it);
       num_deleted_episodes_++;
     }
+
+    auto chunk_it = chunk_refs_.find(chunk->key());
+    REVERB_CHECK(chunk_it != chunk_refs_.end());
+    if (--(chunk_it->second) == 0) {
+      chunk_refs_.erase(chunk_it);
+      chunk_bytes_ -= chunk->DataByteSizeLong();
+      chunk->RemoveTableReference();
+    }
+  }
+  if (index_episodes_) {
+    ForEachDistinctEpisode(*it->second.data, [&](uint64_t episode_id) {
+      auto index_it = episode_index_.find(episode_id);
+      REVERB_CHECK(index_it != episode_index_.end());
+      auto& keys = index_it->second;
+      keys.erase(std::find(keys.begin(), keys.end(), key));
+      if (keys.empty()) episode_index_.erase(index_it);
+    });
   }
 
+  const Key slot = it->second.slot;
+  free_slots_.push_back(slot);
   *deleted_item = std::move(it->second);
   data_.erase(it);
   rate_limiter_->Delete(&mu_);
-  REVERB_RETURN_IF_ERROR(sampler_->Delete(key));
-  REVERB_RETURN_IF_ERROR(remover_->Delete(key));
+  {
+    internal::ScopedLatencyTimer timer(&latency_.selector);
+    REVERB_RETURN_IF_ERROR(ForEachSelector(
+        [&](auto* selector) { return selector->Delete(slot); }));
+  }
+  PublishStats();
   return absl::OkStatus();
 }
 
 absl::Status Table::UpdateItem(
     Key key, double priority, std::initializer_list<TableExtension*> exclude) {
+  REVERB_RETURN_IF_ERROR(CheckNotFrozen());
   auto it = data_.find(key);
   if (it == data_.end()) {
     return absl::OkStatus();
   }
-  it->second.item.set_priority(priority);
-  REVERB_RETURN_IF_ERROR(sampler_->Update(key, priority));
-  REVERB_RETURN_IF_ERROR(remover_->Update(key, priority));
+  it->second.priority = priority;
+  {
+    internal::ScopedLatencyTimer timer(&latency_.selector);
+    const Key slot = it->second.slot;
+    REVERB_RETURN_IF_ERROR(ForEachSelector(
+        [&](auto* selector) { return selector->Update(slot, priority); }));
+  }
+  PublishStats();
 
-  for (auto& extension : extensions_) {
-    if (std::none_of(
-            exclude.begin(), exclude.end(),
-            [ext_ptr = extension.get()](auto e) { return e == ext_ptr; })) {
-      extension->OnUpdate(&mu_, it->second);
+  if (!extensions_.empty()) {
+    internal::ScopedLatencyTimer timer(&latency_.extensions);
+    const TableItemView item = ToItemView(key, it->second);
+    for (auto& extension : extensions_) {
+      if (std::none_of(
+              exclude.begin(), exclude.end(),
+              [ext_ptr = extension.get()](auto e) { return e == ext_ptr; })) {
+        extension->OnUpdate(&mu_, item);
+      }
+    }
+  }
+
+  return absl::OkStatus();
+}
+
+absl::Status Table::UpdateItems(absl::Span<const KeyWithPriority> updates) {
+  REVERB_RETURN_IF_ERROR(CheckNotFrozen());
+  // Updates of keys which do not exist are dropped and the keys of the others
+  // are replaced by their slots before the updates are passed on to the
+  // selectors.
+  std::vector<const KeyWithPriority*> existing_updates;
+  std::vector<StoredItem*> stored;
+  std::vector<KeyWithPriority> slot_updates;
+  existing_updates.reserve(updates.size());
+  stored.reserve(updates.size());
+  slot_updates.reserve(updates.size());
+  for (const auto& update : updates) {
+    auto it = data_.find(update.key());
+    if (it == data_.end()) continue;
+    it->second.priority = update.priority();
+    existing_updates.push_back(&update);
+    stored.push_back(&it->second);
+    slot_updates.emplace_back();
+    slot_updates.back().set_key(it->second.slot);
+    slot_updates.back().set_priority(update.priority());
+  }
+
+  {
+    internal::ScopedLatencyTimer timer(&latency_.selector);
+    REVERB_RETURN_IF_ERROR(ForEachSelector(
+        [&](auto* selector) { return selector->UpdateBatch(slot_updates); }));
+  }
+  PublishStats();
+
+  if (!extensions_.empty()) {
+    internal::ScopedLatencyTimer timer(&latency_.extensions);
+    std::vector<TableItemView> items;
+    std::vector<const TableItemView*> pointers(existing_updates.size());
+    items.reserve(existing_updates.size());
+    for (int i = 0; i < existing_updates.size(); i++) {
+      // The extensions see the priority of every update, even if a later
+      // update of the same key has already been stored.
+      items.push_back(ToItemView(existing_updates[i]->key(), *stored[i]));
+      items[i].priority_ = existing_updates[i]->priority();
+      pointers[i] = &items[i];
+    }
+    for (auto& extension : extensions_) {
+      extension->OnUpdateBatch(&mu_, pointers);
     }
   }
 
   return absl::OkStatus();
 }
 
+Table::ResetState::~ResetState() {
+  for (const auto& key_and_item : items) {
+    for (const auto& chunk : key_and_item.second.data->chunks) {
+      if (chunk_refs.erase(chunk->key()) > 0) {
+        chunk->RemoveTableReference();
+      }
+    }
+  }
+}
+
 absl::Status Table::Reset() {
+  // Only empty structures are swapped in while the lock is held. The old state
+  // is torn down (see `ResetState`) after the lock has been released.
+  ResetState state;
+  {
+    internal::TimedMutexLock lock(&mu_, &latency_.lock[kResetLock]);
+    REVERB_RETURN_IF_ERROR(CheckNotFrozen());
+
+    for (auto& extension : extensions_) {
+      extension->OnReset(&mu_);
+    }
+
+    sampler_->Clear();
+    remover_->Clear();
+
+    state.items.swap(data_);
+    state.chunk_refs.swap(chunk_refs_);
+    state.episode_refs.swap(episode_refs_);
+    state.slot_keys.swap(slot_keys_);
+    state.free_slots.swap(free_slots_);
+    state.age_index.swap(age_index_);
+    state.episode_index.swap(episode_index_);
+    chunk_bytes_ = 0;
+
+    num_deleted_episodes_ = 0;
+    PublishStats();
+
+    rate_limiter_->Reset(&mu_);
+    ++num_resets_;
+  }
+
+  Reclaim(std::move(state));
+
+  return absl::OkStatus();
+}
+
+absl::Status Table::Freeze() {
   absl::MutexLock lock(&mu_);
+  if (frozen_.load(std::memory_order_relaxed)) return absl::OkStatus();
+  if (!sampler_supports_shared_) {
+    return absl::FailedPreconditionError(absl::StrCat(
+        "Table ", name_, " cannot be frozen as its sampler does not support "
+        "`SampleShared`."));
+  }
+  if (!CanSampleShared() || max_age_ != absl::InfiniteDuration()) {
+    return absl::FailedPreconditionError(absl::StrCat(
+        "Table ", name_,
+        " cannot be frozen as its items can change as a result of sampling "
+        "or time passing (max_times_sampled, max_age or extensions)."));
+  }
+  if (data_.empty()) {
+    return absl::FailedPreconditionError(
+        absl::StrCat("Table ", name_, " cannot be frozen while empty."));
+  }
+  if (!pending_samples_.empty() || !pending_inserts_.empty()) {
+    return absl::FailedPreconditionError(absl::StrCat(
+        "Table ", name_, " cannot be frozen while requests are queued."));
+  }
+  frozen_.store(true, std::memory_order_release);
+  return absl::OkStatus();
+}
 
-  for (auto& extension : extensions_) {
-    extension->OnReset(&mu_);
+bool Table::frozen() const { return frozen_.load(std::memory_order_acquire); }
+
+absl::Status Table::SetPriorityExponent(double priority_exponent) {
+  if (!(priority_exponent >= 0)) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Priority exponent must be non-negative, got ", priority_exponent,
+        "."));
+  }
+  if (sampler_kind_ != SelectorKind::kPrioritized &&
+      remover_kind_ != SelectorKind::kPrioritized) {
+    return absl::FailedPreconditionError(absl::StrCat(
+        "Table ", name_, " has no prioritized selector whose priority "
+        "exponent could be changed."));
   }
 
-  sampler_->Clear();
-  remover_->Clear();
+  internal::TimedMutexLock lock(&mu_, &latency_.lock[kMutateLock]);
+  REVERB_RETURN_IF_ERROR(CheckNotFrozen());
+  internal::ScopedLatencyTimer timer(&latency_.selector);
+  if (sampler_kind_ == SelectorKind::kPrioritized) {
+    REVERB_RETURN_IF_ERROR(static_cast<PrioritizedSelector*>(sampler_.get())
+                               ->SetPriorityExponent(priority_exponent));
+  }
+  if (remover_kind_ == SelectorKind::kPrioritized) {
+    REVERB_RETURN_IF_ERROR(static_cast<PrioritizedSelector*>(remover_.get())
+                               ->SetPriorityExponent(priority_exponent));
+  }
+  PublishStats();
 
-  num_deleted_episodes_ = 0;
+  absl::MutexLock options_lock(&options_mu_);
+  sampler_options_ = sampler_->options();
+  remover_options_ = remover_->options();
+  return absl::OkStatus();
+}
+
+absl::Status Table::DeleteEpisode(uint64_t episode_id) {
+  if (!index_episodes_) {
+    return absl::FailedPreconditionError(absl::StrCat(
+        "Table ", name_, " does not index episodes (see `index_episodes`)."));
+  }
+  std::vector<StoredItem> deleted_items;
+  {
+    internal::TimedMutexLock lock(&mu_, &latency_.lock[kMutateLock]);
+    auto it = episode_index_.find(episode_id);
+    if (it == episode_index_.end()) return absl::OkStatus();
+
+    // `DeleteItem` removes the keys from the index so they are copied first.
+    const std::vector<Key> keys = it->second;
+    deleted_items.resize(keys.size());
+    for (int i = 0; i < keys.size(); i++) {
+      REVERB_RETURN_IF_ERROR(DeleteItem(keys[i], &deleted_items[i]));
+    }
+  }
+  Reclaim(std::move(deleted_items));
+  return absl::OkStatus();
+}
 
-  data_.clear();
+absl::Status Table::SampleEpisode(std::vector<Item>* items,
+                                  absl::Duration timeout) {
+  if (!index_episodes_) {
+    return absl::FailedPreconditionError(absl::StrCat(
+        "Table ", name_, " does not index episodes (see `index_episodes`)."));
+  }
+  SampledItem sampled;
+  REVERB_RETURN_IF_ERROR(Sample(&sampled, timeout));
+  const uint64_t episode_id = sampled.chunks.front()->episode_id();
 
-  rate_limiter_->Reset(&mu_);
+  items->clear();
+  {
+    absl::MutexLock lock(&mu_);
+    auto it = episode_index_.find(episode_id);
+    if (it != episode_index_.end()) {
+      items->reserve(it->second.size() + 1);
+      for (Key key : it->second) {
+        items->push_back(ToItem(key, data_.at(key)));
+      }
+    }
+  }
 
+  // The sampled item is missing if it was deleted by the sample (or
+  // concurrently). `inserted_at` is strictly increasing in insertion order so
+  // it is used to put the item back in its place.
+  const Key sampled_key = sampled.item.key();
+  if (std::none_of(items->begin(), items->end(), [&](const Item& item) {
+        return item.item.key() == sampled_key;
+      })) {
+    const auto& inserted_at = sampled.item.inserted_at();
+    auto pos = std::find_if(items->begin(), items->end(),
+                            [&](const Item& item) {
+                              const auto& other = item.item.inserted_at();
+                              return std::make_pair(other.seconds(),
+                                                    other.nanos()) >
+                                     std::make_pair(inserted_at.seconds(),
+                                                    inserted_at.nanos());
+                            });
+    Item item;
+    item.item = std::move(sampled.item);
+    item.chunks = std::move(sampled.chunks);
+    items->insert(pos, std::move(item));
+  }
   return absl::OkStatus();
 }
 
+bool Table::index_episodes() const { return index_episodes_; }
+
+std::vector<std::pair<Table::Key, Table::StoredItem>> Table::SnapshotItems() {
+  std::vector<std::pair<Key, StoredItem>> entries;
+  {
+    internal::TimedReaderMutexLock lock(&mu_, &latency_.lock[kExportLock]);
+    entries.reserve(data_.size());
+    for (const auto& entry : data_) {
+      entries.push_back(entry);
+    }
+  }
+  SortByInsertionTime(&entries);
+  return entries;
+}
+
 Table::CheckpointAndChunks Table::Checkpoint() {
   PriorityTableCheckpoint checkpoint;
   checkpoint.set_table_name(name());
   checkpoint.set_max_size(max_size_);
+  checkpoint.set_max_chunk_bytes(max_chunk_bytes_);
   checkpoint.set_max_times_sampled(max_times_sampled_);
+  if (max_age_ != absl::InfiniteDuration()) {
+    EncodeAsDurationProto(max_age_, checkpoint.mutable_max_age());
+  }
+  checkpoint.set_index_episodes(index_episodes_);
 
   if (signature_.has_value()) {
     *checkpoint.mutable_signature() = signature_.value();
   }
 
-  absl::MutexLock lock(&mu_);
+  // Only the items themselves are copied while the lock is held. This is cheap
+  // as the parts of the items which never change are shared rather than
+  // copied, so the expensive conversion into protos can happen after the lock
+  // has been released without blocking inserts and samples.
+  std::vector<std::pair<Key, StoredItem>> entries;
+  {
+    internal::TimedMutexLock lock(&mu_, &latency_.lock[kCheckpointLock]);
 
-  checkpoint.set_num_deleted_episodes(num_deleted_episodes_);
+    checkpoint.set_num_deleted_episodes(num_deleted_episodes_);
 
-  *checkpoint.mutable_sampler() = sampler_->options();
-  *checkpoint.mutable_remover() = remover_->options();
+    *checkpoint.mutable_sampler() = sampler_->options();
+    *checkpoint.mutable_remover() = remover_->options();
 
-  // Note that is is important that the rate limiter checkpoint is
-  // finalized before the items are added
-  *checkpoint.mutable_rate_limiter() = rate_limiter_->CheckpointReader(&mu_);
+    // Note that is is important that the rate limiter checkpoint is
+    // finalized before the items are added
+    *checkpoint.mutable_rate_limiter() = rate_limiter_->CheckpointReader(&mu_);
 
-  absl::flat_hash_set<std::shared_ptr<ChunkStore::Chunk>> chunks;
-  for (const auto& entry : data_) {
-    *checkpoint.add_items() = entry.second.item;
-    chunks.insert(entry.second.chunks.begin(), entry.second.chunks.end());
+    entries.reserve(data_.size());
+    for (const auto& entry : data_) {
+      entries.push_back(entry);
+    }
   }
 
   // Sort the items in ascending order based on their insertion time. This makes
   // it possible to reconstruct ordered structures (Fifo) when the checkpoint is
   // loaded.
-  std::sort(checkpoint.mutable_items()->begin(),
-            checkpoint.mutable_items()->end(), IsInsertedBefore);
+  SortByInsertionTime(&entries);
+
+  absl::flat_hash_set<std::shared_ptr<ChunkStore::Chunk>> chunks;
+  checkpoint.mutable_items()->Reserve(entries.size());
+  for (const auto& entry : entries) {
+    *checkpoint.add_items() = ToPrioritizedItem(entry.first, entry.second);
+    chunks.insert(entry.second.data->chunks.begin(),
+                  entry.second.data->chunks.end());
+  }
 
   return {std::move(checkpoint), std::move(chunks)};
 }
@@ -418,21 +1565,60 @@ absl::Status Table::InsertCheckpointItem(Table::Item item) {
       << "InsertCheckpointItem called for item with already present key: "
       << item.item.key();
 
-  REVERB_RETURN_IF_ERROR(
-      sampler_->Insert(item.item.key(), item.item.priority()));
-  REVERB_RETURN_IF_ERROR(
-      remover_->Insert(item.item.key(), item.item.priority()));
-
   const auto key = item.item.key();
-  auto it = data_.emplace(key, std::move(item)).first;
-  for (auto& extension : extensions_) {
-    extension->OnInsert(&mu_, it->second);
+  StoredItem stored = ToStoredItem(std::move(item));
+  last_inserted_at_ns_ = std::max(last_inserted_at_ns_, stored.inserted_at_ns);
+  return InsertStoredItem(key, std::move(stored));
+}
+
+absl::Status Table::BulkLoad(std::vector<Table::Item> items) {
+  absl::MutexLock lock(&mu_);
+  REVERB_CHECK_LE(data_.size() + items.size(), max_size_)
+      << "BulkLoad called with more items than the Table can hold";
+
+  data_.reserve(data_.size() + items.size());
+  slot_keys_.reserve(slot_keys_.size() + items.size());
+  std::vector<KeyWithPriority> selector_inserts;
+  selector_inserts.reserve(items.size());
+  for (auto& item : items) {
+    const auto key = item.item.key();
+    REVERB_CHECK(!data_.contains(key))
+        << "BulkLoad called for item with already present key: "
+        << key;
+    StoredItem stored = ToStoredItem(std::move(item));
+    last_inserted_at_ns_ =
+        std::max(last_inserted_at_ns_, stored.inserted_at_ns);
+    REVERB_RETURN_IF_ERROR(
+        InsertStoredItem(key, std::move(stored), &selector_inserts));
   }
 
-  for (const auto& chunk : it->second.chunks) {
-    ++episode_refs_[chunk->episode_id()];
+  {
+    internal::ScopedLatencyTimer timer(&latency_.selector);
+    REVERB_RETURN_IF_ERROR(sampler_->InsertBatch(selector_inserts));
+    REVERB_RETURN_IF_ERROR(remover_->InsertBatch(selector_inserts));
   }
+  PublishStats();
+  return absl::OkStatus();
+}
+
+absl::Status Table::InsertRestoredItem(Table::Item item) {
+  std::vector<StoredItem> deleted_items;
+  {
+    absl::MutexLock lock(&mu_);
+    const auto key = item.item.key();
+
+    // Items inserted while the checkpoint is being restored are more recent
+    // than the checkpointed ones so they take precedence.
+    if (data_.contains(key)) return absl::OkStatus();
 
+    StoredItem stored = ToStoredItem(std::move(item));
+    last_inserted_at_ns_ =
+        std::max(last_inserted_at_ns_, stored.inserted_at_ns);
+    REVERB_RETURN_IF_ERROR(InsertStoredItem(key, std::move(stored)));
+    REVERB_RETURN_IF_ERROR(FinalizeInsert(&deleted_items));
+  }
+  // The caller is a background thread so the deleted items are destroyed here
+  // rather than handed to `reclaimer_`, which may be set concurrently.
   return absl::OkStatus();
 }
 
@@ -440,13 +1626,14 @@ bool Table::Get(Table::Key key, Table::Item* item) {
   absl::MutexLock lock(&mu_);
   auto it = data_.find(key);
   if (it != data_.end()) {
-    *item = it->second;
+    *item = ToItem(key, it->second);
     return true;
   }
   return false;
 }
 
-const internal::flat_hash_map<Table::Key, Table::Item>* Table::RawLookup() {
+const internal::flat_hash_map<Table::Key, Table::StoredItem>*
+Table::RawLookup() {
   mu_.AssertHeld();
   return &data_;
 }
@@ -462,30 +1649,70 @@ const std::vector<std::shared_ptr<TableExtension>>& Table::extensions() const {
   return extensions_;
 }
 
+int64_t Table::NowNanos() const {
+  return coarse_clock_ != nullptr ? coarse_clock_->NowNanos()
+                                  : absl::GetCurrentTimeNanos();
+}
+
+void Table::UnsafeSetCoarseClock(std::shared_ptr<internal::CoarseClock> clock) {
+  rate_limiter_->UnsafeSetCoarseClock(clock);
+  coarse_clock_ = std::move(clock);
+}
+
+void Table::UnsafeSetNumaNode(int node) { numa_node_ = node; }
+
+int Table::numa_node() const { return numa_node_; }
+
+void Table::PublishStats() {
+  num_items_.store(data_.size(), std::memory_order_relaxed);
+  num_episodes_.store(episode_refs_.size(), std::memory_order_relaxed);
+  num_chunks_.store(chunk_refs_.size(), std::memory_order_relaxed);
+  num_chunk_bytes_.store(chunk_bytes_, std::memory_order_relaxed);
+  const double weight = sampler_->TotalWeight();
+  total_sampler_weight_.store(weight < 0 ? data_.size() : weight,
+                              std::memory_order_relaxed);
+}
+
+void Table::UnsafeSetReclaimer(std::shared_ptr<internal::Reclaimer> reclaimer) {
+  reclaimer_ = std::move(reclaimer);
+}
+
 const absl::optional<tensorflow::StructuredValue>& Table::signature() const {
   return signature_;
 }
 
 bool Table::CanSample(int num_samples) const {
-  absl::MutexLock lock(&mu_);
-  return rate_limiter_->CanSample(&mu_, num_samples);
+  return rate_limiter_->CanSampleWithoutLock(num_samples);
 }
 
 bool Table::CanInsert(int num_inserts) const {
-  absl::MutexLock lock(&mu_);
-  return rate_limiter_->CanInsert(&mu_, num_inserts);
+  return rate_limiter_->CanInsertWithoutLock(num_inserts);
 }
 
 RateLimiterEventHistory Table::GetRateLimiterEventHistory(
     size_t min_insert_event_id, size_t min_sample_event_id) const {
-  absl::MutexLock lock(&mu_);
-  return rate_limiter_->GetEventHistory(&mu_, min_insert_event_id,
+  return rate_limiter_->GetEventHistory(min_insert_event_id,
                                         min_sample_event_id);
 }
 
 int64_t Table::num_episodes() const {
-  absl::MutexLock lock(&mu_);
-  return episode_refs_.size();
+  return num_episodes_.load(std::memory_order_relaxed);
+}
+
+int64_t Table::num_chunks() const {
+  return num_chunks_.load(std::memory_order_relaxed);
+}
+
+int64_t Table::num_chunk_bytes() const {
+  return num_chunk_bytes_.load(std::memory_order_relaxed);
+}
+
+int64_t Table::num_inserted_bytes() const {
+  return num_inserted_bytes_.load(std::memory_order_relaxed);
+}
+
+int64_t Table::num_sampled_bytes() const {
+  return num_sampled_bytes_.load(std::memory_order_relaxed);
 }
 
 absl::Status Table::UnsafeUpdateItem(
@@ -510,8 +1737,7 @@ std::vector<std::shared_ptr<TableExtension>> Table::UnsafeClearExtensions() {
 }
 
 int64_t Table::num_deleted_episodes() const {
-  absl::MutexLock lock(&mu_);
-  return num_deleted_episodes_;
+  return num_deleted_episodes_.load(std::memory_order_relaxed);
 }
 
 void Table::set_num_deleted_episodes_from_checkpoint(int64_t value) {
@@ -571,5 +1797,24 @@ std::string Table::DebugString() const {
   return str;
 }
 
+FlatTrajectory TableItemView::flat_trajectory() const {
+  FlatTrajectory trajectory;
+  REVERB_CHECK(trajectory.ParseFromString(data_->trajectory));
+  return trajectory;
+}
+
+TableItem TableItemView::ToItem() const {
+  TableItem item;
+  item.item.set_key(key_);
+  item.item.set_table(*table_);
+  item.item.set_priority(priority_);
+  item.item.set_times_sampled(times_sampled_);
+  EncodeAsTimestampProto(inserted_at(), item.item.mutable_inserted_at());
+  REVERB_CHECK(
+      item.item.mutable_flat_trajectory()->ParseFromString(data_->trajectory));
+  item.chunks.assign(data_->chunks.begin(), data_->chunks.end());
+  return item;
+}
+
 }  // namespace reverb
 }  // namespace deepmind
@@ -15,7 +15,11 @@
 #ifndef REVERB_CC_TABLE_H_
 #define REVERB_CC_TABLE_H_
 
+#include <array>
+#include <atomic>
 #include <cstddef>
+#include <deque>
+#include <functional>
 #include <initializer_list>
 #include <memory>
 #include <string>
@@ -24,23 +28,32 @@
 
 #include <cstdint>
 #include "absl/base/thread_annotations.h"
+#include "absl/container/inlined_vector.h"
 #include "absl/status/status.h"
 #include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
 #include "absl/types/optional.h"
 #include "absl/types/span.h"
 #include "reverb/cc/checkpointing/checkpoint.pb.h"
 #include "reverb/cc/chunk_store.h"
 #include "reverb/cc/platform/hash_map.h"
 #include "reverb/cc/platform/hash_set.h"
+#include "reverb/cc/platform/thread.h"
 #include "reverb/cc/rate_limiter.h"
 #include "reverb/cc/schema.pb.h"
 #include "reverb/cc/selectors/interface.h"
+#include "reverb/cc/support/coarse_clock.h"
+#include "reverb/cc/support/latency_histogram.h"
+#include "reverb/cc/support/periodic_closure.h"
+#include "reverb/cc/support/reclaimer.h"
 #include "reverb/cc/table_extensions/interface.h"
 #include "tensorflow/core/protobuf/struct.pb.h"
 
 namespace deepmind {
 namespace reverb {
 
+class TableItemView;
+
 // Used for representing items of the priority distribution. See
 // PrioritizedItem in schema.proto for documentation.
 struct TableItem {
@@ -52,24 +65,34 @@ struct TableItem {
 // instances of `ItemSelector`, one for sampling (`sampler`) and
 // another for removing (`remover`). All item operations (insert/update/delete)
 // on the table are propagated to the sampler and remover with the original
-// operation on the table. The `Table` uses the sampler to determine which items
-// it should return when `Table::Sample()` is called. Similarly, the remover is
-// used to determine which items should be deleted to ensure capacity.
+// operation on the table. The selectors are keyed by the dense slot ids which
+// the table assigns to its items rather than by the item keys, so they can
+// index their state by slot instead of hashing the keys. The `Table` uses the
+// sampler to determine which items it should return when `Table::Sample()` is
+// called. Similarly, the remover is used to determine which items should be
+// deleted to ensure capacity.
 //
 // A `RateLimiter` is used to set the ratio of inserted to sampled
 // items. This means that calls to `Table::InsertOrAssign()` and
 // `Table::Sample()` may be blocked by the `RateLimiter` as it enforces this
 // ratio.
 //
-// Please note that the remover is only used to limit the number of items in
-// the table, not the number of data elements nor the memory used. Each item
+// By default the remover is only used to limit the number of items in the
+// table, not the number of data elements nor the memory used. Each item
 // references one or more chunks, each chunk holds one or more data elements and
-// consumes and "unknown" amount of memory. Each chunk can be referenced by any
+// consumes a varying amount of memory. Each chunk can be referenced by any
 // number of items across all tables on the server. Deleting a single item from
 // one table simply decrements the reference count of the chunks it references
 // and only when a chunk is referenced by zero items is it destroyed and its
 // memory deallocated.
 //
+// The table keeps track of the (serialized) size of the distinct chunks
+// referenced by its items (see `num_chunk_bytes`). If `max_chunk_bytes` is
+// set then the remover is also used to delete items until this size is within
+// the budget. Note that chunks shared with other tables are counted in full by
+// every table referencing them, the memory held by the server as a whole is
+// reported by `ChunkStore::num_bytes`.
+//
 // This means you must be careful when choosing the remover strategy. A
 // dangerous example would be using a FIFO  remover for one table and then
 // introducing another with table with a  LIFO remover. In this scenario, the
@@ -90,6 +113,69 @@ class Table {
     int64_t table_size;
   };
 
+  // Number of times a stored item has been sampled. Incremented atomically so
+  // that samplers which only hold `mu_` in shared mode can update it
+  // concurrently. Copies hold the count at the time they were made.
+  class SampleCount {
+   public:
+    SampleCount(int32_t count = 0) : count_(count) {}  // NOLINT
+    SampleCount(const SampleCount& other) : count_(other) {}
+    SampleCount& operator=(const SampleCount& other) {
+      count_.store(other, std::memory_order_relaxed);
+      return *this;
+    }
+
+    operator int32_t() const { return count_.load(std::memory_order_relaxed); }
+
+    // Increments the count and returns the new count.
+    int32_t Increment() {
+      return count_.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+
+   private:
+    std::atomic<int32_t> count_;
+  };
+
+  // Compact representation of an item used when storing it in the table.
+  //
+  // A `PrioritizedItem` proto carries a lot of overhead per item (the table
+  // name, the timestamp submessage and the nested messages of the trajectory)
+  // which adds up to several hundred bytes per item in large tables. Fields
+  // which are shared by all items (the key is stored by the map and the table
+  // name by the table) are therefore dropped and the trajectory is kept in its
+  // serialized form. Stored items are only materialized back into `Item` when
+  // they leave the table (e.g. when sampled or checkpointed) or are passed to
+  // extensions.
+  struct StoredItem {
+    // The parts of the item which never change once it has been inserted.
+    struct Data {
+      // Serialized `FlatTrajectory`.
+      std::string trajectory;
+
+      // Chunks referenced by `trajectory`. Most items only reference a single
+      // chunk so no heap allocation is required for the common case.
+      absl::InlinedVector<std::shared_ptr<ChunkStore::Chunk>, 1> chunks;
+
+      // Sum of the `DataByteSizeLong` of `chunks`.
+      int64_t chunk_bytes = 0;
+    };
+
+    // Shared with the samples taken from the table so that sampling an item
+    // only requires a pointer to be copied while `mu_` is held.
+    std::shared_ptr<const Data> data;
+
+    double priority;
+
+    // Insertion time in nanoseconds since the Unix epoch.
+    int64_t inserted_at_ns;
+
+    SampleCount times_sampled;
+
+    // Dense id which is passed to `sampler_` and `remover_` in place of the
+    // key (see `ItemSelector`). Assigned when the item is inserted.
+    Key slot = 0;
+  };
+
   // Used when checkpointing to ensure that none of the chunks referenced by the
   // checkpointed items are removed before the checkpoint operations has
   // completed.
@@ -111,11 +197,25 @@ class Table {
   // `signature` allows an optional declaration of the data that can be stored
   //   in this table.  writers and readers are responsible for checking against
   //   this signature, as it is available via RPC request.
+  // `max_chunk_bytes` is the maximum total size (in bytes) of the chunks
+  //   referenced by the items in the table. When exceeded by an insert the
+  //   `remover` is used to delete items until the chunks fit. A value <= 0
+  //   means there is no limit.
+  // `max_age` is the maximum age of the items in the table. Items whose
+  //   `inserted_at` is older than `max_age` are deleted by a background
+  //   sweeper regardless of `max_size` (see `ExpireItems`). Must be positive.
+  //   Items never expire if `max_age` is infinite.
+  // `index_episodes` makes the table maintain an index from episode id to the
+  //   keys of the items referencing it, which is required by `DeleteEpisode`
+  //   and `SampleEpisode`.
   Table(std::string name, std::shared_ptr<ItemSelector> sampler,
         std::shared_ptr<ItemSelector> remover, int64_t max_size,
         int32_t max_times_sampled, std::shared_ptr<RateLimiter> rate_limiter,
         std::vector<std::shared_ptr<TableExtension>> extensions = {},
-        absl::optional<tensorflow::StructuredValue> signature = absl::nullopt);
+        absl::optional<tensorflow::StructuredValue> signature = absl::nullopt,
+        int64_t max_chunk_bytes = 0,
+        absl::Duration max_age = absl::InfiniteDuration(),
+        bool index_episodes = false);
 
   ~Table();
 
@@ -134,15 +234,74 @@ class Table {
   // item is removed with the strategy specified by the `remover_`. Please note
   // that we insert the new item that exceeds the capacity BEFORE we run the
   // remover. This means that the newly inserted item could be deleted right
-  // away.
+  // away. The same applies to `max_chunk_bytes` except that as many items as
+  // required to respect the budget are removed.
   absl::Status InsertOrAssign(Item item);
 
+  // Called with the result of `InsertOrAssignAsync`.
+  using InsertCallback = std::function<void(absl::Status)>;
+
+  // Asynchronous version of `InsertOrAssign`. Rather than blocking the calling
+  // thread while the rate limiter does not allow the insert to proceed, the
+  // request is queued and `callback` is invoked once the insert has been
+  // executed, `timeout` has expired (with `DeadlineExceeded`) or the table has
+  // been closed (with `Cancelled`).
+  //
+  // Queued inserts are executed in the order they were received. If no other
+  // insert is queued and the insert can proceed right away then it is executed
+  // and `callback` is invoked before the call returns. Otherwise `callback` is
+  // invoked from a worker thread owned by the table. In both cases `callback`
+  // is invoked without holding the table lock but it should not block as this
+  // delays the completion of other queued requests.
+  void InsertOrAssignAsync(Item item, InsertCallback callback,
+                           absl::Duration timeout = kDefaultTimeout);
+
+  // Same as calling `InsertOrAssign` on each of the items in order but the
+  // lock is only acquired once and the rate limiter is consulted once for as
+  // many inserts as it allows to proceed without blocking.
+  //
+  // All items are validated before any of them are inserted. If any of the
+  // items are invalid then the table is left unmodified. Other errors (e.g.
+  // timeouts or cancellation) can result in only a prefix of the items being
+  // inserted.
+  absl::Status InsertOrAssignBatch(std::vector<Item> items);
+
+  // Asynchronous version of `InsertOrAssignBatch`. `callbacks[i]` is invoked
+  // with the result of inserting `items[i]` as if the items had been passed to
+  // `InsertOrAssignAsync` one by one, but the lock is only acquired once for
+  // all the items that can be executed inline and the callbacks of these are
+  // invoked (in order) once it has been released. The remaining items are
+  // queued, in order, behind the inserts that are already waiting.
+  void InsertOrAssignBatchAsync(std::vector<Item> items,
+                                std::vector<InsertCallback> callbacks,
+                                absl::Duration timeout = kDefaultTimeout);
+
   // Inserts an item without consulting or modifying the RateLimiter about the
   // operation.
   //
   // This should ONLY be used when restoring a `Table` from a checkpoint.
   absl::Status InsertCheckpointItem(Item item);
 
+  // Same as calling `InsertCheckpointItem` for each of `items` but the lock is
+  // only acquired once, the memory of the table is reserved for all the items
+  // up front and the selectors are bulk loaded with
+  // `ItemSelector::InsertBatch` (e.g. heapified or with the sums built
+  // bottom-up) rather than updated once per item.
+  //
+  // This should ONLY be used when restoring a `Table` from a checkpoint.
+  absl::Status BulkLoad(std::vector<Item> items);
+
+  // Inserts an item restored from a checkpoint while the table is serving. The
+  // timestamp of the item is kept and the insert is recorded by the
+  // RateLimiter, which must therefore have been restored with the restored
+  // items excluded from its insert count, so sampling is only allowed once
+  // enough items are resident. Items are removed as by `InsertOrAssign` if the
+  // table overflows. If the key is already present then the item is dropped
+  // as the present item was inserted after the checkpoint was taken.
+  //
+  // This should ONLY be used when restoring a `Table` from a checkpoint.
+  absl::Status InsertRestoredItem(Item item) ABSL_LOCKS_EXCLUDED(mu_);
+
   // Updates the priority or deletes items in this table distribution. All
   // operations in the arguments are applied in the order that they are listed.
   // Different operations can be set at the same time. Ignores non existing keys
@@ -179,13 +338,54 @@ class Table {
   // operation to be "approved" by the rate limiter. The remaining items of the
   // batch will only be added if these can proceeed without releasing the lock
   // and awaiting state changes in the rate limiter.
+  //
+  // Unless `max_times_sampled_` is set, all the samples are approved by the
+  // rate limiter before their keys are selected with a single call to
+  // `ItemSelector::SampleBatch`, which allows the sampler to select the keys of
+  // the batch jointly (e.g. stratified).
+  //
+  // Sampling then does not change the table (beyond the sample counts of the
+  // items), so unless the table also has extensions (which are notified while
+  // holding the exclusive lock) the exclusive lock is released as soon as the
+  // samples have been approved. The keys are selected with
+  // `ItemSelector::SampleBatchShared` while holding the lock in shared mode,
+  // which allows concurrent calls to select their keys in parallel. If the
+  // table was emptied in between then the approvals are lost and the call
+  // starts over.
+  //
+  // The sampled items are materialized into `items` after the lock has been
+  // released.
   absl::Status SampleFlexibleBatch(std::vector<SampledItem>* items,
                                    int batch_size,
                                    absl::Duration timeout = kDefaultTimeout);
 
+  // Called with the result of `SampleFlexibleBatchAsync`. The items are empty
+  // unless the status is OK.
+  using SampleCallback =
+      std::function<void(absl::Status, std::vector<SampledItem>)>;
+
+  // Asynchronous version of `SampleFlexibleBatch`. Queued samples are
+  // completed in the order they were received. See `InsertOrAssignAsync` for
+  // details on how and when `callback` is invoked.
+  void SampleFlexibleBatchAsync(int batch_size, SampleCallback callback,
+                                absl::Duration timeout = kDefaultTimeout);
+
+  // Like `SampleFlexibleBatchAsync` but first applies `updates` and `deletes`
+  // as `MutateItems` does, under the same lock acquisition as the sample. The
+  // items are mutated right away even if the sample is queued. If the
+  // mutation fails then nothing is sampled and `callback` is invoked with the
+  // error.
+  void MutateAndSampleFlexibleBatchAsync(
+      absl::Span<const KeyWithPriority> updates, absl::Span<const Key> deletes,
+      int batch_size, SampleCallback callback,
+      absl::Duration timeout = kDefaultTimeout);
+
   // Returns true iff the current state would allow for `num_samples` to be
   // sampled. Dies if `num_samples` is < 1.
   //
+  // Does not acquire `mu_` so the state could change concurrently and the
+  // result must therefore only be treated as a hint.
+  //
   // TODO(b/153258711): This currently ignores max_size and
   // max_times_sampled arguments to the table, and will return true if e.g.
   // there are 2 items in the table, max_times_sampled=1, and num_samples=3.
@@ -194,6 +394,9 @@ class Table {
   // Returns true iff the current state would allow for `num_inserts` to be
   // inserted. Dies if `num_inserts` is < 1.
   //
+  // Does not acquire `mu_` so the state could change concurrently and the
+  // result must therefore only be treated as a hint.
+  //
   // TODO(b/153258711): This currently ignores max_size and max_times_sampled
   // arguments to the table.
   bool CanInsert(int num_inserts) const;
@@ -217,28 +420,138 @@ class Table {
   // Registered table extensions.
   const std::vector<std::shared_ptr<TableExtension>>& extensions() const;
 
+  // Sets the reclaimer used to destroy deleted items (and the chunks they
+  // hold the last reference to) on a background thread. If not set then the
+  // deleted items are destroyed by the calling thread once `mu_` has been
+  // released.
+  //
+  // Note! This method is not thread safe and caller is responsible for making
+  // sure that this method, nor any other method, is called concurrently.
+  void UnsafeSetReclaimer(std::shared_ptr<internal::Reclaimer> reclaimer);
+
+  // Sets the clock used when assigning `inserted_at` to new items and by the
+  // rate limiter to timestamp calls. Reading a `CoarseClock` is much cheaper
+  // than reading the system clock (which is done while holding `mu_`) but the
+  // timestamps are only accurate up to the resolution of the clock. If not set
+  // then the system clock is used.
+  //
+  // Regardless of the clock, the timestamps of the items are strictly
+  // increasing in the order the items were inserted.
+  //
+  // Note! This method is not thread safe and caller is responsible for making
+  // sure that this method, nor any other method, is called concurrently.
+  void UnsafeSetCoarseClock(std::shared_ptr<internal::CoarseClock> clock);
+
+  // Pins the background threads of the table (i.e the thread which completes
+  // the queued asynchronous requests) to the CPUs of NUMA node `node`. Items
+  // and chunks are allocated by the threads which receive them so only the
+  // memory allocated by the background threads is affected. A negative value
+  // (the default) leaves the threads unpinned.
+  //
+  // Note! This method is not thread safe and caller is responsible for making
+  // sure that this method, nor any other method, is called concurrently.
+  void UnsafeSetNumaNode(int node);
+
+  // NUMA node set by `UnsafeSetNumaNode` or -1 if unset.
+  int numa_node() const;
+
   // Lookup a single item. Returns true if found, else false.
   bool Get(Key key, Item* item) ABSL_LOCKS_EXCLUDED(mu_);
 
   // Get pointer to `data_`. Must only be called by extensions while lock held.
-  const internal::flat_hash_map<Key, Item>* RawLookup()
+  const internal::flat_hash_map<Key, StoredItem>* RawLookup()
       ABSL_ASSERT_EXCLUSIVE_LOCK(mu_);
 
   // Removes all items and resets the RateLimiter to its initial state.
   absl::Status Reset();
 
-  // Generate a checkpoint from the table's current state.
+  // Makes the table read-only, e.g. to serve a restored checkpoint for offline
+  // training. Every subsequent insert, update, delete and reset fails with
+  // `FailedPrecondition`, and since the items and selectors can no longer
+  // change, samples are selected without acquiring `mu_` or consulting the
+  // rate limiter, so any number of threads can sample concurrently without
+  // blocking each other. Samples of a frozen table are not counted by the rate
+  // limiter. Freezing an already frozen table is a no-op.
+  //
+  // Returns `FailedPrecondition` if the table is empty, has requests queued,
+  // or could change as a result of sampling or time passing, i.e. if
+  // `max_times_sampled` or `max_age` is set or extensions are registered, or
+  // if the sampler does not support `ItemSelector::SampleShared`.
+  absl::Status Freeze() ABSL_LOCKS_EXCLUDED(mu_);
+
+  // True if `Freeze` has been called.
+  bool frozen() const;
+
+  // Changes the exponent the priorities are raised to by the sampler and the
+  // remover (see `PrioritizedSelector::SetPriorityExponent`), e.g. to anneal
+  // the degree of prioritization during training. Only the selectors which are
+  // `PrioritizedSelector`s are changed. O(n) time while holding `mu_`.
+  //
+  // Returns `InvalidArgument` if the exponent is negative and
+  // `FailedPrecondition` if the table is frozen or neither selector is a
+  // `PrioritizedSelector`. The table is left unchanged on error.
+  absl::Status SetPriorityExponent(double priority_exponent)
+      ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Deletes all items which reference a chunk of episode `episode_id`. Takes
+  // time proportional to the number of items of the episode. Episodes without
+  // items are ignored. Returns `FailedPrecondition` unless the table was
+  // constructed with `index_episodes`.
+  absl::Status DeleteEpisode(uint64_t episode_id) ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Samples a single item, which counts as one sample for the rate limiter and
+  // `max_times_sampled`, and returns all items of the episode of its first
+  // chunk in the order they were inserted. The sampled item is included even
+  // if it was deleted as a result of the sample. The other items are copied
+  // as they are and are not counted as sampled. Returns `FailedPrecondition`
+  // unless the table was constructed with `index_episodes`.
+  absl::Status SampleEpisode(std::vector<Item>* items,
+                             absl::Duration timeout = kDefaultTimeout)
+      ABSL_LOCKS_EXCLUDED(mu_);
+
+  // True if the table maintains an index of the items of each episode.
+  bool index_episodes() const;
+
+  // Generate a checkpoint from the table's current state. `mu_` is only held
+  // while the state is captured, the items are converted into protos after it
+  // has been released so concurrent inserts and samples are not blocked.
   CheckpointAndChunks Checkpoint() ABSL_LOCKS_EXCLUDED(mu_);
 
-  // Number of items in the table distribution.
-  int64_t size() const ABSL_LOCKS_EXCLUDED(mu_);
+  // Snapshot of the items currently in the table, sorted by insertion time.
+  // Only the items themselves are copied while `mu_` is held (in shared mode,
+  // so samples are not blocked). Use `ToItem` to materialize them.
+  std::vector<std::pair<Key, StoredItem>> SnapshotItems()
+      ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Materializes the item stored as `stored` under `key`, e.g. an item
+  // returned by `SnapshotItems`.
+  Item ToItem(Key key, const StoredItem& stored) const;
+
+  // Number of items in the table distribution. Does not acquire `mu_`.
+  int64_t size() const;
+
+  // Total sampling weight of the items in the table as reported by the
+  // sampler. See `ItemSelector::TotalWeight` for details. Does not acquire
+  // `mu_`.
+  double TotalSamplerWeight() const;
+
+  // Number of episodes in the table. Does not acquire `mu_`.
+  int64_t num_episodes() const;
 
-  // Number of episodes in the table.
-  int64_t num_episodes() const ABSL_LOCKS_EXCLUDED(mu_);
+  // Number of distinct chunks referenced by the items in the table and the sum
+  // of their `DataByteSizeLong`. Does not acquire `mu_`.
+  int64_t num_chunks() const;
+  int64_t num_chunk_bytes() const;
+
+  // Total `DataByteSizeLong` of the chunks referenced by the items inserted
+  // into and sampled from the table since it was created. Items are charged
+  // for all of their chunks. Does not acquire `mu_`.
+  int64_t num_inserted_bytes() const;
+  int64_t num_sampled_bytes() const;
 
   // Number of episodes that previously were in the table but has since been
-  // deleted.
-  int64_t num_deleted_episodes() const ABSL_LOCKS_EXCLUDED(mu_);
+  // deleted. Does not acquire `mu_`.
+  int64_t num_deleted_episodes() const;
 
   // "Manually" set the number of deleted episodes. This is only intended to be
   // called when reconstructing a Table from a checkpoint and will trigger death
@@ -249,13 +562,18 @@ class Table {
   const std::string& name() const;
 
   // Metadata about the table, including the current state of the rate limiter.
+  //
+  // Does not acquire `mu_` so it is safe to call frequently (e.g. when polled
+  // by monitoring) without slowing down inserts and samples. The statistics
+  // are read one by one so they are not guaranteed to be consistent with each
+  // other while the table is being modified.
   TableInfo info() const;
 
   // Signature (if any) of the table.
   const absl::optional<tensorflow::StructuredValue>& signature() const;
 
   // Makes a copy of all COMPLETED rate limiter events since (inclusive)
-  // `min_X_event_id`.
+  // `min_X_event_id`. Does not acquire `mu_`.
   RateLimiterEventHistory GetRateLimiterEventHistory(
       size_t min_insert_event_id, size_t min_sample_event_id) const
       ABSL_LOCKS_EXCLUDED(mu_);
@@ -276,6 +594,171 @@ class Table {
   std::string DebugString() const;
 
  private:
+  // Snapshot of a sampled item taken while holding `mu_`. Only the (refcounted)
+  // immutable data and the fields which can change after the item was inserted
+  // are copied so the materialization can happen after the lock is released.
+  struct StoredSample {
+    Key key;
+    StoredItem stored;
+    double probability;
+    int64_t table_size;
+  };
+
+  // Request queued by `SampleFlexibleBatchAsync`.
+  struct PendingSample {
+    int batch_size;
+    SampleCallback callback;
+    absl::Time deadline;
+  };
+
+  // Request queued by `InsertOrAssignAsync`.
+  struct PendingInsert {
+    Item item;
+    InsertCallback callback;
+    absl::Time deadline;
+  };
+
+  // Implementation of `InsertOrAssign` for an already validated item. See
+  // `InsertNewItem` regarding `deleted_items`.
+  absl::Status InsertOrAssignLocked(Item item, absl::Duration timeout,
+                                    std::vector<StoredItem>* deleted_items)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Implementation of `SampleFlexibleBatch`. The sampled items are appended to
+  // `samples` and items deleted as a result of reaching `max_times_sampled_`
+  // are appended to `deleted_items`.
+  absl::Status SampleFlexibleBatchLocked(int batch_size, absl::Duration timeout,
+                                         std::vector<StoredSample>* samples,
+                                         std::vector<StoredItem>* deleted_items)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Calls `OnSampleBatch` of every extension with `items` and clears them.
+  void NotifySampled(std::vector<TableItemView>* items)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Awaits the approval of the rate limiter for the `index`th sample of a
+  // batch and returns false if it was not approved. All calls but the first
+  // (`index` == 0) return immediately if the rate limiter does not allow
+  // another sample to proceed, which is not an error. Other errors are
+  // written to `status`.
+  bool AwaitSampleApproval(int index, absl::Duration timeout,
+                           absl::Status* status)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Awaits the approval of up to `batch_size` samples, see
+  // `AwaitSampleApproval`, and writes the number of approved samples to
+  // `num_approved`.
+  absl::Status AwaitSampleApprovals(int batch_size, absl::Duration timeout,
+                                    int* num_approved)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Returns true if `SampleFlexibleBatch` can select the keys of approved
+  // samples while holding `mu_` in shared mode. This requires that the sampler
+  // supports `ItemSelector::SampleShared` and that sampling does not change
+  // the items (or notify extensions).
+  bool CanSampleShared() const ABSL_SHARED_LOCKS_REQUIRED(mu_);
+
+  // Selects `num_samples` already approved samples using
+  // `ItemSelector::SampleBatchShared` and appends them to `samples`. Appends
+  // nothing if the table is empty.
+  void SampleApprovedShared(int num_samples,
+                            std::vector<StoredSample>* samples)
+      ABSL_SHARED_LOCKS_REQUIRED(mu_);
+
+  // Selects `num_samples` samples of a frozen table without holding `mu_`. Safe
+  // since neither `data_` nor the selectors change once the table is frozen.
+  void SampleFrozen(int num_samples, std::vector<StoredSample>* samples)
+      ABSL_NO_THREAD_SAFETY_ANALYSIS;
+
+  // Returns `FailedPrecondition` if the table is frozen (see `Freeze`).
+  absl::Status CheckNotFrozen() const;
+
+  // Materializes `samples` and appends the result to `items`.
+  // Also adds the size of the samples to `num_sampled_bytes_`.
+  void MaterializeSamples(const std::vector<StoredSample>& samples,
+                          std::vector<SampledItem>* items);
+
+  // Returns true if `item` is an update or the rate limiter would allow it to
+  // be inserted without blocking.
+  bool CanInsertOrAssignLocked(const Item& item) const
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Returns true if `item` is an insert (rather than an update) or a sample
+  // (if `item` is null) which the rate limiter holds back until a pacing slot
+  // after `now`. See `RateLimiter::NextPacingSlot`.
+  bool IsPacedLocked(const Item* item, absl::Time now) const
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Starts `async_worker_` unless it is already running.
+  void MaybeStartAsyncWorker() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Returns true if the request at the front of `pending_samples_` or
+  // `pending_inserts_` can be completed or if `async_worker_` should stop.
+  bool AsyncWorkerCanProceed() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Loop run by `async_worker_`. Completes the queued requests as the rate
+  // limiter allows them to proceed (or their deadline expires) until
+  // `async_worker_stopped_` is set.
+  void RunAsyncWorker() ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Inserts an item which does not already exist in `data_` into `data_`,
+  // `sampler_`, `remover_` and calls `OnInsert` on all extensions. If the
+  // insert causes `max_size_` or `max_chunk_bytes_` to be exceeded then items
+  // are removed and appended to `deleted_items`.
+  //
+  // The rate limiter must have approved the insert (and not been notified of
+  // it) before this method is called. `Insert` is called on the rate limiter
+  // before the method returns.
+  //
+  // `now_ns` is the time read from the table clock (see `NowNanos`). The
+  // item is assigned the smallest timestamp which is >= `now_ns` and later
+  // than the timestamp of all previously inserted items.
+  absl::Status InsertNewItem(Item item, int64_t now_ns,
+                             std::vector<StoredItem>* deleted_items)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Removes items (appended to `deleted_items`) until the table is within
+  // `max_size_` and `max_chunk_bytes_` after an item has been inserted, and
+  // then notifies the rate limiter of the insert.
+  absl::Status FinalizeInsert(std::vector<StoredItem>* deleted_items)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Asks `remover_` which item to delete next.
+  Key SelectItemToRemove() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Called periodically by `expiry_sweeper_`. Deletes the items which are
+  // older than `max_age_` in small batches, releasing `mu_` between them, so
+  // the lock is never held for long even when many items expire at once. The
+  // age is measured with the system clock since `coarse_clock_` may be set
+  // after the sweeper has started.
+  void ExpireItems() ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Reads the current time (in nanoseconds since the Unix epoch) from
+  // `coarse_clock_` if set and from the system clock otherwise.
+  int64_t NowNanos() const;
+
+  // Inserts `stored` into `data_`, `sampler_` and `remover_`, calls `OnInsert`
+  // on all extensions and increments the episode and chunk references. If
+  // `selector_inserts` is set then the slot and priority of the item are
+  // appended to it instead of being inserted into the selectors, which the
+  // caller must then do with `ItemSelector::InsertBatch`.
+  absl::Status InsertStoredItem(
+      Key key, StoredItem stored,
+      std::vector<KeyWithPriority>* selector_inserts = nullptr)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Materializes the item stored as `stored` under `key`.
+  PrioritizedItem ToPrioritizedItem(Key key, const StoredItem& stored) const;
+
+  // Creates a view of `stored` for the extensions.
+  TableItemView ToItemView(Key key, const StoredItem& stored) const;
+
+  // Same as calling `UpdateItem` for every update in order, but the selectors
+  // apply all the updates in one batch (see `ItemSelector::UpdateBatch`).
+  // Updates of keys which do not exist are ignored.
+  absl::Status UpdateItems(absl::Span<const KeyWithPriority> updates)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
   // Updates item priority in `data_`, `samper_`, `remover_` and calls
   // `OnUpdate` on all extensions not part of `exclude`.
   absl::Status UpdateItem(
@@ -288,31 +771,180 @@ class Table {
   //
   // The deleted item is returned in order to allow the deallocation of the
   // underlying item to be postponed until the lock has been released.
-  absl::Status DeleteItem(Key key, Item* deleted_item)
+  absl::Status DeleteItem(Key key, StoredItem* deleted_item)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
 
+  // Publishes the current size, number of episodes and chunk usage for lock
+  // free reads. Must be called whenever `data_`, `episode_refs_` or
+  // `chunk_refs_` is modified.
+  void PublishStats() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Removes the table references (see `ChunkStore::Chunk::AddTableReference`)
+  // to the chunks of `items`, which must be all the items of the table, and
+  // clears `chunk_refs_`.
+  void ReleaseChunkReferencesLocked(
+      const internal::flat_hash_map<Key, StoredItem>& items)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // State swapped out of the table by `Reset`. Releasing the table references
+  // to the chunks requires a pass over every item so the destructor does it,
+  // i.e. it happens on the thread of `reclaimer_` (if set) once `mu_` has been
+  // released rather than while every stream is blocked on the lock.
+  struct ResetState {
+    ResetState() = default;
+    ResetState(ResetState&&) = default;
+    ~ResetState();
+
+    internal::flat_hash_map<Key, StoredItem> items;
+    internal::flat_hash_map<ChunkStore::Key, int64_t> chunk_refs;
+    internal::flat_hash_map<uint64_t, int64_t> episode_refs;
+    std::vector<Key> slot_keys;
+    std::vector<Key> free_slots;
+    std::deque<std::pair<int64_t, Key>> age_index;
+    internal::flat_hash_map<uint64_t, std::vector<Key>> episode_index;
+  };
+
+  // Calls `fn` with `sampler_` and then with `remover_`, each downcast to its
+  // concrete type if possible (see `internal::VisitSelector`). Returns the
+  // first error returned by `fn`.
+  template <typename Fn>
+  absl::Status ForEachSelector(Fn fn) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Hands over `garbage` to `reclaimer_` if set, otherwise `garbage` is
+  // destroyed when the call returns. Must not be called while holding `mu_`.
+  template <typename T>
+  void Reclaim(T garbage) ABSL_LOCKS_EXCLUDED(mu_) {
+    if (reclaimer_ != nullptr) {
+      reclaimer_->Reclaim(std::move(garbage));
+    }
+  }
+
   // Distribution used for sampling.
   std::shared_ptr<ItemSelector> sampler_ ABSL_GUARDED_BY(mu_);
 
   // Distribution used for removing.
   std::shared_ptr<ItemSelector> remover_ ABSL_GUARDED_BY(mu_);
 
+  // Copies of the options of `sampler_` and `remover_` which allow `info()` to
+  // be served without holding `mu_`. They only change when
+  // `SetPriorityExponent` is called, which refreshes them while holding both
+  // `mu_` and `options_mu_`.
+  mutable absl::Mutex options_mu_;
+  KeyDistributionOptions sampler_options_ ABSL_GUARDED_BY(options_mu_);
+  KeyDistributionOptions remover_options_ ABSL_GUARDED_BY(options_mu_);
+
+  // `kind()` of `sampler_` and `remover_`, which the hot paths use to call the
+  // common selectors without virtual dispatch (see `internal::VisitSelector`).
+  const SelectorKind sampler_kind_;
+  const SelectorKind remover_kind_;
+
+  // `SupportsSampleShared()` of `sampler_`. See `CanSampleShared`.
+  const bool sampler_supports_shared_;
+
   // Bijection of key to item. Used for storing the chunks and timestep range of
   // each item.
-  internal::flat_hash_map<Key, Item> data_ ABSL_GUARDED_BY(mu_);
+  internal::flat_hash_map<Key, StoredItem> data_ ABSL_GUARDED_BY(mu_);
+
+  // Key of the item in every slot (see `StoredItem::slot`), which maps the
+  // keys returned by `sampler_` and `remover_` back to the items. The slots
+  // in `free_slots_` are not in use and are reused by the next inserts.
+  std::vector<Key> slot_keys_ ABSL_GUARDED_BY(mu_);
+  std::vector<Key> free_slots_ ABSL_GUARDED_BY(mu_);
 
   // Count of references from chunks referenced by items.
   internal::flat_hash_map<uint64_t, int64_t> episode_refs_ ABSL_GUARDED_BY(mu_);
 
+  // Keys of the items referencing each episode in the order they were
+  // inserted. An item is listed once under every distinct episode of its
+  // chunks. Only maintained when `index_episodes_` is set.
+  const bool index_episodes_;
+  internal::flat_hash_map<uint64_t, std::vector<Key>> episode_index_
+      ABSL_GUARDED_BY(mu_);
+
+  // Count of references to each chunk from the items in the table and the sum
+  // of `DataByteSizeLong` of the referenced chunks.
+  internal::flat_hash_map<ChunkStore::Key, int64_t> chunk_refs_
+      ABSL_GUARDED_BY(mu_);
+  int64_t chunk_bytes_ ABSL_GUARDED_BY(mu_) = 0;
+
+  // Number of times `Reset()` has been called. Used by `SampleFlexibleBatch`
+  // to detect that the samples it had approved were cleared by a reset while
+  // it did not hold `mu_`.
+  int64_t num_resets_ ABSL_GUARDED_BY(mu_) = 0;
+
   // The total number of episodes that were at some point referenced by items
   // in the table but have since been removed. Is set to 0 when `Reset()`
-  // called.
-  int64_t num_deleted_episodes_ ABSL_GUARDED_BY(mu_);
+  // called. Only modified while holding `mu_`.
+  std::atomic<int64_t> num_deleted_episodes_;
+
+  // Copies of `data_.size()` and `episode_refs_.size()` which are updated by
+  // `PublishStats` and can be read without holding `mu_`.
+  std::atomic<int64_t> num_items_;
+  std::atomic<int64_t> num_episodes_;
+
+  // Copies of `chunk_refs_.size()` and `chunk_bytes_` which are updated by
+  // `PublishStats` and can be read without holding `mu_`.
+  std::atomic<int64_t> num_chunks_{0};
+  std::atomic<int64_t> num_chunk_bytes_{0};
+
+  // See `num_inserted_bytes` and `num_sampled_bytes`. Samples are counted
+  // once they have been materialized so `mu_` is not required.
+  std::atomic<int64_t> num_inserted_bytes_{0};
+  std::atomic<int64_t> num_sampled_bytes_{0};
+
+  // Copy of `sampler_->TotalWeight()` (or the number of items if the sampler
+  // does not know its weight) which is updated by `PublishStats` and can be
+  // read without holding `mu_`.
+  std::atomic<double> total_sampler_weight_{0};
+
+  // Operations which the contention of `mu_` is attributed to (see
+  // `TableLatencyStats.lock_contention`).
+  enum LockOperation {
+    kInsertLock,
+    kSampleLock,
+    kMutateLock,
+    kInfoLock,
+    kResetLock,
+    kCheckpointLock,
+    kAsyncWorkerLock,
+    kExpireLock,
+    kExportLock,
+    kNumLockOperations,
+  };
+
+  // Latencies reported by `info` (see `TableLatencyStats`). Only a sample of
+  // the operations is timed and the histograms are lock-free so they can be
+  // updated while holding `mu_` in shared mode.
+  struct LatencyHistograms {
+    std::array<internal::LockContentionHistograms, kNumLockOperations> lock;
+    internal::AtomicLatencyHistogram selector;
+    internal::AtomicLatencyHistogram extensions;
+  };
+  mutable LatencyHistograms latency_;
 
   // Maximum number of items that this container can hold. InsertOrAssign()
   // respects this limit when inserting a new item.
   const int64_t max_size_;
 
+  // Maximum value of `chunk_bytes_` after an insert has completed. A value
+  // <= 0 means there is no limit.
+  const int64_t max_chunk_bytes_;
+
+  // Items older than this are deleted by `expiry_sweeper_`. Infinite if items
+  // never expire.
+  const absl::Duration max_age_;
+
+  // `inserted_at_ns` and key of the items in the order they were inserted.
+  // Only maintained when `max_age_` is finite. Entries are not removed when
+  // the item is deleted by other means; `ExpireItems` skips them instead,
+  // which bounds the size of the index by the number of inserts within
+  // `max_age_`. Items restored from a checkpoint while new items are inserted
+  // may be indexed out of order, in which case they expire late.
+  std::deque<std::pair<int64_t, Key>> age_index_ ABSL_GUARDED_BY(mu_);
+
+  // Number of items deleted by `ExpireItems`.
+  std::atomic<int64_t> num_expired_items_{0};
+
   // Maximum number of times an item can be sampled before it is deleted.
   // A value <= 0 means there is no limit.
   const int32_t max_times_sampled_;
@@ -335,6 +967,93 @@ class Table {
 
   // Optional signature for data in the table.
   const absl::optional<tensorflow::StructuredValue> signature_;
+
+  // Destroys deleted items outside of the calling thread. See
+  // `UnsafeSetReclaimer`.
+  std::shared_ptr<internal::Reclaimer> reclaimer_;
+
+  // Clock used for `inserted_at`. See `UnsafeSetCoarseClock`.
+  std::shared_ptr<internal::CoarseClock> coarse_clock_;
+
+  // NUMA node of the background threads. See `UnsafeSetNumaNode`.
+  int numa_node_ = -1;
+
+  // Timestamp (in nanoseconds since the Unix epoch) of the most recently
+  // inserted item. Used to keep the timestamps strictly increasing.
+  int64_t last_inserted_at_ns_ ABSL_GUARDED_BY(mu_) = 0;
+
+  // Requests queued by `SampleFlexibleBatchAsync` and `InsertOrAssignAsync`.
+  std::deque<PendingSample> pending_samples_ ABSL_GUARDED_BY(mu_);
+  std::deque<PendingInsert> pending_inserts_ ABSL_GUARDED_BY(mu_);
+
+  // Set by `Close`.
+  bool closed_ ABSL_GUARDED_BY(mu_) = false;
+
+  // Set by `Freeze` while holding `mu_`. Read without `mu_` by the samplers.
+  std::atomic<bool> frozen_{false};
+
+  // Set in the destructor to stop `async_worker_`.
+  bool async_worker_stopped_ ABSL_GUARDED_BY(mu_) = false;
+
+  // Completes the queued asynchronous requests. Started by the first request
+  // which is unable to complete inline.
+  std::unique_ptr<internal::Thread> async_worker_;
+
+  // Calls `ExpireItems`. Only set when `max_age_` is finite.
+  std::unique_ptr<internal::PeriodicClosure> expiry_sweeper_;
+};
+
+// Lightweight view of an item stored in a `Table`. Passed to the hooks of
+// `TableExtension`s in place of a materialized `TableItem` so that the hooks
+// (which run while the table holds its mutex) do not have to parse the
+// trajectory and build a `PrioritizedItem` for every operation.
+//
+// The key, priority, sample count and chunks are available right away. The
+// trajectory is only parsed by `flat_trajectory` and `ToItem`. Copying a view
+// only copies a reference to the immutable data of the item so views can be
+// kept beyond the hook (e.g. by `AsyncTableExtension`) and materialized once
+// the mutex has been released, as long as they do not outlive the table.
+class TableItemView {
+ public:
+  using Key = Table::Key;
+
+  Key key() const { return key_; }
+  double priority() const { return priority_; }
+  int32_t times_sampled() const { return times_sampled_; }
+  absl::Time inserted_at() const {
+    return absl::FromUnixNanos(inserted_at_ns_);
+  }
+  const std::string& table() const { return *table_; }
+
+  // Chunks referenced by the trajectory of the item.
+  absl::Span<const std::shared_ptr<ChunkStore::Chunk>> chunks() const {
+    return data_->chunks;
+  }
+
+  // Parses the trajectory of the item. The trajectory is parsed on every call.
+  FlatTrajectory flat_trajectory() const;
+
+  // Materializes the item. Expensive, see `flat_trajectory`.
+  TableItem ToItem() const;
+
+ private:
+  friend class Table;
+
+  TableItemView(Key key, const Table::StoredItem& stored,
+                const std::string* table)
+      : key_(key),
+        priority_(stored.priority),
+        times_sampled_(stored.times_sampled),
+        inserted_at_ns_(stored.inserted_at_ns),
+        table_(table),
+        data_(stored.data) {}
+
+  Key key_;
+  double priority_;
+  int32_t times_sampled_;
+  int64_t inserted_at_ns_;
+  const std::string* table_;
+  std::shared_ptr<const Table::StoredItem::Data> data_;
 };
 
 }  // namespace reverb
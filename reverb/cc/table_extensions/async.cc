@@ -0,0 +1,230 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/table_extensions/async.h"
+
+#include <algorithm>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "reverb/cc/platform/logging.h"
+#include "reverb/cc/table.h"
+
+namespace deepmind {
+namespace reverb {
+
+absl::Status AsyncTableExtension::Options::Validate() const {
+  if (max_queue_size < 1) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "max_queue_size must be >= 1 but got ", max_queue_size, "."));
+  }
+  if (max_batch_size < 1) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "max_batch_size must be >= 1 but got ", max_batch_size, "."));
+  }
+  return absl::OkStatus();
+}
+
+AsyncTableExtension::AsyncTableExtension(Options options)
+    : options_(std::move(options)) {
+  REVERB_CHECK_OK(options_.Validate());
+}
+
+AsyncTableExtension::AsyncTableExtension()
+    : AsyncTableExtension(Options()) {}
+
+AsyncTableExtension::~AsyncTableExtension() {
+  // The table unregisters the extension before releasing it so this is only
+  // reached with a running worker if the table was never destroyed properly.
+  StopWorker();
+}
+
+absl::Status AsyncTableExtension::RegisterTable(absl::Mutex* mu,
+                                                Table* table) {
+  {
+    absl::MutexLock lock(&mu_);
+    if (table_) {
+      return absl::FailedPreconditionError(absl::StrCat(
+          "Attempting to registering a table ", absl::Hex(table),
+          " (name: ", table->name(), ") with extension that has already been ",
+          "registered with: ", absl::Hex(table_), " (name: ", table_->name(),
+          ")"));
+    }
+    table_ = table;
+    stopped_ = false;
+  }
+  worker_ = internal::StartThread("AsyncTableExtension",
+                                  [this] { RunWorker(); });
+  return absl::OkStatus();
+}
+
+void AsyncTableExtension::UnregisterTable(absl::Mutex* mu, Table* table) {
+  StopWorker();
+  absl::MutexLock lock(&mu_);
+  REVERB_CHECK_EQ(table, table_)
+      << "The wrong Table attempted to unregister this extension.";
+  table_ = nullptr;
+}
+
+void AsyncTableExtension::StopWorker() {
+  {
+    absl::MutexLock lock(&mu_);
+    stopped_ = true;
+  }
+  worker_ = nullptr;
+}
+
+Table* AsyncTableExtension::table() const {
+  absl::MutexLock lock(&mu_);
+  return table_;
+}
+
+void AsyncTableExtension::OnInsert(absl::Mutex* mu, const TableItemView& item) {
+  Enqueue(EventType::kInsert, {&item});
+}
+
+void AsyncTableExtension::OnDelete(absl::Mutex* mu, const TableItemView& item) {
+  Enqueue(EventType::kDelete, {&item});
+}
+
+void AsyncTableExtension::OnUpdate(absl::Mutex* mu, const TableItemView& item) {
+  Enqueue(EventType::kUpdate, {&item});
+}
+
+void AsyncTableExtension::OnSample(absl::Mutex* mu, const TableItemView& item) {
+  Enqueue(EventType::kSample, {&item});
+}
+
+void AsyncTableExtension::OnReset(absl::Mutex* mu) {
+  Enqueue(EventType::kReset, {nullptr});
+}
+
+void AsyncTableExtension::OnUpdateBatch(
+    absl::Mutex* mu, absl::Span<const TableItemView* const> items) {
+  Enqueue(EventType::kUpdate, items);
+}
+
+void AsyncTableExtension::OnSampleBatch(
+    absl::Mutex* mu, absl::Span<const TableItemView* const> items) {
+  Enqueue(EventType::kSample, items);
+}
+
+void AsyncTableExtension::Enqueue(
+    EventType type, absl::Span<const TableItemView* const> items) {
+  absl::MutexLock lock(&mu_);
+  for (const TableItemView* item : items) {
+    // Dropping a reset would leave the extension with items which no longer
+    // exist so resets are accepted even when the queue is full.
+    if (type != EventType::kReset &&
+        queue_.size() >= options_.max_queue_size) {
+      num_dropped_.fetch_add(1, std::memory_order_relaxed);
+      continue;
+    }
+    queue_.push_back(QueuedEvent{
+        type, item != nullptr ? absl::make_optional(*item) : absl::nullopt});
+    num_enqueued_++;
+  }
+}
+
+void AsyncTableExtension::RunWorker() {
+  std::vector<QueuedEvent> queued;
+  std::vector<Event> batch;
+  while (true) {
+    // Items hold references to chunks so the previous batch is released
+    // before waiting for the next one.
+    queued.clear();
+    batch.clear();
+    {
+      absl::MutexLock lock(&mu_);
+      mu_.Await(absl::Condition(
+          +[](AsyncTableExtension* e) ABSL_EXCLUSIVE_LOCKS_REQUIRED(e->mu_) {
+            return e->stopped_ || !e->queue_.empty();
+          },
+          this));
+
+      // Remaining events are processed before the worker stops.
+      if (queue_.empty()) return;
+
+      const int size = std::min<int>(queue_.size(), options_.max_batch_size);
+      queued.reserve(size);
+      std::move(queue_.begin(), queue_.begin() + size,
+                std::back_inserter(queued));
+      queue_.erase(queue_.begin(), queue_.begin() + size);
+    }
+
+    // Neither the table nor the extension is locked while the items are
+    // materialized.
+    batch.reserve(queued.size());
+    for (const QueuedEvent& event : queued) {
+      batch.push_back(
+          Event{event.type, event.item ? event.item->ToItem() : TableItem()});
+    }
+
+    ApplyOnEvents(batch);
+
+    absl::MutexLock lock(&mu_);
+    num_processed_ += batch.size();
+  }
+}
+
+void AsyncTableExtension::WaitUntilIdle() {
+  absl::MutexLock lock(&mu_);
+  const int64_t target = num_enqueued_;
+  auto processed = [this, target]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    return num_processed_ >= target;
+  };
+  mu_.Await(absl::Condition(&processed));
+}
+
+int64_t AsyncTableExtension::num_dropped_events() const {
+  return num_dropped_.load(std::memory_order_relaxed);
+}
+
+void AsyncTableExtension::ApplyOnEvents(absl::Span<const Event> events) {
+  for (const Event& event : events) {
+    switch (event.type) {
+      case EventType::kInsert:
+        ApplyOnInsert(event.item);
+        break;
+      case EventType::kDelete:
+        ApplyOnDelete(event.item);
+        break;
+      case EventType::kUpdate:
+        ApplyOnUpdate(event.item);
+        break;
+      case EventType::kSample:
+        ApplyOnSample(event.item);
+        break;
+      case EventType::kReset:
+        ApplyOnReset();
+        break;
+    }
+  }
+}
+
+void AsyncTableExtension::ApplyOnInsert(const TableItem& item) {}
+
+void AsyncTableExtension::ApplyOnDelete(const TableItem& item) {}
+
+void AsyncTableExtension::ApplyOnUpdate(const TableItem& item) {}
+
+void AsyncTableExtension::ApplyOnSample(const TableItem& item) {}
+
+void AsyncTableExtension::ApplyOnReset() {}
+
+}  // namespace reverb
+}  // namespace deepmind
@@ -0,0 +1,173 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_TABLE_EXTENSIONS_ASYNC_H_
+#define REVERB_CC_TABLE_EXTENSIONS_ASYNC_H_
+
+#include <atomic>
+#include <deque>
+#include <memory>
+
+#include <cstdint>
+#include "absl/base/thread_annotations.h"
+#include "absl/status/status.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
+#include "reverb/cc/platform/thread.h"
+#include "reverb/cc/table.h"
+#include "reverb/cc/table_extensions/interface.h"
+
+namespace deepmind {
+namespace reverb {
+
+// A `TableExtension` whose hooks run on a thread of its own rather than while
+// the parent table holds its mutex. The hooks of the table only copy the view
+// of the item (see `TableItemView`) into a bounded queue and the item is
+// materialized on the worker thread, so expensive extensions (e.g. statistics
+// or diffusion of priorities) do not inflate the critical section of every
+// operation.
+//
+// Consistency model:
+//
+//   * Events are processed one batch at a time on a single worker thread, in
+//     exactly the order the table applied the operations.
+//   * Every event carries a copy of the item as it was when the operation was
+//     applied. The table may have changed further by the time it is processed
+//     so the state of the table must not be assumed to match the event.
+//   * Since the worker does not hold the mutex of the table it may call the
+//     public methods of `table()` (e.g. `UpdateItem` to diffuse priorities).
+//     The resulting events are processed like any other.
+//   * When the queue is full, events are dropped (see `num_dropped_events`)
+//     rather than blocking the table. Resets are never dropped.
+//   * `WaitUntilIdle` blocks until all earlier events have been processed and
+//     all events are processed before the table unregisters the extension.
+//
+// Children override `ApplyOnEvents` or any subset of the per event methods.
+class AsyncTableExtension : public TableExtension {
+ public:
+  struct Options {
+    // Maximum number of events waiting to be processed.
+    int max_queue_size = 10000;
+
+    // Maximum number of events passed to a single call of `ApplyOnEvents`.
+    int max_batch_size = 128;
+
+    absl::Status Validate() const;
+  };
+
+  enum class EventType { kInsert, kDelete, kUpdate, kSample, kReset };
+
+  struct Event {
+    EventType type;
+
+    // Empty for `kReset`.
+    TableItem item;
+  };
+
+  explicit AsyncTableExtension(Options options);
+  AsyncTableExtension();
+  ~AsyncTableExtension() override;
+
+  // Blocks until every event enqueued before the call has been processed.
+  void WaitUntilIdle() ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Number of events which were dropped because the queue was full.
+  int64_t num_dropped_events() const;
+
+ protected:
+  friend class Table;
+
+  // Called on the worker thread with consecutive events. Dispatches each event
+  // to the matching `ApplyOn*` method by default.
+  virtual void ApplyOnEvents(absl::Span<const Event> events);
+
+  // Children should override these (noop by default).
+  virtual void ApplyOnInsert(const TableItem& item);
+  virtual void ApplyOnDelete(const TableItem& item);
+  virtual void ApplyOnUpdate(const TableItem& item);
+  virtual void ApplyOnSample(const TableItem& item);
+  virtual void ApplyOnReset();
+
+  // The table which the extension is registered with, or nullptr.
+  Table* table() const ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Starts the worker thread.
+  absl::Status RegisterTable(absl::Mutex* mu, Table* table)
+      ABSL_LOCKS_EXCLUDED(mu) override;
+
+  // Processes the remaining events and stops the worker thread.
+  void UnregisterTable(absl::Mutex* mu, Table* table)
+      ABSL_LOCKS_EXCLUDED(mu) override;
+
+  // Enqueue a copy of the view.
+  void OnInsert(absl::Mutex* mu, const TableItemView& item) override
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
+  void OnDelete(absl::Mutex* mu, const TableItemView& item) override
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
+  void OnUpdate(absl::Mutex* mu, const TableItemView& item) override
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
+  void OnSample(absl::Mutex* mu, const TableItemView& item) override
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
+  void OnReset(absl::Mutex* mu) override ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
+
+  // Enqueue copies of all the views at once.
+  void OnUpdateBatch(absl::Mutex* mu,
+                     absl::Span<const TableItemView* const> items) override
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
+  void OnSampleBatch(absl::Mutex* mu,
+                     absl::Span<const TableItemView* const> items) override
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
+
+ private:
+  // An event as it is held by the queue. The item is only materialized into
+  // an `Event` by the worker thread.
+  struct QueuedEvent {
+    EventType type;
+
+    // Empty for `kReset`.
+    absl::optional<TableItemView> item;
+  };
+
+  // Enqueues an event of `type` for each item. Items are nullptr for
+  // `kReset`.
+  void Enqueue(EventType type, absl::Span<const TableItemView* const> items)
+      ABSL_LOCKS_EXCLUDED(mu_);
+
+  void RunWorker() ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Joins the worker thread after it has processed the remaining events.
+  void StopWorker() ABSL_LOCKS_EXCLUDED(mu_);
+
+  const Options options_;
+
+  mutable absl::Mutex mu_;
+  Table* table_ ABSL_GUARDED_BY(mu_) = nullptr;
+  std::deque<QueuedEvent> queue_ ABSL_GUARDED_BY(mu_);
+  bool stopped_ ABSL_GUARDED_BY(mu_) = false;
+
+  // Number of events which have been enqueued and processed respectively.
+  int64_t num_enqueued_ ABSL_GUARDED_BY(mu_) = 0;
+  int64_t num_processed_ ABSL_GUARDED_BY(mu_) = 0;
+
+  std::atomic<int64_t> num_dropped_{0};
+
+  // Only set while the extension is registered with a table.
+  std::unique_ptr<internal::Thread> worker_;
+};
+
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_TABLE_EXTENSIONS_ASYNC_H_
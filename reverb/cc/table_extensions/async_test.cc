@@ -0,0 +1,211 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/table_extensions/async.h"
+
+#include <cfloat>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include <cstdint>
+#include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/synchronization/notification.h"
+#include "reverb/cc/chunk_store.h"
+#include "reverb/cc/platform/status_matchers.h"
+#include "reverb/cc/rate_limiter.h"
+#include "reverb/cc/schema.pb.h"
+#include "reverb/cc/selectors/fifo.h"
+#include "reverb/cc/selectors/uniform.h"
+#include "reverb/cc/table.h"
+#include "reverb/cc/testing/proto_test_util.h"
+
+namespace deepmind {
+namespace reverb {
+namespace {
+
+using ::testing::ElementsAre;
+
+TableItem MakeItem(uint64_t key, double priority) {
+  TableItem item;
+  ChunkData data =
+      testing::MakeChunkData(key, testing::MakeSequenceRange(key, 0, 1));
+  item.chunks.push_back(std::make_shared<ChunkStore::Chunk>(data));
+  item.item = testing::MakePrioritizedItem(key, priority, {data});
+  return item;
+}
+
+std::unique_ptr<Table> MakeTable(std::shared_ptr<TableExtension> extension) {
+  return absl::make_unique<Table>(
+      "dist", std::make_shared<UniformSelector>(),
+      std::make_shared<FifoSelector>(), /*max_size=*/2,
+      /*max_times_sampled=*/0,
+      std::make_shared<RateLimiter>(1.0, 1, -DBL_MAX, DBL_MAX),
+      std::vector<std::shared_ptr<TableExtension>>{std::move(extension)});
+}
+
+// Records the events it receives as strings.
+class RecordingExtension : public AsyncTableExtension {
+ public:
+  using AsyncTableExtension::AsyncTableExtension;
+
+  std::string DebugString() const override { return "RecordingExtension"; }
+
+  std::vector<std::string> events() {
+    absl::MutexLock lock(&mu_);
+    return events_;
+  }
+
+  // Blocks the worker in the next call to `ApplyOnEvents` until `release` is
+  // notified.
+  absl::Notification entered;
+  absl::Notification release;
+  bool block = false;
+
+ protected:
+  void ApplyOnEvents(absl::Span<const Event> events) override {
+    if (block) {
+      entered.Notify();
+      release.WaitForNotification();
+      block = false;
+    }
+    AsyncTableExtension::ApplyOnEvents(events);
+  }
+
+  void ApplyOnInsert(const TableItem& item) override {
+    Record(absl::StrCat("insert ", item.item.key()));
+  }
+  void ApplyOnDelete(const TableItem& item) override {
+    Record(absl::StrCat("delete ", item.item.key()));
+  }
+  void ApplyOnUpdate(const TableItem& item) override {
+    Record(absl::StrCat("update ", item.item.key(), " ",
+                        item.item.priority()));
+  }
+  void ApplyOnSample(const TableItem& item) override {
+    Record(absl::StrCat("sample ", item.item.key()));
+  }
+  void ApplyOnReset() override { Record("reset"); }
+
+ private:
+  void Record(std::string event) {
+    absl::MutexLock lock(&mu_);
+    events_.push_back(std::move(event));
+  }
+
+  absl::Mutex mu_;
+  std::vector<std::string> events_ ABSL_GUARDED_BY(mu_);
+};
+
+TEST(AsyncTableExtensionTest, ValidatesOptions) {
+  AsyncTableExtension::Options options;
+  REVERB_EXPECT_OK(options.Validate());
+  options.max_queue_size = 0;
+  EXPECT_EQ(options.Validate().code(), absl::StatusCode::kInvalidArgument);
+  options = AsyncTableExtension::Options();
+  options.max_batch_size = 0;
+  EXPECT_EQ(options.Validate().code(), absl::StatusCode::kInvalidArgument);
+}
+
+TEST(AsyncTableExtensionTest, ProcessesEventsInTableOrder) {
+  auto extension = std::make_shared<RecordingExtension>();
+  auto table = MakeTable(extension);
+
+  REVERB_ASSERT_OK(table->InsertOrAssign(MakeItem(1, 1)));
+  REVERB_ASSERT_OK(table->InsertOrAssign(MakeItem(2, 1)));
+  REVERB_ASSERT_OK(
+      table->MutateItems({testing::MakeKeyWithPriority(1, 5)}, {}));
+  Table::SampledItem sample;
+  REVERB_ASSERT_OK(table->Sample(&sample));
+  // Exceeds `max_size` so the oldest item is removed.
+  REVERB_ASSERT_OK(table->InsertOrAssign(MakeItem(3, 1)));
+  REVERB_ASSERT_OK(table->Reset());
+
+  extension->WaitUntilIdle();
+  EXPECT_THAT(extension->events(),
+              ElementsAre("insert 1", "insert 2", "update 1 5",
+                          absl::StrCat("sample ", sample.item.key()),
+                          "delete 1", "insert 3", "reset"));
+  EXPECT_EQ(extension->num_dropped_events(), 0);
+}
+
+TEST(AsyncTableExtensionTest, DoesNotBlockTableWhenQueueIsFull) {
+  AsyncTableExtension::Options options;
+  options.max_queue_size = 1;
+  auto extension = std::make_shared<RecordingExtension>(options);
+  extension->block = true;
+  auto table = MakeTable(extension);
+
+  // The worker holds the first event while the second fills the queue.
+  REVERB_ASSERT_OK(table->InsertOrAssign(MakeItem(1, 1)));
+  extension->entered.WaitForNotification();
+  REVERB_ASSERT_OK(table->InsertOrAssign(MakeItem(2, 1)));
+  REVERB_ASSERT_OK(table->MutateItems({}, {1, 2}));
+  REVERB_ASSERT_OK(table->Reset());
+  EXPECT_EQ(extension->num_dropped_events(), 2);
+
+  extension->release.Notify();
+  extension->WaitUntilIdle();
+  EXPECT_THAT(extension->events(),
+              ElementsAre("insert 1", "insert 2", "reset"));
+}
+
+TEST(AsyncTableExtensionTest, ProcessesRemainingEventsWhenUnregistered) {
+  auto extension = std::make_shared<RecordingExtension>();
+  auto table = MakeTable(extension);
+  REVERB_ASSERT_OK(table->InsertOrAssign(MakeItem(1, 1)));
+  REVERB_ASSERT_OK(table->InsertOrAssign(MakeItem(2, 1)));
+  table = nullptr;
+  EXPECT_THAT(extension->events(), ElementsAre("insert 1", "insert 2"));
+}
+
+// Diffuses the priority of every inserted item to the item inserted before it
+// through the public API of the table.
+class DiffusingExtension : public AsyncTableExtension {
+ public:
+  std::string DebugString() const override { return "DiffusingExtension"; }
+
+ protected:
+  void ApplyOnInsert(const TableItem& item) override {
+    if (previous_key_ != 0) {
+      REVERB_EXPECT_OK(table()->MutateItems(
+          {testing::MakeKeyWithPriority(previous_key_, item.item.priority())},
+          {}));
+    }
+    previous_key_ = item.item.key();
+  }
+
+ private:
+  uint64_t previous_key_ = 0;
+};
+
+TEST(AsyncTableExtensionTest, CanCallTableFromWorker) {
+  auto extension = std::make_shared<DiffusingExtension>();
+  auto table = MakeTable(extension);
+  REVERB_ASSERT_OK(table->InsertOrAssign(MakeItem(1, 1)));
+  REVERB_ASSERT_OK(table->InsertOrAssign(MakeItem(2, 7)));
+  extension->WaitUntilIdle();
+
+  Table::Item item;
+  ASSERT_TRUE(table->Get(1, &item));
+  EXPECT_EQ(item.item.priority(), 7);
+}
+
+}  // namespace
+}  // namespace reverb
+}  // namespace deepmind
@@ -16,6 +16,7 @@
 
 #include "absl/status/status.h"
 #include "absl/strings/str_cat.h"
+#include "absl/types/span.h"
 #include "reverb/cc/platform/logging.h"
 #include "reverb/cc/table.h"
 
@@ -42,33 +43,53 @@ void TableExtensionBase::UnregisterTable(absl::Mutex* mu, Table* table) {
   table_ = nullptr;
 }
 
-void TableExtensionBase::OnDelete(absl::Mutex* mu, const TableItem& item) {
+void TableExtensionBase::OnDelete(absl::Mutex* mu, const TableItemView& item) {
   ApplyOnDelete(item);
 }
 
-void TableExtensionBase::OnInsert(absl::Mutex* mu, const TableItem& item) {
+void TableExtensionBase::OnInsert(absl::Mutex* mu, const TableItemView& item) {
   ApplyOnInsert(item);
 }
 
 void TableExtensionBase::OnReset(absl::Mutex* mu) { ApplyOnReset(); }
 
-void TableExtensionBase::OnUpdate(absl::Mutex* mu, const TableItem& item) {
+void TableExtensionBase::OnUpdate(absl::Mutex* mu, const TableItemView& item) {
   ApplyOnUpdate(item);
 }
 
-void TableExtensionBase::OnSample(absl::Mutex* mu, const TableItem& item) {
+void TableExtensionBase::OnSample(absl::Mutex* mu, const TableItemView& item) {
   ApplyOnSample(item);
 }
 
-void TableExtensionBase::ApplyOnDelete(const TableItem& item) {}
+void TableExtensionBase::OnUpdateBatch(
+    absl::Mutex* mu, absl::Span<const TableItemView* const> items) {
+  ApplyOnUpdateBatch(items);
+}
+
+void TableExtensionBase::OnSampleBatch(
+    absl::Mutex* mu, absl::Span<const TableItemView* const> items) {
+  ApplyOnSampleBatch(items);
+}
+
+void TableExtensionBase::ApplyOnDelete(const TableItemView& item) {}
 
-void TableExtensionBase::ApplyOnInsert(const TableItem& item) {}
+void TableExtensionBase::ApplyOnInsert(const TableItemView& item) {}
 
 void TableExtensionBase::ApplyOnReset() {}
 
-void TableExtensionBase::ApplyOnUpdate(const TableItem& item) {}
+void TableExtensionBase::ApplyOnUpdate(const TableItemView& item) {}
 
-void TableExtensionBase::ApplyOnSample(const TableItem& item) {}
+void TableExtensionBase::ApplyOnSample(const TableItemView& item) {}
+
+void TableExtensionBase::ApplyOnUpdateBatch(
+    absl::Span<const TableItemView* const> items) {
+  for (const TableItemView* item : items) ApplyOnUpdate(*item);
+}
+
+void TableExtensionBase::ApplyOnSampleBatch(
+    absl::Span<const TableItemView* const> items) {
+  for (const TableItemView* item : items) ApplyOnSample(*item);
+}
 
 }  // namespace reverb
 }  // namespace deepmind
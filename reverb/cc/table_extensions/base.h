@@ -17,6 +17,7 @@
 
 #include "absl/base/thread_annotations.h"
 #include "absl/synchronization/mutex.h"
+#include "absl/types/span.h"
 #include "reverb/cc/table.h"
 #include "reverb/cc/table_extensions/interface.h"
 
@@ -35,11 +36,16 @@ class TableExtensionBase : public TableExtension {
   virtual ~TableExtensionBase() = default;
 
   // Children should override these (noop by default).
-  virtual void ApplyOnDelete(const TableItem& item);
-  virtual void ApplyOnInsert(const TableItem& item);
+  virtual void ApplyOnDelete(const TableItemView& item);
+  virtual void ApplyOnInsert(const TableItemView& item);
   virtual void ApplyOnReset();
-  virtual void ApplyOnUpdate(const TableItem& item);
-  virtual void ApplyOnSample(const TableItem& item);
+  virtual void ApplyOnUpdate(const TableItemView& item);
+  virtual void ApplyOnSample(const TableItemView& item);
+
+  // Children which can process many items at once should override these
+  // (calls ApplyOnUpdate and ApplyOnSample for each item by default).
+  virtual void ApplyOnUpdateBatch(absl::Span<const TableItemView* const> items);
+  virtual void ApplyOnSampleBatch(absl::Span<const TableItemView* const> items);
 
  protected:
   friend class Table;
@@ -51,26 +57,36 @@ class TableExtensionBase : public TableExtension {
       ABSL_LOCKS_EXCLUDED(mu) override;
 
   // Delegates call to ApplyOnDelete.
-  void OnDelete(absl::Mutex* mu, const TableItem& item) override
+  void OnDelete(absl::Mutex* mu, const TableItemView& item) override
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
 
   // Delegates call to ApplyOnInsert.
-  void OnInsert(absl::Mutex* mu, const TableItem& item) override
+  void OnInsert(absl::Mutex* mu, const TableItemView& item) override
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
 
   // Delegates call to ApplyOnReset.
   void OnReset(absl::Mutex* mu) override ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
 
   // Delegates call to ApplyOnUpdate.
-  void OnUpdate(absl::Mutex* mu, const TableItem& item) override
+  void OnUpdate(absl::Mutex* mu, const TableItemView& item) override
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
 
   // Delegates call to ApplyOnSample.
-  void OnSample(absl::Mutex* mu, const TableItem& item) override
+  void OnSample(absl::Mutex* mu, const TableItemView& item) override
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
+
+  // Delegates call to ApplyOnUpdateBatch.
+  void OnUpdateBatch(absl::Mutex* mu,
+                     absl::Span<const TableItemView* const> items) override
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
+
+  // Delegates call to ApplyOnSampleBatch.
+  void OnSampleBatch(absl::Mutex* mu,
+                     absl::Span<const TableItemView* const> items) override
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
 
  protected:
-  absl::Mutex table_mu_;
+  mutable absl::Mutex table_mu_;
   Table* table_ ABSL_GUARDED_BY(table_mu_) = nullptr;
 };
 
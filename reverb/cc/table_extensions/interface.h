@@ -21,18 +21,24 @@
 #include "absl/base/thread_annotations.h"
 #include "absl/status/status.h"
 #include "absl/synchronization/mutex.h"
+#include "absl/types/span.h"
 #include "reverb/cc/schema.pb.h"
 
 namespace deepmind {
 namespace reverb {
 
 class Table;
-class TableItem;
+class TableItemView;
 
 // A `TableExtension` is passed to a single `Table` and executed
 // as part of the atomic operations of the parent table. All "hooks" are
 // executed while parent is holding its mutex and thus latency is very
-// important.
+// important. Extensions which are expensive should derive from
+// `AsyncTableExtension` (see async.h) which runs the hooks on its own thread.
+//
+// The items are passed as `TableItemView`s which are only valid for the
+// duration of the hook unless copied. Use `TableItemView::ToItem` sparingly as
+// it parses the trajectory of the item.
 class TableExtension {
  public:
   virtual ~TableExtension() = default;
@@ -44,23 +50,42 @@ class TableExtension {
   friend class Table;
 
   // Executed just after item is inserted into  parent `Table`.
-  virtual void OnInsert(absl::Mutex* mu, const TableItem& item)
+  virtual void OnInsert(absl::Mutex* mu, const TableItemView& item)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu) = 0;
 
   // Executed just before item is removed from parent `Table`.
-  virtual void OnDelete(absl::Mutex* mu, const TableItem& item)
+  virtual void OnDelete(absl::Mutex* mu, const TableItemView& item)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu) = 0;
 
   // Executed just after the priority of an item has been updated in parent
   // `Table`.
-  virtual void OnUpdate(absl::Mutex* mu, const TableItem& item)
+  virtual void OnUpdate(absl::Mutex* mu, const TableItemView& item)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu) = 0;
 
   // Executed just before a sample is returned. The sample count of the item
   // includes the active sample and thus always is >= 1.
-  virtual void OnSample(absl::Mutex* mu, const TableItem& item)
+  virtual void OnSample(absl::Mutex* mu, const TableItemView& item)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu) = 0;
 
+  // Executed instead of `OnUpdate` for the items updated by a single call to
+  // `Table::MutateItems`, in the order of the updates. Calls `OnUpdate` for
+  // each item by default.
+  virtual void OnUpdateBatch(absl::Mutex* mu,
+                             absl::Span<const TableItemView* const> items)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu) {
+    for (const TableItemView* item : items) OnUpdate(mu, *item);
+  }
+
+  // Executed instead of `OnSample` for the items of a sampled batch, in the
+  // order they were sampled. When an item may be deleted after being sampled
+  // (i.e `max_times_sampled` is set) the batches only hold a single item.
+  // Calls `OnSample` for each item by default.
+  virtual void OnSampleBatch(absl::Mutex* mu,
+                             absl::Span<const TableItemView* const> items)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu) {
+    for (const TableItemView* item : items) OnSample(mu, *item);
+  }
+
   // Executed just before all items are deleted.
   virtual void OnReset(absl::Mutex* mu) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu) = 0;
 
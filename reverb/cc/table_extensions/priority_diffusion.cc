@@ -0,0 +1,148 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/table_extensions/priority_diffusion.h"
+
+#include <string>
+#include <utility>
+
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_join.h"
+#include "absl/synchronization/mutex.h"
+#include "reverb/cc/platform/logging.h"
+#include "reverb/cc/table.h"
+
+namespace deepmind {
+namespace reverb {
+
+absl::Status PriorityDiffusionExtension::Options::Validate() const {
+  if (weights.empty()) {
+    return absl::InvalidArgumentError("weights must not be empty.");
+  }
+  for (double weight : weights) {
+    if (weight < 0 || weight > 1) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "weights must be in [0, 1] but got ", weight, "."));
+    }
+  }
+  return absl::OkStatus();
+}
+
+PriorityDiffusionExtension::PriorityDiffusionExtension(Options options)
+    : options_(std::move(options)) {
+  REVERB_CHECK_OK(options_.Validate());
+}
+
+std::string PriorityDiffusionExtension::DebugString() const {
+  return absl::StrCat("PriorityDiffusionExtension(weights=[",
+                      absl::StrJoin(options_.weights, ", "), "])");
+}
+
+int64_t PriorityDiffusionExtension::num_items() const {
+  absl::MutexLock lock(&table_mu_);
+  return positions_.size();
+}
+
+void PriorityDiffusionExtension::ApplyOnInsert(const TableItemView& item) {
+  if (item.chunks().empty()) return;
+  absl::MutexLock lock(&table_mu_);
+  const Table::Key key = item.key();
+  if (positions_.contains(key)) return;
+
+  const uint64_t episode_id = item.chunks().front()->episode_id();
+  Episode& episode = episodes_[episode_id];
+  const int64_t index = episode.next_index++;
+  episode.keys.emplace_hint(episode.keys.end(), index, key);
+  positions_[key] = {episode_id, index};
+}
+
+void PriorityDiffusionExtension::ApplyOnDelete(const TableItemView& item) {
+  absl::MutexLock lock(&table_mu_);
+  auto it = positions_.find(item.key());
+  if (it == positions_.end()) return;
+
+  auto episode_it = episodes_.find(it->second.episode_id);
+  episode_it->second.keys.erase(it->second.index);
+  if (episode_it->second.keys.empty()) {
+    episodes_.erase(episode_it);
+  }
+  positions_.erase(it);
+}
+
+void PriorityDiffusionExtension::ApplyOnReset() {
+  absl::MutexLock lock(&table_mu_);
+  episodes_.clear();
+  positions_.clear();
+}
+
+void PriorityDiffusionExtension::ApplyOnUpdate(const TableItemView& item) {
+  absl::MutexLock lock(&table_mu_);
+  Diffuse(item, {item.key()});
+}
+
+void PriorityDiffusionExtension::ApplyOnUpdateBatch(
+    absl::Span<const TableItemView* const> items) {
+  absl::MutexLock lock(&table_mu_);
+  internal::flat_hash_set<Table::Key> updated;
+  updated.reserve(items.size());
+  for (const TableItemView* item : items) {
+    updated.insert(item->key());
+  }
+  for (const TableItemView* item : items) {
+    Diffuse(*item, updated);
+  }
+}
+
+void PriorityDiffusionExtension::Diffuse(
+    const TableItemView& item,
+    const internal::flat_hash_set<Table::Key>& skip) {
+  auto it = positions_.find(item.key());
+  if (it == positions_.end() || table_ == nullptr) return;
+
+  const auto& keys = episodes_[it->second.episode_id].keys;
+  const auto center = keys.find(it->second.index);
+  const auto* data = table_->RawLookup();
+  const double priority = item.priority();
+
+  auto update = [&](Table::Key key, double weight)
+                    ABSL_EXCLUSIVE_LOCKS_REQUIRED(table_mu_) {
+    if (weight == 0 || skip.contains(key)) return;
+    auto data_it = data->find(key);
+    if (data_it == data->end()) return;
+    const double old_priority = data_it->second.priority;
+    // The extension is excluded so the update is not diffused any further.
+    auto status = table_->UnsafeUpdateItem(
+        key, (1 - weight) * old_priority + weight * priority, {this});
+    if (!status.ok()) {
+      REVERB_LOG(REVERB_WARNING) << "Failed to diffuse the priority of item "
+                                 << item.key() << " to item " << key
+                                 << ": " << status;
+    }
+  };
+
+  auto next = center;
+  for (double weight : options_.weights) {
+    if (++next == keys.end()) break;
+    update(next->second, weight);
+  }
+  auto previous = center;
+  for (double weight : options_.weights) {
+    if (previous == keys.begin()) break;
+    update((--previous)->second, weight);
+  }
+}
+
+}  // namespace reverb
+}  // namespace deepmind
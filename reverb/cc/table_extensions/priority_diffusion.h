@@ -0,0 +1,101 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_TABLE_EXTENSIONS_PRIORITY_DIFFUSION_H_
+#define REVERB_CC_TABLE_EXTENSIONS_PRIORITY_DIFFUSION_H_
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <cstdint>
+#include "absl/status/status.h"
+#include "absl/types/span.h"
+#include "reverb/cc/platform/hash_map.h"
+#include "reverb/cc/platform/hash_set.h"
+#include "reverb/cc/table.h"
+#include "reverb/cc/table_extensions/base.h"
+
+namespace deepmind {
+namespace reverb {
+
+// Diffuses priority updates to the items which are temporally adjacent to the
+// updated item, i.e the items of the same episode which were inserted just
+// before and after it.
+//
+// The extension maintains an ordered index of the item keys of every episode
+// so the neighbours of an item are found in O(log n) without scanning the
+// table. When the priority of an item is updated to `p`, the priority of its
+// neighbour at distance `d` changes from `q` to
+//
+//   (1 - weights[d - 1]) * q + weights[d - 1] * p
+//
+// Updates made by the extension itself are not diffused any further, and
+// items updated by the same `MutateItems` call keep the priority they were
+// given. The episode of an item is the episode of its first chunk.
+class PriorityDiffusionExtension : public TableExtensionBase {
+ public:
+  struct Options {
+    // Weight of the update for the neighbours at distance 1, 2, ... on either
+    // side of the updated item. Must be in [0, 1].
+    std::vector<double> weights = {0.5};
+
+    absl::Status Validate() const;
+  };
+
+  explicit PriorityDiffusionExtension(Options options);
+
+  std::string DebugString() const override;
+
+  // Number of items in the index.
+  int64_t num_items() const ABSL_LOCKS_EXCLUDED(table_mu_);
+
+ protected:
+  void ApplyOnInsert(const TableItemView& item) override;
+  void ApplyOnDelete(const TableItemView& item) override;
+  void ApplyOnReset() override;
+  void ApplyOnUpdate(const TableItemView& item) override;
+  void ApplyOnUpdateBatch(
+      absl::Span<const TableItemView* const> items) override;
+
+ private:
+  // Position of an item in the index.
+  struct Position {
+    uint64_t episode_id;
+    int64_t index;
+  };
+
+  // Items of an episode ordered by when they were inserted.
+  struct Episode {
+    std::map<int64_t, Table::Key> keys;
+    int64_t next_index = 0;
+  };
+
+  // Diffuses the priority of `item` to its neighbours, except for `skip`.
+  void Diffuse(const TableItemView& item,
+               const internal::flat_hash_set<Table::Key>& skip)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(table_mu_);
+
+  const Options options_;
+
+  internal::flat_hash_map<uint64_t, Episode> episodes_
+      ABSL_GUARDED_BY(table_mu_);
+  internal::flat_hash_map<Table::Key, Position> positions_
+      ABSL_GUARDED_BY(table_mu_);
+};
+
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_TABLE_EXTENSIONS_PRIORITY_DIFFUSION_H_
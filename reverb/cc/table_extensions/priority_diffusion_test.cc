@@ -0,0 +1,145 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/table_extensions/priority_diffusion.h"
+
+#include <cfloat>
+#include <memory>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include <cstdint>
+#include "absl/memory/memory.h"
+#include "reverb/cc/chunk_store.h"
+#include "reverb/cc/platform/status_matchers.h"
+#include "reverb/cc/rate_limiter.h"
+#include "reverb/cc/schema.pb.h"
+#include "reverb/cc/selectors/fifo.h"
+#include "reverb/cc/selectors/prioritized.h"
+#include "reverb/cc/table.h"
+#include "reverb/cc/testing/proto_test_util.h"
+
+namespace deepmind {
+namespace reverb {
+namespace {
+
+TableItem MakeItem(uint64_t key, uint64_t episode_id, double priority) {
+  TableItem item;
+  ChunkData data = testing::MakeChunkData(
+      key, testing::MakeSequenceRange(episode_id, 0, 1));
+  item.chunks.push_back(std::make_shared<ChunkStore::Chunk>(data));
+  item.item = testing::MakePrioritizedItem(key, priority, {data});
+  return item;
+}
+
+std::unique_ptr<Table> MakeTable(
+    std::shared_ptr<PriorityDiffusionExtension> extension) {
+  return absl::make_unique<Table>(
+      "dist", std::make_shared<PrioritizedSelector>(1),
+      std::make_shared<FifoSelector>(), /*max_size=*/100,
+      /*max_times_sampled=*/0,
+      std::make_shared<RateLimiter>(1.0, 1, -DBL_MAX, DBL_MAX),
+      std::vector<std::shared_ptr<TableExtension>>{std::move(extension)});
+}
+
+double Priority(Table* table, uint64_t key) {
+  Table::Item item;
+  EXPECT_TRUE(table->Get(key, &item));
+  return item.item.priority();
+}
+
+TEST(PriorityDiffusionExtensionTest, ValidatesOptions) {
+  PriorityDiffusionExtension::Options options;
+  REVERB_EXPECT_OK(options.Validate());
+  options.weights = {};
+  EXPECT_EQ(options.Validate().code(), absl::StatusCode::kInvalidArgument);
+  options.weights = {0.5, 1.5};
+  EXPECT_EQ(options.Validate().code(), absl::StatusCode::kInvalidArgument);
+  options.weights = {-0.1};
+  EXPECT_EQ(options.Validate().code(), absl::StatusCode::kInvalidArgument);
+}
+
+TEST(PriorityDiffusionExtensionTest, DiffusesToNeighboursOfSameEpisode) {
+  PriorityDiffusionExtension::Options options;
+  options.weights = {0.5, 0.25};
+  auto extension = std::make_shared<PriorityDiffusionExtension>(options);
+  auto table = MakeTable(extension);
+
+  // Items 1-5 belong to episode 1 and are interleaved with item 10 of
+  // episode 2.
+  REVERB_ASSERT_OK(table->InsertOrAssign(MakeItem(1, 1, 1)));
+  REVERB_ASSERT_OK(table->InsertOrAssign(MakeItem(2, 1, 1)));
+  REVERB_ASSERT_OK(table->InsertOrAssign(MakeItem(10, 2, 1)));
+  REVERB_ASSERT_OK(table->InsertOrAssign(MakeItem(3, 1, 1)));
+  REVERB_ASSERT_OK(table->InsertOrAssign(MakeItem(4, 1, 1)));
+  REVERB_ASSERT_OK(table->InsertOrAssign(MakeItem(5, 1, 1)));
+  EXPECT_EQ(extension->num_items(), 6);
+
+  REVERB_ASSERT_OK(
+      table->MutateItems({testing::MakeKeyWithPriority(3, 9)}, {}));
+  EXPECT_EQ(Priority(table.get(), 1), 3);
+  EXPECT_EQ(Priority(table.get(), 2), 5);
+  EXPECT_EQ(Priority(table.get(), 3), 9);
+  EXPECT_EQ(Priority(table.get(), 4), 5);
+  EXPECT_EQ(Priority(table.get(), 5), 3);
+  EXPECT_EQ(Priority(table.get(), 10), 1);
+}
+
+TEST(PriorityDiffusionExtensionTest, SkipsDeletedItems) {
+  auto extension = std::make_shared<PriorityDiffusionExtension>(
+      PriorityDiffusionExtension::Options());
+  auto table = MakeTable(extension);
+  REVERB_ASSERT_OK(table->InsertOrAssign(MakeItem(1, 1, 1)));
+  REVERB_ASSERT_OK(table->InsertOrAssign(MakeItem(2, 1, 1)));
+  REVERB_ASSERT_OK(table->InsertOrAssign(MakeItem(3, 1, 1)));
+
+  REVERB_ASSERT_OK(table->MutateItems({}, {2}));
+  EXPECT_EQ(extension->num_items(), 2);
+
+  // Item 1 is now the neighbour of item 3.
+  REVERB_ASSERT_OK(
+      table->MutateItems({testing::MakeKeyWithPriority(3, 5)}, {}));
+  EXPECT_EQ(Priority(table.get(), 1), 3);
+}
+
+TEST(PriorityDiffusionExtensionTest, KeepsPrioritiesOfItemsInSameBatch) {
+  auto extension = std::make_shared<PriorityDiffusionExtension>(
+      PriorityDiffusionExtension::Options());
+  auto table = MakeTable(extension);
+  REVERB_ASSERT_OK(table->InsertOrAssign(MakeItem(1, 1, 1)));
+  REVERB_ASSERT_OK(table->InsertOrAssign(MakeItem(2, 1, 1)));
+  REVERB_ASSERT_OK(table->InsertOrAssign(MakeItem(3, 1, 1)));
+
+  REVERB_ASSERT_OK(table->MutateItems({testing::MakeKeyWithPriority(1, 7),
+                                       testing::MakeKeyWithPriority(2, 3)},
+                                      {}));
+  EXPECT_EQ(Priority(table.get(), 1), 7);
+  EXPECT_EQ(Priority(table.get(), 2), 3);
+  EXPECT_EQ(Priority(table.get(), 3), 2);
+}
+
+TEST(PriorityDiffusionExtensionTest, ResetClearsIndex) {
+  auto extension = std::make_shared<PriorityDiffusionExtension>(
+      PriorityDiffusionExtension::Options());
+  auto table = MakeTable(extension);
+  REVERB_ASSERT_OK(table->InsertOrAssign(MakeItem(1, 1, 1)));
+  REVERB_ASSERT_OK(table->InsertOrAssign(MakeItem(2, 1, 1)));
+  REVERB_ASSERT_OK(table->Reset());
+  EXPECT_EQ(extension->num_items(), 0);
+}
+
+}  // namespace
+}  // namespace reverb
+}  // namespace deepmind
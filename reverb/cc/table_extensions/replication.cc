@@ -0,0 +1,241 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/table_extensions/replication.h"
+
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "grpcpp/grpcpp.h"
+#include "absl/memory/memory.h"
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "absl/types/span.h"
+#include "reverb/cc/platform/logging.h"
+#include "reverb/cc/platform/status_macros.h"
+#include "reverb/cc/reverb_service.pb.h"
+#include "reverb/cc/support/grpc_util.h"
+#include "reverb/cc/table.h"
+
+namespace deepmind {
+namespace reverb {
+namespace {
+
+// Events which are sent to the standby in the same way.
+enum class EventKind { kInsert, kMutation, kReset, kIgnored };
+
+EventKind KindOf(AsyncTableExtension::EventType type) {
+  switch (type) {
+    case AsyncTableExtension::EventType::kInsert:
+      return EventKind::kInsert;
+    case AsyncTableExtension::EventType::kUpdate:
+    case AsyncTableExtension::EventType::kDelete:
+      return EventKind::kMutation;
+    case AsyncTableExtension::EventType::kReset:
+      return EventKind::kReset;
+    case AsyncTableExtension::EventType::kSample:
+      return EventKind::kIgnored;
+  }
+  return EventKind::kIgnored;
+}
+
+}  // namespace
+
+absl::Status ReplicationExtension::Options::Validate() const {
+  REVERB_RETURN_IF_ERROR(async.Validate());
+  if (max_kept_chunks < 0) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "max_kept_chunks must be >= 0 but got ", max_kept_chunks, "."));
+  }
+  return absl::OkStatus();
+}
+
+ReplicationExtension::ReplicationExtension(
+    std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface> standby,
+    Options options)
+    : AsyncTableExtension(options.async),
+      standby_(std::move(standby)),
+      max_kept_chunks_(options.max_kept_chunks) {
+  REVERB_CHECK(standby_ != nullptr);
+  REVERB_CHECK_OK(options.Validate());
+}
+
+ReplicationExtension::ReplicationExtension(
+    std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface> standby)
+    : ReplicationExtension(std::move(standby), Options()) {}
+
+int64_t ReplicationExtension::num_failed_events() const {
+  return num_failed_.load(std::memory_order_relaxed);
+}
+
+std::string ReplicationExtension::DebugString() const {
+  return absl::StrCat("ReplicationExtension(max_kept_chunks=",
+                      max_kept_chunks_, ")");
+}
+
+void ReplicationExtension::ApplyOnEvents(absl::Span<const Event> events) {
+  size_t begin = 0;
+  while (begin < events.size()) {
+    const EventKind kind = KindOf(events[begin].type);
+    size_t end = begin + 1;
+    while (end < events.size() && KindOf(events[end].type) == kind) end++;
+    auto group = events.subspan(begin, end - begin);
+    begin = end;
+
+    absl::Status status;
+    switch (kind) {
+      case EventKind::kInsert:
+        status = SendInserts(group);
+        break;
+      case EventKind::kMutation:
+        status = SendMutations(group);
+        break;
+      case EventKind::kReset:
+        // Consecutive resets have the same effect as one.
+        status = SendReset(table()->name());
+        break;
+      case EventKind::kIgnored:
+        break;
+    }
+    if (!status.ok()) {
+      num_failed_.fetch_add(group.size(), std::memory_order_relaxed);
+      REVERB_LOG_EVERY_N(REVERB_WARNING, 100)
+          << "Failed to replicate " << group.size()
+          << " operations to the standby: " << status;
+      CloseStream();
+    }
+  }
+}
+
+void ReplicationExtension::UnregisterTable(absl::Mutex* mu, Table* table) {
+  AsyncTableExtension::UnregisterTable(mu, table);
+  CloseStream();
+}
+
+void ReplicationExtension::MaybeOpenStream() {
+  if (stream_ != nullptr) return;
+  context_ = absl::make_unique<grpc::ClientContext>();
+  context_->set_wait_for_ready(true);
+  stream_ = standby_->InsertStream(context_.get());
+}
+
+void ReplicationExtension::CloseStream() {
+  if (stream_ != nullptr) {
+    stream_->WritesDone();
+    auto status = stream_->Finish();
+    if (!status.ok()) {
+      REVERB_LOG(REVERB_WARNING) << "Insert stream to the standby finished "
+                                 << "with " << FromGrpcStatus(status);
+    }
+  }
+  stream_ = nullptr;
+  context_ = nullptr;
+  kept_chunks_.clear();
+  kept_chunk_set_.clear();
+}
+
+absl::Status ReplicationExtension::SendInserts(
+    absl::Span<const Event> events) {
+  MaybeOpenStream();
+
+  InsertStreamRequest request;
+  auto* batch = request.mutable_batch();
+  for (const Event& event : events) {
+    for (const auto& chunk : event.item.chunks) {
+      if (!kept_chunk_set_.insert(chunk->key()).second) continue;
+      kept_chunks_.push_back(chunk->key());
+      std::shared_ptr<const ChunkData> data;
+      REVERB_RETURN_IF_ERROR(chunk->PinData(&data));
+      *batch->add_requests()->mutable_chunk() = *data;
+    }
+
+    auto* insertion = batch->add_requests()->mutable_item();
+    *insertion->mutable_item() = event.item.item;
+    insertion->set_keep_unreleased_chunks(true);
+    while (kept_chunks_.size() > max_kept_chunks_) {
+      insertion->add_released_chunk_keys(kept_chunks_.front());
+      kept_chunk_set_.erase(kept_chunks_.front());
+      kept_chunks_.pop_front();
+    }
+  }
+
+  // The standby confirms the items in order, so waiting for the confirmation
+  // of the last item ensures that mutations sent afterwards find all of them.
+  const uint64_t last_key = events.back().item.item.key();
+  batch->mutable_requests()->rbegin()->mutable_item()->set_send_confirmation(
+      true);
+  if (!stream_->Write(request)) {
+    return FromGrpcStatus(stream_->Finish());
+  }
+  InsertStreamResponse response;
+  while (stream_->Read(&response)) {
+    if (response.key() == last_key) return absl::OkStatus();
+    for (uint64_t key : response.keys()) {
+      if (key == last_key) return absl::OkStatus();
+    }
+  }
+  return absl::UnavailableError(
+      "Insert stream to the standby closed before the items were confirmed.");
+}
+
+absl::Status ReplicationExtension::SendMutations(
+    absl::Span<const Event> events) {
+  // The updates and deletes of a request are applied updates first, so the
+  // events are split wherever that would reorder them.
+  MutatePrioritiesRequest request;
+  auto flush = [&]() -> absl::Status {
+    if (request.updates().empty() && request.delete_keys().empty()) {
+      return absl::OkStatus();
+    }
+    grpc::ClientContext context;
+    context.set_wait_for_ready(true);
+    MutatePrioritiesResponse response;
+    auto status = standby_->MutatePriorities(&context, request, &response);
+    request.Clear();
+    return FromGrpcStatus(status);
+  };
+
+  for (const Event& event : events) {
+    const auto& item = event.item.item;
+    if (request.table() != item.table()) {
+      REVERB_RETURN_IF_ERROR(flush());
+      request.set_table(item.table());
+    }
+    if (event.type == EventType::kUpdate) {
+      if (!request.delete_keys().empty()) {
+        REVERB_RETURN_IF_ERROR(flush());
+        request.set_table(item.table());
+      }
+      auto* update = request.add_updates();
+      update->set_key(item.key());
+      update->set_priority(item.priority());
+    } else {
+      request.add_delete_keys(item.key());
+    }
+  }
+  return flush();
+}
+
+absl::Status ReplicationExtension::SendReset(const std::string& table) {
+  grpc::ClientContext context;
+  context.set_wait_for_ready(true);
+  ResetRequest request;
+  request.set_table(table);
+  ResetResponse response;
+  return FromGrpcStatus(standby_->Reset(&context, request, &response));
+}
+
+}  // namespace reverb
+}  // namespace deepmind
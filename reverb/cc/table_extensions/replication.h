@@ -0,0 +1,130 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_TABLE_EXTENSIONS_REPLICATION_H_
+#define REVERB_CC_TABLE_EXTENSIONS_REPLICATION_H_
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+
+#include "grpcpp/grpcpp.h"
+#include "absl/status/status.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/types/span.h"
+#include "reverb/cc/platform/hash_set.h"
+#include "reverb/cc/reverb_service.grpc.pb.h"
+#include "reverb/cc/reverb_service.pb.h"
+#include "reverb/cc/table.h"
+#include "reverb/cc/table_extensions/async.h"
+
+namespace deepmind {
+namespace reverb {
+
+// Replicates the operations applied to the parent table (on the primary
+// server) to the table with the same name on a standby server, so that the
+// standby holds (close to) the same items and chunks and clients can fail over
+// to it without waiting for a checkpoint to be restored.
+//
+// Inserted items are sent, together with the chunks they reference, over an
+// insert stream to the standby. Updates and deletes (including those made by
+// the remover and by `max_times_sampled`) are sent as `MutatePriorities` calls
+// and resets as `Reset` calls. The operations are sent by the worker thread of
+// `AsyncTableExtension` in the order the table applied them, so the primary is
+// never blocked by the standby.
+//
+// Replication is best effort:
+//
+//   * Events dropped by the queue (see `num_dropped_events`) or which fail to
+//     reach the standby (see `num_failed_events`) are lost. The insert stream
+//     is reopened by the next insert after a failure.
+//   * The number of times items have been sampled is not replicated.
+//   * The tables of the standby must accept inserts without being sampled,
+//     i.e. use a rate limiter which never blocks inserts (e.g. `MinSize`).
+class ReplicationExtension : public AsyncTableExtension {
+ public:
+  struct Options {
+    AsyncTableExtension::Options async;
+
+    // Maximum number of chunks which the insert stream to the standby keeps
+    // alive after the items referencing them have been sent. Chunks are
+    // usually referenced by several consecutive items so keeping the most
+    // recently sent chunks avoids sending them more than once. Chunks which
+    // are referenced after they have been released are sent again.
+    int max_kept_chunks = 1024;
+
+    absl::Status Validate() const;
+  };
+
+  ReplicationExtension(
+      std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface> standby,
+      Options options);
+  explicit ReplicationExtension(
+      std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface> standby);
+
+  // Number of events which were not replicated because a call to the standby
+  // failed.
+  int64_t num_failed_events() const;
+
+  std::string DebugString() const override;
+
+ protected:
+  // Groups consecutive events of the same kind and sends each group with a
+  // single call (or batch of stream messages) to the standby.
+  void ApplyOnEvents(absl::Span<const Event> events) override;
+
+  // Closes the insert stream once the remaining events have been sent.
+  void UnregisterTable(absl::Mutex* mu, Table* table)
+      ABSL_LOCKS_EXCLUDED(mu) override;
+
+ private:
+  // Sends the items of `events` (all `kInsert`) and the chunks they reference
+  // which the stream does not already hold. Returns once the standby has
+  // confirmed the items.
+  absl::Status SendInserts(absl::Span<const Event> events);
+
+  // Sends the updates and deletes of `events` (all `kUpdate` or `kDelete`).
+  absl::Status SendMutations(absl::Span<const Event> events);
+
+  absl::Status SendReset(const std::string& table);
+
+  // Opens the insert stream unless it is already open.
+  void MaybeOpenStream();
+
+  // Closes the insert stream (if open), which releases the chunks it keeps.
+  void CloseStream();
+
+  const std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface> standby_;
+  const int max_kept_chunks_;
+
+  std::atomic<int64_t> num_failed_{0};
+
+  // The insert stream to the standby. Only used by the worker thread, and by
+  // `UnregisterTable` once the worker has stopped.
+  std::unique_ptr<grpc::ClientContext> context_;
+  std::unique_ptr<grpc::ClientReaderWriterInterface<InsertStreamRequest,
+                                                    InsertStreamResponse>>
+      stream_;
+
+  // Chunks kept alive by `stream_`, oldest first.
+  std::deque<uint64_t> kept_chunks_;
+  internal::flat_hash_set<uint64_t> kept_chunk_set_;
+};
+
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_TABLE_EXTENSIONS_REPLICATION_H_
@@ -0,0 +1,168 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "reverb/cc/table_extensions/replication.h"
+
+#include <cfloat>
+#include <memory>
+#include <vector>
+
+#include "grpcpp/grpcpp.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include <cstdint>
+#include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
+#include "reverb/cc/chunk_store.h"
+#include "reverb/cc/platform/grpc_utils.h"
+#include "reverb/cc/platform/net.h"
+#include "reverb/cc/platform/server.h"
+#include "reverb/cc/platform/status_matchers.h"
+#include "reverb/cc/rate_limiter.h"
+#include "reverb/cc/reverb_service.grpc.pb.h"
+#include "reverb/cc/schema.pb.h"
+#include "reverb/cc/selectors/fifo.h"
+#include "reverb/cc/selectors/uniform.h"
+#include "reverb/cc/table.h"
+#include "reverb/cc/testing/proto_test_util.h"
+
+namespace deepmind {
+namespace reverb {
+namespace {
+
+TableItem MakeItem(uint64_t key, double priority) {
+  TableItem item;
+  ChunkData data =
+      testing::MakeChunkData(key, testing::MakeSequenceRange(key, 0, 1));
+  item.chunks.push_back(std::make_shared<ChunkStore::Chunk>(data));
+  item.item = testing::MakePrioritizedItem(key, priority, {data});
+  return item;
+}
+
+std::shared_ptr<Table> MakeTable(
+    std::vector<std::shared_ptr<TableExtension>> extensions = {}) {
+  return std::make_shared<Table>(
+      "dist", std::make_shared<UniformSelector>(),
+      std::make_shared<FifoSelector>(), /*max_size=*/10,
+      /*max_times_sampled=*/0,
+      std::make_shared<RateLimiter>(1.0, 1, -DBL_MAX, DBL_MAX),
+      std::move(extensions));
+}
+
+class ReplicationExtensionTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    standby_table_ = MakeTable();
+    int port = internal::PickUnusedPortOrDie();
+    REVERB_ASSERT_OK(StartServer({standby_table_}, port,
+                                 /*checkpointer=*/nullptr, &server_));
+    extension_ = std::make_shared<ReplicationExtension>(
+        /* grpc_gen:: */ReverbService::NewStub(CreateCustomGrpcChannel(
+            absl::StrCat("localhost:", port), MakeChannelCredentials(),
+            grpc::ChannelArguments())));
+    table_ = MakeTable({extension_});
+  }
+
+  void TearDown() override {
+    table_ = nullptr;
+    server_->Stop();
+  }
+
+  std::shared_ptr<Table> standby_table_;
+  std::unique_ptr<Server> server_;
+  std::shared_ptr<ReplicationExtension> extension_;
+  std::shared_ptr<Table> table_;
+};
+
+TEST_F(ReplicationExtensionTest, ReplicatesInserts) {
+  for (int i = 1; i <= 3; i++) {
+    REVERB_ASSERT_OK(table_->InsertOrAssign(MakeItem(i, i)));
+  }
+  extension_->WaitUntilIdle();
+
+  EXPECT_EQ(standby_table_->size(), 3);
+  for (int i = 1; i <= 3; i++) {
+    Table::Item item;
+    ASSERT_TRUE(standby_table_->Get(i, &item));
+    EXPECT_EQ(item.item.priority(), i);
+    ASSERT_EQ(item.chunks.size(), 1);
+    EXPECT_EQ(item.chunks[0]->key(), i);
+  }
+  EXPECT_EQ(extension_->num_failed_events(), 0);
+}
+
+TEST_F(ReplicationExtensionTest, ReplicatesUpdatesAndDeletes) {
+  for (int i = 1; i <= 3; i++) {
+    REVERB_ASSERT_OK(table_->InsertOrAssign(MakeItem(i, i)));
+  }
+  REVERB_ASSERT_OK(
+      table_->MutateItems({testing::MakeKeyWithPriority(1, 5)}, {}));
+  REVERB_ASSERT_OK(table_->MutateItems({}, {2}));
+  extension_->WaitUntilIdle();
+
+  EXPECT_EQ(standby_table_->size(), 2);
+  Table::Item item;
+  ASSERT_TRUE(standby_table_->Get(1, &item));
+  EXPECT_EQ(item.item.priority(), 5);
+  EXPECT_FALSE(standby_table_->Get(2, &item));
+  EXPECT_TRUE(standby_table_->Get(3, &item));
+  EXPECT_EQ(extension_->num_failed_events(), 0);
+}
+
+TEST_F(ReplicationExtensionTest, ReplicatesRemovals) {
+  // The primary table holds at most 10 items so the oldest items are removed
+  // by the FIFO remover and the removals are replicated as deletes.
+  for (int i = 1; i <= 12; i++) {
+    REVERB_ASSERT_OK(table_->InsertOrAssign(MakeItem(i, i)));
+  }
+  extension_->WaitUntilIdle();
+
+  EXPECT_EQ(standby_table_->size(), 10);
+  Table::Item item;
+  EXPECT_FALSE(standby_table_->Get(1, &item));
+  EXPECT_FALSE(standby_table_->Get(2, &item));
+  EXPECT_TRUE(standby_table_->Get(12, &item));
+  EXPECT_EQ(extension_->num_failed_events(), 0);
+}
+
+TEST_F(ReplicationExtensionTest, ReplicatesReset) {
+  for (int i = 1; i <= 3; i++) {
+    REVERB_ASSERT_OK(table_->InsertOrAssign(MakeItem(i, i)));
+  }
+  REVERB_ASSERT_OK(table_->Reset());
+  REVERB_ASSERT_OK(table_->InsertOrAssign(MakeItem(4, 4)));
+  extension_->WaitUntilIdle();
+
+  EXPECT_EQ(standby_table_->size(), 1);
+  Table::Item item;
+  EXPECT_TRUE(standby_table_->Get(4, &item));
+  EXPECT_EQ(extension_->num_failed_events(), 0);
+}
+
+TEST(ReplicationExtensionOptionsTest, Validate) {
+  ReplicationExtension::Options options;
+  REVERB_EXPECT_OK(options.Validate());
+
+  options.max_kept_chunks = -1;
+  EXPECT_FALSE(options.Validate().ok());
+
+  options.max_kept_chunks = 0;
+  options.async.max_batch_size = 0;
+  EXPECT_FALSE(options.Validate().ok());
+}
+
+}  // namespace
+}  // namespace reverb
+}  // namespace deepmind
@@ -16,6 +16,7 @@
 
 #include <atomic>
 #include <cfloat>
+#include <map>
 #include <memory>
 #include <string>
 #include <utility>
@@ -26,6 +27,7 @@
 #include <cstdint>
 #include "absl/memory/memory.h"
 #include "absl/synchronization/notification.h"
+#include "absl/time/clock.h"
 #include "absl/time/time.h"
 #include "reverb/cc/checkpointing/checkpoint.pb.h"
 #include "reverb/cc/chunk_store.h"
@@ -34,7 +36,11 @@
 #include "reverb/cc/rate_limiter.h"
 #include "reverb/cc/schema.pb.h"
 #include "reverb/cc/selectors/fifo.h"
+#include "reverb/cc/selectors/interface.h"
+#include "reverb/cc/selectors/prioritized.h"
 #include "reverb/cc/selectors/uniform.h"
+#include "reverb/cc/support/coarse_clock.h"
+#include "reverb/cc/support/reclaimer.h"
 #include "reverb/cc/table_extensions/interface.h"
 #include "reverb/cc/testing/proto_test_util.h"
 #include "tensorflow/core/framework/tensor_shape.h"
@@ -50,8 +56,10 @@ const absl::Duration kTimeout = absl::Milliseconds(250);
 
 using ::deepmind::reverb::testing::Partially;
 using ::testing::ElementsAre;
+using ::testing::ElementsAreArray;
 using ::testing::IsEmpty;
 using ::testing::SizeIs;
+using ::testing::UnorderedElementsAre;
 
 MATCHER_P(HasItemKey, key, "") { return arg.item.key() == key; }
 
@@ -113,6 +121,31 @@ TEST(TableTest, CopySubset) {
   EXPECT_THAT(table->Copy(2), SizeIs(2));
 }
 
+TEST(TableTest, SnapshotItemsInInsertionOrder) {
+  auto table = MakeUniformTable("dist");
+  REVERB_EXPECT_OK(table->InsertOrAssign(MakeItem(1, 123)));
+  REVERB_EXPECT_OK(table->InsertOrAssign(MakeItem(3, 125)));
+  REVERB_EXPECT_OK(table->InsertOrAssign(MakeItem(2, 124)));
+
+  auto snapshot = table->SnapshotItems();
+  ASSERT_THAT(snapshot, SizeIs(3));
+
+  // Items deleted after the snapshot was taken are still materialized.
+  REVERB_EXPECT_OK(table->Reset());
+  std::vector<PrioritizedItem> items;
+  for (const auto& [key, stored] : snapshot) {
+    auto item = table->ToItem(key, stored);
+    EXPECT_THAT(item.chunks, SizeIs(1));
+    items.push_back(std::move(item.item));
+  }
+  EXPECT_THAT(items, ElementsAre(Partially(testing::EqualsProto(
+                                     "key: 1 priority: 123 table: 'dist'")),
+                                 Partially(testing::EqualsProto(
+                                     "key: 3 priority: 125 table: 'dist'")),
+                                 Partially(testing::EqualsProto(
+                                     "key: 2 priority: 124 table: 'dist'"))));
+}
+
 TEST(TableTest, InsertOrAssignOverwrites) {
   auto table = MakeUniformTable("dist");
   REVERB_EXPECT_OK(table->InsertOrAssign(MakeItem(3, 123)));
@@ -138,6 +171,28 @@ TEST(TableTest, UpdatesAreAppliedPartially) {
   EXPECT_EQ(items[0].item.priority(), 456);
 }
 
+TEST(TableTest, UpdatesAreAppliedInOrder) {
+  Table table("dist", absl::make_unique<PrioritizedSelector>(1),
+              absl::make_unique<FifoSelector>(), 1000, 0, MakeLimiter(1));
+  REVERB_EXPECT_OK(table.InsertOrAssign(MakeItem(3, 1)));
+  REVERB_EXPECT_OK(table.InsertOrAssign(MakeItem(4, 1)));
+  REVERB_EXPECT_OK(table.MutateItems(
+      {
+          testing::MakeKeyWithPriority(3, 5),
+          testing::MakeKeyWithPriority(5, 55),
+          testing::MakeKeyWithPriority(4, 2),
+          testing::MakeKeyWithPriority(3, 6),
+      },
+      {}));
+
+  Table::Item item;
+  ASSERT_TRUE(table.Get(3, &item));
+  EXPECT_EQ(item.item.priority(), 6);
+  ASSERT_TRUE(table.Get(4, &item));
+  EXPECT_EQ(item.item.priority(), 2);
+  EXPECT_DOUBLE_EQ(table.TotalSamplerWeight(), 8);
+}
+
 TEST(TableTest, DeletesAreAppliedPartially) {
   auto table = MakeUniformTable("dist");
   REVERB_EXPECT_OK(table->InsertOrAssign(MakeItem(3, 123)));
@@ -146,6 +201,94 @@ TEST(TableTest, DeletesAreAppliedPartially) {
   EXPECT_THAT(table->Copy(), ElementsAre(HasItemKey(7)));
 }
 
+TEST(TableTest, InsertOrAssignBatchInsertsAndUpdates) {
+  auto table = MakeUniformTable("dist");
+  REVERB_EXPECT_OK(table->InsertOrAssign(MakeItem(1, 123)));
+
+  std::vector<Table::Item> items;
+  items.push_back(MakeItem(1, 456));
+  items.push_back(MakeItem(2, 123));
+  items.push_back(MakeItem(3, 123));
+  items.push_back(MakeItem(3, 789));
+  REVERB_EXPECT_OK(table->InsertOrAssignBatch(std::move(items)));
+
+  EXPECT_EQ(table->size(), 3);
+  Table::Item item;
+  ASSERT_TRUE(table->Get(1, &item));
+  EXPECT_EQ(item.item.priority(), 456);
+  ASSERT_TRUE(table->Get(3, &item));
+  EXPECT_EQ(item.item.priority(), 789);
+
+  // The items are inserted in order.
+  auto checkpoint = table->Checkpoint();
+  ASSERT_THAT(checkpoint.checkpoint.items(), SizeIs(3));
+  for (int i = 0; i < 3; i++) {
+    EXPECT_EQ(checkpoint.checkpoint.items(i).key(), i + 1);
+  }
+}
+
+TEST(TableTest, InsertOrAssignBatchDeletesWhenOverflowing) {
+  auto table = MakeUniformTable("dist", 10);
+
+  std::vector<Table::Item> items;
+  for (int i = 0; i < 15; i++) {
+    items.push_back(MakeItem(i, 123));
+  }
+  REVERB_EXPECT_OK(table->InsertOrAssignBatch(std::move(items)));
+
+  auto copy = table->Copy();
+  EXPECT_THAT(copy, SizeIs(10));
+  for (const Table::Item& item : copy) {
+    EXPECT_GE(item.item.key(), 5);
+  }
+}
+
+TEST(TableTest, InsertOrAssignBatchValidatesAllItemsFirst) {
+  auto table = MakeUniformTable("dist");
+
+  std::vector<Table::Item> items;
+  items.push_back(MakeItem(1, 123));
+  items.push_back(MakeItem(2, 123));
+  items.back().chunks.clear();
+  EXPECT_EQ(table->InsertOrAssignBatch(std::move(items)).code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(table->size(), 0);
+}
+
+TEST(TableTest, InsertOrAssignBatchBlocksWhenRateLimited) {
+  auto table = absl::make_unique<Table>(
+      "dist", absl::make_unique<UniformSelector>(),
+      absl::make_unique<FifoSelector>(), 1000, 0,
+      absl::make_unique<RateLimiter>(/*samples_per_insert=*/1.0,
+                                     /*min_size_to_sample=*/1,
+                                     /*min_diff=*/-DBL_MAX,
+                                     /*max_diff=*/2.0));
+
+  absl::Notification notification;
+  auto insert_thread = internal::StartThread("", [&] {
+    std::vector<Table::Item> items;
+    for (int i = 0; i < 5; i++) {
+      items.push_back(MakeItem(i, 123));
+    }
+    REVERB_EXPECT_OK(table->InsertOrAssignBatch(std::move(items)));
+    notification.Notify();
+  });
+
+  // Only the first two items can be inserted before the limiter blocks.
+  EXPECT_FALSE(notification.WaitForNotificationWithTimeout(kTimeout));
+  EXPECT_EQ(table->size(), 2);
+
+  // Sampling allows the remaining inserts to proceed.
+  for (int i = 0; i < 3; i++) {
+    Table::SampledItem sample;
+    REVERB_EXPECT_OK(table->Sample(&sample));
+  }
+  EXPECT_TRUE(notification.WaitForNotificationWithTimeout(kTimeout));
+  EXPECT_EQ(table->size(), 5);
+
+  insert_thread = nullptr;  // Joins the thread.
+}
+
 TEST(TableTest, SampleBlocksWhenNotEnoughItems) {
   auto table = MakeUniformTable("dist");
 
@@ -173,6 +316,7 @@ TEST(TableTest, SampleMatchesInsert) {
 
   Table::SampledItem sample;
   REVERB_EXPECT_OK(table->Sample(&sample));
+  item.item.set_table("dist");
   item.item.set_times_sampled(1);
   sample.item.clear_inserted_at();
   EXPECT_THAT(sample.item, testing::EqualsProto(item.item));
@@ -206,6 +350,24 @@ TEST(TableTest, MaxTimesSampledIsRespected) {
   EXPECT_THAT(table->Copy(), IsEmpty());
 }
 
+TEST(TableTest, SampledItemOutlivesDeletedItem) {
+  auto table = MakeUniformTable("dist", 10, 1);
+
+  Table::Item item = MakeItem(3, 123);
+  REVERB_EXPECT_OK(table->InsertOrAssign(item));
+
+  // The item is deleted as part of the sample so the sample must hold its own
+  // references to the trajectory and chunks.
+  Table::SampledItem sample;
+  REVERB_ASSERT_OK(table->Sample(&sample));
+  EXPECT_THAT(table->Copy(), IsEmpty());
+  EXPECT_EQ(sample.item.times_sampled(), 1);
+  EXPECT_THAT(sample.item.flat_trajectory(),
+              testing::EqualsProto(item.item.flat_trajectory()));
+  EXPECT_EQ(sample.chunks, item.chunks);
+  EXPECT_EQ(sample.table_size, 1);
+}
+
 TEST(TableTest, InsertDeletesWhenOverflowing) {
   auto table = MakeUniformTable("dist", 10);
 
@@ -220,6 +382,173 @@ TEST(TableTest, InsertDeletesWhenOverflowing) {
   }
 }
 
+TEST(TableTest, SelectorsFollowItemsAcrossReusedSlots) {
+  Table table("dist", absl::make_unique<PrioritizedSelector>(1),
+              absl::make_unique<FifoSelector>(), /*max_size=*/3,
+              /*max_times_sampled=*/0, MakeLimiter(1));
+
+  // Keys are far larger than the slots assigned to the items.
+  const uint64_t kBase = uint64_t{1} << 60;
+  for (int i = 0; i < 10; i++) {
+    REVERB_EXPECT_OK(table.InsertOrAssign(MakeItem(kBase + i, 1)));
+  }
+  REVERB_EXPECT_OK(table.MutateItems(
+      {testing::MakeKeyWithPriority(kBase + 7, 0),
+       testing::MakeKeyWithPriority(kBase + 8, 0)},
+      {}));
+
+  Table::SampledItem sample;
+  REVERB_ASSERT_OK(table.Sample(&sample));
+  EXPECT_EQ(sample.item.key(), kBase + 9);
+  EXPECT_EQ(sample.probability, 1);
+
+  // The new item reuses the slot of the deleted one.
+  REVERB_EXPECT_OK(table.MutateItems({}, {kBase + 9}));
+  REVERB_EXPECT_OK(table.InsertOrAssign(MakeItem(kBase + 20, 1)));
+  REVERB_ASSERT_OK(table.Sample(&sample));
+  EXPECT_EQ(sample.item.key(), kBase + 20);
+  EXPECT_EQ(sample.probability, 1);
+}
+
+TEST(TableTest, InsertDeletesWhenChunkBytesExceeded) {
+  // All chunk keys require the same number of bytes to encode so every item
+  // references chunks of the same size.
+  const int64_t chunk_bytes = MakeItem(2, 1).chunks[0]->DataByteSizeLong();
+  Table table("dist", absl::make_unique<UniformSelector>(),
+              absl::make_unique<FifoSelector>(), /*max_size=*/1000,
+              /*max_times_sampled=*/0, MakeLimiter(1), /*extensions=*/{},
+              /*signature=*/absl::nullopt,
+              /*max_chunk_bytes=*/3 * chunk_bytes);
+
+  for (int i = 2; i < 12; i++) {
+    REVERB_EXPECT_OK(table.InsertOrAssign(MakeItem(i, 123)));
+    EXPECT_LE(table.num_chunk_bytes(), 3 * chunk_bytes);
+  }
+  EXPECT_THAT(table.Copy(), UnorderedElementsAre(HasItemKey(9),
+                                                 HasItemKey(10),
+                                                 HasItemKey(11)));
+  EXPECT_EQ(table.num_chunks(), 3);
+  EXPECT_EQ(table.num_chunk_bytes(), 3 * chunk_bytes);
+}
+
+TEST(TableTest, CountsInsertedAndSampledBytes) {
+  const int64_t chunk_bytes = MakeItem(2, 1).chunks[0]->DataByteSizeLong();
+  Table table("dist", absl::make_unique<UniformSelector>(),
+              absl::make_unique<FifoSelector>(), /*max_size=*/2,
+              /*max_times_sampled=*/0, MakeLimiter(1));
+
+  // Updates and items deleted to make room do not change the counters.
+  for (int i = 2; i < 5; i++) {
+    REVERB_EXPECT_OK(table.InsertOrAssign(MakeItem(i, 1)));
+  }
+  REVERB_EXPECT_OK(table.InsertOrAssign(MakeItem(4, 2)));
+  EXPECT_EQ(table.num_inserted_bytes(), 3 * chunk_bytes);
+  EXPECT_EQ(table.num_sampled_bytes(), 0);
+
+  std::vector<Table::SampledItem> samples;
+  REVERB_EXPECT_OK(table.SampleFlexibleBatch(&samples, 5));
+  ASSERT_EQ(samples.size(), 5);
+  EXPECT_EQ(table.num_sampled_bytes(), 5 * chunk_bytes);
+
+  TableInfo info = table.info();
+  EXPECT_EQ(info.num_inserted_bytes(), 3 * chunk_bytes);
+  EXPECT_EQ(info.num_sampled_bytes(), 5 * chunk_bytes);
+  EXPECT_EQ(info.num_chunks(), 2);
+  EXPECT_EQ(info.num_chunk_bytes(), 2 * chunk_bytes);
+}
+
+TEST(TableTest, DeletesItemsOlderThanMaxAge) {
+  Table table("dist", absl::make_unique<UniformSelector>(),
+              absl::make_unique<FifoSelector>(), /*max_size=*/1000,
+              /*max_times_sampled=*/0, MakeLimiter(1), /*extensions=*/{},
+              /*signature=*/absl::nullopt, /*max_chunk_bytes=*/0,
+              /*max_age=*/absl::Milliseconds(500));
+
+  // More items than are deleted each time the sweeper acquires the lock.
+  for (int i = 2; i < 502; i++) {
+    REVERB_EXPECT_OK(table.InsertOrAssign(MakeItem(i, 1)));
+  }
+  // Deleted items remain in the age index until they would have expired.
+  REVERB_EXPECT_OK(table.MutateItems({}, {2, 3}));
+  EXPECT_EQ(table.size(), 498);
+
+  const absl::Time deadline = absl::Now() + absl::Seconds(10);
+  while (table.size() > 0 && absl::Now() < deadline) {
+    absl::SleepFor(absl::Milliseconds(10));
+  }
+  EXPECT_EQ(table.size(), 0);
+
+  TableInfo info = table.info();
+  EXPECT_EQ(info.num_expired_items(), 498);
+  EXPECT_EQ(info.max_age().nanos(), 500000000);
+  EXPECT_EQ(table.Checkpoint().checkpoint.max_age().nanos(), 500000000);
+
+  // New items are not affected by the items which expired before them.
+  REVERB_EXPECT_OK(table.InsertOrAssign(MakeItem(2, 1)));
+  EXPECT_EQ(table.size(), 1);
+}
+
+TEST(TableTest, ItemsDoNotExpireByDefault) {
+  Table table("dist", absl::make_unique<UniformSelector>(),
+              absl::make_unique<FifoSelector>(), 10, 0, MakeLimiter(1));
+  REVERB_EXPECT_OK(table.InsertOrAssign(MakeItem(1, 1)));
+
+  TableInfo info = table.info();
+  EXPECT_FALSE(info.has_max_age());
+  EXPECT_EQ(info.num_expired_items(), 0);
+  EXPECT_FALSE(table.Checkpoint().checkpoint.has_max_age());
+}
+
+TEST(TableTest, ReclaimerDestroysDeletedItems) {
+  auto reclaimer = std::make_shared<internal::Reclaimer>();
+  auto table = MakeUniformTable("dist", 1, 1);
+  table->UnsafeSetReclaimer(reclaimer);
+
+  auto first = MakeItem(1, 123);
+  std::weak_ptr<ChunkStore::Chunk> first_chunk = first.chunks[0];
+  REVERB_ASSERT_OK(table->InsertOrAssign(std::move(first)));
+
+  // Inserting the second item evicts the first and sampling it removes the
+  // second since `max_times_sampled` is 1.
+  auto second = MakeItem(2, 123);
+  std::weak_ptr<ChunkStore::Chunk> second_chunk = second.chunks[0];
+  REVERB_ASSERT_OK(table->InsertOrAssign(std::move(second)));
+  {
+    Table::SampledItem sample;
+    REVERB_ASSERT_OK(table->Sample(&sample));
+  }
+
+  reclaimer->Flush();
+  EXPECT_TRUE(first_chunk.expired());
+  EXPECT_TRUE(second_chunk.expired());
+  EXPECT_EQ(table->size(), 0);
+}
+
+TEST(TableTest, ResetTearsDownStateOnReclaimer) {
+  auto reclaimer = std::make_shared<internal::Reclaimer>();
+  auto table = MakeUniformTable("dist");
+  table->UnsafeSetReclaimer(reclaimer);
+
+  auto item = MakeItem(1, 123);
+  std::shared_ptr<ChunkStore::Chunk> chunk = item.chunks[0];
+  REVERB_ASSERT_OK(table->InsertOrAssign(std::move(item)));
+  EXPECT_EQ(chunk->num_tables(), 1);
+
+  // The table is empty as soon as `Reset` returns while the table references
+  // to the chunks are released once the reclaimer has destroyed the old state.
+  REVERB_ASSERT_OK(table->Reset());
+  EXPECT_EQ(table->size(), 0);
+  EXPECT_EQ(table->num_episodes(), 0);
+  EXPECT_EQ(table->num_chunks(), 0);
+
+  reclaimer->Flush();
+  EXPECT_EQ(chunk->num_tables(), 0);
+
+  // The table is usable after the reset.
+  REVERB_ASSERT_OK(table->InsertOrAssign(MakeItem(2, 123)));
+  EXPECT_EQ(table->size(), 1);
+}
+
 TEST(TableTest, ConcurrentCalls) {
   auto table = MakeUniformTable("dist", 1000);
 
@@ -239,6 +568,275 @@ TEST(TableTest, ConcurrentCalls) {
   EXPECT_EQ(count, 1000);
 }
 
+TEST(TableTest, ConcurrentSamplesCountEverySample) {
+  auto table = MakeUniformTable("dist", 1000);
+  for (Table::Key i = 0; i < 100; i++) {
+    REVERB_EXPECT_OK(table->InsertOrAssign(MakeItem(i, 123)));
+  }
+
+  // The keys are selected while holding the lock in shared mode, so the sample
+  // counts of the items are incremented concurrently.
+  std::vector<std::unique_ptr<internal::Thread>> bundle;
+  for (int i = 0; i < 8; i++) {
+    bundle.push_back(internal::StartThread("", [&table] {
+      std::vector<Table::SampledItem> items;
+      for (int j = 0; j < 1000; j++) {
+        items.clear();
+        REVERB_EXPECT_OK(table->SampleFlexibleBatch(&items, 16));
+        EXPECT_EQ(items.size(), 16);
+      }
+    }));
+  }
+  bundle.clear();  // Joins all threads.
+
+  int64_t times_sampled = 0;
+  for (const auto& item : table->Copy()) {
+    times_sampled += item.item.times_sampled();
+  }
+  EXPECT_EQ(times_sampled, 8 * 1000 * 16);
+}
+
+// The samples are approved while holding the lock in exclusive mode and their
+// keys selected after it has been reacquired in shared mode. The table is
+// emptied over and over so that it is sometimes emptied in between.
+TEST(TableTest, SamplesApprovedBeforeDeletesAreCountedOnce) {
+  auto table = MakeUniformTable("dist");
+  std::atomic<bool> done(false);
+  std::atomic<int64_t> num_samples(0);
+  std::vector<std::unique_ptr<internal::Thread>> bundle;
+  for (int i = 0; i < 4; i++) {
+    bundle.push_back(internal::StartThread("", [&] {
+      std::vector<Table::SampledItem> items;
+      while (!done.load()) {
+        items.clear();
+        REVERB_EXPECT_OK(table->SampleFlexibleBatch(&items, 4));
+        num_samples += items.size();
+      }
+    }));
+  }
+  for (Table::Key key = 0; key < 1000; key++) {
+    REVERB_EXPECT_OK(table->InsertOrAssign(MakeItem(key, 1)));
+    REVERB_EXPECT_OK(table->MutateItems({}, {key}));
+  }
+  REVERB_EXPECT_OK(table->InsertOrAssign(MakeItem(1000, 1)));
+  done = true;
+  bundle.clear();  // Joins all threads.
+
+  EXPECT_EQ(table->Checkpoint().checkpoint.rate_limiter().sample_count(),
+            num_samples.load());
+}
+
+TEST(TableTest, SamplesApprovedBeforeResetAreNotCounted) {
+  auto table = MakeUniformTable("dist");
+  constexpr Table::Key kLastKey = 1000;
+  std::atomic<bool> done(false);
+  std::atomic<int64_t> num_samples_of_last_key(0);
+  std::vector<std::unique_ptr<internal::Thread>> bundle;
+  for (int i = 0; i < 4; i++) {
+    bundle.push_back(internal::StartThread("", [&] {
+      std::vector<Table::SampledItem> items;
+      while (!done.load()) {
+        items.clear();
+        REVERB_EXPECT_OK(table->SampleFlexibleBatch(&items, 4));
+        for (const auto& item : items) {
+          if (item.item.key() == kLastKey) num_samples_of_last_key++;
+        }
+      }
+    }));
+  }
+  for (Table::Key key = 0; key <= kLastKey; key++) {
+    REVERB_EXPECT_OK(table->Reset());
+    REVERB_EXPECT_OK(table->InsertOrAssign(MakeItem(key, 1)));
+  }
+  done = true;
+  bundle.clear();  // Joins all threads.
+
+  // The rate limiter only counts the samples approved after the last reset,
+  // which must also be the only samples of the item inserted after it.
+  EXPECT_EQ(table->Checkpoint().checkpoint.rate_limiter().sample_count(),
+            num_samples_of_last_key.load());
+}
+
+// Selector which only implements the methods that `ItemSelector` requires, as
+// selectors defined outside of Reverb may do.
+class MinimalSelector : public ItemSelector {
+ public:
+  absl::Status Delete(Key key) override { return selector_.Delete(key); }
+  absl::Status Insert(Key key, double priority) override {
+    return selector_.Insert(key, priority);
+  }
+  absl::Status Update(Key key, double priority) override {
+    return selector_.Update(key, priority);
+  }
+  KeyWithProbability Sample() override { return selector_.Sample(); }
+  void Clear() override { selector_.Clear(); }
+  KeyDistributionOptions options() const override {
+    return selector_.options();
+  }
+  std::string DebugString() const override { return "MinimalSelector"; }
+
+ private:
+  UniformSelector selector_;
+};
+
+TEST(TableTest, SamplesWithSelectorsWithoutSampleShared) {
+  Table table("dist", std::make_shared<MinimalSelector>(),
+              std::make_shared<MinimalSelector>(), /*max_size=*/10,
+              /*max_times_sampled=*/0, MakeLimiter(1));
+  for (Table::Key i = 0; i < 20; i++) {
+    REVERB_EXPECT_OK(table.InsertOrAssign(MakeItem(i, 1)));
+  }
+  EXPECT_EQ(table.size(), 10);
+
+  std::vector<Table::SampledItem> items;
+  REVERB_EXPECT_OK(table.SampleFlexibleBatch(&items, 16));
+  EXPECT_THAT(items, SizeIs(16));
+  EXPECT_EQ(table.Freeze().code(), absl::StatusCode::kFailedPrecondition);
+}
+
+TEST(TableTest, SetPriorityExponentReweightsItems) {
+  Table table("dist", absl::make_unique<PrioritizedSelector>(1),
+              absl::make_unique<FifoSelector>(), 10, 0, MakeLimiter(1));
+  REVERB_EXPECT_OK(table.InsertOrAssign(MakeItem(1, 1)));
+  REVERB_EXPECT_OK(table.InsertOrAssign(MakeItem(2, 3)));
+  EXPECT_DOUBLE_EQ(table.TotalSamplerWeight(), 4);
+
+  REVERB_EXPECT_OK(table.SetPriorityExponent(2));
+  EXPECT_DOUBLE_EQ(table.TotalSamplerWeight(), 10);
+  std::vector<Table::SampledItem> items;
+  REVERB_EXPECT_OK(table.SampleFlexibleBatch(&items, 10));
+  for (const auto& item : items) {
+    EXPECT_DOUBLE_EQ(item.probability, item.item.key() == 1 ? 0.1 : 0.9);
+  }
+
+  EXPECT_EQ(table.SetPriorityExponent(-1).code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_DOUBLE_EQ(table.TotalSamplerWeight(), 10);
+}
+
+TEST(TableTest, SetPriorityExponentUpdatesInfo) {
+  Table table("dist", absl::make_unique<PrioritizedSelector>(1),
+              absl::make_unique<PrioritizedSelector>(1), 10, 0,
+              MakeLimiter(1));
+  REVERB_EXPECT_OK(table.SetPriorityExponent(0.5));
+  TableInfo info = table.info();
+  EXPECT_EQ(info.sampler_options().prioritized().priority_exponent(), 0.5);
+  EXPECT_EQ(info.remover_options().prioritized().priority_exponent(), 0.5);
+}
+
+TEST(TableTest, SetPriorityExponentRequiresPrioritizedSelector) {
+  auto table = MakeUniformTable("dist");
+  EXPECT_EQ(table->SetPriorityExponent(1).code(),
+            absl::StatusCode::kFailedPrecondition);
+}
+
+TEST(TableTest, TotalSamplerWeightFallsBackToSize) {
+  Table table("dist", std::make_shared<MinimalSelector>(),
+              std::make_shared<MinimalSelector>(), /*max_size=*/10,
+              /*max_times_sampled=*/0, MakeLimiter(1));
+  for (Table::Key i = 0; i < 3; i++) {
+    REVERB_EXPECT_OK(table.InsertOrAssign(MakeItem(i, 1)));
+  }
+  EXPECT_DOUBLE_EQ(table.TotalSamplerWeight(), 3);
+  REVERB_EXPECT_OK(table.MutateItems({}, {1}));
+  EXPECT_DOUBLE_EQ(table.TotalSamplerWeight(), 2);
+}
+
+TEST(TableTest, FrozenTableRejectsMutations) {
+  auto table = MakeUniformTable("dist");
+  REVERB_EXPECT_OK(table->InsertOrAssign(MakeItem(1, 1)));
+  REVERB_EXPECT_OK(table->InsertOrAssign(MakeItem(2, 1)));
+  EXPECT_FALSE(table->frozen());
+  REVERB_EXPECT_OK(table->Freeze());
+  EXPECT_TRUE(table->frozen());
+  REVERB_EXPECT_OK(table->Freeze());
+
+  EXPECT_EQ(table->InsertOrAssign(MakeItem(3, 1)).code(),
+            absl::StatusCode::kFailedPrecondition);
+  EXPECT_EQ(table->InsertOrAssign(MakeItem(1, 5)).code(),
+            absl::StatusCode::kFailedPrecondition);
+  EXPECT_EQ(table->InsertOrAssignBatch({MakeItem(4, 1)}).code(),
+            absl::StatusCode::kFailedPrecondition);
+  EXPECT_EQ(table->MutateItems({}, {1}).code(),
+            absl::StatusCode::kFailedPrecondition);
+  EXPECT_EQ(table->Reset().code(), absl::StatusCode::kFailedPrecondition);
+
+  absl::Status status;
+  table->MutateAndSampleFlexibleBatchAsync(
+      {}, {2}, 1,
+      [&status](absl::Status s, std::vector<Table::SampledItem>) {
+        status = std::move(s);
+      });
+  EXPECT_EQ(status.code(), absl::StatusCode::kFailedPrecondition);
+
+  EXPECT_EQ(table->size(), 2);
+  Table::Item item;
+  ASSERT_TRUE(table->Get(1, &item));
+  EXPECT_EQ(item.item.priority(), 1);
+}
+
+TEST(TableTest, FreezeRequiresImmutableItems) {
+  EXPECT_EQ(MakeUniformTable("dist")->Freeze().code(),
+            absl::StatusCode::kFailedPrecondition);
+
+  auto table = MakeUniformTable("dist", 1000, /*max_times_sampled=*/1);
+  REVERB_EXPECT_OK(table->InsertOrAssign(MakeItem(1, 1)));
+  EXPECT_EQ(table->Freeze().code(), absl::StatusCode::kFailedPrecondition);
+
+  Table expiring("dist", absl::make_unique<UniformSelector>(),
+                 absl::make_unique<FifoSelector>(), /*max_size=*/1000,
+                 /*max_times_sampled=*/0, MakeLimiter(1), /*extensions=*/{},
+                 /*signature=*/absl::nullopt, /*max_chunk_bytes=*/0,
+                 /*max_age=*/absl::Hours(1));
+  REVERB_EXPECT_OK(expiring.InsertOrAssign(MakeItem(1, 1)));
+  EXPECT_EQ(expiring.Freeze().code(), absl::StatusCode::kFailedPrecondition);
+  EXPECT_FALSE(expiring.frozen());
+}
+
+TEST(TableTest, FrozenTableIgnoresRateLimiter) {
+  // Unless the table is frozen the limiter blocks samples until it holds at
+  // least 100 items.
+  Table table("dist", absl::make_unique<UniformSelector>(),
+              absl::make_unique<FifoSelector>(), /*max_size=*/1000,
+              /*max_times_sampled=*/0, MakeLimiter(100));
+  for (Table::Key i = 0; i < 10; i++) {
+    REVERB_EXPECT_OK(table.InsertOrAssign(MakeItem(i, 123)));
+  }
+  REVERB_EXPECT_OK(table.Freeze());
+
+  std::vector<std::unique_ptr<internal::Thread>> bundle;
+  for (int i = 0; i < 8; i++) {
+    bundle.push_back(internal::StartThread("", [&table] {
+      std::vector<Table::SampledItem> items;
+      for (int j = 0; j < 100; j++) {
+        items.clear();
+        REVERB_EXPECT_OK(
+            table.SampleFlexibleBatch(&items, 16, absl::ZeroDuration()));
+        EXPECT_EQ(items.size(), 16);
+      }
+    }));
+  }
+  bundle.clear();  // Joins all threads.
+
+  absl::Status status;
+  std::vector<Table::SampledItem> items;
+  table.SampleFlexibleBatchAsync(
+      4,
+      [&](absl::Status s, std::vector<Table::SampledItem> sampled) {
+        status = std::move(s);
+        items = std::move(sampled);
+      },
+      absl::ZeroDuration());
+  REVERB_EXPECT_OK(status);
+  EXPECT_THAT(items, SizeIs(4));
+
+  int64_t times_sampled = 0;
+  for (const auto& item : table.Copy()) {
+    times_sampled += item.item.times_sampled();
+  }
+  EXPECT_EQ(times_sampled, 8 * 100 * 16 + 4);
+}
+
 TEST(TableTest, UseAsQueue) {
   Table queue(
       /*name=*/"queue",
@@ -443,6 +1041,24 @@ TEST(TableTest, CheckpointOrderItems) {
                           Partially(testing::EqualsProto("key: 2"))));
 }
 
+TEST(TableTest, CheckpointWhileInsertingConcurrently) {
+  auto table = MakeUniformTable("dist", 1000);
+
+  auto insert_thread = internal::StartThread("", [&table] {
+    for (int i = 0; i < 1000; i++) {
+      REVERB_EXPECT_OK(table->InsertOrAssign(MakeItem(i, i)));
+    }
+  });
+
+  int64_t last_size = 0;
+  while (last_size < 1000) {
+    auto checkpoint = table->Checkpoint();
+    EXPECT_GE(checkpoint.checkpoint.items_size(), last_size);
+    last_size = checkpoint.checkpoint.items_size();
+  }
+  insert_thread = nullptr;  // Joins the thread.
+}
+
 TEST(TableTest, CheckpointSanityCheck) {
   tensorflow::StructuredValue signature;
   auto* spec =
@@ -604,6 +1220,25 @@ TEST(TableTest, GetExistingItem) {
   EXPECT_THAT(item, HasItemKey(2));
 }
 
+TEST(TableTest, GetMaterializesStoredItem) {
+  auto table = MakeUniformTable("dist");
+
+  Table::Item item = MakeItem(1, 5);
+  REVERB_EXPECT_OK(table->InsertOrAssign(item));
+  REVERB_EXPECT_OK(table->MutateItems({testing::MakeKeyWithPriority(1, 7)}, {}));
+
+  Table::Item got;
+  ASSERT_TRUE(table->Get(1, &got));
+  EXPECT_EQ(got.item.key(), 1);
+  EXPECT_EQ(got.item.table(), "dist");
+  EXPECT_EQ(got.item.priority(), 7);
+  EXPECT_EQ(got.item.times_sampled(), 0);
+  EXPECT_TRUE(got.item.has_inserted_at());
+  EXPECT_THAT(got.item.flat_trajectory(),
+              testing::EqualsProto(item.item.flat_trajectory()));
+  EXPECT_EQ(got.chunks, item.chunks);
+}
+
 TEST(TableTest, GetMissingItem) {
   auto table = MakeUniformTable("dist");
 
@@ -663,6 +1298,69 @@ TEST(TableTest, NumEpisodes) {
   EXPECT_EQ(table->num_episodes(), 1);
 }
 
+TEST(TableTest, NumChunkBytes) {
+  auto table = MakeUniformTable("dist");
+
+  auto first = MakeItem(1, 1);
+  const int64_t first_bytes = first.chunks[0]->DataByteSizeLong();
+  REVERB_EXPECT_OK(table->InsertOrAssign(first));
+  EXPECT_EQ(table->num_chunks(), 1);
+  EXPECT_EQ(table->num_chunk_bytes(), first_bytes);
+
+  // An item referencing the same chunk does not increase the usage.
+  auto second = first;
+  second.item.set_key(2);
+  REVERB_EXPECT_OK(table->InsertOrAssign(second));
+  EXPECT_EQ(table->num_chunks(), 1);
+  EXPECT_EQ(table->num_chunk_bytes(), first_bytes);
+
+  auto third = MakeItem(3, 1);
+  const int64_t third_bytes = third.chunks[0]->DataByteSizeLong();
+  REVERB_EXPECT_OK(table->InsertOrAssign(third));
+  EXPECT_EQ(table->num_chunks(), 2);
+  EXPECT_EQ(table->num_chunk_bytes(), first_bytes + third_bytes);
+
+  // The chunk is only released once all items referencing it are removed.
+  REVERB_EXPECT_OK(table->MutateItems({}, {1}));
+  EXPECT_EQ(table->num_chunk_bytes(), first_bytes + third_bytes);
+  REVERB_EXPECT_OK(table->MutateItems({}, {2}));
+  EXPECT_EQ(table->num_chunks(), 1);
+  EXPECT_EQ(table->num_chunk_bytes(), third_bytes);
+
+  REVERB_EXPECT_OK(table->Reset());
+  EXPECT_EQ(table->num_chunks(), 0);
+  EXPECT_EQ(table->num_chunk_bytes(), 0);
+}
+
+TEST(TableTest, CountsTableReferencesOfChunks) {
+  auto first_table = MakeUniformTable("first");
+  auto second_table = MakeUniformTable("second");
+
+  auto item = MakeItem(1, 1);
+  const auto& chunk = item.chunks[0];
+  REVERB_EXPECT_OK(first_table->InsertOrAssign(item));
+  EXPECT_EQ(chunk->num_tables(), 1);
+
+  // A second item in the same table does not count as another reference.
+  auto other = item;
+  other.item.set_key(2);
+  REVERB_EXPECT_OK(first_table->InsertOrAssign(other));
+  EXPECT_EQ(chunk->num_tables(), 1);
+
+  REVERB_EXPECT_OK(second_table->InsertOrAssign(item));
+  EXPECT_EQ(chunk->num_tables(), 2);
+
+  REVERB_EXPECT_OK(second_table->MutateItems({}, {1}));
+  EXPECT_EQ(chunk->num_tables(), 1);
+
+  REVERB_EXPECT_OK(second_table->InsertOrAssign(item));
+  REVERB_EXPECT_OK(first_table->Reset());
+  EXPECT_EQ(chunk->num_tables(), 1);
+
+  second_table = nullptr;
+  EXPECT_EQ(chunk->num_tables(), 0);
+}
+
 TEST(TableTest, NumDeletedEpisodes) {
   auto table = MakeUniformTable("dist");
 
@@ -707,6 +1405,70 @@ TEST(TableTest, NumDeletedEpisodes) {
   EXPECT_EQ(table->num_deleted_episodes(), 0);
 }
 
+std::unique_ptr<Table> MakeEpisodeIndexedTable(int32_t max_times_sampled = 0) {
+  return absl::make_unique<Table>(
+      "dist", absl::make_unique<UniformSelector>(),
+      absl::make_unique<FifoSelector>(), 1000, max_times_sampled,
+      MakeLimiter(1), std::vector<std::shared_ptr<TableExtension>>(),
+      absl::nullopt, /*max_chunk_bytes=*/0, absl::InfiniteDuration(),
+      /*index_episodes=*/true);
+}
+
+TEST(TableTest, DeleteEpisodeDeletesAllItemsOfEpisode) {
+  auto table = MakeEpisodeIndexedTable();
+  REVERB_EXPECT_OK(table->InsertOrAssign(
+      MakeItem(1, 1, {testing::MakeSequenceRange(100, 0, 5)})));
+  REVERB_EXPECT_OK(table->InsertOrAssign(
+      MakeItem(2, 1, {testing::MakeSequenceRange(101, 0, 5)})));
+  // Items spanning two episodes are deleted with either of them.
+  REVERB_EXPECT_OK(table->InsertOrAssign(
+      MakeItem(3, 1, {testing::MakeSequenceRange(100, 6, 10),
+                      testing::MakeSequenceRange(102, 0, 5)})));
+
+  REVERB_EXPECT_OK(table->DeleteEpisode(100));
+  EXPECT_EQ(table->size(), 1);
+  Table::Item item;
+  EXPECT_TRUE(table->Get(2, &item));
+
+  // Unknown episodes are ignored.
+  REVERB_EXPECT_OK(table->DeleteEpisode(102));
+  EXPECT_EQ(table->size(), 1);
+
+  // The index is rebuilt by inserts after a reset.
+  REVERB_EXPECT_OK(table->Reset());
+  REVERB_EXPECT_OK(table->InsertOrAssign(
+      MakeItem(4, 1, {testing::MakeSequenceRange(101, 6, 10)})));
+  REVERB_EXPECT_OK(table->DeleteEpisode(101));
+  EXPECT_EQ(table->size(), 0);
+}
+
+TEST(TableTest, SampleEpisodeReturnsItemsInInsertionOrder) {
+  auto table = MakeEpisodeIndexedTable(/*max_times_sampled=*/1);
+  for (int i = 0; i < 3; i++) {
+    REVERB_EXPECT_OK(table->InsertOrAssign(
+        MakeItem(i + 1, 1, {testing::MakeSequenceRange(100, i * 5, i * 5)})));
+  }
+
+  // The sampled item is deleted by the sample but still returned in place.
+  std::vector<Table::Item> items;
+  REVERB_EXPECT_OK(table->SampleEpisode(&items));
+  ASSERT_THAT(items, SizeIs(3));
+  for (int i = 0; i < 3; i++) {
+    EXPECT_EQ(items[i].item.key(), i + 1);
+  }
+  EXPECT_EQ(table->size(), 2);
+}
+
+TEST(TableTest, EpisodeMethodsRequireIndex) {
+  auto table = MakeUniformTable("dist");
+  REVERB_EXPECT_OK(table->InsertOrAssign(MakeItem(1, 1)));
+  EXPECT_EQ(table->DeleteEpisode(100).code(),
+            absl::StatusCode::kFailedPrecondition);
+  std::vector<Table::Item> items;
+  EXPECT_EQ(table->SampleEpisode(&items).code(),
+            absl::StatusCode::kFailedPrecondition);
+}
+
 TEST(TableDeathTest, SetNumDeletedEpisodesFromCheckpointOnNonEmptyTable) {
   auto table = MakeUniformTable("dist");
   REVERB_EXPECT_OK(table->InsertOrAssign(MakeItem(1, 1)));
@@ -742,7 +1504,15 @@ TEST(TableTest, Info) {
   Table::SampledItem sample;
   REVERB_EXPECT_OK(table.Sample(&sample));
 
-  EXPECT_THAT(table.info(), testing::EqualsProto(R"pb(
+  // The size of the remaining chunk depends on which item was sampled.
+  auto info = table.info();
+  EXPECT_EQ(info.num_chunks(), 1);
+  EXPECT_EQ(info.num_chunk_bytes(),
+            table.Copy()[0].chunks[0]->DataByteSizeLong());
+  info.clear_num_chunks();
+  info.clear_num_chunk_bytes();
+
+  EXPECT_THAT(info, testing::EqualsProto(R"pb(
                 name: 'dist'
                 sampler_options { uniform: true }
                 remover_options { fifo: true is_deterministic: true }
@@ -767,9 +1537,471 @@ TEST(TableTest, Info) {
                 current_size: 1
                 num_episodes: 1
                 num_deleted_episodes: 6
+                total_sampler_weight: 1
               )pb"));
 }
 
+// Blocks inside `OnInsert` (i.e while the table lock is held) until released.
+class BlockingInsertExtension : public TableExtension {
+ public:
+  std::string DebugString() const override {
+    return "BlockingInsertExtension";
+  }
+
+  absl::Notification entered;
+  absl::Notification release;
+
+ protected:
+  void OnInsert(absl::Mutex* mu, const TableItemView& item) override {
+    entered.Notify();
+    release.WaitForNotification();
+  }
+  void OnDelete(absl::Mutex* mu, const TableItemView& item) override {}
+  void OnUpdate(absl::Mutex* mu, const TableItemView& item) override {}
+  void OnSample(absl::Mutex* mu, const TableItemView& item) override {}
+  void OnReset(absl::Mutex* mu) override {}
+  absl::Status RegisterTable(absl::Mutex* mu, Table* table) override {
+    return absl::OkStatus();
+  }
+  void UnregisterTable(absl::Mutex* mu, Table* table) override {}
+};
+
+// Records the sizes of the batches passed to `OnUpdateBatch` and
+// `OnSampleBatch` and the keys of all updated and sampled items.
+class BatchRecordingExtension : public TableExtension {
+ public:
+  std::string DebugString() const override {
+    return "BatchRecordingExtension";
+  }
+
+  std::vector<int> update_batches;
+  std::vector<int> sample_batches;
+  std::vector<uint64_t> updated_keys;
+  std::vector<uint64_t> sampled_keys;
+
+ protected:
+  void OnUpdateBatch(absl::Mutex* mu,
+                     absl::Span<const TableItemView* const> items) override {
+    update_batches.push_back(items.size());
+    for (const TableItemView* item : items) {
+      updated_keys.push_back(item->key());
+    }
+  }
+  void OnSampleBatch(absl::Mutex* mu,
+                     absl::Span<const TableItemView* const> items) override {
+    sample_batches.push_back(items.size());
+    for (const TableItemView* item : items) {
+      sampled_keys.push_back(item->key());
+    }
+  }
+  void OnInsert(absl::Mutex* mu, const TableItemView& item) override {}
+  void OnDelete(absl::Mutex* mu, const TableItemView& item) override {}
+  void OnUpdate(absl::Mutex* mu, const TableItemView& item) override {}
+  void OnSample(absl::Mutex* mu, const TableItemView& item) override {}
+  void OnReset(absl::Mutex* mu) override {}
+  absl::Status RegisterTable(absl::Mutex* mu, Table* table) override {
+    return absl::OkStatus();
+  }
+  void UnregisterTable(absl::Mutex* mu, Table* table) override {}
+};
+
+// Keeps copies of the views passed to `OnInsert` and `OnUpdate`.
+class ViewRecordingExtension : public TableExtension {
+ public:
+  std::string DebugString() const override { return "ViewRecordingExtension"; }
+
+  std::vector<TableItemView> inserted;
+  std::vector<TableItemView> updated;
+
+ protected:
+  void OnInsert(absl::Mutex* mu, const TableItemView& item) override {
+    inserted.push_back(item);
+  }
+  void OnDelete(absl::Mutex* mu, const TableItemView& item) override {}
+  void OnUpdate(absl::Mutex* mu, const TableItemView& item) override {
+    updated.push_back(item);
+  }
+  void OnSample(absl::Mutex* mu, const TableItemView& item) override {}
+  void OnReset(absl::Mutex* mu) override {}
+  absl::Status RegisterTable(absl::Mutex* mu, Table* table) override {
+    return absl::OkStatus();
+  }
+  void UnregisterTable(absl::Mutex* mu, Table* table) override {}
+};
+
+TEST(TableTest, ExtensionViewsMaterializeTheItem) {
+  auto extension = std::make_shared<ViewRecordingExtension>();
+  Table table("dist", absl::make_unique<UniformSelector>(),
+              absl::make_unique<FifoSelector>(), 10, 0, MakeLimiter(1),
+              {extension});
+  REVERB_ASSERT_OK(table.InsertOrAssign(MakeItem(1, 2)));
+  REVERB_ASSERT_OK(
+      table.MutateItems({testing::MakeKeyWithPriority(1, 3)}, {}));
+
+  Table::Item stored;
+  ASSERT_TRUE(table.Get(1, &stored));
+
+  ASSERT_THAT(extension->inserted, SizeIs(1));
+  const TableItemView& inserted = extension->inserted[0];
+  EXPECT_EQ(inserted.key(), 1);
+  EXPECT_EQ(inserted.priority(), 2);
+  EXPECT_EQ(inserted.table(), "dist");
+  EXPECT_THAT(inserted.chunks(), ElementsAreArray(stored.chunks));
+  EXPECT_THAT(inserted.flat_trajectory(),
+              testing::EqualsProto(stored.item.flat_trajectory()));
+
+  // The views hold the state of the item at the time of the hook.
+  ASSERT_THAT(extension->updated, SizeIs(1));
+  Table::Item updated = extension->updated[0].ToItem();
+  EXPECT_THAT(updated.item, testing::EqualsProto(stored.item));
+  EXPECT_THAT(updated.chunks, ElementsAreArray(stored.chunks));
+  EXPECT_EQ(inserted.ToItem().item.priority(), 2);
+}
+
+TEST(TableTest, ExtensionsAreNotifiedOfBatches) {
+  auto extension = std::make_shared<BatchRecordingExtension>();
+  Table table("dist", absl::make_unique<UniformSelector>(),
+              absl::make_unique<FifoSelector>(), 10, 0, MakeLimiter(1),
+              {extension});
+  REVERB_ASSERT_OK(table.InsertOrAssign(MakeItem(1, 1)));
+  REVERB_ASSERT_OK(table.InsertOrAssign(MakeItem(2, 1)));
+
+  REVERB_ASSERT_OK(table.MutateItems({testing::MakeKeyWithPriority(2, 3),
+                                      testing::MakeKeyWithPriority(7, 3),
+                                      testing::MakeKeyWithPriority(1, 3)},
+                                     {}));
+  EXPECT_THAT(extension->update_batches, ElementsAre(2));
+  EXPECT_THAT(extension->updated_keys, ElementsAre(2, 1));
+
+  std::vector<Table::SampledItem> items;
+  REVERB_ASSERT_OK(table.SampleFlexibleBatch(&items, 5));
+  ASSERT_THAT(items, SizeIs(5));
+  EXPECT_THAT(extension->sample_batches, ElementsAre(5));
+  for (int i = 0; i < items.size(); i++) {
+    EXPECT_EQ(extension->sampled_keys[i], items[i].item.key());
+  }
+}
+
+TEST(TableTest, ExtensionsAreNotifiedOfEachSampleIfItemsCanBeDeleted) {
+  auto extension = std::make_shared<BatchRecordingExtension>();
+  Table table("dist", absl::make_unique<UniformSelector>(),
+              absl::make_unique<FifoSelector>(), 10, /*max_times_sampled=*/2,
+              MakeLimiter(1), {extension});
+  REVERB_ASSERT_OK(table.InsertOrAssign(MakeItem(1, 1)));
+  REVERB_ASSERT_OK(table.InsertOrAssign(MakeItem(2, 1)));
+
+  std::vector<Table::SampledItem> items;
+  REVERB_ASSERT_OK(table.SampleFlexibleBatch(&items, 3));
+  EXPECT_THAT(extension->sample_batches, ElementsAre(1, 1, 1));
+}
+
+TEST(TableTest, InfoDoesNotBlockOnTableLock) {
+  auto extension = std::make_shared<BlockingInsertExtension>();
+  Table table("dist", absl::make_unique<UniformSelector>(),
+              absl::make_unique<FifoSelector>(), 10, 0, MakeLimiter(1),
+              {extension});
+
+  auto thread = internal::StartThread("", [&] {
+    REVERB_EXPECT_OK(table.InsertOrAssign(MakeItem(1, 1)));
+  });
+
+  // The insert is now holding the lock of the table.
+  extension->entered.WaitForNotification();
+  TableInfo info = table.info();
+  EXPECT_EQ(info.name(), "dist");
+  EXPECT_EQ(info.rate_limiter_info().insert_stats().completed(), 1);
+  EXPECT_EQ(table.num_episodes(), 0);
+  EXPECT_EQ(table.num_deleted_episodes(), 0);
+
+  extension->release.Notify();
+  thread = nullptr;
+
+  EXPECT_EQ(table.info().current_size(), 1);
+  EXPECT_EQ(table.num_episodes(), 1);
+}
+
+TEST(TableTest, InfoReportsLatencies) {
+  Table table("dist", absl::make_unique<UniformSelector>(),
+              absl::make_unique<FifoSelector>(), 10, 0, MakeLimiter(1));
+
+  // Only a sample of the operations is timed.
+  for (int i = 0; i < 1000; i++) {
+    REVERB_ASSERT_OK(table.InsertOrAssign(MakeItem(i, 1)));
+  }
+
+  TableInfo info = table.info();
+  const auto& stats = info.latency_stats();
+  EXPECT_GT(stats.lock_wait().count(), 0);
+  EXPECT_GT(stats.lock_hold().count(), 0);
+  EXPECT_GT(stats.selector().count(), 0);
+  EXPECT_EQ(stats.extensions().count(), 0);
+
+  int64_t bucket_count = 0;
+  for (const auto& bucket : stats.lock_hold().buckets()) {
+    bucket_count += bucket.count();
+  }
+  EXPECT_EQ(bucket_count, stats.lock_hold().count());
+}
+
+TEST(TableTest, InfoAttributesLockContentionToOperations) {
+  Table table("dist", absl::make_unique<UniformSelector>(),
+              absl::make_unique<FifoSelector>(), 10, 0, MakeLimiter(1));
+
+  for (int i = 0; i < 1000; i++) {
+    REVERB_ASSERT_OK(table.InsertOrAssign(MakeItem(i, 1)));
+  }
+
+  TableInfo info = table.info();
+  std::map<std::string, LockContention> contention;
+  for (const auto& op : info.latency_stats().lock_contention()) {
+    contention[op.operation()] = op;
+  }
+  EXPECT_EQ(contention.size(), 8);
+  EXPECT_GT(contention["insert"].hold().count(), 0);
+  EXPECT_EQ(contention["insert"].hold().count(),
+            contention["insert"].wait().count());
+  EXPECT_EQ(contention["sample"].hold().count(), 0);
+  EXPECT_EQ(contention["mutate"].hold().count(), 0);
+  EXPECT_EQ(contention["checkpoint"].hold().count(), 0);
+}
+
+TEST(TableTest, SizeAndRateLimiterChecksDoNotBlockOnTableLock) {
+  auto extension = std::make_shared<BlockingInsertExtension>();
+  Table table("dist", absl::make_unique<UniformSelector>(),
+              absl::make_unique<FifoSelector>(), 10, 0, MakeLimiter(1),
+              {extension});
+
+  auto thread = internal::StartThread("", [&] {
+    REVERB_EXPECT_OK(table.InsertOrAssign(MakeItem(1, 1)));
+  });
+
+  // The insert is now holding the lock of the table.
+  extension->entered.WaitForNotification();
+  EXPECT_EQ(table.size(), 0);
+  EXPECT_FALSE(table.CanSample(1));
+  EXPECT_TRUE(table.CanInsert(1));
+
+  extension->release.Notify();
+  thread = nullptr;
+
+  EXPECT_EQ(table.size(), 1);
+  EXPECT_TRUE(table.CanSample(1));
+}
+
+TEST(TableTest, CoarseClockTimestampsAreStrictlyIncreasing) {
+  auto table = MakeUniformTable("dist");
+
+  // The clock is never refreshed during the test so all items are inserted
+  // with the same time read from the clock.
+  auto clock = std::make_shared<internal::CoarseClock>(absl::Hours(1));
+  table->UnsafeSetCoarseClock(clock);
+
+  for (int i = 0; i < 10; i++) {
+    REVERB_EXPECT_OK(table->InsertOrAssign(MakeItem(i, 1)));
+  }
+
+  auto checkpoint = table->Checkpoint().checkpoint;
+  ASSERT_EQ(checkpoint.items_size(), 10);
+  for (int i = 0; i < 10; i++) {
+    const auto& item = checkpoint.items(i);
+    EXPECT_EQ(item.key(), i);
+    EXPECT_EQ(item.inserted_at().seconds() * 1000000000 +
+                  item.inserted_at().nanos(),
+              clock->NowNanos() + i);
+  }
+}
+
+TEST(TableTest, AsyncSampleAndInsertCompleteInlineWhenNotBlocked) {
+  auto table = MakeUniformTable("dist");
+
+  bool inserted = false;
+  table->InsertOrAssignAsync(MakeItem(1, 1), [&](absl::Status status) {
+    REVERB_EXPECT_OK(status);
+    inserted = true;
+  });
+  EXPECT_TRUE(inserted);
+  EXPECT_EQ(table->size(), 1);
+
+  bool sampled = false;
+  table->SampleFlexibleBatchAsync(
+      2, [&](absl::Status status, std::vector<Table::SampledItem> items) {
+        REVERB_EXPECT_OK(status);
+        EXPECT_THAT(items, ElementsAre(HasItemKey(1), HasItemKey(1)));
+        sampled = true;
+      });
+  EXPECT_TRUE(sampled);
+}
+
+TEST(TableTest, MutateAndSampleAppliesMutationsBeforeSampling) {
+  auto table = MakeUniformTable("dist");
+  REVERB_EXPECT_OK(table->InsertOrAssign(MakeItem(1, 1)));
+  REVERB_EXPECT_OK(table->InsertOrAssign(MakeItem(2, 1)));
+
+  KeyWithPriority update;
+  update.set_key(2);
+  update.set_priority(5);
+  bool sampled = false;
+  table->MutateAndSampleFlexibleBatchAsync(
+      {update}, {1}, 2,
+      [&](absl::Status status, std::vector<Table::SampledItem> items) {
+        REVERB_EXPECT_OK(status);
+        EXPECT_THAT(items, ElementsAre(HasItemKey(2), HasItemKey(2)));
+        EXPECT_EQ(items[0].item.priority(), 5);
+        sampled = true;
+      });
+  EXPECT_TRUE(sampled);
+  EXPECT_EQ(table->size(), 1);
+}
+
+TEST(TableTest, MutateAndSampleAppliesMutationsWhenSampleIsQueued) {
+  auto table = MakeUniformTable("dist");
+  REVERB_EXPECT_OK(table->InsertOrAssign(MakeItem(1, 1)));
+
+  absl::Notification done;
+  table->MutateAndSampleFlexibleBatchAsync(
+      {}, {1}, 1,
+      [&](absl::Status status, std::vector<Table::SampledItem> items) {
+        REVERB_EXPECT_OK(status);
+        EXPECT_THAT(items, ElementsAre(HasItemKey(2)));
+        done.Notify();
+      });
+  EXPECT_EQ(table->size(), 0);
+  EXPECT_FALSE(done.WaitForNotificationWithTimeout(kTimeout));
+
+  REVERB_EXPECT_OK(table->InsertOrAssign(MakeItem(2, 1)));
+  EXPECT_TRUE(done.WaitForNotificationWithTimeout(10 * kTimeout));
+}
+
+TEST(TableTest, AsyncSampleCompletesWhenItemInserted) {
+  auto table = MakeUniformTable("dist");
+
+  absl::Notification done;
+  table->SampleFlexibleBatchAsync(
+      1, [&](absl::Status status, std::vector<Table::SampledItem> items) {
+        REVERB_EXPECT_OK(status);
+        EXPECT_THAT(items, ElementsAre(HasItemKey(3)));
+        done.Notify();
+      });
+  EXPECT_FALSE(done.WaitForNotificationWithTimeout(kTimeout));
+
+  REVERB_EXPECT_OK(table->InsertOrAssign(MakeItem(3, 1)));
+  EXPECT_TRUE(done.WaitForNotificationWithTimeout(10 * kTimeout));
+}
+
+TEST(TableTest, AsyncInsertCompletesWhenRateLimiterAllowsIt) {
+  auto table = absl::make_unique<Table>(
+      "dist", absl::make_unique<UniformSelector>(),
+      absl::make_unique<FifoSelector>(), 1000, 0,
+      absl::make_unique<RateLimiter>(/*samples_per_insert=*/1.0,
+                                     /*min_size_to_sample=*/1,
+                                     /*min_diff=*/-DBL_MAX,
+                                     /*max_diff=*/1.0));
+  REVERB_EXPECT_OK(table->InsertOrAssign(MakeItem(1, 1)));
+
+  absl::Notification done;
+  table->InsertOrAssignAsync(MakeItem(2, 1), [&](absl::Status status) {
+    REVERB_EXPECT_OK(status);
+    done.Notify();
+  });
+  EXPECT_FALSE(done.WaitForNotificationWithTimeout(kTimeout));
+  EXPECT_EQ(table->size(), 1);
+
+  Table::SampledItem sample;
+  REVERB_EXPECT_OK(table->Sample(&sample));
+  EXPECT_TRUE(done.WaitForNotificationWithTimeout(10 * kTimeout));
+  EXPECT_EQ(table->size(), 2);
+}
+
+TEST(TableTest, AsyncBatchInsertQueuesItemsThatCannotProceed) {
+  auto table = absl::make_unique<Table>(
+      "dist", absl::make_unique<UniformSelector>(),
+      absl::make_unique<FifoSelector>(), 1000, 0,
+      absl::make_unique<RateLimiter>(/*samples_per_insert=*/1.0,
+                                     /*min_size_to_sample=*/1,
+                                     /*min_diff=*/-DBL_MAX,
+                                     /*max_diff=*/1.0));
+
+  absl::Mutex mu;
+  std::vector<int> completed;
+  std::vector<Table::InsertCallback> callbacks;
+  for (int i = 1; i <= 3; i++) {
+    callbacks.push_back([&, i](absl::Status status) {
+      REVERB_EXPECT_OK(status);
+      absl::MutexLock lock(&mu);
+      completed.push_back(i);
+    });
+  }
+  std::vector<Table::Item> items;
+  items.push_back(MakeItem(1, 1));
+  items.push_back(MakeItem(2, 1));
+  items.push_back(MakeItem(3, 1));
+  table->InsertOrAssignBatchAsync(std::move(items), std::move(callbacks));
+
+  // Only the first item is allowed by the rate limiter so the others are
+  // queued and completed, in order, as samples make room for them.
+  {
+    absl::MutexLock lock(&mu);
+    EXPECT_THAT(completed, ElementsAre(1));
+  }
+  EXPECT_EQ(table->size(), 1);
+
+  for (int i = 2; i <= 3; i++) {
+    Table::SampledItem sample;
+    REVERB_EXPECT_OK(table->Sample(&sample));
+    absl::MutexLock lock(&mu);
+    auto has_completed = [&completed, i] {
+      return completed.size() == static_cast<size_t>(i);
+    };
+    EXPECT_TRUE(
+        mu.AwaitWithTimeout(absl::Condition(&has_completed), 10 * kTimeout));
+  }
+  absl::MutexLock lock(&mu);
+  EXPECT_THAT(completed, ElementsAre(1, 2, 3));
+  EXPECT_EQ(table->size(), 3);
+}
+
+TEST(TableTest, AsyncSampleTimesOut) {
+  auto table = MakeUniformTable("dist");
+
+  absl::Notification done;
+  table->SampleFlexibleBatchAsync(
+      1,
+      [&](absl::Status status, std::vector<Table::SampledItem> items) {
+        EXPECT_EQ(status.code(), absl::StatusCode::kDeadlineExceeded);
+        EXPECT_THAT(items, IsEmpty());
+        done.Notify();
+      },
+      kTimeout);
+  EXPECT_TRUE(done.WaitForNotificationWithTimeout(10 * kTimeout));
+}
+
+TEST(TableTest, CloseCancelsPendingAsyncRequests) {
+  auto table = MakeUniformTable("dist");
+
+  absl::Notification done;
+  table->SampleFlexibleBatchAsync(
+      1, [&](absl::Status status, std::vector<Table::SampledItem> items) {
+        EXPECT_EQ(status.code(), absl::StatusCode::kCancelled);
+        done.Notify();
+      });
+  EXPECT_FALSE(done.WaitForNotificationWithTimeout(kTimeout));
+
+  table->Close();
+  EXPECT_TRUE(done.WaitForNotificationWithTimeout(10 * kTimeout));
+}
+
+TEST(TableTest, DestructorCancelsPendingAsyncRequests) {
+  auto table = MakeUniformTable("dist");
+
+  absl::Status result;
+  table->SampleFlexibleBatchAsync(
+      1, [&](absl::Status status, std::vector<Table::SampledItem> items) {
+        result = status;
+      });
+  table = nullptr;
+  EXPECT_EQ(result.code(), absl::StatusCode::kCancelled);
+}
+
 TEST(TableTest, DefaultFlexibleBatchSize) {
   // If a sample to insert ratio is set then that should be used.
   Table samples_per_insert_table(
@@ -14,10 +14,26 @@
 
 #include "reverb/cc/tensor_compression.h"
 
+#include <algorithm>
+#include <cmath>
 #include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
 
+#include "absl/base/thread_annotations.h"
+#include "absl/memory/memory.h"
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "reverb/cc/platform/hash_map.h"
 #include "reverb/cc/platform/logging.h"
 #include "reverb/cc/platform/snappy.h"
+#include "tensorflow/core/framework/allocation_description.pb.h"
 #include "tensorflow/core/framework/register_types.h"
 #include "tensorflow/core/framework/tensor_shape.h"
 #include "tensorflow/core/framework/types.h"
@@ -39,21 +55,379 @@ tensorflow::Tensor DeltaEncode(const tensorflow::Tensor& tensor, bool encode) {
   TF_CHECK_OK(output_reinterpret.BitcastFrom(
       output, tensorflow::DataTypeToEnum<T>::v(), output.shape()));
 
-  auto src = tensor_reinterpret.flat_outer_dims<T>();
-  auto dst = output_reinterpret.flat_outer_dims<T>();
-  for (int j = 0; j < src.dimension(1); j++) {
-    dst(0, j) = src(0, j);
-  }
-  for (int i = 1; i < src.dimension(0); i++) {
-    for (int j = 0; j < src.dimension(1); j++) {
-      dst(i, j) = src(i, j) + (encode ? -src(i - 1, j) : dst(i - 1, j));
+  // The rows (i.e. time steps) are processed one at a time and each row is a
+  // contiguous run of elements without dependencies between them, so the inner
+  // loops are vectorized by the compiler. Decoding is a prefix sum over the
+  // rows.
+  const int64_t num_rows = tensor.dim_size(0);
+  const int64_t row_size = num_rows == 0 ? 0 : tensor.NumElements() / num_rows;
+  const T* __restrict src = tensor_reinterpret.flat<T>().data();
+  T* __restrict dst = output_reinterpret.flat<T>().data();
+
+  std::copy(src, src + row_size, dst);
+  for (int64_t i = 1; i < num_rows; i++) {
+    const T* __restrict row = src + i * row_size;
+    const T* __restrict prev = (encode ? src : dst) + (i - 1) * row_size;
+    T* __restrict out = dst + i * row_size;
+    if (encode) {
+      for (int64_t j = 0; j < row_size; j++) out[j] = row[j] - prev[j];
+    } else {
+      for (int64_t j = 0; j < row_size; j++) out[j] = row[j] + prev[j];
     }
   }
   return output;
 }
 
+class SnappyCodec : public TensorCodec {
+ public:
+  void Compress(absl::string_view input, std::string* output) const override {
+    output->clear();
+    SnappyCompressFromString(input, output);
+  }
+
+  bool Uncompress(absl::string_view input, size_t output_size,
+                  char* output) const override {
+    return SnappyUncompressToString(input, output_size, output);
+  }
+};
+
+class IdentityCodec : public TensorCodec {
+ public:
+  void Compress(absl::string_view input, std::string* output) const override {
+    output->assign(input.data(), input.size());
+  }
+
+  bool Uncompress(absl::string_view input, size_t output_size,
+                  char* output) const override {
+    if (input.size() != output_size) return false;
+    std::memcpy(output, input.data(), output_size);
+    return true;
+  }
+};
+
+// Exposes the content of a `TensorProto` as a `tensorflow::TensorBuffer`
+// without copying it. The buffer holds a reference to the owner of the proto
+// until it is destroyed.
+class ProtoContentTensorBuffer : public tensorflow::TensorBuffer {
+ public:
+  ProtoContentTensorBuffer(absl::string_view content,
+                           std::shared_ptr<const void> owner)
+      : tensorflow::TensorBuffer(const_cast<char*>(content.data())),
+        size_(content.size()),
+        owner_(std::move(owner)) {}
+
+  size_t size() const override { return size_; }
+
+  tensorflow::TensorBuffer* root_buffer() override { return this; }
+
+  void FillAllocationDescription(
+      tensorflow::AllocationDescription* proto) const override {
+    proto->set_requested_bytes(size_);
+    proto->set_allocator_name("ProtoContentTensorBuffer");
+  }
+
+  bool OwnsMemory() const override { return false; }
+
+ private:
+  const size_t size_;
+  std::shared_ptr<const void> owner_;
+};
+
+class TensorCodecRegistry {
+ public:
+  static TensorCodecRegistry* Get() {
+    static auto* registry = new TensorCodecRegistry();
+    return registry;
+  }
+
+  void Register(ChunkData::Codec codec,
+                std::unique_ptr<TensorCodec> implementation) {
+    REVERB_CHECK(implementation != nullptr);
+    absl::MutexLock lock(&mu_);
+    REVERB_CHECK(codecs_.emplace(codec, std::move(implementation)).second)
+        << "Codec " << ChunkData::Codec_Name(codec)
+        << " has already been registered.";
+  }
+
+  const TensorCodec* Find(ChunkData::Codec codec) const {
+    absl::MutexLock lock(&mu_);
+    auto it = codecs_.find(codec);
+    return it == codecs_.end() ? nullptr : it->second.get();
+  }
+
+ private:
+  TensorCodecRegistry() {
+    codecs_[ChunkData::SNAPPY] = absl::make_unique<SnappyCodec>();
+    codecs_[ChunkData::NONE] = absl::make_unique<IdentityCodec>();
+  }
+
+  mutable absl::Mutex mu_;
+  internal::flat_hash_map<int, std::unique_ptr<TensorCodec>> codecs_
+      ABSL_GUARDED_BY(mu_);
+};
+
+const TensorCodec& GetRegisteredCodecOrDie(ChunkData::Codec codec) {
+  const TensorCodec* implementation = GetTensorCodec(codec);
+  REVERB_CHECK(implementation != nullptr)
+      << "Codec " << ChunkData::Codec_Name(codec) << " has not been registered.";
+  return *implementation;
+}
+
+// The serialized content of string tensors has no fixed size so when they are
+// compressed the uncompressed size is stored in front of the compressed data.
+constexpr size_t kStringSizeHeaderBytes = sizeof(uint64_t);
+
+// `TensorProto::version_number` of string tensors whose packed content (i.e.
+// the length prefixed strings of `Tensor::AsProtoTensorContent`) has been
+// compressed. String tensors compressed with `SNAPPY` before strings were
+// compressed by it lack the marker and hold the packed content uncompressed.
+constexpr int kCompressedStringsVersion = 1;
+
+bool HasCompressedStrings(const tensorflow::TensorProto& proto,
+                          ChunkData::Codec codec) {
+  if (codec == ChunkData::NONE) return false;
+  return codec != ChunkData::SNAPPY ||
+         proto.version_number() == kCompressedStringsVersion;
+}
+
 }  // namespace
 
+bool DeduplicateFrames(const tensorflow::Tensor& tensor,
+                       tensorflow::Tensor* unique_frames,
+                       ChunkData::DeduplicatedFrames* frames) {
+  if (tensor.dims() < 3 || !tensorflow::DataTypeCanUseMemcpy(tensor.dtype())) {
+    return false;
+  }
+
+  const int64_t num_frames = tensor.dim_size(0) * tensor.dim_size(1);
+  if (num_frames == 0) return false;
+  const size_t frame_bytes = tensor.TotalBytes() / num_frames;
+  const char* data = tensor.tensor_data().data();
+
+  // Maps the content of each unique frame to its index among them. The keys
+  // point into `tensor`.
+  internal::flat_hash_map<absl::string_view, int32_t> unique_index;
+  std::vector<int32_t> frame_indices;
+  std::vector<int64_t> unique_offsets;
+  frame_indices.reserve(num_frames);
+  for (int64_t i = 0; i < num_frames; i++) {
+    absl::string_view frame(data + i * frame_bytes, frame_bytes);
+    const int32_t next_index = unique_offsets.size();
+    auto it = unique_index.emplace(frame, next_index).first;
+    if (it->second == next_index) {
+      unique_offsets.push_back(i);
+    }
+    frame_indices.push_back(it->second);
+  }
+
+  if (unique_offsets.size() == num_frames) return false;
+
+  tensorflow::TensorShape shape = tensor.shape();
+  shape.RemoveDimRange(0, 2);
+  shape.InsertDim(0, unique_offsets.size());
+  *unique_frames = tensorflow::Tensor(tensor.dtype(), shape);
+  char* dst = const_cast<char*>(unique_frames->tensor_data().data());
+  for (int64_t i = 0; i < unique_offsets.size(); i++) {
+    std::memcpy(dst + i * frame_bytes, data + unique_offsets[i] * frame_bytes,
+                frame_bytes);
+  }
+
+  tensor.shape().AsProto(frames->mutable_shape());
+  frames->mutable_frame_indices()->Assign(frame_indices.begin(),
+                                          frame_indices.end());
+  return true;
+}
+
+absl::Status ExpandDeduplicatedFrames(
+    const tensorflow::Tensor& unique_frames,
+    const ChunkData::DeduplicatedFrames& frames, tensorflow::Tensor* out) {
+  tensorflow::TensorShape shape(frames.shape());
+  if (shape.dims() < 3 ||
+      shape.dim_size(0) * shape.dim_size(1) != frames.frame_indices_size()) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Deduplicated frames of shape ", shape.DebugString(), " have ",
+        frames.frame_indices_size(), " frame indices."));
+  }
+  if (unique_frames.dims() != shape.dims() - 1 ||
+      unique_frames.dtype() == tensorflow::DT_STRING) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Unique frames of shape ", unique_frames.shape().DebugString(),
+        " cannot be expanded into shape ", shape.DebugString(), "."));
+  }
+
+  const int64_t num_unique = unique_frames.dim_size(0);
+  const size_t frame_bytes =
+      num_unique == 0 ? 0 : unique_frames.TotalBytes() / num_unique;
+  tensorflow::Tensor expanded(unique_frames.dtype(), shape);
+  if (expanded.TotalBytes() != frame_bytes * frames.frame_indices_size()) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Unique frames of shape ", unique_frames.shape().DebugString(),
+        " cannot be expanded into shape ", shape.DebugString(), "."));
+  }
+
+  const char* src = unique_frames.tensor_data().data();
+  char* dst = const_cast<char*>(expanded.tensor_data().data());
+  for (int i = 0; i < frames.frame_indices_size(); i++) {
+    const int32_t index = frames.frame_indices(i);
+    if (index < 0 || index >= num_unique) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Frame index ", index, " is out of range for ",
+                       num_unique, " unique frames."));
+    }
+    std::memcpy(dst + i * frame_bytes, src + index * frame_bytes, frame_bytes);
+  }
+
+  *out = std::move(expanded);
+  return absl::OkStatus();
+}
+
+bool HasDeduplicatedFrames(const ChunkData& chunk_data, int column) {
+  return column < chunk_data.deduplicated_frames_size() &&
+         chunk_data.deduplicated_frames(column).frame_indices_size() > 0;
+}
+
+bool QuantizeTensor(const tensorflow::Tensor& tensor,
+                    ChunkData::Quantization quantization,
+                    tensorflow::Tensor* quantized,
+                    ChunkData::QuantizedColumn* column) {
+  if (quantization == ChunkData::NO_QUANTIZATION ||
+      tensor.dtype() != tensorflow::DT_FLOAT) {
+    return false;
+  }
+
+  auto src = tensor.flat<float>();
+  switch (quantization) {
+    case ChunkData::BFLOAT16: {
+      *quantized = tensorflow::Tensor(tensorflow::DT_BFLOAT16, tensor.shape());
+      auto dst = quantized->flat<tensorflow::bfloat16>();
+      for (int64_t i = 0; i < src.size(); i++) {
+        dst(i) = static_cast<tensorflow::bfloat16>(src(i));
+      }
+      break;
+    }
+    case ChunkData::FLOAT16: {
+      *quantized = tensorflow::Tensor(tensorflow::DT_HALF, tensor.shape());
+      auto dst = quantized->flat<Eigen::half>();
+      for (int64_t i = 0; i < src.size(); i++) {
+        dst(i) = static_cast<Eigen::half>(src(i));
+      }
+      break;
+    }
+    case ChunkData::UINT8_AFFINE: {
+      float min = std::numeric_limits<float>::infinity();
+      float max = -std::numeric_limits<float>::infinity();
+      for (int64_t i = 0; i < src.size(); i++) {
+        if (!std::isfinite(src(i))) return false;
+        min = std::min(min, src(i));
+        max = std::max(max, src(i));
+      }
+      const float scale = max > min ? (max - min) / 255.0f : 1.0f;
+      const float offset = src.size() > 0 ? min : 0.0f;
+
+      *quantized = tensorflow::Tensor(tensorflow::DT_UINT8, tensor.shape());
+      auto dst = quantized->flat<tensorflow::uint8>();
+      for (int64_t i = 0; i < src.size(); i++) {
+        dst(i) = static_cast<tensorflow::uint8>(std::min(
+            255.0f, std::max(0.0f, std::round((src(i) - offset) / scale))));
+      }
+      column->set_scale(scale);
+      column->set_offset(offset);
+      break;
+    }
+    default:
+      return false;
+  }
+
+  column->set_quantization(quantization);
+  return true;
+}
+
+absl::Status DequantizeTensor(const tensorflow::Tensor& quantized,
+                              const ChunkData::QuantizedColumn& column,
+                              tensorflow::Tensor* out) {
+  tensorflow::DataType want;
+  switch (column.quantization()) {
+    case ChunkData::BFLOAT16:
+      want = tensorflow::DT_BFLOAT16;
+      break;
+    case ChunkData::FLOAT16:
+      want = tensorflow::DT_HALF;
+      break;
+    case ChunkData::UINT8_AFFINE:
+      want = tensorflow::DT_UINT8;
+      break;
+    default:
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Unsupported quantization ",
+          ChunkData::Quantization_Name(column.quantization()), "."));
+  }
+  if (quantized.dtype() != want) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Expected ", ChunkData::Quantization_Name(column.quantization()),
+        " quantized tensor to have dtype ", tensorflow::DataTypeString(want),
+        " but got ", tensorflow::DataTypeString(quantized.dtype()), "."));
+  }
+
+  tensorflow::Tensor dequantized(tensorflow::DT_FLOAT, quantized.shape());
+  auto dst = dequantized.flat<float>();
+  switch (column.quantization()) {
+    case ChunkData::BFLOAT16: {
+      auto src = quantized.flat<tensorflow::bfloat16>();
+      for (int64_t i = 0; i < dst.size(); i++) {
+        dst(i) = static_cast<float>(src(i));
+      }
+      break;
+    }
+    case ChunkData::FLOAT16: {
+      auto src = quantized.flat<Eigen::half>();
+      for (int64_t i = 0; i < dst.size(); i++) {
+        dst(i) = static_cast<float>(src(i));
+      }
+      break;
+    }
+    default: {
+      auto src = quantized.flat<tensorflow::uint8>();
+      for (int64_t i = 0; i < dst.size(); i++) {
+        dst(i) = column.scale() * src(i) + column.offset();
+      }
+      break;
+    }
+  }
+
+  *out = std::move(dequantized);
+  return absl::OkStatus();
+}
+
+bool IsQuantized(const ChunkData& chunk_data, int column) {
+  return column < chunk_data.quantized_columns_size() &&
+         chunk_data.quantized_columns(column).quantization() !=
+             ChunkData::NO_QUANTIZATION;
+}
+
+tensorflow::DataType ColumnDtype(const ChunkData& chunk_data, int column) {
+  if (IsQuantized(chunk_data, column)) {
+    return tensorflow::DT_FLOAT;
+  }
+  return chunk_data.data().tensors(column).dtype();
+}
+
+const tensorflow::TensorShapeProto& ColumnShape(const ChunkData& chunk_data,
+                                                int column) {
+  if (HasDeduplicatedFrames(chunk_data, column)) {
+    return chunk_data.deduplicated_frames(column).shape();
+  }
+  return chunk_data.data().tensors(column).tensor_shape();
+}
+
+void RegisterTensorCodec(ChunkData::Codec codec,
+                         std::unique_ptr<TensorCodec> implementation) {
+  TensorCodecRegistry::Get()->Register(codec, std::move(implementation));
+}
+
+const TensorCodec* GetTensorCodec(ChunkData::Codec codec) {
+  return TensorCodecRegistry::Get()->Find(codec);
+}
+
 tensorflow::Tensor DeltaEncode(const tensorflow::Tensor& tensor, bool encode) {
   if (tensor.dims() < 2) return tensor;
 
@@ -79,33 +453,286 @@ std::vector<tensorflow::Tensor> DeltaEncodeList(
 }
 
 void CompressTensorAsProto(const tensorflow::Tensor& tensor,
-                           tensorflow::TensorProto* proto) {
+                           tensorflow::TensorProto* proto,
+                           ChunkData::Codec codec) {
+  const TensorCodec& implementation = GetRegisteredCodecOrDie(codec);
   if (tensor.dtype() == tensorflow::DT_STRING) {
     tensor.AsProtoTensorContent(proto);
+    if (codec == ChunkData::NONE) return;
+
+    uint64_t size = proto->tensor_content().size();
+    std::string compressed;
+    implementation.Compress(proto->tensor_content(), &compressed);
+    std::string* content = proto->mutable_tensor_content();
+    content->assign(reinterpret_cast<const char*>(&size),
+                    kStringSizeHeaderBytes);
+    content->append(compressed);
+    proto->set_version_number(kCompressedStringsVersion);
   } else {
     proto->set_dtype(tensor.dtype());
     tensor.shape().AsProto(proto->mutable_tensor_shape());
-    SnappyCompressFromString(tensor.tensor_data(),
-                             proto->mutable_tensor_content());
+    implementation.Compress(tensor.tensor_data(),
+                            proto->mutable_tensor_content());
   }
 }
 
+ChunkData::Codec CompressTensorAsProtoIfSmaller(const tensorflow::Tensor& tensor,
+                                                tensorflow::TensorProto* proto,
+                                                ChunkData::Codec codec) {
+  CompressTensorAsProto(tensor, proto, codec);
+  if (codec == ChunkData::NONE) return codec;
+  if (tensor.dtype() == tensorflow::DT_STRING) {
+    // The packed content of strings is larger than `TotalBytes` (which only
+    // counts the bytes of the strings) so it is compared directly.
+    tensorflow::TensorProto uncompressed;
+    CompressTensorAsProto(tensor, &uncompressed, ChunkData::NONE);
+    if (proto->tensor_content().size() < uncompressed.tensor_content().size()) {
+      return codec;
+    }
+    *proto = std::move(uncompressed);
+    return ChunkData::NONE;
+  }
+  if (proto->tensor_content().size() < tensor.TotalBytes()) {
+    return codec;
+  }
+  proto->Clear();
+  CompressTensorAsProto(tensor, proto, ChunkData::NONE);
+  return ChunkData::NONE;
+}
+
 tensorflow::Tensor DecompressTensorFromProto(
-    const tensorflow::TensorProto& proto) {
+    const tensorflow::TensorProto& proto, ChunkData::Codec codec) {
+  const TensorCodec& implementation = GetRegisteredCodecOrDie(codec);
   if (proto.dtype() == tensorflow::DT_STRING) {
     tensorflow::Tensor tensor;
-    REVERB_CHECK(tensor.FromProto(proto));
+    if (!HasCompressedStrings(proto, codec)) {
+      REVERB_CHECK(tensor.FromProto(proto));
+      return tensor;
+    }
+
+    absl::string_view content = proto.tensor_content();
+    REVERB_CHECK_GE(content.size(), kStringSizeHeaderBytes);
+    uint64_t size;
+    std::memcpy(&size, content.data(), kStringSizeHeaderBytes);
+    content.remove_prefix(kStringSizeHeaderBytes);
+
+    tensorflow::TensorProto uncompressed;
+    uncompressed.set_dtype(proto.dtype());
+    *uncompressed.mutable_tensor_shape() = proto.tensor_shape();
+    std::string* uncompressed_content = uncompressed.mutable_tensor_content();
+    uncompressed_content->resize(size);
+    REVERB_CHECK(implementation.Uncompress(content, size,
+                                           &(*uncompressed_content)[0]));
+    REVERB_CHECK(tensor.FromProto(uncompressed));
     return tensor;
   } else {
     tensorflow::Tensor tensor(proto.dtype(),
                               tensorflow::TensorShape(proto.tensor_shape()));
-    const auto& tensor_content = proto.tensor_content();
-    SnappyUncompressToString(tensor_content,
-                             tensor.tensor_data().size(),
-                             const_cast<char*>(tensor.tensor_data().data()));
+    implementation.Uncompress(proto.tensor_content(),
+                              tensor.tensor_data().size(),
+                              const_cast<char*>(tensor.tensor_data().data()));
     return tensor;
   }
 }
 
+bool AliasUncompressedTensor(const tensorflow::TensorProto& proto,
+                             ChunkData::Codec codec,
+                             std::shared_ptr<const void> owner,
+                             tensorflow::Tensor* out) {
+  if (codec != ChunkData::NONE ||
+      !tensorflow::DataTypeCanUseMemcpy(proto.dtype())) {
+    return false;
+  }
+  tensorflow::TensorShape shape(proto.tensor_shape());
+  absl::string_view content = proto.tensor_content();
+  if (shape.num_elements() == 0 ||
+      content.size() !=
+          shape.num_elements() * tensorflow::DataTypeSize(proto.dtype()) ||
+      reinterpret_cast<uintptr_t>(content.data()) % EIGEN_MAX_ALIGN_BYTES !=
+          0) {
+    return false;
+  }
+
+  auto* buffer = new ProtoContentTensorBuffer(content, std::move(owner));
+  *out = tensorflow::Tensor(proto.dtype(), shape, buffer);
+  buffer->Unref();
+  return true;
+}
+
+absl::Status DecompressTensorIntoBuffer(const tensorflow::TensorProto& proto,
+                                        ChunkData::Codec codec,
+                                        tensorflow::Tensor* out) {
+  if (out->dtype() != proto.dtype()) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Cannot decompress tensor of dtype ",
+        tensorflow::DataTypeString(proto.dtype()), " into buffer of dtype ",
+        tensorflow::DataTypeString(out->dtype()), "."));
+  }
+  tensorflow::TensorShape shape(proto.tensor_shape());
+  if (out->NumElements() != shape.num_elements()) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Cannot decompress tensor of shape ", shape.DebugString(),
+        " into buffer of shape ", out->shape().DebugString(), "."));
+  }
+
+  if (proto.dtype() == tensorflow::DT_STRING) {
+    // The encoding of strings has no fixed size so they cannot be decoded in
+    // place.
+    tensorflow::Tensor tensor = DecompressTensorFromProto(proto, codec);
+    auto src = tensor.flat<tensorflow::tstring>();
+    auto dst = out->flat<tensorflow::tstring>();
+    for (int64_t i = 0; i < src.size(); i++) {
+      dst(i) = std::move(src(i));
+    }
+    return absl::OkStatus();
+  }
+
+  const TensorCodec* implementation = GetTensorCodec(codec);
+  if (implementation == nullptr) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Codec ", ChunkData::Codec_Name(codec), " has not been registered."));
+  }
+  auto buffer = out->tensor_data();
+  if (!implementation->Uncompress(proto.tensor_content(), buffer.size(),
+                                  const_cast<char*>(buffer.data()))) {
+    return absl::DataLossError(
+        absl::StrCat("Failed to decompress tensor of shape ",
+                     shape.DebugString(), " with codec ",
+                     ChunkData::Codec_Name(codec), "."));
+  }
+  return absl::OkStatus();
+}
+
+bool CompressTensorAsBlocks(const tensorflow::Tensor& tensor,
+                            int rows_per_block, ChunkData::Codec codec,
+                            tensorflow::TensorProto* proto,
+                            ChunkData::CompressedBlocks* blocks) {
+  if (rows_per_block <= 0 || tensor.dims() == 0 ||
+      !tensorflow::DataTypeCanUseMemcpy(tensor.dtype()) ||
+      tensor.dim_size(0) <= rows_per_block) {
+    return false;
+  }
+
+  const TensorCodec& implementation = GetRegisteredCodecOrDie(codec);
+  const int64_t num_rows = tensor.dim_size(0);
+  const size_t row_bytes = tensor.TotalBytes() / num_rows;
+  const char* data = tensor.tensor_data().data();
+
+  proto->set_dtype(tensor.dtype());
+  tensor.shape().AsProto(proto->mutable_tensor_shape());
+  std::string* content = proto->mutable_tensor_content();
+  content->clear();
+  blocks->set_rows_per_block(rows_per_block);
+  blocks->clear_block_ends();
+
+  std::string compressed;
+  for (int64_t start = 0; start < num_rows; start += rows_per_block) {
+    const int64_t end = std::min<int64_t>(start + rows_per_block, num_rows);
+    implementation.Compress(
+        absl::string_view(data + start * row_bytes, (end - start) * row_bytes),
+        &compressed);
+    content->append(compressed);
+    blocks->add_block_ends(content->size());
+  }
+  return true;
+}
+
+bool HasCompressedBlocks(const ChunkData& chunk_data, int column) {
+  return column < chunk_data.compressed_blocks_size() &&
+         chunk_data.compressed_blocks(column).block_ends_size() > 0;
+}
+
+absl::Status DecompressRowsIntoBuffer(const tensorflow::TensorProto& proto,
+                                      ChunkData::Codec codec,
+                                      const ChunkData::CompressedBlocks& blocks,
+                                      int64_t offset, int64_t length,
+                                      tensorflow::Tensor* out) {
+  if (out->dtype() != proto.dtype()) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Cannot decompress tensor of dtype ",
+        tensorflow::DataTypeString(proto.dtype()), " into buffer of dtype ",
+        tensorflow::DataTypeString(out->dtype()), "."));
+  }
+  tensorflow::TensorShape shape(proto.tensor_shape());
+  if (shape.dims() == 0 || offset < 0 || length < 0 ||
+      offset + length > shape.dim_size(0)) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Cannot decompress rows (", offset, ", ", offset + length,
+        ") of tensor with shape ", shape.DebugString(), "."));
+  }
+  const int64_t num_rows = shape.dim_size(0);
+  const size_t row_bytes =
+      num_rows == 0 ? 0
+                    : shape.num_elements() / num_rows *
+                          tensorflow::DataTypeSize(proto.dtype());
+  if (out->TotalBytes() != length * row_bytes) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Cannot decompress ", length, " rows of tensor with shape ",
+        shape.DebugString(), " into buffer of shape ",
+        out->shape().DebugString(), "."));
+  }
+  if (length == 0) return absl::OkStatus();
+
+  const TensorCodec* implementation = GetTensorCodec(codec);
+  if (implementation == nullptr) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Codec ", ChunkData::Codec_Name(codec), " has not been registered."));
+  }
+  const int64_t rows_per_block = blocks.rows_per_block();
+  if (rows_per_block <= 0 ||
+      blocks.block_ends_size() !=
+          (num_rows + rows_per_block - 1) / rows_per_block) {
+    return absl::DataLossError(absl::StrCat(
+        "Block index with ", blocks.block_ends_size(), " blocks of ",
+        rows_per_block, " rows does not match tensor with shape ",
+        shape.DebugString(), "."));
+  }
+
+  absl::string_view content = proto.tensor_content();
+  char* dst = const_cast<char*>(out->tensor_data().data());
+  std::string partial_block;
+  for (int64_t block = offset / rows_per_block;
+       block * rows_per_block < offset + length; block++) {
+    const int64_t block_start = block * rows_per_block;
+    const int64_t block_end =
+        std::min<int64_t>(block_start + rows_per_block, num_rows);
+    const int64_t begin = block == 0 ? 0 : blocks.block_ends(block - 1);
+    const int64_t end = blocks.block_ends(block);
+    if (begin > end || end > static_cast<int64_t>(content.size())) {
+      return absl::DataLossError(absl::StrCat(
+          "Block ", block, " spans bytes (", begin, ", ", end,
+          ") of content with only ", content.size(), " bytes."));
+    }
+    auto input = content.substr(begin, end - begin);
+
+    // Blocks which are entirely covered by the rows are decompressed straight
+    // into `out`. The blocks at the edges are decompressed into a temporary
+    // buffer and only the requested rows copied.
+    const int64_t first = std::max(offset, block_start);
+    const int64_t last = std::min(offset + length, block_end);
+    const size_t block_bytes = (block_end - block_start) * row_bytes;
+    char* target = dst + (first - offset) * row_bytes;
+    bool ok;
+    if (first == block_start && last == block_end) {
+      ok = implementation->Uncompress(input, block_bytes, target);
+    } else {
+      partial_block.resize(block_bytes);
+      ok = implementation->Uncompress(input, block_bytes, &partial_block[0]);
+      if (ok) {
+        std::memcpy(target,
+                    partial_block.data() + (first - block_start) * row_bytes,
+                    (last - first) * row_bytes);
+      }
+    }
+    if (!ok) {
+      return absl::DataLossError(absl::StrCat(
+          "Failed to decompress block ", block, " of tensor with shape ",
+          shape.DebugString(), " with codec ", ChunkData::Codec_Name(codec),
+          "."));
+    }
+  }
+  return absl::OkStatus();
+}
+
 }  // namespace reverb
 }  // namespace deepmind
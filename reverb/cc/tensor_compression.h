@@ -15,6 +15,14 @@
 #ifndef LEARNING_DEEPMIND_REPLAY_REVERB_TENSOR_COMPRESSION_H_
 #define LEARNING_DEEPMIND_REPLAY_REVERB_TENSOR_COMPRESSION_H_
 
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/strings/string_view.h"
+#include "reverb/cc/schema.pb.h"
 #include "tensorflow/core/framework/tensor.h"
 #include "tensorflow/core/framework/tensor.pb.h"
 
@@ -31,14 +39,154 @@ tensorflow::Tensor DeltaEncode(const tensorflow::Tensor& tensor, bool encode);
 std::vector<tensorflow::Tensor> DeltaEncodeList(
     const std::vector<tensorflow::Tensor>& tensors, bool encode);
 
-// Compresses a Tensor with Zippy. The resulting `proto` must be read with
-// `DecompressTensorFromProto`. Note that string tensors are not compressed.
+// Splits every row of `tensor` into frames along its second dimension (i.e.
+// `tensor[i, j]` is a frame) and stores identical frames once. Intended for
+// overlapping stacked observations where consecutive rows share all but one
+// frame. Returns false, without modifying `unique_frames` or `frames`, if
+// `tensor` has less than 3 dimensions, cannot be copied with memcpy (e.g.
+// strings) or has no duplicate frames.
+bool DeduplicateFrames(const tensorflow::Tensor& tensor,
+                       tensorflow::Tensor* unique_frames,
+                       ChunkData::DeduplicatedFrames* frames);
+
+// Inverse of `DeduplicateFrames`.
+absl::Status ExpandDeduplicatedFrames(
+    const tensorflow::Tensor& unique_frames,
+    const ChunkData::DeduplicatedFrames& frames, tensorflow::Tensor* out);
+
+// True if the frames of `column` in `chunk_data` have been deduplicated.
+bool HasDeduplicatedFrames(const ChunkData& chunk_data, int column);
+
+// Quantizes the DT_FLOAT `tensor` with `quantization`. Returns false, without
+// modifying `quantized` or `column`, if `quantization` is `NO_QUANTIZATION`,
+// `tensor` is not DT_FLOAT or, for `UINT8_AFFINE`, if `tensor` contains
+// non-finite values.
+bool QuantizeTensor(const tensorflow::Tensor& tensor,
+                    ChunkData::Quantization quantization,
+                    tensorflow::Tensor* quantized,
+                    ChunkData::QuantizedColumn* column);
+
+// Inverse of `QuantizeTensor`. `out` is a DT_FLOAT tensor with the shape of
+// `quantized`.
+absl::Status DequantizeTensor(const tensorflow::Tensor& quantized,
+                              const ChunkData::QuantizedColumn& column,
+                              tensorflow::Tensor* out);
+
+// True if `column` in `chunk_data` has been quantized.
+bool IsQuantized(const ChunkData& chunk_data, int column);
+
+// Dtype of the tensor in `column` of `chunk_data` once unpacked, which differs
+// from the dtype of the stored tensor if it has been quantized.
+tensorflow::DataType ColumnDtype(const ChunkData& chunk_data, int column);
+
+// Shape of the tensor in `column` of `chunk_data` once decompressed, which
+// differs from the shape of the stored tensor if its frames have been
+// deduplicated.
+const tensorflow::TensorShapeProto& ColumnShape(const ChunkData& chunk_data,
+                                                int column);
+
+// Compresses and decompresses the content of tensors. Implementations must be
+// thread-safe.
+class TensorCodec {
+ public:
+  virtual ~TensorCodec() = default;
+
+  // Replaces the content of `output` with the compressed `input`.
+  virtual void Compress(absl::string_view input, std::string* output) const = 0;
+
+  // Decompresses `input` into `output`, which holds exactly `output_size`
+  // bytes. Returns false if `input` is corrupt or does not decompress into
+  // `output_size` bytes.
+  virtual bool Uncompress(absl::string_view input, size_t output_size,
+                          char* output) const = 0;
+};
+
+// Registers the implementation of `codec`. Codecs which depend on libraries
+// that are not always available (e.g. `ChunkData::ZSTD`) are registered by the
+// library which provides them, typically from a static initializer. Must not be
+// called more than once per codec and never for the built-in `SNAPPY` and
+// `NONE` codecs.
+void RegisterTensorCodec(ChunkData::Codec codec,
+                         std::unique_ptr<TensorCodec> implementation);
+
+// Returns the implementation of `codec` or nullptr if it has not been
+// registered.
+const TensorCodec* GetTensorCodec(ChunkData::Codec codec);
+
+// Compresses a Tensor with `codec`, which must be registered. The resulting
+// `proto` must be read with `DecompressTensorFromProto` and the same codec.
+// The strings of string tensors are packed into a single length prefixed buffer
+// which is compressed like the content of any other tensor, and unpacked into
+// `tstring`s when the tensor is decompressed.
 void CompressTensorAsProto(const tensorflow::Tensor& tensor,
-                           tensorflow::TensorProto* proto);
+                           tensorflow::TensorProto* proto,
+                           ChunkData::Codec codec = ChunkData::SNAPPY);
+
+// Same as `CompressTensorAsProto` except that the content is stored
+// uncompressed (i.e. with `NONE`) if compressing it with `codec` does not make
+// it smaller. This is typical for the tiny chunks of columns holding a few
+// scalars per step (e.g. rewards), where the codec has too little input to find
+// any redundancy and only adds its own framing. Returns the codec which was
+// used.
+ChunkData::Codec CompressTensorAsProtoIfSmaller(const tensorflow::Tensor& tensor,
+                                                tensorflow::TensorProto* proto,
+                                                ChunkData::Codec codec);
 
-// Assumes that the TensorProto was built by calling `CompressTensorAsProto`.
+// Assumes that the TensorProto was built by calling `CompressTensorAsProto`
+// with `codec`.
 tensorflow::Tensor DecompressTensorFromProto(
-    const tensorflow::TensorProto& proto);
+    const tensorflow::TensorProto& proto,
+    ChunkData::Codec codec = ChunkData::SNAPPY);
+
+// Sets `out` to a tensor which shares the content of `proto`, which must have
+// been built by `CompressTensorAsProto` (or `CompressTensorAsBlocks`) with
+// `codec`, instead of decompressing it into a new buffer. The buffer of `out`
+// holds on to `owner`, which must keep `proto` alive and unmodified, until
+// every tensor sharing it has been destroyed. The buffer does not own its
+// memory so TensorFlow never forwards it to the output of an op, but it must
+// not be written to. Returns false, without modifying `out`, unless `codec` is
+// `NONE`, the dtype can be memcpy-ed (i.e. not strings) and the content is
+// aligned as required by `tensorflow::Tensor`.
+bool AliasUncompressedTensor(const tensorflow::TensorProto& proto,
+                             ChunkData::Codec codec,
+                             std::shared_ptr<const void> owner,
+                             tensorflow::Tensor* out);
+
+// Decompresses `proto`, which must have been built by `CompressTensorAsProto`
+// with `codec`, directly into the buffer of `out`. `out` must already have the
+// dtype and number of elements of the compressed tensor and its shape is left
+// unchanged. `out` can be a slice (see `Tensor::Slice`) of a larger tensor in
+// which case the data is written straight into the larger tensor. Note that
+// delta encoding is not reversed.
+absl::Status DecompressTensorIntoBuffer(const tensorflow::TensorProto& proto,
+                                        ChunkData::Codec codec,
+                                        tensorflow::Tensor* out);
+
+// Compresses `tensor` with `codec` in independent blocks of `rows_per_block`
+// rows (along the first dimension) so that a range of rows can later be read
+// with `DecompressRowsIntoBuffer` without decompressing the remaining blocks.
+// Returns false, without modifying `proto` or `blocks`, if `rows_per_block` is
+// <= 0, `tensor` is a scalar, its dtype cannot be memcpy-ed (i.e. strings) or
+// if it does not have more than `rows_per_block` rows.
+bool CompressTensorAsBlocks(const tensorflow::Tensor& tensor,
+                            int rows_per_block, ChunkData::Codec codec,
+                            tensorflow::TensorProto* proto,
+                            ChunkData::CompressedBlocks* blocks);
+
+// True if `column` in `chunk_data` has been compressed in blocks.
+bool HasCompressedBlocks(const ChunkData& chunk_data, int column);
+
+// Decompresses `length` rows, starting at row `offset`, of `proto` straight
+// into the buffer of `out`. `proto` must have been built by
+// `CompressTensorAsBlocks` with `codec` and `blocks`. Only the blocks which
+// cover the rows are decompressed. `out` must have the dtype of `proto` and
+// exactly the size of the rows. As with `DecompressTensorIntoBuffer`, `out` can
+// be a slice of a larger tensor.
+absl::Status DecompressRowsIntoBuffer(const tensorflow::TensorProto& proto,
+                                      ChunkData::Codec codec,
+                                      const ChunkData::CompressedBlocks& blocks,
+                                      int64_t offset, int64_t length,
+                                      tensorflow::Tensor* out);
 
 template <typename T>
 struct UnsignedType {
@@ -14,14 +14,24 @@
 
 #include "reverb/cc/tensor_compression.h"
 
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <memory>
 #include <string>
 
 #include "gtest/gtest.h"
+#include "absl/memory/memory.h"
+#include "absl/status/status.h"
+#include "absl/strings/string_view.h"
+#include "reverb/cc/platform/status_matchers.h"
+#include "reverb/cc/schema.pb.h"
 #include "reverb/cc/testing/tensor_testutil.h"
 #include "tensorflow/core/framework/register_types.h"
 #include "tensorflow/core/framework/tensor.h"
 #include "tensorflow/core/framework/tensor.pb.h"
 #include "tensorflow/core/framework/tensor_shape.h"
+#include "tensorflow/core/framework/tensor_util.h"
 #include "tensorflow/core/framework/types.h"
 #include "tensorflow/core/framework/types.pb.h"
 
@@ -48,6 +58,30 @@ TEST(TensorCompressionTest, EncodeMatchesDecode) {
   EncodeMatchesDecodeT<bool>();
 }
 
+TEST(TensorCompressionTest, EncodeStoresDifferenceToPreviousStep) {
+  tensorflow::Tensor tensor(tensorflow::DT_UINT8,
+                            tensorflow::TensorShape({3, 2}));
+  auto values = tensor.flat<tensorflow::uint8>();
+  values(0) = 10;
+  values(1) = 200;
+  values(2) = 15;
+  values(3) = 100;
+  values(4) = 5;
+  values(5) = 255;
+
+  tensorflow::Tensor encoded = DeltaEncode(tensor, true);
+  auto got = encoded.flat<tensorflow::uint8>();
+  EXPECT_EQ(got(0), 10);
+  EXPECT_EQ(got(1), 200);
+  EXPECT_EQ(got(2), 5);
+  EXPECT_EQ(got(3), 156);  // 100 - 200 wraps around.
+  EXPECT_EQ(got(4), 246);  // 5 - 15 wraps around.
+  EXPECT_EQ(got(5), 155);
+
+  test::ExpectTensorEqual<tensorflow::uint8>(tensor,
+                                             DeltaEncode(encoded, false));
+}
+
 TEST(TensorCompressionTest, EncodeListMatchesDecode) {
   tensorflow::Tensor tensor(tensorflow::DT_INT32,
                             tensorflow::TensorShape({16, 37, 6}));
@@ -74,6 +108,43 @@ TEST(TensorCompressionTest, StringTensor) {
   test::ExpectTensorEqual<tensorflow::tstring>(tensor, result);
 }
 
+TEST(TensorCompressionTest, StringTensorIsCompressed) {
+  tensorflow::Tensor tensor(tensorflow::DT_STRING,
+                            tensorflow::TensorShape({100}));
+  auto strings = tensor.flat<tensorflow::tstring>();
+  for (int i = 0; i < strings.size(); i++) {
+    strings(i) = "{\"observation\": \"the same text every step\"}";
+  }
+
+  tensorflow::TensorProto uncompressed;
+  tensor.AsProtoTensorContent(&uncompressed);
+
+  tensorflow::TensorProto proto;
+  EXPECT_EQ(CompressTensorAsProtoIfSmaller(tensor, &proto, ChunkData::SNAPPY),
+            ChunkData::SNAPPY);
+  EXPECT_LT(proto.tensor_content().size(),
+            uncompressed.tensor_content().size());
+  test::ExpectTensorEqual<tensorflow::tstring>(
+      tensor, DecompressTensorFromProto(proto, ChunkData::SNAPPY));
+
+  tensorflow::Tensor out(tensorflow::DT_STRING, tensor.shape());
+  REVERB_ASSERT_OK(DecompressTensorIntoBuffer(proto, ChunkData::SNAPPY, &out));
+  test::ExpectTensorEqual<tensorflow::tstring>(tensor, out);
+}
+
+TEST(TensorCompressionTest, DecompressesUncompressedSnappyStringTensor) {
+  // String tensors used to be stored uncompressed by `SNAPPY`.
+  tensorflow::Tensor tensor(tensorflow::DT_STRING,
+                            tensorflow::TensorShape({2}));
+  tensor.flat<tensorflow::tstring>()(0) = "hello";
+  tensor.flat<tensorflow::tstring>()(1) = "world";
+
+  tensorflow::TensorProto proto;
+  tensor.AsProtoTensorContent(&proto);
+  test::ExpectTensorEqual<tensorflow::tstring>(
+      tensor, DecompressTensorFromProto(proto, ChunkData::SNAPPY));
+}
+
 TEST(TensorCompressionTest, NonStringTensor) {
   tensorflow::Tensor tensor(tensorflow::DT_INT32,
                             tensorflow::TensorShape({2, 2}));
@@ -98,6 +169,381 @@ TEST(TensorCompressionTest, NonStringTensorWithDeltaEncoding) {
   test::ExpectTensorEqual<int>(tensor, DeltaEncode(result, false));
 }
 
+TEST(TensorCompressionTest, CompressIfSmallerFallsBackToNone) {
+  tensorflow::Tensor scalar(static_cast<int32_t>(1337));
+  tensorflow::TensorProto proto;
+  EXPECT_EQ(CompressTensorAsProtoIfSmaller(scalar, &proto, ChunkData::SNAPPY),
+            ChunkData::NONE);
+  EXPECT_EQ(proto.tensor_content(), scalar.tensor_data());
+  test::ExpectTensorEqual<int32_t>(
+      DecompressTensorFromProto(proto, ChunkData::NONE), scalar);
+
+  tensorflow::Tensor zeros(tensorflow::DT_INT32,
+                           tensorflow::TensorShape({1024}));
+  zeros.flat<int>().setZero();
+  tensorflow::TensorProto zeros_proto;
+  EXPECT_EQ(
+      CompressTensorAsProtoIfSmaller(zeros, &zeros_proto, ChunkData::SNAPPY),
+      ChunkData::SNAPPY);
+  EXPECT_LT(zeros_proto.tensor_content().size(), zeros.TotalBytes());
+}
+
+TEST(TensorCompressionTest, DecompressIntoSliceOfLargerTensor) {
+  tensorflow::Tensor tensor(tensorflow::DT_INT32,
+                            tensorflow::TensorShape({2, 3}));
+  tensor.flat<int>().setRandom();
+  tensorflow::TensorProto proto;
+  CompressTensorAsProto(tensor, &proto);
+
+  tensorflow::Tensor batch(tensorflow::DT_INT32,
+                           tensorflow::TensorShape({4, 3}));
+  batch.flat<int>().setZero();
+  tensorflow::Tensor rows = batch.Slice(1, 3);
+  ASSERT_TRUE(
+      DecompressTensorIntoBuffer(proto, ChunkData::SNAPPY, &rows).ok());
+
+  test::ExpectTensorEqual<int>(batch.Slice(1, 3), tensor);
+  EXPECT_EQ(batch.flat<int>()(0), 0);
+  EXPECT_EQ(batch.flat<int>()(11), 0);
+}
+
+TEST(TensorCompressionTest, DecompressIntoStringBuffer) {
+  tensorflow::Tensor tensor(tensorflow::DT_STRING,
+                            tensorflow::TensorShape({2}));
+  tensor.flat<tensorflow::tstring>()(0) = "a";
+  tensor.flat<tensorflow::tstring>()(1) = "bc";
+  tensorflow::TensorProto proto;
+  CompressTensorAsProto(tensor, &proto);
+
+  tensorflow::Tensor out(tensorflow::DT_STRING, tensorflow::TensorShape({2}));
+  ASSERT_TRUE(DecompressTensorIntoBuffer(proto, ChunkData::SNAPPY, &out).ok());
+  test::ExpectTensorEqual<tensorflow::tstring>(out, tensor);
+}
+
+TEST(TensorCompressionTest, DecompressIntoBufferValidatesDtypeAndSize) {
+  tensorflow::Tensor tensor(tensorflow::DT_INT32,
+                            tensorflow::TensorShape({2, 3}));
+  tensor.flat<int>().setRandom();
+  tensorflow::TensorProto proto;
+  CompressTensorAsProto(tensor, &proto);
+
+  tensorflow::Tensor wrong_dtype(tensorflow::DT_FLOAT,
+                                 tensorflow::TensorShape({2, 3}));
+  EXPECT_EQ(
+      DecompressTensorIntoBuffer(proto, ChunkData::SNAPPY, &wrong_dtype).code(),
+      absl::StatusCode::kInvalidArgument);
+
+  tensorflow::Tensor wrong_size(tensorflow::DT_INT32,
+                                tensorflow::TensorShape({3, 3}));
+  EXPECT_EQ(
+      DecompressTensorIntoBuffer(proto, ChunkData::SNAPPY, &wrong_size).code(),
+      absl::StatusCode::kInvalidArgument);
+}
+
+TEST(TensorCompressionTest, DeduplicateFramesOfStackedObservations) {
+  // Three steps of a stack of two frames where step `i` stacks frames `i` and
+  // `i + 1` so only 4 of the 6 frames are unique.
+  tensorflow::Tensor tensor(tensorflow::DT_UINT8,
+                            tensorflow::TensorShape({3, 2, 4}));
+  auto values = tensor.tensor<tensorflow::uint8, 3>();
+  for (int step = 0; step < 3; step++) {
+    for (int frame = 0; frame < 2; frame++) {
+      for (int pixel = 0; pixel < 4; pixel++) {
+        values(step, frame, pixel) = 10 * (step + frame) + pixel;
+      }
+    }
+  }
+
+  tensorflow::Tensor unique_frames;
+  ChunkData::DeduplicatedFrames frames;
+  ASSERT_TRUE(DeduplicateFrames(tensor, &unique_frames, &frames));
+  EXPECT_EQ(unique_frames.shape(), tensorflow::TensorShape({4, 4}));
+  EXPECT_EQ(tensorflow::TensorShape(frames.shape()), tensor.shape());
+  EXPECT_EQ(frames.frame_indices_size(), 6);
+
+  tensorflow::Tensor expanded;
+  ASSERT_TRUE(ExpandDeduplicatedFrames(unique_frames, frames, &expanded).ok());
+  test::ExpectTensorEqual<tensorflow::uint8>(expanded, tensor);
+}
+
+TEST(TensorCompressionTest, DeduplicateFramesSkipsTensorsWithoutDuplicates) {
+  tensorflow::Tensor tensor(tensorflow::DT_INT32,
+                            tensorflow::TensorShape({2, 2, 3}));
+  auto flat = tensor.flat<int>();
+  for (int i = 0; i < flat.size(); i++) flat(i) = i;
+
+  tensorflow::Tensor unique_frames;
+  ChunkData::DeduplicatedFrames frames;
+  EXPECT_FALSE(DeduplicateFrames(tensor, &unique_frames, &frames));
+  EXPECT_EQ(frames.frame_indices_size(), 0);
+
+  // Tensors without frames are never deduplicated.
+  tensorflow::Tensor rows(tensorflow::DT_INT32, tensorflow::TensorShape({2, 2}));
+  rows.flat<int>().setZero();
+  EXPECT_FALSE(DeduplicateFrames(rows, &unique_frames, &frames));
+}
+
+void ExpectQuantizationRoundTrip(ChunkData::Quantization quantization,
+                                 tensorflow::DataType quantized_dtype,
+                                 float abs_err) {
+  tensorflow::Tensor tensor(tensorflow::DT_FLOAT,
+                            tensorflow::TensorShape({4, 8}));
+  auto values = tensor.flat<float>();
+  for (int i = 0; i < values.size(); i++) values(i) = -3.0f + 0.25f * i;
+
+  tensorflow::Tensor quantized;
+  ChunkData::QuantizedColumn column;
+  ASSERT_TRUE(QuantizeTensor(tensor, quantization, &quantized, &column));
+  EXPECT_EQ(quantized.dtype(), quantized_dtype);
+  EXPECT_EQ(quantized.shape(), tensor.shape());
+  EXPECT_EQ(column.quantization(), quantization);
+
+  tensorflow::Tensor dequantized;
+  ASSERT_TRUE(DequantizeTensor(quantized, column, &dequantized).ok());
+  test::ExpectTensorNear<float>(dequantized, tensor, abs_err);
+}
+
+TEST(TensorCompressionTest, QuantizeBfloat16) {
+  ExpectQuantizationRoundTrip(ChunkData::BFLOAT16, tensorflow::DT_BFLOAT16,
+                              0.02);
+}
+
+TEST(TensorCompressionTest, QuantizeFloat16) {
+  ExpectQuantizationRoundTrip(ChunkData::FLOAT16, tensorflow::DT_HALF, 0.002);
+}
+
+TEST(TensorCompressionTest, QuantizeUint8Affine) {
+  // The range is 7.75 so the step size is ~0.03.
+  ExpectQuantizationRoundTrip(ChunkData::UINT8_AFFINE, tensorflow::DT_UINT8,
+                              0.016);
+}
+
+TEST(TensorCompressionTest, QuantizeSkipsUnsupportedTensors) {
+  tensorflow::Tensor quantized;
+  ChunkData::QuantizedColumn column;
+
+  tensorflow::Tensor ints(tensorflow::DT_INT32, tensorflow::TensorShape({2}));
+  ints.flat<int>().setZero();
+  EXPECT_FALSE(
+      QuantizeTensor(ints, ChunkData::BFLOAT16, &quantized, &column));
+
+  tensorflow::Tensor floats(tensorflow::DT_FLOAT, tensorflow::TensorShape({2}));
+  floats.flat<float>()(0) = 1.0f;
+  floats.flat<float>()(1) = std::numeric_limits<float>::infinity();
+  EXPECT_FALSE(
+      QuantizeTensor(floats, ChunkData::NO_QUANTIZATION, &quantized, &column));
+  EXPECT_FALSE(
+      QuantizeTensor(floats, ChunkData::UINT8_AFFINE, &quantized, &column));
+  EXPECT_EQ(column.quantization(), ChunkData::NO_QUANTIZATION);
+}
+
+// Stores the content reversed so that a missing decompression is detected.
+class ReversingCodec : public TensorCodec {
+ public:
+  void Compress(absl::string_view input, std::string* output) const override {
+    output->assign(input.rbegin(), input.rend());
+  }
+
+  bool Uncompress(absl::string_view input, size_t output_size,
+                  char* output) const override {
+    if (input.size() != output_size) return false;
+    std::copy(input.rbegin(), input.rend(), output);
+    return true;
+  }
+};
+
+TEST(TensorCompressionTest, BuiltInCodecsAreRegistered) {
+  EXPECT_NE(GetTensorCodec(ChunkData::SNAPPY), nullptr);
+  EXPECT_NE(GetTensorCodec(ChunkData::NONE), nullptr);
+  EXPECT_EQ(GetTensorCodec(ChunkData::ZSTD), nullptr);
+}
+
+TEST(TensorCompressionTest, NoneCodecStoresRawContent) {
+  tensorflow::Tensor tensor(tensorflow::DT_INT32,
+                            tensorflow::TensorShape({2, 2}));
+  tensor.flat<int>().setRandom();
+
+  tensorflow::TensorProto proto;
+  CompressTensorAsProto(tensor, &proto, ChunkData::NONE);
+  EXPECT_EQ(proto.tensor_content(), tensor.tensor_data());
+
+  tensorflow::Tensor result = DecompressTensorFromProto(proto, ChunkData::NONE);
+  test::ExpectTensorEqual<int>(tensor, result);
+}
+
+TEST(TensorCompressionTest, AliasUncompressedTensorSharesContent) {
+  tensorflow::Tensor tensor(tensorflow::DT_INT32,
+                            tensorflow::TensorShape({16, 4}));
+  tensor.flat<int>().setRandom();
+
+  auto proto = std::make_shared<tensorflow::TensorProto>();
+  CompressTensorAsProto(tensor, proto.get(), ChunkData::NONE);
+  std::weak_ptr<tensorflow::TensorProto> weak_proto = proto;
+  const char* content = proto->tensor_content().data();
+
+  tensorflow::Tensor alias;
+  if (reinterpret_cast<uintptr_t>(content) % EIGEN_MAX_ALIGN_BYTES != 0) {
+    // The memory of the proto is not aligned as required by the tensor.
+    EXPECT_FALSE(AliasUncompressedTensor(*proto, ChunkData::NONE, proto,
+                                         &alias));
+    return;
+  }
+  ASSERT_TRUE(
+      AliasUncompressedTensor(*proto, ChunkData::NONE, proto, &alias));
+  EXPECT_EQ(alias.tensor_data().data(), content);
+  test::ExpectTensorEqual<int>(tensor, alias);
+
+  // The proto is kept alive by the tensor (and its slices).
+  proto = nullptr;
+  tensorflow::Tensor slice = alias.Slice(4, 8);
+  alias = tensorflow::Tensor();
+  EXPECT_FALSE(weak_proto.expired());
+  test::ExpectTensorEqual<int>(tensor.Slice(4, 8), slice);
+  slice = tensorflow::Tensor();
+  EXPECT_TRUE(weak_proto.expired());
+}
+
+TEST(TensorCompressionTest, AliasUncompressedTensorSkipsUnsupportedTensors) {
+  tensorflow::Tensor alias;
+
+  tensorflow::Tensor ints(tensorflow::DT_INT32, tensorflow::TensorShape({64}));
+  ints.flat<int>().setZero();
+  auto compressed = std::make_shared<tensorflow::TensorProto>();
+  CompressTensorAsProto(ints, compressed.get(), ChunkData::SNAPPY);
+  EXPECT_FALSE(AliasUncompressedTensor(*compressed, ChunkData::SNAPPY,
+                                       compressed, &alias));
+
+  tensorflow::Tensor strings(tensorflow::DT_STRING,
+                             tensorflow::TensorShape({2}));
+  strings.flat<tensorflow::tstring>()(0) = "hello";
+  strings.flat<tensorflow::tstring>()(1) = "world";
+  auto string_proto = std::make_shared<tensorflow::TensorProto>();
+  CompressTensorAsProto(strings, string_proto.get(), ChunkData::NONE);
+  EXPECT_FALSE(AliasUncompressedTensor(*string_proto, ChunkData::NONE,
+                                       string_proto, &alias));
+
+  EXPECT_FALSE(alias.IsInitialized());
+}
+
+TEST(TensorCompressionTest, RegisteredCodecCompressesAllTensors) {
+  RegisterTensorCodec(ChunkData::LZ4, absl::make_unique<ReversingCodec>());
+  ASSERT_NE(GetTensorCodec(ChunkData::LZ4), nullptr);
+
+  tensorflow::Tensor tensor(tensorflow::DT_INT32,
+                            tensorflow::TensorShape({2, 2}));
+  tensor.flat<int>().setRandom();
+  tensorflow::TensorProto proto;
+  CompressTensorAsProto(tensor, &proto, ChunkData::LZ4);
+  test::ExpectTensorEqual<int>(
+      tensor, DecompressTensorFromProto(proto, ChunkData::LZ4));
+
+  // String tensors are compressed as well.
+  tensorflow::Tensor strings(tensorflow::DT_STRING,
+                             tensorflow::TensorShape({2}));
+  strings.flat<tensorflow::tstring>()(0) = "hello";
+  strings.flat<tensorflow::tstring>()(1) = "world";
+  tensorflow::TensorProto string_proto;
+  CompressTensorAsProto(strings, &string_proto, ChunkData::LZ4);
+  tensorflow::TensorProto uncompressed;
+  strings.AsProtoTensorContent(&uncompressed);
+  EXPECT_NE(string_proto.tensor_content(), uncompressed.tensor_content());
+  test::ExpectTensorEqual<tensorflow::tstring>(
+      strings, DecompressTensorFromProto(string_proto, ChunkData::LZ4));
+}
+
+TEST(TensorCompressionTest, CompressTensorAsBlocksDecompressesRowRanges) {
+  tensorflow::Tensor tensor(tensorflow::DT_INT32,
+                            tensorflow::TensorShape({10, 3}));
+  auto values = tensor.flat<int>();
+  for (int i = 0; i < values.size(); i++) values(i) = i;
+
+  tensorflow::TensorProto proto;
+  ChunkData::CompressedBlocks blocks;
+  ASSERT_TRUE(
+      CompressTensorAsBlocks(tensor, 4, ChunkData::SNAPPY, &proto, &blocks));
+  EXPECT_EQ(blocks.rows_per_block(), 4);
+  EXPECT_EQ(blocks.block_ends_size(), 3);
+  EXPECT_EQ(blocks.block_ends(2), proto.tensor_content().size());
+
+  // Every range of rows, including ranges which start or end within a block.
+  for (int offset = 0; offset < 10; offset++) {
+    for (int length = 0; offset + length <= 10; length++) {
+      tensorflow::Tensor got(tensorflow::DT_INT32,
+                             tensorflow::TensorShape({length, 3}));
+      REVERB_ASSERT_OK(DecompressRowsIntoBuffer(
+          proto, ChunkData::SNAPPY, blocks, offset, length, &got));
+      test::ExpectTensorEqual<int>(
+          got, tensorflow::tensor::DeepCopy(
+                   tensor.Slice(offset, offset + length)));
+    }
+  }
+
+  tensorflow::Tensor too_small(tensorflow::DT_INT32,
+                               tensorflow::TensorShape({1, 3}));
+  EXPECT_EQ(DecompressRowsIntoBuffer(proto, ChunkData::SNAPPY, blocks, 0, 2,
+                                     &too_small)
+                .code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(DecompressRowsIntoBuffer(proto, ChunkData::SNAPPY, blocks, 9, 1,
+                                     &too_small)
+                .code(),
+            absl::StatusCode::kOk);
+  EXPECT_EQ(DecompressRowsIntoBuffer(proto, ChunkData::SNAPPY, blocks, 10, 1,
+                                     &too_small)
+                .code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+TEST(TensorCompressionTest, CompressTensorAsBlocksOnlyDecompressesCoveredBlocks) {
+  tensorflow::Tensor tensor(tensorflow::DT_INT32,
+                            tensorflow::TensorShape({6, 2}));
+  auto values = tensor.flat<int>();
+  for (int i = 0; i < values.size(); i++) values(i) = i;
+
+  tensorflow::TensorProto proto;
+  ChunkData::CompressedBlocks blocks;
+  ASSERT_TRUE(
+      CompressTensorAsBlocks(tensor, 2, ChunkData::NONE, &proto, &blocks));
+
+  // Overwrite the content of the first block. The rows of the remaining
+  // blocks are unaffected since the first block is never read.
+  (*proto.mutable_tensor_content())[0] = 42;
+  tensorflow::Tensor got(tensorflow::DT_INT32, tensorflow::TensorShape({3, 2}));
+  REVERB_ASSERT_OK(
+      DecompressRowsIntoBuffer(proto, ChunkData::NONE, blocks, 3, 3, &got));
+  test::ExpectTensorEqual<int>(got,
+                               tensorflow::tensor::DeepCopy(tensor.Slice(3, 6)));
+
+  REVERB_ASSERT_OK(
+      DecompressRowsIntoBuffer(proto, ChunkData::NONE, blocks, 0, 3, &got));
+  EXPECT_EQ(got.flat<int>()(0), 42);
+  EXPECT_EQ(got.flat<int>()(1), 1);
+}
+
+TEST(TensorCompressionTest, CompressTensorAsBlocksSkipsUnsupportedTensors) {
+  tensorflow::TensorProto proto;
+  ChunkData::CompressedBlocks blocks;
+
+  tensorflow::Tensor ints(tensorflow::DT_INT32, tensorflow::TensorShape({4}));
+  ints.flat<int>().setZero();
+  EXPECT_FALSE(
+      CompressTensorAsBlocks(ints, 0, ChunkData::SNAPPY, &proto, &blocks));
+  EXPECT_FALSE(
+      CompressTensorAsBlocks(ints, 4, ChunkData::SNAPPY, &proto, &blocks));
+
+  tensorflow::Tensor scalar(tensorflow::DT_INT32, tensorflow::TensorShape({}));
+  EXPECT_FALSE(
+      CompressTensorAsBlocks(scalar, 1, ChunkData::SNAPPY, &proto, &blocks));
+
+  tensorflow::Tensor strings(tensorflow::DT_STRING,
+                             tensorflow::TensorShape({4}));
+  EXPECT_FALSE(
+      CompressTensorAsBlocks(strings, 1, ChunkData::SNAPPY, &proto, &blocks));
+
+  EXPECT_EQ(blocks.block_ends_size(), 0);
+  EXPECT_FALSE(proto.has_tensor_shape());
+}
+
 }  // namespace
 }  // namespace reverb
 }  // namespace deepmind
@@ -0,0 +1,462 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/tools/load_generator.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <deque>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "grpcpp/support/channel_arguments.h"
+#include "absl/memory/memory.h"
+#include "absl/random/random.h"
+#include "absl/status/status.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/string_view.h"
+#include "absl/strings/strip.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/optional.h"
+#include "reverb/cc/client.h"
+#include "reverb/cc/platform/grpc_utils.h"
+#include "reverb/cc/platform/status_macros.h"
+#include "reverb/cc/platform/thread.h"
+#include "reverb/cc/reverb_service.grpc.pb.h"
+#include "reverb/cc/sampler.h"
+#include "reverb/cc/schema.pb.h"
+#include "reverb/cc/trajectory_writer.h"
+#include "tensorflow/core/framework/tensor.h"
+#include "tensorflow/core/framework/types.h"
+
+namespace deepmind {
+namespace reverb {
+namespace tools {
+namespace {
+
+// Each power of two is split into `kBucketsPerDoubling` buckets. The last
+// bucket holds everything above ~2^27 microseconds (~2 minutes).
+constexpr int kBucketsPerDoubling = 4;
+constexpr int kNumBuckets = 28 * kBucketsPerDoubling;
+
+// The key, probability, table size and priority which precede the columns
+// returned by `Sampler::GetNextTrajectory`.
+constexpr int kNumSampleInfoTensors = 4;
+
+int BucketIndex(absl::Duration latency) {
+  double us = absl::ToDoubleMicroseconds(latency);
+  if (us <= 1) return 0;
+  int index = static_cast<int>(std::ceil(kBucketsPerDoubling * std::log2(us)));
+  return std::min(index, kNumBuckets - 1);
+}
+
+absl::Duration BucketUpperBound(int index) {
+  return absl::Microseconds(
+      std::exp2(static_cast<double>(index) / kBucketsPerDoubling));
+}
+
+absl::Duration DecodeDurationProto(const google::protobuf::Duration& proto) {
+  return absl::Seconds(proto.seconds()) + absl::Nanoseconds(proto.nanos());
+}
+
+std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface> MakeStub(
+    const std::string& address) {
+  grpc::ChannelArguments arguments;
+  arguments.SetMaxReceiveMessageSize(-1);  // Unlimited.
+  arguments.SetMaxSendMessageSize(-1);     // Unlimited.
+  return /* grpc_gen:: */ReverbService::NewStub(
+      CreateCustomGrpcChannel(address, MakeChannelCredentials(), arguments));
+}
+
+// Sums the rate limiter wait times of `table` over all `stubs`.
+absl::Status GetRateLimiterWaitTimes(
+    const std::vector<std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface>>&
+        stubs,
+    const std::string& table, absl::Duration* insert_wait,
+    absl::Duration* sample_wait) {
+  *insert_wait = absl::ZeroDuration();
+  *sample_wait = absl::ZeroDuration();
+  for (const auto& stub : stubs) {
+    Client client(stub);
+    struct Client::ServerInfo info;
+    REVERB_RETURN_IF_ERROR(client.ServerInfo(absl::Seconds(30), &info));
+    auto it = std::find_if(
+        info.table_info.begin(), info.table_info.end(),
+        [&table](const TableInfo& t) { return t.name() == table; });
+    if (it == info.table_info.end()) {
+      return absl::NotFoundError(
+          absl::StrCat("Server does not have table ", table, "."));
+    }
+    const auto& limiter = it->rate_limiter_info();
+    *insert_wait +=
+        DecodeDurationProto(limiter.insert_stats().completed_wait_time()) +
+        DecodeDurationProto(limiter.insert_stats().pending_wait_time());
+    *sample_wait +=
+        DecodeDurationProto(limiter.sample_stats().completed_wait_time()) +
+        DecodeDurationProto(limiter.sample_stats().pending_wait_time());
+  }
+  return absl::OkStatus();
+}
+
+// Tensors of a single step filled with random bytes. The same step is appended
+// over and over again, so generating the data does not slow down the actors.
+std::vector<absl::optional<tensorflow::Tensor>> MakeStep(
+    const std::vector<ColumnSpec>& spec, int64_t* num_bytes) {
+  absl::BitGen gen;
+  std::vector<absl::optional<tensorflow::Tensor>> step;
+  *num_bytes = 0;
+  for (const auto& column : spec) {
+    tensorflow::Tensor tensor(column.dtype, column.shape);
+    char* data = const_cast<char*>(tensor.tensor_data().data());
+    for (size_t i = 0; i < tensor.TotalBytes(); i++) {
+      data[i] = absl::Uniform<unsigned char>(gen);
+    }
+    *num_bytes += tensor.TotalBytes();
+    step.push_back(std::move(tensor));
+  }
+  return step;
+}
+
+// State of an actor or learner thread. Only read by the main thread once the
+// worker thread has been joined.
+struct WorkerResult {
+  absl::Status status;
+  int64_t steps = 0;
+  int64_t items = 0;
+  int64_t bytes = 0;
+  LatencyHistogram append_latency;
+  LatencyHistogram insert_latency;
+  LatencyHistogram sample_latency;
+};
+
+void RunActor(const LoadGenerator::Options& options, TrajectoryWriter* writer,
+              const std::atomic<bool>* stop, WorkerResult* result) {
+  int64_t step_bytes;
+  auto step = MakeStep(options.step_spec, &step_bytes);
+
+  // The references of the last `sequence_length` steps, per column.
+  std::vector<std::deque<std::weak_ptr<CellRef>>> history(
+      options.step_spec.size());
+
+  auto run = [&]() -> absl::Status {
+    while (!stop->load()) {
+      for (auto& column : history) column.clear();
+
+      for (int i = 0; i < options.episode_length && !stop->load(); i++) {
+        std::vector<absl::optional<std::weak_ptr<CellRef>>> refs;
+        absl::Time start = absl::Now();
+        REVERB_RETURN_IF_ERROR(writer->Append(step, &refs));
+        result->append_latency.Record(absl::Now() - start);
+        result->steps++;
+        result->bytes += step_bytes;
+
+        for (int c = 0; c < history.size(); c++) {
+          history[c].push_back(refs[c].value());
+          if (history[c].size() > options.sequence_length) {
+            history[c].pop_front();
+          }
+        }
+
+        if (i + 1 < options.sequence_length ||
+            (i + 1 - options.sequence_length) % options.sequence_period != 0) {
+          continue;
+        }
+
+        std::vector<TrajectoryColumn> trajectory;
+        for (const auto& column : history) {
+          trajectory.emplace_back(
+              std::vector<std::weak_ptr<CellRef>>(column.begin(), column.end()),
+              /*squeeze=*/false);
+        }
+        start = absl::Now();
+        REVERB_RETURN_IF_ERROR(writer->CreateItem(options.table, 1.0,
+                                                  trajectory));
+        REVERB_RETURN_IF_ERROR(writer->Flush(options.max_in_flight_items));
+        result->insert_latency.Record(absl::Now() - start);
+        result->items++;
+      }
+      if (!stop->load()) {
+        REVERB_RETURN_IF_ERROR(writer->EndEpisode(/*clear_buffers=*/true));
+      }
+    }
+    return absl::OkStatus();
+  };
+
+  // Errors caused by the writer being closed at the end of the run are
+  // expected.
+  auto status = run();
+  if (!stop->load()) result->status = status;
+}
+
+void RunLearner(Sampler* sampler, const std::atomic<bool>* stop,
+                WorkerResult* result) {
+  std::vector<tensorflow::Tensor> data;
+  while (!stop->load()) {
+    absl::Time start = absl::Now();
+    auto status = sampler->GetNextTrajectory(&data);
+    if (!status.ok()) {
+      // Errors caused by the sampler being closed at the end of the run are
+      // expected.
+      if (!stop->load()) result->status = status;
+      return;
+    }
+    result->sample_latency.Record(absl::Now() - start);
+    result->items++;
+    for (int i = kNumSampleInfoTensors; i < data.size(); i++) {
+      result->bytes += data[i].TotalBytes();
+    }
+  }
+}
+
+std::string FormatRate(double count, absl::Duration elapsed) {
+  return absl::StrFormat("%.1f/s", count / absl::ToDoubleSeconds(elapsed));
+}
+
+}  // namespace
+
+LatencyHistogram::LatencyHistogram() : buckets_(kNumBuckets, 0) {}
+
+void LatencyHistogram::Record(absl::Duration latency) {
+  buckets_[BucketIndex(latency)]++;
+  count_++;
+  total_ += latency;
+  max_ = std::max(max_, latency);
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram& other) {
+  for (int i = 0; i < kNumBuckets; i++) {
+    buckets_[i] += other.buckets_[i];
+  }
+  count_ += other.count_;
+  total_ += other.total_;
+  max_ = std::max(max_, other.max_);
+}
+
+absl::Duration LatencyHistogram::mean() const {
+  return count_ == 0 ? absl::ZeroDuration() : total_ / count_;
+}
+
+absl::Duration LatencyHistogram::Percentile(double p) const {
+  if (count_ == 0) return absl::ZeroDuration();
+  auto rank = static_cast<int64_t>(std::ceil(p * count_));
+  int64_t seen = 0;
+  for (int i = 0; i < kNumBuckets; i++) {
+    seen += buckets_[i];
+    if (seen >= rank) return std::min(BucketUpperBound(i), max_);
+  }
+  return max_;
+}
+
+std::string LatencyHistogram::DebugString() const {
+  return absl::StrCat("count=", count_,
+                      " mean=", absl::FormatDuration(mean()),
+                      " p50=", absl::FormatDuration(Percentile(0.5)),
+                      " p90=", absl::FormatDuration(Percentile(0.9)),
+                      " p99=", absl::FormatDuration(Percentile(0.99)),
+                      " max=", absl::FormatDuration(max_));
+}
+
+absl::Status ParseColumnSpecs(absl::string_view text,
+                              std::vector<ColumnSpec>* specs) {
+  specs->clear();
+  // Commas separate both the columns and the dimensions so the columns are
+  // split on the closing brackets.
+  for (absl::string_view part : absl::StrSplit(text, ']', absl::SkipEmpty())) {
+    part = absl::StripPrefix(part, ",");
+    if (part.find('[') == absl::string_view::npos) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Column spec '", part, "' must be of the form dtype[dims]."));
+    }
+    std::pair<absl::string_view, absl::string_view> dtype_and_dims =
+        absl::StrSplit(part, absl::MaxSplits('[', 1));
+
+    ColumnSpec spec;
+    if (!tensorflow::DataTypeFromString(dtype_and_dims.first, &spec.dtype) ||
+        !tensorflow::DataTypeCanUseMemcpy(spec.dtype)) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Unsupported dtype '", dtype_and_dims.first,
+                       "'. The dtype must have a fixed size."));
+    }
+    for (absl::string_view dim :
+         absl::StrSplit(dtype_and_dims.second, ',', absl::SkipEmpty())) {
+      int64_t size;
+      if (!absl::SimpleAtoi(dim, &size) || size < 0) {
+        return absl::InvalidArgumentError(absl::StrCat(
+            "Invalid dimension '", dim, "' in column spec '", part, "]'."));
+      }
+      spec.shape.AddDim(size);
+    }
+    specs->push_back(std::move(spec));
+  }
+  if (specs->empty()) {
+    return absl::InvalidArgumentError("At least one column must be specified.");
+  }
+  return absl::OkStatus();
+}
+
+absl::Status LoadGenerator::Options::Validate() const {
+  if (server_addresses.empty()) {
+    return absl::InvalidArgumentError(
+        "At least one server address must be specified.");
+  }
+  if (table.empty()) {
+    return absl::InvalidArgumentError("table must be specified.");
+  }
+  if (step_spec.empty()) {
+    return absl::InvalidArgumentError("step_spec must not be empty.");
+  }
+  if (num_actors < 0 || num_learners < 0) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "num_actors (", num_actors, ") and num_learners (", num_learners,
+        ") must not be negative."));
+  }
+  if (sequence_length < 1 || sequence_period < 1 ||
+      episode_length < sequence_length) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "sequence_length (", sequence_length, ") and sequence_period (",
+        sequence_period, ") must be >= 1 and episode_length (", episode_length,
+        ") must be >= sequence_length."));
+  }
+  if (max_in_flight_items < 0) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "max_in_flight_items (", max_in_flight_items,
+        ") must not be negative."));
+  }
+  if (duration <= absl::ZeroDuration()) {
+    return absl::InvalidArgumentError("duration must be positive.");
+  }
+  TrajectoryWriter::Options writer = writer_options;
+  writer.num_keep_alive_refs =
+      std::max(writer.num_keep_alive_refs, sequence_length);
+  REVERB_RETURN_IF_ERROR(writer.Validate());
+  return sampler_options.Validate();
+}
+
+absl::Status LoadGenerator::Run(const Options& options, Report* report) {
+  REVERB_RETURN_IF_ERROR(options.Validate());
+  *report = Report();
+
+  std::vector<std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface>>
+      stubs;
+  for (const auto& address : options.server_addresses) {
+    stubs.push_back(MakeStub(address));
+  }
+
+  absl::Duration insert_wait_before;
+  absl::Duration sample_wait_before;
+  REVERB_RETURN_IF_ERROR(GetRateLimiterWaitTimes(
+      stubs, options.table, &insert_wait_before, &sample_wait_before));
+
+  TrajectoryWriter::Options writer_options = options.writer_options;
+  writer_options.num_keep_alive_refs =
+      std::max(writer_options.num_keep_alive_refs, options.sequence_length);
+
+  std::vector<std::unique_ptr<TrajectoryWriter>> writers;
+  for (int i = 0; i < options.num_actors; i++) {
+    writers.push_back(absl::make_unique<TrajectoryWriter>(
+        stubs[i % stubs.size()], writer_options));
+  }
+  std::vector<std::unique_ptr<Sampler>> samplers;
+  for (int i = 0; i < options.num_learners; i++) {
+    samplers.push_back(absl::make_unique<Sampler>(
+        stubs[i % stubs.size()], options.table, options.sampler_options));
+  }
+
+  std::atomic<bool> stop(false);
+  std::vector<WorkerResult> actors(options.num_actors);
+  std::vector<WorkerResult> learners(options.num_learners);
+  std::vector<std::unique_ptr<internal::Thread>> threads;
+
+  absl::Time start = absl::Now();
+  for (int i = 0; i < options.num_actors; i++) {
+    threads.push_back(internal::StartThread(
+        absl::StrCat("LoadGeneratorActor_", i),
+        [&options, writer = writers[i].get(), &stop, result = &actors[i]] {
+          RunActor(options, writer, &stop, result);
+        }));
+  }
+  for (int i = 0; i < options.num_learners; i++) {
+    threads.push_back(internal::StartThread(
+        absl::StrCat("LoadGeneratorLearner_", i),
+        [sampler = samplers[i].get(), &stop, result = &learners[i]] {
+          RunLearner(sampler, &stop, result);
+        }));
+  }
+
+  absl::SleepFor(options.duration);
+
+  // Closing the writers and samplers unblocks the workers which are waiting
+  // for the rate limiters.
+  stop.store(true);
+  for (auto& writer : writers) writer->Close();
+  for (auto& sampler : samplers) sampler->Close();
+  threads.clear();  // Joins the threads.
+  report->elapsed = absl::Now() - start;
+
+  for (const auto& actor : actors) {
+    REVERB_RETURN_IF_ERROR(actor.status);
+    report->steps_written += actor.steps;
+    report->items_written += actor.items;
+    report->bytes_written += actor.bytes;
+    report->append_latency.Merge(actor.append_latency);
+    report->insert_latency.Merge(actor.insert_latency);
+  }
+  for (const auto& learner : learners) {
+    REVERB_RETURN_IF_ERROR(learner.status);
+    report->items_sampled += learner.items;
+    report->bytes_sampled += learner.bytes;
+    report->sample_latency.Merge(learner.sample_latency);
+  }
+
+  absl::Duration insert_wait_after;
+  absl::Duration sample_wait_after;
+  REVERB_RETURN_IF_ERROR(GetRateLimiterWaitTimes(
+      stubs, options.table, &insert_wait_after, &sample_wait_after));
+  report->insert_rate_limiter_wait = insert_wait_after - insert_wait_before;
+  report->sample_rate_limiter_wait = sample_wait_after - sample_wait_before;
+  return absl::OkStatus();
+}
+
+std::string LoadGenerator::Report::DebugString() const {
+  return absl::StrCat(
+      "elapsed: ", absl::FormatDuration(elapsed), "\n",
+      "steps written: ", steps_written, " (",
+      FormatRate(steps_written, elapsed), ")\n",
+      "items written: ", items_written, " (",
+      FormatRate(items_written, elapsed), ")\n",
+      "bytes written: ", bytes_written, " (",
+      FormatRate(bytes_written, elapsed), ")\n",
+      "items sampled: ", items_sampled, " (",
+      FormatRate(items_sampled, elapsed), ")\n",
+      "bytes sampled: ", bytes_sampled, " (",
+      FormatRate(bytes_sampled, elapsed), ")\n",
+      "append latency: ", append_latency.DebugString(), "\n",
+      "insert latency: ", insert_latency.DebugString(), "\n",
+      "sample latency: ", sample_latency.DebugString(), "\n",
+      "insert rate limiter wait: ",
+      absl::FormatDuration(insert_rate_limiter_wait), "\n",
+      "sample rate limiter wait: ",
+      absl::FormatDuration(sample_rate_limiter_wait), "\n");
+}
+
+}  // namespace tools
+}  // namespace reverb
+}  // namespace deepmind
@@ -0,0 +1,172 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_TOOLS_LOAD_GENERATOR_H_
+#define REVERB_CC_TOOLS_LOAD_GENERATOR_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/time.h"
+#include "reverb/cc/sampler.h"
+#include "reverb/cc/trajectory_writer.h"
+#include "tensorflow/core/framework/tensor_shape.h"
+#include "tensorflow/core/framework/types.pb.h"
+
+namespace deepmind {
+namespace reverb {
+namespace tools {
+
+// Histogram of latencies with exponentially growing buckets. Each power of two
+// is split into four buckets, starting at one microsecond, so percentiles are
+// reported with an error of at most ~19%. Not thread-safe; each thread is
+// expected to record into its own histogram and `Merge` them at the end.
+class LatencyHistogram {
+ public:
+  LatencyHistogram();
+
+  void Record(absl::Duration latency);
+
+  // Adds the latencies recorded by `other`.
+  void Merge(const LatencyHistogram& other);
+
+  int64_t count() const { return count_; }
+  absl::Duration mean() const;
+  absl::Duration max() const { return max_; }
+
+  // Upper bound of the bucket which holds the `p` quantile, where `p` is in
+  // (0, 1]. Never larger than `max()`. Returns zero if nothing has been
+  // recorded.
+  absl::Duration Percentile(double p) const;
+
+  // Count, mean, p50, p90, p99 and max on a single line.
+  std::string DebugString() const;
+
+ private:
+  std::vector<int64_t> buckets_;
+  int64_t count_ = 0;
+  absl::Duration total_ = absl::ZeroDuration();
+  absl::Duration max_ = absl::ZeroDuration();
+};
+
+// Dtype and shape of one column of the synthetic steps.
+struct ColumnSpec {
+  tensorflow::DataType dtype;
+  tensorflow::TensorShape shape;
+};
+
+// Parses a comma separated list of column specs of the form `dtype[dims]`
+// (e.g. "uint8[84,84,4],float[],int32[18]"). The dtypes are named as by
+// `tensorflow::DataTypeString` and must have a fixed size (i.e. no strings).
+absl::Status ParseColumnSpecs(absl::string_view text,
+                              std::vector<ColumnSpec>* specs);
+
+// Drives synthetic actors and learners against one or more running servers,
+// which all must hold `Options::table`.
+//
+// Actors write episodes of `episode_length` steps with a `TrajectoryWriter` and
+// create an item of the last `sequence_length` steps every `sequence_period`
+// steps. Learners sample the items with a `Sampler`. The actors and learners
+// are assigned to the servers round robin and always connect over gRPC, even
+// if a server is running in the same process.
+class LoadGenerator {
+ public:
+  struct Options {
+    // Addresses of the servers, e.g. "localhost:8000".
+    std::vector<std::string> server_addresses;
+
+    // Table which the items are written to and sampled from.
+    std::string table;
+
+    // Columns of every step. All columns are set in every step.
+    std::vector<ColumnSpec> step_spec;
+
+    // Number of actor threads, each with its own `TrajectoryWriter`.
+    int num_actors = 1;
+
+    // Number of steps before each actor ends its episode.
+    int episode_length = 100;
+
+    // Number of steps in each item.
+    int sequence_length = 10;
+
+    // Number of steps between the creation of two items.
+    int sequence_period = 1;
+
+    // Maximum number of unconfirmed items per actor (see
+    // `TrajectoryWriter::Flush`).
+    int max_in_flight_items = 10;
+
+    // Options of the writers. `num_keep_alive_refs` is raised to
+    // `sequence_length` if smaller.
+    TrajectoryWriter::Options writer_options = {/*max_chunk_length=*/10,
+                                                /*num_keep_alive_refs=*/10};
+
+    // Number of learner threads, each with its own `Sampler`.
+    int num_learners = 1;
+
+    // Options of the samplers.
+    Sampler::Options sampler_options;
+
+    // Time after which the actors and learners are stopped.
+    absl::Duration duration = absl::Seconds(60);
+
+    absl::Status Validate() const;
+  };
+
+  struct Report {
+    // Time from when the actors and learners were started until the last of
+    // them stopped.
+    absl::Duration elapsed;
+
+    int64_t steps_written = 0;
+    int64_t items_written = 0;
+    int64_t bytes_written = 0;
+    int64_t items_sampled = 0;
+    int64_t bytes_sampled = 0;
+
+    // Latency of `TrajectoryWriter::Append`.
+    LatencyHistogram append_latency;
+
+    // Latency of `TrajectoryWriter::CreateItem` followed by the `Flush` which
+    // bounds the number of items in flight. This is where the actors block
+    // when the rate limiter holds back inserts.
+    LatencyHistogram insert_latency;
+
+    // Latency of `Sampler::GetNextTrajectory`.
+    LatencyHistogram sample_latency;
+
+    // Time which inserts and samples spent blocked by the rate limiters during
+    // the run, summed over the servers. Taken from the `RateLimiterInfo` of
+    // the table before and after the run.
+    absl::Duration insert_rate_limiter_wait;
+    absl::Duration sample_rate_limiter_wait;
+
+    // Human readable summary with throughputs per second.
+    std::string DebugString() const;
+  };
+
+  // Runs the actors and learners for `options.duration`. Returns the first
+  // error encountered by any of them, in which case `report` is incomplete.
+  static absl::Status Run(const Options& options, Report* report);
+};
+
+}  // namespace tools
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_TOOLS_LOAD_GENERATOR_H_
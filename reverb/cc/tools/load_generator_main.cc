@@ -0,0 +1,170 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Generates synthetic load against one or more replay servers and prints the
+// throughput, latencies and rate limiter wait times. For example, to run 64
+// actors and 4 learners against two servers for 5 minutes:
+//
+//   bazel run -c opt //reverb/cc/tools:load_generator_main -- \
+//     --servers=host1:8000,host2:8000 --table=replay \
+//     --step_spec='uint8[84,84,4],float[],int32[]' \
+//     --num_actors=64 --num_learners=4 --duration=5m
+//
+// If no servers are given then a server with a single table, configured by
+// the `--local_*` flags, is started in the process. The actors and learners
+// still connect to it over gRPC.
+
+#include <cfloat>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "absl/time/time.h"
+#include "reverb/cc/platform/net.h"
+#include "reverb/cc/platform/server.h"
+#include "reverb/cc/platform/status_macros.h"
+#include "reverb/cc/rate_limiter.h"
+#include "reverb/cc/selectors/fifo.h"
+#include "reverb/cc/selectors/interface.h"
+#include "reverb/cc/selectors/prioritized.h"
+#include "reverb/cc/selectors/uniform.h"
+#include "reverb/cc/table.h"
+#include "reverb/cc/tools/load_generator.h"
+
+ABSL_FLAG(std::vector<std::string>, servers, {},
+          "Comma separated addresses of the servers. If empty then a local "
+          "server is started.");
+ABSL_FLAG(std::string, table, "replay", "Table to write to and sample from.");
+ABSL_FLAG(std::string, step_spec, "uint8[84,84,4],float[],int32[]",
+          "Comma separated dtype[dims] of the columns of every step.");
+ABSL_FLAG(int, num_actors, 1, "Number of actors.");
+ABSL_FLAG(int, num_learners, 1, "Number of learners.");
+ABSL_FLAG(int, episode_length, 100, "Number of steps per episode.");
+ABSL_FLAG(int, sequence_length, 10, "Number of steps per item.");
+ABSL_FLAG(int, sequence_period, 1, "Number of steps between items.");
+ABSL_FLAG(int, max_in_flight_items, 10,
+          "Maximum number of unconfirmed items per actor.");
+ABSL_FLAG(int, chunk_length, 10, "Number of steps per chunk.");
+ABSL_FLAG(int, sampler_workers, 1, "Number of workers per sampler.");
+ABSL_FLAG(int, max_in_flight_samples_per_worker, 100,
+          "Number of samples requested by a sampler worker at a time.");
+ABSL_FLAG(absl::Duration, duration, absl::Seconds(60),
+          "How long to generate load for.");
+
+ABSL_FLAG(std::string, local_selector, "uniform",
+          "Sampler of the local table: uniform, prioritized or fifo.");
+ABSL_FLAG(int64_t, local_max_size, 1000000,
+          "Maximum number of items in the local table.");
+ABSL_FLAG(double, local_samples_per_insert, 1.0,
+          "Samples per insert of the local rate limiter.");
+ABSL_FLAG(int64_t, local_min_size_to_sample, 1000,
+          "Minimum number of items in the local table before sampling.");
+ABSL_FLAG(double, local_error_buffer, -1,
+          "Allowed deviation from samples_per_insert of the local rate "
+          "limiter. Negative values disable the limit.");
+
+namespace deepmind {
+namespace reverb {
+namespace tools {
+namespace {
+
+absl::Status StartLocalServer(const std::string& table_name,
+                              std::unique_ptr<Server>* server,
+                              std::string* address) {
+  std::shared_ptr<ItemSelector> sampler;
+  const std::string selector = absl::GetFlag(FLAGS_local_selector);
+  if (selector == "uniform") {
+    sampler = std::make_shared<UniformSelector>();
+  } else if (selector == "prioritized") {
+    sampler = std::make_shared<PrioritizedSelector>(0.8);
+  } else if (selector == "fifo") {
+    sampler = std::make_shared<FifoSelector>();
+  } else {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Unknown selector '", selector, "'."));
+  }
+
+  const double samples_per_insert =
+      absl::GetFlag(FLAGS_local_samples_per_insert);
+  const int64_t min_size = absl::GetFlag(FLAGS_local_min_size_to_sample);
+  const double error_buffer = absl::GetFlag(FLAGS_local_error_buffer);
+  double min_diff = -DBL_MAX;
+  double max_diff = DBL_MAX;
+  if (error_buffer >= 0) {
+    min_diff = samples_per_insert * min_size - error_buffer;
+    max_diff = samples_per_insert * min_size + error_buffer;
+  }
+
+  auto table = std::make_shared<Table>(
+      table_name, std::move(sampler), std::make_shared<FifoSelector>(),
+      absl::GetFlag(FLAGS_local_max_size), /*max_times_sampled=*/0,
+      std::make_shared<RateLimiter>(samples_per_insert, min_size, min_diff,
+                                    max_diff));
+  int port = internal::PickUnusedPortOrDie();
+  REVERB_RETURN_IF_ERROR(
+      StartServer({std::move(table)}, port, /*checkpointer=*/nullptr, server));
+  *address = absl::StrCat("localhost:", port);
+  return absl::OkStatus();
+}
+
+absl::Status Main() {
+  LoadGenerator::Options options;
+  options.server_addresses = absl::GetFlag(FLAGS_servers);
+  options.table = absl::GetFlag(FLAGS_table);
+  REVERB_RETURN_IF_ERROR(
+      ParseColumnSpecs(absl::GetFlag(FLAGS_step_spec), &options.step_spec));
+  options.num_actors = absl::GetFlag(FLAGS_num_actors);
+  options.num_learners = absl::GetFlag(FLAGS_num_learners);
+  options.episode_length = absl::GetFlag(FLAGS_episode_length);
+  options.sequence_length = absl::GetFlag(FLAGS_sequence_length);
+  options.sequence_period = absl::GetFlag(FLAGS_sequence_period);
+  options.max_in_flight_items = absl::GetFlag(FLAGS_max_in_flight_items);
+  options.writer_options.max_chunk_length = absl::GetFlag(FLAGS_chunk_length);
+  options.sampler_options.num_workers = absl::GetFlag(FLAGS_sampler_workers);
+  options.sampler_options.max_in_flight_samples_per_worker =
+      absl::GetFlag(FLAGS_max_in_flight_samples_per_worker);
+  options.duration = absl::GetFlag(FLAGS_duration);
+
+  std::unique_ptr<Server> server;
+  if (options.server_addresses.empty()) {
+    std::string address;
+    REVERB_RETURN_IF_ERROR(StartLocalServer(options.table, &server, &address));
+    options.server_addresses.push_back(std::move(address));
+  }
+
+  LoadGenerator::Report report;
+  REVERB_RETURN_IF_ERROR(LoadGenerator::Run(options, &report));
+  std::cout << report.DebugString();
+  return absl::OkStatus();
+}
+
+}  // namespace
+}  // namespace tools
+}  // namespace reverb
+}  // namespace deepmind
+
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+  auto status = deepmind::reverb::tools::Main();
+  if (!status.ok()) {
+    std::cerr << status << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,184 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/tools/load_generator.h"
+
+#include <cfloat>
+#include <memory>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "absl/time/time.h"
+#include "reverb/cc/platform/net.h"
+#include "reverb/cc/platform/server.h"
+#include "reverb/cc/platform/status_matchers.h"
+#include "reverb/cc/rate_limiter.h"
+#include "reverb/cc/selectors/fifo.h"
+#include "reverb/cc/selectors/uniform.h"
+#include "reverb/cc/table.h"
+#include "tensorflow/core/framework/tensor_shape.h"
+#include "tensorflow/core/framework/types.pb.h"
+
+namespace deepmind {
+namespace reverb {
+namespace tools {
+namespace {
+
+TEST(LatencyHistogramTest, EmptyHistogram) {
+  LatencyHistogram histogram;
+  EXPECT_EQ(histogram.count(), 0);
+  EXPECT_EQ(histogram.mean(), absl::ZeroDuration());
+  EXPECT_EQ(histogram.Percentile(0.5), absl::ZeroDuration());
+}
+
+TEST(LatencyHistogramTest, PercentilesAreWithinBucketError) {
+  LatencyHistogram histogram;
+  for (int i = 1; i <= 1000; i++) {
+    histogram.Record(absl::Microseconds(i));
+  }
+  EXPECT_EQ(histogram.count(), 1000);
+  EXPECT_EQ(histogram.max(), absl::Microseconds(1000));
+  EXPECT_EQ(histogram.mean(), absl::Nanoseconds(500500));
+
+  auto expect_near = [](absl::Duration actual, absl::Duration expected) {
+    EXPECT_GE(actual, expected);
+    EXPECT_LE(actual, expected * 1.2);
+  };
+  expect_near(histogram.Percentile(0.5), absl::Microseconds(500));
+  expect_near(histogram.Percentile(0.9), absl::Microseconds(900));
+  EXPECT_LE(histogram.Percentile(0.999), histogram.max());
+}
+
+TEST(LatencyHistogramTest, Merge) {
+  LatencyHistogram a;
+  LatencyHistogram b;
+  a.Record(absl::Microseconds(10));
+  b.Record(absl::Milliseconds(10));
+  a.Merge(b);
+  EXPECT_EQ(a.count(), 2);
+  EXPECT_EQ(a.max(), absl::Milliseconds(10));
+  EXPECT_LE(a.Percentile(0.5), absl::Microseconds(12));
+}
+
+TEST(ParseColumnSpecsTest, ParsesDtypesAndShapes) {
+  std::vector<ColumnSpec> specs;
+  REVERB_ASSERT_OK(
+      ParseColumnSpecs("uint8[84,84,4],float[],int32[18]", &specs));
+  ASSERT_EQ(specs.size(), 3);
+  EXPECT_EQ(specs[0].dtype, tensorflow::DT_UINT8);
+  EXPECT_EQ(specs[0].shape, tensorflow::TensorShape({84, 84, 4}));
+  EXPECT_EQ(specs[1].dtype, tensorflow::DT_FLOAT);
+  EXPECT_EQ(specs[1].shape, tensorflow::TensorShape({}));
+  EXPECT_EQ(specs[2].dtype, tensorflow::DT_INT32);
+  EXPECT_EQ(specs[2].shape, tensorflow::TensorShape({18}));
+}
+
+TEST(ParseColumnSpecsTest, RejectsInvalidSpecs) {
+  std::vector<ColumnSpec> specs;
+  EXPECT_EQ(ParseColumnSpecs("", &specs).code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(ParseColumnSpecs("float", &specs).code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(ParseColumnSpecs("string[]", &specs).code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(ParseColumnSpecs("not_a_dtype[]", &specs).code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(ParseColumnSpecs("float[2,x]", &specs).code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+LoadGenerator::Options MakeOptions() {
+  LoadGenerator::Options options;
+  options.server_addresses = {"localhost:1234"};
+  options.table = "dist";
+  options.step_spec = {{tensorflow::DT_FLOAT, tensorflow::TensorShape({4})}};
+  options.episode_length = 10;
+  options.sequence_length = 3;
+  options.duration = absl::Milliseconds(500);
+  return options;
+}
+
+TEST(LoadGeneratorTest, ValidateOptions) {
+  REVERB_EXPECT_OK(MakeOptions().Validate());
+
+  auto options = MakeOptions();
+  options.server_addresses.clear();
+  EXPECT_EQ(options.Validate().code(), absl::StatusCode::kInvalidArgument);
+
+  options = MakeOptions();
+  options.sequence_length = 11;
+  EXPECT_EQ(options.Validate().code(), absl::StatusCode::kInvalidArgument);
+
+  options = MakeOptions();
+  options.step_spec.clear();
+  EXPECT_EQ(options.Validate().code(), absl::StatusCode::kInvalidArgument);
+
+  options = MakeOptions();
+  options.duration = absl::ZeroDuration();
+  EXPECT_EQ(options.Validate().code(), absl::StatusCode::kInvalidArgument);
+}
+
+TEST(LoadGeneratorTest, RunsActorsAndLearners) {
+  int port = internal::PickUnusedPortOrDie();
+  std::unique_ptr<Server> server;
+  REVERB_ASSERT_OK(StartServer(
+      {std::make_shared<Table>(
+          "dist", std::make_shared<UniformSelector>(),
+          std::make_shared<FifoSelector>(), /*max_size=*/1000,
+          /*max_times_sampled=*/0,
+          std::make_shared<RateLimiter>(1.0, 1, -DBL_MAX, DBL_MAX))},
+      port, /*checkpointer=*/nullptr, &server));
+
+  auto options = MakeOptions();
+  options.server_addresses = {absl::StrCat("localhost:", port)};
+  options.num_actors = 2;
+  options.num_learners = 1;
+
+  LoadGenerator::Report report;
+  REVERB_ASSERT_OK(LoadGenerator::Run(options, &report));
+  EXPECT_GE(report.elapsed, options.duration);
+  EXPECT_GT(report.steps_written, 0);
+  EXPECT_GT(report.items_written, 0);
+  EXPECT_EQ(report.bytes_written, report.steps_written * 4 * sizeof(float));
+  EXPECT_GT(report.items_sampled, 0);
+  EXPECT_EQ(report.bytes_sampled,
+            report.items_sampled * options.sequence_length * 4 * sizeof(float));
+  EXPECT_EQ(report.append_latency.count(), report.steps_written);
+  EXPECT_EQ(report.insert_latency.count(), report.items_written);
+  EXPECT_EQ(report.sample_latency.count(), report.items_sampled);
+  EXPECT_GE(report.insert_rate_limiter_wait, absl::ZeroDuration());
+  EXPECT_GE(report.sample_rate_limiter_wait, absl::ZeroDuration());
+}
+
+TEST(LoadGeneratorTest, FailsIfTableIsMissing) {
+  int port = internal::PickUnusedPortOrDie();
+  std::unique_ptr<Server> server;
+  REVERB_ASSERT_OK(StartServer(/*tables=*/{}, port, /*checkpointer=*/nullptr,
+                               &server));
+
+  auto options = MakeOptions();
+  options.server_addresses = {absl::StrCat("localhost:", port)};
+
+  LoadGenerator::Report report;
+  EXPECT_EQ(LoadGenerator::Run(options, &report).code(),
+            absl::StatusCode::kNotFound);
+}
+
+}  // namespace
+}  // namespace tools
+}  // namespace reverb
+}  // namespace deepmind
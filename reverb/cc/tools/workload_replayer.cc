@@ -0,0 +1,501 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "reverb/cc/tools/workload_replayer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "grpcpp/grpcpp.h"
+#include "absl/random/random.h"
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/optional.h"
+#include "reverb/cc/platform/grpc_utils.h"
+#include "reverb/cc/platform/hash_map.h"
+#include "reverb/cc/platform/status_macros.h"
+#include "reverb/cc/platform/thread.h"
+#include "reverb/cc/rate_limiter.h"
+#include "reverb/cc/reverb_service.grpc.pb.h"
+#include "reverb/cc/reverb_service.pb.h"
+#include "reverb/cc/schema.pb.h"
+#include "reverb/cc/selectors/fifo.h"
+#include "reverb/cc/selectors/heap.h"
+#include "reverb/cc/selectors/interface.h"
+#include "reverb/cc/selectors/lifo.h"
+#include "reverb/cc/selectors/prioritized.h"
+#include "reverb/cc/selectors/rank_based.h"
+#include "reverb/cc/selectors/reservoir.h"
+#include "reverb/cc/selectors/uniform.h"
+#include "reverb/cc/support/grpc_util.h"
+#include "reverb/cc/tensor_compression.h"
+#include "tensorflow/core/framework/tensor.h"
+#include "tensorflow/core/framework/tensor_shape.h"
+
+namespace deepmind {
+namespace reverb {
+namespace tools {
+namespace {
+
+using Stub = /* grpc_gen:: */ReverbService::StubInterface;
+
+std::shared_ptr<Stub> MakeStub(const std::string& address) {
+  grpc::ChannelArguments arguments;
+  arguments.SetMaxReceiveMessageSize(-1);  // Unlimited.
+  arguments.SetMaxSendMessageSize(-1);     // Unlimited.
+  return /* grpc_gen:: */ReverbService::NewStub(
+      CreateCustomGrpcChannel(address, MakeChannelCredentials(), arguments));
+}
+
+absl::Status MakeSelector(const KeyDistributionOptions& options,
+                          std::shared_ptr<ItemSelector>* selector) {
+  switch (options.distribution_case()) {
+    case KeyDistributionOptions::kFifo:
+      *selector = std::make_shared<FifoSelector>();
+      return absl::OkStatus();
+    case KeyDistributionOptions::kLifo:
+      *selector = std::make_shared<LifoSelector>();
+      return absl::OkStatus();
+    case KeyDistributionOptions::kUniform:
+      *selector = std::make_shared<UniformSelector>();
+      return absl::OkStatus();
+    case KeyDistributionOptions::kPrioritized:
+      *selector = std::make_shared<PrioritizedSelector>(
+          options.prioritized().priority_exponent());
+      return absl::OkStatus();
+    case KeyDistributionOptions::kHeap:
+      *selector = std::make_shared<HeapSelector>(options.heap().min_heap());
+      return absl::OkStatus();
+    case KeyDistributionOptions::kRankBased:
+      *selector = std::make_shared<RankBasedSelector>(
+          options.rank_based().priority_exponent());
+      return absl::OkStatus();
+    case KeyDistributionOptions::kReservoir:
+      *selector = std::make_shared<ReservoirSelector>(
+          options.reservoir().num_inserted());
+      return absl::OkStatus();
+    default:
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Unsupported selector: ", options.ShortDebugString()));
+  }
+}
+
+// State of a replayed stream. Only read by the main thread once the stream
+// thread has been joined.
+struct StreamResult {
+  absl::Status status;
+  int64_t chunks = 0;
+  int64_t bytes = 0;
+  int64_t items = 0;
+  int64_t items_skipped = 0;
+  int64_t sample_requests = 0;
+  int64_t samples = 0;
+  int64_t unary_calls = 0;
+  LatencyHistogram insert_latency;
+  LatencyHistogram sample_latency;
+  LatencyHistogram unary_latency;
+  absl::Duration max_lag = absl::ZeroDuration();
+};
+
+// Maps the recorded offsets of the events to the time they are replayed at.
+class Schedule {
+ public:
+  Schedule(absl::Time start, double speed) : start_(start), speed_(speed) {}
+
+  // Blocks until it is time to send `event`. Records the lag in `result` if
+  // the replay is behind.
+  void WaitFor(const WorkloadTraceEvent& event, StreamResult* result) const {
+    if (speed_ == 0) return;
+    absl::Time at = start_ + absl::Microseconds(event.offset_us()) / speed_;
+    absl::Time now = absl::Now();
+    if (now < at) {
+      absl::SleepFor(at - now);
+    } else {
+      result->max_lag = std::max(result->max_lag, now - at);
+    }
+  }
+
+ private:
+  const absl::Time start_;
+  const double speed_;
+};
+
+// Fills `chunk` with a single uncompressed column of random bytes, shaped to
+// match the recorded number of steps and size. `noise` holds the random bytes
+// and is grown as required.
+void MakeChunk(const WorkloadTraceEvent::Chunk& recorded, std::string* noise,
+               ChunkData* chunk) {
+  const int64_t num_rows = std::max<int64_t>(recorded.num_rows(), 1);
+  const int64_t row_bytes =
+      std::max<int64_t>(recorded.num_bytes() / num_rows, 1);
+  tensorflow::Tensor tensor(tensorflow::DT_UINT8,
+                            tensorflow::TensorShape({num_rows, row_bytes}));
+  const size_t size = tensor.TotalBytes();
+  if (noise->size() < size) {
+    absl::BitGen gen;
+    while (noise->size() < size) {
+      noise->push_back(absl::Uniform<unsigned char>(gen));
+    }
+  }
+  std::memcpy(const_cast<char*>(tensor.tensor_data().data()), noise->data(),
+              size);
+
+  chunk->set_chunk_key(recorded.chunk_key());
+  chunk->mutable_sequence_range()->set_episode_id(recorded.chunk_key());
+  chunk->mutable_sequence_range()->set_start(0);
+  chunk->mutable_sequence_range()->set_end(num_rows - 1);
+  chunk->set_codec(ChunkData::NONE);
+  CompressTensorAsProto(tensor, chunk->mutable_data()->add_tensors(),
+                        ChunkData::NONE);
+}
+
+// Converts a recorded item into a request which references the synthetic
+// chunks held by the stream (`held`, by number of rows), and applies the
+// releases of the item to `held`. Returns false, and leaves `held` as is, if
+// the item references a chunk which the stream does not hold.
+bool MakeItem(const WorkloadTraceEvent::Item& recorded,
+              internal::flat_hash_map<uint64_t, int64_t>* held,
+              InsertStreamRequest* request) {
+  auto* insertion = request->mutable_item();
+  auto* item = insertion->mutable_item();
+  item->set_key(recorded.key());
+  item->set_table(recorded.table());
+  item->set_priority(recorded.priority());
+  auto* column = item->mutable_flat_trajectory()->add_columns();
+  for (uint64_t key : recorded.chunk_keys()) {
+    auto it = held->find(key);
+    if (it == held->end()) return false;
+    auto* slice = column->add_chunk_slices();
+    slice->set_chunk_key(key);
+    slice->set_offset(0);
+    slice->set_length(it->second);
+    slice->set_index(0);
+  }
+  insertion->set_send_confirmation(recorded.send_confirmation());
+
+  // Only chunks which the stream holds are kept or released, as the server
+  // expects to find every kept chunk.
+  if (recorded.keep_unreleased_chunks()) {
+    insertion->set_keep_unreleased_chunks(true);
+    for (uint64_t key : recorded.released_chunk_keys()) {
+      if (held->erase(key) > 0) insertion->add_released_chunk_keys(key);
+    }
+  } else {
+    internal::flat_hash_map<uint64_t, int64_t> kept;
+    for (uint64_t key : recorded.keep_chunk_keys()) {
+      auto it = held->find(key);
+      if (it == held->end() || !kept.emplace(*it).second) continue;
+      insertion->add_keep_chunk_keys(key);
+    }
+    *held = std::move(kept);
+  }
+  return true;
+}
+
+absl::Status ReplayInsertStream(
+    Stub* stub, const Schedule& schedule,
+    const std::vector<const WorkloadTraceEvent*>& events,
+    StreamResult* result) {
+  grpc::ClientContext context;
+  context.set_wait_for_ready(true);
+  auto stream = stub->InsertStream(&context);
+
+  // Send times of the items which are waiting for their confirmation.
+  absl::Mutex mu;
+  internal::flat_hash_map<uint64_t, absl::Time> pending;
+  LatencyHistogram latency;
+  auto reader = internal::StartThread(
+      "WorkloadReplayerConfirmations", [&stream, &mu, &pending, &latency] {
+        InsertStreamResponse response;
+        while (stream->Read(&response)) {
+          absl::MutexLock lock(&mu);
+          absl::Time now = absl::Now();
+          auto confirm = [&](uint64_t key) {
+            auto it = pending.find(key);
+            if (it == pending.end()) return;
+            latency.Record(now - it->second);
+            pending.erase(it);
+          };
+          confirm(response.key());
+          for (uint64_t key : response.keys()) confirm(key);
+        }
+      });
+
+  internal::flat_hash_map<uint64_t, int64_t> held;
+  std::string noise;
+  bool write_failed = false;
+  for (const auto* event : events) {
+    InsertStreamRequest request;
+    if (event->has_chunk()) {
+      MakeChunk(event->chunk(), &noise, request.mutable_chunk());
+      held[event->chunk().chunk_key()] =
+          request.chunk().sequence_range().end() + 1;
+      result->chunks++;
+      result->bytes += request.chunk().ByteSizeLong();
+    } else if (event->has_item()) {
+      if (!MakeItem(event->item(), &held, &request)) {
+        result->items_skipped++;
+        continue;
+      }
+      result->items++;
+    } else {
+      continue;
+    }
+
+    schedule.WaitFor(*event, result);
+    if (request.item().send_confirmation()) {
+      absl::MutexLock lock(&mu);
+      pending[request.item().item().key()] = absl::Now();
+    }
+    if (!stream->Write(request)) {
+      write_failed = true;
+      break;
+    }
+  }
+  if (!write_failed) stream->WritesDone();
+  reader = nullptr;  // Joins the thread once the server closed the stream.
+  result->insert_latency.Merge(latency);
+  return FromGrpcStatus(stream->Finish());
+}
+
+absl::Status ReplaySampleStream(
+    Stub* stub, const Schedule& schedule,
+    absl::Duration rate_limiter_timeout,
+    const std::vector<const WorkloadTraceEvent*>& events,
+    StreamResult* result) {
+  grpc::ClientContext context;
+  context.set_wait_for_ready(true);
+  auto stream = stub->SampleStream(&context);
+
+  // Send times and number of outstanding samples of the requests which have
+  // not completed, in the order they were sent.
+  absl::Mutex mu;
+  std::deque<std::pair<absl::Time, int64_t>> pending;
+  LatencyHistogram latency;
+  int64_t samples = 0;
+  auto reader = internal::StartThread(
+      "WorkloadReplayerSamples",
+      [&stream, &mu, &pending, &latency, &samples] {
+        SampleStreamResponse response;
+        while (stream->Read(&response)) {
+          if (!response.end_of_sequence()) continue;
+          absl::MutexLock lock(&mu);
+          samples++;
+          if (!pending.empty() && --pending.front().second == 0) {
+            latency.Record(absl::Now() - pending.front().first);
+            pending.pop_front();
+          }
+        }
+      });
+
+  bool write_failed = false;
+  for (const auto* event : events) {
+    if (!event->has_sample()) continue;
+    SampleStreamRequest request;
+    request.set_table(event->sample().table());
+    request.set_num_samples(event->sample().num_samples());
+    request.set_flexible_batch_size(event->sample().flexible_batch_size());
+    request.set_max_cached_chunks(event->sample().max_cached_chunks());
+    request.set_trim_chunks(event->sample().trim_chunks());
+    request.mutable_rate_limiter_timeout()->set_milliseconds(
+        absl::ToInt64Milliseconds(rate_limiter_timeout));
+
+    schedule.WaitFor(*event, result);
+    {
+      absl::MutexLock lock(&mu);
+      pending.emplace_back(absl::Now(), request.num_samples());
+    }
+    result->sample_requests++;
+    if (!stream->Write(request)) {
+      write_failed = true;
+      break;
+    }
+  }
+  if (!write_failed) stream->WritesDone();
+  reader = nullptr;  // Joins the thread once the server closed the stream.
+  result->samples += samples;
+  result->sample_latency.Merge(latency);
+  return FromGrpcStatus(stream->Finish());
+}
+
+absl::Status ReplayUnaryCalls(
+    Stub* stub, const Schedule& schedule,
+    const std::vector<const WorkloadTraceEvent*>& events,
+    StreamResult* result) {
+  for (const auto* event : events) {
+    grpc::ClientContext context;
+    context.set_wait_for_ready(true);
+    schedule.WaitFor(*event, result);
+    absl::Time start = absl::Now();
+    grpc::Status status;
+    if (event->has_mutate_priorities()) {
+      MutatePrioritiesResponse response;
+      status = stub->MutatePriorities(&context, event->mutate_priorities(),
+                                      &response);
+    } else if (event->has_reset()) {
+      ResetResponse response;
+      status = stub->Reset(&context, event->reset(), &response);
+    } else {
+      continue;
+    }
+    REVERB_RETURN_IF_ERROR(FromGrpcStatus(status));
+    result->unary_latency.Record(absl::Now() - start);
+    result->unary_calls++;
+  }
+  return absl::OkStatus();
+}
+
+std::string FormatRate(double count, absl::Duration elapsed) {
+  return absl::StrFormat("%.1f/s", count / absl::ToDoubleSeconds(elapsed));
+}
+
+}  // namespace
+
+absl::Status MakeTablesFromTrace(const WorkloadTraceHeader& header,
+                                 std::vector<std::shared_ptr<Table>>* tables) {
+  tables->clear();
+  for (const auto& info : header.tables()) {
+    std::shared_ptr<ItemSelector> sampler;
+    std::shared_ptr<ItemSelector> remover;
+    REVERB_RETURN_IF_ERROR(MakeSelector(info.sampler_options(), &sampler));
+    REVERB_RETURN_IF_ERROR(MakeSelector(info.remover_options(), &remover));
+    const auto& limiter = info.rate_limiter_info();
+    tables->push_back(std::make_shared<Table>(
+        info.name(), std::move(sampler), std::move(remover), info.max_size(),
+        info.max_times_sampled(),
+        std::make_shared<RateLimiter>(
+            limiter.samples_per_insert(), limiter.min_size_to_sample(),
+            limiter.min_diff(), limiter.max_diff()),
+        /*extensions=*/std::vector<std::shared_ptr<TableExtension>>{},
+        /*signature=*/absl::nullopt, info.max_chunk_bytes(),
+        info.has_max_age()
+            ? absl::Seconds(info.max_age().seconds()) +
+                  absl::Nanoseconds(info.max_age().nanos())
+            : absl::InfiniteDuration()));
+  }
+  return absl::OkStatus();
+}
+
+absl::Status WorkloadReplayer::Options::Validate() const {
+  if (server_address.empty()) {
+    return absl::InvalidArgumentError("server_address must be specified.");
+  }
+  if (!std::isfinite(speed) || speed < 0) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("speed must be >= 0 but got ", speed, "."));
+  }
+  if (rate_limiter_timeout <= absl::ZeroDuration()) {
+    return absl::InvalidArgumentError(
+        "rate_limiter_timeout must be positive.");
+  }
+  return absl::OkStatus();
+}
+
+absl::Status WorkloadReplayer::Run(
+    const Options& options, const std::vector<WorkloadTraceEvent>& events,
+    Report* report) {
+  REVERB_RETURN_IF_ERROR(options.Validate());
+  *report = Report();
+  std::shared_ptr<Stub> stub = MakeStub(options.server_address);
+
+  // The events of every stream, in the order they were recorded. The unary
+  // calls all have stream id 0.
+  std::vector<std::vector<const WorkloadTraceEvent*>> streams;
+  std::vector<uint64_t> stream_ids;
+  internal::flat_hash_map<uint64_t, int> stream_index;
+  for (const auto& event : events) {
+    auto it = stream_index.emplace(event.stream_id(), streams.size()).first;
+    if (it->second == streams.size()) {
+      streams.emplace_back();
+      stream_ids.push_back(event.stream_id());
+    }
+    streams[it->second].push_back(&event);
+  }
+
+  std::vector<StreamResult> results(streams.size());
+  std::vector<std::unique_ptr<internal::Thread>> threads;
+  absl::Time start = absl::Now();
+  Schedule schedule(start, options.speed);
+  for (int i = 0; i < streams.size(); i++) {
+    threads.push_back(internal::StartThread(
+        absl::StrCat("WorkloadReplayerStream_", i),
+        [&options, &schedule, stub, id = stream_ids[i], stream = &streams[i],
+         result = &results[i]] {
+          if (id == 0) {
+            result->status =
+                ReplayUnaryCalls(stub.get(), schedule, *stream, result);
+          } else if (stream->front()->has_sample()) {
+            result->status = ReplaySampleStream(
+                stub.get(), schedule, options.rate_limiter_timeout, *stream,
+                result);
+          } else {
+            result->status =
+                ReplayInsertStream(stub.get(), schedule, *stream, result);
+          }
+        }));
+  }
+  threads.clear();  // Joins the threads.
+  report->elapsed = absl::Now() - start;
+
+  for (const auto& result : results) {
+    REVERB_RETURN_IF_ERROR(result.status);
+    report->chunks_inserted += result.chunks;
+    report->bytes_inserted += result.bytes;
+    report->items_inserted += result.items;
+    report->items_skipped += result.items_skipped;
+    report->sample_requests += result.sample_requests;
+    report->items_sampled += result.samples;
+    report->unary_calls += result.unary_calls;
+    report->insert_latency.Merge(result.insert_latency);
+    report->sample_latency.Merge(result.sample_latency);
+    report->unary_latency.Merge(result.unary_latency);
+    report->max_lag = std::max(report->max_lag, result.max_lag);
+  }
+  return absl::OkStatus();
+}
+
+std::string WorkloadReplayer::Report::DebugString() const {
+  return absl::StrCat(
+      "elapsed: ", absl::FormatDuration(elapsed), "\n",
+      "chunks inserted: ", chunks_inserted, " (",
+      FormatRate(chunks_inserted, elapsed), ")\n",
+      "bytes inserted: ", bytes_inserted, " (",
+      FormatRate(bytes_inserted, elapsed), ")\n",
+      "items inserted: ", items_inserted, " (",
+      FormatRate(items_inserted, elapsed), ")\n",
+      "items skipped: ", items_skipped, "\n",
+      "sample requests: ", sample_requests, "\n",
+      "items sampled: ", items_sampled, " (",
+      FormatRate(items_sampled, elapsed), ")\n",
+      "unary calls: ", unary_calls, "\n",
+      "insert latency: ", insert_latency.DebugString(), "\n",
+      "sample latency: ", sample_latency.DebugString(), "\n",
+      "unary latency: ", unary_latency.DebugString(), "\n",
+      "max lag: ", absl::FormatDuration(max_lag), "\n");
+}
+
+}  // namespace tools
+}  // namespace reverb
+}  // namespace deepmind
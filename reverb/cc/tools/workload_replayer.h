@@ -0,0 +1,113 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef REVERB_CC_TOOLS_WORKLOAD_REPLAYER_H_
+#define REVERB_CC_TOOLS_WORKLOAD_REPLAYER_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/time/time.h"
+#include "reverb/cc/support/workload_trace.pb.h"
+#include "reverb/cc/table.h"
+#include "reverb/cc/tools/load_generator.h"
+
+namespace deepmind {
+namespace reverb {
+namespace tools {
+
+// Creates empty tables configured as the tables of the recorded server. The
+// signatures of the tables are not restored as the replayed chunks hold
+// synthetic data.
+absl::Status MakeTablesFromTrace(const WorkloadTraceHeader& header,
+                                 std::vector<std::shared_ptr<Table>>* tables);
+
+// Replays a workload trace recorded by `internal::WorkloadRecorder` against a
+// running server, which must hold the tables referenced by the trace (see
+// `MakeTablesFromTrace`).
+//
+// Every recorded stream is replayed by its own thread on a stream of its own,
+// and the unary calls (`MutatePriorities` and `Reset`) by a single thread, so
+// the requests of a stream keep their order while the streams run
+// concurrently. Each request is sent at its recorded offset from the start of
+// the trace (divided by `Options::speed`), or as soon as the previous request
+// of the stream has been sent if the replay falls behind.
+//
+// Chunks are replaced by random data of the recorded size and number of
+// steps, and items reference their chunks in full. Items which reference
+// chunks which were sent before the recording started are skipped.
+class WorkloadReplayer {
+ public:
+  struct Options {
+    // Address of the server, e.g. "localhost:8000".
+    std::string server_address;
+
+    // Factor by which the replay is sped up relative to the recording. If 0
+    // then the requests are sent as fast as possible.
+    double speed = 1.0;
+
+    // Timeout of the sample requests on the rate limiter. Bounds the time a
+    // replay can block when the trace holds more samples than the rate limiter
+    // allows (e.g. because some writers were not recorded).
+    absl::Duration rate_limiter_timeout = absl::Seconds(60);
+
+    absl::Status Validate() const;
+  };
+
+  struct Report {
+    // Time from the start of the replay until the last stream completed.
+    absl::Duration elapsed;
+
+    int64_t chunks_inserted = 0;
+    int64_t bytes_inserted = 0;
+    int64_t items_inserted = 0;
+    int64_t items_skipped = 0;
+    int64_t sample_requests = 0;
+    int64_t items_sampled = 0;
+    int64_t unary_calls = 0;
+
+    // Time from sending an item with `send_confirmation` until it was
+    // confirmed.
+    LatencyHistogram insert_latency;
+
+    // Time from sending a sample request until its last sample was received.
+    LatencyHistogram sample_latency;
+
+    // Latency of the `MutatePriorities` and `Reset` calls.
+    LatencyHistogram unary_latency;
+
+    // How far behind its recorded offset the most delayed request was sent.
+    absl::Duration max_lag;
+
+    // Human readable summary with throughputs per second.
+    std::string DebugString() const;
+  };
+
+  // Replays `events` and waits for all requests to complete. Returns the first
+  // error encountered by any of the streams, in which case `report` is
+  // incomplete.
+  static absl::Status Run(const Options& options,
+                          const std::vector<WorkloadTraceEvent>& events,
+                          Report* report);
+};
+
+}  // namespace tools
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_TOOLS_WORKLOAD_REPLAYER_H_
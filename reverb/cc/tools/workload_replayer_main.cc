@@ -0,0 +1,101 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Replays a workload trace recorded by a server (see
+// `ServerOptions::workload_trace_path`) and prints the throughput and
+// latencies. For example, to replay a trace at twice the recorded speed
+// against a server started in the process with the tables of the recorded
+// server:
+//
+//   bazel run -c opt //reverb/cc/tools:workload_replayer_main -- \
+//     --trace=/tmp/workload.trace --speed=2
+//
+// Set `--server` to replay the trace against a running server instead, which
+// must hold the tables of the trace.
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "absl/time/time.h"
+#include "reverb/cc/platform/net.h"
+#include "reverb/cc/platform/server.h"
+#include "reverb/cc/platform/status_macros.h"
+#include "reverb/cc/support/workload_recorder.h"
+#include "reverb/cc/support/workload_trace.pb.h"
+#include "reverb/cc/table.h"
+#include "reverb/cc/tools/workload_replayer.h"
+
+ABSL_FLAG(std::string, trace, "", "Path of the workload trace.");
+ABSL_FLAG(std::string, server, "",
+          "Address of the server to replay against. If empty then a server "
+          "with the tables of the trace is started in the process.");
+ABSL_FLAG(double, speed, 1.0,
+          "Factor by which the replay is sped up. 0 replays the requests as "
+          "fast as possible.");
+ABSL_FLAG(absl::Duration, rate_limiter_timeout, absl::Seconds(60),
+          "Timeout of the sample requests on the rate limiter.");
+
+namespace deepmind {
+namespace reverb {
+namespace tools {
+namespace {
+
+absl::Status Main() {
+  WorkloadTraceHeader header;
+  std::vector<WorkloadTraceEvent> events;
+  REVERB_RETURN_IF_ERROR(internal::ReadWorkloadTrace(
+      absl::GetFlag(FLAGS_trace), &header, &events));
+
+  WorkloadReplayer::Options options;
+  options.server_address = absl::GetFlag(FLAGS_server);
+  options.speed = absl::GetFlag(FLAGS_speed);
+  options.rate_limiter_timeout = absl::GetFlag(FLAGS_rate_limiter_timeout);
+
+  std::unique_ptr<Server> server;
+  if (options.server_address.empty()) {
+    std::vector<std::shared_ptr<Table>> tables;
+    REVERB_RETURN_IF_ERROR(MakeTablesFromTrace(header, &tables));
+    int port = internal::PickUnusedPortOrDie();
+    REVERB_RETURN_IF_ERROR(StartServer(std::move(tables), port,
+                                       /*checkpointer=*/nullptr, &server));
+    options.server_address = absl::StrCat("localhost:", port);
+  }
+
+  WorkloadReplayer::Report report;
+  REVERB_RETURN_IF_ERROR(WorkloadReplayer::Run(options, events, &report));
+  std::cout << report.DebugString();
+  return absl::OkStatus();
+}
+
+}  // namespace
+}  // namespace tools
+}  // namespace reverb
+}  // namespace deepmind
+
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+  auto status = deepmind::reverb::tools::Main();
+  if (!status.ok()) {
+    std::cerr << status << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,207 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "reverb/cc/tools/workload_replayer.h"
+
+#include <cfloat>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "absl/time/time.h"
+#include "reverb/cc/platform/net.h"
+#include "reverb/cc/platform/server.h"
+#include "reverb/cc/platform/status_matchers.h"
+#include "reverb/cc/rate_limiter.h"
+#include "reverb/cc/schema.pb.h"
+#include "reverb/cc/selectors/fifo.h"
+#include "reverb/cc/selectors/prioritized.h"
+#include "reverb/cc/support/workload_recorder.h"
+#include "reverb/cc/support/workload_trace.pb.h"
+#include "reverb/cc/table.h"
+
+namespace deepmind {
+namespace reverb {
+namespace tools {
+namespace {
+
+std::shared_ptr<Table> MakeTable() {
+  return std::make_shared<Table>(
+      "dist", std::make_shared<PrioritizedSelector>(0.8),
+      std::make_shared<FifoSelector>(), /*max_size=*/10,
+      /*max_times_sampled=*/0,
+      std::make_shared<RateLimiter>(1.0, 1, -DBL_MAX, DBL_MAX));
+}
+
+WorkloadTraceEvent MakeChunkEvent(uint64_t stream_id, uint64_t key) {
+  WorkloadTraceEvent event;
+  event.set_stream_id(stream_id);
+  event.mutable_chunk()->set_chunk_key(key);
+  event.mutable_chunk()->set_num_rows(2);
+  event.mutable_chunk()->set_num_bytes(100);
+  return event;
+}
+
+WorkloadTraceEvent MakeItemEvent(uint64_t stream_id, uint64_t key,
+                                 std::vector<uint64_t> chunk_keys,
+                                 std::vector<uint64_t> keep_chunk_keys) {
+  WorkloadTraceEvent event;
+  event.set_stream_id(stream_id);
+  auto* item = event.mutable_item();
+  item->set_table("dist");
+  item->set_key(key);
+  item->set_priority(1.0);
+  item->mutable_chunk_keys()->Add(chunk_keys.begin(), chunk_keys.end());
+  item->mutable_keep_chunk_keys()->Add(keep_chunk_keys.begin(),
+                                       keep_chunk_keys.end());
+  item->set_send_confirmation(true);
+  return event;
+}
+
+std::vector<WorkloadTraceEvent> MakeEvents() {
+  std::vector<WorkloadTraceEvent> events;
+  events.push_back(MakeChunkEvent(1, 1));
+  events.push_back(MakeItemEvent(1, 10, {1}, {1}));
+  events.push_back(MakeChunkEvent(1, 2));
+  events.push_back(MakeItemEvent(1, 11, {1, 2}, {}));
+  // References a chunk which was sent before the recording started.
+  events.push_back(MakeItemEvent(1, 12, {3}, {}));
+
+  WorkloadTraceEvent sample;
+  sample.set_stream_id(2);
+  sample.mutable_sample()->set_table("dist");
+  sample.mutable_sample()->set_num_samples(2);
+  sample.mutable_sample()->set_flexible_batch_size(-1);
+  events.push_back(sample);
+
+  WorkloadTraceEvent mutation;
+  mutation.mutable_mutate_priorities()->set_table("dist");
+  auto* update = mutation.mutable_mutate_priorities()->add_updates();
+  update->set_key(10);
+  update->set_priority(5);
+  events.push_back(mutation);
+  return events;
+}
+
+WorkloadReplayer::Options MakeOptions(int port) {
+  WorkloadReplayer::Options options;
+  options.server_address = absl::StrCat("localhost:", port);
+  options.speed = 0;
+  return options;
+}
+
+TEST(WorkloadReplayerTest, ValidateOptions) {
+  REVERB_EXPECT_OK(MakeOptions(1234).Validate());
+
+  auto options = MakeOptions(1234);
+  options.server_address.clear();
+  EXPECT_EQ(options.Validate().code(), absl::StatusCode::kInvalidArgument);
+
+  options = MakeOptions(1234);
+  options.speed = -1;
+  EXPECT_EQ(options.Validate().code(), absl::StatusCode::kInvalidArgument);
+
+  options = MakeOptions(1234);
+  options.rate_limiter_timeout = absl::ZeroDuration();
+  EXPECT_EQ(options.Validate().code(), absl::StatusCode::kInvalidArgument);
+}
+
+TEST(WorkloadReplayerTest, MakesTablesFromTrace) {
+  WorkloadTraceHeader header;
+  *header.add_tables() = MakeTable()->info();
+
+  std::vector<std::shared_ptr<Table>> tables;
+  REVERB_ASSERT_OK(MakeTablesFromTrace(header, &tables));
+  ASSERT_EQ(tables.size(), 1);
+  TableInfo info = tables[0]->info();
+  EXPECT_EQ(info.name(), "dist");
+  EXPECT_EQ(info.max_size(), 10);
+  EXPECT_EQ(info.sampler_options().prioritized().priority_exponent(), 0.8);
+  EXPECT_TRUE(info.remover_options().fifo());
+}
+
+TEST(WorkloadReplayerTest, ReplaysEvents) {
+  int port = internal::PickUnusedPortOrDie();
+  auto table = MakeTable();
+  std::unique_ptr<Server> server;
+  REVERB_ASSERT_OK(
+      StartServer({table}, port, /*checkpointer=*/nullptr, &server));
+
+  WorkloadReplayer::Report report;
+  REVERB_ASSERT_OK(WorkloadReplayer::Run(MakeOptions(port), MakeEvents(),
+                                         &report));
+  EXPECT_EQ(report.chunks_inserted, 2);
+  EXPECT_GE(report.bytes_inserted, 200);
+  EXPECT_EQ(report.items_inserted, 2);
+  EXPECT_EQ(report.items_skipped, 1);
+  EXPECT_EQ(report.sample_requests, 1);
+  EXPECT_EQ(report.items_sampled, 2);
+  EXPECT_EQ(report.unary_calls, 1);
+  EXPECT_EQ(report.insert_latency.count(), 2);
+  EXPECT_EQ(report.sample_latency.count(), 1);
+  EXPECT_EQ(report.unary_latency.count(), 1);
+  EXPECT_EQ(table->size(), 2);
+}
+
+TEST(WorkloadReplayerTest, ReplaysRecordedTrace) {
+  const char* dir = std::getenv("TEST_TMPDIR");
+  const std::string path =
+      absl::StrCat(dir != nullptr ? dir : "/tmp", "/replays_recorded_trace");
+
+  // Record the requests of a replay and replay the recording again.
+  int port = internal::PickUnusedPortOrDie();
+  std::unique_ptr<Server> server;
+  ServerOptions server_options;
+  server_options.workload_trace_path = path;
+  REVERB_ASSERT_OK(StartServer({MakeTable()}, port, /*checkpointer=*/nullptr,
+                               server_options, &server));
+  WorkloadReplayer::Report report;
+  REVERB_ASSERT_OK(WorkloadReplayer::Run(MakeOptions(port), MakeEvents(),
+                                         &report));
+  server->Stop();  // Closes the trace.
+
+  WorkloadTraceHeader header;
+  std::vector<WorkloadTraceEvent> events;
+  REVERB_ASSERT_OK(internal::ReadWorkloadTrace(path, &header, &events));
+  // The skipped item was never sent.
+  EXPECT_EQ(events.size(), MakeEvents().size() - 1);
+
+  std::vector<std::shared_ptr<Table>> tables;
+  REVERB_ASSERT_OK(MakeTablesFromTrace(header, &tables));
+  int replay_port = internal::PickUnusedPortOrDie();
+  std::unique_ptr<Server> replay_server;
+  REVERB_ASSERT_OK(StartServer(tables, replay_port, /*checkpointer=*/nullptr,
+                               &replay_server));
+
+  WorkloadReplayer::Report replay_report;
+  REVERB_ASSERT_OK(WorkloadReplayer::Run(MakeOptions(replay_port), events,
+                                         &replay_report));
+  EXPECT_EQ(replay_report.chunks_inserted, report.chunks_inserted);
+  EXPECT_EQ(replay_report.items_inserted, report.items_inserted);
+  EXPECT_EQ(replay_report.items_skipped, 0);
+  EXPECT_EQ(replay_report.items_sampled, report.items_sampled);
+  EXPECT_EQ(replay_report.unary_calls, report.unary_calls);
+  EXPECT_EQ(tables[0]->size(), 2);
+}
+
+}  // namespace
+}  // namespace tools
+}  // namespace reverb
+}  // namespace deepmind
@@ -14,7 +14,11 @@
 
 #include "reverb/cc/trajectory_writer.h"
 
+#include <unistd.h>
+
 #include <algorithm>
+#include <cstring>
+#include <iterator>
 #include <memory>
 #include <vector>
 
@@ -25,20 +29,25 @@
 #include "absl/status/status.h"
 #include "absl/strings/str_cat.h"
 #include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
 #include "absl/time/time.h"
 #include "absl/types/optional.h"
 #include "absl/types/span.h"
+#include "reverb/cc/local_insert_stream.h"
 #include "reverb/cc/platform/hash_set.h"
 #include "reverb/cc/platform/logging.h"
 #include "reverb/cc/platform/status_macros.h"
 #include "reverb/cc/platform/thread.h"
+#include "reverb/cc/platform/tracing.h"
 #include "reverb/cc/reverb_service.grpc.pb.h"
 #include "reverb/cc/reverb_service.pb.h"
 #include "reverb/cc/schema.pb.h"
 #include "reverb/cc/support/cleanup.h"
 #include "reverb/cc/support/grpc_util.h"
+#include "reverb/cc/support/shared_memory.h"
 #include "reverb/cc/support/signature.h"
 #include "reverb/cc/support/tf_util.h"
+#include "reverb/cc/support/thread_pool.h"
 #include "reverb/cc/support/trajectory_util.h"
 #include "reverb/cc/tensor_compression.h"
 #include "tensorflow/core/framework/tensor.h"
@@ -78,12 +87,84 @@ std::vector<FlatTrajectory::ChunkSlice> MergeAdjacent(
   return slices;
 }
 
+// Deadline of the `InitializeConnection` call which negotiates the shared
+// memory transport.
+constexpr auto kSharedMemoryNegotiationTimeout = absl::Seconds(5);
+
+// Bounds of the (exponential) backoff between attempts to reconnect a stream
+// which failed without any items being confirmed.
+constexpr auto kMinReconnectBackoff = absl::Milliseconds(10);
+constexpr auto kMaxReconnectBackoff = absl::Seconds(1);
+
+// Releases the chunks and items borrowed by the requests of `batch` and clears
+// it.
+void ReleaseBatch(InsertStreamRequest* batch) {
+  for (auto& request : *batch->mutable_batch()->mutable_requests()) {
+    if (request.has_chunk()) {
+      request.release_chunk();
+    } else if (request.has_item()) {
+      request.mutable_item()->release_item();
+    }
+  }
+  batch->Clear();
+}
+
+// Writes the requests collected in `batch` to `stream` as a single message and
+// clears it. No message is written if `batch` is empty.
+bool WriteBatch(grpc::ClientReaderWriterInterface<InsertStreamRequest,
+                                                  InsertStreamResponse>* stream,
+                InsertStreamRequest* batch) {
+  if (batch->batch().requests().empty()) return true;
+  auto release_batch = internal::MakeCleanup([batch] { ReleaseBatch(batch); });
+
+  grpc::WriteOptions options;
+  options.set_no_compression();
+  return stream->Write(*batch, options);
+}
+
+// Writes the chunk of `ref` to `stream`. If `shared_memory` is non-null and has
+// enough free space then the chunk is serialized into it, `position` updated
+// and only a reference to the chunk is written to the stream. If `batch` is
+// non-null then the request is added to it instead of being written, with the
+// chunk borrowed from `ref` until the batch is written. `chunk_column` is the
+// `InsertStreamRequest.chunk_column` the chunk is indexed under by the server,
+// or 0 if it shouldn't be indexed.
 bool SendChunk(grpc::ClientReaderWriterInterface<InsertStreamRequest,
                                                  InsertStreamResponse>* stream,
-               const CellRef& ref) {
+               const CellRef& ref, int32_t chunk_column,
+               internal::SharedMemoryRing* shared_memory, uint64_t* position,
+               InsertStreamRequest* batch) {
   REVERB_CHECK(ref.IsReady());
 
+  if (shared_memory != nullptr) {
+    const auto& chunk = *ref.GetChunk();
+    const int64_t size = chunk.ByteSizeLong();
+    int64_t offset;
+    if (char* data = shared_memory->Allocate(size, &offset, position);
+        data != nullptr && chunk.SerializeToArray(data, size)) {
+      InsertStreamRequest request;
+      request.set_chunk_column(chunk_column);
+      auto* shared_memory_chunk = request.mutable_shared_memory_chunk();
+      shared_memory_chunk->set_segment(shared_memory->name());
+      shared_memory_chunk->set_offset(offset);
+      shared_memory_chunk->set_length(size);
+      if (batch != nullptr) {
+        *batch->mutable_batch()->add_requests() = std::move(request);
+        return true;
+      }
+      return stream->Write(request);
+    }
+  }
+
+  if (batch != nullptr) {
+    auto* request = batch->mutable_batch()->add_requests();
+    request->set_chunk_column(chunk_column);
+    request->set_allocated_chunk(const_cast<ChunkData*>(ref.GetChunk().get()));
+    return true;
+  }
+
   InsertStreamRequest request;
+  request.set_chunk_column(chunk_column);
   request.set_allocated_chunk(const_cast<ChunkData*>(ref.GetChunk().get()));
   auto release_chunk =
       internal::MakeCleanup([&request] { request.release_chunk(); });
@@ -93,6 +174,63 @@ bool SendChunk(grpc::ClientReaderWriterInterface<InsertStreamRequest,
   return stream->Write(request, options);
 }
 
+// Describes the trajectory of `item`, whose (ready) references are `refs`, as
+// the last steps of columns of a single episode so the server can build the
+// `FlatTrajectory` from the chunks it holds. `chunk_columns` maps the chunkers
+// to the `chunk_column` their chunks were sent with. Returns false if the
+// trajectory cannot be expressed this way, e.g. because a column skips steps
+// or spans multiple chunkers.
+bool AssembleTrajectory(
+    const PrioritizedItem& item,
+    absl::Span<const std::shared_ptr<CellRef>> refs,
+    const internal::flat_hash_map<const Chunker*, int32_t>& chunk_columns,
+    InsertStreamRequest::AssembledTrajectory* assembled) {
+  assembled->Clear();
+  int ref_index = 0;
+  for (const auto& column : item.flat_trajectory().columns()) {
+    int num_steps = 0;
+    for (const auto& slice : column.chunk_slices()) {
+      num_steps += slice.length();
+    }
+    if (num_steps == 0 || ref_index + num_steps > refs.size()) return false;
+
+    auto column_refs = refs.subspan(ref_index, num_steps);
+    ref_index += num_steps;
+
+    auto chunker = column_refs.front()->chunker().lock();
+    auto it = chunk_columns.find(chunker.get());
+    if (it == chunk_columns.end()) return false;
+
+    const int32_t end_step = column_refs.back()->episode_step();
+    if (assembled->columns().empty()) {
+      assembled->set_episode_id(column_refs.front()->episode_id());
+      assembled->set_end_step(end_step);
+    } else if (end_step != assembled->end_step()) {
+      return false;
+    }
+
+    for (int i = 0; i < column_refs.size(); i++) {
+      const CellRef& ref = *column_refs[i];
+      if (ref.chunker().lock() != chunker ||
+          ref.episode_id() != assembled->episode_id() ||
+          ref.episode_step() != end_step - num_steps + 1 + i) {
+        return false;
+      }
+      const SequenceRange& range = ref.GetChunk()->sequence_range();
+      if (range.sparse() || range.episode_id() != ref.episode_id() ||
+          ref.offset() != ref.episode_step() - range.start()) {
+        return false;
+      }
+    }
+
+    auto* assembled_column = assembled->add_columns();
+    assembled_column->set_chunk_column(it->second);
+    assembled_column->set_num_steps(num_steps);
+    assembled_column->set_squeeze(column.squeeze());
+  }
+  return ref_index == refs.size();
+}
+
 bool AllReady(absl::Span<const std::shared_ptr<CellRef>> refs) {
   for (const auto& ref : refs) {
     if (!ref->IsReady()) {
@@ -112,6 +250,93 @@ bool ContainsAll(const internal::flat_hash_set<uint64_t>& set,
   return true;
 }
 
+// Returns true if `row` has the shape of a row of `buffer`.
+bool IsRowOf(const tensorflow::Tensor& buffer, const tensorflow::Tensor& row) {
+  if (buffer.dims() != row.dims() + 1) return false;
+  for (int i = 0; i < row.dims(); i++) {
+    if (buffer.dim_size(i + 1) != row.dim_size(i)) return false;
+  }
+  return true;
+}
+
+// Copies `row` into row `index` of `buffer`. `row` must have the dtype of
+// `buffer` and the shape of its rows.
+void CopyRow(const tensorflow::Tensor& row, int index,
+             tensorflow::Tensor* buffer) {
+  if (tensorflow::DataTypeCanUseMemcpy(buffer->dtype())) {
+    auto src = row.tensor_data();
+    std::memcpy(const_cast<char*>(buffer->tensor_data().data()) +
+                    index * src.size(),
+                src.data(), src.size());
+  } else {
+    auto src = row.flat<tensorflow::tstring>();
+    auto dst = buffer->flat<tensorflow::tstring>();
+    for (int64_t i = 0; i < src.size(); i++) {
+      dst(index * src.size() + i) = src(i);
+    }
+  }
+}
+
+// Encodes the first `num_rows` rows of `buffer` into `chunk` using the (column)
+// options of the `Chunker`.
+absl::Status EncodeChunk(const tensorflow::Tensor& buffer, int num_rows,
+                         ChunkData::Codec codec, bool deduplicate_frames,
+                         ChunkData::Quantization quantization,
+                         int rows_per_block, ChunkData* chunk) {
+  // Slicing from the first row shares (and keeps aligned) the buffer.
+  tensorflow::Tensor batched =
+      num_rows == buffer.dim_size(0) ? buffer : buffer.Slice(0, num_rows);
+  tensorflow::Tensor quantized;
+  ChunkData::QuantizedColumn quantized_column;
+  if (QuantizeTensor(batched, quantization, &quantized, &quantized_column)) {
+    batched = std::move(quantized);
+    *chunk->add_quantized_columns() = std::move(quantized_column);
+  }
+
+  tensorflow::Tensor unique_frames;
+  ChunkData::DeduplicatedFrames frames;
+  if (deduplicate_frames &&
+      DeduplicateFrames(batched, &unique_frames, &frames)) {
+    chunk->set_codec(CompressTensorAsProtoIfSmaller(
+        unique_frames, chunk->mutable_data()->add_tensors(), codec));
+    *chunk->add_deduplicated_frames() = std::move(frames);
+    return absl::OkStatus();
+  }
+
+  auto* proto = chunk->mutable_data()->add_tensors();
+  ChunkData::CompressedBlocks blocks;
+  if (CompressTensorAsBlocks(batched, rows_per_block, codec, proto, &blocks)) {
+    // As in `CompressTensorAsProtoIfSmaller`, the blocks are stored
+    // uncompressed if the codec does not make them smaller.
+    if (codec != ChunkData::NONE &&
+        proto->tensor_content().size() >= batched.TotalBytes()) {
+      codec = ChunkData::NONE;
+      CompressTensorAsBlocks(batched, rows_per_block, codec, proto, &blocks);
+    }
+    chunk->set_codec(codec);
+    *chunk->add_compressed_blocks() = std::move(blocks);
+  } else {
+    chunk->set_codec(CompressTensorAsProtoIfSmaller(batched, proto, codec));
+  }
+  return absl::OkStatus();
+}
+
+// Returns the length of the chunks of the column with `spec` when configured
+// with `options`. See `TrajectoryWriter::Options::target_chunk_bytes`.
+int ChunkLength(const TrajectoryWriter::Options& options,
+                const internal::TensorSpec& spec) {
+  tensorflow::TensorShape shape;
+  if (options.target_chunk_bytes <= 0 ||
+      !tensorflow::DataTypeCanUseMemcpy(spec.dtype) ||
+      !spec.shape.AsTensorShape(&shape)) {
+    return options.max_chunk_length;
+  }
+  const int64_t row_bytes = std::max<int64_t>(
+      shape.num_elements() * tensorflow::DataTypeSize(spec.dtype), 1);
+  return std::clamp<int64_t>(options.target_chunk_bytes / row_bytes, 1,
+                             options.max_chunk_length);
+}
+
 }  // namespace
 
 CellRef::CellRef(std::weak_ptr<Chunker> chunker, uint64_t chunk_key, int offset,
@@ -157,10 +382,22 @@ absl::Status CellRef::GetData(tensorflow::Tensor* out) const {
 }
 
 Chunker::Chunker(internal::TensorSpec spec, int max_chunk_length,
-                 int num_keep_alive_refs)
+                 int num_keep_alive_refs, ChunkData::Codec codec,
+                 bool deduplicate_frames,
+                 ChunkData::Quantization quantization, int rows_per_block,
+                 internal::ThreadPool* compression_pool,
+                 std::function<void(const absl::Status&)> on_chunk_ready)
     : spec_(std::move(spec)),
       max_chunk_length_(max_chunk_length),
-      num_keep_alive_refs_(num_keep_alive_refs) {
+      num_keep_alive_refs_(num_keep_alive_refs),
+      codec_(codec),
+      deduplicate_frames_(deduplicate_frames),
+      quantization_(quantization),
+      rows_per_block_(rows_per_block),
+      compression_pool_(compression_pool),
+      on_chunk_ready_(std::move(on_chunk_ready)),
+      cell_ref_pool_(std::make_shared<internal::SlotPool>(
+          /*slots_per_slab=*/max_chunk_length)) {
   REVERB_CHECK_GE(num_keep_alive_refs, max_chunk_length);
   Reset();
 }
@@ -182,43 +419,58 @@ absl::Status Chunker::Append(tensorflow::Tensor tensor,
   }
 
   absl::MutexLock lock(&mu_);
+  REVERB_RETURN_IF_ERROR(compression_status_);
 
-  if (!buffer_.empty() &&
+  if (offset_ > 0 &&
       active_refs_.back()->episode_id() != episode_info.episode_id) {
     return absl::FailedPreconditionError(
         "Chunker::Append called with new episode when buffer non empty.");
   }
-  if (!buffer_.empty() &&
+  if (offset_ > 0 &&
       active_refs_.back()->episode_step() >= episode_info.step) {
     return absl::FailedPreconditionError(
         "Chunker::Append called with an episode step which was not greater "
         "than already observed.");
   }
 
-  active_refs_.push_back(std::make_shared<CellRef>(
+  // The buffer of a chunk is allocated by its first row. The buffer of the
+  // previous chunk is reused unless it was handed over to `compression_pool_`
+  // or holds rows of another shape.
+  if (offset_ == 0 && (buffer_.dims() == 0 ||
+                       buffer_.dim_size(0) != max_chunk_length_ ||
+                       !IsRowOf(buffer_, tensor))) {
+    tensorflow::TensorShape shape = tensor.shape();
+    shape.InsertDim(0, max_chunk_length_);
+    buffer_ = tensorflow::Tensor(tensor.dtype(), shape);
+  } else if (!IsRowOf(buffer_, tensor)) {
+    tensorflow::TensorShape shape = buffer_.shape();
+    shape.RemoveDim(0);
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Tensor of shape ", tensor.shape().DebugString(),
+        " provided for column ", spec_.name,
+        " but the rows of the current chunk have shape ", shape.DebugString(),
+        ". All rows of a chunk must have the same shape."));
+  }
+  CopyRow(tensor, offset_, &buffer_);
+
+  active_refs_.push_back(std::allocate_shared<CellRef>(
+      internal::SlotPoolAllocator<CellRef>(cell_ref_pool_),
       std::weak_ptr<Chunker>(shared_from_this()), next_chunk_key_, offset_++,
       std::move(episode_info)));
-
-  // Add a batch dim to the tensor before adding it to the buffer. This will
-  // prepare it for the concat op when the chunk is finalized.
-  tensorflow::TensorShape shape = tensor.shape();
-  shape.InsertDim(0, 1);
-
-  // This should never fail due to dtype or shape differences, because the dtype
-  // of tensors[j] is UNKNOWN and `shape` has the same number of elements as
-  // `item`.
-  tensorflow::Tensor batched_tensor(tensor.dtype(), shape);
-  REVERB_CHECK(batched_tensor.CopyFrom(tensor, shape));
-  buffer_.push_back(std::move(batched_tensor));
+  if (active_chunk_keys_.empty() ||
+      active_chunk_keys_.back().first != next_chunk_key_) {
+    active_chunk_keys_.emplace_back(next_chunk_key_, 0);
+  }
+  ++active_chunk_keys_.back().second;
 
   // Create the chunk if max buffer size reached.
-  if (buffer_.size() == max_chunk_length_) {
+  if (offset_ == max_chunk_length_) {
     REVERB_RETURN_IF_ERROR(FlushLocked());
   }
 
   // Delete references which which have exceeded their max age.
   while (active_refs_.size() > num_keep_alive_refs_) {
-    active_refs_.pop_front();
+    PopOldestRefLocked();
   }
 
   *ref = active_refs_.back();
@@ -229,30 +481,42 @@ absl::Status Chunker::Append(tensorflow::Tensor tensor,
 std::vector<uint64_t> Chunker::GetKeepKeys() const {
   absl::MutexLock lock(&mu_);
   std::vector<uint64_t> keys;
-  for (const auto& ref : active_refs_) {
-    if (keys.empty() || keys.back() != ref->chunk_key()) {
-      keys.push_back(ref->chunk_key());
-    }
+  keys.reserve(active_chunk_keys_.size());
+  for (const auto& [key, count] : active_chunk_keys_) {
+    keys.push_back(key);
   }
   return keys;
 }
 
+void Chunker::PopOldestRefLocked() {
+  active_refs_.pop_front();
+  if (--active_chunk_keys_.front().second == 0) {
+    active_chunk_keys_.pop_front();
+  }
+}
+
 absl::Status Chunker::Flush() {
   absl::MutexLock lock(&mu_);
+  REVERB_RETURN_IF_ERROR(compression_status_);
   return FlushLocked();
 }
 
+bool Chunker::IsCompressing(uint64_t chunk_key) const {
+  absl::MutexLock lock(&mu_);
+  return compressing_chunk_keys_.contains(chunk_key);
+}
+
 absl::Status Chunker::FlushLocked() {
-  if (buffer_.empty()) return absl::OkStatus();
+  if (offset_ == 0) return absl::OkStatus();
+
+  internal::ScopedTrace trace([this] {
+    return absl::StrCat("Chunker::FlushLocked#chunk_key=", next_chunk_key_,
+                        ",num_rows=", offset_, "#");
+  });
 
   ChunkData chunk;
   chunk.set_chunk_key(next_chunk_key_);
 
-  tensorflow::Tensor batched;
-  REVERB_RETURN_IF_ERROR(
-      FromTensorflowStatus(tensorflow::tensor::Concat(buffer_, &batched)));
-  CompressTensorAsProto(batched, chunk.mutable_data()->add_tensors());
-
   // Set the sequence range of the chunk.
   for (const auto& ref : active_refs_) {
     if (ref->chunk_key() != chunk.chunk_key()) continue;
@@ -275,6 +539,41 @@ absl::Status Chunker::FlushLocked() {
     }
   }
 
+  if (compression_pool_ != nullptr) {
+    // Hand the buffer over to the pool so the caller does not have to wait
+    // for the encoding. The `CellRef`s are notified in `FinishCompression`.
+    std::vector<std::shared_ptr<CellRef>> refs;
+    for (const auto& ref : active_refs_) {
+      if (ref->chunk_key() == chunk.chunk_key()) {
+        refs.push_back(ref);
+      }
+    }
+    compressing_chunk_keys_.insert(chunk.chunk_key());
+    compression_pool_->Schedule(
+        [self = shared_from_this(), buffer = std::move(buffer_),
+         num_rows = offset_, chunk = std::move(chunk), refs = std::move(refs),
+         codec = codec_, deduplicate_frames = deduplicate_frames_,
+         quantization = quantization_,
+         rows_per_block = rows_per_block_]() mutable {
+          internal::ScopedTrace trace("Chunker/EncodeChunk");
+          auto status =
+              EncodeChunk(buffer, num_rows, codec, deduplicate_frames,
+                          quantization, rows_per_block, &chunk);
+          self->FinishCompression(std::move(status), std::move(chunk),
+                                  std::move(refs));
+        });
+
+    // The next chunk allocates a new buffer.
+    buffer_ = tensorflow::Tensor();
+    next_chunk_key_ = NewKey();
+    offset_ = 0;
+    return absl::OkStatus();
+  }
+
+  REVERB_RETURN_IF_ERROR(EncodeChunk(buffer_, offset_, codec_,
+                                     deduplicate_frames_, quantization_,
+                                     rows_per_block_, &chunk));
+
   // Now the chunk has been finalized we can notify the `CellRef`s.
   auto chunk_sp = std::make_shared<const ChunkData>(std::move(chunk));
   for (auto& ref : active_refs_) {
@@ -283,42 +582,74 @@ absl::Status Chunker::FlushLocked() {
     }
   }
 
-  buffer_.clear();
+  // `chunk` does not reference `buffer_` so it is reused by the next chunk.
   next_chunk_key_ = NewKey();
   offset_ = 0;
 
   return absl::OkStatus();
 }
 
+void Chunker::FinishCompression(absl::Status status, ChunkData chunk,
+                                std::vector<std::shared_ptr<CellRef>> refs) {
+  {
+    absl::MutexLock lock(&mu_);
+    const uint64_t chunk_key = chunk.chunk_key();
+    if (status.ok()) {
+      auto chunk_sp = std::make_shared<const ChunkData>(std::move(chunk));
+      for (auto& ref : refs) {
+        ref->SetChunk(chunk_sp);
+      }
+    } else if (compression_status_.ok()) {
+      compression_status_ = status;
+    }
+    compressing_chunk_keys_.erase(chunk_key);
+  }
+
+  if (on_chunk_ready_) {
+    on_chunk_ready_(status);
+  }
+}
+
 void Chunker::Reset() {
   absl::MutexLock lock(&mu_);
-  buffer_.clear();
-  buffer_.reserve(max_chunk_length_);
+  // Chunks which are being compressed are not waited for. Their `CellRef`s are
+  // still notified when the compression completes.
   offset_ = 0;
   next_chunk_key_ = NewKey();
   active_refs_.clear();
+  active_chunk_keys_.clear();
 }
 
 const internal::TensorSpec& Chunker::spec() const { return spec_; }
 
 absl::Status Chunker::ApplyConfig(int max_chunk_length,
-                                  int num_keep_alive_refs) {
+                                  int num_keep_alive_refs,
+                                  ChunkData::Codec codec,
+                                  bool deduplicate_frames,
+                                  ChunkData::Quantization quantization,
+                                  int rows_per_block) {
   absl::MutexLock lock(&mu_);
 
-  if (!buffer_.empty()) {
+  if (offset_ > 0) {
     return absl::FailedPreconditionError(
         "Flush must be called before ApplyConfig.");
   }
 
   TrajectoryWriter::Options options{.max_chunk_length = max_chunk_length,
-                                    .num_keep_alive_refs = num_keep_alive_refs};
+                                    .num_keep_alive_refs = num_keep_alive_refs,
+                                    .codec = codec,
+                                    .rows_per_block = rows_per_block};
   REVERB_RETURN_IF_ERROR(options.Validate());
 
   max_chunk_length_ = max_chunk_length;
   num_keep_alive_refs_ = num_keep_alive_refs;
+  codec_ = codec;
+  deduplicate_frames_ = deduplicate_frames;
+  quantization_ = quantization;
+  rows_per_block_ = rows_per_block;
 
   while (active_refs_.size() > num_keep_alive_refs) {
-    active_refs_.pop_front();
+    PopOldestRefLocked();
   }
 
   return absl::OkStatus();
@@ -328,12 +659,19 @@ absl::Status Chunker::CopyDataForCell(const CellRef* ref,
                                       tensorflow::Tensor* out) const {
   absl::MutexLock lock(&mu_);
 
+  // If the chunk is being compressed then the data has already left the buffer
+  // so we have to wait for the chunk to be finalized.
+  auto compressed = [this, ref]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    return !compressing_chunk_keys_.contains(ref->chunk_key());
+  };
+  mu_.Await(absl::Condition(&compressed));
+
   // If the chunk has been finalized then we unpack it and slice out the data.
   if (ref->IsReady()) {
-    tensorflow::Tensor column;
-    REVERB_RETURN_IF_ERROR(
-        internal::UnpackChunkColumn(*ref->GetChunk(), 0, &column));
-    *out = column.SubSlice(ref->offset());
+    tensorflow::Tensor row;
+    REVERB_RETURN_IF_ERROR(internal::UnpackChunkColumnAndSlice(
+        *ref->GetChunk(), 0, ref->offset(), 1, &row));
+    *out = row.SubSlice(0);
     if (!out->IsAligned()) {
       *out = tensorflow::tensor::DeepCopy(*out);
     }
@@ -349,19 +687,14 @@ absl::Status Chunker::CopyDataForCell(const CellRef* ref,
     negative_offset++;
   }
 
-  int buffer_index = buffer_.size() - negative_offset - 1;
+  int buffer_index = offset_ - negative_offset - 1;
   if (buffer_index < 0) {
     return absl::InternalError(
         "Data could not be found in buffer nor in finalized chunk.");
   }
 
-  // A batch dimension is added to the data before it is added to the buffer so
-  // we strip that off before copying the content to the output tensor.
-  tensorflow::TensorShape shape = buffer_[buffer_index].shape();
-  shape.RemoveDim(0);
-  if (!out->CopyFrom(buffer_[buffer_index], shape)) {
-    return absl::InternalError("Unable to copy tensor from buffer.");
-  }
+  // The row is copied since `buffer_` is overwritten by the next chunk.
+  *out = tensorflow::tensor::DeepCopy(buffer_.SubSlice(buffer_index));
 
   return absl::OkStatus();
 }
@@ -371,29 +704,80 @@ TrajectoryWriter::TrajectoryWriter(
     const Options& options)
     : stub_(std::move(stub)),
       options_(options),
-      episode_id_(NewKey()),
-      episode_step_(0),
       closed_(false),
-      stream_worker_(
-          internal::StartThread("TrajectoryWriter_StreamWorker", [this] {
-            while (true) {
-              auto status = RunStreamWorker();
-
-              absl::MutexLock lock(&mu_);
-
-              if (closed_) {
-                unrecoverable_status_ = absl::CancelledError(
-                    "TrajectoryWriter::Close has been called.");
-                return;
-              }
-
-              if (!status.ok() && !absl::IsUnavailable(status)) {
-                unrecoverable_status_ = status;
-                return;
-              }
-            }
-          })) {
+      stream_worker_(internal::StartThread("TrajectoryWriter_StreamWorker",
+                                           [this] { RunStreamWorkerLoop(); })) {
+  REVERB_CHECK_OK(options.Validate());
+  chunkers_.resize(options_.num_episodes);
+  for (int i = 0; i < options_.num_episodes; i++) {
+    episodes_.push_back({NewKey(), 0});
+  }
+  if (options_.num_compression_threads > 0) {
+    compression_pool_ = absl::make_unique<internal::ThreadPool>(
+        "TrajectoryWriter_Compression", options_.num_compression_threads);
+  }
+}
+
+TrajectoryWriter::TrajectoryWriter(
+    internal::flat_hash_map<std::string, std::shared_ptr<Table>> tables,
+    const Options& options)
+    : local_tables_(std::move(tables)),
+      options_(options),
+      closed_(false),
+      stream_worker_(internal::StartThread("TrajectoryWriter_StreamWorker",
+                                           [this] { RunStreamWorkerLoop(); })) {
+  REVERB_CHECK(!local_tables_.empty());
   REVERB_CHECK_OK(options.Validate());
+  chunkers_.resize(options_.num_episodes);
+  for (int i = 0; i < options_.num_episodes; i++) {
+    episodes_.push_back({NewKey(), 0});
+  }
+  if (options_.num_compression_threads > 0) {
+    compression_pool_ = absl::make_unique<internal::ThreadPool>(
+        "TrajectoryWriter_Compression", options_.num_compression_threads);
+  }
+}
+
+void TrajectoryWriter::RunStreamWorkerLoop() {
+  absl::Duration backoff = absl::ZeroDuration();
+  while (true) {
+    auto status = RunStreamWorker();
+
+    absl::MutexLock lock(&mu_);
+
+    if (!closed_ && (status.ok() || absl::IsUnavailable(status))) {
+      if (!status.ok()) ++num_unavailable_streams_;
+
+      // The items written to the failed stream but not confirmed might not
+      // have reached the server so they are written again, before the items
+      // which have not been written yet.
+      write_queue_.insert(write_queue_.begin(),
+                          std::make_move_iterator(unconfirmed_items_.begin()),
+                          std::make_move_iterator(unconfirmed_items_.end()));
+      unconfirmed_items_.clear();
+      in_flight_items_.clear();
+
+      // Reconnect straight away if the stream made progress and otherwise back
+      // off so a server which is down is not flooded with new streams.
+      backoff = received_confirmation_
+                    ? absl::ZeroDuration()
+                    : std::min(std::max(2 * backoff, kMinReconnectBackoff),
+                               kMaxReconnectBackoff);
+      received_confirmation_ = false;
+      mu_.AwaitWithTimeout(absl::Condition(&closed_), backoff);
+    }
+
+    if (closed_) {
+      unrecoverable_status_ =
+          absl::CancelledError("TrajectoryWriter::Close has been called.");
+      return;
+    }
+
+    if (!status.ok() && !absl::IsUnavailable(status)) {
+      unrecoverable_status_ = status;
+      return;
+    }
+  }
 }
 
 TrajectoryWriter::~TrajectoryWriter() {
@@ -414,27 +798,81 @@ TrajectoryWriter::~TrajectoryWriter() {
 absl::Status TrajectoryWriter::Append(
     std::vector<absl::optional<tensorflow::Tensor>> data,
     std::vector<absl::optional<std::weak_ptr<CellRef>>>* refs) {
+  return AppendToEpisode(0, std::move(data), refs);
+}
+
+absl::Status TrajectoryWriter::AppendBatch(
+    std::vector<absl::optional<tensorflow::Tensor>> data,
+    std::vector<std::vector<absl::optional<std::weak_ptr<CellRef>>>>* refs) {
+  const int num_episodes = options_.num_episodes;
+  for (int i = 0; i < data.size(); i++) {
+    if (!data[i].has_value()) continue;
+    const auto& tensor = data[i].value();
+    if (tensor.dims() == 0 || tensor.dim_size(0) != num_episodes) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "AppendBatch expects tensors with a leading dimension of size ",
+          num_episodes, " (num_episodes) but column ", i, " has shape ",
+          tensor.shape().DebugString(), "."));
+    }
+  }
+
+  refs->resize(num_episodes);
+  for (int episode = 0; episode < num_episodes; episode++) {
+    std::vector<absl::optional<tensorflow::Tensor>> step(data.size());
+    for (int i = 0; i < data.size(); i++) {
+      if (!data[i].has_value()) continue;
+      // The row shares the memory of the batch. Chunkers copy the row into
+      // their buffer, which requires aligned rows unless the dtype can be
+      // copied with memcpy.
+      tensorflow::Tensor row = data[i]->SubSlice(episode);
+      if (!row.IsAligned() && !tensorflow::DataTypeCanUseMemcpy(row.dtype())) {
+        row = tensorflow::tensor::DeepCopy(row);
+      }
+      step[i] = std::move(row);
+    }
+    REVERB_RETURN_IF_ERROR(
+        AppendToEpisode(episode, std::move(step), &(*refs)[episode]));
+  }
+  return absl::OkStatus();
+}
+
+absl::Status TrajectoryWriter::AppendToEpisode(
+    int episode, std::vector<absl::optional<tensorflow::Tensor>> data,
+    std::vector<absl::optional<std::weak_ptr<CellRef>>>* refs) {
   CellRef::EpisodeInfo episode_info;
   {
     absl::MutexLock lock(&mu_);
     REVERB_RETURN_IF_ERROR(unrecoverable_status_);
-    episode_info = {episode_id_, episode_step_};
+    episode_info = {episodes_[episode].id, episodes_[episode].step};
   }
 
+  auto& chunkers = chunkers_[episode];
+
   // If this is the first time the column has been present in the data then
   // create a chunker using the spec of the item.
   for (int i = 0; i < data.size(); i++) {
-    if (data[i].has_value() && !chunkers_.contains(i)) {
+    if (data[i].has_value() && !chunkers.contains(i)) {
       const auto& tensor = data[i].value();
       // If the new column has been configured with `ConfigureChunker` then we
       // use the overrided options. If not then we use the default `options_`.
       const auto& chunker_options =
           options_override_.contains(i) ? options_override_[i] : options_;
-      chunkers_[i] = std::make_shared<Chunker>(
-          internal::TensorSpec{std::to_string(i), tensor.dtype(),
-                               tensor.shape()},
-          chunker_options.max_chunk_length,
-          chunker_options.num_keep_alive_refs);
+      internal::TensorSpec spec{std::to_string(i), tensor.dtype(),
+                                tensor.shape()};
+      const int chunk_length = ChunkLength(chunker_options, spec);
+      chunkers[i] = std::make_shared<Chunker>(
+          std::move(spec), chunk_length,
+          chunker_options.num_keep_alive_refs, chunker_options.codec,
+          chunker_options.deduplicate_frames, chunker_options.quantization,
+          chunker_options.rows_per_block, compression_pool_.get(), [this](const absl::Status& status) {
+            absl::MutexLock lock(&mu_);
+            if (!status.ok() && unrecoverable_status_.ok()) {
+              unrecoverable_status_ = status;
+            }
+            // Wake up stream worker in case it was blocked on items
+            // referencing the chunk.
+            data_cv_.Signal();
+          });
     }
   }
 
@@ -447,17 +885,17 @@ absl::Status TrajectoryWriter::Append(
 
     std::weak_ptr<CellRef> ref;
     REVERB_RETURN_IF_ERROR(
-        chunkers_[i]->Append(std::move(data[i].value()), episode_info, &ref));
+        chunkers[i]->Append(std::move(data[i].value()), episode_info, &ref));
     refs->push_back(std::move(ref));
   }
 
   absl::MutexLock lock(&mu_);
 
   // Sanity check that `Append` or `EndEpisode` wasn't called concurrently.
-  REVERB_CHECK_EQ(episode_info.episode_id, episode_id_);
-  REVERB_CHECK_EQ(episode_info.step, episode_step_);
+  REVERB_CHECK_EQ(episode_info.episode_id, episodes_[episode].id);
+  REVERB_CHECK_EQ(episode_info.step, episodes_[episode].step);
 
-  episode_step_++;
+  episodes_[episode].step++;
 
   // Wake up stream worker in case it was blocked on items referencing
   // incomplete chunks
@@ -503,12 +941,104 @@ absl::Status TrajectoryWriter::CreateItem(
     column.ToProto(item_and_refs.item.mutable_flat_trajectory()->add_columns());
   }
 
-  {
-    absl::MutexLock lock(&mu_);
-    write_queue_.push_back(std::move(item_and_refs));
+  absl::MutexLock lock(&mu_);
+  write_queue_.push_back(std::move(item_and_refs));
+  AddToBufferLocked(write_queue_.back());
+  return EnforceBufferLimitLocked();
+}
+
+void TrajectoryWriter::AddToBufferLocked(const ItemAndRefs& item) {
+  if (options_.max_buffered_bytes == 0) return;
+  internal::flat_hash_set<uint64_t> keys;
+  for (const auto& ref : item.refs) {
+    if (!keys.insert(ref->chunk_key()).second) continue;
+    auto [it, inserted] = buffered_chunks_.try_emplace(
+        ref->chunk_key(), BufferedChunk{0, -1, ref});
+    if (inserted) unsized_chunk_keys_.push_back(ref->chunk_key());
+    it->second.num_items++;
   }
+}
 
-  return absl::OkStatus();
+void TrajectoryWriter::RemoveFromBufferLocked(const ItemAndRefs& item) {
+  if (options_.max_buffered_bytes == 0) return;
+  internal::flat_hash_set<uint64_t> keys;
+  for (const auto& ref : item.refs) {
+    if (!keys.insert(ref->chunk_key()).second) continue;
+    auto it = buffered_chunks_.find(ref->chunk_key());
+    if (--it->second.num_items > 0) continue;
+    if (it->second.bytes > 0) buffered_bytes_ -= it->second.bytes;
+    buffered_chunks_.erase(it);
+  }
+}
+
+void TrajectoryWriter::UpdateBufferedBytesLocked() {
+  auto sized = [this](uint64_t key) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    auto it = buffered_chunks_.find(key);
+    if (it == buffered_chunks_.end() || it->second.bytes >= 0) return true;
+    auto chunk = it->second.ref->GetChunk();
+    if (chunk == nullptr) return false;
+    it->second.bytes = chunk->ByteSizeLong();
+    it->second.ref = nullptr;
+    buffered_bytes_ += it->second.bytes;
+    return true;
+  };
+  unsized_chunk_keys_.erase(std::remove_if(unsized_chunk_keys_.begin(),
+                                           unsized_chunk_keys_.end(), sized),
+                            unsized_chunk_keys_.end());
+}
+
+absl::Status TrajectoryWriter::EnforceBufferLimitLocked() {
+  if (options_.max_buffered_bytes == 0) return absl::OkStatus();
+  UpdateBufferedBytesLocked();
+
+  auto num_buffered_items = [this]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    return write_queue_.size() + unconfirmed_items_.size();
+  };
+
+  if (options_.buffer_overflow_policy !=
+      Options::BufferOverflowPolicy::kBlock) {
+    while (buffered_bytes_ > options_.max_buffered_bytes &&
+           num_buffered_items() > 1) {
+      DropItemLocked();
+    }
+    return absl::OkStatus();
+  }
+
+  auto cond = [&]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    if (!unrecoverable_status_.ok()) return true;
+    UpdateBufferedBytesLocked();
+    return buffered_bytes_ <= options_.max_buffered_bytes ||
+           num_buffered_items() <= 1;
+  };
+  mu_.Await(absl::Condition(&cond));
+  return unrecoverable_status_;
+}
+
+void TrajectoryWriter::DropItemLocked() {
+  num_dropped_items_++;
+
+  // Items which have been written are older than those which have not.
+  if (!unconfirmed_items_.empty()) {
+    RemoveFromBufferLocked(unconfirmed_items_.front());
+    unconfirmed_items_.pop_front();
+    return;
+  }
+
+  auto it = write_queue_.begin();
+  if (options_.buffer_overflow_policy ==
+      Options::BufferOverflowPolicy::kDropLowestPriority) {
+    it = std::min_element(write_queue_.begin(), write_queue_.end(),
+                          [](const ItemAndRefs& a, const ItemAndRefs& b) {
+                            return a.item.priority() < b.item.priority();
+                          });
+  }
+  RemoveFromBufferLocked(*it);
+  write_queue_.erase(it);
+}
+
+int64_t TrajectoryWriter::num_dropped_items() const {
+  absl::MutexLock lock(&mu_);
+  return num_dropped_items_;
 }
 
 void TrajectoryColumn::ToProto(FlatTrajectory::Column* proto) const {
@@ -534,6 +1064,9 @@ void TrajectoryWriter::Close() {
     if (context_ != nullptr) {
       context_->TryCancel();
     }
+    if (local_stream_ != nullptr) {
+      local_stream_->TryCancel();
+    }
 
     // This will unblock the worker if the front pending item is referencing
     // incomplete chunks and the worker is waiting for that to change.
@@ -544,10 +1077,70 @@ void TrajectoryWriter::Close() {
   stream_worker_ = nullptr;
 }
 
+void TrajectoryWriter::MaybeNegotiateSharedMemory() {
+  if (options_.shared_memory_bytes == 0 || shared_memory_negotiated_ ||
+      stub_ == nullptr) {
+    return;
+  }
+  shared_memory_negotiated_ = true;
+
+  std::unique_ptr<internal::SharedMemoryRing> ring;
+  if (auto status = internal::SharedMemoryRing::Create(
+          options_.shared_memory_bytes, &ring);
+      !status.ok()) {
+    REVERB_LOG(REVERB_WARNING)
+        << "Unable to create shared memory segment, chunks will be sent "
+           "through the gRPC stream: "
+        << status;
+    return;
+  }
+
+  grpc::ClientContext context;
+  context.set_wait_for_ready(false);
+  context.set_deadline(
+      absl::ToChronoTime(absl::Now() + kSharedMemoryNegotiationTimeout));
+  auto stream = stub_->InitializeConnection(&context);
+
+  InitializeConnectionRequest request;
+  request.set_pid(getpid());
+  request.set_shared_memory_name(ring->name());
+  InitializeConnectionResponse response;
+  const bool responded = stream->Write(request) && stream->Read(&response);
+  stream->WritesDone();
+  auto status = FromGrpcStatus(stream->Finish());
+
+  if (!responded || !status.ok() ||
+      response.shared_memory_token() != ring->token()) {
+    REVERB_LOG(REVERB_INFO)
+        << "Server could not map the shared memory segment, chunks will be "
+           "sent through the gRPC stream. Status: "
+        << status;
+    return;
+  }
+
+  shared_memory_ = std::move(ring);
+}
+
+void TrajectoryWriter::ReleaseConfirmedSharedMemoryLocked() {
+  // Items are confirmed in the order they were written so the memory of the
+  // items written before the oldest unconfirmed item can be released.
+  while (!shared_memory_releases_.empty() &&
+         (in_flight_items_.empty() ||
+          shared_memory_releases_.front().first != in_flight_items_.front())) {
+    shared_memory_->Release(shared_memory_releases_.front().second);
+    shared_memory_releases_.pop_front();
+  }
+}
+
 std::unique_ptr<TrajectoryWriter::InsertStream>
 TrajectoryWriter::SetContextAndCreateStream() {
   absl::MutexLock lock(&mu_);
   REVERB_CHECK(unrecoverable_status_.ok());
+  if (!local_tables_.empty()) {
+    auto stream = absl::make_unique<internal::LocalInsertStream>(local_tables_);
+    local_stream_ = stream.get();
+    return stream;
+  }
   context_ = absl::make_unique<grpc::ClientContext>();
   context_->set_wait_for_ready(false);
   return stub_->InsertStream(context_.get());
@@ -572,26 +1165,65 @@ bool TrajectoryWriter::GetNextPendingItem(
 bool TrajectoryWriter::SendItem(
     TrajectoryWriter::InsertStream* stream,
     const internal::flat_hash_set<uint64_t>& keep_keys,
-    const PrioritizedItem& item) const {
+    const std::vector<uint64_t>& released_keys, const PrioritizedItem& item,
+    const InsertStreamRequest::AssembledTrajectory* assembled,
+    bool send_confirmation, InsertStreamRequest* batch) const {
+  auto populate = [&](InsertStreamRequest::PriorityInsertion* insertion) {
+    insertion->set_allocated_item(const_cast<PrioritizedItem*>(&item));
+    insertion->set_send_confirmation(send_confirmation);
+    if (assembled != nullptr) {
+      *insertion->mutable_assembled_trajectory() = *assembled;
+    }
+    if (options_.send_released_chunk_keys) {
+      insertion->set_keep_unreleased_chunks(true);
+      insertion->mutable_released_chunk_keys()->Add(released_keys.begin(),
+                                                    released_keys.end());
+    } else {
+      for (auto keep_key : keep_keys) {
+        insertion->add_keep_chunk_keys(keep_key);
+      }
+    }
+  };
+
+  if (batch != nullptr) {
+    populate(batch->mutable_batch()->add_requests()->mutable_item());
+    return WriteBatch(stream, batch);
+  }
+
   InsertStreamRequest request;
-  request.mutable_item()->set_allocated_item(
-      const_cast<PrioritizedItem*>(&item));
+  populate(request.mutable_item());
   auto realease_item = internal::MakeCleanup(
       [&request] { request.mutable_item()->release_item(); });
-  request.mutable_item()->set_send_confirmation(true);
-  for (auto keep_key : keep_keys) {
-    request.mutable_item()->add_keep_chunk_keys(keep_key);
-  }
   return stream->Write(request);
 }
 
+void TrajectoryWriter::ConfirmItemsLocked(uint64_t key) {
+  auto it = std::find(in_flight_items_.begin(), in_flight_items_.end(), key);
+  if (it != in_flight_items_.end()) {
+    in_flight_items_.erase(in_flight_items_.begin(), std::next(it));
+  }
+
+  auto item_it = std::find_if(
+      unconfirmed_items_.begin(), unconfirmed_items_.end(),
+      [key](const ItemAndRefs& item) { return item.item.key() == key; });
+  if (item_it != unconfirmed_items_.end()) {
+    for (auto confirmed = unconfirmed_items_.begin();
+         confirmed != std::next(item_it); ++confirmed) {
+      RemoveFromBufferLocked(*confirmed);
+    }
+    unconfirmed_items_.erase(unconfirmed_items_.begin(), std::next(item_it));
+  }
+}
+
 internal::flat_hash_set<uint64_t> TrajectoryWriter::GetKeepKeys(
     const internal::flat_hash_set<uint64_t>& streamed_chunk_keys) const {
   internal::flat_hash_set<uint64_t> keys;
-  for (const auto& it : chunkers_) {
-    for (uint64_t key : it.second->GetKeepKeys()) {
-      if (streamed_chunk_keys.contains(key)) {
-        keys.insert(key);
+  for (const auto& chunkers : chunkers_) {
+    for (const auto& it : chunkers) {
+      for (uint64_t key : it.second->GetKeepKeys()) {
+        if (streamed_chunk_keys.contains(key)) {
+          keys.insert(key);
+        }
       }
     }
   }
@@ -613,35 +1245,99 @@ internal::flat_hash_set<uint64_t> TrajectoryWriter::GetKeepKeys(
 }
 
 absl::Status TrajectoryWriter::RunStreamWorker() {
+  MaybeNegotiateSharedMemory();
+
+  // Chunks written to the shared memory by a previous stream are resent on the
+  // new stream so all of the memory can be reused.
+  if (shared_memory_ != nullptr) {
+    absl::MutexLock lock(&mu_);
+    shared_memory_releases_.clear();
+    shared_memory_->Reset();
+  }
+
+  internal::ScopedTrace open_trace("InsertStream/Open");
   auto stream = SetContextAndCreateStream();
+  open_trace.Stop();
+  auto clear_local_stream = internal::MakeCleanup([this] {
+    absl::MutexLock lock(&mu_);
+    local_stream_ = nullptr;
+  });
 
   auto reader = internal::StartThread("TrajectoryWriter_ReaderWorker", [&] {
     InsertStreamResponse response;
     while (stream->Read(&response)) {
+      internal::TraceInstant([&response] {
+        return absl::StrCat("InsertStream/Confirmed#num_items=",
+                            response.keys_size() + 1, "#");
+      });
       absl::MutexLock lock(&mu_);
-      in_flight_items_.erase(response.key());
+      received_confirmation_ = true;
+      ConfirmItemsLocked(response.key());
+      for (uint64_t key : response.keys()) {
+        ConfirmItemsLocked(key);
+      }
+      if (shared_memory_ != nullptr) {
+        ReleaseConfirmedSharedMemoryLocked();
+      }
     }
   });
 
+  // When coalescing, the chunks of an item are collected in `batch` and written
+  // together with the item as a single message.
+  InsertStreamRequest batch;
+  InsertStreamRequest* batch_ptr =
+      options_.coalesce_requests ? &batch : nullptr;
+  auto release_batch =
+      internal::MakeCleanup([&batch] { ReleaseBatch(&batch); });
+
   internal::flat_hash_set<uint64_t> streamed_chunk_keys;
+  std::vector<uint64_t> released_keys;
+
+  // Column IDs under which the server indexes the chunks of each chunker. Only
+  // used when `options_.assemble_items_on_server`.
+  internal::flat_hash_map<const Chunker*, int32_t> chunk_columns;
+  InsertStreamRequest::AssembledTrajectory assembled;
   while (true) {
     ItemAndRefs item_and_refs;
+    bool send_confirmation;
 
+    internal::ScopedTrace wait_trace("TrajectoryWriter/WaitForItem");
     if (!GetNextPendingItem(&item_and_refs)) {
       return FromGrpcStatus(stream->Finish());
     }
+    wait_trace.Stop();
 
     // Send referenced chunks which haven't already been sent.
     for (const auto& ref : item_and_refs.refs) {
       if (!ref->IsReady() || streamed_chunk_keys.contains(ref->chunk_key())) {
         continue;
       }
-      if (!SendChunk(stream.get(), *ref)) {
+      int32_t chunk_column = 0;
+      if (options_.assemble_items_on_server) {
+        chunk_column =
+            chunk_columns
+                .try_emplace(ref->chunker().lock().get(),
+                             chunk_columns.size() + 1)
+                .first->second;
+      }
+      internal::ScopedTrace send_trace([&ref] {
+        return absl::StrCat("InsertStream/SendChunk#chunk_key=",
+                            ref->chunk_key(), "#");
+      });
+      if (!SendChunk(stream.get(), *ref, chunk_column, shared_memory_.get(),
+                     &shared_memory_position_, batch_ptr)) {
         return FromGrpcStatus(stream->Finish());
       }
       streamed_chunk_keys.insert(ref->chunk_key());
     }
 
+    // The chunks of an item which cannot be sent yet are written straight
+    // away rather than held back while the worker waits for the rest.
+    if (!ContainsAll(streamed_chunk_keys, item_and_refs.refs) &&
+        !WriteBatch(stream.get(), &batch)) {
+      return FromGrpcStatus(stream->Finish());
+    }
+
     {
       absl::WriterMutexLock lock(&mu_);
       // Check whether all chunks referenced by the item have been written to
@@ -653,36 +1349,83 @@ absl::Status TrajectoryWriter::RunStreamWorker() {
         // sleep until the chunks changed. If all the chunks are now completed
         // then we move straight to the top of the loop.
         if (!AllReady(item_and_refs.refs)) {
+          internal::ScopedTrace trace("TrajectoryWriter/WaitForChunks");
           data_cv_.Wait(&mu_);
         }
         continue;
       }
 
-      in_flight_items_.insert(item_and_refs.item.key());
+      // Confirmation is requested for every `items_per_confirmation`th item
+      // and whenever the worker might have to wait after this item, i.e. if
+      // the next item is missing or references incomplete chunks.
+      send_confirmation =
+          (options_.items_per_confirmation > 0 &&
+           ++items_since_confirmation_ >= options_.items_per_confirmation) ||
+          write_queue_.size() == 1 || !AllReady(write_queue_[1].refs);
+      if (send_confirmation) {
+        items_since_confirmation_ = 0;
+      }
+      in_flight_items_.push_back(item_and_refs.item.key());
+      if (shared_memory_ != nullptr) {
+        shared_memory_releases_.emplace_back(item_and_refs.item.key(),
+                                             shared_memory_position_);
+      }
 
       // Remove keys of expired chunks from streamed_chunk_keys to avoid OOM
-      // issues caused by the otherwise indefinitely growing hash set.
-      streamed_chunk_keys = GetKeepKeys(streamed_chunk_keys);
+      // issues caused by the otherwise indefinitely growing hash set. The
+      // server holds on to exactly the streamed chunks so the removed keys are
+      // the ones it can release.
+      auto keep_keys = GetKeepKeys(streamed_chunk_keys);
+      released_keys.clear();
+      if (options_.send_released_chunk_keys) {
+        for (uint64_t key : streamed_chunk_keys) {
+          if (!keep_keys.contains(key)) released_keys.push_back(key);
+        }
+      }
+      streamed_chunk_keys = std::move(keep_keys);
+    }
+
+    // The trajectory is replaced by a description the server expands if
+    // possible. `item_and_refs` is a copy so the queued item is unaffected.
+    bool use_assembled =
+        options_.assemble_items_on_server &&
+        AssembleTrajectory(item_and_refs.item, item_and_refs.refs,
+                           chunk_columns, &assembled);
+    if (use_assembled) {
+      item_and_refs.item.clear_flat_trajectory();
     }
 
     // All chunks have been written to the stream so the item can now be
     // written.
-    if (!SendItem(stream.get(), streamed_chunk_keys, item_and_refs.item)) {
+    internal::ScopedTrace send_trace([&item_and_refs] {
+      return absl::StrCat("InsertStream/SendItem#key=",
+                          item_and_refs.item.key(), "#");
+    });
+    if (!SendItem(stream.get(), streamed_chunk_keys, released_keys,
+                  item_and_refs.item, use_assembled ? &assembled : nullptr,
+                  send_confirmation, batch_ptr)) {
       {
         absl::WriterMutexLock lock(&mu_);
-        in_flight_items_.erase(item_and_refs.item.key());
+        in_flight_items_.pop_back();
       }
       return FromGrpcStatus(stream->Finish());
     }
 
-    // Item has been sent so we can now pop it from the queue. Note that by
-    // deallocating the ItemAndRefs object we are allowing the underlying
-    // ChunkData to be deallocated.
+    // Item has been sent so we can now pop it from the queue. It is held
+    // (together with the underlying ChunkData) until it has been confirmed by
+    // the server unless the confirmation has already been received. Note that
+    // the item could have been dropped while it was being written.
     {
       absl::MutexLock lock(&mu_);
-      // TODO(b/178090185): Maybe keep the item and references around until the
-      // item has been confirmed by the server.
-      write_queue_.pop_front();
+      const uint64_t key = item_and_refs.item.key();
+      if (!write_queue_.empty() && write_queue_.front().item.key() == key) {
+        if (!in_flight_items_.empty() && in_flight_items_.back() == key) {
+          unconfirmed_items_.push_back(std::move(write_queue_.front()));
+        } else {
+          RemoveFromBufferLocked(write_queue_.front());
+        }
+        write_queue_.pop_front();
+      }
     }
   }
 
@@ -695,8 +1438,16 @@ absl::Status TrajectoryWriter::Flush(int ignore_last_num_items,
   return FlushLocked(ignore_last_num_items, timeout);
 }
 
+absl::Status TrajectoryWriter::FlushWithoutRetries() {
+  absl::MutexLock lock(&mu_);
+  return FlushLocked(/*ignore_last_num_items=*/0,
+                     /*timeout=*/absl::InfiniteDuration(),
+                     /*retry_on_unavailable=*/false);
+}
+
 absl::Status TrajectoryWriter::FlushLocked(int ignore_last_num_items,
-                                           absl::Duration timeout) {
+                                           absl::Duration timeout,
+                                           bool retry_on_unavailable) {
   // If items are referencing any data which has not yet been finalized into a
   // `ChunkData` then force the chunk to be created prematurely. This will allow
   // the worker to write all items to the stream. Note that we don't need to
@@ -708,7 +1459,11 @@ absl::Status TrajectoryWriter::FlushLocked(int ignore_last_num_items,
 
     for (auto& ref : item.refs) {
       if (!ref->IsReady()) {
-        REVERB_RETURN_IF_ERROR(ref->chunker().lock()->Flush());
+        // Chunks which are already being compressed do not have to be forced.
+        auto chunker = ref->chunker().lock();
+        if (!chunker->IsCompressing(ref->chunk_key())) {
+          REVERB_RETURN_IF_ERROR(chunker->Flush());
+        }
       }
     }
   }
@@ -720,11 +1475,17 @@ absl::Status TrajectoryWriter::FlushLocked(int ignore_last_num_items,
   // The write worker is now able to send  (at least) all but the last
   // `ignore_last_num_items` items to the server. We release the mutex and wait
   // for the items to be confirmed or the TrajectoryWriter to be closed.
-  auto cond = [ignore_last_num_items,
+  const int64_t num_unavailable_streams = num_unavailable_streams_;
+  auto cond = [ignore_last_num_items, retry_on_unavailable,
+               num_unavailable_streams,
                this]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
     if (!unrecoverable_status_.ok()) {
       return true;
     }
+    if (!retry_on_unavailable &&
+        num_unavailable_streams_ != num_unavailable_streams) {
+      return true;
+    }
 
     // Items are considered pending until they are confirmed by the server so
     // both `write_queue_` and `in_flight_items_` must be counted. However, to
@@ -733,8 +1494,8 @@ absl::Status TrajectoryWriter::FlushLocked(int ignore_last_num_items,
     // release the mutex for a period in order to perform the actual write to
     // the gRPC stream. We check for this here to avoid double counting.
     int num_pending_items = write_queue_.size() + in_flight_items_.size();
-    if (!write_queue_.empty() &&
-        in_flight_items_.contains(write_queue_.front().item.key())) {
+    if (!write_queue_.empty() && !in_flight_items_.empty() &&
+        in_flight_items_.back() == write_queue_.front().item.key()) {
       num_pending_items--;
     }
 
@@ -749,9 +1510,25 @@ absl::Status TrajectoryWriter::FlushLocked(int ignore_last_num_items,
   }
 
   REVERB_RETURN_IF_ERROR(unrecoverable_status_);
+  if (!retry_on_unavailable &&
+      num_unavailable_streams_ != num_unavailable_streams &&
+      write_queue_.size() > ignore_last_num_items) {
+    return absl::UnavailableError(
+        absl::StrCat("The stream to the server failed with ",
+                     write_queue_.size(), " items not yet confirmed."));
+  }
   return absl::OkStatus();
 }
 
+absl::Status TrajectoryWriter::AwaitInFlightItems(int limit) {
+  absl::MutexLock lock(&mu_);
+  auto cond = [limit, this]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    return !unrecoverable_status_.ok() || in_flight_items_.size() <= limit;
+  };
+  mu_.Await(absl::Condition(&cond));
+  return unrecoverable_status_;
+}
+
 absl::Status TrajectoryWriter::EndEpisode(bool clear_buffers,
                                                 absl::Duration timeout) {
   absl::MutexLock lock(&mu_);
@@ -759,7 +1536,30 @@ absl::Status TrajectoryWriter::EndEpisode(bool clear_buffers,
 
   REVERB_RETURN_IF_ERROR(FlushLocked(0, timeout));
 
-  for (auto& it : chunkers_) {
+  for (int episode = 0; episode < episodes_.size(); episode++) {
+    REVERB_RETURN_IF_ERROR(EndEpisodeLocked(episode, clear_buffers));
+  }
+  return absl::OkStatus();
+}
+
+absl::Status TrajectoryWriter::EndEpisode(int episode, bool clear_buffers,
+                                          absl::Duration timeout) {
+  if (episode < 0 || episode >= options_.num_episodes) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("episode must be in [0, ", options_.num_episodes,
+                     ") but got ", episode, "."));
+  }
+
+  absl::MutexLock lock(&mu_);
+  REVERB_RETURN_IF_ERROR(unrecoverable_status_);
+
+  REVERB_RETURN_IF_ERROR(FlushLocked(0, timeout));
+  return EndEpisodeLocked(episode, clear_buffers);
+}
+
+absl::Status TrajectoryWriter::EndEpisodeLocked(int episode,
+                                                bool clear_buffers) {
+  for (auto& it : chunkers_[episode]) {
     if (clear_buffers) {
       it.second->Reset();
     } else {
@@ -770,18 +1570,31 @@ absl::Status TrajectoryWriter::EndEpisode(bool clear_buffers,
     }
   }
 
-  episode_id_ = NewKey();
-  episode_step_ = 0;
+  episodes_[episode] = {NewKey(), 0};
   return absl::OkStatus();
 }
 
+void TrajectoryWriter::SetEpisodeId(uint64_t episode_id) {
+  absl::MutexLock lock(&mu_);
+  REVERB_CHECK_EQ(episodes_.size(), 1);
+  REVERB_CHECK_EQ(episodes_[0].step, 0);
+  episodes_[0].id = episode_id;
+}
+
 absl::Status TrajectoryWriter::ConfigureChunker(int column,
                                                 const Options& options) {
   REVERB_RETURN_IF_ERROR(options.Validate());
 
-  if (auto it = chunkers_.find(column); it != chunkers_.end()) {
-    return it->second->ApplyConfig(options.max_chunk_length,
-                                   options.num_keep_alive_refs);
+  // The options are applied to the chunkers of the column in every episode
+  // and kept for the episodes which have not yet created the chunker.
+  for (auto& chunkers : chunkers_) {
+    if (auto it = chunkers.find(column); it != chunkers.end()) {
+      REVERB_RETURN_IF_ERROR(it->second->ApplyConfig(
+          ChunkLength(options, it->second->spec()),
+          options.num_keep_alive_refs, options.codec,
+          options.deduplicate_frames, options.quantization,
+          options.rows_per_block));
+    }
   }
 
   options_override_[column] = options;
@@ -802,6 +1615,42 @@ absl::Status TrajectoryWriter::Options::Validate() const {
         "num_keep_alive_refs (", num_keep_alive_refs,
         ") must be >= max_chunk_length (", max_chunk_length, ")."));
   }
+  if (shared_memory_bytes < 0) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "shared_memory_bytes must be >= 0 but got ", shared_memory_bytes,
+        "."));
+  }
+  if (num_episodes <= 0) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "num_episodes must be > 0 but got ", num_episodes, "."));
+  }
+  if (items_per_confirmation < 0) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("items_per_confirmation must be >= 0 but got ",
+                     items_per_confirmation, "."));
+  }
+  if (target_chunk_bytes < 0) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "target_chunk_bytes must be >= 0 but got ", target_chunk_bytes, "."));
+  }
+  if (rows_per_block < 0) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "rows_per_block must be >= 0 but got ", rows_per_block, "."));
+  }
+  if (max_buffered_bytes < 0) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "max_buffered_bytes must be >= 0 but got ", max_buffered_bytes, "."));
+  }
+  if (num_compression_threads < 0) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("num_compression_threads must be >= 0 but got ",
+                     num_compression_threads, "."));
+  }
+  if (GetTensorCodec(codec) == nullptr) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("codec ", ChunkData::Codec_Name(codec),
+                     " has not been registered."));
+  }
   return absl::OkStatus();
 }
 
@@ -15,8 +15,12 @@
 #ifndef REVERB_CC_TRAJECTORY_WRITER_H_
 #define REVERB_CC_TRAJECTORY_WRITER_H_
 
+#include <cstdint>
 #include <deque>
+#include <functional>
 #include <memory>
+#include <string>
+#include <utility>
 #include <vector>
 
 #include "grpcpp/impl/codegen/client_context.h"
@@ -29,11 +33,16 @@
 #include "absl/types/span.h"
 #include "reverb/cc/platform/hash_map.h"
 #include "reverb/cc/platform/hash_set.h"
+#include "reverb/cc/local_insert_stream.h"
 #include "reverb/cc/platform/thread.h"
 #include "reverb/cc/reverb_service.grpc.pb.h"
 #include "reverb/cc/reverb_service.pb.h"
 #include "reverb/cc/schema.pb.h"
+#include "reverb/cc/support/shared_memory.h"
 #include "reverb/cc/support/signature.h"
+#include "reverb/cc/support/slot_pool.h"
+#include "reverb/cc/support/thread_pool.h"
+#include "reverb/cc/table.h"
 #include "tensorflow/core/framework/tensor.h"
 
 namespace deepmind {
@@ -43,6 +52,7 @@ namespace reverb {
 
 class CellRef;
 class Chunker;
+class ShardedTrajectoryWriter;
 class TrajectoryColumn;
 
 // With the exception of `Close`, none of the methods are thread safe.
@@ -65,17 +75,148 @@ class TrajectoryWriter {
     // expire with different `TrajectoryWriter::Append` calls.
     int num_keep_alive_refs;
 
+    // If > 0 then the writer tries to send chunks through a shared memory ring
+    // buffer of this size instead of the gRPC stream. The transport is
+    // negotiated with `InitializeConnection` and the writer falls back to the
+    // stream if the server is not on the same host, or if a chunk does not fit
+    // in the free space of the ring. Ignored by `ConfigureChunker`.
+    int64_t shared_memory_bytes = 0;
+
+    // Codec used to compress the chunks. Set per column with `ConfigureChunker`
+    // to e.g. skip the compression of small columns or to use a stronger codec
+    // for images. Codecs other than `SNAPPY` and `NONE` must have been
+    // registered with `RegisterTensorCodec`. Sampled columns which cover a
+    // single chunk stored with `NONE` share the memory of the chunk instead of
+    // being copied (see `AliasUncompressedTensor`), unless they are quantized
+    // or deduplicated.
+    ChunkData::Codec codec = ChunkData::SNAPPY;
+
+    // If true then identical frames (the sub-tensors along the first dimension
+    // of each appended tensor) are stored once per chunk, see
+    // `DeduplicateFrames`. Intended for stacked observations, e.g. Atari frame
+    // stacks of shape [4, 84, 84] where consecutive steps share all but one
+    // frame, which then only take up the memory of the unique frames. The stack
+    // must be the leading dimension of the column for the frames to be found.
+    bool deduplicate_frames = false;
+
+    // Lossy encoding applied to float32 columns before they are compressed,
+    // see `ChunkData::Quantization`. The sampled columns are dequantized so
+    // their dtype is unchanged. Ignored for columns of other dtypes. Note that
+    // `CellRef::GetData` also returns the dequantized data once the chunk has
+    // been finalized.
+    ChunkData::Quantization quantization = ChunkData::NO_QUANTIZATION;
+
+    // If > 0 then chunks are encoded and compressed by a pool of this many
+    // threads instead of by the thread calling `Append` which fills the chunk.
+    // `Append` then returns as soon as the data has been buffered and the
+    // `CellRef`s of the chunk become ready once the compression has completed.
+    // Ignored by `ConfigureChunker`.
+    int num_compression_threads = 0;
+
+    // If > 0 then the chunks are compressed in independent blocks of this many
+    // rows (i.e. steps) so that sampling a few steps of a long chunk, or
+    // calling `CellRef::GetData`, only decompresses the blocks covering them
+    // at the cost of a slightly worse compression ratio. Ignored for string
+    // columns and columns with deduplicated frames.
+    int rows_per_block = 0;
+
+    // If > 0 then the length of the chunks of each column is derived from the
+    // size of its rows such that a chunk holds about this many (uncompressed)
+    // bytes, with `max_chunk_length` as an upper bound. Columns of large rows
+    // (e.g. images) then get short chunks, which can be released as soon as
+    // the few items referencing them have been removed, while small columns
+    // (e.g. rewards) get long chunks which compress better and amortize the
+    // per chunk overhead. Columns of strings always use `max_chunk_length`.
+    int64_t target_chunk_bytes = 0;
+
+    // Confirmation is requested for every `items_per_confirmation`th item
+    // written to the stream. The server confirms the items of a stream in order
+    // so the confirmation of an item also confirms the items written before
+    // it, which allows many items to be in flight with few round trips on high
+    // latency connections. Regardless of this option, confirmation is always
+    // requested for the last item written before the worker would have to wait
+    // for more items (or chunks), so `Flush` and `EndEpisode` never wait for
+    // items which will not be confirmed. If 0 then confirmations are only
+    // requested for such items. Note that `Flush(ignore_last_num_items)` counts
+    // items as pending until they have been confirmed.
+    int items_per_confirmation = 1;
+
+    // Number of episodes which are written concurrently, e.g. one per
+    // environment of an actor which steps a batch of environments in lockstep.
+    // Each episode has its own chunkers but the chunks and items of all
+    // episodes are sent through a single stream. `Append` writes to the first
+    // episode while `AppendBatch` writes one step to every episode.
+    int num_episodes = 1;
+
+    // If true then the chunks of an item are written to the stream together
+    // with the item as a single (batch) message rather than one message each,
+    // which saves the per message overhead when items reference many small
+    // chunks. Requires a server which supports batched requests.
+    bool coalesce_requests = false;
+
+    // If true then items tell the server which chunks are no longer needed
+    // rather than listing every chunk it should keep. This makes the size of
+    // the item messages (and the work done by the server) proportional to the
+    // chunks released by the item rather than to all the chunks kept alive by
+    // the writer. Requires a server which supports `keep_unreleased_chunks`.
+    bool send_released_chunk_keys = false;
+
+    // If true then items whose columns each cover consecutive steps of a
+    // single episode are sent as an `AssembledTrajectory` ("the last N steps
+    // of column X") which the server expands against the chunks it holds,
+    // rather than as a full `FlatTrajectory`. Other items are sent as usual.
+    // Requires a server which supports `assembled_trajectory`.
+    bool assemble_items_on_server = false;
+
+    // What to do once the buffer of the writer holds `max_buffered_bytes`.
+    enum class BufferOverflowPolicy {
+      // `CreateItem` blocks until the server has confirmed enough items.
+      kBlock,
+
+      // The oldest items are dropped (see `num_dropped_items`) so `CreateItem`
+      // never blocks. Dropped items may or may not have been written to the
+      // server already.
+      kDropOldest,
+
+      // Items which have been written to the server are dropped first, then
+      // the items with the lowest priority (the oldest of them in case of a
+      // tie). The server stops confirming items while its rate limiter blocks
+      // inserts, so with this policy writers keep a constant rate and only
+      // the most important items wait for the server rather than the caller.
+      kDropLowestPriority,
+    };
+
+    // If > 0 then the (finalized) chunks held for items which have not been
+    // confirmed by the server are limited to about this many bytes, with
+    // `buffer_overflow_policy` deciding what happens once the limit is reached.
+    // Items are held until they are confirmed so that the items written to a
+    // stream which fails, e.g because the server restarted, can be written
+    // again once the writer has reconnected. Note that at least one item is
+    // always kept, even if it exceeds the limit on its own.
+    int64_t max_buffered_bytes = 0;
+
+    BufferOverflowPolicy buffer_overflow_policy = BufferOverflowPolicy::kBlock;
+
     // Checks that field values are valid and returns `InvalidArgument` if any
     // field value, or combination of field values, are invalid.
     absl::Status Validate() const;
   };
 
-  // TODO(b/178084425): Allow chunking options to be specified for each column.
+  // `options` apply to every column. The chunking options of individual
+  // columns can be overridden with `ConfigureChunker`.
+  //
   // TODO(b/178085651): Support initiation using the table signature.
   explicit TrajectoryWriter(
       std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface> stub,
       const Options& options);
 
+  // Writes directly to `tables`, which must be owned by the same process,
+  // using an `internal::LocalInsertStream` instead of a gRPC stream. Items can
+  // only be created for the tables in `tables`.
+  TrajectoryWriter(
+      internal::flat_hash_map<std::string, std::shared_ptr<Table>> tables,
+      const Options& options);
+
   // Flushes pending items and then closes stream. If `Close` has already been
   // called then no action is taken.
   ~TrajectoryWriter();
@@ -100,6 +241,21 @@ class TrajectoryWriter {
       std::vector<absl::optional<std::weak_ptr<CellRef>>>* refs)
       ABSL_LOCKS_EXCLUDED(mu_);
 
+  // Same as `Append` but appends one step to each of the `num_episodes`
+  // episodes (see `Options::num_episodes`). Every provided tensor of `data`
+  // must have a leading dimension of size `num_episodes` with the data of
+  // episode `i` in row `i`.
+  //
+  // `refs` is resized to `num_episodes` and `refs[i]` receives the references
+  // of episode `i` as with `Append`. The references of the different episodes
+  // can not be mixed within the same column of a trajectory since they are
+  // held by different chunkers. If an error is returned then the step may
+  // have been appended to some of the episodes.
+  absl::Status AppendBatch(
+      std::vector<absl::optional<tensorflow::Tensor>> data,
+      std::vector<std::vector<absl::optional<std::weak_ptr<CellRef>>>>* refs)
+      ABSL_LOCKS_EXCLUDED(mu_);
+
   // Defines an item representing the data of `trajectory` and enques it for
   // insertion into `table` where it can be sampled according to `priority`.
   //
@@ -113,10 +269,10 @@ class TrajectoryWriter {
   //
   // Note that this method will not block and wait for the IO to complete. This
   // means that if only `Append` and `CreateItem` are used then the caller will
-  // not be impacted by the rate limiter on the server. Furthermore, the buffer
-  // of pending items (and referenced data) could grow until the process runs
-  // out of memory. The caller must therefore use `Flush` to achieve the
-  // desired level of synchronization.
+  // not be impacted by the rate limiter on the server. Furthermore, unless
+  // `max_buffered_bytes` is set, the buffer of pending items (and referenced
+  // data) could grow until the process runs out of memory. The caller must
+  // therefore use `Flush` to achieve the desired level of synchronization.
   absl::Status CreateItem(absl::string_view table, double priority,
                           absl::Span<const TrajectoryColumn> trajectory)
       ABSL_LOCKS_EXCLUDED(mu_);
@@ -143,20 +299,43 @@ class TrajectoryWriter {
   absl::Status EndEpisode(
       bool clear_buffers, absl::Duration timeout = absl::InfiniteDuration());
 
+  // Same as `EndEpisode` but only finalizes the chunks of, and resets, episode
+  // `episode` (see `Options::num_episodes`). The other episodes continue
+  // unaffected, though the pending items of all episodes are confirmed.
+  absl::Status EndEpisode(
+      int episode, bool clear_buffers,
+      absl::Duration timeout = absl::InfiniteDuration());
+
   // Closes the stream, joins the worker thread and unblocks any concurrent
   // `Flush` call. All future (and concurrent) calls returns CancelledError once
   void Close() ABSL_LOCKS_EXCLUDED(mu_);
 
-  // Attempts to configure a column `Chunker` (see `Chunker::Configure` for
+  // Attempts to configure a column `Chunker` (see `Chunker::ApplyConfig` for
   // details). If no `Chunker` exists for the column then the options will be
   // used to create the chunker when the column is present for the first time
-  // in the data of an `Append` call.
+  // in the data of an `Append` call. The chunk length of the column is derived
+  // from `options.max_chunk_length` and `options.target_chunk_bytes`.
   absl::Status ConfigureChunker(int column, const Options& options);
 
+  // Number of items which have been dropped because the buffer was full (see
+  // `Options::buffer_overflow_policy`).
+  int64_t num_dropped_items() const ABSL_LOCKS_EXCLUDED(mu_);
+
  private:
+  friend class ShardedTrajectoryWriter;
+  friend class Writer;
+
   using InsertStream = grpc::ClientReaderWriterInterface<InsertStreamRequest,
                                                          InsertStreamResponse>;
 
+  struct Episode {
+    // ID of the episode.
+    uint64_t id;
+
+    // Step within the episode.
+    int step;
+  };
+
   struct ItemAndRefs {
     PrioritizedItem item;
 
@@ -166,12 +345,56 @@ class TrajectoryWriter {
     std::vector<std::shared_ptr<CellRef>> refs;
   };
 
+  // A chunk referenced by items which are counted by `buffered_bytes_`.
+  struct BufferedChunk {
+    // Number of buffered items referencing the chunk.
+    int num_items;
+
+    // Size of the chunk, or -1 if it has not been finalized yet.
+    int64_t bytes;
+
+    // Reference used to size the chunk once it has been finalized.
+    std::shared_ptr<CellRef> ref;
+  };
+
+  // Replaces the ID of the active episode. Must only be called before the
+  // first `Append` of the episode and only if `num_episodes` is 1. Used by
+  // `ShardedTrajectoryWriter` to keep the episode IDs consistent across the
+  // writers of all shards.
+  void SetEpisodeId(uint64_t episode_id) ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Appends `data` to the chunkers of episode `episode`. See `Append`.
+  absl::Status AppendToEpisode(
+      int episode, std::vector<absl::optional<tensorflow::Tensor>> data,
+      std::vector<absl::optional<std::weak_ptr<CellRef>>>* refs)
+      ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Finalizes (or resets if `clear_buffers`) the chunks of episode `episode`
+  // and starts a new episode in its place.
+  absl::Status EndEpisodeLocked(int episode, bool clear_buffers)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
   // Sends all but the last `ignore_last_num_items` pending items and awaits
   // confirmation. Incomplete chunks referenced by non ignored items are
-  // finalized and transmitted.
-  absl::Status FlushLocked(int ignore_last_num_items, absl::Duration timeout)
+  // finalized and transmitted. If `retry_on_unavailable` is false then
+  // UnavailableError is returned as soon as a stream fails with a transient
+  // error rather than waiting for the worker to reconnect.
+  absl::Status FlushLocked(int ignore_last_num_items, absl::Duration timeout,
+                           bool retry_on_unavailable = true)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
 
+  // Like `Flush` but gives up with UnavailableError if the stream to the
+  // server fails with a transient error before all items have been confirmed.
+  // The unconfirmed items remain queued. Used by `Writer::Close` when retries
+  // are disabled.
+  absl::Status FlushWithoutRetries() ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Blocks until at most `limit` items have been written to the stream without
+  // being confirmed by the server, or until an error is encountered. Unlike
+  // `Flush`, items waiting for their chunks to be finalized are neither counted
+  // nor forced to be sent. Used by `Writer` to bound the items in flight.
+  absl::Status AwaitInFlightItems(int limit) ABSL_LOCKS_EXCLUDED(mu_);
+
   // Creates a gRPC stream to the server with `context_` and continues to run
   // until `closed_` set or until an error is encountered. In both cases
   // `Finish` is called on the stream and the status returned to the caller.
@@ -182,10 +405,23 @@ class TrajectoryWriter {
   // by `worker_thread_`.
   absl::Status RunStreamWorker();
 
-  // Sets `context_` and opens a gRPC InsertStream to the server.
+  // Creates `shared_memory_` and negotiates its use with the server if
+  // requested by `options_` and not already attempted.
+  void MaybeNegotiateSharedMemory();
+
+  // Releases the shared memory of chunks sent before the oldest unconfirmed
+  // item.
+  void ReleaseConfirmedSharedMemoryLocked() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Sets `context_` and opens a gRPC InsertStream to the server. If the writer
+  // was constructed with local tables then a `LocalInsertStream` is opened
+  // instead and assigned to `local_stream_`.
   std::unique_ptr<InsertStream> SetContextAndCreateStream()
       ABSL_LOCKS_EXCLUDED(mu_);
 
+  // Body of `stream_worker_`.
+  void RunStreamWorkerLoop() ABSL_LOCKS_EXCLUDED(mu_);
+
   // Blocks until `write_queue_` is non-empty then copies the front element into
   // `item_and_refs`. If `Close` called before operation could complete, `false`
   // is returned.
@@ -194,10 +430,41 @@ class TrajectoryWriter {
 
   // Build and write the item insertion request to the stream. All chunks
   // referenced by item must have been written to the stream before calling this
-  // method.
+  // method. `keep_keys` are the chunks the server should keep after the item
+  // and `released_keys` the chunks it kept before the item but no longer
+  // needs; which of the two is sent depends on
+  // `options_.send_released_chunk_keys`. If `assembled` is non-null then it is
+  // sent in place of the trajectory of `item`. If `batch` is non-null then the
+  // item is added to it and the batch is written.
   bool SendItem(InsertStream* stream,
                 const internal::flat_hash_set<uint64_t>& keep_keys,
-                const PrioritizedItem& item) const;
+                const std::vector<uint64_t>& released_keys,
+                const PrioritizedItem& item,
+                const InsertStreamRequest::AssembledTrajectory* assembled,
+                bool send_confirmation, InsertStreamRequest* batch) const;
+
+  // Removes the item with key `key`, and all items sent before it, from
+  // `in_flight_items_` and `unconfirmed_items_`.
+  void ConfirmItemsLocked(uint64_t key) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Adds (removes) the chunks referenced by `item` to (from) the chunks counted
+  // by `buffered_bytes_`. Noop unless `options_.max_buffered_bytes` is set.
+  void AddToBufferLocked(const ItemAndRefs& item)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  void RemoveFromBufferLocked(const ItemAndRefs& item)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Adds the size of chunks which have been finalized since they were added
+  // to the buffer to `buffered_bytes_`.
+  void UpdateBufferedBytesLocked() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Applies `options_.buffer_overflow_policy` if the buffer holds more than
+  // `options_.max_buffered_bytes`.
+  absl::Status EnforceBufferLimitLocked() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Drops the next item according to `options_.buffer_overflow_policy` and
+  // releases the chunks only referenced by it.
+  void DropItemLocked() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
 
   // Union of `GetChunkKeys` from all column chunkers and all the chunks
   // referenced by pending items (except for chunks only referenced by the first
@@ -208,27 +475,31 @@ class TrajectoryWriter {
       const internal::flat_hash_set<uint64_t>& streamed_chunk_keys) const
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
 
-  // Stub used to create InsertStream gRPC streams.
+  // Stub used to create InsertStream gRPC streams. nullptr if the writer was
+  // constructed with local tables.
   std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface> stub_;
 
+  // Tables written to through a `LocalInsertStream`. Empty if the writer was
+  // constructed with a stub.
+  internal::flat_hash_map<std::string, std::shared_ptr<Table>> local_tables_;
+
   // Configuration options.
   Options options_;
 
   // Override of default options for yet to be constructed chunkers.
   internal::flat_hash_map<int, Options> options_override_;
 
-  // Mapping from column index to Chunker. Shared pointers are used as the
-  // `CellRef`s created by the chunker will own a weak_ptr created using
-  // `weak_from_this()` on the Chunker.
-  internal::flat_hash_map<int, std::shared_ptr<Chunker>> chunkers_;
+  // Mapping from column index to Chunker for each of the `num_episodes`
+  // episodes. Shared pointers are used as the `CellRef`s created by the
+  // chunker will own a weak_ptr created using `weak_from_this()` on the
+  // Chunker.
+  std::vector<internal::flat_hash_map<int, std::shared_ptr<Chunker>>>
+      chunkers_;
 
   mutable absl::Mutex mu_;
 
-  // ID of the active episode.
-  uint64_t episode_id_ ABSL_GUARDED_BY(mu_);
-
-  // Step within the episode.
-  int episode_step_ ABSL_GUARDED_BY(mu_);
+  // The active episode of each of the `num_episodes` episodes.
+  std::vector<Episode> episodes_ ABSL_GUARDED_BY(mu_);
 
   // True if `Close` has been called.
   bool closed_ ABSL_GUARDED_BY(mu_);
@@ -241,9 +512,38 @@ class TrajectoryWriter {
   // Items waiting for `stream_worker_` to write it to the steam.
   std::deque<ItemAndRefs> write_queue_ ABSL_GUARDED_BY(mu_);
 
-  // Keys of items which have been written to the stream but for which no
-  // confirmation has yet been received from the server.
-  internal::flat_hash_set<uint64_t> in_flight_items_ ABSL_GUARDED_BY(mu_);
+  // Keys of items which have been written to the stream but which have not
+  // yet been confirmed by the server, in the order they were written.
+  std::deque<uint64_t> in_flight_items_ ABSL_GUARDED_BY(mu_);
+
+  // The items of `in_flight_items_`, unless they have been dropped. They are
+  // moved back to the front of `write_queue_` if the stream fails.
+  std::deque<ItemAndRefs> unconfirmed_items_ ABSL_GUARDED_BY(mu_);
+
+  // Chunks referenced by the items of `write_queue_` and `unconfirmed_items_`
+  // and the sum of their sizes. Only maintained if
+  // `options_.max_buffered_bytes` is set.
+  internal::flat_hash_map<uint64_t, BufferedChunk> buffered_chunks_
+      ABSL_GUARDED_BY(mu_);
+  int64_t buffered_bytes_ ABSL_GUARDED_BY(mu_) = 0;
+
+  // Keys of the chunks in `buffered_chunks_` which have not been sized yet.
+  std::vector<uint64_t> unsized_chunk_keys_ ABSL_GUARDED_BY(mu_);
+
+  // Number of items dropped due to `options_.buffer_overflow_policy`.
+  int64_t num_dropped_items_ ABSL_GUARDED_BY(mu_) = 0;
+
+  // True if the server has confirmed items since the stream was opened. Used
+  // to decide whether the stream worker should back off before reconnecting.
+  bool received_confirmation_ ABSL_GUARDED_BY(mu_) = false;
+
+  // Number of streams which have failed with a transient error. Used by
+  // `FlushWithoutRetries` to detect that the server is unavailable.
+  int64_t num_unavailable_streams_ ABSL_GUARDED_BY(mu_) = 0;
+
+  // Number of items written since the last item for which a confirmation was
+  // requested. Only accessed by the stream worker.
+  int items_since_confirmation_ = 0;
 
   // We signal when a chunk is flushed in case the stream worker backed off due
   // to the front item of `write_queue_` referencing incomplete chunks.
@@ -255,10 +555,39 @@ class TrajectoryWriter {
   // concurrent `Close` calls and creation of new streams.
   std::unique_ptr<grpc::ClientContext> context_ ABSL_GUARDED_BY(mu_);
 
+  // Stream used by `stream_worker_` when writing to `local_tables_`. Cancelled
+  // by `Close` in place of `context_`.
+  internal::LocalInsertStream* local_stream_ ABSL_GUARDED_BY(mu_) = nullptr;
+
+  // Ring buffer used to send chunks to the server through shared memory.
+  // nullptr unless the transport was successfully negotiated. Only set by the
+  // stream worker before the first stream is created.
+  std::unique_ptr<internal::SharedMemoryRing> shared_memory_;
+
+  // True once `MaybeNegotiateSharedMemory` has run. Only accessed by the
+  // stream worker.
+  bool shared_memory_negotiated_ = false;
+
+  // Position in `shared_memory_` after the last chunk was written to it. Only
+  // accessed by the stream worker.
+  uint64_t shared_memory_position_ = 0;
+
+  // Keys of the items written to the stream (in order) together with the value
+  // of `shared_memory_position_` when they were written. Once an item has been
+  // confirmed the server has read all chunks written before it so the memory
+  // can be reused.
+  std::deque<std::pair<uint64_t, uint64_t>> shared_memory_releases_
+      ABSL_GUARDED_BY(mu_);
+
   // Creates `context_` and calls `RunStreamWorker` until `Close` called or
   // until the stream returns a non transient error. In both cases
   // `unrecoverable_status_` is populated before the thread is joinable.
   std::unique_ptr<internal::Thread> stream_worker_;
+
+  // Compresses the chunks of all columns when `num_compression_threads` > 0.
+  // Declared last so that the scheduled compressions, which reference `mu_`
+  // and `data_cv_`, complete before any other member is destroyed.
+  std::unique_ptr<internal::ThreadPool> compression_pool_;
 };
 
 class TrajectoryColumn {
@@ -360,24 +689,40 @@ class CellRef {
 class Chunker : public std::enable_shared_from_this<Chunker> {
  public:
   Chunker(internal::TensorSpec spec, int max_chunk_length,
-          int num_keep_alive_refs);
+          int num_keep_alive_refs,
+          ChunkData::Codec codec = ChunkData::SNAPPY,
+          bool deduplicate_frames = false,
+          ChunkData::Quantization quantization = ChunkData::NO_QUANTIZATION,
+          int rows_per_block = 0,
+          internal::ThreadPool* compression_pool = nullptr,
+          std::function<void(const absl::Status&)> on_chunk_ready = nullptr);
 
   // Validates `tensor` against `spec_` and `episode_info` against previous
-  // calls, appends it to the active chunk and returns a reference to the new
-  // row. If the active chunk now has `max_chunk_length` rows then it is
-  // finalized and its `CellRef`s notified (including `ref`).
+  // calls, copies it into the next row of the active chunk and returns a
+  // reference to the new row. All rows of a chunk must have the same shape,
+  // even if `spec_` is only partially defined. If the active chunk now has
+  // `max_chunk_length` rows then it is finalized and its `CellRef`s notified
+  // (including `ref`).
   absl::Status Append(tensorflow::Tensor tensor,
                       CellRef::EpisodeInfo episode_info,
                       std::weak_ptr<CellRef>* ref) ABSL_LOCKS_EXCLUDED(mu_);
 
   // Creates a chunk from the data in the buffer and calls `SetChunk` on its
-  // `CellRef`s.
+  // `CellRef`s. If `compression_pool` was provided then the chunk is encoded
+  // on the pool and `SetChunk` called (followed by `on_chunk_ready`) once it
+  // completes, which may be after `Flush` has returned.
   absl::Status Flush() ABSL_LOCKS_EXCLUDED(mu_);
 
+  // True if the chunk with key `chunk_key` is being compressed on the
+  // `compression_pool`.
+  bool IsCompressing(uint64_t chunk_key) const ABSL_LOCKS_EXCLUDED(mu_);
+
   // Clears buffers of both references and data not yet committed to a Chunk.
   void Reset();
 
-  // Keys of the FINALIZED chunks referenced by `CellRef`s in `active_refs_`.
+  // Keys of the chunks referenced by `CellRef`s in `active_refs_`, oldest
+  // first. Takes time proportional to the number of chunks rather than the
+  // number of references.
   std::vector<uint64_t> GetKeepKeys() const ABSL_LOCKS_EXCLUDED(mu_);
 
   // Spec which appended tensors need to be compatible with.
@@ -385,9 +730,14 @@ class Chunker : public std::enable_shared_from_this<Chunker> {
 
   // Modify options on Chunker with an empty buffer (i.e newly created or
   // `Flush` just called.). Returns `InvalidArgumentError` if
-  // `max_chunk_length > num_keep_alive_refs`  or if either is <= 0.
-  absl::Status ApplyConfig(int max_chunk_length, int num_keep_alive_refs)
-      ABSL_LOCKS_EXCLUDED(mu_);
+  // `max_chunk_length > num_keep_alive_refs`, if either is <= 0 or if `codec`
+  // has not been registered.
+  absl::Status ApplyConfig(int max_chunk_length, int num_keep_alive_refs,
+                           ChunkData::Codec codec = ChunkData::SNAPPY,
+                           bool deduplicate_frames = false,
+                           ChunkData::Quantization quantization =
+                               ChunkData::NO_QUANTIZATION,
+                           int rows_per_block = 0) ABSL_LOCKS_EXCLUDED(mu_);
 
  private:
   friend CellRef;
@@ -401,6 +751,16 @@ class Chunker : public std::enable_shared_from_this<Chunker> {
  private:
   absl::Status FlushLocked() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
 
+  // Removes the oldest reference from `active_refs_` and updates
+  // `active_chunk_keys_` accordingly.
+  void PopOldestRefLocked() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Calls `SetChunk` on `refs` (or records `status` if not ok), removes the
+  // chunk from `compressing_chunk_keys_` and then invokes `on_chunk_ready_`.
+  void FinishCompression(absl::Status status, ChunkData chunk,
+                         std::vector<std::shared_ptr<CellRef>> refs)
+      ABSL_LOCKS_EXCLUDED(mu_);
+
   // Spec which all data in `Append` must follow.
   internal::TensorSpec spec_;
 
@@ -412,12 +772,37 @@ class Chunker : public std::enable_shared_from_this<Chunker> {
   // new trajectories.
   int num_keep_alive_refs_;
 
+  // Codec used to compress the finalized chunks.
+  ChunkData::Codec codec_;
+
+  // If true then identical frames are stored once per chunk.
+  bool deduplicate_frames_;
+
+  // Lossy encoding applied to float32 chunks before they are compressed.
+  ChunkData::Quantization quantization_;
+
+  // If > 0 then chunks are compressed in blocks of this many rows.
+  int rows_per_block_;
+
+  // If set then chunks are encoded on this pool rather than in `FlushLocked`.
+  // Not owned.
+  internal::ThreadPool* compression_pool_;
+
+  // Called after the `CellRef`s of a chunk encoded on `compression_pool_`
+  // have been notified, with an error if the encoding failed.
+  std::function<void(const absl::Status&)> on_chunk_ready_;
+
   mutable absl::Mutex mu_;
 
-  // Data waiting for the next chunk to be constructed.
-  std::vector<tensorflow::Tensor> buffer_ ABSL_GUARDED_BY(mu_);
+  // Data waiting for the next chunk to be constructed. Has shape
+  // [max_chunk_length_, ...] and holds the rows of the chunk in its first
+  // `offset_` rows. Allocated by the first `Append` of a chunk (unless the
+  // buffer of the previous chunk can be reused) and encoded without copying
+  // the rows when the chunk is flushed.
+  tensorflow::Tensor buffer_ ABSL_GUARDED_BY(mu_);
 
-  // Offset within the chunk of the next appended item.
+  // Offset within the chunk of the next appended item, i.e. the number of rows
+  // in `buffer_`.
   int offset_ ABSL_GUARDED_BY(mu_);
 
   // Key of the chunk that will be constructed from `buffer_`.
@@ -427,6 +812,24 @@ class Chunker : public std::enable_shared_from_this<Chunker> {
   // When the size exceeds `num_keep_alive_refs_` then the oldest item is
   // removed.
   std::deque<std::shared_ptr<CellRef>> active_refs_ ABSL_GUARDED_BY(mu_);
+
+  // Keys of the chunks referenced by `active_refs_` and the number of
+  // references to each, oldest first. Maintained as references enter and
+  // leave `active_refs_` so `GetKeepKeys` does not have to scan them.
+  std::deque<std::pair<uint64_t, int>> active_chunk_keys_ ABSL_GUARDED_BY(mu_);
+
+  // Memory of the `CellRef`s (and their control blocks) created by `Append`.
+  // Shared with the allocators stored in the control blocks so references
+  // which outlive the chunker keep it alive.
+  std::shared_ptr<internal::SlotPool> cell_ref_pool_;
+
+  // Keys of the chunks which are being encoded on `compression_pool_`.
+  internal::flat_hash_set<uint64_t> compressing_chunk_keys_
+      ABSL_GUARDED_BY(mu_);
+
+  // First error encountered when encoding a chunk on `compression_pool_`.
+  // Returned by all subsequent `Append` and `Flush` calls.
+  absl::Status compression_status_ ABSL_GUARDED_BY(mu_);
 };
 
 }  // namespace reverb
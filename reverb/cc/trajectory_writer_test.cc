@@ -14,6 +14,8 @@
 
 #include "reverb/cc/trajectory_writer.h"
 
+#include <atomic>
+#include <cfloat>
 #include <memory>
 #include <string>
 
@@ -31,13 +33,22 @@
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
 #include "absl/types/optional.h"
+#include "reverb/cc/platform/hash_map.h"
 #include "reverb/cc/platform/logging.h"
 #include "reverb/cc/platform/status_matchers.h"
+#include "reverb/cc/platform/thread.h"
+#include "reverb/cc/rate_limiter.h"
 #include "reverb/cc/reverb_service.grpc.pb.h"
 #include "reverb/cc/reverb_service.pb.h"
 #include "reverb/cc/reverb_service_mock.grpc.pb.h"
+#include "reverb/cc/selectors/fifo.h"
+#include "reverb/cc/selectors/uniform.h"
 #include "reverb/cc/support/queue.h"
+#include "reverb/cc/support/shared_memory.h"
 #include "reverb/cc/support/signature.h"
+#include "reverb/cc/support/thread_pool.h"
+#include "reverb/cc/support/trajectory_util.h"
+#include "reverb/cc/table.h"
 #include "reverb/cc/testing/proto_test_util.h"
 #include "reverb/cc/testing/tensor_testutil.h"
 #include "tensorflow/core/framework/tensor.h"
@@ -54,7 +65,9 @@ namespace {
 using ::grpc::testing::MockClientReaderWriter;
 using ::testing::_;
 using ::testing::ElementsAre;
+using ::testing::IsEmpty;
 using ::testing::Return;
+using ::testing::SizeIs;
 using ::testing::UnorderedElementsAre;
 
 using Step = ::std::vector<::absl::optional<::tensorflow::Tensor>>;
@@ -67,6 +80,8 @@ MATCHER(IsChunk, "") { return arg.has_chunk(); }
 
 MATCHER(IsItem, "") { return arg.item().send_confirmation(); }
 
+MATCHER(IsSharedMemoryChunk, "") { return arg.has_shared_memory_chunk(); }
+
 inline std::string Int32Str() {
   return tensorflow::DataTypeString(tensorflow::DT_INT32);
 }
@@ -118,8 +133,17 @@ class FakeStream
     absl::MutexLock lock(&mu_);
     requests_->push_back(msg);
 
-    if (msg.item().send_confirmation()) {
-      REVERB_CHECK(pending_confirmation_.Push(msg.item().item().key()));
+    auto confirm = [this](const InsertStreamRequest& request) {
+      if (request.item().send_confirmation()) {
+        REVERB_CHECK(pending_confirmation_.Push(request.item().item().key()));
+      }
+    };
+    if (msg.has_batch()) {
+      for (const auto& request : msg.batch().requests()) {
+        confirm(request);
+      }
+    } else {
+      confirm(msg);
     }
 
     return true;
@@ -165,6 +189,53 @@ class FakeStream
   internal::Queue<uint64_t> pending_confirmation_;
 };
 
+// Stream of a server which is down, i.e every write fails and the stream is
+// finished with `UNAVAILABLE`.
+MockClientReaderWriter<InsertStreamRequest, InsertStreamResponse>*
+MakeUnavailableStream() {
+  auto* stream = new ::testing::NiceMock<
+      MockClientReaderWriter<InsertStreamRequest, InsertStreamResponse>>();
+  ON_CALL(*stream, Write(_, _)).WillByDefault(Return(false));
+  ON_CALL(*stream, Finish())
+      .WillByDefault(Return(grpc::Status(grpc::StatusCode::UNAVAILABLE, "")));
+  return stream;
+}
+
+// Answers the shared memory negotiation of `TrajectoryWriter`. If `map_segment`
+// then the segment is mapped and its token returned, otherwise the server is
+// emulated as being on a different host.
+class FakeInitializeConnectionStream
+    : public MockClientReaderWriter<InitializeConnectionRequest,
+                                    InitializeConnectionResponse> {
+ public:
+  FakeInitializeConnectionStream(bool map_segment,
+                                 std::shared_ptr<std::string> segment_name)
+      : map_segment_(map_segment), segment_name_(std::move(segment_name)) {}
+
+  bool Write(const InitializeConnectionRequest& msg,
+             grpc::WriteOptions options) override {
+    *segment_name_ = msg.shared_memory_name();
+    return true;
+  }
+
+  bool Read(InitializeConnectionResponse* response) override {
+    if (!map_segment_) return false;
+    std::unique_ptr<internal::SharedMemorySegment> segment;
+    REVERB_CHECK_OK(
+        internal::SharedMemorySegment::Open(*segment_name_, &segment));
+    response->set_shared_memory_token(segment->token());
+    return true;
+  }
+
+  bool WritesDone() override { return true; }
+
+  grpc::Status Finish() override { return grpc::Status::OK; }
+
+ private:
+  bool map_segment_;
+  std::shared_ptr<std::string> segment_name_;
+};
+
 TEST(CellRef, IsReady) {
   auto chunker = std::make_shared<Chunker>(kIntSpec, 2, 5);
 
@@ -179,6 +250,176 @@ TEST(CellRef, IsReady) {
   EXPECT_TRUE(ref.lock()->IsReady());
 }
 
+TEST(Chunker, CompressesChunksWithCodec) {
+  internal::TensorSpec spec = {"0", tensorflow::DT_INT32, {64}};
+  auto chunker = std::make_shared<Chunker>(spec, /*max_chunk_length=*/2,
+                                           /*num_keep_alive_refs=*/2,
+                                           ChunkData::NONE);
+
+  std::weak_ptr<CellRef> ref;
+  auto want = MakeConstantTensor<tensorflow::DT_INT32>({64}, 7);
+  REVERB_ASSERT_OK(chunker->Append(want, {1, 0}, &ref));
+  REVERB_ASSERT_OK(chunker->Flush());
+
+  auto chunk = ref.lock()->GetChunk();
+  EXPECT_EQ(chunk->codec(), ChunkData::NONE);
+  tensorflow::Tensor got;
+  REVERB_ASSERT_OK(ref.lock()->GetData(&got));
+  test::ExpectTensorEqual<int32_t>(got, want);
+
+  // The codec can be changed once the buffer is empty.
+  REVERB_ASSERT_OK(chunker->ApplyConfig(2, 2, ChunkData::SNAPPY));
+  REVERB_ASSERT_OK(chunker->Append(want, {1, 1}, &ref));
+  REVERB_ASSERT_OK(chunker->Flush());
+  EXPECT_EQ(ref.lock()->GetChunk()->codec(), ChunkData::SNAPPY);
+
+  EXPECT_EQ(chunker->ApplyConfig(2, 2, ChunkData::ZSTD).code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+TEST(Chunker, StoresIncompressibleChunksUncompressed) {
+  auto chunker = std::make_shared<Chunker>(kIntSpec, /*max_chunk_length=*/1,
+                                           /*num_keep_alive_refs=*/1);
+
+  // A single int32 does not become smaller when compressed.
+  std::weak_ptr<CellRef> ref;
+  auto want = MakeConstantTensor<tensorflow::DT_INT32>({1}, 7);
+  REVERB_ASSERT_OK(chunker->Append(want, {1, 0}, &ref));
+
+  auto chunk = ref.lock()->GetChunk();
+  ASSERT_NE(chunk, nullptr);
+  EXPECT_EQ(chunk->codec(), ChunkData::NONE);
+  EXPECT_EQ(chunk->data().tensors(0).tensor_content().size(), 4);
+
+  tensorflow::Tensor got;
+  REVERB_ASSERT_OK(ref.lock()->GetData(&got));
+  test::ExpectTensorEqual<int32_t>(got, want);
+}
+
+TEST(Chunker, QuantizesFloatColumns) {
+  auto chunker = std::make_shared<Chunker>(
+      kFloatSpec, /*max_chunk_length=*/1, /*num_keep_alive_refs=*/1,
+      ChunkData::SNAPPY, /*deduplicate_frames=*/false, ChunkData::BFLOAT16);
+
+  std::weak_ptr<CellRef> ref;
+  auto want = MakeConstantTensor<tensorflow::DT_FLOAT>({1}, 1.5f);
+  REVERB_ASSERT_OK(chunker->Append(want, {1, 0}, &ref));
+
+  auto chunk = ref.lock()->GetChunk();
+  ASSERT_NE(chunk, nullptr);
+  ASSERT_EQ(chunk->quantized_columns_size(), 1);
+  EXPECT_EQ(chunk->quantized_columns(0).quantization(), ChunkData::BFLOAT16);
+  EXPECT_EQ(chunk->data().tensors(0).dtype(), tensorflow::DT_BFLOAT16);
+
+  // The data is dequantized into the dtype of the column.
+  tensorflow::Tensor got;
+  REVERB_ASSERT_OK(ref.lock()->GetData(&got));
+  test::ExpectTensorEqual<float>(got, want);
+}
+
+TEST(Chunker, DeduplicatesFramesOfStackedObservations) {
+  internal::TensorSpec spec = {"0", tensorflow::DT_INT32, {2, 3}};
+  auto chunker = std::make_shared<Chunker>(spec, /*max_chunk_length=*/2,
+                                           /*num_keep_alive_refs=*/2,
+                                           ChunkData::SNAPPY,
+                                           /*deduplicate_frames=*/true);
+
+  // Both steps stack the same two frames.
+  auto want = MakeConstantTensor<tensorflow::DT_INT32>({2, 3}, 3);
+  std::weak_ptr<CellRef> first;
+  REVERB_ASSERT_OK(chunker->Append(want, {1, 0}, &first));
+  std::weak_ptr<CellRef> second;
+  REVERB_ASSERT_OK(chunker->Append(want, {1, 1}, &second));
+
+  auto chunk = second.lock()->GetChunk();
+  ASSERT_NE(chunk, nullptr);
+  ASSERT_EQ(chunk->deduplicated_frames_size(), 1);
+  EXPECT_EQ(chunk->deduplicated_frames(0).frame_indices_size(), 4);
+  EXPECT_EQ(tensorflow::TensorShape(chunk->data().tensors(0).tensor_shape()),
+            tensorflow::TensorShape({1, 3}));
+
+  tensorflow::Tensor got;
+  REVERB_ASSERT_OK(first.lock()->GetData(&got));
+  test::ExpectTensorEqual<int32_t>(got, want);
+  REVERB_ASSERT_OK(second.lock()->GetData(&got));
+  test::ExpectTensorEqual<int32_t>(got, want);
+}
+
+TEST(Chunker, CompressesChunksOnPool) {
+  internal::ThreadPool pool("test", 1);
+  absl::Notification chunk_ready;
+  auto chunker = std::make_shared<Chunker>(
+      kIntSpec, /*max_chunk_length=*/2, /*num_keep_alive_refs=*/2,
+      ChunkData::SNAPPY, /*deduplicate_frames=*/false,
+      ChunkData::NO_QUANTIZATION, /*rows_per_block=*/0, &pool,
+      [&](const absl::Status& status) {
+        REVERB_EXPECT_OK(status);
+        chunk_ready.Notify();
+      });
+
+  // Occupy the only thread so the compression can't start before we have
+  // checked the state of the references.
+  absl::Notification unblock;
+  pool.Schedule([&] { unblock.WaitForNotification(); });
+
+  auto want = MakeConstantTensor<tensorflow::DT_INT32>({1}, 7);
+  std::weak_ptr<CellRef> first;
+  REVERB_ASSERT_OK(chunker->Append(want, {1, 0}, &first));
+  std::weak_ptr<CellRef> second;
+  REVERB_ASSERT_OK(chunker->Append(want, {1, 1}, &second));
+
+  // The buffer was full so `Append` handed it over to the pool without
+  // waiting for it to be compressed.
+  EXPECT_FALSE(first.lock()->IsReady());
+  EXPECT_TRUE(chunker->IsCompressing(first.lock()->chunk_key()));
+
+  unblock.Notify();
+  chunk_ready.WaitForNotification();
+
+  EXPECT_FALSE(chunker->IsCompressing(first.lock()->chunk_key()));
+  ASSERT_TRUE(first.lock()->IsReady());
+  ASSERT_TRUE(second.lock()->IsReady());
+  EXPECT_EQ(first.lock()->GetChunk(), second.lock()->GetChunk());
+  EXPECT_THAT(first.lock()->GetChunk()->sequence_range(),
+              testing::EqualsProto("episode_id: 1 start: 0 end: 1"));
+
+  tensorflow::Tensor got;
+  REVERB_ASSERT_OK(second.lock()->GetData(&got));
+  test::ExpectTensorEqual<int32_t>(got, want);
+}
+
+TEST(Chunker, CompressesChunksInBlocks) {
+  internal::TensorSpec spec = {"0", tensorflow::DT_INT32, {64}};
+  auto chunker = std::make_shared<Chunker>(
+      spec, /*max_chunk_length=*/5, /*num_keep_alive_refs=*/5,
+      ChunkData::SNAPPY, /*deduplicate_frames=*/false,
+      ChunkData::NO_QUANTIZATION, /*rows_per_block=*/2);
+
+  std::vector<std::weak_ptr<CellRef>> refs(5);
+  for (int i = 0; i < 5; i++) {
+    REVERB_ASSERT_OK(chunker->Append(
+        MakeConstantTensor<tensorflow::DT_INT32>({64}, i), {1, i}, &refs[i]));
+  }
+
+  auto chunk = refs[0].lock()->GetChunk();
+  ASSERT_NE(chunk, nullptr);
+  ASSERT_EQ(chunk->compressed_blocks_size(), 1);
+  EXPECT_EQ(chunk->compressed_blocks(0).rows_per_block(), 2);
+  EXPECT_EQ(chunk->compressed_blocks(0).block_ends_size(), 3);
+
+  for (int i = 0; i < 5; i++) {
+    tensorflow::Tensor got;
+    REVERB_ASSERT_OK(refs[i].lock()->GetData(&got));
+    test::ExpectTensorEqual<int32_t>(
+        got, MakeConstantTensor<tensorflow::DT_INT32>({64}, i));
+  }
+
+  tensorflow::Tensor column;
+  REVERB_ASSERT_OK(internal::UnpackChunkColumn(*chunk, 0, &column));
+  EXPECT_EQ(column.shape(), tensorflow::TensorShape({5, 64}));
+  EXPECT_EQ(column.flat<int32_t>()(4 * 64), 4);
+}
+
 TEST(CellRef, GetDataFromChunkerBuffer) {
   internal::TensorSpec spec = {"0", tensorflow::DT_INT32, {3, 3}};
   auto chunker = std::make_shared<Chunker>(spec,
@@ -257,6 +498,31 @@ TEST(Chunker, AppendValidatesSpecShape) {
                   "Got [2] which is incompatible with [1]."));
 }
 
+TEST(Chunker, AppendRequiresRowsOfChunkToHaveSameShape) {
+  internal::TensorSpec spec = {"0", tensorflow::DT_INT32, {-1}};
+  auto chunker = std::make_shared<Chunker>(spec, /*max_chunk_length=*/2,
+                                           /*num_keep_alive_refs=*/5);
+
+  std::weak_ptr<CellRef> ref;
+  REVERB_ASSERT_OK(chunker->Append(
+      MakeConstantTensor<tensorflow::DT_INT32>({2}, 1), {1, 0}, &ref));
+  auto status = chunker->Append(
+      MakeConstantTensor<tensorflow::DT_INT32>({3}, 2), {1, 1}, &ref);
+  EXPECT_EQ(status.code(), absl::StatusCode::kInvalidArgument);
+  EXPECT_THAT(std::string(status.message()),
+              ::testing::HasSubstr("rows of the current chunk have shape [2]"));
+
+  // The next chunk can have rows of another shape.
+  REVERB_ASSERT_OK(chunker->Flush());
+  auto want = MakeConstantTensor<tensorflow::DT_INT32>({3}, 3);
+  REVERB_ASSERT_OK(chunker->Append(want, {1, 2}, &ref));
+  REVERB_ASSERT_OK(chunker->Flush());
+
+  tensorflow::Tensor got;
+  REVERB_ASSERT_OK(ref.lock()->GetData(&got));
+  test::ExpectTensorEqual<tensorflow::int32>(got, want);
+}
+
 TEST(Chunker, AppendFlushesOnMaxChunkLength) {
   auto chunker = std::make_shared<Chunker>(kIntSpec, /*max_chunk_length=*/2,
                                            /*num_keep_alive_refs=*/5);
@@ -372,6 +638,27 @@ TEST(Chunker, GetKeepKeys) {
   EXPECT_THAT(chunker->GetKeepKeys(), ElementsAre(third.lock()->chunk_key()));
 }
 
+TEST(Chunker, GetKeepKeysFollowsResetAndApplyConfig) {
+  auto chunker = std::make_shared<Chunker>(kIntSpec, /*max_chunk_length=*/1,
+                                           /*num_keep_alive_refs=*/3);
+
+  std::vector<std::weak_ptr<CellRef>> refs(3);
+  for (int i = 0; i < 3; i++) {
+    REVERB_ASSERT_OK(chunker->Append(MakeTensor(kIntSpec),
+                                     {/*episode_id=*/1, /*step=*/i}, &refs[i]));
+  }
+  EXPECT_THAT(chunker->GetKeepKeys(), SizeIs(3));
+
+  // Shrinking the window drops the keys of the chunks which left it.
+  REVERB_ASSERT_OK(chunker->ApplyConfig(/*max_chunk_length=*/1,
+                                        /*num_keep_alive_refs=*/1));
+  EXPECT_THAT(chunker->GetKeepKeys(),
+              ElementsAre(refs[2].lock()->chunk_key()));
+
+  chunker->Reset();
+  EXPECT_THAT(chunker->GetKeepKeys(), IsEmpty());
+}
+
 TEST(Chunker, ResetClearsRefs) {
   auto chunker = std::make_shared<Chunker>(kIntSpec, /*max_chunk_length=*/2,
                                            /*num_keep_alive_refs=*/2);
@@ -750,6 +1037,142 @@ TEST(TrajectoryWriter, ConfigureChunkerOnFutureColumn) {
   EXPECT_FALSE(second[1]->expired());
 }
 
+TEST(TrajectoryWriter, TargetChunkBytesSetsChunkLengthOfEachColumn) {
+  auto stub = std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
+  EXPECT_CALL(*stub, InsertStreamRaw(_)).WillOnce(Return(new FakeStream()));
+
+  TrajectoryWriter::Options options{/*max_chunk_length=*/4,
+                                    /*num_keep_alive_refs=*/4};
+  options.target_chunk_bytes = 32;
+  TrajectoryWriter writer(stub, options);
+
+  // Rows of the first column take 4 bytes so its chunks are capped by
+  // max_chunk_length. Rows of the second column take 16 bytes so its chunks
+  // hold two rows.
+  const internal::TensorSpec large_spec = {"1", tensorflow::DT_INT32, {4}};
+  std::vector<StepRef> steps(4);
+  for (auto& step : steps) {
+    REVERB_ASSERT_OK(writer.Append(
+        Step({MakeTensor(kIntSpec), MakeTensor(large_spec)}), &step));
+  }
+  EXPECT_EQ(steps[0][0]->lock()->chunk_key(), steps[3][0]->lock()->chunk_key());
+  EXPECT_EQ(steps[0][1]->lock()->chunk_key(), steps[1][1]->lock()->chunk_key());
+  EXPECT_NE(steps[1][1]->lock()->chunk_key(), steps[2][1]->lock()->chunk_key());
+  EXPECT_TRUE(steps[0][1]->lock()->IsReady());
+  EXPECT_TRUE(steps[3][1]->lock()->IsReady());
+}
+
+TEST(TrajectoryWriter, AppendBatchWritesEachRowToItsEpisode) {
+  auto stub = std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
+  EXPECT_CALL(*stub, InsertStreamRaw(_)).WillOnce(Return(new FakeStream()));
+
+  TrajectoryWriter::Options options{/*max_chunk_length=*/2,
+                                    /*num_keep_alive_refs=*/2};
+  options.num_episodes = 3;
+  TrajectoryWriter writer(stub, options);
+
+  tensorflow::Tensor batch(tensorflow::DT_INT32, {3, 1});
+  batch.flat<int32_t>().setValues({10, 11, 12});
+  std::vector<StepRef> first;
+  REVERB_ASSERT_OK(writer.AppendBatch(Step({batch}), &first));
+  ASSERT_EQ(first.size(), 3);
+
+  // Every episode has its own chunker, episode ID and step.
+  for (int i = 0; i < 3; i++) {
+    auto ref = first[i][0]->lock();
+    EXPECT_EQ(ref->episode_step(), 0);
+    EXPECT_FALSE(ref->IsReady());
+    tensorflow::Tensor got;
+    REVERB_ASSERT_OK(ref->GetData(&got));
+    test::ExpectTensorEqual<int32_t>(
+        got, MakeConstantTensor<tensorflow::DT_INT32>({1}, 10 + i));
+  }
+  EXPECT_NE(first[0][0]->lock()->episode_id(),
+            first[1][0]->lock()->episode_id());
+  EXPECT_NE(first[0][0]->lock()->chunk_key(), first[1][0]->lock()->chunk_key());
+
+  // Ending one episode leaves the others running.
+  REVERB_ASSERT_OK(writer.EndEpisode(/*episode=*/1, /*clear_buffers=*/false));
+  EXPECT_TRUE(first[1][0]->lock()->IsReady());
+  EXPECT_FALSE(first[0][0]->lock()->IsReady());
+
+  std::vector<StepRef> second;
+  REVERB_ASSERT_OK(writer.AppendBatch(Step({batch}), &second));
+  EXPECT_EQ(second[0][0]->lock()->episode_step(), 1);
+  EXPECT_EQ(second[1][0]->lock()->episode_step(), 0);
+  EXPECT_TRUE(second[0][0]->lock()->IsReady());
+  EXPECT_FALSE(second[1][0]->lock()->IsReady());
+
+  // Items of all episodes are written to the same stream.
+  REVERB_ASSERT_OK(writer.CreateItem("table", 1.0,
+                                     MakeTrajectory({{first[0][0]}})));
+  REVERB_ASSERT_OK(writer.CreateItem("table", 1.0,
+                                     MakeTrajectory({{second[2][0]}})));
+  REVERB_ASSERT_OK(writer.Flush());
+}
+
+TEST(TrajectoryWriter, AppendBatchValidatesBatchSize) {
+  auto stub = std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
+  EXPECT_CALL(*stub, InsertStreamRaw(_)).WillOnce(Return(new FakeStream()));
+
+  TrajectoryWriter::Options options{/*max_chunk_length=*/2,
+                                    /*num_keep_alive_refs=*/2};
+  options.num_episodes = 3;
+  TrajectoryWriter writer(stub, options);
+
+  std::vector<StepRef> refs;
+  auto status = writer.AppendBatch(Step({MakeTensor(kIntSpec)}), &refs);
+  EXPECT_EQ(status.code(), absl::StatusCode::kInvalidArgument);
+  EXPECT_THAT(std::string(status.message()),
+              ::testing::HasSubstr("leading dimension of size 3"));
+}
+
+TEST(TrajectoryWriter, ConfirmsLastItemWhenConfirmationsAreNotRequested) {
+  auto* stream = new FakeStream();
+  auto stub = std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
+  EXPECT_CALL(*stub, InsertStreamRaw(_)).WillOnce(Return(stream));
+
+  TrajectoryWriter::Options options{/*max_chunk_length=*/1,
+                                    /*num_keep_alive_refs=*/1};
+  options.items_per_confirmation = 0;
+  TrajectoryWriter writer(stub, options);
+
+  StepRef refs;
+  REVERB_ASSERT_OK(writer.Append(Step({MakeTensor(kIntSpec)}), &refs));
+  for (int i = 0; i < 10; i++) {
+    REVERB_ASSERT_OK(
+        writer.CreateItem("table", 1.0, MakeTrajectory({{refs[0]}})));
+  }
+
+  // The confirmation of the last item confirms all the items before it so
+  // `Flush` returns even though most of the items were not confirmed.
+  REVERB_ASSERT_OK(writer.Flush());
+  ASSERT_THAT(stream->requests(), SizeIs(11));
+  EXPECT_TRUE(stream->requests().back().item().send_confirmation());
+}
+
+TEST(TrajectoryWriter, CoalescedRequestsWriteChunksAndItemAsOneMessage) {
+  auto* stream = new FakeStream();
+  auto stub = std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
+  EXPECT_CALL(*stub, InsertStreamRaw(_)).WillOnce(Return(stream));
+
+  TrajectoryWriter::Options options{/*max_chunk_length=*/1,
+                                    /*num_keep_alive_refs=*/1};
+  options.coalesce_requests = true;
+  TrajectoryWriter writer(stub, options);
+
+  StepRef refs;
+  REVERB_ASSERT_OK(writer.Append(
+      Step({MakeTensor(kIntSpec), MakeTensor(kIntSpec)}), &refs));
+  REVERB_ASSERT_OK(writer.CreateItem(
+      "table", 1.0, MakeTrajectory({{refs[0]}, {refs[1]}})));
+  REVERB_ASSERT_OK(writer.Flush());
+
+  ASSERT_THAT(stream->requests(), SizeIs(1));
+  EXPECT_THAT(stream->requests()[0].batch().requests(),
+              ElementsAre(IsChunk(), IsChunk(), IsItem()));
+}
+
 TEST(TrajectoryWriter, NoDataIsSentIfNoItemsCreated) {
   auto* stream = new FakeStream();
   EXPECT_CALL(*stream, Write(_, _)).Times(0);
@@ -942,6 +1365,140 @@ TEST(TrajectoryWriter, RetriesOnTransientError) {
   EXPECT_THAT(success_stream->requests(), ElementsAre(IsChunk(), IsItem()));
 }
 
+TEST(TrajectoryWriter, ReplaysUnconfirmedItemsOnNewStream) {
+  auto* fail_stream =
+      new MockClientReaderWriter<InsertStreamRequest, InsertStreamResponse>();
+  EXPECT_CALL(*fail_stream, Write(IsChunk(), _))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+  EXPECT_CALL(*fail_stream, Write(IsItem(), _))
+      .WillOnce(Return(true))
+      .WillOnce(Return(false));
+  EXPECT_CALL(*fail_stream, Read(_)).WillOnce(Return(false));
+  EXPECT_CALL(*fail_stream, Finish())
+      .WillOnce(Return(grpc::Status(grpc::StatusCode::UNAVAILABLE, "")));
+
+  auto* success_stream = new FakeStream();
+
+  auto stub = std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
+  EXPECT_CALL(*stub, InsertStreamRaw(_))
+      .WillOnce(Return(fail_stream))
+      .WillOnce(Return(success_stream));
+
+  TrajectoryWriter writer(stub,
+                          {/*max_chunk_length=*/1, /*num_keep_alive_refs=*/1});
+
+  // The first item is written but never confirmed and the write of the second
+  // item fails.
+  StepRef first;
+  REVERB_ASSERT_OK(writer.Append(Step({MakeTensor(kIntSpec)}), &first));
+  REVERB_ASSERT_OK(
+      writer.CreateItem("table", 1.0, MakeTrajectory({{first[0]}})));
+  StepRef second;
+  REVERB_ASSERT_OK(writer.Append(Step({MakeTensor(kIntSpec)}), &second));
+  REVERB_ASSERT_OK(
+      writer.CreateItem("table", 1.0, MakeTrajectory({{second[0]}})));
+  REVERB_ASSERT_OK(writer.Flush());
+
+  // Both items (and their chunks) should have been written to the new stream.
+  EXPECT_THAT(success_stream->requests(),
+              ElementsAre(IsChunk(), IsItem(), IsChunk(), IsItem()));
+}
+
+TEST(TrajectoryWriter, DropsOldestItemsWhenBufferIsFull) {
+  auto stub = std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
+  EXPECT_CALL(*stub, InsertStreamRaw(_))
+      .WillRepeatedly(::testing::InvokeWithoutArgs(&MakeUnavailableStream));
+
+  TrajectoryWriter::Options options{/*max_chunk_length=*/1,
+                                    /*num_keep_alive_refs=*/1};
+  options.max_buffered_bytes = 1;
+  options.buffer_overflow_policy =
+      TrajectoryWriter::Options::BufferOverflowPolicy::kDropOldest;
+  TrajectoryWriter writer(stub, options);
+
+  // Every chunk exceeds the limit so all but the newest item are dropped.
+  for (int i = 0; i < 5; i++) {
+    StepRef step;
+    REVERB_ASSERT_OK(writer.Append(Step({MakeTensor(kIntSpec)}), &step));
+    REVERB_ASSERT_OK(
+        writer.CreateItem("table", 1.0, MakeTrajectory({{step[0]}})));
+  }
+  EXPECT_EQ(writer.num_dropped_items(), 4);
+
+  // Close the writer since the server never comes back.
+  writer.Close();
+}
+
+TEST(TrajectoryWriter, DropsLowestPriorityItemsWhenBufferIsFull) {
+  // The server is down until all items have been created.
+  auto* success_stream = new FakeStream();
+  std::atomic<bool> server_up(false);
+  auto stub = std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
+  EXPECT_CALL(*stub, InsertStreamRaw(_))
+      .WillRepeatedly(::testing::InvokeWithoutArgs(
+          [&]() -> grpc::ClientReaderWriterInterface<InsertStreamRequest,
+                                                     InsertStreamResponse>* {
+            if (server_up) return success_stream;
+            return MakeUnavailableStream();
+          }));
+
+  TrajectoryWriter::Options options{/*max_chunk_length=*/1,
+                                    /*num_keep_alive_refs=*/1};
+  options.max_buffered_bytes = 1;
+  options.buffer_overflow_policy =
+      TrajectoryWriter::Options::BufferOverflowPolicy::kDropLowestPriority;
+  TrajectoryWriter writer(stub, options);
+
+  // Every chunk exceeds the limit so only the item with the highest priority
+  // is kept.
+  for (double priority : {3.0, 1.0, 5.0, 2.0}) {
+    StepRef step;
+    REVERB_ASSERT_OK(writer.Append(Step({MakeTensor(kIntSpec)}), &step));
+    REVERB_ASSERT_OK(
+        writer.CreateItem("table", priority, MakeTrajectory({{step[0]}})));
+  }
+  EXPECT_EQ(writer.num_dropped_items(), 3);
+
+  server_up = true;
+  REVERB_ASSERT_OK(writer.Flush());
+  ASSERT_THAT(success_stream->requests(), ElementsAre(IsChunk(), IsItem()));
+  EXPECT_EQ(success_stream->requests()[1].item().item().priority(), 5.0);
+}
+
+TEST(TrajectoryWriter, CreateItemBlocksWhenBufferIsFull) {
+  auto stub = std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
+  EXPECT_CALL(*stub, InsertStreamRaw(_))
+      .WillRepeatedly(::testing::InvokeWithoutArgs(&MakeUnavailableStream));
+
+  TrajectoryWriter::Options options{/*max_chunk_length=*/1,
+                                    /*num_keep_alive_refs=*/1};
+  options.max_buffered_bytes = 1;
+  TrajectoryWriter writer(stub, options);
+
+  // The newest item is always accepted.
+  StepRef first;
+  REVERB_ASSERT_OK(writer.Append(Step({MakeTensor(kIntSpec)}), &first));
+  REVERB_ASSERT_OK(
+      writer.CreateItem("table", 1.0, MakeTrajectory({{first[0]}})));
+
+  StepRef second;
+  REVERB_ASSERT_OK(writer.Append(Step({MakeTensor(kIntSpec)}), &second));
+  absl::Status status;
+  absl::Notification created;
+  auto thread = internal::StartThread("CreateItem", [&] {
+    status = writer.CreateItem("table", 1.0, MakeTrajectory({{second[0]}}));
+    created.Notify();
+  });
+  EXPECT_FALSE(created.WaitForNotificationWithTimeout(absl::Milliseconds(100)));
+
+  // Closing the writer unblocks the call.
+  writer.Close();
+  created.WaitForNotification();
+  EXPECT_EQ(status.code(), absl::StatusCode::kCancelled);
+  EXPECT_EQ(writer.num_dropped_items(), 0);
+}
+
 TEST(TrajectoryWriter, StopsOnNonTransientError) {
   auto* fail_stream =
       new MockClientReaderWriter<InsertStreamRequest, InsertStreamResponse>();
@@ -1142,6 +1699,91 @@ TEST(TrajectoryWriter, KeepKeysOnlyIncludesLiveChunks) {
                                    third[0].value().lock()->chunk_key()));
 }
 
+TEST(TrajectoryWriter, ReleasedKeysOnlyIncludeExpiredChunks) {
+  auto* stream = new FakeStream();
+  auto stub = std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
+  EXPECT_CALL(*stub, InsertStreamRaw(_)).WillOnce(Return(stream));
+
+  TrajectoryWriter::Options options = {/*max_chunk_length=*/1,
+                                       /*num_keep_alive_refs=*/2};
+  options.send_released_chunk_keys = true;
+  TrajectoryWriter writer(stub, options);
+
+  std::vector<uint64_t> chunk_keys;
+  for (int i = 0; i < 3; i++) {
+    StepRef step;
+    REVERB_ASSERT_OK(writer.Append(Step({MakeTensor(kIntSpec)}), &step));
+    chunk_keys.push_back(step[0].value().lock()->chunk_key());
+    REVERB_ASSERT_OK(
+        writer.CreateItem("table", 1.0, MakeTrajectory({{step[0]}})));
+    REVERB_ASSERT_OK(writer.Flush());
+
+    // The item never lists the chunks to keep. Nothing is released until the
+    // chunk of the first step expires with the third step.
+    const auto& insertion = stream->requests().back().item();
+    EXPECT_TRUE(insertion.keep_unreleased_chunks());
+    EXPECT_THAT(insertion.keep_chunk_keys(), IsEmpty());
+    if (i < 2) {
+      EXPECT_THAT(insertion.released_chunk_keys(), IsEmpty());
+    } else {
+      EXPECT_THAT(insertion.released_chunk_keys(),
+                  UnorderedElementsAre(chunk_keys[0]));
+    }
+  }
+}
+
+TEST(TrajectoryWriter, AssemblesItemsOnServerWhenPossible) {
+  auto* stream = new FakeStream();
+  auto stub = std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
+  EXPECT_CALL(*stub, InsertStreamRaw(_)).WillOnce(Return(stream));
+
+  TrajectoryWriter::Options options = {/*max_chunk_length=*/2,
+                                       /*num_keep_alive_refs=*/3};
+  options.assemble_items_on_server = true;
+  TrajectoryWriter writer(stub, options);
+
+  std::vector<StepRef> steps(3);
+  for (auto& step : steps) {
+    REVERB_ASSERT_OK(writer.Append(
+        Step({MakeTensor(kIntSpec), MakeTensor(kFloatSpec)}), &step));
+  }
+
+  // The last two steps of both columns can be assembled by the server.
+  REVERB_ASSERT_OK(writer.CreateItem(
+      "table", 1.0,
+      MakeTrajectory({{steps[1][0], steps[2][0]}, {steps[1][1], steps[2][1]}})));
+  // Skipping a step cannot be described by an assembled trajectory.
+  REVERB_ASSERT_OK(writer.CreateItem(
+      "table", 1.0, MakeTrajectory({{steps[0][0], steps[2][0]}})));
+  REVERB_ASSERT_OK(writer.Flush());
+
+  std::vector<InsertStreamRequest::PriorityInsertion> items;
+  for (const auto& request : stream->requests()) {
+    if (request.has_chunk()) {
+      EXPECT_GT(request.chunk_column(), 0);
+    } else if (request.has_item()) {
+      items.push_back(request.item());
+    }
+  }
+  ASSERT_THAT(items, SizeIs(2));
+
+  const uint64_t episode_id = steps[2][0].value().lock()->episode_id();
+  EXPECT_FALSE(items[0].item().has_flat_trajectory());
+  const auto& assembled = items[0].assembled_trajectory();
+  EXPECT_EQ(assembled.episode_id(), episode_id);
+  EXPECT_EQ(assembled.end_step(), 2);
+  ASSERT_THAT(assembled.columns(), SizeIs(2));
+  EXPECT_NE(assembled.columns(0).chunk_column(),
+            assembled.columns(1).chunk_column());
+  for (const auto& column : assembled.columns()) {
+    EXPECT_EQ(column.num_steps(), 2);
+    EXPECT_FALSE(column.squeeze());
+  }
+
+  EXPECT_FALSE(items[1].has_assembled_trajectory());
+  EXPECT_THAT(items[1].item().flat_trajectory().columns(), SizeIs(1));
+}
+
 TEST(TrajectoryWriter, CreateItemValidatesTrajectoryDtype) {
   auto* stream = new FakeStream();
   auto stub = std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
@@ -1347,6 +1989,125 @@ TEST(TrajectoryWriter, EndEpisodeReturnsIfTimeoutExpired) {
   writer.Close();
 }
 
+TEST(TrajectoryWriter, SendsChunksThroughSharedMemoryIfNegotiated) {
+  auto segment_name = std::make_shared<std::string>();
+  auto* stream = new FakeStream();
+  auto stub = std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
+  EXPECT_CALL(*stub, InitializeConnectionRaw(_))
+      .WillOnce(Return(new FakeInitializeConnectionStream(
+          /*map_segment=*/true, segment_name)));
+  EXPECT_CALL(*stub, InsertStreamRaw(_)).WillOnce(Return(stream));
+
+  TrajectoryWriter::Options options{/*max_chunk_length=*/1,
+                                    /*num_keep_alive_refs=*/1};
+  options.shared_memory_bytes = 1024;
+  TrajectoryWriter writer(stub, options);
+
+  StepRef refs;
+  REVERB_ASSERT_OK(writer.Append(Step({MakeTensor(kIntSpec)}), &refs));
+  REVERB_ASSERT_OK(
+      writer.CreateItem("table", 1.0, MakeTrajectory({{refs[0]}})));
+  REVERB_ASSERT_OK(writer.Flush());
+
+  auto requests = stream->requests();
+  ASSERT_THAT(requests, ElementsAre(IsSharedMemoryChunk(), IsItem()));
+
+  // The chunk referenced by the item can be read from the segment.
+  std::unique_ptr<internal::SharedMemorySegment> segment;
+  REVERB_ASSERT_OK(internal::SharedMemorySegment::Open(
+      requests[0].shared_memory_chunk().segment(), &segment));
+  absl::string_view data;
+  REVERB_ASSERT_OK(segment->Read(requests[0].shared_memory_chunk().offset(),
+                                 requests[0].shared_memory_chunk().length(),
+                                 &data));
+  ChunkData chunk;
+  ASSERT_TRUE(chunk.ParseFromArray(data.data(), data.size()));
+  EXPECT_EQ(chunk.chunk_key(), refs[0]->lock()->chunk_key());
+  EXPECT_EQ(requests[0].shared_memory_chunk().segment(), *segment_name);
+}
+
+TEST(TrajectoryWriter, FallsBackToStreamIfSharedMemoryNotNegotiated) {
+  auto* stream = new FakeStream();
+  auto stub = std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
+  EXPECT_CALL(*stub, InitializeConnectionRaw(_))
+      .WillOnce(Return(new FakeInitializeConnectionStream(
+          /*map_segment=*/false, std::make_shared<std::string>())));
+  EXPECT_CALL(*stub, InsertStreamRaw(_)).WillOnce(Return(stream));
+
+  TrajectoryWriter::Options options{/*max_chunk_length=*/1,
+                                    /*num_keep_alive_refs=*/1};
+  options.shared_memory_bytes = 1024;
+  TrajectoryWriter writer(stub, options);
+
+  StepRef refs;
+  REVERB_ASSERT_OK(writer.Append(Step({MakeTensor(kIntSpec)}), &refs));
+  REVERB_ASSERT_OK(
+      writer.CreateItem("table", 1.0, MakeTrajectory({{refs[0]}})));
+  REVERB_ASSERT_OK(writer.Flush());
+
+  EXPECT_THAT(stream->requests(), ElementsAre(IsChunk(), IsItem()));
+}
+
+TEST(TrajectoryWriter, WritesDirectlyToLocalTables) {
+  auto table = std::make_shared<Table>(
+      "dist", std::make_shared<UniformSelector>(),
+      std::make_shared<FifoSelector>(), 1000, 0,
+      std::make_shared<RateLimiter>(1.0, 1, -DBL_MAX, DBL_MAX));
+  TrajectoryWriter writer(
+      internal::flat_hash_map<std::string, std::shared_ptr<Table>>{
+          {"dist", table}},
+      {/*max_chunk_length=*/2, /*num_keep_alive_refs=*/2});
+
+  StepRef first;
+  REVERB_ASSERT_OK(writer.Append(Step({MakeTensor(kIntSpec)}), &first));
+  StepRef second;
+  REVERB_ASSERT_OK(writer.Append(Step({MakeTensor(kIntSpec)}), &second));
+  REVERB_ASSERT_OK(
+      writer.CreateItem("dist", 1.0, MakeTrajectory({{first[0], second[0]}})));
+  REVERB_ASSERT_OK(writer.CreateItem("dist", 1.0, MakeTrajectory({{second[0]}})));
+  REVERB_ASSERT_OK(writer.Flush());
+
+  EXPECT_EQ(table->size(), 2);
+
+  // Both items reference the same chunk, which is not copied for each item.
+  auto items = table->Copy();
+  ASSERT_THAT(items, ::testing::SizeIs(2));
+  EXPECT_EQ(items[0].chunks[0].get(), items[1].chunks[0].get());
+
+  // Items for tables which are not local fail the writer.
+  REVERB_ASSERT_OK(
+      writer.CreateItem("missing", 1.0, MakeTrajectory({{second[0]}})));
+  EXPECT_EQ(writer.Flush().code(), absl::StatusCode::kNotFound);
+}
+
+TEST(TrajectoryWriter, CompressesChunksOnPool) {
+  auto* stream = new FakeStream();
+  auto stub = std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
+  EXPECT_CALL(*stub, InsertStreamRaw(_)).WillOnce(Return(stream));
+
+  TrajectoryWriter::Options options = {/*max_chunk_length=*/1,
+                                       /*num_keep_alive_refs=*/2};
+  options.num_compression_threads = 2;
+  TrajectoryWriter writer(stub, options);
+
+  auto want = MakeConstantTensor<tensorflow::DT_INT32>({1}, 7);
+  StepRef first;
+  REVERB_ASSERT_OK(writer.Append(Step({want, want}), &first));
+  REVERB_ASSERT_OK(writer.CreateItem("table", 1.0,
+                                     MakeTrajectory({{first[0]}, {first[1]}})));
+
+  // The chunks are compressed in the background and the item is sent once both
+  // of them are ready.
+  REVERB_ASSERT_OK(writer.Flush());
+  EXPECT_TRUE(first[0].value().lock()->IsReady());
+  EXPECT_TRUE(first[1].value().lock()->IsReady());
+  EXPECT_THAT(stream->requests(), ElementsAre(IsChunk(), IsChunk(), IsItem()));
+
+  tensorflow::Tensor got;
+  REVERB_ASSERT_OK(first[0].value().lock()->GetData(&got));
+  test::ExpectTensorEqual<int32_t>(got, want);
+}
+
 class TrajectoryWriterOptionsTest : public ::testing::Test {
  protected:
   void ExpectInvalidArgumentWithMessage(const std::string& message) {
@@ -1364,6 +2125,13 @@ TEST_F(TrajectoryWriterOptionsTest, Valid) {
   REVERB_EXPECT_OK(options_.Validate());
 }
 
+TEST_F(TrajectoryWriterOptionsTest, UnregisteredCodec) {
+  options_.max_chunk_length = 2;
+  options_.num_keep_alive_refs = 2;
+  options_.codec = ChunkData::ZSTD;
+  ExpectInvalidArgumentWithMessage("codec ZSTD has not been registered.");
+}
+
 TEST_F(TrajectoryWriterOptionsTest, ZeroMaxChunkLength) {
   options_.max_chunk_length = 0;
   options_.num_keep_alive_refs = 2;
@@ -1397,6 +2165,60 @@ TEST_F(TrajectoryWriterOptionsTest, NumKeepAliveLtMaxChunkLength) {
       "num_keep_alive_refs (5) must be >= max_chunk_length (6).");
 }
 
+TEST_F(TrajectoryWriterOptionsTest, NegativeSharedMemoryBytes) {
+  options_.max_chunk_length = 2;
+  options_.num_keep_alive_refs = 2;
+  options_.shared_memory_bytes = -1;
+  ExpectInvalidArgumentWithMessage(
+      "shared_memory_bytes must be >= 0 but got -1.");
+}
+
+TEST_F(TrajectoryWriterOptionsTest, NegativeNumCompressionThreads) {
+  options_.max_chunk_length = 2;
+  options_.num_keep_alive_refs = 2;
+  options_.num_compression_threads = -1;
+  ExpectInvalidArgumentWithMessage(
+      "num_compression_threads must be >= 0 but got -1.");
+}
+
+TEST_F(TrajectoryWriterOptionsTest, NegativeRowsPerBlock) {
+  options_.max_chunk_length = 2;
+  options_.num_keep_alive_refs = 2;
+  options_.rows_per_block = -1;
+  ExpectInvalidArgumentWithMessage("rows_per_block must be >= 0 but got -1.");
+}
+
+TEST_F(TrajectoryWriterOptionsTest, NegativeItemsPerConfirmation) {
+  options_.max_chunk_length = 2;
+  options_.num_keep_alive_refs = 2;
+  options_.items_per_confirmation = -1;
+  ExpectInvalidArgumentWithMessage(
+      "items_per_confirmation must be >= 0 but got -1.");
+}
+
+TEST_F(TrajectoryWriterOptionsTest, ZeroNumEpisodes) {
+  options_.max_chunk_length = 2;
+  options_.num_keep_alive_refs = 2;
+  options_.num_episodes = 0;
+  ExpectInvalidArgumentWithMessage("num_episodes must be > 0 but got 0.");
+}
+
+TEST_F(TrajectoryWriterOptionsTest, NegativeMaxBufferedBytes) {
+  options_.max_chunk_length = 2;
+  options_.num_keep_alive_refs = 2;
+  options_.max_buffered_bytes = -1;
+  ExpectInvalidArgumentWithMessage(
+      "max_buffered_bytes must be >= 0 but got -1.");
+}
+
+TEST_F(TrajectoryWriterOptionsTest, NegativeTargetChunkBytes) {
+  options_.max_chunk_length = 2;
+  options_.num_keep_alive_refs = 2;
+  options_.target_chunk_bytes = -1;
+  ExpectInvalidArgumentWithMessage(
+      "target_chunk_bytes must be >= 0 but got -1.");
+}
+
 }  // namespace
 }  // namespace reverb
 }  // namespace deepmind
@@ -16,12 +16,14 @@
 
 #include <algorithm>
 #include <iterator>
+#include <memory>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include "absl/base/thread_annotations.h"
 #include "absl/functional/bind_front.h"
+#include "absl/memory/memory.h"
 #include "absl/status/status.h"
 #include "absl/strings/str_cat.h"
 #include "absl/synchronization/mutex.h"
@@ -36,6 +38,7 @@
 #include "reverb/cc/support/tf_util.h"
 #include "reverb/cc/support/trajectory_util.h"
 #include "reverb/cc/tensor_compression.h"
+#include "reverb/cc/trajectory_writer.h"
 #include "tensorflow/core/framework/tensor.h"
 #include "tensorflow/core/framework/tensor_util.h"
 
@@ -60,7 +63,7 @@ int PositiveModulo(int value, int divisor) {
 Writer::Writer(std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface> stub,
                int chunk_length, int max_timesteps, bool delta_encoded,
                std::shared_ptr<internal::FlatSignatureMap> signatures,
-               absl::optional<int> max_in_flight_items)
+               absl::optional<int> max_in_flight_items, bool pipelined)
     : stub_(std::move(stub)),
       chunk_length_(chunk_length),
       max_timesteps_(max_timesteps),
@@ -72,7 +75,16 @@ Writer::Writer(std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface> stu
       episode_id_(NewID()),
       index_within_episode_(0),
       closed_(false),
-      inserted_dtypes_and_shapes_(max_timesteps) {}
+      inserted_dtypes_and_shapes_(max_timesteps) {
+  if (pipelined) {
+    REVERB_CHECK(!delta_encoded_)
+        << "Pipelined writers do not support delta encoding.";
+    TrajectoryWriter::Options options;
+    options.max_chunk_length = chunk_length_;
+    options.num_keep_alive_refs = std::max(chunk_length_, max_timesteps_);
+    trajectory_writer_ = absl::make_unique<TrajectoryWriter>(stub_, options);
+  }
+}
 
 Writer::~Writer() {
   if (!closed_) Close().IgnoreError();
@@ -83,11 +95,17 @@ absl::Status Writer::Append(std::vector<tensorflow::Tensor> data) {
     return absl::FailedPreconditionError(
         "Calling method Append after Close has been called");
   }
-  if (!buffer_.empty() && buffer_.front().size() != data.size()) {
+  size_t num_tensors = data.size();
+  if (trajectory_writer_ != nullptr) {
+    if (!step_refs_.empty()) num_tensors = step_refs_.back().size();
+  } else if (!buffer_.empty()) {
+    num_tensors = buffer_.front().size();
+  }
+  if (num_tensors != data.size()) {
     return absl::InvalidArgumentError(absl::StrCat(
         "Number of tensors per timestep was "
         "inconsistent. Previously it was ",
-        buffer_.front().size(), ", but is now ", data.size(), "."));
+        num_tensors, ", but is now ", data.size(), "."));
   }
 
   // Store flattened signature into inserted_dtypes_and_shapes_
@@ -102,13 +120,19 @@ absl::Status Writer::Append(std::vector<tensorflow::Tensor> data) {
   insert_dtypes_and_shapes_location_ =
       (insert_dtypes_and_shapes_location_ + 1) % max_timesteps_;
 
-  buffer_.push_back(std::move(data));
-  if (buffer_.size() < chunk_length_) return absl::OkStatus();
+  absl::Status status;
+  if (trajectory_writer_ != nullptr) {
+    status = AppendPipelined(std::move(data));
+  } else {
+    buffer_.push_back(std::move(data));
+    if (buffer_.size() < chunk_length_) return absl::OkStatus();
 
-  auto status = Finish(/*retry_on_unavailable=*/true);
+    status = Finish(/*retry_on_unavailable=*/true);
+    // Undo adding stuff to the buffer.
+    if (!status.ok()) buffer_.pop_back();
+  }
   if (!status.ok()) {
-    // Undo adding stuff to the buffer and undo the dtypes_and_shapes_ changes.
-    buffer_.pop_back();
+    // Undo the dtypes_and_shapes_ changes.
     insert_dtypes_and_shapes_location_ =
         PositiveModulo(insert_dtypes_and_shapes_location_ - 1, max_timesteps_);
     std::swap(dtypes_and_shapes_t,
@@ -152,7 +176,11 @@ absl::Status Writer::CreateItem(const std::string& table, int num_timesteps,
     return absl::FailedPreconditionError(
         "Calling method CreateItem after Close has been called");
   }
-  if (num_timesteps > chunks_.size() * chunk_length_ + buffer_.size()) {
+  const int num_buffered_timesteps =
+      trajectory_writer_ != nullptr
+          ? step_refs_.size()
+          : chunks_.size() * chunk_length_ + buffer_.size();
+  if (num_timesteps > num_buffered_timesteps) {
     return absl::InvalidArgumentError(
         "Argument `num_timesteps` is larger than number of buffered "
         "timesteps.");
@@ -221,6 +249,10 @@ absl::Status Writer::CreateItem(const std::string& table, int num_timesteps,
     }
   }
 
+  if (trajectory_writer_ != nullptr) {
+    return CreateItemPipelined(table, num_timesteps, priority);
+  }
+
   PrioritizedItem item;
   item.set_key(NewID());
   item.set_table(table.data(), table.size());
@@ -274,6 +306,9 @@ absl::Status Writer::Flush() {
     return absl::FailedPreconditionError(
         "Calling method Flush after Close has been called");
   }
+  if (trajectory_writer_ != nullptr) {
+    return trajectory_writer_->Flush();
+  }
 
   if (!pending_items_.empty()) {
     return Finish(/*retry_on_unavailable=*/true);
@@ -296,6 +331,7 @@ std::string Writer::DebugString() const {
   }
   absl::StrAppend(&str, ", episode_id=", episode_id_,
                   ", index_within_episode=", index_within_episode_,
+                  ", pipelined=", trajectory_writer_ != nullptr,
                   ", closed=", closed_, ")");
   return str;
 }
@@ -354,6 +390,23 @@ absl::Status Writer::Close(bool retry_on_unavailable) {
     return absl::FailedPreconditionError(
         "Calling method Close after Close has been called");
   }
+  if (trajectory_writer_ != nullptr) {
+    // The stream worker retries transient errors until the items have been
+    // written so when retries are disabled the flush instead gives up as soon
+    // as the stream fails and the unconfirmed items are dropped by `Close`.
+    auto status = retry_on_unavailable
+                      ? trajectory_writer_->Flush()
+                      : trajectory_writer_->FlushWithoutRetries();
+    trajectory_writer_->Close();
+    step_refs_.clear();
+    closed_ = true;
+    if (absl::IsUnavailable(status) && !retry_on_unavailable) {
+      REVERB_LOG(REVERB_INFO)
+          << "The Writer will be closed although the server was Unavailable";
+      return absl::OkStatus();
+    }
+    return status;
+  }
   if (!pending_items_.empty()) {
     auto status = Finish(retry_on_unavailable);
     if (!status.ok()) {
@@ -507,6 +560,51 @@ bool Writer::WritePendingData() {
   return true;
 }
 
+absl::Status Writer::AppendPipelined(std::vector<tensorflow::Tensor> data) {
+  std::vector<absl::optional<tensorflow::Tensor>> columns;
+  columns.reserve(data.size());
+  for (auto& tensor : data) {
+    columns.push_back(std::move(tensor));
+  }
+
+  std::vector<absl::optional<std::weak_ptr<CellRef>>> refs;
+  REVERB_RETURN_IF_ERROR(trajectory_writer_->Append(std::move(columns), &refs));
+  step_refs_.push_back(std::move(refs));
+  if (step_refs_.size() > max_timesteps_) {
+    step_refs_.pop_front();
+  }
+  return absl::OkStatus();
+}
+
+absl::Status Writer::CreateItemPipelined(const std::string& table,
+                                         int num_timesteps, double priority) {
+  if (num_timesteps <= 0) {
+    return absl::InvalidArgumentError("`num_timesteps` must be > 0");
+  }
+
+  // Every tensor of the timesteps is a separate column of the trajectory.
+  const int num_columns = step_refs_.back().size();
+  std::vector<TrajectoryColumn> trajectory;
+  trajectory.reserve(num_columns);
+  for (int column = 0; column < num_columns; column++) {
+    std::vector<std::weak_ptr<CellRef>> refs;
+    refs.reserve(num_timesteps);
+    for (int t = step_refs_.size() - num_timesteps; t < step_refs_.size();
+         t++) {
+      refs.push_back(*step_refs_[t][column]);
+    }
+    trajectory.emplace_back(std::move(refs), /*squeeze=*/false);
+  }
+  REVERB_RETURN_IF_ERROR(
+      trajectory_writer_->CreateItem(table, priority, trajectory));
+
+  if (max_in_flight_items_.has_value()) {
+    return trajectory_writer_->AwaitInFlightItems(
+        max_in_flight_items_.value());
+  }
+  return absl::OkStatus();
+}
+
 uint64_t Writer::NewID() {
   return absl::Uniform<uint64_t>(bit_gen_, 0, UINT64_MAX);
 }
@@ -567,7 +665,8 @@ void Writer::ItemConfirmationWorker() {
     }
     if (!stream_->Read(&response)) break;
     absl::WriterMutexLock lock(&mu_);
-    num_items_in_flight_--;
+    // The server batches the confirmations which are ready at the same time.
+    num_items_in_flight_ -= 1 + response.keys_size();
   }
   absl::WriterMutexLock lock(&mu_);
   item_confirmation_worker_running_ = false;
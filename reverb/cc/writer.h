@@ -15,6 +15,7 @@
 #ifndef LEARNING_DEEPMIND_REPLAY_REVERB_WRITER_H_
 #define LEARNING_DEEPMIND_REPLAY_REVERB_WRITER_H_
 
+#include <deque>
 #include <list>
 #include <memory>
 #include <vector>
@@ -36,6 +37,7 @@
 #include "reverb/cc/reverb_service.pb.h"
 #include "reverb/cc/schema.pb.h"
 #include "reverb/cc/support/signature.h"
+#include "reverb/cc/trajectory_writer.h"
 #include "tensorflow/core/framework/tensor.h"
 #include "tensorflow/core/framework/tensor_shape.h"
 #include "tensorflow/core/lib/hash/hash.h"
@@ -44,13 +46,26 @@ namespace deepmind {
 namespace reverb {
 
 // None of the methods are thread safe.
+//
+// If `pipelined` is set then the timesteps are chunked and streamed by a
+// `TrajectoryWriter` rather than by the calling thread. `Append` and
+// `CreateItem` then return as soon as the data has been buffered while the
+// chunks and items are written to the server in the background, and only
+// `Flush`, `Close` and (if `max_in_flight_items` is set) `CreateItem` wait for
+// the server. The items reference the same timesteps but every tensor of the
+// timesteps is chunked separately, and errors encountered by the stream are
+// returned by the next call rather than by the call which caused the write.
+// Pipelined writers do not support `delta_encoded`. Transient errors are
+// retried in the background, except by `Close(/*retry_on_unavailable=*/false)`
+// which gives up as soon as the stream to the server fails.
 class Writer {
  public:
   // The client must not be deleted while any of its writer instances exist.
   Writer(std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface> stub,
          int chunk_length, int max_timesteps, bool delta_encoded = false,
          std::shared_ptr<internal::FlatSignatureMap> signatures = nullptr,
-         absl::optional<int> max_in_flight_items = absl::nullopt);
+         absl::optional<int> max_in_flight_items = absl::nullopt,
+         bool pipelined = false);
   ~Writer();
 
   // Appends a timestamp to internal `buffer_`. If the size of the buffer
@@ -121,6 +136,16 @@ class Writer {
   // Helper for generating a random ID.
   uint64_t NewID();
 
+  // Appends `data` to `trajectory_writer_` and records the references to it
+  // in `step_refs_`.
+  absl::Status AppendPipelined(std::vector<tensorflow::Tensor> data);
+
+  // Creates an item in `trajectory_writer_` which references the last
+  // `num_timesteps` of `step_refs_` and then waits until the number of items
+  // in flight is within `max_in_flight_items_`.
+  absl::Status CreateItemPipelined(const std::string& table, int num_timesteps,
+                                   double priority);
+
   // Blocks until the number of in flight items is <= `limit` or until reading
   // from the stream fails. Returns true if `limit` reached.
   bool ConfirmItems(int limit) ABSL_LOCKS_EXCLUDED(mu_);
@@ -203,6 +228,15 @@ class Writer {
   std::unique_ptr<internal::Thread> item_confirmation_worker_thread_
       ABSL_GUARDED_BY(mu_) = nullptr;
 
+  // Chunks and streams the timesteps when the writer is pipelined, nullptr
+  // otherwise. None of the members below which hold the timesteps, chunks or
+  // pending items are used when set.
+  std::unique_ptr<TrajectoryWriter> trajectory_writer_;
+
+  // References to the tensors of the (at most) `max_timesteps_` most recent
+  // timesteps appended to `trajectory_writer_`, oldest first.
+  std::deque<std::vector<absl::optional<std::weak_ptr<CellRef>>>> step_refs_;
+
   // Cache mapping table name to cached flattened signature.
   std::shared_ptr<internal::FlatSignatureMap> signatures_;
 
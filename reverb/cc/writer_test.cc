@@ -24,6 +24,7 @@
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include "absl/status/status.h"
+#include "absl/synchronization/mutex.h"
 #include "absl/synchronization/notification.h"
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
@@ -139,6 +140,7 @@ class FakeInsertStream
 
   bool Write(const InsertStreamRequest& msg,
              grpc::WriteOptions options) override {
+    absl::MutexLock lock(&mu_);
     requests_->push_back(msg);
     if (msg.item().send_confirmation()) {
       written_item_ids_.push(msg.item().item().key());
@@ -157,7 +159,15 @@ class FakeInsertStream
     }
 
     // If the response IDs queue wasn't explicitly provided then we fallback to
-    // return IDs of that has been sent to the fake server
+    // return IDs of that has been sent to the fake server. The writers only
+    // read while items are in flight, except for pipelined writers which read
+    // until the stream is finished.
+    absl::MutexLock lock(&mu_);
+    mu_.Await(absl::Condition(
+        +[](FakeInsertStream* s) ABSL_EXCLUSIVE_LOCKS_REQUIRED(s->mu_) {
+          return !s->written_item_ids_.empty() || s->finished_;
+        },
+        this));
     if (written_item_ids_.empty()) {
       return false;
     }
@@ -167,12 +177,18 @@ class FakeInsertStream
   }
 
   grpc::Status Finish() override {
+    absl::MutexLock lock(&mu_);
+    finished_ = true;
     return num_success_writes_ >= 0 ? grpc::Status::OK : bad_status_;
   }
 
-  bool WritesDone() override { return num_success_writes_-- > 0; }
+  bool WritesDone() override {
+    absl::MutexLock lock(&mu_);
+    return num_success_writes_-- > 0;
+  }
 
   bool NextMessageSize(uint32_t* sz) override {
+    absl::MutexLock lock(&mu_);
     if (written_item_ids_.empty()) {
       return false;
     }
@@ -184,9 +200,11 @@ class FakeInsertStream
   void WaitForInitialMetadata() override {}
 
  private:
-  std::vector<InsertStreamRequest>* requests_;
-  std::queue<uint64_t> written_item_ids_;
-  int num_success_writes_;
+  absl::Mutex mu_;
+  std::vector<InsertStreamRequest>* requests_ ABSL_GUARDED_BY(mu_);
+  std::queue<uint64_t> written_item_ids_ ABSL_GUARDED_BY(mu_);
+  int num_success_writes_ ABSL_GUARDED_BY(mu_);
+  bool finished_ ABSL_GUARDED_BY(mu_) = false;
   grpc::Status bad_status_;
   internal::Queue<uint64_t>* response_ids_;
 };
@@ -582,6 +600,72 @@ TEST(WriterTest, FlushWritesItem) {
               IsItemWithRangeAndPriorityAndTable(0, 1, 1.0, "dist"));
 }
 
+TEST(WriterTest, PipelinedWriterWritesItemsInBackground) {
+  std::vector<InsertStreamRequest> requests;
+  auto stub = MakeGoodStub(&requests);
+  Writer writer(stub, /*chunk_length=*/2, /*max_timesteps=*/4,
+                /*delta_encoded=*/false, /*signatures=*/nullptr,
+                /*max_in_flight_items=*/absl::nullopt, /*pipelined=*/true);
+
+  REVERB_ASSERT_OK(writer.Append(MakeTimestep(/*num_tensors=*/2)));
+  REVERB_ASSERT_OK(writer.Append(MakeTimestep(/*num_tensors=*/2)));
+  REVERB_ASSERT_OK(writer.Append(MakeTimestep(/*num_tensors=*/2)));
+  REVERB_ASSERT_OK(writer.CreateItem("dist", 3, 1.0));
+
+  // Every tensor is chunked separately and the partial chunks of the last
+  // timestep are finalized by the flush.
+  REVERB_ASSERT_OK(writer.Flush());
+  ASSERT_THAT(requests, SizeIs(5));
+  for (int i = 0; i < 4; i++) {
+    EXPECT_THAT(requests[i], IsChunk());
+  }
+  EXPECT_THAT(requests[4],
+              IsItemWithRangeAndPriorityAndTable(0, 3, 1.0, "dist"));
+  EXPECT_EQ(requests[4].item().item().flat_trajectory().columns_size(), 2);
+
+  REVERB_ASSERT_OK(writer.Close());
+}
+
+TEST(WriterTest, PipelinedWriterFailsIfMethodsCalledAfterClose) {
+  std::vector<InsertStreamRequest> requests;
+  auto stub = MakeGoodStub(&requests);
+  Writer writer(stub, /*chunk_length=*/2, /*max_timesteps=*/4,
+                /*delta_encoded=*/false, /*signatures=*/nullptr,
+                /*max_in_flight_items=*/absl::nullopt, /*pipelined=*/true);
+
+  REVERB_ASSERT_OK(writer.Append(MakeTimestep()));
+  REVERB_ASSERT_OK(writer.CreateItem("dist", 1, 1.0));
+  REVERB_ASSERT_OK(writer.Close());
+  ASSERT_THAT(requests, SizeIs(2));
+
+  EXPECT_FALSE(writer.Close().ok());
+  EXPECT_FALSE(writer.Append(MakeTimestep()).ok());
+  EXPECT_FALSE(writer.CreateItem("dist", 1, 1.0).ok());
+  EXPECT_FALSE(writer.Flush().ok());
+}
+
+TEST(WriterTest, PipelinedWriterCloseDoesntRetryIfRetriesDisabled) {
+  std::vector<InsertStreamRequest> requests;
+  // The worker backs off between the failing streams so it would take several
+  // seconds to reach the final (healthy) stream.
+  auto stub = MakeFlakyStub(&requests, 0, 10,
+                            ToGrpcStatus(absl::UnavailableError("")));
+  Writer writer(stub, /*chunk_length=*/2, /*max_timesteps=*/4,
+                /*delta_encoded=*/false, /*signatures=*/nullptr,
+                /*max_in_flight_items=*/absl::nullopt, /*pipelined=*/true);
+
+  REVERB_ASSERT_OK(writer.Append(MakeTimestep()));
+  REVERB_ASSERT_OK(writer.CreateItem("dist", 1, 1.0));
+
+  // Close gives up as soon as the first stream fails rather than waiting for
+  // the worker to reconnect.
+  REVERB_ASSERT_OK(writer.Close(/*retry_on_unavailable=*/false));
+  for (const auto& request : requests) {
+    EXPECT_FALSE(request.has_item());
+  }
+  EXPECT_FALSE(writer.Append(MakeTimestep()).ok());
+}
+
 TEST(WriterTest, SequenceRangeIsSetOnChunks) {
   std::vector<InsertStreamRequest> requests;
   auto stub = MakeGoodStub(&requests);
@@ -694,6 +778,7 @@ TEST(WriterTest, WriteTimeStepsMatchingSignature) {
   REVERB_ASSERT_OK(writer->Append(MakeTimestep()));
   REVERB_ASSERT_OK(writer->Append(MakeTimestep()));
   REVERB_ASSERT_OK(writer->CreateItem("dist", 2, 1.0));
+  REVERB_ASSERT_OK(writer->Flush());
   ASSERT_THAT(requests, SizeIs(2));
 }
 
@@ -709,6 +794,7 @@ TEST(WriterTest, WriteTimeStepsMatchingBoundedSignature) {
   REVERB_ASSERT_OK(writer->Append(MakeTimestep()));
   REVERB_ASSERT_OK(writer->Append(MakeTimestep()));
   REVERB_ASSERT_OK(writer->CreateItem("dist", 2, 1.0));
+  REVERB_ASSERT_OK(writer->Flush());
   ASSERT_THAT(requests, SizeIs(2));
 }
 
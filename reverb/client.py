@@ -87,6 +87,19 @@ from reverb.cc import schema_pb2
 from tensorflow.python.saved_model import nested_structure_coder  # pylint: disable=g-direct-tensorflow-import
 
 
+def set_channels_per_server(num_channels: int):
+  """Sets the number of gRPC channels shared by clients to the same server.
+
+  All clients in the process (including datasets) which connect to the same
+  server address share a pool of `num_channels` channels, each with its own
+  connection. Only affects clients created after the call.
+
+  Args:
+    num_channels: Number of channels per server address. Must be positive.
+  """
+  pybind.set_channels_per_server(num_channels)
+
+
 class Writer:
   """Writer is used for streaming data of arbitrary length.
 
@@ -479,6 +492,18 @@ class Client:
       deletes = []
     self._client.MutatePriorities(table, list(updates.items()), deletes)
 
+  def delete_episodes(self, table: str, episode_ids: List[int]):
+    """Deletes all items of the episodes from a priority table.
+
+    The table must have been constructed with `index_episodes=True`.
+
+    Args:
+      table: Name of the priority table to delete the items from.
+      episode_ids: Ids of the episodes whose items should be deleted. Episodes
+        without items in the table are ignored.
+    """
+    self._client.DeleteEpisodes(table, episode_ids)
+
   def reset(self, table: str):
     """Clears all items of the table and resets its RateLimiter.
 
@@ -58,8 +58,9 @@ class ReplayDataset(tf.data.Dataset):
                sequence_length: Optional[int] = None,
                emit_timesteps: bool = True,
                rate_limiter_timeout_ms: int = -1,
-               flexible_batch_size: int = -1):
-    """Constructs a new ReplayDataset.
+               flexible_batch_size: int = -1,
+               share_sampler: bool = False):
+    """
 
     Args:
       server_address: Address of gRPC ReverbService.
@@ -107,6 +108,12 @@ class ReplayDataset(tf.data.Dataset):
         Larger `flexible_batch_size` values result a bias towards sampling over
         inserts. In highly overloaded systems this results in higher sample QPS
         and lower insert QPS compared to lower `flexible_batch_size` values.
+      share_sampler: (Defaults to False) If set, the iterators of all datasets
+        in the process which sample from the same table with the same
+        arguments share a single sampler, and thus its workers and streams,
+        instead of creating one each. Useful when many iterators are created,
+        e.g. by `interleave`. Requires `emit_timesteps` to be False. Cancelling
+        any of the iterators closes the shared sampler.
 
 
     Raises:
@@ -120,6 +127,7 @@ class ReplayDataset(tf.data.Dataset):
         `sequence_length` as its leading dimension.
       ValueError: If `rate_limiter_timeout_ms < -1`.
       ValueError: If `flexible_batch_size` is not a positive integer or -1.
+      ValueError: If `share_sampler` is True and `emit_timesteps` is True.
     """
     tree.assert_same_structure(dtypes, shapes, False)
     if max_in_flight_samples_per_worker < 1:
@@ -145,6 +153,8 @@ class ReplayDataset(tf.data.Dataset):
       raise ValueError(
           'flexible_batch_size (%d) must be a positive integer or -1' %
           flexible_batch_size)
+    if share_sampler and emit_timesteps:
+      raise ValueError('share_sampler requires emit_timesteps to be False')
 
     # Add the info fields.
     dtypes = replay_sample.ReplaySample(replay_sample.SampleInfo.tf_dtypes(),
@@ -187,6 +197,7 @@ class ReplayDataset(tf.data.Dataset):
     self._max_samples_per_stream = max_samples_per_stream
     self._rate_limiter_timeout_ms = rate_limiter_timeout_ms
     self._flexible_batch_size = flexible_batch_size
+    self._share_sampler = share_sampler
 
     if _is_tf1_runtime():
       # Disabling to avoid errors given the different tf.data.Dataset init args
@@ -283,7 +294,8 @@ class ReplayDataset(tf.data.Dataset):
         num_workers_per_iterator=self._num_workers_per_iterator,
         max_samples_per_stream=self._max_samples_per_stream,
         rate_limiter_timeout_ms=self._rate_limiter_timeout_ms,
-        flexible_batch_size=self._flexible_batch_size)
+        flexible_batch_size=self._flexible_batch_size,
+        share_sampler=self._share_sampler)
 
   def _inputs(self) -> List[Any]:
     return []
@@ -188,6 +188,11 @@ class ReplayDatasetTest(tf.test.TestCase, parameterized.TestCase):
           'flexible_batch_size': 0,
           'want_error': ValueError,
       },
+      {
+          'testcase_name': 'share_sampler_when_emitting_timesteps',
+          'share_sampler': True,
+          'want_error': ValueError,
+      },
   )
   def test_sampler_parameter_validation(self, **kwargs):
     dtypes = (tf.float32,)
@@ -223,6 +228,27 @@ class ReplayDatasetTest(tf.test.TestCase, parameterized.TestCase):
       np.testing.assert_array_equal(sample.data[0],
                                     np.zeros((3, 3), dtype=np.float32))
 
+  def test_iterators_share_sampler(self):
+    self._populate_replay(sequence_length=10)
+
+    dataset = reverb_dataset.ReplayDataset(
+        self._client.server_address,
+        table='dist',
+        dtypes=(tf.float32,),
+        shapes=(tf.TensorShape([10, 3, 3]),),
+        max_in_flight_samples_per_worker=100,
+        sequence_length=10,
+        emit_timesteps=False,
+        share_sampler=True)
+    interleaved = tf.data.Dataset.range(4).interleave(
+        lambda _: dataset, cycle_length=4)
+
+    got = self._sample_from(interleaved, 20)
+    for sample in got:
+      self.assertIsInstance(sample, replay_sample.ReplaySample)
+      np.testing.assert_array_equal(sample.data[0],
+                                    np.zeros((10, 3, 3), dtype=np.float32))
+
   def test_distribution_strategy(self):
     self._populate_replay()
 
@@ -23,4 +23,6 @@ Lifo = pybind.LifoSelector
 MaxHeap = functools.partial(pybind.HeapSelector, False)  # pylint: disable=invalid-name
 MinHeap = functools.partial(pybind.HeapSelector, True)  # pylint: disable=invalid-name
 Prioritized = pybind.PrioritizedSelector
+RankBased = pybind.RankBasedSelector
+Reservoir = pybind.ReservoirSelector
 Uniform = pybind.UniformSelector
@@ -35,11 +35,15 @@
 #include "reverb/cc/selectors/interface.h"
 #include "reverb/cc/selectors/lifo.h"
 #include "reverb/cc/selectors/prioritized.h"
+#include "reverb/cc/selectors/rank_based.h"
+#include "reverb/cc/selectors/reservoir.h"
 #include "reverb/cc/selectors/uniform.h"
+#include "reverb/cc/support/channel_pool.h"
 #include "reverb/cc/table.h"
 #include "reverb/cc/table_extensions/interface.h"
 #include "reverb/cc/trajectory_writer.h"
 #include "reverb/cc/writer.h"
+#include "tensorflow/core/framework/allocation_description.pb.h"
 #include "tensorflow/core/framework/tensor.h"
 #include "tensorflow/core/framework/tensor_shape.h"
 #include "tensorflow/core/framework/types.h"
@@ -296,8 +300,45 @@ inline tensorflow::Status VerifyDtypeIsSupported(
   return tensorflow::Status::OK();
 }
 
+// Exposes the data of an ndarray as a `tensorflow::TensorBuffer` without
+// copying it. The buffer holds a reference to the array until it is destroyed.
+class NdArrayTensorBuffer : public tensorflow::TensorBuffer {
+ public:
+  // Takes ownership of the reference to `array`.
+  explicit NdArrayTensorBuffer(PyArrayObject *array)
+      : tensorflow::TensorBuffer(PyArray_DATA(array)), array_(array) {}
+
+  ~NdArrayTensorBuffer() override {
+    // The tensor might be released by a thread which doesn't hold the GIL.
+    PyGILState_STATE state = PyGILState_Ensure();
+    Py_DECREF(array_);
+    PyGILState_Release(state);
+  }
+
+  size_t size() const override { return PyArray_NBYTES(array_); }
+
+  tensorflow::TensorBuffer *root_buffer() override { return this; }
+
+  void FillAllocationDescription(
+      tensorflow::AllocationDescription *proto) const override {
+    proto->set_requested_bytes(size());
+    proto->set_allocator_name("NdArrayTensorBuffer");
+  }
+
+  bool OwnsMemory() const override { return false; }
+
+ private:
+  PyArrayObject *array_;
+};
+
+// Converts `ndarray` into `out_tensor`. If `borrow_buffer` is true and the
+// array is (or is converted into) an aligned C-contiguous array of a dtype
+// which can be memcpy'd then `out_tensor` shares the data of the array and
+// keeps it alive instead of copying it. The caller must then not hold on to
+// `out_tensor` while the array could be mutated.
 tensorflow::Status NdArrayToTensor(PyObject *ndarray,
-                                   tensorflow::Tensor *out_tensor) {
+                                   tensorflow::Tensor *out_tensor,
+                                   bool borrow_buffer = false) {
   DCHECK(out_tensor != nullptr);
   auto array_safe = make_safe(PyArray_FromAny(
       /*op=*/ndarray,
@@ -324,7 +365,16 @@ tensorflow::Status NdArrayToTensor(PyObject *ndarray,
     nelems *= dims[i];
   }
 
-  if (tensorflow::DataTypeCanUseMemcpy(dtype)) {
+  if (tensorflow::DataTypeCanUseMemcpy(dtype) && borrow_buffer &&
+      reinterpret_cast<uintptr_t>(PyArray_DATA(py_array)) %
+              EIGEN_MAX_ALIGN_BYTES ==
+          0) {
+    auto *buffer = new NdArrayTensorBuffer(
+        reinterpret_cast<PyArrayObject *>(array_safe.release()));
+    *out_tensor =
+        tensorflow::Tensor(dtype, tensorflow::TensorShape(dims), buffer);
+    buffer->Unref();
+  } else if (tensorflow::DataTypeCanUseMemcpy(dtype)) {
     *out_tensor = tensorflow::Tensor(dtype, tensorflow::TensorShape(dims));
     size_t size = PyArray_NBYTES(py_array);
     memcpy(out_tensor->data(), PyArray_DATA(py_array), size);
@@ -381,6 +431,60 @@ tensorflow::Status TensorToNdArray(const tensorflow::Tensor &tensor,
   return tensorflow::Status::OK();
 }
 
+// Converts `tensor` into an ndarray. Tensors of dtypes which can be memcpy'd
+// are not copied: the array views the buffer of the tensor and keeps it alive
+// through a capsule set as the base object of the array. Other tensors are
+// copied as by `TensorToNdArray`.
+tensorflow::Status TensorToNdArrayView(tensorflow::Tensor tensor,
+                                       PyObject **out_ndarray) {
+  if (!tensorflow::DataTypeCanUseMemcpy(tensor.dtype())) {
+    return TensorToNdArray(tensor, out_ndarray);
+  }
+
+  PyArray_Descr *descr = nullptr;
+  TF_RETURN_IF_ERROR(GetPyDescrFromTensor(tensor, &descr));
+
+  absl::InlinedVector<npy_intp, 4> dims(tensor.dims());
+  for (int i = 0; i < tensor.dims(); i++) {
+    dims[i] = tensor.dim_size(i);
+  }
+
+  void *data = const_cast<char *>(tensor.tensor_data().data());
+  auto safe_out_ndarray = make_safe(PyArray_NewFromDescr(
+      &PyArray_Type, descr, dims.size(), dims.data(), /*strides=*/nullptr, data,
+      NPY_ARRAY_CARRAY, /*obj=*/nullptr));
+  if (!safe_out_ndarray) {
+    return tensorflow::errors::Internal("Could not allocate ndarray");
+  }
+
+  PyObject *owner = PyCapsule_New(
+      new tensorflow::Tensor(std::move(tensor)), /*name=*/nullptr,
+      [](PyObject *capsule) {
+        delete static_cast<tensorflow::Tensor *>(
+            PyCapsule_GetPointer(capsule, /*name=*/nullptr));
+      });
+  if (owner == nullptr) {
+    return tensorflow::errors::Internal("Could not allocate capsule");
+  }
+  // Steals the reference to `owner`, also when it fails.
+  if (PyArray_SetBaseObject(
+          reinterpret_cast<PyArrayObject *>(safe_out_ndarray.get()), owner) !=
+      0) {
+    return tensorflow::errors::Internal("Could not set base of ndarray");
+  }
+
+  *out_ndarray = safe_out_ndarray.release();
+  return tensorflow::Status::OK();
+}
+
+// Tensor converted from an ndarray which shares the data of the array, see
+// `NdArrayToTensor`. Used for arguments which are copied before the call
+// returns, e.g. the steps passed to `TrajectoryWriter::Append`, so that the
+// only copy of the data is the one made by the callee.
+struct BorrowedTensor {
+  tensorflow::Tensor tensor;
+};
+
 // This wrapper exists for the sole purpose of allowing the weak_ptr to be
 // handled in Python. Pybind supports shared_ptr and unique_ptr out of the box
 // and although it is possible to implement our own `SmartPointer, using a
@@ -463,6 +567,27 @@ struct type_caster<tensorflow::Tensor> {
   }
 };
 
+template <>
+struct type_caster<BorrowedTensor> {
+ public:
+  PYBIND11_TYPE_CASTER(BorrowedTensor, _("tensorflow::Tensor"));
+
+  bool load(handle handle, bool) {
+    tensorflow::Status status =
+        NdArrayToTensor(handle.ptr(), &value.tensor, /*borrow_buffer=*/true);
+
+    if (!status.ok()) {
+      REVERB_LOG(REVERB_ERROR)
+          << "Tensor can't be extracted from the source represented as "
+             "ndarray: "
+          << status.ToString();
+      PyErr_Clear();
+      return false;
+    }
+    return true;
+  }
+};
+
 // Raise an exception if a given status is not OK, otherwise return None.
 template <>
 struct type_caster<absl::Status> {
@@ -511,6 +636,14 @@ PYBIND11_MODULE(libpybind, m) {
       m, "HeapSelector")
       .def(py::init<bool>(), py::arg("min_heap"));
 
+  py::class_<RankBasedSelector, ItemSelector,
+             std::shared_ptr<RankBasedSelector>>(m, "RankBasedSelector")
+      .def(py::init<double>(), py::arg("priority_exponent"));
+
+  py::class_<ReservoirSelector, ItemSelector,
+             std::shared_ptr<ReservoirSelector>>(m, "ReservoirSelector")
+      .def(py::init());
+
   py::class_<TableExtension, std::shared_ptr<TableExtension>>(m,
                                                               "TableExtension")
       .def("__repr__", &TableExtension::DebugString,
@@ -533,7 +666,10 @@ PYBIND11_MODULE(libpybind, m) {
                   const std::vector<std::shared_ptr<TableExtension>>
                       &extensions,
                   const absl::optional<std::string> &serialized_signature =
-                      absl::nullopt) -> Table * {
+                      absl::nullopt,
+                  int64_t max_chunk_bytes = 0,
+                  double max_age_sec = 0,
+                  bool index_episodes = false) -> Table * {
                  absl::optional<tensorflow::StructuredValue> signature =
                      absl::nullopt;
                  if (serialized_signature) {
@@ -547,18 +683,37 @@ PYBIND11_MODULE(libpybind, m) {
                      return nullptr;
                    }
                  }
+                 auto max_age = max_age_sec > 0 ? absl::Seconds(max_age_sec)
+                                                : absl::InfiniteDuration();
                  return new Table(name, sampler, remover, max_size,
                                   max_times_sampled, rate_limiter, extensions,
-                                  std::move(signature));
+                                  std::move(signature), max_chunk_bytes,
+                                  max_age, index_episodes);
                }),
            py::arg("name"), py::arg("sampler"), py::arg("remover"),
            py::arg("max_size"), py::arg("max_times_sampled"),
-           py::arg("rate_limiter"), py::arg("extensions"), py::arg("signature"))
+           py::arg("rate_limiter"), py::arg("extensions"), py::arg("signature"),
+           py::arg("max_chunk_bytes") = 0, py::arg("max_age_sec") = 0,
+           py::arg("index_episodes") = false)
       .def("name", &Table::name)
       .def("can_sample", &Table::CanSample,
            py::call_guard<py::gil_scoped_release>())
       .def("can_insert", &Table::CanInsert,
            py::call_guard<py::gil_scoped_release>())
+      .def(
+          "set_priority_exponent",
+          [](Table *table, double priority_exponent) {
+            // Release the GIL only while the table is being reweighted. See
+            // `Sampler.GetNextTimestep` for why it must be held when
+            // `MaybeRaiseFromStatus` is called.
+            absl::Status status;
+            {
+              py::gil_scoped_release g;
+              status = table->SetPriorityExponent(priority_exponent);
+            }
+            MaybeRaiseFromStatus(status);
+          },
+          py::arg("priority_exponent"))
       .def("__repr__", &Table::DebugString,
            py::call_guard<py::gil_scoped_release>());
 
@@ -612,6 +767,35 @@ PYBIND11_MODULE(libpybind, m) {
              MaybeRaiseFromStatus(status);
              return sample;
            })
+      .def("GetNextBatch",
+           [](Sampler *sampler, int batch_size) {
+             absl::Status status;
+             std::vector<tensorflow::Tensor> batch;
+
+             // The samples are decoded straight into the batch without the
+             // GIL. See `GetNextTimestep` for why the GIL must be held when
+             // `MaybeRaiseFromStatus` is called.
+             {
+               py::gil_scoped_release g;
+               status = sampler->GetNextBatch(batch_size, &batch);
+             }
+             MaybeRaiseFromStatus(status);
+
+             // The arrays view the decoded tensors rather than copying them.
+             py::list arrays;
+             for (auto &tensor : batch) {
+               PyObject *array;
+               tensorflow::Status view_status =
+                   TensorToNdArrayView(std::move(tensor), &array);
+               if (!view_status.ok()) {
+                 MaybeRaiseFromStatus(
+                     absl::InternalError(view_status.ToString()));
+               }
+               arrays.append(py::reinterpret_steal<py::object>(array));
+             }
+             return arrays;
+           },
+           py::arg("batch_size"))
       .def("Close", &Sampler::Close, py::call_guard<py::gil_scoped_release>());
 
   py::class_<Client>(m, "Client")
@@ -667,6 +851,13 @@ PYBIND11_MODULE(libpybind, m) {
             return client->MutatePriorities(table, update_protos, deletes);
           },
           py::call_guard<py::gil_scoped_release>())
+      .def(
+          "DeleteEpisodes",
+          [](Client *client, const std::string &table,
+             const std::vector<uint64_t> &episode_ids) {
+            return client->DeleteEpisodes(table, episode_ids);
+          },
+          py::call_guard<py::gil_scoped_release>())
       .def("Reset", &Client::Reset, py::call_guard<py::gil_scoped_release>())
       .def("ServerInfo",
            [](Client *client, int timeout_sec) {
@@ -712,6 +903,17 @@ PYBIND11_MODULE(libpybind, m) {
       .def("__repr__", &Checkpointer::DebugString,
            py::call_guard<py::gil_scoped_release>());
 
+  m.def(
+      "set_channels_per_server",
+      [](int num_channels) {
+        if (num_channels <= 0) {
+          MaybeRaiseFromStatus(absl::InvalidArgumentError(absl::StrCat(
+              "num_channels must be positive but got ", num_channels, ".")));
+        }
+        ChannelPool::Global()->SetChannelsPerTarget(num_channels);
+      },
+      py::arg("num_channels"));
+
   m.def(
       "create_default_checkpointer",
       [](const std::string &name, const std::string &group = "") {
@@ -723,15 +925,61 @@ PYBIND11_MODULE(libpybind, m) {
   py::class_<Server, std::shared_ptr<Server>>(m, "Server")
       .def(
           py::init([](std::vector<std::shared_ptr<Table>> priority_tables,
-                      int port,
-                      std::shared_ptr<Checkpointer> checkpointer = nullptr) {
+                      int port, std::shared_ptr<Checkpointer> checkpointer,
+                      absl::optional<int64_t> max_insert_read_ahead_bytes,
+                      std::vector<int> additional_ports, bool reuse_port,
+                      absl::optional<int> max_send_message_size,
+                      absl::optional<int> max_receive_message_size,
+                      absl::optional<int> http2_stream_window_bytes,
+                      absl::optional<int> http2_write_buffer_bytes,
+                      absl::optional<int> max_concurrent_streams,
+                      bool numa_aware, bool deduplicate_chunks,
+                      absl::optional<double> checkpoint_interval_seconds,
+                      bool read_only, bool use_callback_service) {
+            ServerOptions options;
+            options.max_insert_read_ahead_bytes =
+                max_insert_read_ahead_bytes.value_or(0);
+            options.additional_ports = std::move(additional_ports);
+            options.reuse_port = reuse_port;
+            options.max_send_message_size =
+                max_send_message_size.value_or(kMaxMessageSize);
+            options.max_receive_message_size =
+                max_receive_message_size.value_or(kMaxMessageSize);
+            options.http2_stream_window_bytes =
+                http2_stream_window_bytes.value_or(0);
+            options.http2_write_buffer_bytes =
+                http2_write_buffer_bytes.value_or(0);
+            options.max_concurrent_streams = max_concurrent_streams.value_or(0);
+            options.numa_aware = numa_aware;
+            options.deduplicate_chunks = deduplicate_chunks;
+            if (checkpoint_interval_seconds.has_value()) {
+              options.checkpoint_interval =
+                  absl::Seconds(*checkpoint_interval_seconds);
+            }
+            options.read_only = read_only;
+            options.use_callback_service = use_callback_service;
+
             std::unique_ptr<Server> server;
             MaybeRaiseFromStatus(StartServer(std::move(priority_tables), port,
-                                             std::move(checkpointer), &server));
+                                             std::move(checkpointer), options,
+                                             &server));
             return server.release();
           }),
           py::arg("priority_tables"), py::arg("port"),
-          py::arg("checkpointer") = nullptr)
+          py::arg("checkpointer") = nullptr,
+          py::arg("max_insert_read_ahead_bytes") = absl::nullopt,
+          py::arg("additional_ports") = std::vector<int>(),
+          py::arg("reuse_port") = true,
+          py::arg("max_send_message_size") = absl::nullopt,
+          py::arg("max_receive_message_size") = absl::nullopt,
+          py::arg("http2_stream_window_bytes") = absl::nullopt,
+          py::arg("http2_write_buffer_bytes") = absl::nullopt,
+          py::arg("max_concurrent_streams") = absl::nullopt,
+          py::arg("numa_aware") = false,
+          py::arg("deduplicate_chunks") = false,
+          py::arg("checkpoint_interval_seconds") = absl::nullopt,
+          py::arg("read_only") = false,
+          py::arg("use_callback_service") = true)
       .def("Stop", &Server::Stop, py::call_guard<py::gil_scoped_release>())
       .def("Wait", &Server::Wait, py::call_guard<py::gil_scoped_release>())
       .def("InProcessClient", &Server::InProcessClient,
@@ -766,7 +1014,17 @@ PYBIND11_MODULE(libpybind, m) {
       .def(
           "Append",
           [](TrajectoryWriter *writer,
-             std::vector<absl::optional<tensorflow::Tensor>> data) {
+             std::vector<absl::optional<BorrowedTensor>> py_data) {
+            // The chunkers copy the rows into their buffers so the tensors
+            // can share the data of the arrays.
+            std::vector<absl::optional<tensorflow::Tensor>> data(
+                py_data.size());
+            for (int i = 0; i < py_data.size(); i++) {
+              if (py_data[i].has_value()) {
+                data[i] = std::move(py_data[i]->tensor);
+              }
+            }
+
             std::vector<absl::optional<std::weak_ptr<CellRef>>> refs;
             MaybeRaiseFromStatus(writer->Append(std::move(data), &refs));
 
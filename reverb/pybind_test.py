@@ -14,10 +14,13 @@
 
 """Sanity tests for the pybind.py."""
 
+import gc
+
 from absl.testing import absltest
 from absl.testing import parameterized
 import numpy as np
 import reverb
+from reverb import trajectory_writer
 
 TABLE_NAME = 'queue'
 
@@ -83,5 +86,93 @@ class TestNdArrayToTensorAndBack(parameterized.TestCase):
       np.testing.assert_array_equal(got, b'string_' + (b'a' * 100 * i))
 
 
+
+class SamplerGetNextBatchTest(absltest.TestCase):
+
+  def setUp(self):
+    super().setUp()
+    self._server = reverb.Server(
+        tables=[reverb.Table.queue(TABLE_NAME, 1000)], port=None)
+    self._client = self._server.in_process_client()
+
+  def tearDown(self):
+    super().tearDown()
+    self._server.stop()
+
+  def _insert(self, steps):
+    with trajectory_writer.TrajectoryWriter(self._client, 1, 1) as writer:
+      for step in steps:
+        writer.append({'x': step})
+        writer.create_item(TABLE_NAME, 1.0, writer.history['x'][-1])
+
+  def _new_sampler(self, max_samples):
+    # pylint: disable=protected-access
+    return self._client._client.NewSampler(TABLE_NAME, max_samples, 1, -1)
+    # pylint: enable=protected-access
+
+  def test_returns_batched_columns(self):
+    steps = [np.arange(6, dtype=np.float32).reshape([2, 3]) + i
+             for i in range(4)]
+    self._insert(steps)
+
+    batch = self._new_sampler(4).GetNextBatch(4)
+
+    self.assertLen(batch, 5)
+    keys, probabilities, table_sizes, priorities, data = batch
+    self.assertEqual(keys.dtype, np.uint64)
+    self.assertEqual(probabilities.dtype, np.float64)
+    self.assertEqual(table_sizes.dtype, np.int64)
+    self.assertEqual(priorities.dtype, np.float64)
+    for column in (keys, probabilities, table_sizes, priorities):
+      self.assertEqual(column.shape, (4,))
+    np.testing.assert_array_equal(priorities, np.ones(4))
+
+    self.assertEqual(data.dtype, np.float32)
+    self.assertEqual(data.shape, (4, 2, 3))
+    np.testing.assert_array_equal(data, np.stack(steps))
+
+  def test_arrays_view_the_decoded_batch(self):
+    self._insert([np.ones([16], dtype=np.int32) * i for i in range(2)])
+
+    data = self._new_sampler(2).GetNextBatch(2)[-1]
+
+    # The array does not own its data but borrows it from the tensor, which
+    # the base object of the array keeps alive.
+    self.assertFalse(data.flags.owndata)
+    self.assertIsNotNone(data.base)
+    self.assertTrue(data.flags.c_contiguous)
+    self.assertTrue(data.flags.writeable)
+
+  def test_arrays_outlive_the_sampler(self):
+    steps = [np.arange(1024, dtype=np.float64) * i for i in range(3)]
+    self._insert(steps)
+
+    sampler = self._new_sampler(3)
+    data = sampler.GetNextBatch(3)[-1]
+    sampler.Close()
+    del sampler
+    gc.collect()
+
+    # Allocations made after the sampler is gone must not reuse the buffer.
+    garbage = [np.full([1024], -1.0) for _ in range(100)]
+    del garbage
+    np.testing.assert_array_equal(data, np.stack(steps))
+
+  def test_string_columns_are_copied(self):
+    steps = [np.array([b'a', b'bc']), np.array([b'def', b'g'])]
+    self._insert(steps)
+
+    data = self._new_sampler(2).GetNextBatch(2)[-1]
+
+    self.assertEqual(data.shape, (2, 2))
+    self.assertTrue(data.flags.owndata)
+    np.testing.assert_array_equal(data, np.stack(steps).astype(object))
+
+  def test_invalid_batch_size_raises(self):
+    self._insert([np.zeros([2], dtype=np.float32)])
+    with self.assertRaises(ValueError):
+      self._new_sampler(1).GetNextBatch(0)
+
+
 if __name__ == '__main__':
   absltest.main()
@@ -28,9 +28,12 @@ Fifo = pybind.FifoSelector
 Heap = pybind.HeapSelector
 Lifo = pybind.LifoSelector
 Prioritized = pybind.PrioritizedSelector
+RankBased = pybind.RankBasedSelector
+Reservoir = pybind.ReservoirSelector
 Uniform = pybind.UniformSelector
 
-SelectorType = Union[Fifo, Heap, Lifo, Prioritized, Uniform]
+SelectorType = Union[Fifo, Heap, Lifo, Prioritized, RankBased, Reservoir,
+                     Uniform]
 
 # Note that this is effectively treated as `Any`; see b/109648354.
 SpecNest = Union[
@@ -106,7 +106,10 @@ class Table:
                rate_limiter: rate_limiters.RateLimiter,
                max_times_sampled: int = 0,
                extensions: Sequence[TableExtensionBase] = (),
-               signature: Optional[reverb_types.SpecNest] = None):
+               signature: Optional[reverb_types.SpecNest] = None,
+               max_chunk_bytes: int = 0,
+               max_age_sec: float = 0,
+               index_episodes: bool = False):
     """Constructor of the Table.
 
     Args:
@@ -125,6 +128,17 @@ class Table:
         the table.
       signature: Optional nested structure containing `tf.TypeSpec` objects,
         describing the schema of items in this table.
+      max_chunk_bytes: Maximum total size (in bytes) of the chunks referenced by
+        the items in the table. When an insert causes the budget to be exceeded
+        the `remover` is used for selecting items to remove until the chunks
+        fit. Any value < 1 means there is no limit.
+      max_age_sec: Maximum age (in seconds) of the items in the table. Items are
+        deleted in the background once they were inserted more than
+        `max_age_sec` ago, regardless of `max_size`. Any value <= 0 means that
+        items never expire.
+      index_episodes: If True then the table maintains an index of the items
+        referencing each episode, which allows all items of an episode to be
+        deleted (see `Client.delete_episodes`) without knowing their keys.
 
     Raises:
       ValueError: If name is empty.
@@ -159,7 +173,10 @@ class Table:
         max_times_sampled=max_times_sampled,
         rate_limiter=rate_limiter.internal_limiter,
         extensions=internal_extensions,
-        signature=signature_proto_str)
+        signature=signature_proto_str,
+        max_chunk_bytes=max_chunk_bytes,
+        max_age_sec=max_age_sec,
+        index_episodes=index_episodes)
 
   @classmethod
   def queue(cls,
@@ -227,6 +244,23 @@ class Table:
     """Returns True if an insert operation is permitted at the current state."""
     return self.internal_table.can_insert(num_inserts)
 
+  def set_priority_exponent(self, priority_exponent: float):
+    """Changes the priority exponent of the prioritized selectors of the table.
+
+    The weights of all items are recomputed from their priorities so the items
+    do not have to be reinserted, e.g. when annealing the degree of
+    prioritization during training. Both the sampler and the remover are
+    updated if they are `item_selectors.Prioritized`.
+
+    Args:
+      priority_exponent: New exponent. Must be non-negative.
+
+    Raises:
+      ValueError: If `priority_exponent` is negative.
+      RuntimeError: If neither the sampler nor the remover is prioritized.
+    """
+    self.internal_table.set_priority_exponent(priority_exponent)
+
   def __repr__(self):
     return repr(self.internal_table)
 
@@ -248,7 +282,20 @@ class Server:
   def __init__(self,
                tables: Sequence[Table] = None,
                port: Union[int, None] = None,
-               checkpointer: checkpointers.CheckpointerBase = None):
+               checkpointer: checkpointers.CheckpointerBase = None,
+               max_insert_read_ahead_bytes: Optional[int] = None,
+               additional_ports: Sequence[int] = (),
+               reuse_port: bool = True,
+               max_send_message_size: Optional[int] = None,
+               max_receive_message_size: Optional[int] = None,
+               http2_stream_window_bytes: Optional[int] = None,
+               http2_write_buffer_bytes: Optional[int] = None,
+               max_concurrent_streams: Optional[int] = None,
+               numa_aware: bool = False,
+               deduplicate_chunks: bool = False,
+               checkpoint_interval_seconds: Optional[float] = None,
+               read_only: bool = False,
+               use_callback_service: bool = True):
     """Constructor of Server serving the ReverbService.
 
     Args:
@@ -258,13 +305,75 @@ class Server:
       checkpointer: Checkpointer used for storing/loading checkpoints. If None
         (default) then `checkpointers.default_checkpointer` is used to
         construct the checkpointer.
+      max_insert_read_ahead_bytes: Maximum size of the data that an insert
+        stream reads ahead of the items that have been inserted into the
+        tables. A larger budget absorbs longer stalls of the tables (e.g. while
+        blocked by the rate limiter) before the writers are throttled. If None
+        (default) then 64MB is used.
+      additional_ports: Ports to listen on in addition to `port`, e.g. to
+        spread the connections of many clients over several listeners.
+      reuse_port: If True (default) then the listeners are created with
+        `SO_REUSEPORT` so that several server processes on the same host can
+        listen on the same port, with the kernel sharding the connections
+        between them.
+      max_send_message_size: Maximum size of the messages sent by the server.
+        If None (default) then the size is unlimited.
+      max_receive_message_size: Maximum size of the messages received by the
+        server. If None (default) then the size is unlimited.
+      http2_stream_window_bytes: Size of the HTTP/2 flow control window of each
+        stream. If None (default) then the window is sized automatically by
+        gRPC, which can be too slow to open the window on fast links.
+      http2_write_buffer_bytes: Size of the buffer which the writes of each
+        connection are coalesced into. If None (default) then the gRPC default
+        is used.
+      max_concurrent_streams: Maximum number of concurrent streams of each
+        connection. If None (default) then the gRPC default is used.
+      numa_aware: If True then the tables are spread round-robin over the NUMA
+        nodes of the host and the background threads of each table are pinned
+        to the CPUs of its node.
+      deduplicate_chunks: If True then chunks whose content is identical to
+        that of a chunk already held by the server (e.g. the same episode
+        written by several writers) share the existing chunk rather than
+        being stored twice.
+      checkpoint_interval_seconds: If set then the server saves a checkpoint
+        with `checkpointer` at this interval, in addition to the checkpoints
+        requested by clients. If None (default) then checkpoints are only saved
+        when requested.
+      read_only: If True then the tables are frozen once the latest checkpoint
+        of `checkpointer` has been loaded. Inserts, updates, deletes and resets
+        then fail, and samples ignore the rate limiters and are served without
+        locking the tables, which makes the server well suited for offline
+        training on a fixed dataset. Every table must be non-empty after the
+        checkpoint has been loaded and must not set `max_times_sampled`,
+        `max_age` or extensions.
+      use_callback_service: If True (default) then the streams are served by
+        the fixed size callback executor of gRPC. If False then every open
+        stream is served by a thread of its own (two for insert streams), so
+        the number of threads grows with the number of connected clients. The
+        latter does not support `deduplicate_chunks`,
+        `max_insert_read_ahead_bytes`, the `ExportTable` RPC, sample groups or
+        mixtures.
 
     Raises:
       ValueError: If tables is empty.
       ValueError: If multiple Table in tables share names.
+      ValueError: If `max_insert_read_ahead_bytes` is not positive.
+      ValueError: If `checkpoint_interval_seconds` is not positive.
+      ValueError: If `use_callback_service` is False and
+        `deduplicate_chunks` or `max_insert_read_ahead_bytes` is set.
     """
     if not tables:
       raise ValueError('At least one table must be provided')
+    if (max_insert_read_ahead_bytes is not None and
+        max_insert_read_ahead_bytes <= 0):
+      raise ValueError(
+          'max_insert_read_ahead_bytes must be > 0 but got '
+          f'{max_insert_read_ahead_bytes}.')
+    if (checkpoint_interval_seconds is not None and
+        checkpoint_interval_seconds <= 0):
+      raise ValueError(
+          'checkpoint_interval_seconds must be > 0 but got '
+          f'{checkpoint_interval_seconds}.')
     names = collections.Counter(table.name for table in tables)
     duplicates = [name for name, count in names.items() if count > 1]
     if duplicates:
@@ -277,8 +386,23 @@ class Server:
     if checkpointer is None:
       checkpointer = checkpointers.default_checkpointer()
 
-    self._server = pybind.Server([table.internal_table for table in tables],
-                                 port, checkpointer.internal_checkpointer())
+    self._server = pybind.Server(
+        [table.internal_table for table in tables],
+        port,
+        checkpointer.internal_checkpointer(),
+        max_insert_read_ahead_bytes,
+        additional_ports=list(additional_ports),
+        reuse_port=reuse_port,
+        max_send_message_size=max_send_message_size,
+        max_receive_message_size=max_receive_message_size,
+        http2_stream_window_bytes=http2_stream_window_bytes,
+        http2_write_buffer_bytes=http2_write_buffer_bytes,
+        max_concurrent_streams=max_concurrent_streams,
+        numa_aware=numa_aware,
+        deduplicate_chunks=deduplicate_chunks,
+        checkpoint_interval_seconds=checkpoint_interval_seconds,
+        read_only=read_only,
+        use_callback_service=use_callback_service)
     self._port = port
 
   def __del__(self):
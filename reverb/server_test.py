@@ -20,6 +20,8 @@ only contains a few extra cases which does not fit well in the client tests.
 """
 
 from absl.testing import absltest
+import portpicker
+from reverb import client
 from reverb import item_selectors
 from reverb import rate_limiters
 from reverb import server
@@ -45,6 +47,32 @@ class ServerTest(absltest.TestCase):
     del my_client
     my_server.stop()
 
+  def test_sync_service_inserts_and_samples(self):
+    my_server = server.Server(
+        tables=[
+            server.Table(
+                name=TABLE_NAME,
+                sampler=item_selectors.Uniform(),
+                remover=item_selectors.Fifo(),
+                max_size=100,
+                rate_limiter=rate_limiters.MinSize(1)),
+        ],
+        port=None,
+        use_callback_service=False)
+    my_client = my_server.in_process_client()
+    my_client.insert(1, {TABLE_NAME: 1.0})
+    sample = next(my_client.sample(TABLE_NAME, 1))
+    self.assertEqual(sample[0].info.table_size, 1)
+    del my_client
+    my_server.stop()
+
+  def test_sync_service_rejects_deduplicate_chunks(self):
+    with self.assertRaises(ValueError):
+      server.Server(
+          tables=[server.Table.queue(TABLE_NAME, 10)],
+          use_callback_service=False,
+          deduplicate_chunks=True)
+
   def test_duplicate_priority_table_name(self):
     with self.assertRaises(ValueError):
       server.Server(
@@ -68,6 +96,24 @@ class ServerTest(absltest.TestCase):
     with self.assertRaises(ValueError):
       server.Server(tables=[], port=None)
 
+  def test_non_positive_max_insert_read_ahead_bytes(self):
+    with self.assertRaises(ValueError):
+      server.Server(
+          tables=[server.Table.queue(TABLE_NAME, 10)],
+          max_insert_read_ahead_bytes=0)
+
+  def test_serves_additional_ports(self):
+    additional_port = portpicker.pick_unused_port()
+    my_server = server.Server(
+        tables=[server.Table.queue(TABLE_NAME, 10)],
+        additional_ports=[additional_port],
+        http2_stream_window_bytes=16 << 20)
+    my_client = client.Client(f'localhost:{additional_port}')
+    my_client.insert(1, {TABLE_NAME: 1.0})
+    self.assertEqual(my_client.server_info()[TABLE_NAME].current_size, 1)
+    my_server.stop()
+    portpicker.return_port(additional_port)
+
   def test_can_sample(self):
     table = server.Table(
         name=TABLE_NAME,
@@ -89,6 +135,42 @@ class ServerTest(absltest.TestCase):
     del my_client
     my_server.stop()
 
+  def test_set_priority_exponent(self):
+    table = server.Table(
+        name=TABLE_NAME,
+        sampler=item_selectors.Prioritized(1),
+        remover=item_selectors.Fifo(),
+        max_size=100,
+        max_times_sampled=0,
+        rate_limiter=rate_limiters.MinSize(1))
+    my_server = server.Server(tables=[table], port=None)
+    my_client = my_server.in_process_client()
+    my_client.insert(1, {TABLE_NAME: 1.0})
+    my_client.insert(2, {TABLE_NAME: 3.0})
+
+    table.set_priority_exponent(2)
+    for sample in my_client.sample(TABLE_NAME, 10):
+      expected = 0.1 if sample[0].info.priority == 1.0 else 0.9
+      self.assertAlmostEqual(sample[0].info.probability, expected)
+    info = my_client.server_info()[TABLE_NAME]
+    self.assertEqual(info.sampler_options.prioritized.priority_exponent, 2)
+
+    with self.assertRaises(ValueError):
+      table.set_priority_exponent(-1)
+    del my_client
+    my_server.stop()
+
+  def test_set_priority_exponent_requires_prioritized_selector(self):
+    table = server.Table(
+        name=TABLE_NAME,
+        sampler=item_selectors.Uniform(),
+        remover=item_selectors.Fifo(),
+        max_size=100,
+        max_times_sampled=0,
+        rate_limiter=rate_limiters.MinSize(1))
+    with self.assertRaises(RuntimeError):
+      table.set_priority_exponent(2)
+
 
 if __name__ == '__main__':
   absltest.main()
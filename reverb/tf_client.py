@@ -117,7 +117,8 @@ class TFClient:
                         table: str,
                         keys: tf.Tensor,
                         priorities: tf.Tensor,
-                        name: str = None):
+                        name: str = None,
+                        asynchronous: bool = False):
     """Creates op for updating priorities of existing items in the replay.
 
     Not found elements for `keys` are silently ignored.
@@ -127,6 +128,11 @@ class TFClient:
       keys: Keys of the items to update. Must be same length as `priorities`.
       priorities: New priorities for `keys`. Must be same length as `keys`.
       name: Optional name for the operation.
+      asynchronous: If True then the op does not wait for the server. The
+        updates are buffered by the client and sent in the background, merged
+        with the other updates of `table` so that only the latest priority of
+        each key is sent. An error of a failed update is raised by a later
+        call.
 
     Returns:
       A tf-op for performing the update.
@@ -135,7 +141,12 @@ class TFClient:
     with tf.name_scope(name, f'{self._name}_update_priorities',
                        ['update_priorities']) as scope:
       return gen_client_ops.reverb_client_update_priorities(
-          self._handle, table, keys, priorities, name=scope)
+          self._handle,
+          table,
+          keys,
+          priorities,
+          asynchronous=asynchronous,
+          name=scope)
 
   def dataset(self,
               table: str,
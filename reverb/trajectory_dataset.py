@@ -48,7 +48,8 @@ class TrajectoryDataset(tf.data.Dataset):
                num_workers_per_iterator: int = -1,
                max_samples_per_stream: int = -1,
                rate_limiter_timeout_ms: int = -1,
-               flexible_batch_size: int = -1):
+               flexible_batch_size: int = -1,
+               batch_size: Optional[int] = None):
     """Constructs a new TrajectoryDataset.
 
     Args:
@@ -89,6 +90,13 @@ class TrajectoryDataset(tf.data.Dataset):
           a bias towards sampling over inserts. In highly overloaded systems
           this results in higher sample QPS and lower insert QPS compared to
           lower `flexible_batch_size` values.
+      batch_size: (Defaults to None: no batching) If set then every element
+        holds this many trajectories batched along a new leading dimension.
+        The batch is sampled and decoded in place by a single call which is
+        considerably faster than `dataset.batch(batch_size)` for small
+        trajectories. `shapes` still describe a single trajectory. Samples of
+        an incomplete batch are dropped if `rate_limiter_timeout_ms` ends the
+        sequence.
 
     Raises:
       ValueError: If `dtypes` and `shapes` don't share the same structure.
@@ -98,6 +106,7 @@ class TrajectoryDataset(tf.data.Dataset):
       ValueError: If `max_samples_per_stream` is not a positive integer or -1.
       ValueError: If `rate_limiter_timeout_ms < -1`.
       ValueError: If `flexible_batch_size` is not a positive integer or -1.
+      ValueError: If `batch_size` is not None or a positive integer.
     """
     tree.assert_same_structure(dtypes, shapes, False)
     if max_in_flight_samples_per_worker < 1:
@@ -119,6 +128,9 @@ class TrajectoryDataset(tf.data.Dataset):
       raise ValueError(
           'flexible_batch_size (%d) must be a positive integer or -1' %
           flexible_batch_size)
+    if batch_size is not None and batch_size < 1:
+      raise ValueError(
+          'batch_size (%d) must be None or a positive integer' % batch_size)
 
     # Add the info fields (all scalars).
     dtypes = replay_sample.ReplaySample(
@@ -145,6 +157,7 @@ class TrajectoryDataset(tf.data.Dataset):
     self._max_samples_per_stream = max_samples_per_stream
     self._rate_limiter_timeout_ms = rate_limiter_timeout_ms
     self._flexible_batch_size = flexible_batch_size
+    self._batch_size = batch_size
 
     if _is_tf1_runtime():
       # Disabling to avoid errors given the different tf.data.Dataset init args
@@ -165,7 +178,8 @@ class TrajectoryDataset(tf.data.Dataset):
                            max_samples_per_stream: int = -1,
                            rate_limiter_timeout_ms: int = -1,
                            get_signature_timeout_secs: Optional[int] = None,
-                           flexible_batch_size: int = -1):
+                           flexible_batch_size: int = -1,
+                           batch_size: Optional[int] = None):
     """Constructs a TrajectoryDataset using the table's signature to infer specs.
 
     Note: The target `Table` must specify a signature which represent the entire
@@ -183,6 +197,7 @@ class TrajectoryDataset(tf.data.Dataset):
         respond when fetching the table signature. By default no timeout is set
         and the call will block indefinitely if the server does not respond.
       flexible_batch_size: See __init__ for details.
+      batch_size: See __init__ for details.
 
     Returns:
       TrajectoryDataset using the specs defined by the table signature to build
@@ -218,7 +233,8 @@ class TrajectoryDataset(tf.data.Dataset):
         num_workers_per_iterator=num_workers_per_iterator,
         max_samples_per_stream=max_samples_per_stream,
         rate_limiter_timeout_ms=rate_limiter_timeout_ms,
-        flexible_batch_size=flexible_batch_size)
+        flexible_batch_size=flexible_batch_size,
+        batch_size=batch_size)
 
   def _as_variant_tensor(self):
     return gen_trajectory_dataset_op.reverb_trajectory_dataset(
@@ -230,14 +246,19 @@ class TrajectoryDataset(tf.data.Dataset):
         num_workers_per_iterator=self._num_workers_per_iterator,
         max_samples_per_stream=self._max_samples_per_stream,
         rate_limiter_timeout_ms=self._rate_limiter_timeout_ms,
-        flexible_batch_size=self._flexible_batch_size)
+        flexible_batch_size=self._flexible_batch_size,
+        batch_size=self._batch_size or 0)
 
   def _inputs(self) -> List[Any]:
     return []
 
   @property
   def element_spec(self) -> Any:
-    return tree.map_structure(tf.TensorSpec, self._shapes, self._dtypes)
+    shapes = self._shapes
+    if self._batch_size is not None:
+      shapes = tree.map_structure(
+          lambda s: tf.TensorShape([self._batch_size]).concatenate(s), shapes)
+    return tree.map_structure(tf.TensorSpec, shapes, self._dtypes)
 
 
 def _convert_lists_to_tuples(structure: Any) -> Any:
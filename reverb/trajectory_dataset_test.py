@@ -150,6 +150,15 @@ class TrajectoryDatasetTest(tf.test.TestCase, parameterized.TestCase):
           'flexible_batch_size': 0,
           'want_error': ValueError,
       },
+      {
+          'testcase_name': 'batch_size_is_1',
+          'batch_size': 1,
+      },
+      {
+          'testcase_name': 'batch_size_is_0',
+          'batch_size': 0,
+          'want_error': ValueError,
+      },
   )
   def test_sampler_parameter_validation(self, **kwargs):
     if 'max_in_flight_samples_per_worker' not in kwargs:
@@ -194,6 +203,27 @@ class TrajectoryDatasetTest(tf.test.TestCase, parameterized.TestCase):
             ),
             data=SHAPES))
 
+  def test_sample_batched_fixed_length_trajectories(self):
+    self._populate_replay()
+
+    dataset = trajectory_dataset.TrajectoryDataset(
+        tf.constant(self._client.server_address),
+        table=tf.constant(TABLE),
+        dtypes=DTYPES,
+        shapes=SHAPES,
+        max_in_flight_samples_per_worker=4,
+        flexible_batch_size=1,
+        batch_size=4)
+
+    self.assertEqual(dataset.element_spec.info.key.shape, [4])
+    self.assertEqual(dataset.element_spec.data['observation'].shape,
+                     [4, 1, 3, 3])
+
+    sample = self._sample_from(dataset, 1)[0]
+    self.assertEqual(sample.info.key.shape, (4,))
+    self.assertEqual(sample.data['observation'].shape, (4, 1, 3, 3))
+    np.testing.assert_array_equal(sample.data['reward'], [3, 3, 3, 3])
+
   def test_sample_variable_length_trajectory(self):
     with trajectory_writer.TrajectoryWriter(self._client, 2, 10) as writer:
       for i in range(10):